@@ -159,6 +159,41 @@ static inline void bs_write32( bs_t *s, uint32_t i_bits )
     bs_write( s, 16, i_bits );
 }
 
+/* Copies len bytes into the bitstream. A byte-aligned bitstream is flushed and the bytes copied
+ * straight into the buffer, otherwise they go through the cache four at a time */
+static inline void bs_write_bytes( bs_t *s, const uint8_t *data, int len )
+{
+    if( !(s->i_left&7) )
+    {
+        bs_flush( s );
+        memcpy( s->p, data, len );
+        s->p += len;
+        bs_realign( s );
+        return;
+    }
+
+    for( ; len >= 4; len -= 4, data += 4 )
+    {
+        uint32_t word;
+        memcpy( &word, data, 4 );
+        bs_write32( s, endian_fix32( word ) );
+    }
+    for( ; len > 0; len--, data++ )
+        bs_write( s, 8, *data );
+}
+
+/* Unaligned big-endian stores for patching fields in a precomputed header */
+static inline void bs_put_be16( uint8_t *p, uint16_t x )
+{
+    x = endian_fix16( x );
+    memcpy( p, &x, 2 );
+}
+static inline void bs_put_be32( uint8_t *p, uint32_t x )
+{
+    x = endian_fix32( x );
+    memcpy( p, &x, 4 );
+}
+
 static inline void bs_write1( bs_t *s, uint32_t i_bit )
 {
     s->cur_bits <<= 1;
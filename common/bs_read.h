@@ -24,6 +24,8 @@
 #ifndef OBE_BS_READ_H
 #define OBE_BS_READ_H
 
+#include "common/bitstream.h"
+
 /**
  * \file
  * This file defines functions, structures for handling streams of bits in vlc
@@ -72,6 +74,20 @@ static inline uint32_t bs_read( bs_read_t *s, int i_count )
     int      i_shr;
     uint32_t i_result = 0;
 
+    /* Away from the end of the buffer the field is cut straight out of a 64-bit load */
+    if( i_count > 0 && i_count <= 32 && s->p + 8 <= s->p_end )
+    {
+        uint64_t cache;
+        int pos = 8 - s->i_left + i_count;
+
+        memcpy( &cache, s->p, 8 );
+        cache = endian_fix64( cache );
+        i_result = ( cache << ( 8 - s->i_left ) ) >> ( 64 - i_count );
+        s->p += pos >> 3;
+        s->i_left = 8 - ( pos & 7 );
+        return i_result;
+    }
+
     while( i_count > 0 )
     {
         if( s->p >= s->p_end )
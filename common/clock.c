@@ -0,0 +1,173 @@
+/*****************************************************************************
+ * clock.c: input clock recovery
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include <limits.h>
+
+/* A phase error larger than this is a discontinuity in the input, not drift */
+#define CLOCK_MAX_ERROR (OBE_CLOCK / 10)
+/* Crystals are well within this, anything larger is a bad source */
+#define CLOCK_MAX_DRIFT 0.001
+
+/* Loop gains, all with a damping factor of 0.7. They narrow as the loop settles so the
+ * drift is found within a few seconds of the first tick and the jitter is then filtered
+ * with a time constant of around a minute of frames */
+static const struct
+{
+    int num_ticks;
+    double kp;
+    double ki;
+} loop_gains[] =
+{
+    { 32,      0.25,     0.03125 },
+    { 256,     0.0625,   0.001953125 },
+    { INT_MAX, 0.015625, 0.0001220703125 },
+};
+
+void obe_clock_init( obe_clock_t *clock )
+{
+    memset( clock, 0, sizeof(*clock) );
+    pthread_mutex_init( &clock->tick_mutex, NULL );
+}
+
+void obe_clock_destroy( obe_clock_t *clock )
+{
+    pthread_mutex_destroy( &clock->tick_mutex );
+}
+
+static void publish_model( obe_clock_t *clock, int64_t ref_input, int64_t ref_wall, int64_t drift_ppb )
+{
+    unsigned int seq = clock->seq;
+
+    __atomic_store_n( &clock->seq, seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    __atomic_store_n( &clock->ref_input, ref_input, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->ref_wall, ref_wall, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->drift_ppb, drift_ppb, __ATOMIC_RELAXED );
+    __atomic_store_n( &clock->seq, seq + 2, __ATOMIC_RELEASE );
+}
+
+static void read_model( obe_clock_t *clock, int64_t *ref_input, int64_t *ref_wall, double *drift )
+{
+    unsigned int seq;
+    int64_t drift_ppb;
+
+    do
+    {
+        seq = __atomic_load_n( &clock->seq, __ATOMIC_ACQUIRE );
+        *ref_input = __atomic_load_n( &clock->ref_input, __ATOMIC_RELAXED );
+        *ref_wall = __atomic_load_n( &clock->ref_wall, __ATOMIC_RELAXED );
+        drift_ppb = __atomic_load_n( &clock->drift_ppb, __ATOMIC_RELAXED );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    } while( ( seq & 1 ) || seq != __atomic_load_n( &clock->seq, __ATOMIC_RELAXED ) );
+
+    *drift = drift_ppb * 1e-9;
+}
+
+static int64_t model_input_time( int64_t ref_input, int64_t ref_wall, double drift, int64_t wallclock )
+{
+    int64_t delta = wallclock - ref_wall;
+    return ref_input + delta + (int64_t)( delta * drift );
+}
+
+void obe_clock_tick( obe_t *h, int64_t value )
+{
+    obe_clock_t *clock = &h->clock;
+    int64_t wallclock = get_wallclock_in_mpeg_ticks();
+    int64_t ref_input, ref_wall, predicted, error;
+    double drift, kp, ki;
+
+    /* There's normally only one clock source but nothing stops two inputs ticking */
+    pthread_mutex_lock( &clock->tick_mutex );
+
+    read_model( clock, &ref_input, &ref_wall, &drift );
+    predicted = model_input_time( ref_input, ref_wall, clock->drift, wallclock );
+    error = value - predicted;
+
+    if( !clock->num_ticks || error > CLOCK_MAX_ERROR || error < -CLOCK_MAX_ERROR || wallclock <= ref_wall )
+    {
+        /* Keep the drift across a discontinuity since the crystals haven't changed */
+        if( clock->num_ticks )
+        {
+            syslog( LOG_WARNING, "Input clock jumped by %"PRIi64" ticks, resyncing\n", error );
+            __atomic_store_n( &clock->num_resyncs, clock->num_resyncs + 1, __ATOMIC_RELAXED );
+        }
+        clock->num_ticks = 1;
+        clock->jitter = 0;
+        publish_model( clock, value, wallclock, (int64_t)( clock->drift * 1e9 ) );
+        pthread_mutex_unlock( &clock->tick_mutex );
+        return;
+    }
+
+    for( int i = 0; ; i++ )
+    {
+        if( clock->num_ticks < loop_gains[i].num_ticks )
+        {
+            kp = loop_gains[i].kp;
+            ki = loop_gains[i].ki;
+            break;
+        }
+    }
+    if( clock->num_ticks < INT_MAX )
+        clock->num_ticks++;
+
+    /* The phase error over the interval is mostly the drift so the integrator fixes it */
+    clock->drift += ki * error / ( wallclock - ref_wall );
+    if( clock->drift > CLOCK_MAX_DRIFT )
+        clock->drift = CLOCK_MAX_DRIFT;
+    else if( clock->drift < -CLOCK_MAX_DRIFT )
+        clock->drift = -CLOCK_MAX_DRIFT;
+
+    clock->jitter += ( llabs( error ) - clock->jitter ) / 16;
+    __atomic_store_n( &clock->jitter_ticks, (int64_t)clock->jitter, __ATOMIC_RELAXED );
+
+    publish_model( clock, predicted + (int64_t)( kp * error ), wallclock, (int64_t)( clock->drift * 1e9 ) );
+
+    pthread_mutex_unlock( &clock->tick_mutex );
+}
+
+int64_t get_input_clock_in_mpeg_ticks( obe_t *h )
+{
+    int64_t ref_input, ref_wall;
+    double drift;
+
+    read_model( &h->clock, &ref_input, &ref_wall, &drift );
+
+    return model_input_time( ref_input, ref_wall, drift, get_wallclock_in_mpeg_ticks() );
+}
+
+/* Converts a time on the input clock to CLOCK_MONOTONIC, both in 27MHz ticks */
+int64_t input_clock_to_wallclock( obe_t *h, int64_t i_time )
+{
+    int64_t ref_input, ref_wall;
+    double drift;
+
+    read_model( &h->clock, &ref_input, &ref_wall, &drift );
+
+    return ref_wall + (int64_t)( ( i_time - ref_input ) / ( 1 + drift ) );
+}
+
+void sleep_input_clock( obe_t *h, int64_t i_time )
+{
+    sleep_mpeg_ticks( input_clock_to_wallclock( h, i_time ) );
+}
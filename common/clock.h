@@ -0,0 +1,52 @@
+/*****************************************************************************
+ * clock.h: input clock recovery
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_CLOCK_H
+#define OBE_CLOCK_H
+
+/* The input clock is modelled as input = ref_input + ( wall - ref_wall ) * ( 1 + drift ).
+ * Each tick from the clock source input is the phase detector of a PLL that corrects the
+ * reference and the drift, so readers see a continuous clock instead of steps at every tick */
+typedef struct
+{
+    /* Published model. Written under the seqlock so readers never take a lock */
+    unsigned int seq;
+    int64_t ref_input;
+    int64_t ref_wall;
+    int64_t drift_ppb;
+
+    /* Loop state, only touched with tick_mutex held */
+    pthread_mutex_t tick_mutex;
+    int num_ticks;
+    double drift;
+    double jitter;
+
+    /* Monitoring */
+    int64_t jitter_ticks;
+    int64_t num_resyncs;
+} obe_clock_t;
+
+void obe_clock_init( obe_clock_t *clock );
+void obe_clock_destroy( obe_clock_t *clock );
+
+#endif
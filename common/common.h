@@ -28,6 +28,7 @@
 
 #include <libavutil/pixfmt.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/cpu.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,9 +43,19 @@
 #include <sys/time.h>
 #include <time.h>
 #include "obe.h"
+#include "common/queue.h"
+#include "common/pool.h"
+#include "common/clock.h"
+#include "common/numa.h"
+#include "common/trace.h"
 
-#define MAX_DEVICES 1
+#define MAX_DEVICES 8
 #define MAX_STREAMS 40
+#define MAX_OUTPUTS 8
+
+/* Channels an audio encoder can take and channels an SDI input can capture */
+#define OBE_MAX_CHANNELS 8
+#define OBE_MAX_SDI_CHANNELS 16
 
 #define MAX_PROBE_TIME 20
 
@@ -73,6 +84,11 @@
 /* Network output */
 #define TS_PACKETS_SIZE 1316
 
+/* Queue sizing, in seconds of the fastest stream */
+#define OBE_QUEUE_SECONDS_GENERIC     4
+#define OBE_QUEUE_SECONDS_LOW_LATENCY 1
+#define OBE_QUEUE_MAX_FRAME_RATE      64 /* no audio or video stream delivers more frames per second than this */
+
 /* Audio sample patterns */
 #define MAX_AUDIO_SAMPLE_PATTERN 5
 
@@ -127,6 +143,9 @@ typedef struct
     int sar_den;
     int interlaced;
     int tff;
+    /* Compressed video, for passthrough */
+    int profile;
+    int level;
 
     /* Per-frame Data */
     int num_frame_data;
@@ -142,6 +161,9 @@ typedef struct
     /* Compressed Audio */
     int bitrate;
 
+    /* Bursts carried in PCM */
+    int is_337m;
+
     /* AAC */
     int aac_profile_and_level;
     int aac_type;
@@ -164,6 +186,9 @@ typedef struct
 
     /** Misc **/
     int source;
+
+    /* Loaded from a probe cache and not checked against a captured frame yet */
+    int probe_cache_check;
 } obe_int_input_stream_t;
 
 typedef struct
@@ -190,6 +215,26 @@ typedef struct
     obe_output_stream_t *output_streams;
 
     obe_input_stream_t *probed_streams;
+
+    /* Node the card is attached to, -1 if unknown. Capture, filter and video encoder threads run there */
+    int numa_node;
+
+    /* Video frame pools, one per format. Sized at obe_start */
+    pthread_mutex_t frame_pool_mutex;
+    int frame_pool_size;
+    int num_frame_pools;
+    obe_frame_pool_t *frame_pools[OBE_MAX_FRAME_POOLS];
+    int frame_pool_wait; /* wait for a free buffer rather than drop the frame */
+
+    /* Monitoring, only written by the input thread */
+    int64_t last_frame_time;
+    int64_t num_signal_losses;
+
+    /* Failover (input/failover.c), written with the failover mutex held when there is a backup */
+    int is_backup;
+    int has_signal;
+    int needs_resync;
+    int64_t pts_offset; /* moves the timestamps of the device onto the output timeline */
 } obe_device_t;
 
 typedef struct
@@ -297,6 +342,23 @@ typedef struct
     int drop_frame;
 } obe_timecode_t;
 
+/* Per-frame arena
+ * User-data, SEI and other small allocations which live exactly as long as a frame are bumped
+ * out of blocks owned by the frame and all go away with it. Only the thread holding the frame
+ * allocates from its arena. Encoders which keep SEI past the frame take a reference */
+#define OBE_ARENA_BLOCK_SIZE 4096
+
+typedef struct obe_arena_t obe_arena_t;
+struct obe_arena_t
+{
+    int refcount;
+    obe_arena_t *cur;  /* block being allocated from, only set on the first block */
+    obe_arena_t *next;
+    int size;
+    int pos;
+    uint8_t data[] __attribute__((aligned(16)));
+};
+
 typedef struct
 {
     int stream_id;
@@ -313,6 +375,7 @@ typedef struct
      * For most devices these are the same. */
     obe_image_t alloc_img;
     obe_image_t img;
+    obe_frame_buf_t *frame_buf; /* set if alloc_img comes from a frame pool */
     int sar_width;
     int sar_height;
     int sar_guess; /* This is set if the SAR cannot be determined from any WSS/AFD that might exist in the stream */
@@ -322,7 +385,9 @@ typedef struct
 
     /* Ancillary / User-data */
     int num_user_data;
-    obe_user_data_t *user_data;
+    int max_user_data;
+    obe_user_data_t *user_data; /* entries and their data are in the arena */
+    obe_arena_t *arena;
 
     /* Non-video */
     int len;
@@ -337,12 +402,28 @@ typedef struct
     int num_samples;
     int sample_fmt;
     int64_t channel_layout;
-    // TODO channel order
+    /* Planar audio from the channel router. The planes are in SMPTE order (L R C LFE Ls Rs)
+     * and point into audio_buf, which every encoder fed from the same capture shares */
+    int num_channels;
+    uint8_t *audio_plane[OBE_MAX_CHANNELS];
+    obe_buf_t *audio_buf;
     // TODO audio metadata
 
     int reset_obe;
 } obe_raw_frame_t;
 
+/* Log-linear latency histogram in microseconds. The first 8 buckets are 1us wide,
+ * after that every power of two is split into 8 buckets.
+ * Each histogram has a single writer so updates are plain relaxed stores and
+ * obe_get_stats can read it from another thread without a lock */
+#define OBE_LATENCY_BUCKETS 256
+
+typedef struct
+{
+    int64_t max;
+    int64_t buckets[OBE_LATENCY_BUCKETS];
+} obe_latency_hist_t;
+
 typedef struct
 {
     int num_stream_ids;
@@ -353,10 +434,20 @@ typedef struct
     pthread_cond_t  filter_cv;
     int cancel_thread;
 
-    int num_raw_frames;
-    obe_raw_frame_t **frames;
+    obe_queue_t queue;
+
+    obe_latency_hist_t latency;
 } obe_filter_t;
 
+/* Load shedding of a video encoder which can't keep up. Each level includes the ones before it */
+enum obe_shed_level_e
+{
+    SHED_NONE,
+    SHED_FILTER, /* cheaper scaling of renditions */
+    SHED_PRESET, /* x264 moves to faster presets sooner than speedcontrol alone would */
+    SHED_DROP,   /* frames are dropped before they reach the encoder */
+};
+
 typedef struct
 {
     int stream_id;
@@ -369,12 +460,26 @@ typedef struct
     int cancel_thread;
 
     hnd_t encoder_params;
+    hnd_t pool_task; /* set if the encoder runs on the audio pool */
 
-    int num_raw_frames;
-    obe_raw_frame_t **frames;
+    obe_queue_t queue;
+
+    obe_latency_hist_t latency;
+    int speedcontrol_fill; /* tenths of a percent */
+
+    /* Load shedding, written by the filter feeding this encoder */
+    int shed_level;
+    int64_t num_shed_frames;
 
     /* E-AC3 */
     int num_samples;
+
+    /* Rate control and speedcontrol changes from obe_update_stream, taken up at the start of the next GOP */
+    int update_pending;
+    int update_bitrate;
+    int update_vbv_maxrate;
+    int update_max_preset;
+    float update_speed;
 } obe_encoder_t;
 
 typedef struct
@@ -395,6 +500,9 @@ typedef struct
 
     int len;
     uint8_t *data;
+
+    /* Pooled frames live inside this buffer, header included */
+    obe_buf_t *buf;
 } obe_coded_frame_t;
 
 typedef struct
@@ -402,6 +510,12 @@ typedef struct
     int len;
     uint8_t *data;
     uint8_t *cur_pos;
+    obe_buf_t *buf;
+
+    /* Capture time of the oldest video frame in this data */
+    int64_t arrival_time;
+    /* Input clock when the mux handed it to the outputs */
+    int64_t queued_time;
 
     /* MPEG-TS */
     int64_t *pcr_list;
@@ -410,29 +524,69 @@ typedef struct
 
 typedef struct
 {
+    pthread_t output_thread;
     pthread_mutex_t output_mutex;
     pthread_cond_t  output_cv;
-    int num_muxed_data;
-    obe_muxed_data_t **muxed_data;
+    obe_queue_t queue;
+    int cancel_thread; /* the thread sends what is queued, then returns */
+
+    obe_latency_hist_t latency;
+    int64_t bytes_sent;
 } obe_output_t;
 
+typedef struct
+{
+    int stream_id;
+    int base_rate;     /* kbit/s the encoder was configured with */
+    int rate;          /* kbit/s it has been given */
+    double fps;
+    double complexity; /* running average of bits * qscale per frame */
+} obe_statmux_entry_t;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int num_entries;
+    obe_statmux_entry_t entries[MAX_STREAMS];
+} obe_statmux_t;
+
+/* Hot standby input failover, see input/input.h */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    obe_device_t *primary;
+    obe_device_t *backup;  /* NULL without failover */
+    obe_device_t *active;  /* NULL while the slate is sent */
+
+    int64_t frame_duration; /* 27MHz */
+    int64_t last_pts;       /* of the last picture sent on the output timeline, -1 before the first */
+    int64_t num_switches;
+
+    pthread_t slate_thread;
+    int cancel_slate_thread;
+    hnd_t slate;
+} obe_failover_t;
+
 struct obe_t
 {
     int is_active;
+    int is_standby; /* obe_stop has stopped the inputs and nothing else */
     int obe_system;
 
     /* OBE recovered clock */
-    pthread_mutex_t obe_clock_mutex;
-    pthread_cond_t  obe_clock_cv;
+    obe_clock_t clock;
 
     /* Devices */
     pthread_mutex_t device_list_mutex;
     int num_devices;
     obe_device_t *devices[MAX_DEVICES];
     int cur_stream_id;
+    int audio_samples; /* samples per audio frame the inputs are started with */
+    int probe_cache_pending; /* number of streams with probe_cache_check set */
 
     /* Frame drop flags
-     * TODO: make this work for multiple inputs and outputs */
+     * output_drop is a count so that every output can notice each drop by itself
+     * TODO: make this work for multiple inputs */
     pthread_mutex_t drop_mutex;
     int encoder_drop;
     int output_drop;
@@ -450,9 +604,10 @@ struct obe_t
     int cancel_mux_thread;
     obe_mux_opts_t mux_opts;
 
-    /* Output */
-    pthread_t output_thread;
+    /* Outputs */
     obe_output_opts_t output_opts;
+    int num_outputs;
+    obe_output_t *outputs[MAX_OUTPUTS];
 
     /* Filtering */
     int num_filters;
@@ -461,68 +616,120 @@ struct obe_t
     /* Input or Postfiltered frames for encoding */
     int num_encoders;
     obe_encoder_t *encoders[MAX_STREAMS];
+    hnd_t audio_pool; /* audio encoders run on this rather than encoder_thread */
+
+    /* Coded and muxed data buffers */
+    obe_buf_pool_t buf_pool;
+
+    /* Statistical multiplexing of the video encoders */
+    obe_statmux_t statmux;
+
+    /* Hot standby input */
+    obe_failover_t failover;
 
     /* Encoded video frames in smoothing buffer */
     pthread_mutex_t smoothing_mutex;
     pthread_cond_t  smoothing_in_cv;
     pthread_cond_t  smoothing_out_cv;
 
-    int64_t         smoothing_last_pts; /* from sdi clock */
-    int64_t         smoothing_last_wallclock; /* from cpu clock */
-
-    int num_smoothing_frames;
-    obe_coded_frame_t **smoothing_frames;
+    obe_queue_t smoothing_queue;
 
     int             smoothing_buffer_complete;
     int64_t         smoothing_last_exit_time;
 
-    /* Encoded frames for muxing */
+    /* A frame's deadline is smoothing_start_time + ( real_dts - smoothing_start_dts ) on the input clock */
+    int64_t         smoothing_start_dts;
+    int64_t         smoothing_start_time;
+
+    /* Encoded frames for muxing
+     * There is one queue for each output stream, in the same order as output_streams.
+     * Every stream's frames arrive in DTS order so the oldest is always at the front */
     pthread_mutex_t mux_mutex;
     pthread_cond_t  mux_cv;
-    int num_coded_frames;
-    obe_coded_frame_t **coded_frames;
+    obe_queue_t     *mux_queues;
 
-    /* Muxed frames for transmission */
-    pthread_mutex_t output_mutex;
-    pthread_cond_t  output_cv;
-    int num_muxed_data;
-    obe_muxed_data_t **muxed_data;
+    /* Bumped by obe_update_stream once it has changed the ts_opts of output_streams. The mux only
+     * takes the changes up when it writes the PMT itself, which it says with can_update_psi */
+    int stream_update;
+    int can_update_psi;
+
+    /* Statistics and Monitoring
+     * The other stages keep their histograms in their own filter, encoder or output */
+    obe_latency_hist_t smoothing_latency;
+    obe_latency_hist_t mux_latency;
 
-    /* Statistics and Monitoring */
+    /* SNMP */
+    obe_snmp_opts_t snmp_opts;
+    pthread_t monitor_thread;
+    int cancel_monitor_thread;
 
+    /* Shared memory tap (common/tap.c), NULL when off */
+    obe_tap_opts_t tap_opts;
+    hnd_t tap;
+
+    /* Thread placement */
+    obe_thread_opts_t thread_opts[OBE_NUM_THREAD_STAGES];
 
 };
 
 int64_t obe_mdate( void );
 
+/* Older libavutil can't detect AVX2 so obe_get_cpu_flags adds it */
+#ifndef AV_CPU_FLAG_AVX2
+#define AV_CPU_FLAG_AVX2 0x8000
+#endif
+/* Not a libavutil flag at all */
+#define OBE_CPU_FLAG_PCLMUL 0x40000000
+int obe_get_cpu_flags( void );
+
+/* Records the time from capture until now. Only the thread owning the histogram may call this */
+void obe_latency_record( obe_latency_hist_t *hist, int64_t arrival_time );
+
+/* Called by the input thread for every video frame. lost is set if frames were missed before this one */
+void obe_input_frame_arrived( obe_device_t *device, int64_t frame_time, int lost );
+
 obe_device_t *new_device( void );
 void destroy_device( obe_device_t *device );
 obe_raw_frame_t *new_raw_frame( void );
 void destroy_raw_frame( obe_raw_frame_t *raw_frame );
 obe_coded_frame_t *new_coded_frame( int stream_id, int len );
+obe_coded_frame_t *new_pooled_coded_frame( obe_t *h, int stream_id, int len );
 void destroy_coded_frame( obe_coded_frame_t *coded_frame );
 void obe_release_video_data( void *ptr );
+void obe_release_pooled_video_data( void *ptr );
 void obe_release_other_data( void *ptr );
+void obe_release_audio_data( void *ptr );
 void obe_release_frame( void *ptr );
 
-obe_muxed_data_t *new_muxed_data( int len );
+/* Returns 16-byte aligned memory that lasts as long as the frame's arena */
+void *obe_frame_alloc( obe_raw_frame_t *raw_frame, int size );
+/* Appends num zeroed user-data entries and returns the first */
+obe_user_data_t *obe_frame_add_user_data( obe_raw_frame_t *raw_frame, int num );
+void obe_arena_ref( obe_arena_t *arena );
+void obe_arena_unref( obe_arena_t *arena );
+
+obe_muxed_data_t *new_pooled_muxed_data( obe_t *h, int len );
 void destroy_muxed_data( obe_muxed_data_t *muxed_data );
 
 void add_device( obe_t *h, obe_device_t *device );
+obe_frame_buf_t *get_pooled_image( obe_device_t *device, obe_image_t *img, int alloc_height );
 
 int add_to_filter_queue( obe_t *h, obe_raw_frame_t *raw_frame );
+obe_raw_frame_t *get_frame_from_filter_queue( obe_filter_t *filter );
 int remove_frame_from_filter_queue( obe_filter_t *filter );
 int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame );
+obe_raw_frame_t *get_frame_from_encode_queue( obe_encoder_t *encoder );
 int remove_frame_from_encode_queue( obe_encoder_t *encoder );
 int add_to_smoothing_queue( obe_t *h, obe_coded_frame_t *coded_frame );
 int remove_from_smoothing_queue( obe_t *h );
 int add_to_mux_queue( obe_t *h, obe_coded_frame_t *coded_frame );
-int remove_from_mux_queue( obe_t *h, obe_coded_frame_t *coded_frame );
-int remove_early_frames( obe_t *h, int64_t pts );
+int add_frames_to_mux_queue( obe_t *h, obe_coded_frame_t **coded_frames, int num_frames );
+int remove_early_frames( obe_t *h, obe_device_t *device, int64_t pts );
 int add_to_output_queue( obe_t *h, obe_muxed_data_t *muxed_data );
-int remove_from_output_queue( obe_t *h );
+int remove_from_output_queue( obe_output_t *output );
 
 obe_int_input_stream_t *get_input_stream( obe_t *h, int input_stream_id );
+obe_device_t *get_input_device( obe_t *h, int input_stream_id );
 obe_encoder_t *get_encoder( obe_t *h, int stream_id );
 obe_output_stream_t *get_output_stream( obe_t *h, int stream_id );
 
@@ -530,6 +737,7 @@ int64_t get_wallclock_in_mpeg_ticks( void );
 void sleep_mpeg_ticks( int64_t i_delay );
 void obe_clock_tick( obe_t *h, int64_t value );
 int64_t get_input_clock_in_mpeg_ticks( obe_t *h );
+int64_t input_clock_to_wallclock( obe_t *h, int64_t i_time );
 void sleep_input_clock( obe_t *h, int64_t i_delay );
 
 int get_non_display_location( int type );
@@ -0,0 +1,75 @@
+/*****************************************************************************
+ * crc.c: MPEG-2 CRC32
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/crc.h"
+#include "common/x86/crc.h"
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc32_table( void )
+{
+    for( int i = 0; i < 256; i++ )
+    {
+        uint32_t c = (uint32_t)i << 24;
+        for( int j = 0; j < 8; j++ )
+            c = (c << 1) ^ ((c & 0x80000000) ? 0x04c11db7 : 0);
+        crc32_table[i] = c;
+    }
+}
+
+uint32_t obe_crc32_mpeg_c( uint32_t crc, const uint8_t *buf, int len )
+{
+    for( int i = 0; i < len; i++ )
+        crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ buf[i]];
+
+    return crc;
+}
+
+void obe_crc_init( obe_crc_t *crc )
+{
+    int cpu_flags = obe_get_cpu_flags();
+
+    pthread_once( &crc32_table_once, init_crc32_table );
+
+    crc->crc32 = obe_crc32_mpeg_c;
+    crc->crc32_step = 1;
+
+    if( (cpu_flags & (AV_CPU_FLAG_SSSE3|OBE_CPU_FLAG_PCLMUL)) == (AV_CPU_FLAG_SSSE3|OBE_CPU_FLAG_PCLMUL) )
+    {
+        crc->crc32 = obe_crc32_mpeg_pclmul;
+        crc->crc32_step = 16;
+    }
+}
+
+uint32_t obe_crc32_mpeg( const obe_crc_t *crc, const uint8_t *buf, int len )
+{
+    int len_simd = len - (len % crc->crc32_step);
+    uint32_t ret = 0xffffffff;
+
+    if( len_simd )
+        ret = crc->crc32( ret, buf, len_simd );
+
+    return obe_crc32_mpeg_c( ret, buf + len_simd, len - len_simd );
+}
@@ -0,0 +1,44 @@
+/*****************************************************************************
+ * crc.h: MPEG-2 CRC32
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_CRC_H
+#define OBE_CRC_H
+
+/* The CRC32 of ISO/IEC 13818-1 Annex A used by PSI/SI sections: polynomial 0x04c11db7,
+ * computed MSB first with no reflection and no final xor */
+typedef uint32_t (*obe_crc32_func_t)( uint32_t crc, const uint8_t *buf, int len );
+
+/* The SIMD version does whole steps and obe_crc32_mpeg finishes the rest in C */
+typedef struct
+{
+    obe_crc32_func_t crc32;
+    int crc32_step;
+} obe_crc_t;
+
+void obe_crc_init( obe_crc_t *crc );
+/* CRC of a whole section, starting from 0xffffffff */
+uint32_t obe_crc32_mpeg( const obe_crc_t *crc, const uint8_t *buf, int len );
+
+uint32_t obe_crc32_mpeg_c( uint32_t crc, const uint8_t *buf, int len );
+
+#endif
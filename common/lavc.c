@@ -26,6 +26,7 @@
 
 int obe_get_buffer( AVCodecContext *codec, AVFrame *pic )
 {
+    obe_device_t *device = codec->opaque;
     int w = codec->width;
     int h = codec->height;
     int stride[4];
@@ -34,8 +35,28 @@ int obe_get_buffer( AVCodecContext *codec, AVFrame *pic )
 
     /* Only EDGE_EMU codecs are used
      * Allocate an extra line so that SIMD can modify the entire stride for every active line */
-    if( av_image_alloc( pic->data, pic->linesize, w, h + 1, codec->pix_fmt, 32 ) < 0 )
-        return -1;
+    if( device )
+    {
+        /* The buffer reference is handed over to the raw frame through pic->opaque */
+        obe_image_t img = {0};
+        img.csp = codec->pix_fmt;
+        img.width = w;
+        img.height = h;
+
+        obe_frame_buf_t *buf = get_pooled_image( device, &img, h + 1 );
+        if( !buf )
+            return -1;
+
+        memcpy( pic->data, img.plane, sizeof(img.plane) );
+        memcpy( pic->linesize, img.stride, sizeof(img.stride) );
+        pic->opaque = buf;
+    }
+    else
+    {
+        if( av_image_alloc( pic->data, pic->linesize, w, h + 1, codec->pix_fmt, 32 ) < 0 )
+            return -1;
+        pic->opaque = NULL;
+    }
 
     pic->type   = FF_BUFFER_TYPE_USER;
     pic->reordered_opaque = codec->reordered_opaque;
@@ -113,6 +113,8 @@
 
 #define ASI_IOC_GETID		_IOR(ASI_IOC_MAGIC, 129, unsigned int)
 #define ASI_IOC_GETVERSION	_IOR(ASI_IOC_MAGIC, 130, unsigned int)
+#define ASI_IOC_QBUF		_IO(ASI_IOC_MAGIC, 131)
+#define ASI_IOC_DQBUF		_IO(ASI_IOC_MAGIC, 132)
 
 /* Transmitter event flag bit locations */
 #define ASI_EVENT_TX_BUFFER_ORDER	0
@@ -22,11 +22,48 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE /* sendmmsg */
+
 #include "common/common.h"
 #include "common/network/network.h"
 #include "output/output.h"
 #include "udp.h"
 
+/* Not every libc exposes these yet */
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+
+/* SO_TXTIME modes. fq accepts CLOCK_MONOTONIC launch times, the ETF qdisc needs CLOCK_TAI */
+#define UDP_TXTIME_FQ  1
+#define UDP_TXTIME_ETF 2
+
+/* Keeps a GSO super-packet of 1316-byte datagrams under the 64 KiB UDP limit */
+#define UDP_MAX_GSO_SEGMENTS 32
+
+/* struct sock_txtime from linux/net_tstamp.h */
+typedef struct
+{
+    int32_t clockid;
+    uint32_t flags;
+} obe_sock_txtime;
+
+typedef union
+{
+    char buf[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} obe_udp_control;
+
 typedef struct
 {
     int udp_fd;
@@ -40,6 +77,13 @@ typedef struct
     int is_connected;
     int max_packet_size;
     int miface;
+
+    /* Batched sending */
+    int use_gso;
+    int use_txtime;
+    struct mmsghdr msgs[UDP_MAX_BATCH];
+    struct iovec iovs[UDP_MAX_BATCH];
+    obe_udp_control control[UDP_MAX_BATCH];
 } obe_udp_ctx;
 
 static int udp_set_multicast_opts( int sockfd, obe_udp_ctx *s )
@@ -191,6 +235,9 @@ static int udp_port( struct sockaddr_storage *addr, int addr_len )
  *         'localport=n' : set the local port
  *         'pkt_size=n'  : set max packet size
  *         'reuse=1'     : enable reusing the socket
+ *         'gso=1'       : coalesce batches with UDP_SEGMENT
+ *         'txtime=1'    : let the kernel launch batched packets with SO_TXTIME
+ *         'txtime=etf'  : as above, for an interface with the ETF qdisc
  *
  * @param h media file context
  * @param uri of the remote server
@@ -276,6 +323,17 @@ int udp_open( hnd_t *p_handle, char *uri )
 
         if( av_find_info_tag( buf, sizeof(buf), "miface", p ) )
             s->miface = if_nametoindex( buf );
+
+        if( av_find_info_tag( buf, sizeof(buf), "gso", p ) )
+            s->use_gso = strtol( buf, NULL, 10 );
+
+        if( av_find_info_tag( buf, sizeof(buf), "txtime", p ) )
+        {
+            if( !strcmp( buf, "etf" ) )
+                s->use_txtime = UDP_TXTIME_ETF;
+            else if( strtol( buf, NULL, 10 ) )
+                s->use_txtime = UDP_TXTIME_FQ;
+        }
     }
 
     /* fill the dest addr */
@@ -319,6 +377,27 @@ int udp_open( hnd_t *p_handle, char *uri )
     if( s->is_connected && connect( udp_fd, (struct sockaddr *)&s->dest_addr, s->dest_addr_len ) )
         goto fail;
 
+    /* Both of these need a recent kernel so carry on without them if they are missing */
+    if( s->use_gso )
+    {
+        tmp = 0;
+        if( setsockopt( udp_fd, SOL_UDP, UDP_SEGMENT, &tmp, sizeof(tmp) ) < 0 )
+        {
+            syslog( LOG_WARNING, "[udp] UDP GSO not supported, sending datagrams individually\n" );
+            s->use_gso = 0;
+        }
+    }
+
+    if( s->use_txtime )
+    {
+        obe_sock_txtime txtime = { .clockid = s->use_txtime == UDP_TXTIME_ETF ? CLOCK_TAI : CLOCK_MONOTONIC, .flags = 0 };
+        if( setsockopt( udp_fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime) ) < 0 )
+        {
+            syslog( LOG_WARNING, "[udp] SO_TXTIME not supported, batches will be sent immediately\n" );
+            s->use_txtime = 0;
+        }
+    }
+
     s->udp_fd = udp_fd;
     *p_handle = s;
     return 0;
@@ -336,10 +415,12 @@ int udp_write( hnd_t handle, uint8_t *buf, int size )
     obe_udp_ctx *s = handle;
     int ret;
 
+    obe_trace_begin( "send", "udp" );
     if( !s->is_connected )
         ret = sendto( s->udp_fd, buf, size, 0, (struct sockaddr *)&s->dest_addr, s->dest_addr_len );
     else
         ret = send( s->udp_fd, buf, size, 0 );
+    obe_trace_end( "send", "udp" );
 
     if( ret < 0 )
     {
@@ -350,6 +431,127 @@ int udp_write( hnd_t handle, uint8_t *buf, int size )
     return size;
 }
 
+/* ETF works in CLOCK_TAI whereas launch times are given on CLOCK_MONOTONIC */
+static int64_t get_tai_offset( void )
+{
+    struct timespec mono, tai;
+
+    clock_gettime( CLOCK_MONOTONIC, &mono );
+    clock_gettime( CLOCK_TAI, &tai );
+
+    return (int64_t)(tai.tv_sec - mono.tv_sec) * 1000000000 + (tai.tv_nsec - mono.tv_nsec);
+}
+
+int udp_is_kernel_paced( hnd_t handle )
+{
+    obe_udp_ctx *s = handle;
+
+    return !!s->use_txtime;
+}
+
+/* Sends num_pkts datagrams with as few syscalls as possible.
+ * With txtime each datagram carries its own launch time. Otherwise the whole batch is
+ * due now, so runs of equal sized datagrams are merged into GSO super-packets. */
+int udp_write_batch( hnd_t handle, obe_udp_pkt_t *pkts, int num_pkts )
+{
+    obe_udp_ctx *s = handle;
+    int num_msgs = 0, sent = 0, ret;
+    int64_t clock_offset = s->use_txtime == UDP_TXTIME_ETF ? get_tai_offset() : 0;
+
+    for( int i = 0; i < num_pkts; )
+    {
+        struct mmsghdr *msg = &s->msgs[num_msgs];
+        struct cmsghdr *cmsg;
+        int num_segs = 1, controllen = 0;
+
+        if( s->use_gso && !s->use_txtime )
+        {
+            while( i + num_segs < num_pkts && num_segs < UDP_MAX_GSO_SEGMENTS && pkts[i+num_segs].size == pkts[i].size )
+                num_segs++;
+        }
+
+        memset( msg, 0, sizeof(*msg) );
+        for( int j = 0; j < num_segs; j++ )
+        {
+            s->iovs[i+j].iov_base = pkts[i+j].data;
+            s->iovs[i+j].iov_len = pkts[i+j].size;
+        }
+        msg->msg_hdr.msg_iov = &s->iovs[i];
+        msg->msg_hdr.msg_iovlen = num_segs;
+        if( !s->is_connected )
+        {
+            msg->msg_hdr.msg_name = &s->dest_addr;
+            msg->msg_hdr.msg_namelen = s->dest_addr_len;
+        }
+
+        msg->msg_hdr.msg_control = s->control[num_msgs].buf;
+        msg->msg_hdr.msg_controllen = sizeof(s->control[num_msgs].buf);
+        cmsg = CMSG_FIRSTHDR( &msg->msg_hdr );
+
+        if( s->use_txtime && pkts[i].tx_time )
+        {
+            uint64_t tx_time = pkts[i].tx_time + clock_offset;
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN( sizeof(tx_time) );
+            memcpy( CMSG_DATA( cmsg ), &tx_time, sizeof(tx_time) );
+            controllen += CMSG_SPACE( sizeof(tx_time) );
+            cmsg = CMSG_NXTHDR( &msg->msg_hdr, cmsg );
+        }
+
+        if( num_segs > 1 )
+        {
+            uint16_t gso_size = pkts[i].size;
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN( sizeof(gso_size) );
+            memcpy( CMSG_DATA( cmsg ), &gso_size, sizeof(gso_size) );
+            controllen += CMSG_SPACE( sizeof(gso_size) );
+        }
+
+        msg->msg_hdr.msg_controllen = controllen;
+        if( !controllen )
+            msg->msg_hdr.msg_control = NULL;
+
+        i += num_segs;
+        num_msgs++;
+    }
+
+    while( sent < num_msgs )
+    {
+        obe_trace_begin( "send", "udp" );
+        ret = sendmmsg( s->udp_fd, &s->msgs[sent], num_msgs - sent, 0 );
+        obe_trace_end( "send", "udp" );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            syslog( LOG_WARNING, "UDP packet failed to send\n" );
+            return -1;
+        }
+        sent += ret;
+    }
+
+    return num_pkts;
+}
+
+/* Never blocks. Returns 0 when nothing is waiting */
+int udp_read( hnd_t handle, uint8_t *buf, int size )
+{
+    obe_udp_ctx *s = handle;
+    int ret = recv( s->udp_fd, buf, size, MSG_DONTWAIT );
+
+    if( ret < 0 )
+    {
+        /* A connected socket reports an ICMP error from an earlier send here */
+        if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED )
+            return 0;
+        return -1;
+    }
+
+    return ret;
+}
+
 void udp_close( hnd_t handle )
 {
     obe_udp_ctx *s = handle;
@@ -24,8 +24,22 @@
 #ifndef OBE_COMMON_UDP_H
 #define OBE_COMMON_UDP_H
 
+/* Maximum number of datagrams handed to udp_write_batch in one call */
+#define UDP_MAX_BATCH 64
+
+typedef struct
+{
+    uint8_t *data;
+    int size;
+    /* CLOCK_MONOTONIC launch time in nanoseconds, only used with txtime=1. 0 sends immediately */
+    int64_t tx_time;
+} obe_udp_pkt_t;
+
 int udp_open( hnd_t *p_handle, char *target );
 int udp_write( hnd_t p_handle, uint8_t *buf, int size );
+int udp_write_batch( hnd_t p_handle, obe_udp_pkt_t *pkts, int num_pkts );
+int udp_is_kernel_paced( hnd_t p_handle );
+int udp_read( hnd_t p_handle, uint8_t *buf, int size );
 void udp_close( hnd_t handle );
 
 #endif /* OBE_COMMON_UDP_H */
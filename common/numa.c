@@ -0,0 +1,313 @@
+/*****************************************************************************
+ * numa.c: NUMA placement of per-device threads
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include "common/common.h"
+#include "common/numa.h"
+#include <sched.h>
+
+#define NUMA_NODE_CPULIST "/sys/devices/system/node/node%i/cpulist"
+
+int obe_numa_node_of_device( const char *sysfs_dir )
+{
+    char path[256];
+    FILE *fp;
+    int node = -1;
+
+    snprintf( path, sizeof(path), "%s/numa_node", sysfs_dir );
+    fp = fopen( path, "r" );
+    if( !fp )
+        return -1;
+
+    if( fscanf( fp, "%i", &node ) != 1 )
+        node = -1;
+    fclose( fp );
+
+    return node;
+}
+
+/* A cpulist is ranges like "0-7,16-23". Returns -1 if it isn't one or has no CPUs in it */
+static int parse_cpulist( const char *list, cpu_set_t *cpus )
+{
+    const char *pos;
+    char *end;
+    long first, last;
+
+    CPU_ZERO( cpus );
+
+    for( pos = list; *pos && *pos != '\n'; pos = end )
+    {
+        first = last = strtol( pos, &end, 10 );
+        if( end == pos || first < 0 )
+            return -1;
+        if( *end == '-' )
+        {
+            pos = end + 1;
+            last = strtol( pos, &end, 10 );
+            if( end == pos || last < first )
+                return -1;
+        }
+        for( long i = first; i <= last && i < CPU_SETSIZE; i++ )
+            CPU_SET( i, cpus );
+        if( *end == ',' )
+            end++;
+        else if( *end && *end != '\n' )
+            return -1;
+    }
+
+    return CPU_COUNT( cpus ) ? 0 : -1;
+}
+
+static int get_node_cpus( int node, cpu_set_t *cpus )
+{
+    char path[64], list[1024];
+    FILE *fp;
+
+    CPU_ZERO( cpus );
+
+    snprintf( path, sizeof(path), NUMA_NODE_CPULIST, node );
+    fp = fopen( path, "r" );
+    if( !fp )
+    {
+        syslog( LOG_WARNING, "[numa] Could not find the CPUs of node %i\n", node );
+        return -1;
+    }
+
+    if( !fgets( list, sizeof(list), fp ) )
+        list[0] = 0;
+    fclose( fp );
+
+    return parse_cpulist( list, cpus );
+}
+
+int obe_numa_bind_thread( int node )
+{
+    cpu_set_t cpus;
+
+    if( node < 0 )
+        return 0;
+
+    if( get_node_cpus( node, &cpus ) < 0 )
+        return -1;
+
+    if( pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus ) )
+    {
+        syslog( LOG_WARNING, "[numa] Could not bind thread to node %i\n", node );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A node that can't be used leaves the thread unbound rather than failing */
+int obe_numa_thread_create( pthread_t *thread, int node, void *(*start_routine)( void* ), void *arg )
+{
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int ret;
+
+    if( node < 0 || get_node_cpus( node, &cpus ) < 0 )
+        return pthread_create( thread, NULL, start_routine, arg );
+
+    pthread_attr_init( &attr );
+    pthread_attr_setaffinity_np( &attr, sizeof(cpus), &cpus );
+    ret = pthread_create( thread, &attr, start_routine, arg );
+    pthread_attr_destroy( &attr );
+
+    return ret;
+}
+
+/**** Thread placement ****/
+
+/* What each stage did before it could be configured */
+static const struct
+{
+    const char *name;
+    int policy;
+    int priority;
+} stage_defaults[OBE_NUM_THREAD_STAGES] =
+{
+    [OBE_THREAD_INPUT]         = { "input",         SCHED_OTHER, 0 },
+    [OBE_THREAD_FILTER]        = { "filter",        SCHED_OTHER, 0 },
+    [OBE_THREAD_VIDEO_ENCODER] = { "video encoder", SCHED_OTHER, 0 },
+    [OBE_THREAD_AUDIO_ENCODER] = { "audio encoder", SCHED_OTHER, 0 },
+    [OBE_THREAD_SMOOTHING]     = { "smoothing",     SCHED_FIFO,  99 },
+    [OBE_THREAD_MUX]           = { "mux",           SCHED_RR,    99 },
+    [OBE_THREAD_OUTPUT]        = { "output",        SCHED_FIFO,  99 },
+};
+
+static const int sched_policies[] = { -1, SCHED_OTHER, SCHED_FIFO, SCHED_RR };
+
+int obe_setup_thread( obe_t *h, int stage, obe_thread_opts_t *thread_opts )
+{
+    obe_thread_opts_t *opts;
+    cpu_set_t cpus;
+
+    if( stage < 0 || stage >= OBE_NUM_THREAD_STAGES )
+    {
+        fprintf( stderr, "Invalid thread stage\n" );
+        return -1;
+    }
+
+    if( thread_opts->cpus && parse_cpulist( thread_opts->cpus, &cpus ) < 0 )
+    {
+        fprintf( stderr, "Invalid CPU list \"%s\" for the %s threads\n", thread_opts->cpus, stage_defaults[stage].name );
+        return -1;
+    }
+
+    if( thread_opts->policy < OBE_SCHED_DEFAULT || thread_opts->policy > OBE_SCHED_RR ||
+        ( ( thread_opts->policy == OBE_SCHED_FIFO || thread_opts->policy == OBE_SCHED_RR ) &&
+          ( thread_opts->priority < 1 || thread_opts->priority > 99 ) ) )
+    {
+        fprintf( stderr, "Invalid scheduling for the %s threads\n", stage_defaults[stage].name );
+        return -1;
+    }
+
+    opts = &h->thread_opts[stage];
+    free( opts->cpus );
+    memcpy( opts, thread_opts, sizeof(*opts) );
+    if( thread_opts->cpus )
+    {
+        opts->cpus = strdup( thread_opts->cpus );
+        if( !opts->cpus )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void get_stage_sched( obe_t *h, int stage, int *policy, struct sched_param *param )
+{
+    const obe_thread_opts_t *opts = &h->thread_opts[stage];
+
+    memset( param, 0, sizeof(*param) );
+    if( opts->policy == OBE_SCHED_DEFAULT )
+    {
+        *policy = stage_defaults[stage].policy;
+        param->sched_priority = stage_defaults[stage].priority;
+    }
+    else
+    {
+        *policy = sched_policies[opts->policy];
+        param->sched_priority = *policy == SCHED_OTHER ? 0 : opts->priority;
+    }
+}
+
+/* The stage's CPUs, or the node's. Returns -1 if the thread is left wherever the scheduler puts it */
+static int get_stage_cpus( obe_t *h, int stage, int node, cpu_set_t *cpus )
+{
+    if( h->thread_opts[stage].cpus )
+        return parse_cpulist( h->thread_opts[stage].cpus, cpus );
+
+    return node < 0 ? -1 : get_node_cpus( node, cpus );
+}
+
+typedef struct
+{
+    int stage;
+    void *(*start_routine)( void* );
+    void *arg;
+} obe_thread_start_t;
+
+/* Names the thread after its stage in traces */
+static void *start_stage_thread( void *ptr )
+{
+    obe_thread_start_t start = *(obe_thread_start_t*)ptr;
+
+    free( ptr );
+    obe_trace_thread_name( stage_defaults[start.stage].name );
+
+    return start.start_routine( start.arg );
+}
+
+/* Without CAP_SYS_NICE a realtime thread can't be created at all, so it is created normally instead */
+int obe_thread_create( obe_t *h, pthread_t *thread, int stage, int node, void *(*start_routine)( void* ), void *arg )
+{
+    obe_thread_start_t *start;
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int policy, ret;
+
+    start = malloc( sizeof(*start) );
+    if( !start )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+    start->stage = stage;
+    start->start_routine = start_routine;
+    start->arg = arg;
+
+    pthread_attr_init( &attr );
+    if( get_stage_cpus( h, stage, node, &cpus ) == 0 )
+        pthread_attr_setaffinity_np( &attr, sizeof(cpus), &cpus );
+
+    get_stage_sched( h, stage, &policy, &param );
+    if( policy != SCHED_OTHER )
+    {
+        pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+        pthread_attr_setschedpolicy( &attr, policy );
+        pthread_attr_setschedparam( &attr, &param );
+    }
+
+    ret = pthread_create( thread, &attr, start_stage_thread, start );
+    if( ret == EPERM )
+    {
+        syslog( LOG_WARNING, "[numa] No permission for realtime %s threads, running at normal priority\n", stage_defaults[stage].name );
+        pthread_attr_setinheritsched( &attr, PTHREAD_INHERIT_SCHED );
+        ret = pthread_create( thread, &attr, start_stage_thread, start );
+    }
+    pthread_attr_destroy( &attr );
+    if( ret )
+        free( start );
+
+    return ret;
+}
+
+int obe_thread_place( obe_t *h, int stage, int node )
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int policy, ret = 0;
+
+    obe_trace_thread_name( stage_defaults[stage].name );
+
+    if( get_stage_cpus( h, stage, node, &cpus ) == 0 && pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus ) )
+    {
+        syslog( LOG_WARNING, "[numa] Could not set the CPUs of the %s thread\n", stage_defaults[stage].name );
+        ret = -1;
+    }
+
+    get_stage_sched( h, stage, &policy, &param );
+    if( policy != SCHED_OTHER && pthread_setschedparam( pthread_self(), policy, &param ) )
+    {
+        syslog( LOG_WARNING, "[numa] Could not set the priority of the %s thread\n", stage_defaults[stage].name );
+        ret = -1;
+    }
+
+    return ret;
+}
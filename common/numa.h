@@ -0,0 +1,46 @@
+/*****************************************************************************
+ * numa.h: NUMA placement of per-device threads
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_NUMA_H
+#define OBE_NUMA_H
+
+/* Threads which touch a device's raw frames run on the CPUs of the node the card is attached to.
+ * The frame pools are faulted in by the capture thread so their pages end up on that node too */
+
+/* NUMA node of a PCI device from its sysfs directory, -1 if it isn't known */
+int obe_numa_node_of_device( const char *sysfs_dir );
+
+/* Binds the calling thread to the CPUs of a node. Nothing is done for node -1 */
+int obe_numa_bind_thread( int node );
+
+/* pthread_create on the CPUs of a node */
+int obe_numa_thread_create( pthread_t *thread, int node, void *(*start_routine)( void* ), void *arg );
+
+/* pthread_create for a pipeline stage (obe_thread_stage_e) with the CPUs and scheduling set up with obe_setup_thread.
+ * Without CPUs of its own the stage runs on node, which can be -1 */
+int obe_thread_create( obe_t *h, pthread_t *thread, int stage, int node, void *(*start_routine)( void* ), void *arg );
+
+/* The same for the calling thread, for threads which aren't created by OBE */
+int obe_thread_place( obe_t *h, int stage, int node );
+
+#endif
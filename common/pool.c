@@ -0,0 +1,355 @@
+/*****************************************************************************
+ * pool.c: pooled buffers
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include <sys/mman.h>
+#include <libavutil/pixdesc.h>
+
+#define POOL_ALIGN 64
+#define PAGE_ALIGN 4096
+#define HUGEPAGE_SIZE (2*1024*1024)
+
+/* Slabs of a hugepage or more are aligned to one and offered to transparent hugepages, so the
+ * capture and unpack loops walking a frame don't miss the TLB on every 4KB page.
+ * Smaller ones are page aligned, which leaves every data buffer aligned enough for O_DIRECT */
+static void *alloc_slab( size_t size )
+{
+    void *slab;
+    size_t align = size >= HUGEPAGE_SIZE ? HUGEPAGE_SIZE : PAGE_ALIGN;
+
+    if( posix_memalign( &slab, align, size ) )
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    if( align == HUGEPAGE_SIZE )
+        madvise( slab, size & ~(size_t)(HUGEPAGE_SIZE-1), MADV_HUGEPAGE );
+#endif
+
+    /* Fault every page in now rather than during capture */
+    memset( slab, 0, size );
+
+    return slab;
+}
+
+obe_frame_pool_t *obe_frame_pool_create( int csp, int width, int height, int num_bufs )
+{
+    const AVPixFmtDescriptor *desc = &av_pix_fmt_descriptors[csp];
+    obe_frame_pool_t *pool;
+    int offset = 0;
+
+    pool = calloc( 1, sizeof(*pool) );
+    if( !pool )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return NULL;
+    }
+
+    pool->csp = csp;
+    pool->width = width;
+    pool->height = height;
+
+    /* Pad each line to a whole number of cachelines so SIMD can run over the full stride */
+    if( av_image_fill_linesizes( pool->stride, csp, FFALIGN( width, POOL_ALIGN ) ) < 0 )
+        goto fail;
+
+    for( int i = 0; i < 4 && pool->stride[i]; i++ )
+    {
+        int lines = ( i == 1 || i == 2 ) ? -((-height) >> desc->log2_chroma_h) : height;
+
+        pool->stride[i] = FFALIGN( pool->stride[i], POOL_ALIGN );
+        pool->plane_offset[i] = offset;
+        offset += FFALIGN( pool->stride[i] * lines, POOL_ALIGN );
+    }
+    pool->buf_size = offset;
+
+    pool->slab = alloc_slab( (size_t)pool->buf_size * num_bufs );
+    if( !pool->slab )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto fail;
+    }
+
+    pool->bufs = calloc( num_bufs, sizeof(*pool->bufs) );
+    pool->free_bufs = calloc( num_bufs, sizeof(*pool->free_bufs) );
+    if( !pool->bufs || !pool->free_bufs )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto fail;
+    }
+
+    for( int i = 0; i < num_bufs; i++ )
+    {
+        pool->bufs[i].pool = pool;
+        pool->bufs[i].data = pool->slab + (size_t)pool->buf_size * i;
+        pool->free_bufs[i] = &pool->bufs[i];
+    }
+    pool->num_bufs = pool->num_free = num_bufs;
+
+    pthread_mutex_init( &pool->mutex, NULL );
+
+    return pool;
+
+fail:
+    if( pool->slab )
+        free( pool->slab );
+    if( pool->bufs )
+        free( pool->bufs );
+    if( pool->free_bufs )
+        free( pool->free_bufs );
+    free( pool );
+
+    return NULL;
+}
+
+void obe_frame_pool_destroy( obe_frame_pool_t *pool )
+{
+    if( pool->num_free != pool->num_bufs )
+        syslog( LOG_WARNING, "[pool] %i frame buffers still in use\n", pool->num_bufs - pool->num_free );
+
+    if( pool->num_drops )
+        syslog( LOG_INFO, "[pool] %"PRIi64" frames dropped due to pool exhaustion\n", pool->num_drops );
+
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool->slab );
+    free( pool->bufs );
+    free( pool->free_bufs );
+    free( pool );
+}
+
+static void setup_buf( obe_frame_pool_t *pool, obe_frame_buf_t *buf, uint8_t *plane[4], int stride[4] )
+{
+    buf->refcount = 1;
+    for( int i = 0; i < 4; i++ )
+    {
+        plane[i] = pool->stride[i] ? buf->data + pool->plane_offset[i] : NULL;
+        stride[i] = pool->stride[i];
+    }
+}
+
+/* Returns NULL if every buffer is in use. This is counted as a dropped frame */
+obe_frame_buf_t *obe_frame_pool_get( obe_frame_pool_t *pool, uint8_t *plane[4], int stride[4] )
+{
+    obe_frame_buf_t *buf = NULL;
+
+    pthread_mutex_lock( &pool->mutex );
+    if( pool->num_free )
+        buf = pool->free_bufs[--pool->num_free];
+    else if( !pool->num_drops++ )
+        syslog( LOG_WARNING, "[pool] Frame pool exhausted, dropping frames\n" );
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !buf )
+        return NULL;
+
+    setup_buf( pool, buf, plane, stride );
+
+    return buf;
+}
+
+obe_frame_buf_t *obe_frame_pool_get_wait( obe_frame_pool_t *pool, uint8_t *plane[4], int stride[4] )
+{
+    obe_frame_buf_t *buf = NULL;
+
+    while( 1 )
+    {
+        pthread_mutex_lock( &pool->mutex );
+        if( pool->num_free )
+            buf = pool->free_bufs[--pool->num_free];
+        pthread_mutex_unlock( &pool->mutex );
+
+        if( buf )
+            break;
+
+        /* Poll rather than wait on a condition so that the input thread can be cancelled here */
+        usleep( 1000 );
+    }
+
+    setup_buf( pool, buf, plane, stride );
+
+    return buf;
+}
+
+void obe_frame_buf_ref( obe_frame_buf_t *buf )
+{
+    __atomic_add_fetch( &buf->refcount, 1, __ATOMIC_RELAXED );
+}
+
+void obe_frame_buf_unref( obe_frame_buf_t *buf )
+{
+    obe_frame_pool_t *pool = buf->pool;
+
+    if( __atomic_sub_fetch( &buf->refcount, 1, __ATOMIC_ACQ_REL ) )
+        return;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->free_bufs[pool->num_free++] = buf;
+    pthread_mutex_unlock( &pool->mutex );
+}
+
+static int alloc_buf_class( obe_buf_pool_t *pool, int i )
+{
+    obe_buf_class_t *buf_class = &pool->classes[i];
+    size_t slab_size;
+
+    buf_class->num_bufs = MIN( pool->bufs_per_class, MAX( OBE_BUF_POOL_MAX_SLAB / buf_class->buf_size, 1 ) );
+    slab_size = (size_t)buf_class->buf_size * buf_class->num_bufs;
+
+    buf_class->slab = alloc_slab( slab_size );
+    if( !buf_class->slab )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    buf_class->bufs = calloc( buf_class->num_bufs, sizeof(*buf_class->bufs) );
+    buf_class->free_bufs = calloc( buf_class->num_bufs, sizeof(*buf_class->free_bufs) );
+    if( !buf_class->bufs || !buf_class->free_bufs )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        free( buf_class->slab );
+        free( buf_class->bufs );
+        free( buf_class->free_bufs );
+        buf_class->slab = NULL;
+        buf_class->bufs = NULL;
+        buf_class->free_bufs = NULL;
+        return -1;
+    }
+
+    for( int j = 0; j < buf_class->num_bufs; j++ )
+    {
+        buf_class->bufs[j].pool = pool;
+        buf_class->bufs[j].buf_class = i;
+        buf_class->bufs[j].size = buf_class->buf_size;
+        buf_class->bufs[j].data = buf_class->slab + (size_t)buf_class->buf_size * j;
+        buf_class->free_bufs[j] = &buf_class->bufs[j];
+    }
+    buf_class->num_free = buf_class->num_bufs;
+
+    return 0;
+}
+
+int obe_buf_pool_init( obe_buf_pool_t *pool, int bufs_per_class )
+{
+    memset( pool, 0, sizeof(*pool) );
+    pool->bufs_per_class = bufs_per_class;
+    pthread_mutex_init( &pool->mutex, NULL );
+
+    for( int i = 0; i < OBE_BUF_POOL_NUM_CLASSES; i++ )
+    {
+        pool->classes[i].buf_size = 1 << (OBE_BUF_POOL_MIN_SHIFT + i);
+        if( alloc_buf_class( pool, i ) < 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+void obe_buf_pool_destroy( obe_buf_pool_t *pool )
+{
+    for( int i = 0; i < OBE_BUF_POOL_NUM_CLASSES; i++ )
+    {
+        obe_buf_class_t *buf_class = &pool->classes[i];
+        if( !buf_class->slab )
+            continue;
+
+        if( buf_class->num_free != buf_class->num_bufs )
+            syslog( LOG_WARNING, "[pool] %i %i-byte buffers still in use\n", buf_class->num_bufs - buf_class->num_free,
+                    buf_class->buf_size );
+
+        free( buf_class->slab );
+        free( buf_class->bufs );
+        free( buf_class->free_bufs );
+        buf_class->slab = NULL;
+    }
+
+    if( pool->num_heap_allocs )
+        syslog( LOG_INFO, "[pool] %"PRIi64" buffers allocated outside the pool\n", pool->num_heap_allocs );
+
+    pthread_mutex_destroy( &pool->mutex );
+}
+
+/* Buffers larger than the biggest size class, or requested while their class is
+ * empty, come from the heap so coded data is never dropped */
+obe_buf_t *obe_buf_get( obe_buf_pool_t *pool, int size )
+{
+    obe_buf_t *buf = NULL;
+    int i = 0;
+
+    while( i < OBE_BUF_POOL_NUM_CLASSES && pool->classes[i].buf_size < size )
+        i++;
+
+    pthread_mutex_lock( &pool->mutex );
+    if( i < OBE_BUF_POOL_NUM_CLASSES )
+    {
+        obe_buf_class_t *buf_class = &pool->classes[i];
+        if( buf_class->num_free )
+            buf = buf_class->free_bufs[--buf_class->num_free];
+    }
+
+    if( !buf && !pool->num_heap_allocs++ )
+        syslog( LOG_WARNING, "[pool] Buffer pool exhausted, falling back to malloc\n" );
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !buf )
+    {
+        buf = malloc( sizeof(*buf) + size );
+        if( !buf )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return NULL;
+        }
+        buf->pool = pool;
+        buf->buf_class = -1;
+        buf->size = size;
+        buf->data = (uint8_t*)(buf + 1);
+    }
+
+    buf->refcount = 1;
+
+    return buf;
+}
+
+void obe_buf_ref( obe_buf_t *buf )
+{
+    __atomic_add_fetch( &buf->refcount, 1, __ATOMIC_RELAXED );
+}
+
+void obe_buf_unref( obe_buf_t *buf )
+{
+    obe_buf_pool_t *pool = buf->pool;
+    obe_buf_class_t *buf_class;
+
+    if( __atomic_sub_fetch( &buf->refcount, 1, __ATOMIC_ACQ_REL ) )
+        return;
+
+    if( buf->buf_class < 0 )
+    {
+        free( buf );
+        return;
+    }
+
+    buf_class = &pool->classes[buf->buf_class];
+    pthread_mutex_lock( &pool->mutex );
+    buf_class->free_bufs[buf_class->num_free++] = buf;
+    pthread_mutex_unlock( &pool->mutex );
+}
@@ -0,0 +1,127 @@
+/*****************************************************************************
+ * pool.h: pooled buffers
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_POOL_H
+#define OBE_POOL_H
+
+#define OBE_MAX_FRAME_POOLS 16
+
+/* Number of buffers in each video frame pool */
+#define OBE_FRAME_POOL_SIZE_GENERIC     32
+#define OBE_FRAME_POOL_SIZE_LOW_LATENCY 8
+
+typedef struct obe_frame_pool_t obe_frame_pool_t;
+
+/* A refcounted video buffer. It goes back to its pool when the last reference is dropped */
+typedef struct
+{
+    obe_frame_pool_t *pool;
+    int refcount;
+    uint8_t *data;
+} obe_frame_buf_t;
+
+/* Fixed number of identically laid out video buffers carved out of one
+ * pre-faulted allocation. Every plane starts on a 64-byte boundary. */
+struct obe_frame_pool_t
+{
+    pthread_mutex_t mutex;
+
+    /* Format */
+    int csp;
+    int width;
+    int height; /* allocated lines, including any padding the caller asked for */
+    int stride[4];
+    int plane_offset[4];
+    int buf_size;
+
+    uint8_t *slab;
+    int num_bufs;
+    obe_frame_buf_t *bufs;
+    obe_frame_buf_t **free_bufs;
+    int num_free;
+
+    /* Monitoring */
+    int64_t num_drops;
+};
+
+obe_frame_pool_t *obe_frame_pool_create( int csp, int width, int height, int num_bufs );
+void obe_frame_pool_destroy( obe_frame_pool_t *pool );
+obe_frame_buf_t *obe_frame_pool_get( obe_frame_pool_t *pool, uint8_t *plane[4], int stride[4] );
+/* Waits for a buffer instead of dropping. Only for inputs that can be held back, such as file replay */
+obe_frame_buf_t *obe_frame_pool_get_wait( obe_frame_pool_t *pool, uint8_t *plane[4], int stride[4] );
+void obe_frame_buf_ref( obe_frame_buf_t *buf );
+void obe_frame_buf_unref( obe_frame_buf_t *buf );
+
+/* Coded and muxed data buffers. Sizes are rounded up to a power of two between
+ * 4 KiB and 4 MiB and every size class gets its own slab when the pool is set up,
+ * so nothing is allocated or faulted in while encoding */
+#define OBE_BUF_POOL_MIN_SHIFT   12
+#define OBE_BUF_POOL_NUM_CLASSES 11
+
+/* The biggest classes hold fewer buffers so that no slab is larger than this */
+#define OBE_BUF_POOL_MAX_SLAB (32 << 20)
+
+/* Number of buffers in each size class */
+#define OBE_BUF_POOL_SIZE_GENERIC     64
+#define OBE_BUF_POOL_SIZE_LOW_LATENCY 16
+
+typedef struct obe_buf_pool_t obe_buf_pool_t;
+
+/* A refcounted data buffer. buf_class is -1 for a buffer that didn't fit in the pool
+ * and came from the heap instead */
+typedef struct
+{
+    obe_buf_pool_t *pool;
+    int buf_class;
+    int refcount;
+    int size;
+    uint8_t *data;
+} obe_buf_t;
+
+typedef struct
+{
+    int buf_size;
+    uint8_t *slab;
+    obe_buf_t *bufs;
+    obe_buf_t **free_bufs;
+    int num_bufs;
+    int num_free;
+} obe_buf_class_t;
+
+struct obe_buf_pool_t
+{
+    pthread_mutex_t mutex;
+    int bufs_per_class;
+    obe_buf_class_t classes[OBE_BUF_POOL_NUM_CLASSES];
+
+    /* Monitoring */
+    int64_t num_heap_allocs;
+};
+
+int obe_buf_pool_init( obe_buf_pool_t *pool, int bufs_per_class );
+void obe_buf_pool_destroy( obe_buf_pool_t *pool );
+obe_buf_t *obe_buf_get( obe_buf_pool_t *pool, int size );
+void obe_buf_ref( obe_buf_t *buf );
+void obe_buf_unref( obe_buf_t *buf );
+
+#endif
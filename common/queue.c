@@ -0,0 +1,235 @@
+/*****************************************************************************
+ * queue.c: bounded ring queues
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static void futex_wait( int *addr, int val )
+{
+    syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
+
+static void futex_wake( int *addr )
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+}
+
+int obe_queue_init( obe_queue_t *queue, const char *name, int capacity, int is_spsc )
+{
+    int size = 1;
+
+    /* An SPSC ring keeps one slot free to tell full from empty */
+    if( is_spsc )
+        capacity++;
+
+    while( size < capacity )
+        size <<= 1;
+
+    memset( queue, 0, sizeof(*queue) );
+    queue->name = name;
+    queue->is_spsc = is_spsc;
+    queue->items = calloc( size, sizeof(*queue->items) );
+    if( !queue->items )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+    queue->capacity = size;
+
+    return 0;
+}
+
+void obe_queue_destroy( obe_queue_t *queue )
+{
+    if( queue->items )
+        free( queue->items );
+    queue->items = NULL;
+    queue->capacity = queue->size = queue->head = 0;
+}
+
+static int spsc_push( obe_queue_t *queue, void *item )
+{
+    int mask = queue->capacity - 1;
+    int tail = queue->tail;
+    int head = __atomic_load_n( &queue->head, __ATOMIC_ACQUIRE );
+    int size = (tail - head) & mask;
+
+    if( size == mask )
+    {
+        if( !queue->num_overflows++ )
+            syslog( LOG_WARNING, "[queue] %s queue full, dropping\n", queue->name );
+        obe_trace_instant( "overflow", queue->name, size );
+        return -1;
+    }
+
+    queue->items[tail] = item;
+    __atomic_store_n( &queue->tail, (tail + 1) & mask, __ATOMIC_RELEASE );
+    if( size + 1 > queue->high_water )
+        queue->high_water = size + 1;
+    obe_trace_instant( "push", queue->name, size + 1 );
+
+    /* Only make a syscall if the consumer has gone to sleep.
+     * The full barrier pairs with the one in obe_queue_wait */
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &queue->sleeping, __ATOMIC_RELAXED ) )
+        obe_queue_wake( queue );
+
+    return 0;
+}
+
+static void *spsc_pop( obe_queue_t *queue )
+{
+    int mask = queue->capacity - 1;
+    int head = queue->head;
+    int tail = __atomic_load_n( &queue->tail, __ATOMIC_ACQUIRE );
+    void *item;
+
+    if( head == tail )
+        return NULL;
+
+    item = queue->items[head];
+    __atomic_store_n( &queue->head, (head + 1) & mask, __ATOMIC_RELEASE );
+    obe_trace_instant( "pop", queue->name, (tail - head - 1) & mask );
+
+    return item;
+}
+
+int obe_queue_push( obe_queue_t *queue, void *item )
+{
+    if( queue->is_spsc )
+        return spsc_push( queue, item );
+
+    if( queue->size == queue->capacity )
+    {
+        /* Only log the first overflow so a stalled consumer doesn't flood syslog */
+        if( !queue->num_overflows++ )
+            syslog( LOG_WARNING, "[queue] %s queue full, dropping\n", queue->name );
+        obe_trace_instant( "overflow", queue->name, queue->size );
+        return -1;
+    }
+
+    queue->items[(queue->head + queue->size) & (queue->capacity - 1)] = item;
+    queue->size++;
+    if( queue->size > queue->high_water )
+        queue->high_water = queue->size;
+    obe_trace_instant( "push", queue->name, queue->size );
+
+    return 0;
+}
+
+void *obe_queue_pop( obe_queue_t *queue )
+{
+    void *item;
+
+    if( queue->is_spsc )
+        return spsc_pop( queue );
+
+    if( !queue->size )
+        return NULL;
+
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->size--;
+    obe_trace_instant( "pop", queue->name, queue->size );
+
+    return item;
+}
+
+void *obe_queue_front( obe_queue_t *queue )
+{
+    if( queue->is_spsc )
+    {
+        if( queue->head == __atomic_load_n( &queue->tail, __ATOMIC_ACQUIRE ) )
+            return NULL;
+        return queue->items[queue->head];
+    }
+
+    return queue->size ? queue->items[queue->head] : NULL;
+}
+
+int obe_queue_size( obe_queue_t *queue )
+{
+    if( queue->is_spsc )
+    {
+        int head = __atomic_load_n( &queue->head, __ATOMIC_ACQUIRE );
+        int tail = __atomic_load_n( &queue->tail, __ATOMIC_ACQUIRE );
+        return (tail - head) & (queue->capacity - 1);
+    }
+
+    return queue->size;
+}
+
+void obe_queue_remove_at( obe_queue_t *queue, int i )
+{
+    int mask = queue->capacity - 1;
+
+    if( i == 0 )
+    {
+        obe_queue_pop( queue );
+        return;
+    }
+
+    /* Close the gap by moving the newer items down one slot */
+    for( ; i < queue->size - 1; i++ )
+        queue->items[(queue->head + i) & mask] = queue->items[(queue->head + i + 1) & mask];
+
+    queue->size--;
+}
+
+int obe_queue_remove( obe_queue_t *queue, void *item )
+{
+    for( int i = 0; i < queue->size; i++ )
+    {
+        if( obe_queue_item( queue, i ) == item )
+        {
+            obe_queue_remove_at( queue, i );
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void obe_queue_wait( obe_queue_t *queue, const int *cancel )
+{
+    __atomic_store_n( &queue->sleeping, 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+    /* Check again now that the producer can see we are about to sleep */
+    if( queue->head == __atomic_load_n( &queue->tail, __ATOMIC_ACQUIRE ) &&
+        !__atomic_load_n( cancel, __ATOMIC_ACQUIRE ) )
+    {
+        obe_trace_begin( "wait", queue->name );
+        futex_wait( &queue->sleeping, 1 );
+        obe_trace_end( "wait", queue->name );
+    }
+
+    __atomic_store_n( &queue->sleeping, 0, __ATOMIC_RELAXED );
+}
+
+void obe_queue_wake( obe_queue_t *queue )
+{
+    __atomic_store_n( &queue->sleeping, 0, __ATOMIC_RELAXED );
+    futex_wake( &queue->sleeping );
+}
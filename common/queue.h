@@ -0,0 +1,76 @@
+/*****************************************************************************
+ * queue.h: bounded ring queues
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_QUEUE_H
+#define OBE_QUEUE_H
+
+/* Fixed-capacity ring of pointers. The storage is allocated once when the queue is
+ * set up so pushing and popping never touch the allocator.
+ * None of these functions lock, the caller must hold the mutex that owns the queue.
+ *
+ * A queue created in single-producer/single-consumer mode needs no mutex at all.
+ * head is then only written by the consumer and tail only by the producer, and the
+ * consumer sleeps on a futex in obe_queue_wait. Only push, pop, front, wait and wake
+ * may be used on such a queue. */
+typedef struct
+{
+    const char *name;
+
+    void **items;
+    int capacity; /* always a power of two */
+    int head;
+    int size;
+
+    /* SPSC mode */
+    int is_spsc;
+    int tail;
+    int sleeping;
+
+    /* Monitoring */
+    int high_water;
+    int64_t num_overflows;
+} obe_queue_t;
+
+int  obe_queue_init( obe_queue_t *queue, const char *name, int capacity, int is_spsc );
+void obe_queue_destroy( obe_queue_t *queue );
+int  obe_queue_push( obe_queue_t *queue, void *item );
+void *obe_queue_pop( obe_queue_t *queue );
+void *obe_queue_front( obe_queue_t *queue );
+int  obe_queue_remove( obe_queue_t *queue, void *item );
+void obe_queue_remove_at( obe_queue_t *queue, int i );
+
+/* Number of queued items. Safe to call from any thread on an SPSC queue */
+int  obe_queue_size( obe_queue_t *queue );
+
+/* SPSC mode only. obe_queue_wait returns once the queue is non-empty, *cancel is set
+ * or obe_queue_wake is called */
+void obe_queue_wait( obe_queue_t *queue, const int *cancel );
+void obe_queue_wake( obe_queue_t *queue );
+
+/* Returns the i-th oldest item */
+static inline void *obe_queue_item( obe_queue_t *queue, int i )
+{
+    return queue->items[(queue->head + i) & (queue->capacity - 1)];
+}
+
+#endif
@@ -0,0 +1,457 @@
+/*****************************************************************************
+ * tap.c: shared memory tap for confidence monitoring
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/tap.h"
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libavutil/pixdesc.h>
+
+#define TAP_NAME "/obe-tap"
+#define TAP_SLOTS 4
+
+#define TAP_PICTURE_INTERVAL 1000
+#define TAP_METER_INTERVAL   100
+#define TAP_WIDTH            320
+
+typedef struct
+{
+    char *name;
+    uint8_t *map;
+    size_t size;
+
+    int64_t picture_interval; /* 27MHz */
+    int meter_interval;       /* ms */
+    int width;
+} obe_tap_t;
+
+/* Keeps the slots and entries 8-byte aligned for the 64-bit fields */
+#define TAP_ALIGN(x) (((x)+7) & ~7)
+
+static int picture_size( obe_tap_t *tap, int width, int height )
+{
+    int step = ( width + tap->width - 1 ) / tap->width;
+
+    width = ( width / step ) & ~1;
+    height = ( height / step ) & ~1;
+
+    return sizeof(obe_tap_picture_t) + width * height + 2 * ( width / 2 ) * ( height / 2 );
+}
+
+static obe_tap_entry_t *next_entry( obe_tap_entry_t *entry )
+{
+    return (obe_tap_entry_t*)( (uint8_t*)entry + entry->entry_size );
+}
+
+static void add_entry( obe_tap_t *tap, size_t *offset, int type, int stream_id, int payload_size )
+{
+    obe_tap_header_t *header;
+    obe_tap_entry_t *entry;
+    uint32_t slot_size = TAP_ALIGN( sizeof(obe_tap_slot_t) + payload_size );
+
+    /* The first pass only sizes the object */
+    if( tap->map )
+    {
+        header = (obe_tap_header_t*)tap->map;
+        entry = (obe_tap_entry_t*)( tap->map + *offset );
+        entry->type = type;
+        entry->stream_id = stream_id;
+        entry->num_slots = TAP_SLOTS;
+        entry->slot_size = slot_size;
+        entry->entry_size = sizeof(obe_tap_entry_t) + TAP_SLOTS * slot_size;
+        header->num_entries++;
+    }
+
+    *offset += sizeof(obe_tap_entry_t) + TAP_SLOTS * slot_size;
+}
+
+static size_t layout( obe_t *h, obe_tap_t *tap )
+{
+    obe_output_stream_t *output_stream;
+    obe_int_input_stream_t *input_stream;
+    size_t offset = sizeof(obe_tap_header_t);
+    int is_first;
+
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        output_stream = &h->output_streams[i];
+        input_stream = get_input_stream( h, output_stream->input_stream_id );
+        if( !input_stream || output_stream->stream_action != STREAM_ENCODE )
+            continue;
+
+        if( input_stream->stream_type == STREAM_TYPE_VIDEO )
+        {
+            /* One snapshot of each input picture, as the filter has it, whatever it is encoded as */
+            is_first = 1;
+            for( int j = 0; j < i; j++ )
+            {
+                if( h->output_streams[j].input_stream_id == output_stream->input_stream_id &&
+                    h->output_streams[j].stream_action == STREAM_ENCODE )
+                    is_first = 0;
+            }
+
+            if( is_first )
+                add_entry( tap, &offset, OBE_TAP_PICTURE, input_stream->stream_id,
+                           picture_size( tap, input_stream->width, input_stream->height ) );
+        }
+        else if( input_stream->stream_type == STREAM_TYPE_AUDIO )
+            add_entry( tap, &offset, OBE_TAP_METERS, output_stream->stream_id, sizeof(obe_tap_meters_t) );
+    }
+
+    return offset;
+}
+
+int obe_tap_open( obe_t *h )
+{
+    obe_tap_opts_t *opts = &h->tap_opts;
+    obe_tap_header_t *header;
+    obe_tap_t *tap;
+    int fd;
+
+    if( !opts->enabled )
+        return 0;
+
+    tap = calloc( 1, sizeof(*tap) );
+    if( !tap )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    tap->name = strdup( opts->name ? opts->name : TAP_NAME );
+    if( !tap->name )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( tap );
+        return -1;
+    }
+
+    tap->picture_interval = (int64_t)( opts->picture_interval > 0 ? opts->picture_interval : TAP_PICTURE_INTERVAL ) * ( OBE_CLOCK / 1000 );
+    tap->meter_interval = opts->meter_interval > 0 ? opts->meter_interval : TAP_METER_INTERVAL;
+    tap->width = opts->width > 1 ? opts->width : TAP_WIDTH;
+    tap->size = layout( h, tap );
+
+    fd = shm_open( tap->name, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+    {
+        fprintf( stderr, "[tap] Could not open shared memory \"%s\": %s\n", tap->name, strerror( errno ) );
+        goto fail;
+    }
+
+    if( ftruncate( fd, tap->size ) < 0 )
+    {
+        fprintf( stderr, "[tap] Could not size shared memory: %s\n", strerror( errno ) );
+        close( fd );
+        goto fail;
+    }
+
+    tap->map = mmap( NULL, tap->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( tap->map == MAP_FAILED )
+    {
+        tap->map = NULL;
+        fprintf( stderr, "[tap] Could not map shared memory: %s\n", strerror( errno ) );
+        goto fail;
+    }
+
+    /* Fault every page in now so the realtime threads never take a fault writing to it */
+    memset( tap->map, 0, tap->size );
+
+    header = (obe_tap_header_t*)tap->map;
+    header->version = OBE_TAP_VERSION;
+    header->header_size = sizeof(obe_tap_header_t);
+    layout( h, tap );
+    __atomic_store_n( &header->magic, OBE_TAP_MAGIC, __ATOMIC_RELEASE );
+
+    h->tap = tap;
+
+    return 0;
+
+fail:
+    shm_unlink( tap->name );
+    free( tap->name );
+    free( tap );
+    return -1;
+}
+
+void obe_tap_close( obe_t *h )
+{
+    obe_tap_t *tap = h->tap;
+
+    if( !tap )
+        return;
+
+    munmap( tap->map, tap->size );
+    shm_unlink( tap->name );
+    free( tap->name );
+    free( tap );
+    h->tap = NULL;
+}
+
+obe_tap_entry_t *obe_tap_entry( obe_t *h, int type, int stream_id )
+{
+    obe_tap_t *tap = h->tap;
+    obe_tap_header_t *header;
+    obe_tap_entry_t *entry;
+
+    if( !tap )
+        return NULL;
+
+    header = (obe_tap_header_t*)tap->map;
+    entry = (obe_tap_entry_t*)( tap->map + header->header_size );
+    for( uint32_t i = 0; i < header->num_entries; i++, entry = next_entry( entry ) )
+    {
+        if( entry->type == (uint32_t)type && entry->stream_id == (uint32_t)stream_id )
+            return entry;
+    }
+
+    return NULL;
+}
+
+/** Seqlock **/
+/* Writers race each other only around a failover, when the slate or the other input writes the
+ * same meter. The loser skips its write rather than wait */
+static obe_tap_slot_t *begin_write( obe_tap_entry_t *entry, uint64_t *count )
+{
+    obe_tap_slot_t *slot;
+    uint32_t seq;
+
+    *count = __atomic_load_n( &entry->write_count, __ATOMIC_ACQUIRE );
+    slot = (obe_tap_slot_t*)( (uint8_t*)( entry + 1 ) + ( *count % entry->num_slots ) * entry->slot_size );
+    seq = __atomic_load_n( &slot->seq, __ATOMIC_RELAXED );
+
+    if( ( seq & 1 ) || !__atomic_compare_exchange_n( &slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+        return NULL;
+
+    /* The odd seq is visible before any of the payload */
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    return slot;
+}
+
+static void end_write( obe_tap_entry_t *entry, obe_tap_slot_t *slot, uint64_t count )
+{
+    __atomic_store_n( &slot->seq, slot->seq + 1, __ATOMIC_RELEASE );
+    __atomic_compare_exchange_n( &entry->write_count, &count, count + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED );
+}
+
+/** Pictures **/
+/* Nearest sample, which is enough for a thumbnail and reads only the lines it keeps */
+static void decimate_plane( uint8_t *dst, int width, int height, const uint8_t *src, int stride,
+                            int step_x, int step_y, int depth )
+{
+    for( int y = 0; y < height; y++, dst += width )
+    {
+        const uint8_t *line = src + y * step_y * stride;
+
+        if( depth > 8 )
+        {
+            const uint16_t *line16 = (const uint16_t*)line;
+            for( int x = 0; x < width; x++ )
+                dst[x] = line16[x*step_x] >> ( depth - 8 );
+        }
+        else
+        {
+            for( int x = 0; x < width; x++ )
+                dst[x] = line[x*step_x];
+        }
+    }
+}
+
+void obe_tap_picture( obe_t *h, obe_tap_entry_t *entry, int64_t *next_pts, const obe_raw_frame_t *raw_frame )
+{
+    obe_tap_t *tap = h->tap;
+    const obe_image_t *img = &raw_frame->img;
+    const AVPixFmtDescriptor *desc;
+    obe_tap_slot_t *slot;
+    obe_tap_picture_t *picture;
+    uint8_t *dst;
+    uint64_t count;
+    int step, width, height, depth;
+
+    if( !entry )
+        return;
+
+    /* Timestamps that jump back start the interval again */
+    if( raw_frame->pts < *next_pts && *next_pts - raw_frame->pts <= tap->picture_interval )
+        return;
+    *next_pts = raw_frame->pts + tap->picture_interval;
+
+    /* Only planar pictures */
+    desc = &av_pix_fmt_descriptors[img->csp];
+    if( desc->nb_components < 3 || desc->comp[1].plane == desc->comp[2].plane )
+        return;
+
+    depth = desc->comp[0].depth_minus1 + 1;
+    step = ( img->width + tap->width - 1 ) / tap->width;
+    width = ( img->width / step ) & ~1;
+    height = ( img->height / step ) & ~1;
+    if( picture_size( tap, img->width, img->height ) > (int)( entry->slot_size - sizeof(obe_tap_slot_t) ) )
+        return;
+
+    slot = begin_write( entry, &count );
+    if( !slot )
+        return;
+
+    slot->pts = raw_frame->pts;
+    slot->wallclock = obe_mdate();
+
+    picture = (obe_tap_picture_t*)( slot + 1 );
+    picture->width = width;
+    picture->height = height;
+
+    dst = (uint8_t*)( picture + 1 );
+    decimate_plane( dst, width, height, img->plane[0], img->stride[0], step, step, depth );
+    dst += width * height;
+
+    /* Chroma of the snapshot is 4:2:0 whatever the picture is */
+    for( int i = 1; i < 3; i++ )
+    {
+        decimate_plane( dst, width / 2, height / 2, img->plane[i], img->stride[i],
+                        ( 2 * step ) >> desc->log2_chroma_w, ( 2 * step ) >> desc->log2_chroma_h, depth );
+        dst += ( width / 2 ) * ( height / 2 );
+    }
+
+    end_write( entry, slot, count );
+}
+
+/** Meters **/
+/* The filters of ITU-R BS.1770, made for the sample rate as libebur128 does */
+static void k_weighting( obe_tap_meter_t *meter, int sample_rate )
+{
+    double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan( M_PI * f0 / sample_rate );
+    double vh = pow( 10.0, gain / 20.0 );
+    double vb = pow( vh, 0.4996667741545416 );
+    double a0 = 1.0 + k / q + k * k;
+
+    meter->b[0][0] = ( vh + vb * k / q + k * k ) / a0;
+    meter->b[0][1] = 2.0 * ( k * k - vh ) / a0;
+    meter->b[0][2] = ( vh - vb * k / q + k * k ) / a0;
+    meter->a[0][1] = 2.0 * ( k * k - 1.0 ) / a0;
+    meter->a[0][2] = ( 1.0 - k / q + k * k ) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan( M_PI * f0 / sample_rate );
+    a0 = 1.0 + k / q + k * k;
+
+    meter->b[1][0] = 1.0;
+    meter->b[1][1] = -2.0;
+    meter->b[1][2] = 1.0;
+    meter->a[1][1] = 2.0 * ( k * k - 1.0 ) / a0;
+    meter->a[1][2] = ( 1.0 - k / q + k * k ) / a0;
+}
+
+void obe_tap_meter_open( obe_t *h, obe_tap_meter_t *meter, int stream_id, int num_channels, int sample_rate )
+{
+    obe_tap_t *tap = h->tap;
+
+    memset( meter, 0, sizeof(*meter) );
+    meter->entry = obe_tap_entry( h, OBE_TAP_METERS, stream_id );
+    if( !meter->entry || sample_rate <= 0 )
+    {
+        meter->entry = NULL;
+        return;
+    }
+
+    meter->num_channels = MIN( num_channels, OBE_TAP_MAX_CHANNELS );
+    meter->interval = MAX( (int64_t)sample_rate * tap->meter_interval / 1000, 1 );
+    k_weighting( meter, sample_rate );
+}
+
+static void send_meters( obe_tap_meter_t *meter )
+{
+    obe_tap_meters_t *meters;
+    obe_tap_slot_t *slot;
+    uint64_t count;
+
+    slot = begin_write( meter->entry, &count );
+    if( !slot )
+        return;
+
+    slot->pts = meter->pts;
+    slot->wallclock = obe_mdate();
+
+    meters = (obe_tap_meters_t*)( slot + 1 );
+    meters->num_channels = meter->num_channels;
+    meters->num_samples = meter->num_samples;
+    for( int c = 0; c < meter->num_channels; c++ )
+    {
+        meters->peak[c] = meter->peak[c];
+        meters->mean_square[c] = meter->sum[c] / meter->num_samples;
+    }
+
+    end_write( meter->entry, slot, count );
+}
+
+void obe_tap_meter( obe_tap_meter_t *meter, const int32_t *planes, int num_frames, int64_t pts )
+{
+    if( !meter->entry )
+        return;
+
+    if( !meter->num_samples )
+        meter->pts = pts;
+
+    for( int c = 0; c < meter->num_channels; c++ )
+    {
+        const int32_t *src = planes + c * num_frames;
+        double (*z)[2] = meter->z[c];
+        double sum = 0.0;
+        float peak = meter->peak[c];
+
+        /* Two transposed direct form II biquads */
+        for( int i = 0; i < num_frames; i++ )
+        {
+            double x = src[i] * ( 1.0 / 2147483648.0 );
+            double y;
+
+            peak = MAX( peak, fabs( x ) );
+
+            y = meter->b[0][0] * x + z[0][0];
+            z[0][0] = meter->b[0][1] * x - meter->a[0][1] * y + z[0][1];
+            z[0][1] = meter->b[0][2] * x - meter->a[0][2] * y;
+            x = y;
+
+            y = meter->b[1][0] * x + z[1][0];
+            z[1][0] = meter->b[1][1] * x - meter->a[1][1] * y + z[1][1];
+            z[1][1] = meter->b[1][2] * x - meter->a[1][2] * y;
+
+            sum += y * y;
+        }
+
+        meter->peak[c] = peak;
+        meter->sum[c] += sum;
+    }
+
+    meter->num_samples += num_frames;
+    if( meter->num_samples >= meter->interval )
+    {
+        send_meters( meter );
+        meter->num_samples = 0;
+        memset( meter->peak, 0, sizeof(meter->peak) );
+        memset( meter->sum, 0, sizeof(meter->sum) );
+    }
+}
@@ -0,0 +1,62 @@
+/*****************************************************************************
+ * tap.h: shared memory tap for confidence monitoring
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_TAP_H
+#define OBE_TAP_H
+
+/* The layout of the shared memory is in obe.h. The filter and the audio router write it from their
+ * own threads without locks, a writer that finds a slot being written skips its snapshot or reading.
+ * Between snapshots the cost is a timestamp compare per picture */
+
+/* Audio meter of one stream, kept by whichever thread routes its audio */
+typedef struct
+{
+    obe_tap_entry_t *entry; /* NULL without a tap */
+    int num_channels;
+    int interval;           /* samples in a reading */
+
+    int num_samples;
+    int64_t pts;
+    float peak[OBE_TAP_MAX_CHANNELS];
+    double sum[OBE_TAP_MAX_CHANNELS];
+
+    /* K-weighting, the BS.1770 high shelf then high pass, and the state of each channel */
+    double b[2][3];
+    double a[2][3];
+    double z[OBE_TAP_MAX_CHANNELS][2][2];
+} obe_tap_meter_t;
+
+int  obe_tap_open( obe_t *h );
+void obe_tap_close( obe_t *h );
+
+/* NULL without a tap or an entry for the stream */
+obe_tap_entry_t *obe_tap_entry( obe_t *h, int type, int stream_id );
+
+/* Snapshots a picture once picture_interval has passed since *next_pts, which the caller keeps */
+void obe_tap_picture( obe_t *h, obe_tap_entry_t *entry, int64_t *next_pts, const obe_raw_frame_t *raw_frame );
+
+void obe_tap_meter_open( obe_t *h, obe_tap_meter_t *meter, int stream_id, int num_channels, int sample_rate );
+/* planes are num_channels planes of num_frames samples each */
+void obe_tap_meter( obe_tap_meter_t *meter, const int32_t *planes, int num_frames, int64_t pts );
+
+#endif
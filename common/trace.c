@@ -0,0 +1,220 @@
+/*****************************************************************************
+ * trace.c: timeline tracing
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include <inttypes.h>
+#include <sys/syscall.h>
+
+typedef struct
+{
+    int64_t time; /* ns, CLOCK_MONOTONIC */
+    const char *name;
+    const char *detail;
+    int64_t arg;
+    int type;
+} obe_trace_event_t;
+
+/* Only the owning thread writes a ring. pos counts every event ever written, the dump
+ * reads it before and after copying to tell which events may have been overwritten */
+typedef struct
+{
+    int tid;
+    const char *name;
+    uint64_t pos;
+    obe_trace_event_t events[OBE_TRACE_EVENTS];
+} obe_trace_buf_t;
+
+int obe_trace_enabled;
+
+/* Rings are never freed so the events of threads which have exited can still be dumped */
+static obe_trace_buf_t *trace_bufs[OBE_TRACE_MAX_THREADS];
+static int num_trace_bufs;
+
+static __thread obe_trace_buf_t *thread_buf;
+static __thread const char *thread_name;
+static __thread int thread_full;
+
+void obe_trace_thread_name( const char *name )
+{
+    thread_name = name;
+    if( thread_buf )
+        __atomic_store_n( &thread_buf->name, name, __ATOMIC_RELEASE );
+}
+
+static obe_trace_buf_t *new_trace_buf( void )
+{
+    obe_trace_buf_t *buf;
+    int idx;
+
+    if( thread_full )
+        return NULL;
+
+    buf = calloc( 1, sizeof(*buf) );
+    if( !buf )
+    {
+        syslog( LOG_ERR, "[trace] Malloc failed\n" );
+        thread_full = 1;
+        return NULL;
+    }
+    buf->tid = syscall( SYS_gettid );
+    buf->name = thread_name;
+
+    idx = __atomic_fetch_add( &num_trace_bufs, 1, __ATOMIC_RELAXED );
+    if( idx >= OBE_TRACE_MAX_THREADS )
+    {
+        if( idx == OBE_TRACE_MAX_THREADS )
+            syslog( LOG_WARNING, "[trace] More than %i threads, not tracing the rest\n", OBE_TRACE_MAX_THREADS );
+        free( buf );
+        thread_full = 1;
+        return NULL;
+    }
+
+    __atomic_store_n( &trace_bufs[idx], buf, __ATOMIC_RELEASE );
+
+    return buf;
+}
+
+void obe_trace_event( int type, const char *name, const char *detail, int64_t arg )
+{
+    obe_trace_buf_t *buf = thread_buf;
+    obe_trace_event_t *event;
+    struct timespec ts;
+
+    if( !buf )
+    {
+        buf = thread_buf = new_trace_buf();
+        if( !buf )
+            return;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    event = &buf->events[buf->pos & (OBE_TRACE_EVENTS-1)];
+    event->time = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    event->name = name;
+    event->detail = detail;
+    event->arg = arg;
+    event->type = type;
+    __atomic_store_n( &buf->pos, buf->pos + 1, __ATOMIC_RELEASE );
+}
+
+void obe_trace_enable( int enable )
+{
+    __atomic_store_n( &obe_trace_enabled, !!enable, __ATOMIC_RELAXED );
+}
+
+static void write_json_string( FILE *fp, const char *str )
+{
+    fputc( '"', fp );
+    for( ; str && *str; str++ )
+    {
+        if( *str == '"' || *str == '\\' )
+            fprintf( fp, "\\%c", *str );
+        else if( (unsigned char)*str < 0x20 )
+            fprintf( fp, "\\u%04x", *str );
+        else
+            fputc( *str, fp );
+    }
+    fputc( '"', fp );
+}
+
+int obe_trace_dump( const char *filename )
+{
+    static const char ph[] = { [OBE_TRACE_BEGIN] = 'B', [OBE_TRACE_END] = 'E', [OBE_TRACE_INSTANT] = 'i' };
+    obe_trace_event_t *events;
+    int num_bufs, first = 1;
+    uint64_t copied, start, end, pos;
+    int pid = getpid();
+    FILE *fp;
+
+    /* Copied out of the ring first so the events that were overwritten while writing the file are known */
+    events = malloc( OBE_TRACE_EVENTS * sizeof(*events) );
+    if( !events )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    fp = fopen( filename, "w" );
+    if( !fp )
+    {
+        fprintf( stderr, "Could not open trace file \"%s\"\n", filename );
+        free( events );
+        return -1;
+    }
+
+    fprintf( fp, "{\"traceEvents\":[\n" );
+
+    num_bufs = MIN( __atomic_load_n( &num_trace_bufs, __ATOMIC_RELAXED ), OBE_TRACE_MAX_THREADS );
+    for( int i = 0; i < num_bufs; i++ )
+    {
+        obe_trace_buf_t *buf = __atomic_load_n( &trace_bufs[i], __ATOMIC_ACQUIRE );
+        const char *name;
+
+        /* Still being set up by its thread */
+        if( !buf )
+            continue;
+
+        end = __atomic_load_n( &buf->pos, __ATOMIC_ACQUIRE );
+        copied = end > OBE_TRACE_EVENTS ? end - OBE_TRACE_EVENTS : 0;
+        for( uint64_t j = copied; j < end; j++ )
+            events[j - copied] = buf->events[j & (OBE_TRACE_EVENTS-1)];
+
+        /* What the thread has written since, and the event it may be in the middle of, replaced the oldest ones */
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        pos = __atomic_load_n( &buf->pos, __ATOMIC_RELAXED );
+        start = MAX( copied, pos >= OBE_TRACE_EVENTS ? pos - OBE_TRACE_EVENTS + 1 : 0 );
+
+        name = __atomic_load_n( &buf->name, __ATOMIC_ACQUIRE );
+        fprintf( fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":", first ? "" : ",\n", pid, buf->tid );
+        write_json_string( fp, name ? name : "thread" );
+        fprintf( fp, "}}" );
+        first = 0;
+
+        for( uint64_t j = start; j < end; j++ )
+        {
+            obe_trace_event_t *event = &events[j - copied];
+
+            fprintf( fp, ",\n{\"name\":" );
+            write_json_string( fp, event->name );
+            fprintf( fp, ",\"cat\":" );
+            write_json_string( fp, event->detail ? event->detail : "obe" );
+            fprintf( fp, ",\"ph\":\"%c\",\"ts\":%"PRIi64".%03i,\"pid\":%i,\"tid\":%i", ph[event->type],
+                     event->time / 1000, (int)( event->time % 1000 ), pid, buf->tid );
+            if( event->type == OBE_TRACE_INSTANT )
+                fprintf( fp, ",\"s\":\"t\",\"args\":{\"value\":%"PRIi64"}", event->arg );
+            fprintf( fp, "}" );
+        }
+    }
+
+    fprintf( fp, "\n]}\n" );
+    free( events );
+
+    if( fclose( fp ) )
+    {
+        fprintf( stderr, "Could not write trace file \"%s\"\n", filename );
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*****************************************************************************
+ * trace.h: timeline tracing
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_TRACE_H
+#define OBE_TRACE_H
+
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+/* Each thread records its events into a ring of its own so tracing takes no locks.
+ * The ring only holds the last OBE_TRACE_EVENTS events and is allocated on the
+ * thread's first event after tracing is enabled.
+ *
+ * name is what happened and detail what it happened to, usually a queue or a mutex.
+ * Both must outlive the trace, in practice they are string literals or queue names.
+ *
+ * The same events are USDT probes in the "obe" provider when sys/sdt.h is available.
+ * They are a nop until a tracer such as perf, bpftrace or SystemTap attaches, whether
+ * or not the rings are recording */
+#define OBE_TRACE_EVENTS 32768
+#define OBE_TRACE_MAX_THREADS 256
+
+enum obe_trace_type_e
+{
+    OBE_TRACE_BEGIN,
+    OBE_TRACE_END,
+    OBE_TRACE_INSTANT,
+};
+
+extern int obe_trace_enabled;
+
+void obe_trace_event( int type, const char *name, const char *detail, int64_t arg );
+
+/* Names the calling thread in the trace. Threads made with obe_thread_create are named after their stage */
+void obe_trace_thread_name( const char *name );
+
+#if HAVE_SYS_SDT_H
+#define OBE_TRACE_PROBE( probe, name, detail, arg ) DTRACE_PROBE3( obe, probe, name, detail, arg )
+#else
+#define OBE_TRACE_PROBE( probe, name, detail, arg )
+#endif
+
+#define OBE_TRACE( type, probe, name, detail, arg )\
+do\
+{\
+    OBE_TRACE_PROBE( probe, name, detail, arg );\
+    if( __builtin_expect( __atomic_load_n( &obe_trace_enabled, __ATOMIC_RELAXED ), 0 ) )\
+        obe_trace_event( type, name, detail, arg );\
+} while( 0 )
+
+#define obe_trace_begin( name, detail )        OBE_TRACE( OBE_TRACE_BEGIN, begin, name, detail, 0 )
+#define obe_trace_end( name, detail )          OBE_TRACE( OBE_TRACE_END, end, name, detail, 0 )
+#define obe_trace_instant( name, detail, arg ) OBE_TRACE( OBE_TRACE_INSTANT, instant, name, detail, (int64_t)(arg) )
+
+/* pthread_mutex_lock which traces how long it waited when the mutex was contended */
+static inline void obe_trace_mutex_lock( pthread_mutex_t *mutex, const char *name )
+{
+    if( !pthread_mutex_trylock( mutex ) )
+        return;
+
+    obe_trace_begin( "lock", name );
+    pthread_mutex_lock( mutex );
+    obe_trace_end( "lock", name );
+}
+
+/* pthread_cond_wait traced from going to sleep to getting the mutex back */
+static inline void obe_trace_cond_wait( pthread_cond_t *cond, pthread_mutex_t *mutex, const char *name )
+{
+    obe_trace_begin( "wait", name );
+    pthread_cond_wait( cond, mutex );
+    obe_trace_end( "wait", name );
+}
+
+#endif
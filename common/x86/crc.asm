@@ -0,0 +1,66 @@
+%include "x86inc.asm"
+%include "x86util.asm"
+
+SECTION_RODATA
+
+crc32_bswap: db 15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0
+
+; Constants for P = 0x104c11db7, low qword first
+; x^128 mod P and x^192 mod P fold 16 bytes into the next 16
+crc32_fold: dq 0xe8a45605, 0xc5b9cd4c
+; x^96 mod P and x^64 mod P bring the last 16 bytes down to 64 bits
+crc32_reduce: dq 0xf200aa66, 0x490d678d
+; floor(x^64 / P) and P for the Barrett reduction
+crc32_barrett: dq 0x104d101df, 0x104c11db7
+
+SECTION .text
+
+;
+; uint32_t obe_crc32_mpeg_pclmul( uint32_t crc, const uint8_t *buf, int len )
+; len must be a positive multiple of 16
+; The data is byte swapped so every 16 bytes is one polynomial with the first bit on top.
+; Sections are short so there is a single fold chain rather than several interleaved ones
+;
+
+INIT_XMM
+cglobal crc32_mpeg_pclmul, 3,3
+    mova      m5, [crc32_bswap]
+    mova      m4, [crc32_fold]
+    movd      m0, r0d
+    pslldq    m0, 12
+    movu      m1, [r1]
+    pshufb    m1, m5
+    pxor      m0, m1
+    add       r1, 16
+    sub       r2d, 16
+    jz        .reduce
+.loop
+    movu      m1, [r1]
+    pshufb    m1, m5
+    mova      m2, m0
+    pclmulqdq m0, m4, 0x00
+    pclmulqdq m2, m4, 0x11
+    pxor      m0, m1
+    pxor      m0, m2
+    add       r1, 16
+    sub       r2d, 16
+    jg        .loop
+.reduce
+    ; crc = m0 * x^32 mod P
+    mova      m4, [crc32_reduce]
+    movq      m1, m0
+    pclmulqdq m0, m4, 0x01
+    pslldq    m1, 4
+    pxor      m0, m1
+    movq      m1, m0
+    pclmulqdq m0, m4, 0x11
+    pxor      m0, m1
+    mova      m4, [crc32_barrett]
+    mova      m1, m0
+    psrlq     m1, 32
+    pclmulqdq m1, m4, 0x00
+    psrlq     m1, 32
+    pclmulqdq m1, m4, 0x10
+    pxor      m0, m1
+    movd      eax, m0
+    RET
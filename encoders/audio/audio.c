@@ -0,0 +1,365 @@
+/*****************************************************************************
+ * audio.c : OBE audio encoder worker pool
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ ******************************************************************************/
+
+#include "common/common.h"
+#include "encoders/audio/audio.h"
+#include "encoders/audio/x86/convert.h"
+#include <libavutil/cpu.h>
+
+/* Frames a task encodes before it goes to the back of the run queue */
+#define AUDIO_POOL_BATCH 4
+
+enum audio_task_state_e
+{
+    AUDIO_TASK_IDLE,
+    AUDIO_TASK_QUEUED,
+    AUDIO_TASK_RUNNING,
+};
+
+typedef struct obe_audio_pool_t obe_audio_pool_t;
+
+typedef struct
+{
+    obe_audio_pool_t *pool;
+    obe_encoder_t *encoder;
+    const obe_aud_enc_func_t *func;
+    obe_aud_enc_params_t *enc_params;
+    hnd_t handle;
+    int is_open;
+    int failed;
+
+    /* Protected by the pool mutex */
+    int state;
+    int pending; /* a frame arrived while the task was running */
+} obe_audio_task_t;
+
+struct obe_audio_pool_t
+{
+    obe_t *h;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cv;
+    int cancel;
+
+    int num_threads;
+    pthread_t threads[AUDIO_POOL_MAX_THREADS];
+
+    /* Tasks with frames waiting. A task is on here at most once */
+    obe_queue_t run_queue;
+
+    int num_tasks;
+    obe_audio_task_t *tasks[MAX_STREAMS];
+};
+
+/* Needs the pool mutex */
+static void queue_task( obe_audio_pool_t *pool, obe_audio_task_t *task )
+{
+    task->state = AUDIO_TASK_QUEUED;
+    task->pending = 0;
+    obe_queue_push( &pool->run_queue, task );
+    pthread_cond_signal( &pool->cv );
+}
+
+/* Returns the number of frames taken off the encoder's queue */
+static int run_task( obe_audio_task_t *task )
+{
+    obe_encoder_t *encoder = task->encoder;
+    obe_raw_frame_t *raw_frame;
+    int num_frames, ret;
+
+    if( !task->is_open )
+    {
+        task->handle = task->func->open_encoder( task->enc_params );
+        task->failed = !task->handle;
+        task->is_open = 1;
+        if( task->failed )
+            syslog( LOG_ERR, "Could not open audio encoder for stream %i\n", encoder->stream_id );
+    }
+
+    for( num_frames = 0; num_frames < AUDIO_POOL_BATCH; num_frames++ )
+    {
+        pthread_mutex_lock( &encoder->encoder_mutex );
+        raw_frame = obe_queue_pop( &encoder->queue );
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        if( !raw_frame )
+            break;
+
+        /* Keep the queue drained so the input doesn't see it overflow */
+        if( task->failed )
+        {
+            raw_frame->release_data( raw_frame );
+            raw_frame->release_frame( raw_frame );
+        }
+        else
+        {
+            obe_trace_begin( "encode", "audio" );
+            ret = task->func->encode_frame( task->handle, raw_frame );
+            obe_trace_end( "encode", "audio" );
+            if( ret < 0 )
+            {
+                syslog( LOG_ERR, "Audio encoder for stream %i failed\n", encoder->stream_id );
+                task->failed = 1;
+            }
+        }
+    }
+
+    return num_frames;
+}
+
+static void *start_worker( void *ptr )
+{
+    obe_audio_pool_t *pool = ptr;
+    obe_audio_task_t *task;
+    int num_frames;
+
+    pthread_mutex_lock( &pool->mutex );
+    while( 1 )
+    {
+        while( !pool->cancel && !pool->run_queue.size )
+            obe_trace_cond_wait( &pool->cv, &pool->mutex, "audio pool" );
+
+        if( pool->cancel )
+            break;
+
+        task = obe_queue_pop( &pool->run_queue );
+        task->state = AUDIO_TASK_RUNNING;
+        task->pending = 0;
+        pthread_mutex_unlock( &pool->mutex );
+
+        num_frames = run_task( task );
+
+        pthread_mutex_lock( &pool->mutex );
+        if( task->pending || num_frames == AUDIO_POOL_BATCH )
+            queue_task( pool, task );
+        else
+            task->state = AUDIO_TASK_IDLE;
+    }
+    pthread_mutex_unlock( &pool->mutex );
+
+    return NULL;
+}
+
+hnd_t obe_audio_pool_open( obe_t *h, int num_threads )
+{
+    obe_audio_pool_t *pool = calloc( 1, sizeof(*pool) );
+    if( !pool )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    pool->h = h;
+    pthread_mutex_init( &pool->mutex, NULL );
+    pthread_cond_init( &pool->cv, NULL );
+
+    if( obe_queue_init( &pool->run_queue, "audio pool", MAX_STREAMS, 0 ) < 0 )
+        goto fail;
+
+    num_threads = MIN( MAX( num_threads, 1 ), AUDIO_POOL_MAX_THREADS );
+    for( ; pool->num_threads < num_threads; pool->num_threads++ )
+    {
+        if( obe_thread_create( h, &pool->threads[pool->num_threads], OBE_THREAD_AUDIO_ENCODER, -1, start_worker, pool ) < 0 )
+        {
+            fprintf( stderr, "Couldn't create audio encode thread\n" );
+            goto fail;
+        }
+    }
+
+    return pool;
+
+fail:
+    obe_audio_pool_close( pool );
+    return NULL;
+}
+
+int obe_audio_pool_add( hnd_t handle, const obe_aud_enc_func_t *func, obe_aud_enc_params_t *enc_params )
+{
+    obe_audio_pool_t *pool = handle;
+    obe_audio_task_t *task;
+
+    task = calloc( 1, sizeof(*task) );
+    if( !task )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( enc_params );
+        return -1;
+    }
+
+    task->pool = pool;
+    task->encoder = enc_params->encoder;
+    task->func = func;
+    task->enc_params = enc_params;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->tasks[pool->num_tasks++] = task;
+    task->encoder->pool_task = task;
+    /* The encoder is opened on a worker straight away */
+    queue_task( pool, task );
+    pthread_mutex_unlock( &pool->mutex );
+
+    return 0;
+}
+
+void obe_audio_pool_schedule( hnd_t handle )
+{
+    obe_audio_task_t *task = handle;
+    obe_audio_pool_t *pool = task->pool;
+
+    pthread_mutex_lock( &pool->mutex );
+    if( task->state == AUDIO_TASK_IDLE )
+        queue_task( pool, task );
+    else if( task->state == AUDIO_TASK_RUNNING )
+        task->pending = 1;
+    pthread_mutex_unlock( &pool->mutex );
+}
+
+void obe_audio_pool_close( hnd_t handle )
+{
+    obe_audio_pool_t *pool = handle;
+    obe_audio_task_t *task;
+
+    if( !pool )
+        return;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->cancel = 1;
+    pthread_cond_broadcast( &pool->cv );
+    pthread_mutex_unlock( &pool->mutex );
+
+    for( int i = 0; i < pool->num_threads; i++ )
+        pthread_join( pool->threads[i], NULL );
+
+    for( int i = 0; i < pool->num_tasks; i++ )
+    {
+        task = pool->tasks[i];
+        if( task->handle )
+            task->func->close_encoder( task->handle );
+        task->encoder->pool_task = NULL;
+        free( task->enc_params );
+        free( task );
+    }
+
+    obe_queue_destroy( &pool->run_queue );
+    pthread_mutex_destroy( &pool->mutex );
+    pthread_cond_destroy( &pool->cv );
+    free( pool );
+}
+
+#define S32_TO_FLT_SCALE ( 1.0f / 2147483648.0f )
+
+void obe_s32_to_flt_c( float *dst, const int32_t *src, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] = src[i] * S32_TO_FLT_SCALE;
+}
+
+void obe_s32_to_s16_c( int16_t *dst, const int32_t *src, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] = src[i] >> 16;
+}
+
+void obe_s32_to_fltp_2ch_c( float *dst0, float *dst1, const int32_t *src, int num_frames )
+{
+    for( int i = 0; i < num_frames; i++ )
+    {
+        dst0[i] = src[2*i]   * S32_TO_FLT_SCALE;
+        dst1[i] = src[2*i+1] * S32_TO_FLT_SCALE;
+    }
+}
+
+void obe_s32_to_s16p_2ch_c( int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames )
+{
+    for( int i = 0; i < num_frames; i++ )
+    {
+        dst0[i] = src[2*i]   >> 16;
+        dst1[i] = src[2*i+1] >> 16;
+    }
+}
+
+void obe_audio_conv_init( obe_audio_conv_t *conv )
+{
+    int cpu_flags = obe_get_cpu_flags();
+
+    conv->s32_to_flt = obe_s32_to_flt_c;
+    conv->s32_to_s16 = obe_s32_to_s16_c;
+    conv->s32_to_fltp_2ch = obe_s32_to_fltp_2ch_c;
+    conv->s32_to_s16p_2ch = obe_s32_to_s16p_2ch_c;
+    conv->flt_step = conv->s16_step = conv->fltp_step = conv->s16p_step = 1;
+
+    if( cpu_flags & AV_CPU_FLAG_SSE2 )
+    {
+        conv->s32_to_flt = obe_s32_to_flt_sse2;
+        conv->flt_step = 4;
+        conv->s32_to_s16 = obe_s32_to_s16_sse2;
+        conv->s16_step = 8;
+        conv->s32_to_fltp_2ch = obe_s32_to_fltp_2ch_sse2;
+        conv->fltp_step = 4;
+        conv->s32_to_s16p_2ch = obe_s32_to_s16p_2ch_sse2;
+        conv->s16p_step = 8;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        conv->s32_to_flt = obe_s32_to_flt_avx2;
+        conv->flt_step = 8;
+        conv->s32_to_fltp_2ch = obe_s32_to_fltp_2ch_avx2;
+        conv->fltp_step = 8;
+    }
+}
+
+void obe_audio_conv_flt( const obe_audio_conv_t *conv, float *dst, const int32_t *src, int len )
+{
+    int simd_len = len / conv->flt_step * conv->flt_step;
+
+    if( simd_len )
+        conv->s32_to_flt( dst, src, simd_len );
+    obe_s32_to_flt_c( dst + simd_len, src + simd_len, len - simd_len );
+}
+
+void obe_audio_conv_s16( const obe_audio_conv_t *conv, int16_t *dst, const int32_t *src, int len )
+{
+    int simd_len = len / conv->s16_step * conv->s16_step;
+
+    if( simd_len )
+        conv->s32_to_s16( dst, src, simd_len );
+    obe_s32_to_s16_c( dst + simd_len, src + simd_len, len - simd_len );
+}
+
+void obe_audio_conv_fltp_2ch( const obe_audio_conv_t *conv, float *dst0, float *dst1, const int32_t *src, int num_frames )
+{
+    int simd_frames = num_frames / conv->fltp_step * conv->fltp_step;
+
+    if( simd_frames )
+        conv->s32_to_fltp_2ch( dst0, dst1, src, simd_frames );
+    obe_s32_to_fltp_2ch_c( dst0 + simd_frames, dst1 + simd_frames, src + 2*simd_frames, num_frames - simd_frames );
+}
+
+void obe_audio_conv_s16p_2ch( const obe_audio_conv_t *conv, int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames )
+{
+    int simd_frames = num_frames / conv->s16p_step * conv->s16p_step;
+
+    if( simd_frames )
+        conv->s32_to_s16p_2ch( dst0, dst1, src, simd_frames );
+    obe_s32_to_s16p_2ch_c( dst0 + simd_frames, dst1 + simd_frames, src + 2*simd_frames, num_frames - simd_frames );
+}
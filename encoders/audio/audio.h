@@ -26,13 +26,6 @@
 
 #include <libavutil/samplefmt.h>
 
-#define OBE_MAX_CHANNELS 8
-
-typedef struct
-{
-    void* (*start_encoder)( void *ptr );
-} obe_aud_enc_func_t;
-
 typedef struct
 {
     obe_t *h;
@@ -43,6 +36,7 @@ typedef struct
     int bitrate;
     int sample_rate;
     int num_channels;
+    int64_t channel_layout;
     int frames_per_pes;
 
     // TODO ac3 opts
@@ -50,6 +44,47 @@ typedef struct
 
 } obe_aud_enc_params_t;
 
+/* Audio encoders are tasks on a shared pool of worker threads. Frames for an encoder are only
+ * ever encoded by one worker at a time so each stream stays in order.
+ * open_encoder runs on a worker when the pool starts and returns NULL on failure.
+ * encode_frame always releases the raw frame and returns -1 if the encoder can't continue */
+typedef struct
+{
+    hnd_t (*open_encoder)( obe_aud_enc_params_t *enc_params );
+    int   (*encode_frame)( hnd_t handle, obe_raw_frame_t *raw_frame );
+    void  (*close_encoder)( hnd_t handle );
+} obe_aud_enc_func_t;
+
+#define AUDIO_POOL_MAX_THREADS 4
+
+hnd_t obe_audio_pool_open( obe_t *h, int num_threads );
+/* The pool owns enc_params from here on */
+int   obe_audio_pool_add( hnd_t pool, const obe_aud_enc_func_t *func, obe_aud_enc_params_t *enc_params );
+/* Called once a frame has been queued for a pooled encoder */
+void  obe_audio_pool_schedule( hnd_t task );
+/* Stops the workers and closes every encoder */
+void  obe_audio_pool_close( hnd_t pool );
+
+/* Conversion of the 32-bit interleaved input to the encoders' sample formats.
+ * The SIMD versions do whole steps and the wrappers below finish the rest in C */
+typedef struct
+{
+    void (*s32_to_flt)( float *dst, const int32_t *src, int len );
+    int flt_step;
+    void (*s32_to_s16)( int16_t *dst, const int32_t *src, int len );
+    int s16_step;
+    void (*s32_to_fltp_2ch)( float *dst0, float *dst1, const int32_t *src, int num_frames );
+    int fltp_step;
+    void (*s32_to_s16p_2ch)( int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames );
+    int s16p_step;
+} obe_audio_conv_t;
+
+void obe_audio_conv_init( obe_audio_conv_t *conv );
+void obe_audio_conv_flt( const obe_audio_conv_t *conv, float *dst, const int32_t *src, int len );
+void obe_audio_conv_s16( const obe_audio_conv_t *conv, int16_t *dst, const int32_t *src, int len );
+void obe_audio_conv_fltp_2ch( const obe_audio_conv_t *conv, float *dst0, float *dst1, const int32_t *src, int num_frames );
+void obe_audio_conv_s16p_2ch( const obe_audio_conv_t *conv, int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames );
+
 extern const obe_aud_enc_func_t twolame_encoder;
 extern const obe_aud_enc_func_t lavc_encoder;
 
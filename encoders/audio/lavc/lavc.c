@@ -23,10 +23,17 @@
 
 #include "common/common.h"
 #include "common/lavc.h"
+#include "common/bitstream.h"
 #include "encoders/audio/audio.h"
-#include <libavutil/fifo.h>
-#include <libavcodec/audioconvert.h>
-#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/audioconvert.h>
+#include <math.h>
+
+/* LATM carries the StreamMuxConfig this often, like libavformat's muxer */
+#define LATM_CONFIG_INTERVAL 20
+
+/* Room for an ADTS header or a LATM header, config and length bytes, plus bs_t's last store */
+#define AAC_HEADER_MAX 32
 
 typedef struct
 {
@@ -42,65 +49,79 @@ static const lavc_encoder_t lavc_encoders[] =
     { -1, -1 },
 };
 
-static void *start_encoder( void *ptr )
+typedef struct
 {
-    obe_aud_enc_params_t *enc_params = ptr;
-    obe_t *h = enc_params->h;
-    obe_encoder_t *encoder = enc_params->encoder;
-    obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
-    int64_t cur_pts = -1;
-    int i, frame_size = 0, ret, frame_samples_size, is_latm, got_pkt;
-    void *audio_buf = NULL, *samples = NULL;
-    AVFifoBuffer *in_fifo = NULL, *out_fifo = NULL;
-    uint8_t *avio_buf = NULL;
-    AVAudioConvert *audio_conv = NULL;
-    AVFormatContext *fmt = NULL;
-    AVStream *st = NULL;
-    AVPacket pkt;
-    AVIOContext *avio = NULL;
-    AVCodecContext *codec = NULL;
-    AVFrame frame;;
+    obe_aud_enc_params_t *enc_params;
+    AVCodecContext *codec;
+    AVFrame frame;
+    int64_t cur_pts;
+
+    /* One encoder frame of samples in the encoder's format, filled straight from the input */
+    int num_channels;
+    int planar;
+    int out_fmt; /* packed equivalent of the encoder's format */
+    int out_stride;
+    int plane_size;
+    uint8_t *planes[OBE_MAX_CHANNELS];
+    int buffered; /* samples per channel */
+    obe_audio_conv_t conv;
+
+    /* Inputs which aren't 32-bit are widened a chunk at a time first */
+    int32_t *widen_buf;
+
+    /* AC-3 frames are gathered into a PES-sized coded frame */
+    int frame_size;
+    obe_coded_frame_t *pes_frame;
+    int pes_len;
+
+    /* AAC AudioSpecificConfig */
+    int object_type;
+    int sample_rate_index;
+    int channel_config;
+    uint8_t asc[2];
+    int latm_counter;
+} lavc_ctx_t;
+
+static void close_encoder( hnd_t handle )
+{
+    lavc_ctx_t *ctx = handle;
 
-    avcodec_register_all();
+    if( ctx->pes_frame )
+        destroy_coded_frame( ctx->pes_frame );
 
-    /* AAC audio needs ADTS or LATM encapsulation */
-    if( enc_params->output_format == AUDIO_AAC )
+    if( ctx->planes[0] )
+        av_free( ctx->planes[0] );
+
+    if( ctx->widen_buf )
+        free( ctx->widen_buf );
+
+    if( ctx->codec )
     {
-        is_latm = enc_params->aac_opts.latm_output;
-        av_register_all();
+        avcodec_close( ctx->codec );
+        av_free( ctx->codec );
+    }
 
-        fmt = avformat_alloc_context();
-        if( !fmt )
-        {
-            fprintf( stderr, "Malloc failed\n" );
-            goto finish;
-        }
+    free( ctx );
+}
 
-        fmt->oformat = av_guess_format( is_latm ? "latm" : "adts", NULL, NULL );
-        if( !fmt->oformat )
-        {
-            fprintf( stderr, "ADTS muxer not found\n" );
-            goto finish;
-        }
+static hnd_t open_encoder( obe_aud_enc_params_t *enc_params )
+{
+    obe_encoder_t *encoder = enc_params->encoder;
+    lavc_ctx_t *ctx;
+    AVCodec *enc;
+    int i;
 
-        st = avformat_new_stream( fmt, NULL );
-        if( !st )
-        {
-            fprintf( stderr, "Malloc failed\n" );
-            goto finish;
-        }
-        codec = st->codec;
-    }
-    else
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
     {
-        codec = avcodec_alloc_context3( NULL );
-        if( !codec )
-        {
-            fprintf( stderr, "Malloc failed\n" );
-            goto finish;
-        }
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
     }
+    ctx->enc_params = enc_params;
+    ctx->cur_pts = -1;
+    ctx->num_channels = enc_params->num_channels;
+
+    avcodec_register_all();
 
     for( i = 0; lavc_encoders[i].obe_name != -1; i++ )
     {
@@ -111,34 +132,85 @@ static void *start_encoder( void *ptr )
     if( lavc_encoders[i].obe_name == -1 )
     {
         fprintf( stderr, "[lavc] Could not find encoder1\n" );
-        goto finish;
+        goto fail;
     }
 
-    AVCodec *enc = avcodec_find_encoder( lavc_encoders[i].lavc_name );
+    enc = avcodec_find_encoder( lavc_encoders[i].lavc_name );
     if( !enc )
     {
         fprintf( stderr, "[lavc] Could not find encoder2\n" );
-        goto finish;
+        goto fail;
     }
 
     if( enc->sample_fmts[0] == -1 )
     {
         fprintf( stderr, "[lavc] No valid sample formats\n" );
-        goto finish;
+        goto fail;
+    }
+
+    ctx->planar = av_sample_fmt_is_planar( enc->sample_fmts[0] );
+    ctx->out_fmt = av_get_packed_sample_fmt( enc->sample_fmts[0] );
+    if( ctx->out_fmt != AV_SAMPLE_FMT_S16 && ctx->out_fmt != AV_SAMPLE_FMT_S32 && ctx->out_fmt != AV_SAMPLE_FMT_FLT )
+    {
+        fprintf( stderr, "[lavc] Unsupported encoder sample format\n" );
+        goto fail;
+    }
+
+    if( enc_params->sample_format != AV_SAMPLE_FMT_U8  && enc_params->sample_format != AV_SAMPLE_FMT_S16 &&
+        enc_params->sample_format != AV_SAMPLE_FMT_S32 && enc_params->sample_format != AV_SAMPLE_FMT_FLT &&
+        enc_params->sample_format != AV_SAMPLE_FMT_DBL && enc_params->sample_format != AV_SAMPLE_FMT_S32P )
+    {
+        fprintf( stderr, "[lavc] Unsupported input sample format\n" );
+        goto fail;
     }
 
-    codec->sample_rate = enc_params->sample_rate;
-    codec->bit_rate = enc_params->bitrate * 1000;
-    codec->sample_fmt = enc->sample_fmts[0];
-    codec->channels = enc_params->num_channels;
-    codec->channel_layout = AV_CH_LAYOUT_STEREO;
-    codec->time_base.num = 1;
-    codec->time_base.den = OBE_CLOCK;
+    if( ctx->num_channels < 1 || ctx->num_channels > OBE_MAX_CHANNELS )
+    {
+        fprintf( stderr, "[lavc] Unsupported number of channels\n" );
+        goto fail;
+    }
 
-    if( avcodec_open2( codec, enc, NULL ) < 0 )
+    ctx->codec = avcodec_alloc_context3( NULL );
+    if( !ctx->codec )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto fail;
+    }
+
+    ctx->codec->sample_rate = enc_params->sample_rate;
+    ctx->codec->bit_rate = enc_params->bitrate * 1000;
+    ctx->codec->sample_fmt = enc->sample_fmts[0];
+    ctx->codec->channels = enc_params->num_channels;
+    ctx->codec->channel_layout = enc_params->channel_layout;
+    ctx->codec->time_base.num = 1;
+    ctx->codec->time_base.den = OBE_CLOCK;
+    /* The AudioSpecificConfig is needed to write the ADTS and LATM headers */
+    if( enc_params->output_format == AUDIO_AAC )
+        ctx->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+    if( avcodec_open2( ctx->codec, enc, NULL ) < 0 )
     {
         fprintf( stderr, "[lavc] Could not open encoder\n" );
-        goto finish;
+        goto fail;
+    }
+
+    if( enc_params->output_format == AUDIO_AAC )
+    {
+        if( ctx->codec->extradata_size < 2 )
+        {
+            fprintf( stderr, "[lavc] AAC encoder did not return an AudioSpecificConfig\n" );
+            goto fail;
+        }
+        ctx->asc[0] = ctx->codec->extradata[0];
+        ctx->asc[1] = ctx->codec->extradata[1];
+        ctx->object_type = ctx->asc[0] >> 3;
+        ctx->sample_rate_index = ( ( ctx->asc[0] & 7 ) << 1 ) | ( ctx->asc[1] >> 7 );
+        ctx->channel_config = ( ctx->asc[1] >> 3 ) & 0xf;
+        if( ctx->object_type < 1 || ctx->object_type > 4 || ctx->sample_rate_index > 12 || !ctx->channel_config )
+        {
+            fprintf( stderr, "[lavc] AAC configuration can't be signalled in ADTS or LATM\n" );
+            goto fail;
+        }
     }
 
     /* The number of samples per E-AC3 frame is unknown until the encoder is ready */
@@ -146,224 +218,367 @@ static void *start_encoder( void *ptr )
     {
         pthread_mutex_lock( &encoder->encoder_mutex );
         encoder->is_ready = 1;
-        encoder->num_samples = codec->frame_size;
+        encoder->num_samples = ctx->codec->frame_size;
         /* Broadcast because input and muxer can be stuck waiting for encoder */
         pthread_cond_broadcast( &encoder->encoder_cv );
         pthread_mutex_unlock( &encoder->encoder_mutex );
     }
 
-    int in_stride = av_get_bytes_per_sample( enc_params->sample_format );
-    int out_stride = av_get_bytes_per_sample( enc->sample_fmts[0] );
+    if( enc_params->output_format == AUDIO_AC_3 )
+        ctx->frame_size = (double)ctx->codec->frame_size * 125 * enc_params->bitrate *
+                          enc_params->frames_per_pes / enc_params->sample_rate;
+
+    ctx->out_stride = av_get_bytes_per_sample( ctx->out_fmt );
+    ctx->plane_size = ctx->codec->frame_size * ctx->out_stride * ( ctx->planar ? 1 : ctx->num_channels );
 
-    in_fifo = av_fifo_alloc( OBE_MAX_CHANNELS * codec->frame_size * in_stride * 2 );
-    if( !in_fifo )
+    ctx->planes[0] = av_malloc( ctx->plane_size * ( ctx->planar ? ctx->num_channels : 1 ) );
+    if( !ctx->planes[0] )
     {
         fprintf( stderr, "Malloc failed\n" );
-        goto finish;
+        goto fail;
     }
 
-    if( enc_params->output_format == AUDIO_AC_3 )
+    avcodec_get_frame_defaults( &ctx->frame );
+    ctx->frame.data[0] = ctx->planes[0];
+    for( i = 1; ctx->planar && i < ctx->num_channels; i++ )
     {
-        frame_size = (double)codec->frame_size * 125 * enc_params->bitrate *
-                     enc_params->frames_per_pes / enc_params->sample_rate;
-        out_fifo = av_fifo_alloc( frame_size );
-        if( !out_fifo )
+        ctx->planes[i] = ctx->planes[0] + i * ctx->plane_size;
+        ctx->frame.data[i] = ctx->planes[i];
+    }
+    ctx->frame.linesize[0] = ctx->plane_size;
+    ctx->frame.nb_samples = ctx->codec->frame_size;
+
+    if( enc_params->sample_format != AV_SAMPLE_FMT_S32 && enc_params->sample_format != AV_SAMPLE_FMT_S32P )
+    {
+        ctx->widen_buf = malloc( ctx->codec->frame_size * ctx->num_channels * sizeof(*ctx->widen_buf) );
+        if( !ctx->widen_buf )
         {
             fprintf( stderr, "Malloc failed\n" );
-            goto finish;
+            goto fail;
         }
     }
 
-    /* This works on "planar" audio so pretend it's just one audio plane */
-    audio_conv = av_audio_convert_alloc( enc->sample_fmts[0], 1, enc_params->sample_format, 1, NULL, 0 );
-    if( !audio_conv )
-    {
-        fprintf( stderr, "Malloc failed\n" );
-        goto finish;
-    }
+    obe_audio_conv_init( &ctx->conv );
+
+    return ctx;
+
+fail:
+    close_encoder( ctx );
+    return NULL;
+}
 
-    frame_samples_size = codec->frame_size * enc_params->num_channels * out_stride;
+static void widen_to_s32( int32_t *dst, const uint8_t *src, int sample_fmt, int len )
+{
+    double sample;
 
-    samples = malloc( frame_samples_size );
-    if( !samples )
+    for( int i = 0; i < len; i++ )
     {
-        fprintf( stderr, "Malloc failed\n" );
-        goto finish;
+        if( sample_fmt == AV_SAMPLE_FMT_U8 )
+            dst[i] = ( src[i] - 0x80 ) * ( 1 << 24 );
+        else if( sample_fmt == AV_SAMPLE_FMT_S16 )
+            dst[i] = ((const int16_t*)src)[i] * ( 1 << 16 );
+        else
+        {
+            sample = sample_fmt == AV_SAMPLE_FMT_FLT ? ((const float*)src)[i] : ((const double*)src)[i];
+            sample = lrint( sample * 2147483648.0 );
+            dst[i] = sample < INT32_MIN ? INT32_MIN : sample > INT32_MAX ? INT32_MAX : sample;
+        }
     }
+}
 
-    avcodec_get_frame_defaults( &frame );
+/* Converts interleaved 32-bit samples into the frame buffer, splitting channels into planes if needed */
+static void write_samples( lavc_ctx_t *ctx, const int32_t *src, int num_frames )
+{
+    int ch = ctx->num_channels, pos = ctx->buffered;
 
-    while( 1 )
+    if( !ctx->planar || ch == 1 )
     {
-        /* TODO: detect bitrate or channel reconfig */
-        pthread_mutex_lock( &encoder->encoder_mutex );
-        if( encoder->cancel_thread )
+        if( ctx->out_fmt == AV_SAMPLE_FMT_FLT )
+            obe_audio_conv_flt( &ctx->conv, (float*)ctx->planes[0] + pos * ch, src, num_frames * ch );
+        else if( ctx->out_fmt == AV_SAMPLE_FMT_S16 )
+            obe_audio_conv_s16( &ctx->conv, (int16_t*)ctx->planes[0] + pos * ch, src, num_frames * ch );
+        else
+            memcpy( (int32_t*)ctx->planes[0] + pos * ch, src, num_frames * ch * sizeof(*src) );
+    }
+    else if( ch == 2 && ctx->out_fmt == AV_SAMPLE_FMT_FLT )
+        obe_audio_conv_fltp_2ch( &ctx->conv, (float*)ctx->planes[0] + pos, (float*)ctx->planes[1] + pos, src, num_frames );
+    else if( ch == 2 && ctx->out_fmt == AV_SAMPLE_FMT_S16 )
+        obe_audio_conv_s16p_2ch( &ctx->conv, (int16_t*)ctx->planes[0] + pos, (int16_t*)ctx->planes[1] + pos, src, num_frames );
+    else
+    {
+        for( int c = 0; c < ch; c++ )
         {
-            pthread_mutex_unlock( &encoder->encoder_mutex );
-            goto finish;
+            for( int i = 0; i < num_frames; i++ )
+            {
+                if( ctx->out_fmt == AV_SAMPLE_FMT_FLT )
+                    ((float*)ctx->planes[c])[pos+i] = src[i*ch+c] * ( 1.0f / 2147483648.0f );
+                else if( ctx->out_fmt == AV_SAMPLE_FMT_S16 )
+                    ((int16_t*)ctx->planes[c])[pos+i] = src[i*ch+c] >> 16;
+                else
+                    ((int32_t*)ctx->planes[c])[pos+i] = src[i*ch+c];
+            }
         }
+    }
+
+    ctx->buffered += num_frames;
+}
 
-        if( !encoder->num_raw_frames )
-            pthread_cond_wait( &encoder->encoder_cv, &encoder->encoder_mutex );
+/* Converts 32-bit planes into the frame buffer, interleaving them if the encoder wants packed samples */
+static void write_planar_samples( lavc_ctx_t *ctx, int32_t **src, int offset, int num_frames )
+{
+    int ch = ctx->num_channels, pos = ctx->buffered;
 
-        if( encoder->cancel_thread )
+    if( ctx->planar || ch == 1 )
+    {
+        for( int c = 0; c < ch; c++ )
         {
-            pthread_mutex_unlock( &encoder->encoder_mutex );
-            goto finish;
+            if( ctx->out_fmt == AV_SAMPLE_FMT_FLT )
+                obe_audio_conv_flt( &ctx->conv, (float*)ctx->planes[c] + pos, src[c] + offset, num_frames );
+            else if( ctx->out_fmt == AV_SAMPLE_FMT_S16 )
+                obe_audio_conv_s16( &ctx->conv, (int16_t*)ctx->planes[c] + pos, src[c] + offset, num_frames );
+            else
+                memcpy( (int32_t*)ctx->planes[c] + pos, src[c] + offset, num_frames * sizeof(**src) );
+        }
+    }
+    else
+    {
+        for( int c = 0; c < ch; c++ )
+        {
+            for( int i = 0; i < num_frames; i++ )
+            {
+                if( ctx->out_fmt == AV_SAMPLE_FMT_FLT )
+                    ((float*)ctx->planes[0])[(pos+i)*ch+c] = src[c][offset+i] * ( 1.0f / 2147483648.0f );
+                else if( ctx->out_fmt == AV_SAMPLE_FMT_S16 )
+                    ((int16_t*)ctx->planes[0])[(pos+i)*ch+c] = src[c][offset+i] >> 16;
+                else
+                    ((int32_t*)ctx->planes[0])[(pos+i)*ch+c] = src[c][offset+i];
+            }
         }
+    }
 
-        raw_frame = encoder->frames[0];
-        pthread_mutex_unlock( &encoder->encoder_mutex );
+    ctx->buffered += num_frames;
+}
 
-        if( cur_pts == -1 )
-            cur_pts = raw_frame->pts;
+static void write_adts( lavc_ctx_t *ctx, obe_coded_frame_t *coded_frame, AVPacket *pkt )
+{
+    bs_t s;
+
+    bs_init( &s, coded_frame->data, AAC_HEADER_MAX );
+    bs_write( &s, 12, 0xfff );   // syncword
+    bs_write1( &s, 0 );          // ID (MPEG-4)
+    bs_write( &s, 2, 0 );        // layer
+    bs_write1( &s, 1 );          // protection_absent
+    bs_write( &s, 2, ctx->object_type - 1 ); // profile_ObjectType
+    bs_write( &s, 4, ctx->sample_rate_index );
+    bs_write1( &s, 0 );          // private_bit
+    bs_write( &s, 3, ctx->channel_config );
+    bs_write1( &s, 0 );          // original_copy
+    bs_write1( &s, 0 );          // home
+    bs_write1( &s, 0 );          // copyright_identification_bit
+    bs_write1( &s, 0 );          // copyright_identification_start
+    bs_write( &s, 13, 7 + pkt->size ); // aac_frame_length
+    bs_write( &s, 11, 0x7ff );   // adts_buffer_fullness (VBR)
+    bs_write( &s, 2, 0 );        // number_of_raw_data_blocks_in_frame
+    bs_flush( &s );
+
+    memcpy( coded_frame->data + 7, pkt->data, pkt->size );
+    coded_frame->len = 7 + pkt->size;
+}
 
-        in_stride = av_get_bytes_per_sample( raw_frame->sample_fmt );
-        int num_samples = raw_frame->len / in_stride;
-        int sample_bytes = num_samples * out_stride;
-        int istride[6] = { in_stride };
-        int ostride[6] = { out_stride };
-        const void *ibuf[6] = { raw_frame->data };
+/* AudioMuxElement in a LOAS AudioSyncStream. The payload isn't byte aligned after the header */
+static void write_latm( lavc_ctx_t *ctx, obe_coded_frame_t *coded_frame, AVPacket *pkt )
+{
+    bs_t s;
+    int i, len;
 
-        audio_buf = av_malloc( sample_bytes );
-        if( !audio_buf )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto finish;
-        }
+    bs_init( &s, coded_frame->data, coded_frame->len );
+    bs_write( &s, 11, 0x2b7 );   // syncword
+    bs_write( &s, 13, 0 );       // audioMuxLengthBytes, filled in below
 
-        void *obuf[6] = { audio_buf };
+    bs_write1( &s, !!ctx->latm_counter ); // useSameStreamMux
+    if( !ctx->latm_counter )
+    {
+        /* StreamMuxConfig */
+        bs_write1( &s, 0 );      // audioMuxVersion
+        bs_write1( &s, 1 );      // allStreamsSameTimeFraming
+        bs_write( &s, 6, 0 );    // numSubFrames
+        bs_write( &s, 4, 0 );    // numProgram
+        bs_write( &s, 3, 0 );    // numLayer
+        bs_write( &s, 8, ctx->asc[0] ); // AudioSpecificConfig
+        bs_write( &s, 8, ctx->asc[1] );
+        bs_write( &s, 3, 0 );    // frameLengthType
+        bs_write( &s, 8, 0xff ); // latmBufferFullness
+        bs_write1( &s, 0 );      // otherDataPresent
+        bs_write1( &s, 0 );      // crcCheckPresent
+    }
+    ctx->latm_counter = ( ctx->latm_counter + 1 ) % LATM_CONFIG_INTERVAL;
 
-        if( av_audio_convert( audio_conv, obuf, ostride, ibuf, istride, num_samples ) < 0 )
-        {
-            syslog( LOG_ERR, "[lavc] Could not convert audio sample format\n" );
-            goto finish;
-        }
+    /* PayloadLengthInfo */
+    for( i = 0; i + 255 <= pkt->size; i += 255 )
+        bs_write( &s, 8, 255 );
+    bs_write( &s, 8, pkt->size - i );
 
-        if( av_fifo_realloc2( in_fifo, av_fifo_size( in_fifo ) + sample_bytes ) < 0 )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto finish;
-        }
+    bs_write_bytes( &s, pkt->data, pkt->size );
 
-        av_fifo_generic_write( in_fifo, audio_buf, sample_bytes, NULL );
-        av_freep( &audio_buf );
+    bs_align_0( &s );
 
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
-        remove_frame_from_encode_queue( encoder );
+    len = bs_pos( &s ) / 8;
+    coded_frame->data[1] = ( coded_frame->data[1] & 0xe0 ) | ( ( len - 3 ) >> 8 );
+    coded_frame->data[2] = len - 3;
+    coded_frame->len = len;
+}
 
-        av_init_packet( &pkt );
+static int send_frame( lavc_ctx_t *ctx, obe_coded_frame_t *coded_frame )
+{
+    obe_aud_enc_params_t *enc_params = ctx->enc_params;
 
-        while( av_fifo_size( in_fifo ) >= frame_samples_size )
-        {
-            av_fifo_generic_read( in_fifo, samples, frame_samples_size, NULL );
+    coded_frame->pts = ctx->cur_pts;
+    coded_frame->random_access = 1; /* Every frame output is a random access point */
+    if( add_to_mux_queue( enc_params->h, coded_frame ) < 0 )
+        destroy_coded_frame( coded_frame );
 
-            frame.data[0] = samples;
-            frame.linesize[0] = frame_samples_size;
-            frame.nb_samples = codec->frame_size;
+    /* We need to generate PTS because frame sizes have changed */
+    ctx->cur_pts += (double)ctx->codec->frame_size * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
 
-            pkt.data = NULL;
-            pkt.size = 0;
+    return 0;
+}
 
-            ret = avcodec_encode_audio2( codec, &pkt, &frame, &got_pkt );
-            if( ret < 0 )
-            {
-                syslog( LOG_ERR, "[lavc] Audio encoding failed\n" );
-                goto finish;
-            }
+static int encode_samples( lavc_ctx_t *ctx )
+{
+    obe_aud_enc_params_t *enc_params = ctx->enc_params;
+    obe_t *h = enc_params->h;
+    int stream_id = enc_params->encoder->stream_id;
+    obe_coded_frame_t *coded_frame;
+    AVPacket pkt;
+    int ret = -1, got_pkt;
 
-            if( !got_pkt )
-                continue;
+    ctx->buffered = 0;
 
-            /* Encapsulate AAC frames in ADTS or LATM */
-            if( enc_params->output_format == AUDIO_AAC )
-            {
-                /* Allocate a dynamic memory buffer with avio */
-                if( avio_open_dyn_buf( &avio ) )
-                {
-                    syslog( LOG_ERR, "Malloc failed\n" );
-                    goto finish;
-                }
-                fmt->pb = avio;
-                /* TODO: handle fails */
-                avformat_write_header( fmt, NULL );
-                av_write_frame( fmt, &pkt );
-                frame_size = avio_close_dyn_buf( avio, &avio_buf );
-            }
-            else if( enc_params->output_format == AUDIO_AC_3 )
-            {
-                av_fifo_generic_write( out_fifo, pkt.data, pkt.size, NULL );
-                if( av_fifo_size( out_fifo ) < frame_size )
-                    continue;
-            }
-            else
-                frame_size = pkt.size;
+    av_init_packet( &pkt );
+    pkt.data = NULL;
+    pkt.size = 0;
 
-            coded_frame = new_coded_frame( encoder->stream_id, frame_size );
-            if( !coded_frame )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                goto finish;
-            }
+    if( avcodec_encode_audio2( ctx->codec, &pkt, &ctx->frame, &got_pkt ) < 0 )
+    {
+        syslog( LOG_ERR, "[lavc] Audio encoding failed\n" );
+        return -1;
+    }
+
+    if( !got_pkt )
+        return 0;
 
-            if( enc_params->output_format == AUDIO_AAC )
+    if( enc_params->output_format == AUDIO_AC_3 )
+    {
+        if( !ctx->pes_frame )
+        {
+            ctx->pes_frame = new_pooled_coded_frame( h, stream_id, ctx->frame_size );
+            if( !ctx->pes_frame )
             {
-                memcpy( coded_frame->data, avio_buf, frame_size );
-                av_freep( &avio_buf );
+                syslog( LOG_ERR, "Malloc failed\n" );
+                goto end;
             }
-            else if( enc_params->output_format == AUDIO_AC_3 )
-                av_fifo_generic_read( out_fifo, coded_frame->data, frame_size, NULL );
-            else
-                memcpy( coded_frame->data, pkt.data, pkt.size );
+            ctx->pes_len = 0;
+        }
 
-            coded_frame->pts = cur_pts;
-            coded_frame->random_access = 1; /* Every frame output is a random access point */
-            add_to_mux_queue( h, coded_frame );
+        if( ctx->pes_len + pkt.size > ctx->frame_size )
+        {
+            syslog( LOG_ERR, "[lavc] AC-3 frame is larger than expected\n" );
+            goto end;
+        }
 
-            /* We need to generate PTS because frame sizes have changed */
-            cur_pts += (double)codec->frame_size * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
-            obe_free_packet( &pkt );
+        memcpy( ctx->pes_frame->data + ctx->pes_len, pkt.data, pkt.size );
+        ctx->pes_len += pkt.size;
+        if( ctx->pes_len == ctx->frame_size )
+        {
+            send_frame( ctx, ctx->pes_frame );
+            ctx->pes_frame = NULL;
         }
     }
+    else
+    {
+        /* AAC is framed in ADTS or LATM straight into the coded frame */
+        coded_frame = new_pooled_coded_frame( h, stream_id, pkt.size + pkt.size / 255 + AAC_HEADER_MAX );
+        if( !coded_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            goto end;
+        }
 
-finish:
-    if( audio_buf )
-        free( audio_buf );
-
-    if( samples )
-        free( samples );
-
-    if( in_fifo )
-        av_fifo_free( in_fifo );
-
-    if( out_fifo )
-        av_fifo_free( out_fifo );
+        if( enc_params->output_format == AUDIO_AAC && enc_params->aac_opts.latm_output )
+            write_latm( ctx, coded_frame, &pkt );
+        else if( enc_params->output_format == AUDIO_AAC )
+            write_adts( ctx, coded_frame, &pkt );
+        else
+        {
+            memcpy( coded_frame->data, pkt.data, pkt.size );
+            coded_frame->len = pkt.size;
+        }
 
-    if( avio_buf )
-        av_free( avio_buf );
+        send_frame( ctx, coded_frame );
+    }
 
-    if( audio_conv )
-        av_audio_convert_free( audio_conv );
+    ret = 0;
 
-    if( fmt )
-        avformat_free_context( fmt );
+end:
+    obe_free_packet( &pkt );
+    return ret;
+}
 
-    if( codec )
+static int encode_frame( hnd_t handle, obe_raw_frame_t *raw_frame )
+{
+    lavc_ctx_t *ctx = handle;
+    int ch = ctx->num_channels, frame_size = ctx->codec->frame_size;
+    int in_stride = av_get_bytes_per_sample( raw_frame->sample_fmt );
+    int planar = raw_frame->sample_fmt == AV_SAMPLE_FMT_S32P;
+    int num_frames = planar ? raw_frame->num_samples : raw_frame->len / ( in_stride * ch );
+    const uint8_t *src = raw_frame->data;
+    int ret = 0, len, offset = 0;
+
+    /* TODO: detect bitrate reconfig */
+    if( ctx->cur_pts == -1 )
+        ctx->cur_pts = raw_frame->pts;
+
+    if( raw_frame->sample_fmt != AV_SAMPLE_FMT_S32 && !planar && !ctx->widen_buf )
+    {
+        syslog( LOG_ERR, "[lavc] Input sample format changed\n" );
+        ret = -1;
+        num_frames = 0;
+    }
+    else if( planar && raw_frame->num_channels != ch )
     {
-        avcodec_close( codec );
-        av_free( codec );
+        syslog( LOG_ERR, "[lavc] Number of input channels changed\n" );
+        ret = -1;
+        num_frames = 0;
     }
 
-    if( st )
-        av_free( st );
+    while( num_frames )
+    {
+        len = MIN( num_frames, frame_size - ctx->buffered );
+
+        if( planar )
+            write_planar_samples( ctx, (int32_t**)raw_frame->audio_plane, offset, len );
+        else if( raw_frame->sample_fmt == AV_SAMPLE_FMT_S32 )
+            write_samples( ctx, (const int32_t*)src, len );
+        else
+        {
+            widen_to_s32( ctx->widen_buf, src, raw_frame->sample_fmt, len * ch );
+            write_samples( ctx, ctx->widen_buf, len );
+        }
+        src += len * ch * in_stride;
+        offset += len;
+        num_frames -= len;
 
-    if( fmt )
-        avformat_free_context( fmt );
+        if( ctx->buffered == frame_size && encode_samples( ctx ) < 0 )
+        {
+            ret = -1;
+            break;
+        }
+    }
 
-    free( enc_params );
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
 
-    return NULL;
+    return ret;
 }
 
-const obe_aud_enc_func_t lavc_encoder = { start_encoder };
+const obe_aud_enc_func_t lavc_encoder = { open_encoder, encode_frame, close_encoder };
@@ -24,185 +24,278 @@
 #include "common/common.h"
 #include "encoders/audio/audio.h"
 #include <twolame.h>
-#include <libavutil/fifo.h>
 #include <libavcodec/audioconvert.h>
 
-#define MP2_AUDIO_BUFFER_SIZE 50000
+/* twolame encodes straight into the coded frame. It is fed no more samples than complete the
+ * frames_per_pes frames of the current one, so a PES never has to be copied or split */
+typedef struct
+{
+    obe_aud_enc_params_t *enc_params;
+    twolame_options *tl_opts;
+    int max_pes_size; /* frames_per_pes frames, each with room for a padding slot */
+    int out_stride;
+    int64_t cur_pts;
+    AVAudioConvert *audio_conv;
+
+    /* The coded frame being filled */
+    obe_coded_frame_t *coded_frame;
+    int pes_size;
+    int pes_frames;
+    int pending_samples; /* given to twolame but not yet out as a frame */
+
+    /* Planar input from the channel router is converted a plane at a time */
+    obe_audio_conv_t conv;
+    float *planes[2];
+    int plane_len;
 
-static void *start_encoder( void *ptr )
+    /* Packed input is converted here */
+    float *packed;
+    int packed_len;
+} twolame_ctx_t;
+
+static void close_encoder( hnd_t handle )
+{
+    twolame_ctx_t *ctx = handle;
+
+    if( ctx->coded_frame )
+        destroy_coded_frame( ctx->coded_frame );
+
+    if( ctx->audio_conv )
+        av_audio_convert_free( ctx->audio_conv );
+
+    for( int i = 0; i < 2; i++ )
+    {
+        if( ctx->planes[i] )
+            free( ctx->planes[i] );
+    }
+
+    if( ctx->packed )
+        free( ctx->packed );
+
+    if( ctx->tl_opts )
+        twolame_close( &ctx->tl_opts );
+
+    free( ctx );
+}
+
+static hnd_t open_encoder( obe_aud_enc_params_t *enc_params )
 {
-    obe_aud_enc_params_t *enc_params = ptr;
-    obe_t *h = enc_params->h;
     obe_encoder_t *encoder = enc_params->encoder;
-    obe_raw_frame_t *raw_frame;
-    obe_coded_frame_t *coded_frame;
-    twolame_options *tl_opts = NULL;
-    int output_size, frame_size, in_stride;
-    int64_t cur_pts = -1;
-    void *audio_buf = NULL;
-    uint8_t *output_buf = NULL;
-    AVAudioConvert *audio_conv = NULL;
-    AVFifoBuffer *fifo = NULL;
+    twolame_ctx_t *ctx;
+
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+    ctx->enc_params = enc_params;
+    ctx->cur_pts = -1;
 
     /* Lock the mutex until we verify parameters */
     pthread_mutex_lock( &encoder->encoder_mutex );
 
-    tl_opts = twolame_init();
-    if( !tl_opts )
+    ctx->tl_opts = twolame_init();
+    if( !ctx->tl_opts )
     {
         fprintf( stderr, "[twolame] could load options" );
         pthread_mutex_unlock( &encoder->encoder_mutex );
-        goto end;
+        goto fail;
     }
 
     /* TODO: setup bitrate reconfig, errors */
-    twolame_set_bitrate( tl_opts, enc_params->bitrate );
-    twolame_set_in_samplerate( tl_opts, enc_params->sample_rate );
-    twolame_set_out_samplerate( tl_opts, enc_params->sample_rate );
-    twolame_set_copyright( tl_opts, 1 );
-    twolame_set_original( tl_opts, 1 );
-    twolame_set_num_channels( tl_opts, enc_params->num_channels );
-    twolame_set_error_protection( tl_opts, 1 );
+    twolame_set_bitrate( ctx->tl_opts, enc_params->bitrate );
+    twolame_set_in_samplerate( ctx->tl_opts, enc_params->sample_rate );
+    twolame_set_out_samplerate( ctx->tl_opts, enc_params->sample_rate );
+    twolame_set_copyright( ctx->tl_opts, 1 );
+    twolame_set_original( ctx->tl_opts, 1 );
+    twolame_set_num_channels( ctx->tl_opts, enc_params->num_channels );
+    twolame_set_error_protection( ctx->tl_opts, 1 );
 
-    twolame_init_params( tl_opts );
+    twolame_init_params( ctx->tl_opts );
 
-    frame_size = twolame_get_framelength( tl_opts ) * enc_params->frames_per_pes;
+    ctx->max_pes_size = ( twolame_get_framelength( ctx->tl_opts ) + 1 ) * enc_params->frames_per_pes;
 
     encoder->is_ready = 1;
     /* Broadcast because input and muxer can be stuck waiting for encoder */
     pthread_cond_broadcast( &encoder->encoder_cv );
     pthread_mutex_unlock( &encoder->encoder_mutex );
 
-    output_buf = malloc( MP2_AUDIO_BUFFER_SIZE );
-    if( !output_buf )
+    ctx->out_stride = av_get_bytes_per_sample( AV_SAMPLE_FMT_FLT );
+
+    if( enc_params->num_channels < 1 || enc_params->num_channels > 2 )
     {
-        fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        fprintf( stderr, "[twolame] Only mono and stereo are supported\n" );
+        goto fail;
     }
 
-    int out_stride = av_get_bytes_per_sample( AV_SAMPLE_FMT_FLT );
-
-    /* This works on "planar" audio so pretend it's just one audio plane */
-    audio_conv = av_audio_convert_alloc( AV_SAMPLE_FMT_FLT, 1, enc_params->sample_format, 1, NULL, 0 );
-    if( !audio_conv )
+    if( enc_params->sample_format == AV_SAMPLE_FMT_S32P )
+        obe_audio_conv_init( &ctx->conv );
+    else
     {
-        fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        /* This works on "planar" audio so pretend it's just one audio plane */
+        ctx->audio_conv = av_audio_convert_alloc( AV_SAMPLE_FMT_FLT, 1, enc_params->sample_format, 1, NULL, 0 );
+        if( !ctx->audio_conv )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            goto fail;
+        }
     }
 
-    /* Setup the output FIFO */
-    fifo = av_fifo_alloc( frame_size );
-    if( !fifo )
+    return ctx;
+
+fail:
+    close_encoder( ctx );
+    return NULL;
+}
+
+static int grow_buf( float **buf, int *buf_len, int len )
+{
+    float *tmp;
+
+    if( len <= *buf_len )
+        return 0;
+
+    tmp = realloc( *buf, len * sizeof(*tmp) );
+    if( !tmp )
     {
-        fprintf( stderr, "Malloc failed\n" );
-        goto end;
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
     }
+    *buf = tmp;
+    *buf_len = len;
 
-    while( 1 )
-    {
-        pthread_mutex_lock( &encoder->encoder_mutex );
+    return 0;
+}
+
+static int convert_planar( twolame_ctx_t *ctx, obe_raw_frame_t *raw_frame )
+{
+    int num_channels = MIN( raw_frame->num_channels, 2 );
 
-        if( encoder->cancel_thread )
+    if( raw_frame->num_samples > ctx->plane_len )
+    {
+        for( int i = 0; i < 2; i++ )
         {
-            pthread_mutex_unlock( &encoder->encoder_mutex );
-            break;
+            int plane_len = ctx->plane_len;
+            if( grow_buf( &ctx->planes[i], &plane_len, raw_frame->num_samples ) < 0 )
+                return -1;
         }
+        ctx->plane_len = raw_frame->num_samples;
+    }
 
-        if( !encoder->num_raw_frames )
-            pthread_cond_wait( &encoder->encoder_cv, &encoder->encoder_mutex );
+    for( int i = 0; i < num_channels; i++ )
+        obe_audio_conv_flt( &ctx->conv, ctx->planes[i], (int32_t*)raw_frame->audio_plane[i], raw_frame->num_samples );
 
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->encoder_mutex );
-            break;
-        }
+    return 0;
+}
 
-        raw_frame = encoder->frames[0];
-        pthread_mutex_unlock( &encoder->encoder_mutex );
+static int convert_packed( twolame_ctx_t *ctx, obe_raw_frame_t *raw_frame )
+{
+    int in_stride = av_get_bytes_per_sample( raw_frame->sample_fmt );
+    int num_samples = raw_frame->len / in_stride;
+    int istride[6] = { in_stride };
+    int ostride[6] = { ctx->out_stride };
+    const void *ibuf[6] = { raw_frame->data };
 
-        if( cur_pts == -1 )
-            cur_pts = raw_frame->pts;
+    if( grow_buf( &ctx->packed, &ctx->packed_len, num_samples ) < 0 )
+        return -1;
+    void *obuf[6] = { ctx->packed };
 
-        in_stride = av_get_bytes_per_sample( raw_frame->sample_fmt );
-        int num_samples = raw_frame->len / in_stride;
-        int sample_bytes = num_samples * out_stride;
-        int istride[6] = { in_stride };
-        int ostride[6] = { out_stride };
-        const void *ibuf[6] = { raw_frame->data };
+    if( av_audio_convert( ctx->audio_conv, obuf, ostride, ibuf, istride, num_samples ) < 0 )
+    {
+        syslog( LOG_ERR, "[lavf] Could not convert audio sample format\n" );
+        return -1;
+    }
 
-        audio_buf = malloc( sample_bytes );
-        if( !audio_buf )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto end;
-        }
-        void *obuf[6] = { audio_buf };
+    return 0;
+}
 
-        if( av_audio_convert( audio_conv, obuf, ostride, ibuf, istride, num_samples ) < 0 )
-        {
-            syslog( LOG_ERR, "[lavf] Could not convert audio sample format\n" );
-            goto end;
-        }
+/* Encodes num_samples from pos onwards to the end of the current coded frame */
+static int encode_samples( twolame_ctx_t *ctx, int planar, int pos, int num_samples )
+{
+    uint8_t *out = ctx->coded_frame->data + ctx->pes_size;
+    int out_size = ctx->max_pes_size - ctx->pes_size;
 
-        output_size = twolame_encode_buffer_float32_interleaved( tl_opts, audio_buf, raw_frame->num_samples, output_buf, MP2_AUDIO_BUFFER_SIZE );
+    /* The right channel is ignored for mono */
+    if( planar )
+        return twolame_encode_buffer_float32( ctx->tl_opts, ctx->planes[0] + pos, ctx->planes[1] + pos,
+                                              num_samples, out, out_size );
 
-        if( output_size < 0 )
-        {
-            syslog( LOG_ERR, "[twolame] Encode failed\n" );
-            break;
-        }
+    return twolame_encode_buffer_float32_interleaved( ctx->tl_opts, ctx->packed + pos * ctx->enc_params->num_channels,
+                                                      num_samples, out, out_size );
+}
 
-        free( audio_buf );
-        audio_buf = NULL;
+static int encode_frame( hnd_t handle, obe_raw_frame_t *raw_frame )
+{
+    twolame_ctx_t *ctx = handle;
+    obe_aud_enc_params_t *enc_params = ctx->enc_params;
+    obe_t *h = enc_params->h;
+    obe_encoder_t *encoder = enc_params->encoder;
+    int planar = raw_frame->sample_fmt == AV_SAMPLE_FMT_S32P;
+    int pos = 0, num_samples, output_size, ret = -1;
 
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
-        remove_frame_from_encode_queue( encoder );
+    if( ctx->cur_pts == -1 )
+        ctx->cur_pts = raw_frame->pts;
 
-        if( av_fifo_realloc2( fifo, av_fifo_size( fifo ) + output_size ) < 0 )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            break;
-        }
+    if( planar == !!ctx->audio_conv )
+    {
+        syslog( LOG_ERR, "[twolame] Input sample format changed\n" );
+        goto end;
+    }
 
-        av_fifo_generic_write( fifo, output_buf, output_size, NULL );
+    if( ( planar ? convert_planar( ctx, raw_frame ) : convert_packed( ctx, raw_frame ) ) < 0 )
+        goto end;
 
-        while( av_fifo_size( fifo ) >= frame_size )
+    while( pos < raw_frame->num_samples )
+    {
+        if( !ctx->coded_frame )
         {
-            coded_frame = new_coded_frame( encoder->stream_id, frame_size );
-            if( !coded_frame )
+            ctx->coded_frame = new_pooled_coded_frame( h, encoder->stream_id, ctx->max_pes_size );
+            if( !ctx->coded_frame )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
                 goto end;
             }
-            av_fifo_generic_read( fifo, coded_frame->data, frame_size, NULL );
-            coded_frame->pts = cur_pts;
-            coded_frame->random_access = 1; /* Every frame output is a random access point */
+            ctx->pes_size = ctx->pes_frames = 0;
+        }
 
-            add_to_mux_queue( h, coded_frame );
-            /* We need to generate PTS because frame sizes have changed */
-            cur_pts += (double)MP2_NUM_SAMPLES * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
+        num_samples = MIN( raw_frame->num_samples - pos,
+                           ( enc_params->frames_per_pes - ctx->pes_frames ) * MP2_NUM_SAMPLES - ctx->pending_samples );
+
+        output_size = encode_samples( ctx, planar, pos, num_samples );
+        if( output_size < 0 )
+        {
+            syslog( LOG_ERR, "[twolame] Encode failed\n" );
+            goto end;
         }
-    }
 
-end:
-    if( output_buf )
-        free( output_buf );
+        pos += num_samples;
+        ctx->pes_size += output_size;
+        ctx->pending_samples += num_samples;
+        ctx->pes_frames += ctx->pending_samples / MP2_NUM_SAMPLES;
+        ctx->pending_samples %= MP2_NUM_SAMPLES;
 
-    if( audio_buf )
-        free( audio_buf );
+        if( ctx->pes_frames == enc_params->frames_per_pes )
+        {
+            ctx->coded_frame->len = ctx->pes_size;
+            ctx->coded_frame->pts = ctx->cur_pts;
+            ctx->coded_frame->random_access = 1; /* Every frame output is a random access point */
 
-    if( audio_conv )
-        av_audio_convert_free( audio_conv );
+            if( add_to_mux_queue( h, ctx->coded_frame ) < 0 )
+                destroy_coded_frame( ctx->coded_frame );
+            ctx->coded_frame = NULL;
+            /* We need to generate PTS because frame sizes have changed */
+            ctx->cur_pts += (double)MP2_NUM_SAMPLES * OBE_CLOCK * enc_params->frames_per_pes / enc_params->sample_rate;
+        }
+    }
 
-    if( fifo )
-        av_fifo_free( fifo );
+    ret = 0;
 
-    if( tl_opts )
-        twolame_close( &tl_opts );
-    free( enc_params );
+end:
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
 
-    return NULL;
+    return ret;
 }
 
-const obe_aud_enc_func_t twolame_encoder = { start_encoder };
+const obe_aud_enc_func_t twolame_encoder = { open_encoder, encode_frame, close_encoder };
@@ -0,0 +1,147 @@
+%include "x86inc.asm"
+%include "x86util.asm"
+
+SECTION .rodata
+
+align 32
+; 2^-31, which maps a full scale 32-bit sample to [-1.0,1.0)
+s32_to_flt_scale: times 8 dd 0x30000000
+
+SECTION .text
+
+;
+; void obe_s32_to_flt( float *dst, const int32_t *src, int len )
+; void obe_s32_to_s16( int16_t *dst, const int32_t *src, int len )
+; Interleaved in and out. len is in samples and must be a positive multiple of the step
+;
+
+INIT_XMM
+cglobal s32_to_flt_sse2, 3,3
+    movsxdifnidn r2, r2d
+    mova      m2, [s32_to_flt_scale]
+.loop
+    movu      m0, [r1]
+    cvtdq2ps  m0, m0
+    mulps     m0, m2
+    movu      [r0], m0
+    add       r1, mmsize
+    add       r0, mmsize
+    sub       r2, 4
+    jg        .loop
+    RET
+
+cglobal s32_to_s16_sse2, 3,3
+    movsxdifnidn r2, r2d
+.loop
+    movu      m0, [r1]
+    movu      m1, [r1+mmsize]
+    psrad     m0, 16
+    psrad     m1, 16
+    packssdw  m0, m1
+    movu      [r0], m0
+    add       r1, 2*mmsize
+    add       r0, mmsize
+    sub       r2, 8
+    jg        .loop
+    RET
+
+;
+; void obe_s32_to_fltp_2ch( float *dst0, float *dst1, const int32_t *src, int num_frames )
+; void obe_s32_to_s16p_2ch( int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames )
+; Splits a stereo pair into planes while converting it
+;
+
+cglobal s32_to_fltp_2ch_sse2, 4,4
+    movsxdifnidn r3, r3d
+    mova      m4, [s32_to_flt_scale]
+.loop
+    movu      m0, [r2]
+    movu      m1, [r2+mmsize]
+    cvtdq2ps  m0, m0
+    cvtdq2ps  m1, m1
+    mulps     m0, m4
+    mulps     m1, m4
+    movaps    m2, m0
+    shufps    m0, m1, 0x88
+    shufps    m2, m1, 0xdd
+    movu      [r0], m0
+    movu      [r1], m2
+    add       r2, 2*mmsize
+    add       r0, mmsize
+    add       r1, mmsize
+    sub       r3, 4
+    jg        .loop
+    RET
+
+cglobal s32_to_s16p_2ch_sse2, 4,4
+    movsxdifnidn r3, r3d
+.loop
+    movu      m0, [r2]
+    movu      m1, [r2+mmsize]
+    movu      m2, [r2+2*mmsize]
+    movu      m3, [r2+3*mmsize]
+    psrad     m0, 16
+    psrad     m1, 16
+    psrad     m2, 16
+    psrad     m3, 16
+    ; LRLR -> LLRR
+    pshufd    m0, m0, 0xd8
+    pshufd    m1, m1, 0xd8
+    pshufd    m2, m2, 0xd8
+    pshufd    m3, m3, 0xd8
+    mova      m4, m0
+    punpcklqdq m0, m1
+    punpckhqdq m4, m1
+    mova      m5, m2
+    punpcklqdq m2, m3
+    punpckhqdq m5, m3
+    packssdw  m0, m2
+    packssdw  m4, m5
+    movu      [r0], m0
+    movu      [r1], m4
+    add       r2, 4*mmsize
+    add       r0, mmsize
+    add       r1, mmsize
+    sub       r3, 8
+    jg        .loop
+    RET
+
+; x86inc.asm predates YMM support so the AVX2 functions name their registers explicitly
+
+INIT_AVX
+cglobal s32_to_flt_avx2, 3,3
+    movsxdifnidn r2, r2d
+    vmovaps   ymm2, [s32_to_flt_scale]
+.loop
+    vcvtdq2ps ymm0, [r1]
+    vmulps    ymm0, ymm0, ymm2
+    vmovups   [r0], ymm0
+    add       r1, 32
+    add       r0, 32
+    sub       r2, 8
+    jg        .loop
+    vzeroupper
+    RET
+
+cglobal s32_to_fltp_2ch_avx2, 4,4
+    movsxdifnidn r3, r3d
+    vmovaps   ymm4, [s32_to_flt_scale]
+.loop
+    vcvtdq2ps ymm0, [r2]
+    vcvtdq2ps ymm1, [r2+32]
+    vmulps    ymm0, ymm0, ymm4
+    vmulps    ymm1, ymm1, ymm4
+    ; shufps works within lanes, vpermpd puts the halves of each plane back in order
+    vshufps   ymm2, ymm0, ymm1, 0x88
+    vshufps   ymm3, ymm0, ymm1, 0xdd
+    vpermpd   ymm2, ymm2, 0xd8
+    vpermpd   ymm3, ymm3, 0xd8
+    vmovups   [r0], ymm2
+    vmovups   [r1], ymm3
+    add       r2, 64
+    add       r0, 32
+    add       r1, 32
+    sub       r3, 8
+    jg        .loop
+    vzeroupper
+    RET
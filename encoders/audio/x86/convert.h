@@ -0,0 +1,42 @@
+/*****************************************************************************
+ * convert.h: audio sample conversion asm prototypes
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef OBE_X86_AUDIO_CONVERT
+#define OBE_X86_AUDIO_CONVERT
+
+void obe_s32_to_flt_c( float *dst, const int32_t *src, int len );
+void obe_s32_to_flt_sse2( float *dst, const int32_t *src, int len );
+void obe_s32_to_flt_avx2( float *dst, const int32_t *src, int len );
+
+void obe_s32_to_s16_c( int16_t *dst, const int32_t *src, int len );
+void obe_s32_to_s16_sse2( int16_t *dst, const int32_t *src, int len );
+
+void obe_s32_to_fltp_2ch_c( float *dst0, float *dst1, const int32_t *src, int num_frames );
+void obe_s32_to_fltp_2ch_sse2( float *dst0, float *dst1, const int32_t *src, int num_frames );
+void obe_s32_to_fltp_2ch_avx2( float *dst0, float *dst1, const int32_t *src, int num_frames );
+
+void obe_s32_to_s16p_2ch_c( int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames );
+void obe_s32_to_s16p_2ch_sse2( int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames );
+
+#endif
@@ -23,41 +23,51 @@
 
 #include "common/common.h"
 #include "smoothing.h"
+#include <libavutil/mathematics.h>
 
+/* Frames leave the buffer at a deadline on the input clock that is their encoder dts offset
+ * from the first frame's. Sleeping to the deadline rather than to the next clock tick means
+ * the release isn't quantised to the capture frame rate */
 static void *start_smoothing( void *ptr )
 {
     obe_t *h = ptr;
-    int num_smoothing_frames = 0, buffer_frames = 0;
-    int64_t start_dts = -1, start_pts = -1;
+    int num_smoothing_frames = 0, buffer_frames = 0, num_video_encoders = 0;
+    int64_t frame_duration = 0, buffer_duration, deadline, now;
     obe_coded_frame_t *coded_frame = NULL;
 
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
-
-    /* FIXME: when we have soft pulldown this will need changing */
-    if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+    for( int i = 0; i < h->num_encoders; i++ )
     {
-        for( int i = 0; i < h->num_encoders; i++ )
+        if( h->encoders[i]->is_video )
         {
-            if( h->encoders[i]->is_video )
+            if( !num_video_encoders++ )
             {
                 pthread_mutex_lock( &h->encoders[i]->encoder_mutex );
-                if( !h->encoders[i]->is_ready )
+                while( !h->encoders[i]->is_ready )
                     pthread_cond_wait( &h->encoders[i]->encoder_cv, &h->encoders[i]->encoder_mutex );
                 x264_param_t *params = h->encoders[i]->encoder_params;
                 buffer_frames = params->sc.i_buffer_size;
+                frame_duration = av_rescale_q( 1, (AVRational){params->i_fps_den, params->i_fps_num}, (AVRational){1, OBE_CLOCK} );
                 pthread_mutex_unlock( &h->encoders[i]->encoder_mutex );
-                break;
             }
         }
     }
 
-    int64_t send_delta = 0;
+    /* FIXME: when we have soft pulldown this will need changing */
+    if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+    {
+        /* Every rendition of the picture puts its frames in the same buffer */
+        buffer_frames *= num_video_encoders;
+    }
+    else
+        buffer_frames = 0;
+
+    /* A deadline further than this from now means the dts or the input clock jumped. Without a
+     * video encoder to give a frame rate there is nothing to measure it by, so there is no resync */
+    buffer_duration = MAX( buffer_frames, 1 ) * frame_duration;
 
     while( 1 )
     {
-        pthread_mutex_lock( &h->smoothing_mutex );
+        obe_trace_mutex_lock( &h->smoothing_mutex, "smoothing_mutex" );
 
         if( h->cancel_smoothing_thread )
         {
@@ -65,8 +75,8 @@ static void *start_smoothing( void *ptr )
             break;
         }
 
-        if( h->num_smoothing_frames == num_smoothing_frames )
-            pthread_cond_wait( &h->smoothing_in_cv, &h->smoothing_mutex );
+        if( h->smoothing_queue.size == num_smoothing_frames )
+            obe_trace_cond_wait( &h->smoothing_in_cv, &h->smoothing_mutex, "smoothing_in_cv" );
 
         if( h->cancel_smoothing_thread )
         {
@@ -74,14 +84,16 @@ static void *start_smoothing( void *ptr )
             break;
         }
 
-        num_smoothing_frames = h->num_smoothing_frames;
+        num_smoothing_frames = h->smoothing_queue.size;
 
         if( !h->smoothing_buffer_complete )
         {
-            if( num_smoothing_frames >= buffer_frames )
+            if( num_smoothing_frames && num_smoothing_frames >= buffer_frames )
             {
+                coded_frame = obe_queue_item( &h->smoothing_queue, 0 );
                 h->smoothing_buffer_complete = 1;
-                start_dts = -1;
+                h->smoothing_start_dts = coded_frame->real_dts;
+                h->smoothing_start_time = get_input_clock_in_mpeg_ticks( h );
             }
             else
             {
@@ -90,42 +102,38 @@ static void *start_smoothing( void *ptr )
             }
         }
 
-//        printf("\n smoothed frames %i \n", num_smoothing_frames );
-
-        coded_frame = h->smoothing_frames[0];
-        pthread_mutex_unlock( &h->smoothing_mutex );
-
         /* The terminology can be a cause for confusion:
          *   pts refers to the pts from the input which is monotonic
          *   dts refers to the dts out of the encoder which is monotonic */
+        coded_frame = obe_queue_item( &h->smoothing_queue, 0 );
+        deadline = h->smoothing_start_time + coded_frame->real_dts - h->smoothing_start_dts;
+        now = get_input_clock_in_mpeg_ticks( h );
 
-        pthread_mutex_lock( &h->obe_clock_mutex );
-
-        //printf("\n dts gap %"PRIi64" \n", coded_frame->real_dts - start_dts );
-        //printf("\n pts gap %"PRIi64" \n", h->smoothing_last_pts - start_pts );
-
-        if( start_dts == -1 )
+        if( buffer_duration > 0 && ( deadline - now > buffer_duration || now - deadline > buffer_duration ) )
         {
-            start_dts = coded_frame->real_dts;
-            /* Wait until the next clock tick */
-            pthread_cond_wait( &h->obe_clock_cv, &h->obe_clock_mutex );
-            start_pts = h->smoothing_last_pts;
+            syslog( LOG_WARNING, "Smoothing deadline is %"PRIi64" ticks from the input clock, resyncing\n", deadline - now );
+            h->smoothing_start_dts = coded_frame->real_dts;
+            h->smoothing_start_time = deadline = now;
         }
-        else if( coded_frame->real_dts - start_dts > h->smoothing_last_pts - start_pts )
+        pthread_mutex_unlock( &h->smoothing_mutex );
+
+        /* otherwise, send it straight away since the frame is late */
+        if( deadline > now )
         {
-            //printf("\n waiting \n");
-            pthread_cond_wait( &h->obe_clock_cv, &h->obe_clock_mutex );
+            obe_trace_begin( "sleep", "smoothing" );
+            sleep_input_clock( h, deadline );
+            obe_trace_end( "sleep", "smoothing" );
         }
-        /* otherwise, continue since the frame is late */
-
-        pthread_mutex_unlock( &h->obe_clock_mutex );
+        else
+            obe_trace_instant( "late", "smoothing", now - deadline );
 
-        add_to_mux_queue( h, coded_frame );
-
-        //printf("\n send_delta %"PRIi64" \n", get_input_clock_in_mpeg_ticks( h ) - send_delta );
-        //send_delta = get_input_clock_in_mpeg_ticks( h );
+        obe_latency_record( &h->smoothing_latency, coded_frame->arrival_time );
 
+        /* The mux owns the frame once it's queued so it must leave the buffer first */
         remove_from_smoothing_queue( h );
+        if( add_to_mux_queue( h, coded_frame ) < 0 )
+            destroy_coded_frame( coded_frame );
+
         num_smoothing_frames = 0;
     }
 
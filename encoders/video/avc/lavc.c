@@ -0,0 +1,294 @@
+/*****************************************************************************
+ * lavc.c : libavcodec hardware AVC encoding functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ ******************************************************************************/
+
+#include "common/common.h"
+#include "encoders/video/video.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+
+/* Pictures the hardware can hold before the first packet comes out */
+#define LAVC_MAX_DELAY 64
+
+typedef struct
+{
+    int obe_name;
+    const char *lavc_name;
+} lavc_video_encoder_t;
+
+static const lavc_video_encoder_t lavc_video_encoders[] =
+{
+    { VIDEO_ENCODER_NVENC, "h264_nvenc" },
+    { VIDEO_ENCODER_QSV,   "h264_qsv" },
+    { -1, NULL },
+};
+
+typedef struct
+{
+    int64_t pts;
+    int64_t arrival_time;
+} lavc_frame_info_t;
+
+/* SPS profile_idc and level_idc, which the mux signals in the AVC descriptor */
+static int parse_sps( const uint8_t *data, int len, int *profile_idc, int *level_idc )
+{
+    for( int i = 0; i + 6 < len; i++ )
+    {
+        if( data[i] == 0 && data[i+1] == 0 && data[i+2] == 1 && ( data[i+3] & 0x1f ) == 7 )
+        {
+            *profile_idc = data[i+4];
+            *level_idc = data[i+6];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void *start_encoder( void *ptr )
+{
+    obe_vid_enc_params_t *enc_params = ptr;
+    obe_t *h = enc_params->h;
+    obe_encoder_t *encoder = enc_params->encoder;
+    x264_param_t *param = &enc_params->avc_param;
+    obe_raw_frame_t *raw_frame;
+    obe_coded_frame_t *coded_frame;
+    AVCodec *enc = NULL;
+    AVCodecContext *codec = NULL;
+    AVDictionary *opts = NULL;
+    AVFrame frame;
+    AVPacket pkt;
+    lavc_frame_info_t frame_info[LAVC_MAX_DELAY];
+    obe_vid_hrd_t hrd;
+    int64_t frame_count = 0, dts, pts;
+    int profile_idc = 0, level_idc = 0, sps_profile_idc, sps_level_idc, got_pkt, ret, i, prefix_len;
+
+    avcodec_register_all();
+
+    for( i = 0; lavc_video_encoders[i].obe_name != -1; i++ )
+    {
+        if( lavc_video_encoders[i].obe_name == enc_params->video_encoder )
+            break;
+    }
+
+    if( lavc_video_encoders[i].obe_name != -1 )
+        enc = avcodec_find_encoder_by_name( lavc_video_encoders[i].lavc_name );
+    if( !enc )
+    {
+        fprintf( stderr, "[lavc]: Hardware encoder not available\n" );
+        goto finish;
+    }
+
+    codec = avcodec_alloc_context3( enc );
+    if( !codec )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
+
+    /* Lock the mutex until we verify and fetch new parameters */
+    pthread_mutex_lock( &encoder->encoder_mutex );
+
+    codec->width = param->i_width;
+    codec->height = param->i_height;
+    codec->time_base = (AVRational){ param->i_fps_den, param->i_fps_num };
+    codec->sample_aspect_ratio = (AVRational){ param->vui.i_sar_width, param->vui.i_sar_height };
+    /* The video filter converts to 8-bit 4:2:0 for an 8-bit x264 build */
+    codec->pix_fmt = X264_BIT_DEPTH == 8 ? PIX_FMT_YUV420P : PIX_FMT_YUV420P10;
+    codec->gop_size = param->i_keyint_max;
+    codec->max_b_frames = param->i_bframe;
+    codec->level = param->i_level_idc > 0 ? param->i_level_idc : FF_LEVEL_UNKNOWN;
+    codec->bit_rate = (int64_t)param->rc.i_bitrate * 1000;
+    codec->rc_max_rate = (int64_t)param->rc.i_vbv_max_bitrate * 1000;
+    codec->rc_buffer_size = param->rc.i_vbv_buffer_size * 1000;
+    /* The SPS is read from the extradata and put in front of every keyframe */
+    codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    if( param->b_interlaced )
+        codec->flags |= CODEC_FLAG_INTERLACED_DCT | CODEC_FLAG_INTERLACED_ME;
+
+    /* Options the encoder doesn't have are left in the dictionary and ignored */
+    if( h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
+    {
+        av_dict_set( &opts, "preset", "llhq", 0 );
+        av_dict_set( &opts, "zerolatency", "1", 0 );
+        av_dict_set( &opts, "async_depth", "1", 0 );
+        codec->max_b_frames = 0;
+    }
+    else
+        av_dict_set( &opts, "preset", "hq", 0 );
+
+    if( param->rc.i_vbv_max_bitrate && param->rc.i_vbv_max_bitrate == param->rc.i_bitrate )
+        av_dict_set( &opts, "rc", "cbr", 0 );
+
+    if( avcodec_open2( codec, enc, &opts ) < 0 )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "[lavc]: Could not open hardware encoder\n" );
+        goto finish;
+    }
+
+    if( !codec->extradata_size || parse_sps( codec->extradata, codec->extradata_size, &profile_idc, &level_idc ) < 0 )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "[lavc]: Hardware encoder did not return an SPS\n" );
+        goto finish;
+    }
+
+    /* The encoder doesn't return hrd timing so the CPB is modelled from the VBV settings */
+    if( !( param->rc.i_vbv_max_bitrate || param->rc.i_bitrate ) || !param->rc.i_vbv_buffer_size )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "[lavc]: The hardware encoders need a bitrate and VBV buffer size\n" );
+        goto finish;
+    }
+    obe_vid_hrd_init( &hrd, param->rc.i_vbv_max_bitrate ? param->rc.i_vbv_max_bitrate : param->rc.i_bitrate,
+                      param->rc.i_vbv_buffer_size );
+
+    /* The smoothing and mux stages read the settings in x264's form */
+    encoder->encoder_params = malloc( sizeof(*param) );
+    if( !encoder->encoder_params )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto finish;
+    }
+    param->i_profile = profile_idc;
+    param->i_level_idc = level_idc;
+    memcpy( encoder->encoder_params, param, sizeof(*param) );
+
+    encoder->is_ready = 1;
+    /* Broadcast because input and muxer can be stuck waiting for encoder */
+    pthread_cond_broadcast( &encoder->encoder_cv );
+    pthread_mutex_unlock( &encoder->encoder_mutex );
+
+    while( 1 )
+    {
+        raw_frame = get_frame_from_encode_queue( encoder );
+        if( raw_frame )
+        {
+            /* The hardware encoders have no way to take SEI, it goes with the frame's arena when the frame is released */
+            if( raw_frame->img.csp != codec->pix_fmt )
+            {
+                syslog( LOG_ERR, "[lavc]: Picture format doesn't match the hardware encoder\n" );
+                break;
+            }
+
+            /* The picture is read straight out of its pooled buffer, the encoder uploads it */
+            avcodec_get_frame_defaults( &frame );
+            for( i = 0; i < raw_frame->img.planes; i++ )
+            {
+                frame.data[i] = raw_frame->img.plane[i];
+                frame.linesize[i] = raw_frame->img.stride[i];
+            }
+            frame.pts = frame_count;
+            frame.interlaced_frame = param->b_interlaced;
+            frame.top_field_first = param->b_tff;
+
+            frame_info[frame_count % LAVC_MAX_DELAY].pts = raw_frame->pts;
+            frame_info[frame_count % LAVC_MAX_DELAY].arrival_time = raw_frame->arrival_time;
+            frame_count++;
+        }
+        /* At the end the pictures still held by the encoder are drained with NULL frames */
+        else if( !( enc->capabilities & CODEC_CAP_DELAY ) )
+            break;
+
+        av_init_packet( &pkt );
+        pkt.data = NULL;
+        pkt.size = 0;
+
+        obe_trace_begin( "encode", "lavc" );
+        ret = avcodec_encode_video2( codec, &pkt, raw_frame ? &frame : NULL, &got_pkt );
+        obe_trace_end( "encode", "lavc" );
+
+        if( raw_frame )
+        {
+            raw_frame->release_data( raw_frame );
+            raw_frame->release_frame( raw_frame );
+            remove_frame_from_encode_queue( encoder );
+        }
+
+        if( ret < 0 )
+        {
+            syslog( LOG_ERR, "[lavc]: Hardware encode failed\n" );
+            break;
+        }
+
+        if( !got_pkt )
+        {
+            if( !raw_frame )
+                break;
+            continue;
+        }
+
+        if( frame_count - pkt.pts > LAVC_MAX_DELAY )
+        {
+            syslog( LOG_ERR, "[lavc]: Hardware encoder delay is too large\n" );
+            av_free_packet( &pkt );
+            break;
+        }
+
+        /* Keyframes carry the SPS and PPS so decoders can join the stream there */
+        prefix_len = 0;
+        if( pkt.flags & AV_PKT_FLAG_KEY && parse_sps( pkt.data, MIN( pkt.size, 64 ), &sps_profile_idc, &sps_level_idc ) < 0 )
+            prefix_len = codec->extradata_size;
+
+        coded_frame = new_pooled_coded_frame( h, encoder->stream_id, prefix_len + pkt.size );
+        if( !coded_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            av_free_packet( &pkt );
+            break;
+        }
+        memcpy( coded_frame->data, codec->extradata, prefix_len );
+        memcpy( coded_frame->data + prefix_len, pkt.data, pkt.size );
+        coded_frame->is_video = 1;
+        coded_frame->len = prefix_len + pkt.size;
+
+        dts = av_rescale_q( pkt.dts, codec->time_base, (AVRational){1, OBE_CLOCK} );
+        pts = av_rescale_q( pkt.pts, codec->time_base, (AVRational){1, OBE_CLOCK} );
+        obe_vid_hrd_set_timing( &hrd, coded_frame, dts, pts );
+
+        coded_frame->pts = frame_info[pkt.pts % LAVC_MAX_DELAY].pts;
+        coded_frame->arrival_time = frame_info[pkt.pts % LAVC_MAX_DELAY].arrival_time;
+        coded_frame->random_access = !!( pkt.flags & AV_PKT_FLAG_KEY );
+        coded_frame->priority = coded_frame->random_access;
+        av_free_packet( &pkt );
+
+        obe_latency_record( &encoder->latency, coded_frame->arrival_time );
+
+        if( add_to_smoothing_queue( h, coded_frame ) < 0 )
+            destroy_coded_frame( coded_frame );
+    }
+
+finish:
+    av_dict_free( &opts );
+    if( codec )
+    {
+        avcodec_close( codec );
+        av_free( codec );
+    }
+    free( enc_params );
+
+    return NULL;
+}
+
+const obe_vid_enc_func_t lavc_avc_encoder = { start_encoder };
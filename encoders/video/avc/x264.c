@@ -25,6 +25,9 @@
 #include "encoders/video/video.h"
 #include <libavutil/mathematics.h>
 
+/* Fraction of the smoothing buffer fill speedcontrol is told about while shedding load */
+#define SHED_PRESET_FILL 0.5f
+
 static void x264_logger( void *p_unused, int i_level, const char *psz_fmt, va_list arg )
 {
     if( i_level <= X264_LOG_INFO )
@@ -60,8 +63,9 @@ static int convert_obe_to_x264_pic( x264_picture_t *pic, obe_raw_frame_t *raw_fr
 
     if( pic->extra_sei.num_payloads )
     {
-        pic->extra_sei.sei_free = free;
-        pic->extra_sei.payloads = malloc( pic->extra_sei.num_payloads * sizeof(*pic->extra_sei.payloads) );
+        /* The payloads and their data are in the frame's arena, which outlives the picture in x264 */
+        pic->extra_sei.sei_free = NULL;
+        pic->extra_sei.payloads = obe_frame_alloc( raw_frame, pic->extra_sei.num_payloads * sizeof(*pic->extra_sei.payloads) );
 
         if( !pic->extra_sei.payloads )
             return -1;
@@ -78,19 +82,13 @@ static int convert_obe_to_x264_pic( x264_picture_t *pic, obe_raw_frame_t *raw_fr
                 idx++;
             }
             else
-            {
                 syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", raw_frame->user_data[i].type );
-                free( raw_frame->user_data[i].data );
-            }
         }
     }
     else if( raw_frame->num_user_data )
     {
         for( int i = 0; i < raw_frame->num_user_data; i++ )
-        {
             syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", raw_frame->user_data[i].type );
-            free( raw_frame->user_data[i].data );
-        }
     }
 
     return 0;
@@ -105,11 +103,13 @@ static void *start_encoder( void *ptr )
     x264_picture_t pic, pic_out;
     x264_nal_t *nal;
     int i_nal, frame_size = 0, user_sar_width, user_sar_height;
-    int64_t pts = 0, arrival_time = 0, frame_duration, buffer_duration;
-    int64_t *pts2;
+    int statmux_idx = -1, statmux_rate = 0, new_gop = 0, reconfig;
+    int64_t pts = 0, frame_duration, buffer_duration;
+    obe_vid_pic_ctx_t *pic_ctx;
     float buffer_fill;
     obe_raw_frame_t *raw_frame;
     obe_coded_frame_t *coded_frame;
+    obe_vid_nal_ctx_t nal_ctx = {0};
 
     /* TODO: check for width, height changes */
 
@@ -145,45 +145,38 @@ static void *start_encoder( void *ptr )
     pthread_cond_broadcast( &encoder->encoder_cv );
     pthread_mutex_unlock( &encoder->encoder_mutex );
 
+    if( obe_vid_nal_open( &nal_ctx, h, encoder, "x264 nal", frame_duration ) < 0 )
+        goto end;
+
+    /* Filler holds a service at a constant rate so it has nothing to give up */
+    if( h->mux_opts.statmux && enc_params->avc_param.rc.i_vbv_max_bitrate > 0 &&
+        enc_params->avc_param.i_nal_hrd != X264_NAL_HRD_FAKE_CBR )
+    {
+        statmux_rate = enc_params->avc_param.rc.i_vbv_max_bitrate;
+        statmux_idx = obe_statmux_add( h, encoder->stream_id, statmux_rate, frame_duration );
+    }
+
     user_sar_width = enc_params->avc_param.vui.i_sar_width;
     user_sar_height = enc_params->avc_param.vui.i_sar_height;
 
     while( 1 )
     {
-        pthread_mutex_lock( &encoder->encoder_mutex );
-
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->encoder_mutex );
-            break;
-        }
-
-        if( !encoder->num_raw_frames )
-            pthread_cond_wait( &encoder->encoder_cv, &encoder->encoder_mutex );
-
-        if( encoder->cancel_thread )
-        {
-            pthread_mutex_unlock( &encoder->encoder_mutex );
+        raw_frame = get_frame_from_encode_queue( encoder );
+        if( !raw_frame )
             break;
-        }
 
         /* Reset the speedcontrol buffer if the source has dropped frames. Otherwise speedcontrol
          * stays in an underflow state and is locked to the fastest preset */
         pthread_mutex_lock( &h->drop_mutex );
         if( h->encoder_drop )
         {
-            pthread_mutex_lock( &h->smoothing_mutex );
-            h->smoothing_buffer_complete = 0;
-            pthread_mutex_unlock( &h->smoothing_mutex );
+            obe_vid_nal_reset( &nal_ctx );
             syslog( LOG_INFO, "Speedcontrol reset\n" );
             x264_speedcontrol_sync( s, enc_params->avc_param.sc.i_buffer_size, enc_params->avc_param.sc.f_buffer_init, 0 );
             h->encoder_drop = 0;
         }
         pthread_mutex_unlock( &h->drop_mutex );
 
-        raw_frame = encoder->frames[0];
-        pthread_mutex_unlock( &encoder->encoder_mutex );
-
         if( convert_obe_to_x264_pic( &pic, raw_frame ) < 0 )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
@@ -192,14 +185,15 @@ static void *start_encoder( void *ptr )
 
         /* FIXME: if frames are dropped this might not be true */
         pic.i_pts = pts++;
-        pts2 = malloc( sizeof(int64_t) );
-        if( !pts2 )
+        /* The capture time travels with the picture so that with lookahead the
+         * encode latency is measured on the frame that actually came out */
+        pic_ctx = obe_vid_pic_ctx_new( raw_frame );
+        if( !pic_ctx )
         {
             syslog( LOG_ERR, "Malloc failed\n" );
             break;
         }
-        pts2[0] = raw_frame->pts;
-        pic.opaque = pts2;
+        pic.opaque = pic_ctx;
 
         /* If the AFD has changed, then change the SAR. x264 will write the SAR at the next keyframe
          * TODO: allow user to force keyframes in order to be frame accurate */
@@ -222,36 +216,68 @@ static void *start_encoder( void *ptr )
             x264_encoder_reconfig( s, &enc_params->avc_param );
         }
 
-        /* Update speedcontrol based on the system state */
-        if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+        /* Changes from obe_update_stream and a new statmux share are taken up once per GOP */
+        if( new_gop )
         {
-            pthread_mutex_lock( &h->smoothing_mutex );
-            if( h->smoothing_buffer_complete )
+            reconfig = 0;
+
+            pthread_mutex_lock( &encoder->encoder_mutex );
+            if( encoder->update_pending )
             {
-                /* Wait until a frame is sent out. */
-                while( !h->smoothing_last_exit_time )
-                    pthread_cond_wait( &h->smoothing_out_cv, &h->smoothing_mutex );
+                x264_param_t *param = &enc_params->avc_param;
+
+                param->rc.i_bitrate = encoder->update_bitrate;
+                param->sc.max_preset = encoder->update_max_preset;
+                param->sc.f_speed = encoder->update_speed;
+                /* The pool decides the vbv-maxrate, the new one is only our fair share of it */
+                if( statmux_idx >= 0 )
+                    obe_statmux_set_rate( h, statmux_idx, encoder->update_vbv_maxrate );
+                else
+                    param->rc.i_vbv_max_bitrate = encoder->update_vbv_maxrate;
+
+                memcpy( encoder->encoder_params, param, sizeof(*param) );
+                encoder->update_pending = 0;
+                reconfig = 1;
+                syslog( LOG_INFO, "Stream %i: bitrate %i kbit/s, vbv-maxrate %i kbit/s, max preset %i\n", encoder->stream_id,
+                        param->rc.i_bitrate, encoder->update_vbv_maxrate, param->sc.max_preset );
+            }
+            pthread_mutex_unlock( &encoder->encoder_mutex );
 
-                /* time elapsed since last frame was removed */
-                int64_t last_frame_delta = get_input_clock_in_mpeg_ticks( h ) - h->smoothing_last_exit_time;
+            /* Small statmux changes aren't worth a reconfig */
+            if( statmux_idx >= 0 )
+            {
+                int cur_rate = enc_params->avc_param.rc.i_vbv_max_bitrate;
 
-                if( h->num_smoothing_frames )
+                if( abs( statmux_rate - cur_rate ) * 20 > cur_rate )
                 {
-                    int64_t frame_durations = h->smoothing_frames[h->num_smoothing_frames-1]->real_dts - h->smoothing_frames[0]->real_dts + frame_duration;
-                    buffer_fill = (float)(frame_durations - last_frame_delta)/buffer_duration;
+                    enc_params->avc_param.rc.i_vbv_max_bitrate = statmux_rate;
+                    if( enc_params->avc_param.rc.i_rc_method == X264_RC_ABR )
+                        enc_params->avc_param.rc.i_bitrate = statmux_rate;
+                    reconfig = 1;
                 }
-                else
-                    buffer_fill = (float)(-1 * last_frame_delta)/buffer_duration;
-
-                x264_speedcontrol_sync( s, buffer_fill, enc_params->avc_param.sc.i_buffer_size, 1 );
             }
 
-            pthread_mutex_unlock( &h->smoothing_mutex );
+            if( reconfig )
+                x264_encoder_reconfig( s, &enc_params->avc_param );
+            new_gop = 0;
         }
 
+        /* Update speedcontrol from the buffer state the NAL thread last saw */
+        if( obe_vid_nal_buffer_fill( &nal_ctx, buffer_duration, &buffer_fill ) == 0 )
+        {
+            /* When shedding load the buffer is reported emptier than it is so the presets get faster early */
+            if( __atomic_load_n( &encoder->shed_level, __ATOMIC_RELAXED ) >= SHED_PRESET )
+                buffer_fill *= SHED_PRESET_FILL;
+            obe_trace_begin( "speedcontrol", "x264" );
+            x264_speedcontrol_sync( s, buffer_fill, enc_params->avc_param.sc.i_buffer_size, 1 );
+            obe_trace_end( "speedcontrol", "x264" );
+            __atomic_store_n( &encoder->speedcontrol_fill, (int)(buffer_fill * 1000), __ATOMIC_RELAXED );
+        }
+
+        obe_trace_begin( "encode", "x264" );
         frame_size = x264_encoder_encode( s, &nal, &i_nal, &pic, &pic_out );
+        obe_trace_end( "encode", "x264" );
 
-        arrival_time = raw_frame->arrival_time;
         raw_frame->release_data( raw_frame );
         raw_frame->release_frame( raw_frame );
         remove_frame_from_encode_queue( encoder );
@@ -264,7 +290,7 @@ static void *start_encoder( void *ptr )
 
         if( frame_size )
         {
-            coded_frame = new_coded_frame( encoder->stream_id, frame_size );
+            coded_frame = new_pooled_coded_frame( h, encoder->stream_id, frame_size );
             if( !coded_frame )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
@@ -277,23 +303,25 @@ static void *start_encoder( void *ptr )
             coded_frame->cpb_final_arrival_time = pic_out.hrd_timing.cpb_final_arrival_time;
             coded_frame->real_dts = pic_out.hrd_timing.cpb_removal_time;
             coded_frame->real_pts = pic_out.hrd_timing.dpb_output_time;
-            pts2 = pic_out.opaque;
-            coded_frame->pts = pts2[0];
+            pic_ctx = pic_out.opaque;
+            coded_frame->pts = pic_ctx->pts;
+            coded_frame->arrival_time = pic_ctx->arrival_time;
             coded_frame->random_access = pic_out.b_keyframe;
             coded_frame->priority = IS_X264_TYPE_I( pic_out.i_type );
-            free( pic_out.opaque );
+            obe_arena_unref( pic_ctx->arena );
 
-            if( h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
-            {
-                coded_frame->arrival_time = arrival_time;
-                //printf("\n Encode Latency %"PRIi64" \n", obe_mdate() - coded_frame->arrival_time );
-            }
+            if( statmux_idx >= 0 )
+                statmux_rate = obe_statmux_update( h, statmux_idx, frame_size * 8, pic_out.i_qpplus1 - 1 );
+            new_gop |= pic_out.b_keyframe;
 
-            add_to_smoothing_queue( h, coded_frame );
+            if( obe_vid_nal_push( &nal_ctx, coded_frame ) < 0 )
+                destroy_coded_frame( coded_frame );
         }
      }
 
 end:
+    obe_vid_nal_close( &nal_ctx );
+
     if( s )
         x264_encoder_close( s );
     free( enc_params );
@@ -0,0 +1,431 @@
+/*****************************************************************************
+ * x265.c : x265 encoding functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ ******************************************************************************/
+
+#include "common/common.h"
+#include "encoders/video/video.h"
+#include <libavutil/mathematics.h>
+#include <x265.h>
+
+/* The presets speedcontrol steps through, fastest first. x265 can only change its analysis
+ * settings once open so the structural ones (CTU size, lookahead, B-frames) stay those of
+ * the slowest preset allowed */
+static const char * const sc_preset_names[] = { "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", 0 };
+#define SC_NUM_PRESETS 6
+
+/* Smoothing buffer fill either side of which speedcontrol moves a preset */
+#define SC_FILL_LOW   0.5
+#define SC_FILL_HIGH  0.85
+/* Below this it doesn't wait out the hold time before going faster */
+#define SC_FILL_PANIC 0.25
+
+typedef struct
+{
+    x265_param *presets[SC_NUM_PRESETS];
+    int num_presets;
+    int preset;
+
+    /* A change only shows up in the buffer once the frames in the encoder have come out */
+    int settle_frames;
+    int hold_frames;
+    int frames_since_change;
+} x265_sc_t;
+
+static int sc_open( x265_sc_t *sc, const x265_api *api, x265_param *param, int max_preset, const char *tune, int64_t fps )
+{
+    sc->num_presets = MIN( max_preset, SC_NUM_PRESETS-1 ) + 1;
+    sc->preset = sc->num_presets - 1;
+
+    for( int i = 0; i < sc->num_presets; i++ )
+    {
+        sc->presets[i] = api->param_alloc();
+        if( !sc->presets[i] )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return -1;
+        }
+        api->param_default_preset( sc->presets[i], sc_preset_names[i], tune );
+    }
+
+    sc->settle_frames = param->lookaheadDepth + param->bframes + param->frameNumThreads + 1;
+    sc->hold_frames = sc->settle_frames + fps;
+
+    return 0;
+}
+
+static void sc_apply_preset( x265_sc_t *sc, const x265_api *api, x265_encoder *s, x265_param *param, int preset )
+{
+    x265_param *p = sc->presets[preset];
+
+    /* Only these are read by x265_encoder_reconfig */
+    param->maxNumReferences = p->maxNumReferences;
+    param->maxNumMergeCand  = p->maxNumMergeCand;
+    param->searchMethod     = p->searchMethod;
+    param->searchRange      = p->searchRange;
+    param->subpelRefine     = p->subpelRefine;
+    param->rdLevel          = p->rdLevel;
+    param->rdoqLevel        = p->rdoqLevel;
+    param->bEnableRectInter = p->bEnableRectInter;
+    param->bEnableAMP       = p->bEnableAMP;
+    param->bEnableEarlySkip = p->bEnableEarlySkip;
+    param->bEnableFastIntra = p->bEnableFastIntra;
+    param->bIntraInBFrames  = p->bIntraInBFrames;
+
+    if( api->encoder_reconfig( s, param ) < 0 )
+        syslog( LOG_WARNING, "[x265]: Speedcontrol could not change preset\n" );
+
+    sc->preset = preset;
+    sc->frames_since_change = 0;
+}
+
+static void sc_update( x265_sc_t *sc, const x265_api *api, x265_encoder *s, x265_param *param, float buffer_fill )
+{
+    int preset = sc->preset;
+
+    sc->frames_since_change++;
+
+    if( buffer_fill < SC_FILL_PANIC && sc->frames_since_change >= sc->settle_frames )
+        preset--;
+    else if( sc->frames_since_change >= sc->hold_frames )
+    {
+        if( buffer_fill < SC_FILL_LOW )
+            preset--;
+        else if( buffer_fill > SC_FILL_HIGH )
+            preset++;
+    }
+
+    preset = MIN( MAX( preset, 0 ), sc->num_presets - 1 );
+    if( preset != sc->preset )
+        sc_apply_preset( sc, api, s, param, preset );
+}
+
+static void sc_close( x265_sc_t *sc, const x265_api *api )
+{
+    for( int i = 0; i < sc->num_presets; i++ )
+    {
+        if( sc->presets[i] )
+            api->param_free( sc->presets[i] );
+    }
+}
+
+static void convert_x264_to_x265_param( x265_param *param, x264_param_t *avc_param )
+{
+    param->sourceWidth  = avc_param->i_width;
+    param->sourceHeight = avc_param->i_height;
+    param->fpsNum       = avc_param->i_fps_num;
+    param->fpsDenom     = avc_param->i_fps_den;
+    param->internalCsp  = ( avc_param->i_csp & X264_CSP_MASK ) == X264_CSP_I422 ? X265_CSP_I422 : X265_CSP_I420;
+    param->interlaceMode = avc_param->b_interlaced ? ( avc_param->b_tff ? 1 : 2 ) : 0;
+    if( avc_param->i_level_idc > 0 )
+        param->levelIdc = avc_param->i_level_idc;
+
+    param->keyframeMax    = avc_param->i_keyint_max;
+    param->bOpenGOP       = avc_param->b_open_gop;
+    param->bframes        = avc_param->i_bframe;
+    param->bBPyramid      = avc_param->i_bframe_pyramid > 0;
+    param->lookaheadDepth = avc_param->rc.i_lookahead;
+    param->bIntraRefresh  = avc_param->b_intra_refresh;
+    param->bEnableWeightedPred = avc_param->analyse.i_weighted_pred > 0;
+
+    param->rc.rateControlMode = X265_RC_ABR;
+    param->rc.bitrate         = avc_param->rc.i_bitrate;
+    param->rc.vbvMaxBitrate   = avc_param->rc.i_vbv_max_bitrate;
+    param->rc.vbvBufferSize   = avc_param->rc.i_vbv_buffer_size;
+    param->rc.vbvBufferInit   = avc_param->rc.f_vbv_buffer_init;
+    param->bEmitHRDSEI        = 1;
+
+    if( avc_param->vui.i_sar_width > 0 && avc_param->vui.i_sar_height > 0 )
+    {
+        param->vui.aspectRatioIdc = X265_EXTENDED_SAR;
+        param->vui.sarWidth  = avc_param->vui.i_sar_width;
+        param->vui.sarHeight = avc_param->vui.i_sar_height;
+    }
+    param->vui.bEnableOverscanInfoPresentFlag = avc_param->vui.i_overscan > 0;
+    param->vui.bEnableOverscanAppropriateFlag = avc_param->vui.i_overscan == 2;
+    param->vui.bEnableVideoSignalTypePresentFlag  = 1;
+    param->vui.videoFormat = avc_param->vui.i_vidformat;
+    param->vui.bEnableColorDescriptionPresentFlag = 1;
+    param->vui.colorPrimaries = avc_param->vui.i_colorprim;
+    param->vui.transferCharacteristics = avc_param->vui.i_transfer;
+    param->vui.matrixCoeffs = avc_param->vui.i_colmatrix;
+
+    param->bAnnexB = 1;
+    param->bRepeatHeaders = 1;
+    param->bEnableAccessUnitDelimiters = 1;
+    param->logLevel = X265_LOG_WARNING;
+}
+
+static int convert_obe_to_x265_pic( x265_picture *pic, obe_raw_frame_t *raw_frame )
+{
+    obe_image_t *img = &raw_frame->img;
+    int idx = 0, count = 0;
+
+    for( int i = 0; i < img->planes; i++ )
+    {
+        pic->planes[i] = img->plane[i];
+        pic->stride[i] = img->stride[i];
+    }
+    pic->bitDepth = X264_BIT_DEPTH;
+
+    for( int i = 0; i < raw_frame->num_user_data; i++ )
+    {
+        /* Only give correctly formatted data to the encoder */
+        if( raw_frame->user_data[i].type == USER_DATA_AVC_REGISTERED_ITU_T35 ||
+            raw_frame->user_data[i].type == USER_DATA_AVC_UNREGISTERED )
+            count++;
+        else
+        {
+            syslog( LOG_WARNING, "Invalid user data presented to encoder - type %i \n", raw_frame->user_data[i].type );
+            raw_frame->user_data[i].data = NULL;
+        }
+    }
+
+    pic->userSEI.numPayloads = count;
+    pic->userSEI.payloads = NULL;
+
+    if( count )
+    {
+        /* x265 copies the SEI when the picture is passed in so it can go with the frame's arena */
+        pic->userSEI.payloads = obe_frame_alloc( raw_frame, count * sizeof(*pic->userSEI.payloads) );
+        if( !pic->userSEI.payloads )
+            return -1;
+
+        /* The payload types are the same in AVC and HEVC */
+        for( int i = 0; i < raw_frame->num_user_data; i++ )
+        {
+            if( raw_frame->user_data[i].data )
+            {
+                pic->userSEI.payloads[idx].payloadType = raw_frame->user_data[i].type;
+                pic->userSEI.payloads[idx].payloadSize = raw_frame->user_data[i].len;
+                pic->userSEI.payloads[idx].payload = raw_frame->user_data[i].data;
+                idx++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void *start_encoder( void *ptr )
+{
+    obe_vid_enc_params_t *enc_params = ptr;
+    obe_t *h = enc_params->h;
+    obe_encoder_t *encoder = enc_params->encoder;
+    x264_param_t *avc_param = &enc_params->avc_param;
+    const x265_api *api;
+    x265_param *param = NULL;
+    x265_encoder *s = NULL;
+    x265_picture pic, pic_out;
+    x265_nal *nal;
+    uint32_t i_nal;
+    int ret, frame_size, pos, has_sc = 0;
+    int64_t pts = 0, frame_duration, buffer_duration;
+    obe_vid_pic_ctx_t *pic_ctx;
+    float buffer_fill;
+    const char *tune = h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? "zerolatency" : NULL;
+    obe_raw_frame_t *raw_frame;
+    obe_coded_frame_t *coded_frame;
+    obe_vid_nal_ctx_t nal_ctx = {0};
+    obe_vid_hrd_t hrd;
+    x265_sc_t sc = {{0}};
+
+    /* Lock the mutex until we verify and fetch new parameters */
+    pthread_mutex_lock( &encoder->encoder_mutex );
+
+    /* The video filter outputs pictures at x264's bit depth */
+    api = x265_api_get( X264_BIT_DEPTH );
+    if( !api )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "[x265]: x265 was not built for %i-bit\n", X264_BIT_DEPTH );
+        goto end;
+    }
+
+    param = api->param_alloc();
+    if( !param )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+
+    api->param_default_preset( param, h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? "veryfast" :
+                               sc_preset_names[MIN( avc_param->sc.max_preset, SC_NUM_PRESETS-1 )], tune );
+    convert_x264_to_x265_param( param, avc_param );
+
+    if( api->param_apply_profile( param, param->internalCsp == X265_CSP_I422 ? "main422-10" :
+                                         X264_BIT_DEPTH == 10 ? "main10" : "main" ) < 0 )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "[x265]: Unsupported chroma format or bit depth\n" );
+        goto end;
+    }
+
+    s = api->encoder_open( param );
+    if( !s )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        fprintf( stderr, "[x265]: encoder configuration failed\n" );
+        goto end;
+    }
+
+    api->encoder_parameters( s, param );
+
+    /* The smoothing and mux stages read the settings in x264's form */
+    encoder->encoder_params = malloc( sizeof(*avc_param) );
+    if( !encoder->encoder_params )
+    {
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
+    memcpy( encoder->encoder_params, avc_param, sizeof(*avc_param) );
+
+    encoder->is_ready = 1;
+    frame_duration = av_rescale_q( 1, (AVRational){avc_param->i_fps_den, avc_param->i_fps_num}, (AVRational){1, OBE_CLOCK} );
+    buffer_duration = frame_duration * avc_param->sc.i_buffer_size;
+
+    /* Broadcast because input and muxer can be stuck waiting for encoder */
+    pthread_cond_broadcast( &encoder->encoder_cv );
+    pthread_mutex_unlock( &encoder->encoder_mutex );
+
+    /* x265 has no hrd timing output so the CPB is modelled the way it enforces the VBV */
+    obe_vid_hrd_init( &hrd, avc_param->rc.i_vbv_max_bitrate ? avc_param->rc.i_vbv_max_bitrate : avc_param->rc.i_bitrate,
+                      avc_param->rc.i_vbv_buffer_size );
+
+    if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+    {
+        if( sc_open( &sc, api, param, avc_param->sc.max_preset, tune, (avc_param->i_fps_num + avc_param->i_fps_den - 1) / avc_param->i_fps_den ) < 0 )
+            goto end;
+        has_sc = 1;
+    }
+
+    if( obe_vid_nal_open( &nal_ctx, h, encoder, "x265 nal", frame_duration ) < 0 )
+        goto end;
+
+    while( 1 )
+    {
+        raw_frame = get_frame_from_encode_queue( encoder );
+        if( !raw_frame )
+            break;
+
+        /* Give the buffer time to refill if the source has dropped frames rather than
+         * locking speedcontrol to the fastest preset */
+        pthread_mutex_lock( &h->drop_mutex );
+        if( h->encoder_drop )
+        {
+            obe_vid_nal_reset( &nal_ctx );
+            syslog( LOG_INFO, "Speedcontrol reset\n" );
+            sc.frames_since_change = 0;
+            h->encoder_drop = 0;
+        }
+        pthread_mutex_unlock( &h->drop_mutex );
+
+        api->picture_init( param, &pic );
+        if( convert_obe_to_x265_pic( &pic, raw_frame ) < 0 )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            break;
+        }
+
+        /* FIXME: if frames are dropped this might not be true */
+        pic.pts = pts++;
+        pic_ctx = obe_vid_pic_ctx_new( raw_frame );
+        if( !pic_ctx )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            break;
+        }
+        pic.userData = pic_ctx;
+
+        /* TODO: x265 can't change the VUI once open so AFD changes don't change the SAR */
+
+        if( has_sc && obe_vid_nal_buffer_fill( &nal_ctx, buffer_duration, &buffer_fill ) == 0 )
+        {
+            sc_update( &sc, api, s, param, buffer_fill );
+            __atomic_store_n( &encoder->speedcontrol_fill, (int)(buffer_fill * 1000), __ATOMIC_RELAXED );
+        }
+
+        api->picture_init( param, &pic_out );
+        obe_trace_begin( "encode", "x265" );
+        ret = api->encoder_encode( s, &nal, &i_nal, &pic, &pic_out );
+        obe_trace_end( "encode", "x265" );
+
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+        remove_frame_from_encode_queue( encoder );
+
+        if( ret < 0 )
+        {
+            obe_arena_unref( pic_ctx->arena );
+            syslog( LOG_ERR, "x265_encoder_encode failed\n" );
+            break;
+        }
+
+        if( !ret )
+            continue;
+
+        frame_size = 0;
+        for( uint32_t i = 0; i < i_nal; i++ )
+            frame_size += nal[i].sizeBytes;
+
+        coded_frame = new_pooled_coded_frame( h, encoder->stream_id, frame_size );
+        if( !coded_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            break;
+        }
+        pos = 0;
+        for( uint32_t i = 0; i < i_nal; i++ )
+        {
+            memcpy( coded_frame->data + pos, nal[i].payload, nal[i].sizeBytes );
+            pos += nal[i].sizeBytes;
+        }
+        coded_frame->is_video = 1;
+        coded_frame->len = frame_size;
+        obe_vid_hrd_set_timing( &hrd, coded_frame, pic_out.dts * frame_duration, pic_out.pts * frame_duration );
+        pic_ctx = pic_out.userData;
+        coded_frame->pts = pic_ctx->pts;
+        coded_frame->arrival_time = pic_ctx->arrival_time;
+        coded_frame->random_access = IS_X265_TYPE_I( pic_out.sliceType );
+        coded_frame->priority = coded_frame->random_access;
+        obe_arena_unref( pic_ctx->arena );
+
+        if( obe_vid_nal_push( &nal_ctx, coded_frame ) < 0 )
+            destroy_coded_frame( coded_frame );
+    }
+
+end:
+    obe_vid_nal_close( &nal_ctx );
+    if( sc.num_presets )
+        sc_close( &sc, api );
+
+    if( s )
+        api->encoder_close( s );
+    if( param )
+        api->param_free( param );
+    free( enc_params );
+
+    return NULL;
+}
+
+const obe_vid_enc_func_t x265_hevc_encoder = { start_encoder };
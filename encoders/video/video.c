@@ -0,0 +1,285 @@
+/*****************************************************************************
+ * video.c : OBE video encoding functions shared between encoders
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include "common/common.h"
+#include "encoders/video/video.h"
+
+/* Coded frames are handed from the encode thread to the NAL thread in output order */
+#define NAL_QUEUE_SIZE 256
+
+/* Same initial fill as x264's default */
+#define HRD_VBV_INIT 0.9
+
+/* Everything that happens to a coded frame after the encoder returns it runs here so the
+ * encode thread goes straight back to feeding the encoder */
+static void *start_nal_thread( void *ptr )
+{
+    obe_vid_nal_ctx_t *nal_ctx = ptr;
+    obe_t *h = nal_ctx->h;
+    obe_coded_frame_t *coded_frame;
+    int64_t real_dts;
+
+    while( 1 )
+    {
+        coded_frame = obe_queue_front( &nal_ctx->queue );
+        if( !coded_frame )
+        {
+            if( __atomic_load_n( &nal_ctx->cancel, __ATOMIC_ACQUIRE ) )
+                break;
+            obe_queue_wait( &nal_ctx->queue, &nal_ctx->cancel );
+            continue;
+        }
+        obe_queue_pop( &nal_ctx->queue );
+
+        /* The frame belongs to the smoothing thread once it is queued */
+        real_dts = coded_frame->real_dts;
+        obe_latency_record( &nal_ctx->encoder->latency, coded_frame->arrival_time );
+        if( add_to_smoothing_queue( h, coded_frame ) < 0 )
+            destroy_coded_frame( coded_frame );
+
+        /* The buffer drains at the smoothing thread's deadlines so it ends when the newest
+         * frame's deadline has passed */
+        if( h->obe_system == OBE_SYSTEM_TYPE_GENERIC )
+        {
+            obe_trace_mutex_lock( &h->smoothing_mutex, "smoothing_mutex" );
+            if( h->smoothing_buffer_complete )
+                __atomic_store_n( &nal_ctx->buffer_end, h->smoothing_start_time + real_dts - h->smoothing_start_dts +
+                                  nal_ctx->frame_duration, __ATOMIC_RELAXED );
+            else
+                __atomic_store_n( &nal_ctx->buffer_end, INT64_MIN, __ATOMIC_RELAXED );
+            pthread_mutex_unlock( &h->smoothing_mutex );
+        }
+    }
+
+    return NULL;
+}
+
+int obe_vid_nal_open( obe_vid_nal_ctx_t *nal_ctx, obe_t *h, obe_encoder_t *encoder, const char *name, int64_t frame_duration )
+{
+    memset( nal_ctx, 0, sizeof(*nal_ctx) );
+    nal_ctx->h = h;
+    nal_ctx->encoder = encoder;
+    nal_ctx->frame_duration = frame_duration;
+    nal_ctx->buffer_end = INT64_MIN;
+
+    if( obe_queue_init( &nal_ctx->queue, name, NAL_QUEUE_SIZE, 1 ) < 0 )
+        return -1;
+
+    if( pthread_create( &nal_ctx->thread, NULL, start_nal_thread, nal_ctx ) < 0 )
+    {
+        fprintf( stderr, "Couldn't create NAL thread\n" );
+        obe_queue_destroy( &nal_ctx->queue );
+        return -1;
+    }
+    nal_ctx->is_running = 1;
+
+    return 0;
+}
+
+int obe_vid_nal_buffer_fill( obe_vid_nal_ctx_t *nal_ctx, int64_t buffer_duration, float *buffer_fill )
+{
+    int64_t buffer_end = __atomic_load_n( &nal_ctx->buffer_end, __ATOMIC_RELAXED );
+
+    if( nal_ctx->h->obe_system != OBE_SYSTEM_TYPE_GENERIC || buffer_end == INT64_MIN )
+        return -1;
+
+    /* The input clock is read without a lock so this doesn't hold the encoder up */
+    *buffer_fill = (float)(buffer_end - get_input_clock_in_mpeg_ticks( nal_ctx->h ))/buffer_duration;
+    return 0;
+}
+
+void obe_vid_nal_reset( obe_vid_nal_ctx_t *nal_ctx )
+{
+    obe_t *h = nal_ctx->h;
+
+    pthread_mutex_lock( &h->smoothing_mutex );
+    h->smoothing_buffer_complete = 0;
+    __atomic_store_n( &nal_ctx->buffer_end, INT64_MIN, __ATOMIC_RELAXED );
+    pthread_mutex_unlock( &h->smoothing_mutex );
+}
+
+void obe_vid_nal_close( obe_vid_nal_ctx_t *nal_ctx )
+{
+    if( !nal_ctx->is_running )
+        return;
+
+    __atomic_store_n( &nal_ctx->cancel, 1, __ATOMIC_RELEASE );
+    obe_queue_wake( &nal_ctx->queue );
+    pthread_join( nal_ctx->thread, NULL );
+    obe_queue_destroy( &nal_ctx->queue );
+    nal_ctx->is_running = 0;
+}
+
+void obe_vid_hrd_init( obe_vid_hrd_t *hrd, int bitrate, int vbv_bufsize )
+{
+    memset( hrd, 0, sizeof(*hrd) );
+    hrd->bitrate = (int64_t)bitrate * 1000;
+    hrd->init_delay = (int64_t)( HRD_VBV_INIT * vbv_bufsize * OBE_CLOCK / bitrate );
+    hrd->first_dts = INT64_MIN;
+}
+
+void obe_vid_hrd_set_timing( obe_vid_hrd_t *hrd, obe_coded_frame_t *coded_frame, int64_t dts, int64_t pts )
+{
+    int64_t initial_arrival;
+
+    if( hrd->first_dts == INT64_MIN )
+        hrd->first_dts = dts;
+
+    coded_frame->real_dts = dts - hrd->first_dts + hrd->init_delay;
+    coded_frame->real_pts = pts - hrd->first_dts + hrd->init_delay;
+
+    initial_arrival = MAX( hrd->last_final_arrival, coded_frame->real_dts - hrd->init_delay );
+    coded_frame->cpb_initial_arrival_time = initial_arrival;
+    coded_frame->cpb_final_arrival_time = initial_arrival + (int64_t)coded_frame->len * 8 * OBE_CLOCK / hrd->bitrate;
+    hrd->last_final_arrival = coded_frame->cpb_final_arrival_time;
+
+    if( coded_frame->cpb_final_arrival_time > coded_frame->real_dts && !hrd->has_underflowed )
+    {
+        syslog( LOG_WARNING, "Video encoder exceeded the VBV buffer on stream %i\n", coded_frame->stream_id );
+        hrd->has_underflowed = 1;
+    }
+}
+
+/**** Statistical multiplexing ****/
+
+/* Each share stays within these fractions of what the encoder was configured with */
+#define STATMUX_MIN_SHARE 0.5
+#define STATMUX_MAX_SHARE 2.0
+/* Roughly a GOP's worth of frames to average complexity over */
+#define STATMUX_AVG_FRAMES 32
+
+static double qp2qscale( int qp )
+{
+    return 0.85 * pow( 2.0, ( qp - 12.0 ) / 6.0 );
+}
+
+/* Gives out the pool in proportion to complexity per second, which aims for the same qscale everywhere.
+ * Encoders that hit a limit are taken out and the rest of the pool given out again among the others */
+static void statmux_allocate( obe_statmux_t *statmux )
+{
+    int done[MAX_STREAMS] = {0};
+    double pool = 0;
+
+    for( int i = 0; i < statmux->num_entries; i++ )
+        pool += statmux->entries[i].base_rate;
+
+    for( int pass = 0; pass < statmux->num_entries; pass++ )
+    {
+        double total = 0, left = pool;
+        int clamped = 0;
+
+        for( int i = 0; i < statmux->num_entries; i++ )
+        {
+            if( done[i] )
+                left -= statmux->entries[i].rate;
+            else
+                total += statmux->entries[i].complexity * statmux->entries[i].fps;
+        }
+
+        if( total <= 0 )
+            break;
+
+        for( int i = 0; i < statmux->num_entries; i++ )
+        {
+            obe_statmux_entry_t *entry = &statmux->entries[i];
+            double rate;
+
+            if( done[i] )
+                continue;
+
+            rate = left * entry->complexity * entry->fps / total;
+            if( rate < entry->base_rate * STATMUX_MIN_SHARE || rate > entry->base_rate * STATMUX_MAX_SHARE )
+            {
+                entry->rate = MIN( MAX( rate, entry->base_rate * STATMUX_MIN_SHARE ), entry->base_rate * STATMUX_MAX_SHARE );
+                done[i] = clamped = 1;
+            }
+            else
+                entry->rate = rate;
+        }
+
+        if( !clamped )
+            break;
+    }
+}
+
+int obe_statmux_add( obe_t *h, int stream_id, int bitrate, int64_t frame_duration )
+{
+    obe_statmux_t *statmux = &h->statmux;
+    obe_statmux_entry_t *entry;
+    int idx;
+
+    pthread_mutex_lock( &statmux->mutex );
+    idx = statmux->num_entries++;
+    entry = &statmux->entries[idx];
+    entry->stream_id = stream_id;
+    entry->base_rate = entry->rate = bitrate;
+    entry->fps = (double)OBE_CLOCK / frame_duration;
+    entry->complexity = 0;
+    pthread_mutex_unlock( &statmux->mutex );
+
+    syslog( LOG_INFO, "Stream %i joined the statmux pool with %i kbit/s\n", stream_id, bitrate );
+
+    return idx;
+}
+
+int obe_statmux_update( obe_t *h, int idx, int frame_bits, int qp )
+{
+    obe_statmux_t *statmux = &h->statmux;
+    obe_statmux_entry_t *entry = &statmux->entries[idx];
+    double complexity = frame_bits * qp2qscale( qp );
+    int rate;
+
+    pthread_mutex_lock( &statmux->mutex );
+    if( entry->complexity <= 0 )
+        entry->complexity = complexity;
+    else
+        entry->complexity += ( complexity - entry->complexity ) / STATMUX_AVG_FRAMES;
+
+    /* Nothing is given out until every encoder has said how hard its picture is */
+    for( int i = 0; i < statmux->num_entries; i++ )
+    {
+        if( statmux->entries[i].complexity <= 0 )
+        {
+            pthread_mutex_unlock( &statmux->mutex );
+            return entry->rate;
+        }
+    }
+
+    statmux_allocate( statmux );
+    rate = entry->rate;
+    pthread_mutex_unlock( &statmux->mutex );
+
+    return rate;
+}
+
+void obe_statmux_set_rate( obe_t *h, int idx, int bitrate )
+{
+    obe_statmux_t *statmux = &h->statmux;
+
+    pthread_mutex_lock( &statmux->mutex );
+    statmux->entries[idx].base_rate = bitrate;
+    pthread_mutex_unlock( &statmux->mutex );
+
+    syslog( LOG_INFO, "Stream %i now has %i kbit/s in the statmux pool\n", statmux->entries[idx].stream_id, bitrate );
+}
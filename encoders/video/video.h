@@ -33,9 +33,91 @@ typedef struct
 {
     obe_t *h;
     obe_encoder_t *encoder;
+    int video_encoder;
     x264_param_t avc_param;
 } obe_vid_enc_params_t;
 
+/* Carried through the encoder with each picture so the coded frame gets the timing of the
+ * picture that actually came out. It lives in the frame's arena, on which the encoder holds
+ * a reference from submitting the picture until it is output */
+typedef struct
+{
+    int64_t pts;
+    int64_t arrival_time;
+    obe_arena_t *arena;
+} obe_vid_pic_ctx_t;
+
+static inline obe_vid_pic_ctx_t *obe_vid_pic_ctx_new( obe_raw_frame_t *raw_frame )
+{
+    obe_vid_pic_ctx_t *pic_ctx = obe_frame_alloc( raw_frame, sizeof(*pic_ctx) );
+    if( !pic_ctx )
+        return NULL;
+
+    pic_ctx->pts = raw_frame->pts;
+    pic_ctx->arrival_time = raw_frame->arrival_time;
+    pic_ctx->arena = raw_frame->arena;
+    obe_arena_ref( pic_ctx->arena );
+
+    return pic_ctx;
+}
+
+/* Hands coded frames to a thread which queues them for smoothing and tracks when
+ * the smoothing buffer would drain, so the encode thread can read the buffer fill */
+typedef struct
+{
+    obe_t *h;
+    obe_encoder_t *encoder;
+    int64_t frame_duration;
+
+    obe_queue_t queue;
+    pthread_t thread;
+    int is_running;
+    int cancel;
+
+    /* Input clock time at which the smoothing buffer would drain, INT64_MIN when the
+     * buffer isn't full. Only written with smoothing_mutex held */
+    int64_t buffer_end;
+} obe_vid_nal_ctx_t;
+
+int  obe_vid_nal_open( obe_vid_nal_ctx_t *nal_ctx, obe_t *h, obe_encoder_t *encoder, const char *name, int64_t frame_duration );
+/* Fill of the smoothing buffer as a fraction of buffer_duration, which goes negative once it
+ * has drained. Returns -1 if the buffer isn't full yet */
+int  obe_vid_nal_buffer_fill( obe_vid_nal_ctx_t *nal_ctx, int64_t buffer_duration, float *buffer_fill );
+/* Marks the smoothing buffer as refilling after the input has dropped frames */
+void obe_vid_nal_reset( obe_vid_nal_ctx_t *nal_ctx );
+/* Queues everything already pushed for smoothing before returning */
+void obe_vid_nal_close( obe_vid_nal_ctx_t *nal_ctx );
+
+static inline int obe_vid_nal_push( obe_vid_nal_ctx_t *nal_ctx, obe_coded_frame_t *coded_frame )
+{
+    return obe_queue_push( &nal_ctx->queue, coded_frame );
+}
+
+/* Leaky bucket CPB model for encoders which don't return hrd timing */
+typedef struct
+{
+    int64_t bitrate;    /* bits per second */
+    int64_t init_delay; /* 27MHz */
+    int64_t first_dts;
+    int64_t last_final_arrival;
+    int has_underflowed;
+} obe_vid_hrd_t;
+
+/* bitrate in kbit/s and vbv_bufsize in kbit */
+void obe_vid_hrd_init( obe_vid_hrd_t *hrd, int bitrate, int vbv_bufsize );
+/* dts and pts are the encoder's timestamps in 27MHz. Needs coded_frame->len */
+void obe_vid_hrd_set_timing( obe_vid_hrd_t *hrd, obe_coded_frame_t *coded_frame, int64_t dts, int64_t pts );
+
+/* Statistical multiplexing. The video encoders in the pool share the sum of the bitrates they joined with,
+ * in kbit/s. Returns the encoder's index in the pool */
+int obe_statmux_add( obe_t *h, int stream_id, int bitrate, int64_t frame_duration );
+/* Records the size and qp of a coded frame and returns the bitrate the encoder should now use */
+int obe_statmux_update( obe_t *h, int idx, int frame_bits, int qp );
+/* Changes the bitrate the encoder joined with. The pool is shared out again at the next update */
+void obe_statmux_set_rate( obe_t *h, int idx, int bitrate );
+
 extern const obe_vid_enc_func_t x264_encoder;
+extern const obe_vid_enc_func_t lavc_avc_encoder;
+extern const obe_vid_enc_func_t x265_hevc_encoder;
 
 #endif
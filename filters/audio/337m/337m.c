@@ -21,21 +21,273 @@
  *
  *****************************************************************************/
 
-#define 337M_SYNCWORD_1_16_BIT 0xf872
-#define 337M_SYNCWORD_1_20_BIT 0x6f872
-#define 337M_SYNCWORD_1_24_BIT 0x96f872
-
-#define 337M_SYNCWORD_2_16_BIT 0x4e1f
-#define 337M_SYNCWORD_2_20_BIT 0x54e1f
-#define 337M_SYNCWORD_2_24_BIT 0xa54e1f
-
-#define 337M_DATA_TYPE_NULL      0
-#define 337M_DATA_TYPE_AC_3      1
-#define 337M_DATA_TYPE_TIMESTAMP 2
-#define 337M_DATA_TYPE_MP2       6
-#define 337M_DATA_TYPE_AAC       10
-#define 337M_DATA_TYPE_HE_AAC    11
-#define 337M_DATA_TYPE_E_AC_3    16
-#define 337M_DATA_TYPE_E_DIST    28
-
-// 337M startcode search function TODO
+#include "common/common.h"
+#include "filters/audio/337m/337m.h"
+#include "filters/audio/x86/337m.h"
+#include <libavutil/cpu.h>
+#include <libavutil/mathematics.h>
+
+#define SMPTE337M_SYNCWORD_1_16_BIT 0xf872
+#define SMPTE337M_SYNCWORD_1_20_BIT 0x6f872
+#define SMPTE337M_SYNCWORD_1_24_BIT 0x96f872
+
+#define SMPTE337M_SYNCWORD_2_16_BIT 0x4e1f
+#define SMPTE337M_SYNCWORD_2_20_BIT 0x54e1f
+#define SMPTE337M_SYNCWORD_2_24_BIT 0xa54e1f
+
+/* Larger than any AC-3 or E-AC-3 frame */
+#define SMPTE337M_MAX_PAYLOAD 65536
+/* The last word of a burst can carry up to 23 bits past its end, then send_burst flushes the cache */
+#define SMPTE337M_PAYLOAD_PADDING 4
+
+enum smpte337m_state_e
+{
+    SMPTE337M_SEARCH,
+    SMPTE337M_HEADER, /* Pc and Pd */
+    SMPTE337M_PAYLOAD,
+};
+
+static const uint32_t sync_words[][3] =
+{
+    { 16, SMPTE337M_SYNCWORD_1_16_BIT, SMPTE337M_SYNCWORD_2_16_BIT },
+    { 20, SMPTE337M_SYNCWORD_1_20_BIT, SMPTE337M_SYNCWORD_2_20_BIT },
+    { 24, SMPTE337M_SYNCWORD_1_24_BIT, SMPTE337M_SYNCWORD_2_24_BIT },
+};
+
+static inline uint32_t get_word( int32_t sample, int word_bits )
+{
+    return (uint32_t)sample >> ( 32 - word_bits );
+}
+
+static int is_sync_1( int32_t sample )
+{
+    for( int i = 0; i < 3; i++ )
+        if( get_word( sample, sync_words[i][0] ) == sync_words[i][1] )
+            return 1;
+    return 0;
+}
+
+static int is_sync_2( int32_t sample )
+{
+    for( int i = 0; i < 3; i++ )
+        if( get_word( sample, sync_words[i][0] ) == sync_words[i][2] )
+            return 1;
+    return 0;
+}
+
+/* Word length of the sync in a frame, or 0 if Pa and Pb don't agree */
+static int sync_word_bits( const int32_t *frame )
+{
+    for( int i = 0; i < 3; i++ )
+    {
+        if( get_word( frame[0], sync_words[i][0] ) == sync_words[i][1] &&
+            get_word( frame[1], sync_words[i][0] ) == sync_words[i][2] )
+            return sync_words[i][0];
+    }
+
+    return 0;
+}
+
+int obe_find_337m_sync_c( const int32_t *samples, int num_frames )
+{
+    for( int i = 0; i < num_frames; i++ )
+    {
+        if( is_sync_1( samples[2*i] ) && is_sync_2( samples[2*i+1] ) )
+            return i;
+    }
+
+    return num_frames;
+}
+
+static int find_sync( obe_337m_ctx_t *ctx, const int32_t *samples, int num_frames )
+{
+    int simd_frames = num_frames / ctx->sync_step * ctx->sync_step;
+    int pos = ctx->find_sync( samples, simd_frames );
+
+    if( pos < simd_frames )
+        return pos;
+
+    return simd_frames + obe_find_337m_sync_c( samples + 2*simd_frames, num_frames - simd_frames );
+}
+
+int obe_337m_probe( const int32_t *samples, int num_frames )
+{
+    int pos = 0, word_bits;
+    uint32_t pc;
+
+    while( ( pos += obe_find_337m_sync_c( samples + 2*pos, num_frames - pos ) ) < num_frames - 1 )
+    {
+        word_bits = sync_word_bits( &samples[2*pos] );
+        pc = get_word( samples[2*pos+2], word_bits ) >> ( word_bits - 16 );
+
+        if( word_bits && ( ( pc >> 5 ) & 3 ) == ( word_bits - 16 ) / 4 )
+            return pc & 0x1f;
+
+        pos++;
+    }
+
+    return -1;
+}
+
+int obe_337m_stream_format( int data_type )
+{
+    if( data_type == SMPTE337M_DATA_TYPE_AC_3 )
+        return AUDIO_AC_3;
+    else if( data_type == SMPTE337M_DATA_TYPE_E_AC_3 )
+        return AUDIO_E_AC_3;
+
+    /* TODO: Dolby E needs SMPTE 302M carriage */
+    return -1;
+}
+
+int obe_337m_open( obe_337m_ctx_t *ctx, obe_t *h, obe_int_input_stream_t *input_stream,
+                   obe_output_stream_t *output_streams, int num_output_streams )
+{
+    int cpu_flags = obe_get_cpu_flags();
+
+    memset( ctx, 0, sizeof(*ctx) );
+    ctx->h = h;
+    ctx->sample_rate = input_stream->sample_rate;
+
+    for( int i = 0; i < num_output_streams; i++ )
+    {
+        if( output_streams[i].input_stream_id == input_stream->stream_id &&
+            output_streams[i].stream_action == STREAM_PASSTHROUGH )
+            ctx->output_stream_ids[ctx->num_output_streams++] = output_streams[i].stream_id;
+    }
+
+    if( !ctx->num_output_streams )
+        return 0;
+
+    ctx->payload = malloc( SMPTE337M_MAX_PAYLOAD + SMPTE337M_PAYLOAD_PADDING );
+    if( !ctx->payload )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    ctx->find_sync = obe_find_337m_sync_c;
+    ctx->sync_step = 1;
+
+    if( cpu_flags & AV_CPU_FLAG_SSE2 )
+    {
+        ctx->find_sync = obe_find_337m_sync_sse2;
+        ctx->sync_step = 2;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        ctx->find_sync = obe_find_337m_sync_avx2;
+        ctx->sync_step = 4;
+    }
+
+    return 0;
+}
+
+static void put_word( obe_337m_ctx_t *ctx, uint32_t word )
+{
+    ctx->bit_cache = ( ctx->bit_cache << ctx->word_bits ) | word;
+    ctx->cache_bits += ctx->word_bits;
+
+    while( ctx->cache_bits >= 8 )
+    {
+        ctx->cache_bits -= 8;
+        ctx->payload[ctx->payload_pos++] = ctx->bit_cache >> ctx->cache_bits;
+    }
+}
+
+static void send_burst( obe_337m_ctx_t *ctx )
+{
+    obe_coded_frame_t *coded_frame;
+    int len = ( ctx->payload_bits + 7 ) / 8;
+
+    if( ctx->cache_bits )
+        ctx->payload[ctx->payload_pos++] = ctx->bit_cache << ( 8 - ctx->cache_bits );
+
+    for( int i = 0; i < ctx->num_output_streams; i++ )
+    {
+        coded_frame = new_pooled_coded_frame( ctx->h, ctx->output_stream_ids[i], len );
+        if( !coded_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return;
+        }
+
+        memcpy( coded_frame->data, ctx->payload, len );
+        coded_frame->pts = ctx->burst_pts;
+        coded_frame->random_access = 1;
+
+        if( add_to_mux_queue( ctx->h, coded_frame ) < 0 )
+            destroy_coded_frame( coded_frame );
+    }
+}
+
+int obe_337m_extract( obe_337m_ctx_t *ctx, const int32_t *samples, int num_frames, int64_t pts )
+{
+    int num_words = num_frames * 2;
+    int pos = 0, frame;
+    uint32_t pc;
+
+    while( pos < num_words )
+    {
+        if( ctx->state == SMPTE337M_SEARCH )
+        {
+            /* Bursts start on a frame so the search is always on an even word */
+            frame = find_sync( ctx, samples + pos, ( num_words - pos ) / 2 );
+            pos += frame * 2;
+            if( pos >= num_words )
+                break;
+
+            ctx->word_bits = sync_word_bits( &samples[pos] );
+            if( ctx->word_bits )
+            {
+                ctx->burst_pts = pts + av_rescale( pos / 2, OBE_CLOCK, ctx->sample_rate );
+                ctx->num_header_words = 0;
+                ctx->state = SMPTE337M_HEADER;
+            }
+            pos += 2;
+        }
+        else if( ctx->state == SMPTE337M_HEADER )
+        {
+            ctx->header[ctx->num_header_words++] = get_word( samples[pos++], ctx->word_bits );
+            if( ctx->num_header_words < 2 )
+                continue;
+
+            pc = ctx->header[0] >> ( ctx->word_bits - 16 );
+            ctx->data_type = pc & 0x1f;
+            ctx->payload_bits = ctx->header[1];
+            ctx->payload_pos = ctx->cache_bits = 0;
+            ctx->state = SMPTE337M_PAYLOAD;
+
+            /* A data mode that disagrees with the word length means the sync was payload */
+            if( ( ( pc >> 5 ) & 3 ) != ( ctx->word_bits - 16 ) / 4 || ( pc & 0x80 ) ||
+                ctx->data_type == SMPTE337M_DATA_TYPE_NULL || !ctx->payload_bits ||
+                ctx->payload_bits > SMPTE337M_MAX_PAYLOAD * 8 )
+                ctx->state = SMPTE337M_SEARCH;
+        }
+        else
+        {
+            while( pos < num_words && ctx->payload_pos * 8 + ctx->cache_bits < ctx->payload_bits )
+                put_word( ctx, get_word( samples[pos++], ctx->word_bits ) );
+
+            if( ctx->payload_pos * 8 + ctx->cache_bits < ctx->payload_bits )
+                break;
+
+            if( obe_337m_stream_format( ctx->data_type ) >= 0 )
+                send_burst( ctx );
+
+            ctx->state = SMPTE337M_SEARCH;
+            pos = ( pos + 1 ) & ~1;
+        }
+    }
+
+    return 0;
+}
+
+void obe_337m_close( obe_337m_ctx_t *ctx )
+{
+    if( ctx->payload )
+        free( ctx->payload );
+    ctx->payload = NULL;
+    ctx->num_output_streams = 0;
+}
@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * 337m.h : SMPTE 337M functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_FILTERS_AUDIO_337M_H
+#define OBE_FILTERS_AUDIO_337M_H
+
+#define SMPTE337M_DATA_TYPE_NULL      0
+#define SMPTE337M_DATA_TYPE_AC_3      1
+#define SMPTE337M_DATA_TYPE_TIMESTAMP 2
+#define SMPTE337M_DATA_TYPE_MP2       6
+#define SMPTE337M_DATA_TYPE_AAC       10
+#define SMPTE337M_DATA_TYPE_HE_AAC    11
+#define SMPTE337M_DATA_TYPE_E_AC_3    16
+#define SMPTE337M_DATA_TYPE_DOLBY_E   28
+
+/* Bursts are carried in a stereo pair of left-justified 32-bit samples, Pa and Pb share a frame */
+typedef struct
+{
+    obe_t *h;
+    int sample_rate;
+
+    /* Every passthrough of the pair gets a copy of the bursts */
+    int num_output_streams;
+    int output_stream_ids[MAX_STREAMS];
+
+    int (*find_sync)( const int32_t *samples, int num_frames );
+    int sync_step;
+
+    /* Burst being extracted, which can span several audio buffers */
+    int state;
+    int word_bits;
+    int num_header_words;
+    uint32_t header[2];
+    int data_type;
+    int payload_bits;
+    int payload_pos;
+    uint8_t *payload;
+    uint32_t bit_cache;
+    int cache_bits;
+    int64_t burst_pts;
+} obe_337m_ctx_t;
+
+/* Returns the data type of the first burst in the buffer or -1 if there isn't one */
+int obe_337m_probe( const int32_t *samples, int num_frames );
+
+/* Maps a data type to the stream format it is passed through as. Returns -1 for types that can't be */
+int obe_337m_stream_format( int data_type );
+
+/* Sets up extraction of the bursts in an input stream for its passthrough output streams.
+ * Leaves num_output_streams at zero if there aren't any */
+int obe_337m_open( obe_337m_ctx_t *ctx, obe_t *h, obe_int_input_stream_t *input_stream,
+                   obe_output_stream_t *output_streams, int num_output_streams );
+
+/* Sends each burst that completes in the buffer to the mux. pts is the time of the first frame */
+int obe_337m_extract( obe_337m_ctx_t *ctx, const int32_t *samples, int num_frames, int64_t pts );
+
+void obe_337m_close( obe_337m_ctx_t *ctx );
+
+#endif
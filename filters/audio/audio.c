@@ -0,0 +1,298 @@
+/*****************************************************************************
+ * audio.c : audio channel router
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "filters/audio/audio.h"
+#include "filters/audio/x86/audio.h"
+#include <libavutil/audioconvert.h>
+#include <libavutil/samplefmt.h>
+
+/* ITU-R BS.775 Lo/Ro in Q15, normalised so a full scale L, C and Ls can't clip.
+ * 1 / ( 1 + 2 * 0.7071 ) and 0.7071 / ( 1 + 2 * 0.7071 ), rounded to sum to 1.0 */
+#define DOWNMIX_FRONT  13572
+#define DOWNMIX_CENTRE 9598
+
+int obe_channel_map_channels( int channel_map, int *out_channels )
+{
+    if( channel_map == CHANNEL_MAP_MONO )
+        return *out_channels = 1;
+    else if( channel_map == CHANNEL_MAP_5POINT1 )
+        return *out_channels = 6;
+    else if( channel_map == CHANNEL_MAP_5POINT1_TO_STEREO )
+    {
+        *out_channels = 2;
+        return 6;
+    }
+
+    return *out_channels = 2;
+}
+
+int64_t obe_channel_map_layout( int channel_map )
+{
+    if( channel_map == CHANNEL_MAP_MONO )
+        return AV_CH_LAYOUT_MONO;
+    else if( channel_map == CHANNEL_MAP_5POINT1 )
+        return AV_CH_LAYOUT_5POINT1;
+
+    return AV_CH_LAYOUT_STEREO;
+}
+
+static int is_routed( obe_int_input_stream_t *input_stream, obe_output_stream_t *output_stream )
+{
+    return output_stream->input_stream_id == input_stream->stream_id &&
+           output_stream->stream_action == STREAM_ENCODE;
+}
+
+int obe_audio_router_channels( obe_int_input_stream_t *input_stream, obe_output_stream_t *output_streams,
+                               int num_output_streams )
+{
+    int num_channels = 2, out_channels;
+
+    for( int i = 0; i < num_output_streams; i++ )
+    {
+        if( is_routed( input_stream, &output_streams[i] ) )
+            num_channels = MAX( num_channels, output_streams[i].channel_offset +
+                                obe_channel_map_channels( output_streams[i].channel_map, &out_channels ) );
+    }
+
+    return num_channels;
+}
+
+void obe_deinterleave_4ch_s32_c( int32_t *dst, int plane_stride, const int32_t *src, int src_channels, int num_frames )
+{
+    for( int i = 0; i < num_frames; i++ )
+    {
+        dst[i]                = src[i*src_channels];
+        dst[i+plane_stride]   = src[i*src_channels+1];
+        dst[i+2*plane_stride] = src[i*src_channels+2];
+        dst[i+3*plane_stride] = src[i*src_channels+3];
+    }
+}
+
+int obe_audio_router_open( obe_audio_router_t *router, obe_t *h, obe_int_input_stream_t *input_stream,
+                           obe_output_stream_t *output_streams, int num_output_streams, int num_channels )
+{
+    obe_audio_route_t *route;
+    int in_channels;
+
+    memset( router, 0, sizeof(*router) );
+    router->h = h;
+    router->num_channels = router->num_planes = num_channels;
+
+    for( int i = 0; i < num_output_streams; i++ )
+    {
+        if( !is_routed( input_stream, &output_streams[i] ) )
+            continue;
+
+        route = &router->routes[router->num_routes++];
+        route->stream_id = output_streams[i].stream_id;
+        route->channel_map = output_streams[i].channel_map;
+        route->channel_offset = output_streams[i].channel_offset;
+        in_channels = obe_channel_map_channels( route->channel_map, &route->num_channels );
+
+        if( route->channel_offset < 0 || route->channel_offset + in_channels > num_channels )
+        {
+            fprintf( stderr, "Audio stream %i uses channels the input does not capture\n", route->stream_id );
+            return -1;
+        }
+
+        /* Streams use the captured planes directly, only a downmix needs new ones */
+        if( route->channel_map == CHANNEL_MAP_5POINT1_TO_STEREO )
+        {
+            route->plane = router->num_planes;
+            router->num_planes += route->num_channels;
+        }
+        else
+            route->plane = route->channel_offset;
+
+        /* Audio meters for the shared memory tap */
+        if( obe_tap_entry( h, OBE_TAP_METERS, route->stream_id ) )
+        {
+            route->meter = malloc( sizeof(*route->meter) );
+            if( !route->meter )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
+            }
+            obe_tap_meter_open( h, route->meter, route->stream_id, route->num_channels, input_stream->sample_rate );
+        }
+    }
+
+    router->deinterleave_4ch = obe_deinterleave_4ch_s32_c;
+    router->deinterleave_step = 1;
+
+    if( obe_get_cpu_flags() & AV_CPU_FLAG_SSE2 )
+    {
+        router->deinterleave_4ch = obe_deinterleave_4ch_s32_sse2;
+        router->deinterleave_step = 4;
+    }
+
+    return 0;
+}
+
+static void deinterleave( obe_audio_router_t *router, int32_t *dst, const int32_t *src, int num_frames )
+{
+    int num_channels = router->num_channels, c = 0;
+    int simd_frames = num_frames / router->deinterleave_step * router->deinterleave_step;
+
+    for( ; c + 4 <= num_channels; c += 4 )
+    {
+        if( simd_frames )
+            router->deinterleave_4ch( dst + c*num_frames, num_frames, src + c, num_channels, simd_frames );
+        obe_deinterleave_4ch_s32_c( dst + c*num_frames + simd_frames, num_frames, src + c + simd_frames*num_channels,
+                                    num_channels, num_frames - simd_frames );
+    }
+
+    for( ; c < num_channels; c++ )
+        for( int i = 0; i < num_frames; i++ )
+            dst[c*num_frames+i] = src[i*num_channels+c];
+}
+
+/* Planes of a 5.1 set are L R C LFE Ls Rs */
+static void downmix_5point1( int32_t *dst, const int32_t *src, int num_frames )
+{
+    const int32_t *l = src, *r = src + num_frames, *c = src + 2*num_frames;
+    const int32_t *ls = src + 4*num_frames, *rs = src + 5*num_frames;
+
+    for( int i = 0; i < num_frames; i++ )
+    {
+        dst[i]            = ( (int64_t)l[i] * DOWNMIX_FRONT + ( (int64_t)c[i] + ls[i] ) * DOWNMIX_CENTRE ) >> 15;
+        dst[i+num_frames] = ( (int64_t)r[i] * DOWNMIX_FRONT + ( (int64_t)c[i] + rs[i] ) * DOWNMIX_CENTRE ) >> 15;
+    }
+}
+
+int obe_audio_router_send( obe_audio_router_t *router, const int32_t *samples, int num_frames, int64_t pts )
+{
+    obe_t *h = router->h;
+    obe_audio_route_t *route;
+    obe_raw_frame_t *raw_frame;
+    obe_buf_t *buf;
+    int32_t *planes;
+    int ret = 0;
+
+    if( !router->num_routes || num_frames <= 0 )
+        return 0;
+
+    buf = obe_buf_get( &h->buf_pool, router->num_planes * num_frames * sizeof(int32_t) );
+    if( !buf )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+    planes = (int32_t*)buf->data;
+
+    deinterleave( router, planes, samples, num_frames );
+
+    for( int i = 0; i < router->num_routes; i++ )
+    {
+        route = &router->routes[i];
+        if( route->channel_map == CHANNEL_MAP_5POINT1_TO_STEREO )
+            downmix_5point1( planes + route->plane*num_frames, planes + route->channel_offset*num_frames, num_frames );
+    }
+
+    for( int i = 0; i < router->num_routes; i++ )
+    {
+        route = &router->routes[i];
+
+        if( route->meter )
+            obe_tap_meter( route->meter, planes + route->plane*num_frames, num_frames, pts );
+
+        raw_frame = new_raw_frame();
+        if( !raw_frame )
+        {
+            ret = -1;
+            break;
+        }
+
+        raw_frame->num_samples = num_frames;
+        raw_frame->sample_fmt = AV_SAMPLE_FMT_S32P;
+        raw_frame->channel_layout = obe_channel_map_layout( route->channel_map );
+        raw_frame->num_channels = route->num_channels;
+        for( int c = 0; c < route->num_channels; c++ )
+            raw_frame->audio_plane[c] = (uint8_t*)( planes + ( route->plane + c ) * num_frames );
+
+        raw_frame->data = raw_frame->cur_pos = raw_frame->audio_plane[0];
+        raw_frame->len = raw_frame->bytes_left = route->num_channels * num_frames * sizeof(int32_t);
+
+        obe_buf_ref( buf );
+        raw_frame->audio_buf = buf;
+        raw_frame->pts = pts;
+        raw_frame->release_data = obe_release_audio_data;
+        raw_frame->release_frame = obe_release_frame;
+        raw_frame->stream_id = route->stream_id;
+
+        /* A stream with nothing to encode it (e.g. one that failed) just doesn't get the frame */
+        if( add_to_encode_queue( h, raw_frame ) < 0 )
+        {
+            raw_frame->release_data( raw_frame );
+            raw_frame->release_frame( raw_frame );
+        }
+    }
+
+    obe_buf_unref( buf );
+
+    return ret;
+}
+
+const int32_t *obe_audio_router_pair( obe_audio_router_t *router, const int32_t *samples, int num_frames )
+{
+    int32_t *pair;
+
+    if( router->num_channels == 2 )
+        return samples;
+
+    if( num_frames > router->pair_frames )
+    {
+        pair = realloc( router->pair, num_frames * 2 * sizeof(*pair) );
+        if( !pair )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return NULL;
+        }
+        router->pair = pair;
+        router->pair_frames = num_frames;
+    }
+
+    for( int i = 0; i < num_frames; i++ )
+    {
+        router->pair[2*i]   = samples[i*router->num_channels];
+        router->pair[2*i+1] = samples[i*router->num_channels+1];
+    }
+
+    return router->pair;
+}
+
+void obe_audio_router_close( obe_audio_router_t *router )
+{
+    for( int i = 0; i < router->num_routes; i++ )
+    {
+        free( router->routes[i].meter );
+        router->routes[i].meter = NULL;
+    }
+
+    if( router->pair )
+        free( router->pair );
+    router->pair = NULL;
+    router->pair_frames = 0;
+    router->num_routes = 0;
+}
@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * audio.h : audio channel router
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef OBE_FILTERS_AUDIO_H
+#define OBE_FILTERS_AUDIO_H
+
+#include "common/tap.h"
+
+/* One audio stream encoded from some of the captured channels */
+typedef struct
+{
+    int stream_id;
+    int channel_map;
+    int channel_offset;
+    int num_channels; /* channels the encoder gets */
+    int plane;        /* first of them in the deinterleaved capture */
+    obe_tap_meter_t *meter; /* NULL without a tap */
+} obe_audio_route_t;
+
+/* SDI inputs capture every channel the streams need in one interleaved block. It is split into
+ * planes once per capture and each encoder is sent references to the planes it uses */
+typedef struct
+{
+    obe_t *h;
+    int num_channels; /* captured */
+    int num_planes;   /* captured channels then any downmixes */
+
+    int num_routes;
+    obe_audio_route_t routes[MAX_STREAMS];
+
+    void (*deinterleave_4ch)( int32_t *dst, int plane_stride, const int32_t *src, int src_channels, int num_frames );
+    int deinterleave_step;
+
+    /* Channels 0 and 1 interleaved again for SMPTE 337M when more than a pair is captured */
+    int32_t *pair;
+    int pair_frames;
+} obe_audio_router_t;
+
+/* Number of channels a map takes from the capture. out_channels is the number the encoder gets */
+int obe_channel_map_channels( int channel_map, int *out_channels );
+int64_t obe_channel_map_layout( int channel_map );
+
+/* Number of channels an input has to capture for the streams encoded from input_stream, at least 2 */
+int obe_audio_router_channels( obe_int_input_stream_t *input_stream, obe_output_stream_t *output_streams,
+                               int num_output_streams );
+
+int obe_audio_router_open( obe_audio_router_t *router, obe_t *h, obe_int_input_stream_t *input_stream,
+                           obe_output_stream_t *output_streams, int num_output_streams, int num_channels );
+
+/* samples are num_frames frames of num_channels interleaved 32-bit samples */
+int obe_audio_router_send( obe_audio_router_t *router, const int32_t *samples, int num_frames, int64_t pts );
+
+/* Channels 0 and 1 of a capture as an interleaved pair. Returns NULL if it can't be allocated */
+const int32_t *obe_audio_router_pair( obe_audio_router_t *router, const int32_t *samples, int num_frames );
+
+void obe_audio_router_close( obe_audio_router_t *router );
+
+#endif
@@ -0,0 +1,107 @@
+%include "x86inc.asm"
+%include "x86util.asm"
+
+SECTION .rodata
+
+; Pa and Pb of a stereo frame for each word length, left-justified in 32-bit samples
+align 32
+sync_16:      times 4 dd 0xf8720000, 0x4e1f0000
+sync_20:      times 4 dd 0x6f872000, 0x54e1f000
+sync_24:      times 4 dd 0x96f87200, 0xa54e1f00
+sync_mask_16: times 8 dd 0xffff0000
+sync_mask_20: times 8 dd 0xfffff000
+sync_mask_24: times 8 dd 0xffffff00
+
+SECTION .text
+
+;
+; int obe_find_337m_sync( const int32_t *samples, int num_frames )
+; samples are interleaved stereo frames. Returns the first frame which holds Pa and Pb in any
+; word length, or num_frames if there isn't one. num_frames must be a multiple of mmsize/8
+; A frame can match Pa of one word length and Pb of another so the caller checks the match
+;
+
+INIT_XMM
+cglobal find_337m_sync_sse2, 2,5
+    movsxdifnidn r1, r1d
+    xor       r2, r2
+    test      r1, r1
+    jle       .none
+
+.loop
+    movu      m0, [r0+r2*8]
+    pand      m1, m0, [sync_mask_16]
+    pcmpeqd   m1, [sync_16]
+    pand      m2, m0, [sync_mask_20]
+    pcmpeqd   m2, [sync_20]
+    pand      m0, [sync_mask_24]
+    pcmpeqd   m0, [sync_24]
+    por       m0, m1
+    por       m0, m2
+    movmskps  r3d, m0
+
+    ; both dwords of a frame have to match
+    mov       r4d, r3d
+    shr       r4d, 1
+    and       r3d, r4d
+    and       r3d, 0x5
+    jnz       .found
+
+    add       r2, 2
+    cmp       r2, r1
+    jl        .loop
+
+.none
+    mov       eax, r1d
+    RET
+
+.found
+    bsf       r3d, r3d
+    shr       r3d, 1
+    add       r3d, r2d
+    mov       eax, r3d
+    RET
+
+; x86inc.asm predates YMM support so the AVX2 functions name their registers explicitly
+
+INIT_AVX
+cglobal find_337m_sync_avx2, 2,5
+    movsxdifnidn r1, r1d
+    xor       r2, r2
+    test      r1, r1
+    jle       .none
+
+.loop
+    vmovdqu   ymm0, [r0+r2*8]
+    vpand     ymm1, ymm0, [sync_mask_16]
+    vpcmpeqd  ymm1, ymm1, [sync_16]
+    vpand     ymm2, ymm0, [sync_mask_20]
+    vpcmpeqd  ymm2, ymm2, [sync_20]
+    vpand     ymm0, ymm0, [sync_mask_24]
+    vpcmpeqd  ymm0, ymm0, [sync_24]
+    vpor      ymm0, ymm0, ymm1
+    vpor      ymm0, ymm0, ymm2
+    vmovmskps r3d, ymm0
+
+    mov       r4d, r3d
+    shr       r4d, 1
+    and       r3d, r4d
+    and       r3d, 0x55
+    jnz       .found
+
+    add       r2, 4
+    cmp       r2, r1
+    jl        .loop
+
+.none
+    mov       eax, r1d
+    vzeroupper
+    RET
+
+.found
+    bsf       r3d, r3d
+    shr       r3d, 1
+    add       r3d, r2d
+    mov       eax, r3d
+    vzeroupper
+    RET
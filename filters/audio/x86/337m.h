@@ -0,0 +1,31 @@
+/*****************************************************************************
+ * 337m.h: SMPTE 337M asm prototypes
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_X86_337M
+#define OBE_X86_337M
+
+int obe_find_337m_sync_c( const int32_t *samples, int num_frames );
+int obe_find_337m_sync_sse2( const int32_t *samples, int num_frames );
+int obe_find_337m_sync_avx2( const int32_t *samples, int num_frames );
+
+#endif
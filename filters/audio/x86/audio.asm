@@ -0,0 +1,35 @@
+%include "x86inc.asm"
+%include "x86util.asm"
+
+SECTION .text
+
+;
+; void obe_deinterleave_4ch_s32( int32_t *dst, int plane_stride, const int32_t *src, int src_channels, int num_frames )
+; Four frames of four channels are transposed at a time. num_frames must be a positive multiple of 4
+;
+
+INIT_XMM
+cglobal deinterleave_4ch_s32_sse2, 5,6
+    movsxdifnidn r1, r1d
+    movsxdifnidn r3, r3d
+    movsxdifnidn r4, r4d
+    shl       r1, 2
+    shl       r3, 2
+    lea       r5, [r1*3]
+.loop
+    movu      m0, [r2]
+    movu      m1, [r2+r3]
+    movu      m2, [r2+r3*2]
+    add       r2, r3
+    movu      m3, [r2+r3*2]
+    lea       r2, [r2+r3*2]
+    add       r2, r3
+    TRANSPOSE4x4D 0, 1, 2, 3, 4
+    movu      [r0], m0
+    movu      [r0+r1], m1
+    movu      [r0+r1*2], m2
+    movu      [r0+r5], m3
+    add       r0, mmsize
+    sub       r4, 4
+    jg        .loop
+    RET
@@ -0,0 +1,31 @@
+/*****************************************************************************
+ * audio.h: audio channel router asm prototypes
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_X86_AUDIO
+#define OBE_X86_AUDIO
+
+/* Splits channels 0-3 of src_channels interleaved channels into four planes plane_stride samples apart */
+void obe_deinterleave_4ch_s32_c( int32_t *dst, int plane_stride, const int32_t *src, int src_channels, int num_frames );
+void obe_deinterleave_4ch_s32_sse2( int32_t *dst, int plane_stride, const int32_t *src, int src_channels, int num_frames );
+
+#endif
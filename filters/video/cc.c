@@ -168,9 +168,7 @@ int write_608_cc( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
     user_data->type = USER_DATA_AVC_REGISTERED_ITU_T35;
     user_data->len = bs_pos( &r ) >> 3;
 
-    free( user_data->data );
-
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -182,7 +180,7 @@ int write_608_cc( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
     return 0;
 }
 
-static int write_708_cc( obe_user_data_t *user_data, uint8_t *start, int cc_count )
+static int write_708_cc( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame, uint8_t *start, int cc_count )
 {
     bs_t s;
     uint8_t temp[1000];
@@ -218,9 +216,7 @@ static int write_708_cc( obe_user_data_t *user_data, uint8_t *start, int cc_coun
     user_data->type = USER_DATA_AVC_REGISTERED_ITU_T35;
     user_data->len = bs_pos( &s ) >> 3;
 
-    free( user_data->data );
-
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -232,7 +228,7 @@ static int write_708_cc( obe_user_data_t *user_data, uint8_t *start, int cc_coun
     return 0;
 }
 
-int write_cdp( obe_user_data_t *user_data )
+int write_cdp( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
 {
     uint8_t *start = NULL;
     int cc_count = 0;
@@ -330,7 +326,7 @@ int write_cdp( obe_user_data_t *user_data )
     if( !cc_count )
         return 0;
 
-    if( write_708_cc( user_data, start, cc_count ) < 0 )
+    if( write_708_cc( user_data, raw_frame, start, cc_count ) < 0 )
         return -1;
 
     return 0;
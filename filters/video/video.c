@@ -22,9 +22,11 @@
  */
 
 #include <libavutil/cpu.h>
+#include <libavutil/rational.h>
 #include <libswscale/swscale.h>
 #include "common/common.h"
 #include "common/bitstream.h"
+#include "common/tap.h"
 #include "video.h"
 #include "cc.h"
 #include "dither.h"
@@ -42,22 +44,130 @@ typedef uint8_t pixel;
 #define NTSC_FIRST_NON_BLANKED 22
 
 typedef struct
+{
+    int stream_id;
+    int width;
+    int height;
+    int parent; /* rendition this one is scaled from or -1 for the input picture */
+    int deinterlace;
+    struct SwsContext *sws_ctx;
+    struct SwsContext *fast_sws_ctx; /* used while shedding load */
+
+    /* Load shedding */
+    obe_encoder_t *encoder;
+    int shed_level;
+    int shed_recover; /* frames the fill has been below the current level */
+    int shed_drop;
+    int64_t num_dropped; /* since dropping started, reported once the rendition is caught up */
+} obe_vid_filter_rung_t;
+
+/* Frames waiting for an encoder, in eighths of the frame pool, at which each shedding level starts.
+ * The last one is just short of the pool running out, when capture would have to drop the frame instead */
+static const int shed_marks[] = { 0, 3, 4, 7 };
+/* A level is only left after the fill has been below it for this long */
+#define SHED_RECOVER_FRAMES 50
+
+#define MAX_FILTER_SLICES 8
+
+/* blank, chroma, dither, user data and SD aspect ratio */
+#define MAX_FILTER_STEPS 5
+
+typedef struct obe_vid_filter_ctx_t obe_vid_filter_ctx_t;
+
+/* Does its share of the rows of a picture */
+typedef void (*obe_slice_func_t)( obe_vid_filter_ctx_t *vfilt, void *arg, int slice, int num_slices );
+
+/* One step of the filter chain, done in place on the frame.
+ * Returns -1 on error and 1 if the frame has to be dropped because its frame pool is exhausted */
+typedef int (*obe_filter_step_t)( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame );
+
+typedef struct
+{
+    pthread_t thread;
+    obe_vid_filter_ctx_t *vfilt;
+    int idx;
+} obe_vid_filter_slice_t;
+
+struct obe_vid_filter_ctx_t
 {
     /* cpu flags */
     uint32_t avutil_cpu;
 
+    /* output frames come from the device's frame pools */
+    obe_device_t *device;
+    obe_int_input_stream_t *input_stream;
+    int target_csp;
+
+    /* The steps every frame goes through, chosen for the csp, video format and size of the input.
+     * The chain is only built again when a frame arrives that differs in one of them */
+    int num_steps;
+    obe_filter_step_t steps[MAX_FILTER_STEPS];
+    int chain_csp;
+    int chain_format;
+    int chain_width;
+    int chain_height;
+
     /* upscaling */
     void (*scale_plane)( uint16_t *src, int stride, int width, int height, int lshift, int rshift );
 
     /* downscaling */
     struct SwsContext *sws_ctx;
-    int sws_ctx_flags;
     enum PixelFormat dst_pix_fmt;
 
     /* dither */
     void (*dither_row_10_to_8)( uint16_t *src, uint8_t *dst, const uint16_t *dithers, int width, int stride );
+    /* Several rows per call, NULL if there is no SIMD version. step is the width it rounds up to */
+    void (*dither_plane_10_to_8)( uint16_t *src, intptr_t src_stride, uint8_t *dst, intptr_t dst_stride, int width, int height, int y );
+    int dither_plane_step;
+
+    /* 4:2:2 to 4:2:0 chroma, indexed by whether the picture is interlaced */
+    void (*chroma_420_10[2])( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+    void (*chroma_420_8[2])( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dithers );
     int16_t *error_buf;
-} obe_vid_filter_ctx_t;
+    /* Field-based chroma taps, for interlaced pictures made of whole pairs of lines from each field */
+    int chroma_interlaced;
+
+    /* deinterlacing. The SIMD versions round the width up to 32 bytes, which frame pools leave room for */
+    void (*deinterlace_line_8)( uint8_t *dst, const uint8_t *cur, const uint8_t *prev, intptr_t stride, int width );
+    void (*deinterlace_line_10)( uint16_t *dst, const uint16_t *cur, const uint16_t *prev, intptr_t stride, int width );
+    int deinterlace; /* set if any rendition is deinterlaced */
+    int tff;
+    /* The previous input picture, which holds a reference to its buffer */
+    obe_frame_buf_t *prev_buf;
+    obe_image_t prev_img;
+
+    /* Snapshots for the shared memory tap, NULL without one */
+    obe_tap_entry_t *tap;
+    int64_t tap_next_pts;
+
+    /* renditions, largest first */
+    int num_rungs;
+    obe_vid_filter_rung_t rungs[MAX_RENDITIONS];
+
+    /* Slice threads. The filter thread runs slice 0 itself */
+    int num_slices;
+    int num_slice_threads;
+    obe_vid_filter_slice_t slices[MAX_FILTER_SLICES];
+    pthread_mutex_t slice_mutex;
+    pthread_cond_t  slice_cv;
+    pthread_cond_t  slice_done_cv;
+    int slice_job;
+    int slices_left;
+    int cancel_slices;
+    obe_slice_func_t slice_func;
+    void *slice_arg;
+};
+
+/* Arguments for the per-slice pixel functions */
+typedef struct
+{
+    obe_image_t *img;
+    obe_image_t *out;
+    obe_image_t *prev;
+    int interlaced;
+    int tff;
+    int dither;
+} obe_slice_job_t;
 
 typedef struct
 {
@@ -139,7 +249,7 @@ static void scale_plane_c( uint16_t *src, int stride, int width, int height, int
     }
 }
 
-static void dither_row_10_to_8_c( uint16_t *src, uint8_t *dst, const uint16_t *dither, int width, int stride )
+void obe_dither_row_10_to_8_c( uint16_t *src, uint8_t *dst, const uint16_t *dither, int width, int stride )
 {
     const int scale = 511;
     const uint16_t shift = 11;
@@ -161,9 +271,67 @@ static void dither_row_10_to_8_c( uint16_t *src, uint8_t *dst, const uint16_t *d
 
 }
 
+void obe_dither_plane_10_to_8_c( uint16_t *src, intptr_t src_stride, uint8_t *dst, intptr_t dst_stride, int width, int height, int y )
+{
+    for( int j = 0; j < height; j++ )
+    {
+        obe_dither_row_10_to_8_c( src, dst, obe_dithers[(y+j)&7], width, src_stride );
+        src += src_stride / 2;
+        dst += dst_stride;
+    }
+}
+
+/* Interlaced 4:2:0 chroma sits a quarter of the way between two lines of the same field,
+ * so a is weighted towards the nearer line */
+void obe_chroma_420_progressive_10_c( uint16_t *a, uint16_t *b, uint16_t *dst, int width )
+{
+    for( int i = 0; i < width; i++ )
+        dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+void obe_chroma_420_interlaced_10_c( uint16_t *a, uint16_t *b, uint16_t *dst, int width )
+{
+    for( int i = 0; i < width; i++ )
+        dst[i] = (3*a[i] + b[i] + 2) >> 2;
+}
+
+void obe_chroma_420_progressive_8_c( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither )
+{
+    for( int i = 0; i < width; i++ )
+        dst[i] = (((a[i] + b[i] + 1) >> 1) + dither[i&7])*511>>11;
+}
+
+void obe_chroma_420_interlaced_8_c( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither )
+{
+    for( int i = 0; i < width; i++ )
+        dst[i] = (((3*a[i] + b[i] + 2) >> 2) + dither[i&7])*511>>11;
+}
+
+/* Motion adaptive. The woven pixel is kept where neither field has moved since the previous frame
+ * and is pulled towards the average of the lines either side of it as they move */
+#define DEINTERLACE_LINE( depth, pixel ) \
+void obe_deinterlace_line_##depth##_c( pixel *dst, const pixel *cur, const pixel *prev, intptr_t stride, int width ) \
+{ \
+    const pixel *above = (const pixel*)((const uint8_t*)cur - stride); \
+    const pixel *below = (const pixel*)((const uint8_t*)cur + stride); \
+    const pixel *prev_above = (const pixel*)((const uint8_t*)prev - stride); \
+    const pixel *prev_below = (const pixel*)((const uint8_t*)prev + stride); \
+\
+    for( int i = 0; i < width; i++ ) \
+    { \
+        int d = MAX( abs( cur[i] - prev[i] ), ( abs( above[i] - prev_above[i] ) + abs( below[i] - prev_below[i] ) + 1 ) >> 1 ); \
+        dst[i] = obe_clip3( ( above[i] + below[i] + 1 ) >> 1, cur[i] - d, cur[i] + d ); \
+    } \
+}
+
+DEINTERLACE_LINE( 8, uint8_t )
+DEINTERLACE_LINE( 10, uint16_t )
+
+#undef DEINTERLACE_LINE
+
 static void init_filter( obe_vid_filter_ctx_t *vfilt )
 {
-    vfilt->avutil_cpu = av_get_cpu_flags();
+    vfilt->avutil_cpu = obe_get_cpu_flags();
 
 #if 0
     vfilt->scale_plane = scale_plane_c;
@@ -178,7 +346,7 @@ static void init_filter( obe_vid_filter_ctx_t *vfilt )
         vfilt->scale_plane = obe_scale_plane_avx;
 #endif
 
-    vfilt->dither_row_10_to_8 = dither_row_10_to_8_c;
+    vfilt->dither_row_10_to_8 = obe_dither_row_10_to_8_c;
 
     if( vfilt->avutil_cpu & AV_CPU_FLAG_SSE4 )
         vfilt->dither_row_10_to_8 = obe_dither_row_10_to_8_sse4;
@@ -186,6 +354,210 @@ static void init_filter( obe_vid_filter_ctx_t *vfilt )
     if( vfilt->avutil_cpu & AV_CPU_FLAG_AVX )
         vfilt->dither_row_10_to_8 = obe_dither_row_10_to_8_avx;
 
+#if ARCH_X86_64
+    if( vfilt->avutil_cpu & AV_CPU_FLAG_AVX2 )
+    {
+        vfilt->dither_plane_10_to_8 = obe_dither_plane_10_to_8_avx2;
+        vfilt->dither_plane_step = 16;
+    }
+#endif
+
+    vfilt->chroma_420_10[0] = obe_chroma_420_progressive_10_c;
+    vfilt->chroma_420_10[1] = obe_chroma_420_interlaced_10_c;
+    vfilt->chroma_420_8[0] = obe_chroma_420_progressive_8_c;
+    vfilt->chroma_420_8[1] = obe_chroma_420_interlaced_8_c;
+
+    if( vfilt->avutil_cpu & AV_CPU_FLAG_SSE2 )
+    {
+        vfilt->chroma_420_10[0] = obe_chroma_420_progressive_10_sse2;
+        vfilt->chroma_420_10[1] = obe_chroma_420_interlaced_10_sse2;
+        vfilt->chroma_420_8[0] = obe_chroma_420_progressive_8_sse2;
+        vfilt->chroma_420_8[1] = obe_chroma_420_interlaced_8_sse2;
+    }
+
+    if( vfilt->avutil_cpu & AV_CPU_FLAG_AVX )
+    {
+        vfilt->chroma_420_10[0] = obe_chroma_420_progressive_10_avx;
+        vfilt->chroma_420_10[1] = obe_chroma_420_interlaced_10_avx;
+        vfilt->chroma_420_8[0] = obe_chroma_420_progressive_8_avx;
+        vfilt->chroma_420_8[1] = obe_chroma_420_interlaced_8_avx;
+    }
+
+    vfilt->deinterlace_line_8 = obe_deinterlace_line_8_c;
+    vfilt->deinterlace_line_10 = obe_deinterlace_line_10_c;
+
+    if( vfilt->avutil_cpu & AV_CPU_FLAG_SSE2 )
+    {
+        vfilt->deinterlace_line_8 = obe_deinterlace_line_8_sse2;
+        vfilt->deinterlace_line_10 = obe_deinterlace_line_10_sse2;
+    }
+
+    if( vfilt->avutil_cpu & AV_CPU_FLAG_AVX2 )
+    {
+        vfilt->deinterlace_line_8 = obe_deinterlace_line_8_avx2;
+        vfilt->deinterlace_line_10 = obe_deinterlace_line_10_avx2;
+    }
+}
+
+/** Slice threads **/
+static void *slice_thread( void *ptr )
+{
+    obe_vid_filter_slice_t *slice = ptr;
+    obe_vid_filter_ctx_t *vfilt = slice->vfilt;
+    int job = 0;
+
+    pthread_mutex_lock( &vfilt->slice_mutex );
+    while( 1 )
+    {
+        while( vfilt->slice_job == job && !vfilt->cancel_slices )
+            pthread_cond_wait( &vfilt->slice_cv, &vfilt->slice_mutex );
+
+        if( vfilt->cancel_slices )
+            break;
+
+        job = vfilt->slice_job;
+        pthread_mutex_unlock( &vfilt->slice_mutex );
+
+        vfilt->slice_func( vfilt, vfilt->slice_arg, slice->idx, vfilt->num_slices );
+
+        pthread_mutex_lock( &vfilt->slice_mutex );
+        if( !--vfilt->slices_left )
+            pthread_cond_signal( &vfilt->slice_done_cv );
+    }
+    pthread_mutex_unlock( &vfilt->slice_mutex );
+
+    return NULL;
+}
+
+/* Splits the picture into horizontal slices and returns once every slice is done */
+static void run_slices( obe_vid_filter_ctx_t *vfilt, obe_slice_func_t func, void *arg )
+{
+    if( vfilt->num_slices == 1 )
+    {
+        func( vfilt, arg, 0, 1 );
+        return;
+    }
+
+    pthread_mutex_lock( &vfilt->slice_mutex );
+    vfilt->slice_func = func;
+    vfilt->slice_arg = arg;
+    vfilt->slices_left = vfilt->num_slices - 1;
+    vfilt->slice_job++;
+    pthread_cond_broadcast( &vfilt->slice_cv );
+    pthread_mutex_unlock( &vfilt->slice_mutex );
+
+    func( vfilt, arg, 0, vfilt->num_slices );
+
+    pthread_mutex_lock( &vfilt->slice_mutex );
+    while( vfilt->slices_left )
+        pthread_cond_wait( &vfilt->slice_done_cv, &vfilt->slice_mutex );
+    pthread_mutex_unlock( &vfilt->slice_mutex );
+}
+
+static void slice_rows( int height, int slice, int num_slices, int *start, int *end )
+{
+    *start = height * slice / num_slices;
+    *end = height * (slice + 1) / num_slices;
+}
+
+/* One slice per core, or a single slice on the filter thread if the threads can't be started */
+static void init_slices( obe_vid_filter_ctx_t *vfilt )
+{
+    long num_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+    vfilt->num_slices = MIN( MAX( num_cpus, 1 ), MAX_FILTER_SLICES );
+    if( vfilt->num_slices == 1 )
+        return;
+
+    pthread_mutex_init( &vfilt->slice_mutex, NULL );
+    pthread_cond_init( &vfilt->slice_cv, NULL );
+    pthread_cond_init( &vfilt->slice_done_cv, NULL );
+
+    for( int i = 1; i < vfilt->num_slices; i++ )
+    {
+        vfilt->slices[i].vfilt = vfilt;
+        vfilt->slices[i].idx = i;
+        if( pthread_create( &vfilt->slices[i].thread, NULL, slice_thread, &vfilt->slices[i] ) )
+        {
+            fprintf( stderr, "Couldn't create video filter slice thread\n" );
+            break;
+        }
+        vfilt->num_slice_threads++;
+    }
+
+    vfilt->num_slices = vfilt->num_slice_threads + 1;
+
+    /* close_slices only tears down what a running thread uses */
+    if( !vfilt->num_slice_threads )
+    {
+        pthread_mutex_destroy( &vfilt->slice_mutex );
+        pthread_cond_destroy( &vfilt->slice_cv );
+        pthread_cond_destroy( &vfilt->slice_done_cv );
+    }
+}
+
+static void close_slices( obe_vid_filter_ctx_t *vfilt )
+{
+    if( !vfilt->num_slice_threads )
+        return;
+
+    pthread_mutex_lock( &vfilt->slice_mutex );
+    vfilt->cancel_slices = 1;
+    pthread_cond_broadcast( &vfilt->slice_cv );
+    pthread_mutex_unlock( &vfilt->slice_mutex );
+
+    for( int i = 1; i <= vfilt->num_slice_threads; i++ )
+        pthread_join( vfilt->slices[i].thread, NULL );
+
+    pthread_mutex_destroy( &vfilt->slice_mutex );
+    pthread_cond_destroy( &vfilt->slice_cv );
+    pthread_cond_destroy( &vfilt->slice_done_cv );
+}
+
+/* Each rendition is scaled from the smallest larger one so that e.g. 360p is made from 720p
+ * instead of 1080p and every intermediate size is only made once. Deinterlaced renditions are
+ * only scaled from each other, all of them from the one deinterlaced picture */
+static void init_renditions( obe_vid_filter_ctx_t *vfilt, obe_vid_filter_params_t *filter_params )
+{
+    obe_vid_filter_rung_t tmp;
+
+    vfilt->num_rungs = filter_params->num_renditions;
+    for( int i = 0; i < vfilt->num_rungs; i++ )
+    {
+        vfilt->rungs[i].stream_id = filter_params->renditions[i].stream_id;
+        vfilt->rungs[i].width = filter_params->renditions[i].width;
+        vfilt->rungs[i].height = filter_params->renditions[i].height;
+        vfilt->rungs[i].deinterlace = filter_params->renditions[i].deinterlace;
+        vfilt->deinterlace |= vfilt->rungs[i].deinterlace;
+        vfilt->rungs[i].sws_ctx = NULL;
+        vfilt->rungs[i].fast_sws_ctx = NULL;
+        vfilt->rungs[i].encoder = NULL;
+        vfilt->rungs[i].shed_level = SHED_NONE;
+    }
+
+    for( int i = 1; i < vfilt->num_rungs; i++ )
+    {
+        for( int j = i; j > 0 && vfilt->rungs[j].width * vfilt->rungs[j].height >
+                                 vfilt->rungs[j-1].width * vfilt->rungs[j-1].height; j-- )
+        {
+            tmp = vfilt->rungs[j];
+            vfilt->rungs[j] = vfilt->rungs[j-1];
+            vfilt->rungs[j-1] = tmp;
+        }
+    }
+
+    for( int i = 0; i < vfilt->num_rungs; i++ )
+    {
+        obe_vid_filter_rung_t *rung = &vfilt->rungs[i];
+        rung->parent = -1;
+        for( int j = 0; j < i; j++ )
+        {
+            if( vfilt->rungs[j].deinterlace == rung->deinterlace && vfilt->rungs[j].width >= rung->width && vfilt->rungs[j].height >= rung->height &&
+                ( rung->parent < 0 || vfilt->rungs[j].width * vfilt->rungs[j].height <=
+                  vfilt->rungs[rung->parent].width * vfilt->rungs[rung->parent].height ) )
+                rung->parent = j;
+        }
+    }
 }
 
 static void blank_lines( obe_raw_frame_t *raw_frame )
@@ -247,24 +619,12 @@ static int scale_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
     return 0;
 }
 
-static int downconvert_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+/* 8-bit 4:2:2 goes through swscale, with the context made when the chain was built.
+ * Returns 1 if the frame has to be dropped because its frame pool is exhausted */
+static int downconvert_frame_sws( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
 {
     obe_image_t tmp_image = {0};
-
-    if( !vfilt->sws_ctx || raw_frame->reset_obe )
-    {
-        vfilt->sws_ctx_flags |= SWS_FULL_CHR_H_INP | SWS_ACCURATE_RND | SWS_LANCZOS;
-        vfilt->dst_pix_fmt = raw_frame->img.csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV420P10 : PIX_FMT_YUV420P;
-
-        vfilt->sws_ctx = sws_getContext( raw_frame->img.width, raw_frame->img.height, raw_frame->img.csp,
-                                         raw_frame->img.width, raw_frame->img.height, vfilt->dst_pix_fmt,
-                                         vfilt->sws_ctx_flags, NULL, NULL, NULL );
-        if( !vfilt->sws_ctx )
-        {
-            fprintf( stderr, "Video scaling failed\n" );
-            return -1;
-        }
-    }
+    obe_frame_buf_t *frame_buf;
 
     tmp_image.csp = vfilt->dst_pix_fmt;
     tmp_image.width = raw_frame->img.width;
@@ -272,23 +632,163 @@ static int downconvert_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_
     tmp_image.planes = av_pix_fmt_descriptors[vfilt->dst_pix_fmt].nb_components;
     tmp_image.format = raw_frame->img.format;
 
-    if( av_image_alloc( tmp_image.plane, tmp_image.stride, tmp_image.width, tmp_image.height+1,
-                        vfilt->dst_pix_fmt, 16 ) < 0 )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
-    }
+    frame_buf = get_pooled_image( vfilt->device, &tmp_image, tmp_image.height+1 );
+    if( !frame_buf )
+        return 1;
 
     sws_scale( vfilt->sws_ctx, (const uint8_t* const*)raw_frame->img.plane, raw_frame->img.stride,
                0, tmp_image.height, tmp_image.plane, tmp_image.stride );
 
     raw_frame->release_data( raw_frame );
+    raw_frame->release_data = obe_release_pooled_video_data;
+    raw_frame->frame_buf = frame_buf;
     memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
     memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
 
     return 0;
 }
 
+static void (* const chroma_420_10_c[2])( uint16_t *a, uint16_t *b, uint16_t *dst, int width ) =
+{
+    obe_chroma_420_progressive_10_c, obe_chroma_420_interlaced_10_c
+};
+
+static void (* const chroma_420_8_c[2])( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither ) =
+{
+    obe_chroma_420_progressive_8_c, obe_chroma_420_interlaced_8_c
+};
+
+static void downconvert_slice( obe_vid_filter_ctx_t *vfilt, void *arg, int slice, int num_slices )
+{
+    obe_slice_job_t *job = arg;
+    obe_image_t *img = job->img;
+    obe_image_t *out = job->out;
+    const int interlaced = job->interlaced;
+    const int chroma_width = img->width / 2;
+    const int simd_width = chroma_width & ~7;
+    int start, end;
+
+    if( out != img )
+    {
+        slice_rows( img->height, slice, num_slices, &start, &end );
+        if( job->dither && vfilt->dither_plane_10_to_8 && FFALIGN( img->width, vfilt->dither_plane_step ) * 2 <= img->stride[0] &&
+            FFALIGN( img->width, vfilt->dither_plane_step ) <= out->stride[0] )
+        {
+            vfilt->dither_plane_10_to_8( (uint16_t*)(img->plane[0] + start * img->stride[0]), img->stride[0],
+                                         out->plane[0] + start * out->stride[0], out->stride[0], img->width, end - start, start );
+            start = end;
+        }
+
+        for( int j = start; j < end; j++ )
+        {
+            uint16_t *src = (uint16_t*)(img->plane[0] + j * img->stride[0]);
+            uint8_t *dst = out->plane[0] + j * out->stride[0];
+
+            if( job->dither )
+                vfilt->dither_row_10_to_8( src, dst, obe_dithers[j&7], img->width, img->stride[0] );
+            else
+                memcpy( dst, src, img->width * sizeof(uint16_t) );
+        }
+    }
+
+    /* Slices of an interlaced picture start on a top field line */
+    slice_rows( img->height / 4, slice, num_slices, &start, &end );
+    start *= 2;
+    end = slice == num_slices - 1 ? img->height / 2 : end * 2;
+
+    /* Chroma line j is written no lower than the lines it is made from so this also works in place */
+    for( int i = 1; i < 3; i++ )
+    {
+        for( int j = start; j < end; j++ )
+        {
+            int a, b;
+
+            if( !interlaced )
+            {
+                a = 2*j;
+                b = 2*j + 1;
+            }
+            else if( !(j & 1) )
+            {
+                /* Top field, nearer to the upper line */
+                a = 2*j;
+                b = 2*j + 2;
+            }
+            else
+            {
+                /* Bottom field, nearer to the lower line */
+                a = 2*j + 1;
+                b = 2*j - 1;
+            }
+
+            uint16_t *line_a = (uint16_t*)(img->plane[i] + a * img->stride[i]);
+            uint16_t *line_b = (uint16_t*)(img->plane[i] + b * img->stride[i]);
+            uint8_t *dst = out->plane[i] + j * out->stride[i];
+
+            if( job->dither )
+            {
+                if( simd_width )
+                    vfilt->chroma_420_8[interlaced]( line_a, line_b, dst, simd_width, obe_dithers[j&7] );
+                chroma_420_8_c[interlaced]( line_a + simd_width, line_b + simd_width, dst + simd_width,
+                                            chroma_width - simd_width, obe_dithers[j&7] );
+            }
+            else
+            {
+                if( simd_width )
+                    vfilt->chroma_420_10[interlaced]( line_a, line_b, (uint16_t*)dst, simd_width );
+                chroma_420_10_c[interlaced]( line_a + simd_width, line_b + simd_width, (uint16_t*)dst + simd_width,
+                                             chroma_width - simd_width );
+            }
+        }
+    }
+}
+
+/* Vertically subsample the chroma of 10-bit 4:2:2. An 8-bit encoder gets the picture dithered in the
+ * same pass. Otherwise the chroma is filtered in place when there is a single slice and no other
+ * reference to the frame, as slices would overwrite lines their neighbours still have to read.
+ * Returns 1 if the frame has to be dropped because its frame pool is exhausted */
+static int downconvert_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+{
+    obe_image_t *img = &raw_frame->img;
+    obe_image_t tmp_image = {0};
+    obe_frame_buf_t *frame_buf = NULL;
+    obe_slice_job_t job;
+
+    job.img = job.out = img;
+    job.dither = X264_BIT_DEPTH == 8;
+    job.interlaced = vfilt->chroma_interlaced;
+
+    if( job.dither || vfilt->num_slices > 1 || ( raw_frame->frame_buf && raw_frame->frame_buf->refcount > 1 ) )
+    {
+        tmp_image.csp = job.dither ? PIX_FMT_YUV420P : PIX_FMT_YUV420P10;
+        tmp_image.width = img->width;
+        tmp_image.height = img->height;
+        tmp_image.planes = av_pix_fmt_descriptors[tmp_image.csp].nb_components;
+        tmp_image.format = img->format;
+
+        frame_buf = get_pooled_image( vfilt->device, &tmp_image, tmp_image.height+1 );
+        if( !frame_buf )
+            return 1;
+
+        job.out = &tmp_image;
+    }
+
+    run_slices( vfilt, downconvert_slice, &job );
+
+    if( frame_buf )
+    {
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_data = obe_release_pooled_video_data;
+        raw_frame->frame_buf = frame_buf;
+        memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
+        memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
+    }
+    else
+        img->csp = PIX_FMT_YUV420P10;
+
+    return 0;
+}
+
 static int csp_num_interleaved( int csp, int plane )
 {
     return ( csp == PIX_FMT_NV12 && plane == 1 ) ? 2 : 1;
@@ -371,24 +871,13 @@ static int dither_image( obe_raw_frame_t *raw_frame, int16_t *error_buf )
 
 #endif
 
-static int dither_image( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+/* The ordered dither has no state carried between lines so slices don't change the output */
+static void dither_slice( obe_vid_filter_ctx_t *vfilt, void *arg, int slice, int num_slices )
 {
-    obe_image_t *img = &raw_frame->img;
-    obe_image_t tmp_image = {0};
-    obe_image_t *out = &tmp_image;
-
-    tmp_image.csp = img->csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV422P : PIX_FMT_YUV420P;
-    tmp_image.width = raw_frame->img.width;
-    tmp_image.height = raw_frame->img.height;
-    tmp_image.planes = av_pix_fmt_descriptors[tmp_image.csp].nb_components;
-    tmp_image.format = raw_frame->img.format;
-
-    if( av_image_alloc( tmp_image.plane, tmp_image.stride, tmp_image.width, tmp_image.height+1,
-                        tmp_image.csp, 16 ) < 0 )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
-    }
+    obe_slice_job_t *job = arg;
+    obe_image_t *img = job->img;
+    obe_image_t *out = job->out;
+    int start, end;
 
     for( int i = 0; i < img->planes; i++ )
     {
@@ -401,10 +890,21 @@ static int dither_image( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
         int num_interleaved = csp_num_interleaved( img->csp, i );
         int height = obe_cli_csps[img->csp].height[i] * img->height;
         int width = obe_cli_csps[img->csp].width[i] * img->width / num_interleaved;
-        uint16_t *src = (uint16_t*)img->plane[i];
-        uint8_t *dst = out->plane[i];
 
-        for( int j = 0; j < height; j++ )
+        slice_rows( height, slice, num_slices, &start, &end );
+
+        uint16_t *src = (uint16_t*)(img->plane[i] + start * img->stride[i]);
+        uint8_t *dst = out->plane[i] + start * out->stride[i];
+
+        /* The whole slice of the plane goes in one call when the strides have room for the rounded up width */
+        if( vfilt->dither_plane_10_to_8 && FFALIGN( width, vfilt->dither_plane_step ) * 2 <= img->stride[i] &&
+            FFALIGN( width, vfilt->dither_plane_step ) <= out->stride[i] )
+        {
+            vfilt->dither_plane_10_to_8( src, img->stride[i], dst, out->stride[i], width, end - start, start );
+            continue;
+        }
+
+        for( int j = start; j < end; j++ )
         {
             const uint16_t *dither = obe_dithers[j&7];
 
@@ -414,8 +914,33 @@ static int dither_image( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame
             dst += out->stride[i];
         }
     }
+}
+
+/* Returns 1 if the frame has to be dropped because its frame pool is exhausted */
+static int dither_image( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+{
+    obe_image_t *img = &raw_frame->img;
+    obe_image_t tmp_image = {0};
+    obe_frame_buf_t *frame_buf;
+    obe_slice_job_t job;
+
+    tmp_image.csp = img->csp == PIX_FMT_YUV422P10 ? PIX_FMT_YUV422P : PIX_FMT_YUV420P;
+    tmp_image.width = raw_frame->img.width;
+    tmp_image.height = raw_frame->img.height;
+    tmp_image.planes = av_pix_fmt_descriptors[tmp_image.csp].nb_components;
+    tmp_image.format = raw_frame->img.format;
+
+    frame_buf = get_pooled_image( vfilt->device, &tmp_image, tmp_image.height+1 );
+    if( !frame_buf )
+        return 1;
+
+    job.img = img;
+    job.out = &tmp_image;
+    run_slices( vfilt, dither_slice, &job );
 
     raw_frame->release_data( raw_frame );
+    raw_frame->release_data = obe_release_pooled_video_data;
+    raw_frame->frame_buf = frame_buf;
     memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
     memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
 
@@ -468,9 +993,7 @@ static int write_afd( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
     user_data->type = USER_DATA_AVC_REGISTERED_ITU_T35;
     user_data->len = bs_pos( &r ) >> 3;
 
-    free( user_data->data );
-
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -482,7 +1005,7 @@ static int write_afd( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
     return 0;
 }
 
-static int write_bar_data( obe_user_data_t *user_data )
+static int write_bar_data( obe_user_data_t *user_data, obe_raw_frame_t *raw_frame )
 {
     bs_t r;
     uint8_t temp[100];
@@ -536,9 +1059,7 @@ static int write_bar_data( obe_user_data_t *user_data )
     user_data->type = USER_DATA_AVC_REGISTERED_ITU_T35;
     user_data->len = bs_pos( &r ) >> 3;
 
-    free( user_data->data );
-
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -568,11 +1089,11 @@ static int encapsulate_user_data( obe_raw_frame_t *raw_frame, obe_int_input_stre
         if( raw_frame->user_data[i].type == USER_DATA_CEA_608 )
             ret = write_608_cc( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_CEA_708_CDP )
-            ret = write_cdp( &raw_frame->user_data[i] );
+            ret = write_cdp( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_AFD )
             ret = write_afd( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_BAR_DATA )
-            ret = write_bar_data( &raw_frame->user_data[i] );
+            ret = write_bar_data( &raw_frame->user_data[i], raw_frame );
         else if( raw_frame->user_data[i].type == USER_DATA_WSS )
             ret = convert_wss_to_afd( &raw_frame->user_data[i], raw_frame );
 
@@ -583,6 +1104,525 @@ static int encapsulate_user_data( obe_raw_frame_t *raw_frame, obe_int_input_stre
     return ret;
 }
 
+/** Filter chain **/
+static int blank_step( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+{
+    blank_lines( raw_frame );
+    return 0;
+}
+
+static int user_data_step( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+{
+    return encapsulate_user_data( raw_frame, vfilt->input_stream );
+}
+
+/* If SAR, on an SD stream, has not been updated by AFD or WSS, set to default 4:3
+ * TODO: make this user-choosable. OBE will prioritise any SAR information from AFD or WSS over any user settings */
+static int sd_sar_step( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame )
+{
+    if( raw_frame->sar_width == 1 && raw_frame->sar_height == 1 )
+    {
+        raw_frame->sar_width = obe_sd_sars[0][raw_frame->img.format].sar_width;
+        raw_frame->sar_height = obe_sd_sars[0][raw_frame->img.format].sar_height;
+        raw_frame->sar_guess = 1;
+    }
+
+    return 0;
+}
+
+/* Works out once what a picture of this csp, format and size needs on its way to the encoders,
+ * following the csp from one step to the next */
+static int build_chain( obe_vid_filter_ctx_t *vfilt, obe_image_t *img )
+{
+    int csp = img->csp;
+
+    vfilt->num_steps = 0;
+    if( vfilt->sws_ctx )
+    {
+        sws_freeContext( vfilt->sws_ctx );
+        vfilt->sws_ctx = NULL;
+    }
+
+    if( IS_SD( img->format ) )
+        vfilt->steps[vfilt->num_steps++] = blank_step;
+
+    if( vfilt->target_csp == X264_CSP_I420 && csp == PIX_FMT_YUV422P10 )
+    {
+        /* Field-based taps need whole pairs of lines from each field */
+        vfilt->chroma_interlaced = vfilt->input_stream->interlaced && !(img->height & 3);
+        vfilt->steps[vfilt->num_steps++] = downconvert_frame;
+        csp = X264_BIT_DEPTH == 8 ? PIX_FMT_YUV420P : PIX_FMT_YUV420P10;
+    }
+    else if( vfilt->target_csp == X264_CSP_I420 && csp == PIX_FMT_YUV422P )
+    {
+        vfilt->dst_pix_fmt = PIX_FMT_YUV420P;
+        vfilt->sws_ctx = sws_getContext( img->width, img->height, img->csp, img->width, img->height, vfilt->dst_pix_fmt,
+                                         SWS_FULL_CHR_H_INP | SWS_ACCURATE_RND | SWS_LANCZOS, NULL, NULL, NULL );
+        if( !vfilt->sws_ctx )
+        {
+            fprintf( stderr, "Video scaling failed\n" );
+            return -1;
+        }
+        vfilt->steps[vfilt->num_steps++] = downconvert_frame_sws;
+        csp = vfilt->dst_pix_fmt;
+    }
+
+    if( ( csp == PIX_FMT_YUV420P10 || csp == PIX_FMT_YUV422P10 ) && X264_BIT_DEPTH == 8 )
+        vfilt->steps[vfilt->num_steps++] = dither_image;
+
+    vfilt->steps[vfilt->num_steps++] = user_data_step;
+
+    if( IS_SD( img->format ) )
+        vfilt->steps[vfilt->num_steps++] = sd_sar_step;
+
+    vfilt->chain_csp = img->csp;
+    vfilt->chain_format = img->format;
+    vfilt->chain_width = img->width;
+    vfilt->chain_height = img->height;
+
+    return 0;
+}
+
+/** Renditions **/
+static int copy_user_data( obe_raw_frame_t *dst, obe_raw_frame_t *src )
+{
+    obe_user_data_t *user_data;
+
+    /* Each rendition has an arena of its own as its encoder allocates from it */
+    dst->num_user_data = dst->max_user_data = 0;
+    dst->user_data = NULL;
+    dst->arena = NULL;
+    if( !src->num_user_data )
+        return 0;
+
+    user_data = obe_frame_add_user_data( dst, src->num_user_data );
+    if( !user_data )
+        goto fail;
+
+    for( int i = 0; i < src->num_user_data; i++ )
+    {
+        memcpy( &user_data[i], &src->user_data[i], sizeof(*user_data) );
+        user_data[i].data = obe_frame_alloc( dst, src->user_data[i].len );
+        if( !user_data[i].data )
+            goto fail;
+        memcpy( user_data[i].data, src->user_data[i].data, src->user_data[i].len );
+    }
+
+    return 0;
+
+fail:
+    syslog( LOG_ERR, "Malloc failed\n" );
+    obe_arena_unref( dst->arena );
+    dst->arena = NULL;
+    dst->user_data = NULL;
+    dst->num_user_data = dst->max_user_data = 0;
+    return -1;
+}
+
+/* The encoders only read the picture so renditions of the same size share one pooled buffer */
+static obe_raw_frame_t *new_rendition_frame( obe_raw_frame_t *raw_frame, obe_raw_frame_t *src )
+{
+    obe_raw_frame_t *rendition = new_raw_frame();
+    if( !rendition )
+        return NULL;
+
+    memcpy( rendition, raw_frame, sizeof(*rendition) );
+    if( copy_user_data( rendition, raw_frame ) < 0 )
+    {
+        free( rendition );
+        return NULL;
+    }
+
+    rendition->release_data = obe_release_pooled_video_data;
+    rendition->release_frame = obe_release_frame;
+    rendition->frame_buf = NULL;
+
+    if( src )
+    {
+        obe_frame_buf_ref( src->frame_buf );
+        rendition->frame_buf = src->frame_buf;
+        memcpy( &rendition->alloc_img, &src->alloc_img, sizeof(obe_image_t) );
+        memcpy( &rendition->img, &src->img, sizeof(obe_image_t) );
+    }
+
+    return rendition;
+}
+
+/* Returns 1 if the frame has to be dropped because its frame pool is exhausted */
+static int scale_rendition( obe_vid_filter_ctx_t *vfilt, obe_vid_filter_rung_t *rung, obe_raw_frame_t *raw_frame,
+                            obe_raw_frame_t *src, obe_raw_frame_t *rendition )
+{
+    obe_image_t tmp_image = {0};
+    obe_frame_buf_t *frame_buf;
+    int sar_width, sar_height;
+
+    /* Bilinear is a fraction of the cost of Lanczos and only softens the picture a little */
+    int fast = rung->shed_level >= SHED_FILTER;
+    struct SwsContext **sws_ctx = fast ? &rung->fast_sws_ctx : &rung->sws_ctx;
+
+    /* TODO: scale interlaced pictures field by field */
+    if( !*sws_ctx || raw_frame->reset_obe )
+    {
+        if( *sws_ctx )
+            sws_freeContext( *sws_ctx );
+
+        *sws_ctx = sws_getContext( src->img.width, src->img.height, src->img.csp,
+                                   rung->width, rung->height, src->img.csp,
+                                   fast ? SWS_FAST_BILINEAR : SWS_ACCURATE_RND | SWS_LANCZOS, NULL, NULL, NULL );
+        if( !*sws_ctx )
+        {
+            fprintf( stderr, "Video scaling failed\n" );
+            return -1;
+        }
+    }
+
+    tmp_image.csp = src->img.csp;
+    tmp_image.width = rung->width;
+    tmp_image.height = rung->height;
+    tmp_image.planes = av_pix_fmt_descriptors[tmp_image.csp].nb_components;
+    tmp_image.format = src->img.format;
+
+    frame_buf = get_pooled_image( vfilt->device, &tmp_image, tmp_image.height+1 );
+    if( !frame_buf )
+        return 1;
+
+    sws_scale( *sws_ctx, (const uint8_t* const*)src->img.plane, src->img.stride,
+               0, src->img.height, tmp_image.plane, tmp_image.stride );
+
+    rendition->frame_buf = frame_buf;
+    memcpy( &rendition->alloc_img, &tmp_image, sizeof(obe_image_t) );
+    memcpy( &rendition->img, &rendition->alloc_img, sizeof(obe_image_t) );
+
+    /* Keep the display aspect ratio of the input */
+    av_reduce( &sar_width, &sar_height, (int64_t)raw_frame->sar_width * raw_frame->img.width * rung->height,
+               (int64_t)raw_frame->sar_height * raw_frame->img.height * rung->width, 65535 );
+    rendition->sar_width = sar_width;
+    rendition->sar_height = sar_height;
+
+    return 0;
+}
+
+static void release_raw_frame( obe_raw_frame_t *raw_frame )
+{
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
+}
+
+/* Each output line only depends on the input pictures so slices don't change the output */
+static void deinterlace_slice( obe_vid_filter_ctx_t *vfilt, void *arg, int slice, int num_slices )
+{
+    obe_slice_job_t *job = arg;
+    obe_image_t *img = job->img;
+    obe_image_t *prev = job->prev;
+    obe_image_t *out = job->out;
+    int pixel_size = obe_cli_csps[img->csp].bit_depth > 8 ? 2 : 1;
+    int start, end;
+
+    for( int i = 0; i < img->planes; i++ )
+    {
+        int height = obe_cli_csps[img->csp].height[i] * img->height;
+        int width = obe_cli_csps[img->csp].width[i] * img->width;
+
+        slice_rows( height, slice, num_slices, &start, &end );
+
+        for( int j = start; j < end; j++ )
+        {
+            uint8_t *src = img->plane[i] + j * img->stride[i];
+            uint8_t *ref = prev->plane[i] + j * prev->stride[i];
+            uint8_t *dst = out->plane[i] + j * out->stride[i];
+
+            /* Lines of the kept field are copied. A missing line at the top or bottom only has one neighbour */
+            if( ( j & 1 ) != job->tff )
+                memcpy( dst, src, width * pixel_size );
+            else if( j == 0 )
+                memcpy( dst, src + img->stride[i], width * pixel_size );
+            else if( j == height-1 )
+                memcpy( dst, src - img->stride[i], width * pixel_size );
+            else if( pixel_size == 2 )
+                vfilt->deinterlace_line_10( (uint16_t*)dst, (uint16_t*)src, (uint16_t*)ref, img->stride[i], width );
+            else
+                vfilt->deinterlace_line_8( dst, src, ref, img->stride[i], width );
+        }
+    }
+}
+
+/* Makes a progressive frame from the first field of raw_frame, which must come from a pool.
+ * The second field is rebuilt using the previous picture to tell where there is motion.
+ * Returns 1 if the frame has to be dropped because its frame pool is exhausted */
+static int deinterlace_frame( obe_vid_filter_ctx_t *vfilt, obe_raw_frame_t *raw_frame, obe_raw_frame_t **deint )
+{
+    obe_image_t *img = &raw_frame->img;
+    obe_image_t tmp_image = {0};
+    obe_frame_buf_t *frame_buf;
+    obe_slice_job_t job = {0};
+    int ret = 0;
+
+    /* With no previous picture the first field is woven with the second */
+    if( vfilt->prev_buf && ( raw_frame->reset_obe || vfilt->prev_img.csp != img->csp ||
+        vfilt->prev_img.width != img->width || vfilt->prev_img.height != img->height ||
+        memcmp( vfilt->prev_img.stride, img->stride, sizeof(img->stride) ) ) )
+    {
+        obe_frame_buf_unref( vfilt->prev_buf );
+        vfilt->prev_buf = NULL;
+    }
+
+    *deint = NULL;
+
+    tmp_image.csp = img->csp;
+    tmp_image.width = img->width;
+    tmp_image.height = img->height;
+    tmp_image.format = img->format;
+
+    frame_buf = get_pooled_image( vfilt->device, &tmp_image, tmp_image.height+1 );
+    if( !frame_buf )
+    {
+        ret = 1;
+        goto end;
+    }
+
+    *deint = new_rendition_frame( raw_frame, NULL );
+    if( !*deint )
+    {
+        obe_frame_buf_unref( frame_buf );
+        return -1;
+    }
+
+    job.img = img;
+    job.prev = vfilt->prev_buf ? &vfilt->prev_img : img;
+    job.out = &tmp_image;
+    job.tff = vfilt->tff;
+    run_slices( vfilt, deinterlace_slice, &job );
+
+    (*deint)->frame_buf = frame_buf;
+    memcpy( &(*deint)->alloc_img, &tmp_image, sizeof(obe_image_t) );
+    memcpy( &(*deint)->img, &tmp_image, sizeof(obe_image_t) );
+
+end:
+    if( vfilt->prev_buf )
+        obe_frame_buf_unref( vfilt->prev_buf );
+    obe_frame_buf_ref( raw_frame->frame_buf );
+    vfilt->prev_buf = raw_frame->frame_buf;
+    memcpy( &vfilt->prev_img, img, sizeof(obe_image_t) );
+
+    return ret;
+}
+
+/* Each rendition sheds load by how much of the frame pool is waiting for its encoder. Levels go up
+ * as soon as a mark is passed and come down one at a time once the encoder has caught up */
+static void update_shedding( obe_vid_filter_ctx_t *vfilt, obe_t *h, obe_filter_t *filter )
+{
+    int pool_size = vfilt->device->frame_pool_size ? vfilt->device->frame_pool_size : OBE_FRAME_POOL_SIZE_LOW_LATENCY;
+    int filter_fill = obe_queue_size( &filter->queue );
+
+    for( int i = 0; i < vfilt->num_rungs; i++ )
+    {
+        obe_vid_filter_rung_t *rung = &vfilt->rungs[i];
+        int fill, level = SHED_NONE;
+
+        if( !rung->encoder )
+        {
+            for( int j = 0; j < h->num_encoders; j++ )
+            {
+                if( h->encoders[j]->stream_id == rung->stream_id )
+                    rung->encoder = h->encoders[j];
+            }
+            if( !rung->encoder )
+                continue;
+        }
+
+        fill = ( filter_fill + obe_queue_size( &rung->encoder->queue ) ) * 8 / pool_size;
+        while( level < SHED_DROP && fill >= shed_marks[level+1] )
+            level++;
+        rung->shed_drop = level == SHED_DROP;
+
+        if( level >= rung->shed_level )
+        {
+            rung->shed_recover = 0;
+            if( level == rung->shed_level )
+                continue;
+        }
+        else if( ++rung->shed_recover < SHED_RECOVER_FRAMES )
+            continue;
+        else
+        {
+            level = rung->shed_level - 1;
+            rung->shed_recover = 0;
+        }
+
+        syslog( LOG_WARNING, "Encoder for stream %i is %s, load shedding level %i\n", rung->stream_id,
+                level > rung->shed_level ? "falling behind" : "catching up", level );
+        if( level < SHED_DROP && rung->num_dropped )
+        {
+            syslog( LOG_WARNING, "Encoder for stream %i was too far behind, dropped %"PRIi64" frames\n",
+                    rung->stream_id, rung->num_dropped );
+            rung->num_dropped = 0;
+        }
+        rung->shed_level = level;
+        __atomic_store_n( &rung->encoder->shed_level, level, __ATOMIC_RELAXED );
+    }
+}
+
+/* Returns 1 if the rendition's frame is to be dropped. Only the rendition's own encoder misses the frame,
+ * so the drop is counted for it and the input, its audio and the other renditions are left alone */
+static int shed_frame( obe_vid_filter_rung_t *rung )
+{
+    if( !rung->shed_drop )
+        return 0;
+
+    __atomic_add_fetch( &rung->encoder->num_shed_frames, 1, __ATOMIC_RELAXED );
+    if( !rung->num_dropped++ )
+        syslog( LOG_WARNING, "Encoder for stream %i is too far behind, dropping frames\n", rung->stream_id );
+
+    return 1;
+}
+
+/* Makes every rendition of raw_frame and sends each one to its encoder. raw_frame is consumed.
+ * A rendition that can't get a buffer is dropped along with the renditions scaled from it */
+static int send_renditions( obe_vid_filter_ctx_t *vfilt, obe_t *h, obe_raw_frame_t *raw_frame )
+{
+    obe_raw_frame_t *frames[MAX_RENDITIONS] = {0};
+    obe_raw_frame_t *src, *deint = NULL;
+    int input_idx = -1, deint_idx = -1, ret = 0;
+
+    if( vfilt->num_rungs == 1 && !vfilt->deinterlace && vfilt->rungs[0].width == raw_frame->img.width &&
+        vfilt->rungs[0].height == raw_frame->img.height )
+    {
+        raw_frame->stream_id = vfilt->rungs[0].stream_id;
+        if( shed_frame( &vfilt->rungs[0] ) || add_to_encode_queue( h, raw_frame ) < 0 )
+            release_raw_frame( raw_frame );
+        return 0;
+    }
+
+    /* Renditions hold references to the input picture so it has to come from a pool */
+    if( !raw_frame->frame_buf )
+    {
+        obe_image_t tmp_image = {0};
+        obe_frame_buf_t *frame_buf;
+
+        tmp_image.csp = raw_frame->img.csp;
+        tmp_image.width = raw_frame->img.width;
+        tmp_image.height = raw_frame->img.height;
+        tmp_image.format = raw_frame->img.format;
+
+        frame_buf = get_pooled_image( vfilt->device, &tmp_image, tmp_image.height+1 );
+        if( !frame_buf )
+        {
+            release_raw_frame( raw_frame );
+            return 0;
+        }
+
+        av_image_copy( tmp_image.plane, tmp_image.stride, (const uint8_t **)raw_frame->img.plane, raw_frame->img.stride,
+                       tmp_image.csp, tmp_image.width, tmp_image.height );
+
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_data = obe_release_pooled_video_data;
+        raw_frame->frame_buf = frame_buf;
+        memcpy( &raw_frame->alloc_img, &tmp_image, sizeof(obe_image_t) );
+        memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(obe_image_t) );
+    }
+
+    /* Every deinterlaced rendition is made from the one deinterlaced picture */
+    if( vfilt->deinterlace && deinterlace_frame( vfilt, raw_frame, &deint ) < 0 )
+    {
+        release_raw_frame( raw_frame );
+        return -1;
+    }
+
+    for( int i = 0; i < vfilt->num_rungs; i++ )
+    {
+        obe_vid_filter_rung_t *rung = &vfilt->rungs[i];
+
+        if( rung->parent >= 0 )
+            src = frames[rung->parent];
+        else
+            src = rung->deinterlace ? deint : raw_frame;
+        if( !src )
+            continue;
+
+        if( src->img.width == rung->width && src->img.height == rung->height )
+        {
+            /* The first full size rendition takes over the input frame itself */
+            if( src == raw_frame && input_idx < 0 )
+            {
+                input_idx = i;
+                frames[i] = raw_frame;
+                continue;
+            }
+            else if( src == deint && deint_idx < 0 )
+            {
+                deint_idx = i;
+                frames[i] = deint;
+                continue;
+            }
+
+            frames[i] = new_rendition_frame( raw_frame, src );
+            if( !frames[i] )
+            {
+                ret = -1;
+                goto end;
+            }
+        }
+        else
+        {
+            frames[i] = new_rendition_frame( raw_frame, NULL );
+            if( !frames[i] )
+            {
+                ret = -1;
+                goto end;
+            }
+
+            ret = scale_rendition( vfilt, rung, raw_frame, src, frames[i] );
+            if( ret < 0 )
+                goto end;
+            else if( ret )
+            {
+                release_raw_frame( frames[i] );
+                frames[i] = NULL;
+                ret = 0;
+            }
+        }
+    }
+
+end:
+    /* Nothing is queued until every rendition has been made as they are scaled from each other */
+    for( int i = 0; i < vfilt->num_rungs; i++ )
+    {
+        if( !frames[i] )
+            continue;
+
+        if( ret < 0 )
+        {
+            if( i != input_idx && i != deint_idx )
+                release_raw_frame( frames[i] );
+            continue;
+        }
+
+        /* The other renditions hold their own references to the input picture */
+        frames[i]->stream_id = vfilt->rungs[i].stream_id;
+        if( shed_frame( &vfilt->rungs[i] ) )
+        {
+            release_raw_frame( frames[i] );
+            continue;
+        }
+        if( add_to_encode_queue( h, frames[i] ) < 0 )
+            release_raw_frame( frames[i] );
+    }
+
+    if( input_idx < 0 || ret < 0 )
+        release_raw_frame( raw_frame );
+    if( deint && ( deint_idx < 0 || ret < 0 ) )
+        release_raw_frame( deint );
+
+    return ret;
+}
+
+static void drop_frame( obe_filter_t *filter, obe_raw_frame_t *raw_frame )
+{
+    remove_frame_from_filter_queue( filter );
+    raw_frame->release_data( raw_frame );
+    raw_frame->release_frame( raw_frame );
+}
+
 void *start_filter( void *ptr )
 {
     obe_vid_filter_params_t *filter_params = ptr;
@@ -590,6 +1630,8 @@ void *start_filter( void *ptr )
     obe_filter_t *filter = filter_params->filter;
     obe_int_input_stream_t *input_stream = filter_params->input_stream;
     obe_raw_frame_t *raw_frame;
+    int64_t arrival_time;
+    int ret;
 
     obe_vid_filter_ctx_t *vfilt = calloc( 1, sizeof(*vfilt) );
     if( !vfilt )
@@ -599,64 +1641,55 @@ void *start_filter( void *ptr )
     }
 
     init_filter( vfilt );
+    init_slices( vfilt );
+    vfilt->device = filter_params->device;
+    vfilt->input_stream = input_stream;
+    vfilt->target_csp = filter_params->target_csp;
+    vfilt->chain_csp = -1;
+    vfilt->tff = input_stream->tff;
+    init_renditions( vfilt, filter_params );
+    vfilt->tap = obe_tap_entry( h, OBE_TAP_PICTURE, input_stream->stream_id );
 
     while( 1 )
     {
         /* TODO: support resolution changes */
         /* TODO: support changes in pixel format */
 
-        pthread_mutex_lock( &filter->filter_mutex );
-
-        if( filter->cancel_thread )
-        {
-            pthread_mutex_unlock( &filter->filter_mutex );
+        raw_frame = get_frame_from_filter_queue( filter );
+        if( !raw_frame )
             goto end;
-        }
-
-        if( !filter->num_raw_frames )
-            pthread_cond_wait( &filter->filter_cv, &filter->filter_mutex );
-
-        if( filter->cancel_thread )
-        {
-            pthread_mutex_unlock( &filter->filter_mutex );
-            goto end;
-        }
-
-        raw_frame = filter->frames[0];
-        pthread_mutex_unlock( &filter->filter_mutex );
 
         /* TODO: scale 8-bit to 10-bit
          * TODO: convert from 4:2:0 to 4:2:2 */
 
-        if( IS_SD( raw_frame->img.format ) )
-            blank_lines( raw_frame );
-
-        if( filter_params->target_csp == X264_CSP_I420 && ( raw_frame->img.csp == PIX_FMT_YUV422P || raw_frame->img.csp == PIX_FMT_YUV422P10 ) )
+        if( raw_frame->img.csp != vfilt->chain_csp || raw_frame->img.format != vfilt->chain_format ||
+            raw_frame->img.width != vfilt->chain_width || raw_frame->img.height != vfilt->chain_height )
         {
-            if( downconvert_frame( vfilt, raw_frame ) < 0 )
+            if( build_chain( vfilt, &raw_frame->img ) < 0 )
                 goto end;
         }
 
-        if( ( raw_frame->img.csp == PIX_FMT_YUV420P10 || raw_frame->img.csp == PIX_FMT_YUV422P10 ) && X264_BIT_DEPTH == 8 )
-        {
-            if( dither_image( vfilt, raw_frame ) < 0 )
-                goto end;
-        }
+        ret = 0;
+        for( int i = 0; i < vfilt->num_steps && !ret; i++ )
+            ret = vfilt->steps[i]( vfilt, raw_frame );
 
-        if( encapsulate_user_data( raw_frame, input_stream ) < 0 )
+        if( ret < 0 )
             goto end;
-
-        /* If SAR, on an SD stream, has not been updated by AFD or WSS, set to default 4:3
-         * TODO: make this user-choosable. OBE will prioritise any SAR information from AFD or WSS over any user settings */
-        if( IS_SD( raw_frame->img.format ) && raw_frame->sar_width == 1 && raw_frame->sar_height == 1 )
+        else if( ret )
         {
-            raw_frame->sar_width = obe_sd_sars[0][raw_frame->img.format].sar_width;
-            raw_frame->sar_height = obe_sd_sars[0][raw_frame->img.format].sar_height;
-            raw_frame->sar_guess = 1;
+            drop_frame( filter, raw_frame );
+            continue;
         }
 
+        obe_tap_picture( h, vfilt->tap, &vfilt->tap_next_pts, raw_frame );
+
+        /* The frame belongs to the encoders once it has been sent */
+        arrival_time = raw_frame->arrival_time;
         remove_frame_from_filter_queue( filter );
-        add_to_encode_queue( h, raw_frame );
+        update_shedding( vfilt, h, filter );
+        if( send_renditions( vfilt, h, raw_frame ) < 0 )
+            goto end;
+        obe_latency_record( &filter->latency, arrival_time );
     }
 
 end:
@@ -665,6 +1698,18 @@ end:
         if( vfilt->sws_ctx )
             sws_freeContext( vfilt->sws_ctx );
 
+        for( int i = 0; i < vfilt->num_rungs; i++ )
+        {
+            if( vfilt->rungs[i].sws_ctx )
+                sws_freeContext( vfilt->rungs[i].sws_ctx );
+            if( vfilt->rungs[i].fast_sws_ctx )
+                sws_freeContext( vfilt->rungs[i].fast_sws_ctx );
+        }
+
+        if( vfilt->prev_buf )
+            obe_frame_buf_unref( vfilt->prev_buf );
+
+        close_slices( vfilt );
         free( vfilt );
     }
 
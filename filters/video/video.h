@@ -29,12 +29,27 @@ typedef struct
     void* (*start_filter)( void *ptr );
 } obe_vid_filter_func_t;
 
+#define MAX_RENDITIONS 8
+
+/* One encoded version of the input picture */
+typedef struct
+{
+    int stream_id; /* output stream the frames are sent to */
+    int width;
+    int height;
+    int deinterlace; /* rebuilt as progressive from an interlaced input */
+} obe_vid_filter_rendition_t;
+
 typedef struct
 {
     obe_t *h;
+    obe_device_t *device;
     obe_filter_t *filter;
     obe_int_input_stream_t *input_stream;
     int target_csp;
+
+    int num_renditions;
+    obe_vid_filter_rendition_t renditions[MAX_RENDITIONS];
 } obe_vid_filter_params_t;
 
 extern const obe_vid_filter_func_t video_filter;
@@ -7,6 +7,21 @@ align 32
 scale: times 4 dd 511
 shift: dd 11
 
+align 16
+pw_2: times 8 dw 2
+; (x*16352)>>16 == (x*511)>>11
+pw_dither_mult: times 8 dw 16352
+
+; Same as obe_dithers, one row per line & 7
+dithers: times 4 dw 1, 2
+         times 4 dw 3, 0
+         times 4 dw 1, 2
+         times 4 dw 3, 0
+         times 4 dw 1, 2
+         times 4 dw 3, 0
+         times 4 dw 1, 2
+         times 4 dw 3, 0
+
 SECTION .text
 
 ;
@@ -77,3 +92,222 @@ INIT_XMM
 DITHER_row sse4
 INIT_AVX
 DITHER_row avx
+
+;
+; obe_dither_plane_10_to_8( uint16_t *src, intptr_t src_stride, uint8_t *dst, intptr_t dst_stride,
+;                           int width, int height, int y )
+;
+; Dithers height rows starting at line y of the picture. Each row is rounded up to 16 pixels
+; so the strides must leave room for it, which frame pools do.
+; x86inc.asm predates YMM support so the registers are named explicitly. It allows no more
+; than 7 registers, so the two extra ones are r10 and r11, caller-saved on both x86-64 ABIs.
+; There is no version for x86-32
+;
+
+%ifdef ARCH_X86_64
+INIT_AVX
+cglobal dither_plane_10_to_8_avx2, 7,7
+    test      r5d, r5d
+    jle       .end
+    movsxdifnidn r4, r4d
+    and       r6d, 7
+    shl       r6d, 4
+    lea       r10, [dithers]
+    vbroadcasti128 ymm3, [pw_dither_mult]
+    lea       r0, [r0+2*r4]
+    add       r2, r4
+
+.row
+    vbroadcasti128 ymm2, [r10+r6]
+    mov       r11, r4
+    neg       r11
+
+.loop
+    vmovdqu   ymm0, [r0+2*r11]
+    vpaddw    ymm0, ymm0, ymm2
+    vpmulhuw  ymm0, ymm0, ymm3
+    vpackuswb ymm0, ymm0, ymm0
+    vpermq    ymm0, ymm0, 0x08
+    vmovdqu   [r2+r11], xmm0
+
+    add       r11, 16
+    jl        .loop
+
+    add       r6d, 16
+    and       r6d, 127
+    add       r0, r1
+    add       r2, r3
+    sub       r5d, 1
+    jg        .row
+    vzeroupper
+.end
+    RET
+%endif
+
+;
+; obe_chroma_420_progressive_10( uint16_t *a, uint16_t *b, uint16_t *dst, int width )
+; obe_chroma_420_interlaced_10( uint16_t *a, uint16_t *b, uint16_t *dst, int width )
+; obe_chroma_420_progressive_8( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dithers )
+; obe_chroma_420_interlaced_8( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dithers )
+;
+; Progressive is (a+b+1)>>1. Interlaced is (3a+b+2)>>2 where a is the nearer line of the
+; same field. The 8-bit versions dither the result like dither_row_10_to_8.
+; width must be a multiple of 8
+;
+
+%macro CHROMA_420 3
+
+%if %2 == 8
+cglobal chroma_420_%1_8_%3, 5, 5
+    movu      m4, [r4]
+    mova      m5, [pw_dither_mult]
+    pxor      m6, m6
+%else
+cglobal chroma_420_%1_10_%3, 4, 4
+%endif
+%ifidn %1, interlaced
+    mova      m3, [pw_2]
+%endif
+
+.loop
+    movu      m0, [r0]
+    movu      m1, [r1]
+%ifidn %1, interlaced
+    paddw     m2, m0, m0
+    paddw     m0, m2
+    paddw     m0, m1
+    paddw     m0, m3
+    psrlw     m0, 2
+%else
+    pavgw     m0, m1
+%endif
+
+%if %2 == 8
+    paddw     m0, m4
+    pmulhuw   m0, m5
+    packuswb  m0, m6
+    movq      [r2], m0
+    add       r2, mmsize/2
+%else
+    movu      [r2], m0
+    add       r2, mmsize
+%endif
+
+    add       r0, mmsize
+    add       r1, mmsize
+    sub       r3d, mmsize/2
+    jg        .loop
+    REP_RET
+%endmacro
+
+INIT_XMM
+CHROMA_420 progressive, 10, sse2
+CHROMA_420 interlaced,  10, sse2
+CHROMA_420 progressive,  8, sse2
+CHROMA_420 interlaced,   8, sse2
+INIT_AVX
+CHROMA_420 progressive, 10, avx
+CHROMA_420 interlaced,  10, avx
+CHROMA_420 progressive,  8, avx
+CHROMA_420 interlaced,   8, avx
+
+;
+; obe_deinterlace_line_8( uint8_t *dst, const uint8_t *cur, const uint8_t *prev, intptr_t stride, int width )
+; obe_deinterlace_line_10( uint16_t *dst, const uint16_t *cur, const uint16_t *prev, intptr_t stride, int width )
+;
+; cur and prev are the line being rebuilt in this frame and the previous one, the lines either
+; side of it belong to the field that is kept. The spatial prediction (a+b+1)>>1 is clipped to
+; within d of the woven pixel c, where d is how much either field has moved since the last frame:
+;   d = max( |c-c'|, (|a-a'| + |b-b'| + 1) >> 1 )
+; The saturating add and subtract clip the same way as the C version as prediction never leaves
+; the pixel range. width is rounded up to a whole register, frame pools leave room for it
+;
+
+%macro DEINTERLACE_line 3 ; depth, suffix, min/max suffix
+
+cglobal deinterlace_line_%1_sse2, 5,6,6
+    mov       r5, r3
+    neg       r5
+%if %1 == 10
+    add       r4d, r4d
+%endif
+
+.loop
+    movu      m0, [r1+r5]
+    movu      m1, [r1+r3]
+    movu      m2, [r1]
+    movu      m3, [r2+r5]
+    psubus%2  m4, m0, m3
+    psubus%2  m3, m0
+    por       m3, m4
+    movu      m4, [r2+r3]
+    psubus%2  m5, m1, m4
+    psubus%2  m4, m1
+    por       m4, m5
+    pavg%2    m3, m4
+    pavg%2    m0, m1
+    movu      m1, [r2]
+    psubus%2  m4, m2, m1
+    psubus%2  m1, m2
+    por       m1, m4
+    pmax%3    m3, m1
+    paddus%2  m4, m2, m3
+    psubus%2  m2, m3
+    pmin%3    m0, m4
+    pmax%3    m0, m2
+    movu      [r0], m0
+
+    add       r0, mmsize
+    add       r1, mmsize
+    add       r2, mmsize
+    sub       r4d, mmsize
+    jg        .loop
+    REP_RET
+
+INIT_AVX
+cglobal deinterlace_line_%1_avx2, 5,6
+    mov       r5, r3
+    neg       r5
+%if %1 == 10
+    add       r4d, r4d
+%endif
+
+.loop
+    vmovdqu   ymm0, [r1+r5]
+    vmovdqu   ymm1, [r1+r3]
+    vmovdqu   ymm2, [r1]
+    vmovdqu   ymm3, [r2+r5]
+    vpsubus%2 ymm4, ymm0, ymm3
+    vpsubus%2 ymm3, ymm3, ymm0
+    vpor      ymm3, ymm3, ymm4
+    vmovdqu   ymm4, [r2+r3]
+    vpsubus%2 ymm5, ymm1, ymm4
+    vpsubus%2 ymm4, ymm4, ymm1
+    vpor      ymm4, ymm4, ymm5
+    vpavg%2   ymm3, ymm3, ymm4
+    vpavg%2   ymm0, ymm0, ymm1
+    vmovdqu   ymm1, [r2]
+    vpsubus%2 ymm4, ymm2, ymm1
+    vpsubus%2 ymm1, ymm1, ymm2
+    vpor      ymm1, ymm1, ymm4
+    vpmax%3   ymm3, ymm3, ymm1
+    vpaddus%2 ymm4, ymm2, ymm3
+    vpsubus%2 ymm2, ymm2, ymm3
+    vpmin%3   ymm0, ymm0, ymm4
+    vpmax%3   ymm0, ymm0, ymm2
+    vmovdqu   [r0], ymm0
+
+    add       r0, 32
+    add       r1, 32
+    add       r2, 32
+    sub       r4d, 32
+    jg        .loop
+    vzeroupper
+    RET
+%endmacro
+
+; The 10-bit version can use the signed word min and max as samples never reach the sign bit
+INIT_XMM
+DEINTERLACE_line  8, b, ub
+INIT_XMM
+DEINTERLACE_line 10, w, sw
@@ -28,7 +28,36 @@ void obe_scale_plane_mmxext( uint16_t *src, int stride, int width, int height, i
 void obe_scale_plane_sse2( uint16_t *src, int stride, int width, int height, int lshift, int rshift );
 void obe_scale_plane_avx( uint16_t *src, int stride, int width, int height, int lshift, int rshift );
 
+void obe_dither_row_10_to_8_c( uint16_t *src, uint8_t *dst, const uint16_t *dither, int width, int stride );
 void obe_dither_row_10_to_8_sse4( uint16_t *src, uint8_t *dst, const uint16_t *dither, int width, int stride );
 void obe_dither_row_10_to_8_avx( uint16_t *src, uint8_t *dst, const uint16_t *dither, int width, int stride );
 
+/* Dithers height rows starting at line y of the picture */
+void obe_dither_plane_10_to_8_c( uint16_t *src, intptr_t src_stride, uint8_t *dst, intptr_t dst_stride, int width, int height, int y );
+#if ARCH_X86_64
+void obe_dither_plane_10_to_8_avx2( uint16_t *src, intptr_t src_stride, uint8_t *dst, intptr_t dst_stride, int width, int height, int y );
+#endif
+
+void obe_chroma_420_progressive_10_c( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_chroma_420_progressive_10_sse2( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_chroma_420_progressive_10_avx( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_chroma_420_interlaced_10_c( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_chroma_420_interlaced_10_sse2( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_chroma_420_interlaced_10_avx( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+
+void obe_chroma_420_progressive_8_c( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_chroma_420_progressive_8_sse2( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_chroma_420_progressive_8_avx( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_chroma_420_interlaced_8_c( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_chroma_420_interlaced_8_sse2( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_chroma_420_interlaced_8_avx( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+
+/* Rebuilds the line at cur from the lines either side of it and the previous frame */
+void obe_deinterlace_line_8_c( uint8_t *dst, const uint8_t *cur, const uint8_t *prev, intptr_t stride, int width );
+void obe_deinterlace_line_8_sse2( uint8_t *dst, const uint8_t *cur, const uint8_t *prev, intptr_t stride, int width );
+void obe_deinterlace_line_8_avx2( uint8_t *dst, const uint8_t *cur, const uint8_t *prev, intptr_t stride, int width );
+void obe_deinterlace_line_10_c( uint16_t *dst, const uint16_t *cur, const uint16_t *prev, intptr_t stride, int width );
+void obe_deinterlace_line_10_sse2( uint16_t *dst, const uint16_t *cur, const uint16_t *prev, intptr_t stride, int width );
+void obe_deinterlace_line_10_avx2( uint16_t *dst, const uint16_t *cur, const uint16_t *prev, intptr_t stride, int width );
+
 #endif
@@ -0,0 +1,549 @@
+/*****************************************************************************
+ * failover.c : hot standby input failover
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <libavutil/mathematics.h>
+#include "common/common.h"
+#include "input/input.h"
+#include "input/sdi/sdi.h"
+#include "filters/audio/audio.h"
+
+/* SDI is 10-bit 4:2:2 and so is the slate. Black is 64 and no colour is 512 */
+#define SLATE_LUMA   64
+#define SLATE_CHROMA 512
+
+typedef struct
+{
+    int stream_id;
+    int timebase_num;
+    int timebase_den;
+
+    /* The picture is made once. Every slate frame takes another reference so it never goes back to the pool */
+    obe_frame_pool_t *pool;
+    obe_frame_buf_t *buf;
+    obe_image_t alloc_img;
+    obe_image_t img;
+
+    /* Silence goes to every audio encoder through the same routes as the captured audio */
+    int num_routers;
+    obe_audio_router_t routers[MAX_STREAMS];
+    int sample_rates[MAX_STREAMS];
+    int32_t *silence;
+
+    int64_t start_time;
+    int64_t num_frames; /* since the slate came on, for the number of audio samples in each frame */
+} obe_slate_t;
+
+static int is_sdi( obe_device_t *device )
+{
+    return device->device_type == INPUT_DEVICE_LINSYS_SDI || device->device_type == INPUT_DEVICE_DECKLINK;
+}
+
+int obe_failover_add_backup( obe_t *h, obe_device_t *device )
+{
+    obe_device_t *primary = h->devices[0];
+
+    if( h->num_devices != 2 || device != h->devices[1] )
+    {
+        fprintf( stderr, "The backup input must be probed straight after the main input \n" );
+        return -1;
+    }
+
+    if( !is_sdi( primary ) || !is_sdi( device ) )
+    {
+        fprintf( stderr, "Failover needs SDI inputs \n" );
+        return -1;
+    }
+
+    if( primary->num_input_streams != device->num_input_streams )
+    {
+        fprintf( stderr, "The backup input does not carry the same streams as the main input \n" );
+        return -1;
+    }
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        obe_int_input_stream_t *a = primary->streams[i];
+        obe_int_input_stream_t *b = device->streams[i];
+
+        if( a->stream_type != b->stream_type || a->stream_format != b->stream_format ||
+            a->width != b->width || a->height != b->height || a->interlaced != b->interlaced ||
+            a->timebase_num != b->timebase_num || a->timebase_den != b->timebase_den ||
+            a->sample_rate != b->sample_rate || a->is_337m != b->is_337m )
+        {
+            fprintf( stderr, "Stream %i of the backup input does not match the main input \n", i );
+            return -1;
+        }
+    }
+
+    /* Frames from either input go to the same filters and encoders. Lookups by stream id find the primary first */
+    for( int i = 0; i < device->num_input_streams; i++ )
+        device->streams[i]->stream_id = primary->streams[i]->stream_id;
+
+    pthread_mutex_init( &h->failover.mutex, NULL );
+    device->is_backup = 1;
+    h->failover.primary = primary;
+    h->failover.backup = device;
+
+    return 0;
+}
+
+/* The next picture after the last one sent, placed by the clock so a gap keeps its length */
+static int64_t next_pts( obe_t *h )
+{
+    obe_failover_t *failover = &h->failover;
+    int64_t frames = ( get_input_clock_in_mpeg_ticks( h ) - failover->last_pts + failover->frame_duration / 2 ) / failover->frame_duration;
+
+    return failover->last_pts + MAX( frames, 1 ) * failover->frame_duration;
+}
+
+void obe_failover_signal( obe_t *h, obe_device_t *device, int has_signal )
+{
+    obe_failover_t *failover = &h->failover;
+    obe_device_t *other;
+
+    if( !failover->backup || !device || __atomic_load_n( &device->has_signal, __ATOMIC_RELAXED ) == has_signal )
+        return;
+
+    pthread_mutex_lock( &failover->mutex );
+    if( device->has_signal != has_signal )
+    {
+        __atomic_store_n( &device->has_signal, has_signal, __ATOMIC_RELAXED );
+        other = device == failover->primary ? failover->backup : failover->primary;
+
+        /* The other input stays on when this one comes back, a switch back would be a second hit */
+        if( !has_signal && failover->active == device )
+        {
+            __atomic_store_n( &failover->active, other->has_signal ? other : NULL, __ATOMIC_RELAXED );
+            if( failover->active )
+                failover->active->needs_resync = 1;
+            __atomic_store_n( &failover->num_switches, failover->num_switches + 1, __ATOMIC_RELAXED );
+            syslog( LOG_WARNING, "[failover] %s input lost, %s\n", device->is_backup ? "Backup" : "Main",
+                    failover->active ? "switching to the other input" : "sending the slate" );
+        }
+        else if( has_signal && !failover->active )
+        {
+            __atomic_store_n( &failover->active, device, __ATOMIC_RELAXED );
+            device->needs_resync = 1;
+            __atomic_store_n( &failover->num_switches, failover->num_switches + 1, __ATOMIC_RELAXED );
+            syslog( LOG_WARNING, "[failover] %s input is back, switching to it\n", device->is_backup ? "Backup" : "Main" );
+        }
+    }
+    pthread_mutex_unlock( &failover->mutex );
+}
+
+int obe_failover_video( obe_t *h, obe_device_t *device, int64_t *pts )
+{
+    obe_failover_t *failover = &h->failover;
+
+    /* Without a backup only the thread of the device gets here, so the device needs no lock */
+    if( !failover->backup )
+    {
+        /* A restarted input carries on the timeline from the last picture before it stopped */
+        if( device && device->needs_resync )
+        {
+            device->pts_offset = failover->last_pts < 0 || !failover->frame_duration ? 0 : next_pts( h ) - *pts;
+            device->needs_resync = 0;
+        }
+        if( device )
+            *pts += device->pts_offset;
+
+        /* Only the first device drives the clock when there are several */
+        if( !device || device == h->devices[0] )
+        {
+            failover->last_pts = *pts;
+            obe_clock_tick( h, *pts );
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock( &failover->mutex );
+    if( device != failover->active )
+    {
+        pthread_mutex_unlock( &failover->mutex );
+        return -1;
+    }
+
+    if( device->needs_resync )
+    {
+        device->pts_offset = failover->last_pts < 0 ? 0 : next_pts( h ) - *pts;
+        device->needs_resync = 0;
+    }
+
+    *pts += device->pts_offset;
+    failover->last_pts = *pts;
+    pthread_mutex_unlock( &failover->mutex );
+
+    obe_clock_tick( h, *pts );
+
+    return 0;
+}
+
+int obe_failover_pts( obe_t *h, obe_device_t *device, int64_t *pts )
+{
+    obe_failover_t *failover = &h->failover;
+    int ret = 0;
+
+    if( !failover->backup )
+    {
+        if( device->needs_resync )
+            return -1;
+        *pts += device->pts_offset;
+        return 0;
+    }
+
+    /* Anything before the first picture after a switch has no place on the timeline yet */
+    pthread_mutex_lock( &failover->mutex );
+    if( device != failover->active || device->needs_resync )
+        ret = -1;
+    else
+        *pts += device->pts_offset;
+    pthread_mutex_unlock( &failover->mutex );
+
+    return ret;
+}
+
+/** Slate **/
+static void close_slate( obe_slate_t *slate )
+{
+    for( int i = 0; i < slate->num_routers; i++ )
+        obe_audio_router_close( &slate->routers[i] );
+
+    if( slate->buf )
+        obe_frame_buf_unref( slate->buf );
+    if( slate->pool )
+        obe_frame_pool_destroy( slate->pool );
+
+    free( slate->silence );
+    free( slate );
+}
+
+static obe_slate_t *open_slate( obe_t *h )
+{
+    obe_failover_t *failover = &h->failover;
+    obe_device_t *device = failover->primary;
+    obe_int_input_stream_t *video_stream = NULL;
+    obe_slate_t *slate;
+    int max_samples = 0, num_channels, max_channels = 0, j;
+
+    slate = calloc( 1, sizeof(*slate) );
+    if( !slate )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        if( device->streams[i]->stream_format == VIDEO_UNCOMPRESSED )
+            video_stream = device->streams[i];
+    }
+
+    if( !video_stream )
+    {
+        fprintf( stderr, "[failover] The main input has no video\n" );
+        goto fail;
+    }
+
+    slate->stream_id = video_stream->stream_id;
+    slate->timebase_num = video_stream->timebase_num;
+    slate->timebase_den = video_stream->timebase_den;
+
+    slate->alloc_img.csp = PIX_FMT_YUV422P10;
+    slate->alloc_img.planes = 3;
+    slate->alloc_img.width = video_stream->width;
+    slate->alloc_img.height = video_stream->height;
+
+    slate->pool = obe_frame_pool_create( slate->alloc_img.csp, slate->alloc_img.width, slate->alloc_img.height, 1 );
+    if( !slate->pool )
+        goto fail;
+
+    slate->buf = obe_frame_pool_get( slate->pool, slate->alloc_img.plane, slate->alloc_img.stride );
+    if( !slate->buf )
+        goto fail;
+
+    for( int i = 0; i < slate->alloc_img.height; i++ )
+    {
+        uint16_t *y = (uint16_t*)( slate->alloc_img.plane[0] + i * slate->alloc_img.stride[0] );
+        uint16_t *u = (uint16_t*)( slate->alloc_img.plane[1] + i * slate->alloc_img.stride[1] );
+        uint16_t *v = (uint16_t*)( slate->alloc_img.plane[2] + i * slate->alloc_img.stride[2] );
+
+        for( int x = 0; x < slate->alloc_img.width; x++ )
+            y[x] = SLATE_LUMA;
+        for( int x = 0; x < slate->alloc_img.width / 2; x++ )
+            u[x] = v[x] = SLATE_CHROMA;
+    }
+
+    memcpy( &slate->img, &slate->alloc_img, sizeof(slate->img) );
+    if( IS_SD( device->user_opts.video_format ) )
+    {
+        for( j = 0; first_active_line[j].format != -1; j++ )
+        {
+            if( device->user_opts.video_format == first_active_line[j].format )
+                break;
+        }
+        slate->img.format = device->user_opts.video_format;
+        slate->img.first_line = first_active_line[j].line;
+    }
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        obe_int_input_stream_t *input_stream = device->streams[i];
+
+        /* SMPTE 337M bursts are passed through and have no silence */
+        if( input_stream->stream_type != STREAM_TYPE_AUDIO || input_stream->is_337m )
+            continue;
+
+        num_channels = obe_audio_router_channels( input_stream, h->output_streams, h->num_output_streams );
+        if( obe_audio_router_open( &slate->routers[slate->num_routers], h, input_stream, h->output_streams,
+                                   h->num_output_streams, num_channels ) < 0 )
+            goto fail;
+
+        if( !slate->routers[slate->num_routers].num_routes )
+        {
+            obe_audio_router_close( &slate->routers[slate->num_routers] );
+            continue;
+        }
+
+        slate->sample_rates[slate->num_routers] = input_stream->sample_rate;
+        max_samples = MAX( max_samples, av_rescale( failover->frame_duration, input_stream->sample_rate, OBE_CLOCK ) + 1 );
+        max_channels = MAX( max_channels, num_channels );
+        slate->num_routers++;
+    }
+
+    if( slate->num_routers )
+    {
+        slate->silence = calloc( max_samples * max_channels, sizeof(*slate->silence) );
+        if( !slate->silence )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            goto fail;
+        }
+    }
+
+    slate->start_time = obe_mdate();
+
+    return slate;
+
+fail:
+    close_slate( slate );
+    return NULL;
+}
+
+static void send_slate( obe_t *h, obe_slate_t *slate, int64_t pts )
+{
+    int64_t frame_duration = h->failover.frame_duration;
+    obe_raw_frame_t *raw_frame = new_raw_frame();
+
+    if( raw_frame )
+    {
+        obe_frame_buf_ref( slate->buf );
+        raw_frame->frame_buf = slate->buf;
+        memcpy( &raw_frame->alloc_img, &slate->alloc_img, sizeof(slate->alloc_img) );
+        memcpy( &raw_frame->img, &slate->img, sizeof(slate->img) );
+        raw_frame->release_data = obe_release_pooled_video_data;
+        raw_frame->release_frame = obe_release_frame;
+
+        raw_frame->stream_id = slate->stream_id;
+        raw_frame->timebase_num = slate->timebase_num;
+        raw_frame->timebase_den = slate->timebase_den;
+        raw_frame->sar_width = raw_frame->sar_height = 1;
+        raw_frame->pts = pts;
+        raw_frame->arrival_time = obe_mdate();
+
+        if( add_to_filter_queue( h, raw_frame ) < 0 )
+        {
+            raw_frame->release_data( raw_frame );
+            raw_frame->release_frame( raw_frame );
+        }
+    }
+
+    /* Each frame gets its share of the samples so the audio doesn't drift with non-integer counts (NTSC) */
+    for( int i = 0; i < slate->num_routers; i++ )
+    {
+        int num_samples = av_rescale( ( slate->num_frames + 1 ) * frame_duration, slate->sample_rates[i], OBE_CLOCK ) -
+                          av_rescale( slate->num_frames * frame_duration, slate->sample_rates[i], OBE_CLOCK );
+
+        obe_audio_router_send( &slate->routers[i], slate->silence, num_samples, pts );
+    }
+
+    slate->num_frames++;
+}
+
+/* An input that stops sending pictures has lost its signal, even if the card didn't say so */
+static void check_signal( obe_t *h, obe_slate_t *slate )
+{
+    obe_failover_t *failover = &h->failover;
+    obe_device_t *devices[2] = { failover->primary, failover->backup };
+    int64_t now = obe_mdate();
+
+    for( int i = 0; i < 2; i++ )
+    {
+        int64_t last_frame_time = __atomic_load_n( &devices[i]->last_frame_time, __ATOMIC_RELAXED );
+
+        if( __atomic_load_n( &devices[i]->has_signal, __ATOMIC_RELAXED ) &&
+            now - MAX( last_frame_time, slate->start_time ) >= SDI_MAX_DELAY )
+            obe_failover_signal( h, devices[i], 0 );
+    }
+}
+
+/* Runs at the frame rate. It watches both inputs and sends the slate while neither has signal */
+static void *slate_thread( void *ptr )
+{
+    obe_t *h = ptr;
+    obe_failover_t *failover = &h->failover;
+    obe_slate_t *slate = failover->slate;
+    int64_t next_time = get_wallclock_in_mpeg_ticks(), pts;
+    int is_on = 0;
+
+    while( !__atomic_load_n( &failover->cancel_slate_thread, __ATOMIC_ACQUIRE ) )
+    {
+        next_time += failover->frame_duration;
+        sleep_mpeg_ticks( next_time );
+
+        /* Don't try to catch up after being held off */
+        if( get_wallclock_in_mpeg_ticks() - next_time > 4 * failover->frame_duration )
+            next_time = get_wallclock_in_mpeg_ticks();
+
+        /* The inputs are stopped on purpose in warm standby */
+        if( __atomic_load_n( &h->is_standby, __ATOMIC_ACQUIRE ) )
+            continue;
+
+        check_signal( h, slate );
+
+        pthread_mutex_lock( &failover->mutex );
+        if( failover->active )
+        {
+            pthread_mutex_unlock( &failover->mutex );
+            is_on = 0;
+            continue;
+        }
+
+        pts = failover->last_pts < 0 ? 0 : next_pts( h );
+        failover->last_pts = pts;
+        pthread_mutex_unlock( &failover->mutex );
+
+        if( !is_on )
+        {
+            slate->num_frames = 0;
+            is_on = 1;
+        }
+
+        /* The slate is the clock source while it is on */
+        obe_clock_tick( h, pts );
+        send_slate( h, slate, pts );
+    }
+
+    return NULL;
+}
+
+int obe_failover_open( obe_t *h )
+{
+    obe_failover_t *failover = &h->failover;
+    obe_device_t *primary = h->devices[0];
+    obe_int_input_stream_t *video_stream = NULL;
+
+    /* The timeline is kept without a backup too so a restart can carry it on */
+    for( int i = 0; i < primary->num_input_streams; i++ )
+    {
+        if( primary->streams[i]->stream_format == VIDEO_UNCOMPRESSED )
+            video_stream = primary->streams[i];
+    }
+
+    if( video_stream )
+        failover->frame_duration = av_rescale_q( 1, (AVRational){video_stream->timebase_num, video_stream->timebase_den},
+                                                 (AVRational){1, OBE_CLOCK} );
+    failover->last_pts = -1;
+
+    if( !failover->backup )
+        return 0;
+
+    if( !video_stream )
+    {
+        fprintf( stderr, "[failover] The main input has no video\n" );
+        return -1;
+    }
+
+    /* Both inputs are taken to have signal until they show otherwise. The main input starts the timeline */
+    failover->primary->has_signal = failover->backup->has_signal = 1;
+    failover->primary->needs_resync = 1;
+    failover->active = failover->primary;
+
+    failover->slate = open_slate( h );
+    if( !failover->slate )
+        return -1;
+
+    if( obe_thread_create( h, &failover->slate_thread, OBE_THREAD_INPUT, failover->primary->numa_node, slate_thread, (void*)h ) < 0 )
+    {
+        fprintf( stderr, "Couldn't create slate thread \n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+void obe_failover_restart( obe_t *h )
+{
+    obe_failover_t *failover = &h->failover;
+
+    if( failover->backup )
+    {
+        pthread_mutex_lock( &failover->mutex );
+        if( failover->active )
+            failover->active->needs_resync = 1;
+        pthread_mutex_unlock( &failover->mutex );
+        return;
+    }
+
+    /* The input threads have been joined, they start again after this */
+    for( int i = 0; i < h->num_devices; i++ )
+        h->devices[i]->needs_resync = 1;
+}
+
+void obe_failover_stop( obe_t *h )
+{
+    obe_failover_t *failover = &h->failover;
+    void *ret_ptr;
+
+    if( !failover->slate_thread )
+        return;
+
+    __atomic_store_n( &failover->cancel_slate_thread, 1, __ATOMIC_RELEASE );
+    pthread_join( failover->slate_thread, &ret_ptr );
+    failover->slate_thread = 0;
+}
+
+void obe_failover_close( obe_t *h )
+{
+    obe_failover_t *failover = &h->failover;
+
+    if( !failover->backup )
+        return;
+
+    obe_failover_stop( h );
+
+    if( failover->slate )
+        close_slate( failover->slate );
+    failover->slate = NULL;
+
+    pthread_mutex_destroy( &failover->mutex );
+}
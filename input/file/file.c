@@ -0,0 +1,560 @@
+/*****************************************************************************
+ * file.c: raw video and audio file replay
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+/* Replays recordings of the raw card output so that the rest of the pipeline can be run and
+ * measured without a card. The files are memory-mapped, for fast replay they should fit in the page cache */
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "common/common.h"
+#include "input/input.h"
+#include "input/sdi/sdi.h"
+#include "input/sdi/x86/sdi.h"
+
+#include <libavutil/mathematics.h>
+
+#define FILE_SAMPLE_RATE  48000
+#define FILE_NUM_CHANNELS 2
+#define FILE_SAMPLE_SIZE  (FILE_NUM_CHANNELS * sizeof(int32_t))
+
+struct obe_to_file_video
+{
+    int obe_name;
+    int timebase_num;
+    int timebase_den;
+    int width;
+    int height;
+    int tff;
+};
+
+/* The sizes are those of the pictures the cards deliver */
+const static struct obe_to_file_video video_format_tab[] =
+{
+    { INPUT_VIDEO_FORMAT_PAL,        1,    25,    720,  576,  1 },
+    { INPUT_VIDEO_FORMAT_NTSC,       1001, 30000, 720,  486,  0 },
+    { INPUT_VIDEO_FORMAT_720P_50,    1,    50,    1280, 720,  0 },
+    { INPUT_VIDEO_FORMAT_720P_5994,  1001, 60000, 1280, 720,  0 },
+    { INPUT_VIDEO_FORMAT_720P_60,    1,    60,    1280, 720,  0 },
+    { INPUT_VIDEO_FORMAT_1080I_50,   1,    25,    1920, 1080, 1 },
+    { INPUT_VIDEO_FORMAT_1080I_5994, 1001, 30000, 1920, 1080, 1 },
+    { INPUT_VIDEO_FORMAT_1080I_60,   1,    60,    1920, 1080, 1 },
+    { INPUT_VIDEO_FORMAT_1080P_2398, 1001, 24000, 1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_24,   1,    24,    1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_25,   1,    25,    1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_2997, 1001, 30000, 1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_30,   1,    30,    1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_50,   1,    50,    1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_5994, 1001, 60000, 1920, 1080, 0 },
+    { INPUT_VIDEO_FORMAT_1080P_60,   1,    60,    1920, 1080, 0 },
+    { -1, -1, -1, -1, -1, -1 },
+};
+
+typedef struct
+{
+    obe_t *h;
+    obe_device_t *device;
+
+    /* Video */
+    int          vfd;
+    uint8_t      *vmap;
+    size_t       vmap_size;
+    int          file_format;
+    int          video_format;
+    int          width;
+    int          height;
+    int          interlaced;
+    int          tff;
+    int          first_line;
+    AVRational   v_timebase;
+    int          line_size;
+    int          frame_size;
+    int64_t      frames_in_file;
+    int64_t      v_counter;
+    int          video_stream_id;
+
+    void (*unpack_line) ( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+    int          unpack_align;
+
+    /* Audio, silent if there is no file */
+    int          afd;
+    uint8_t      *amap;
+    size_t       amap_size;
+    size_t       audio_pos;
+    int64_t      a_counter;
+    int          audio_stream_id;
+} file_ctx_t;
+
+static int map_file( const char *location, int *fd, uint8_t **map, size_t *size )
+{
+    struct stat st;
+
+    *fd = open( location, O_RDONLY );
+    if( *fd < 0 )
+    {
+        fprintf( stderr, "[file] Could not open %s: %s\n", location, strerror( errno ) );
+        return -1;
+    }
+
+    if( fstat( *fd, &st ) < 0 || !st.st_size )
+    {
+        fprintf( stderr, "[file] %s is empty\n", location );
+        return -1;
+    }
+
+    *size = st.st_size;
+    *map = mmap( NULL, *size, PROT_READ, MAP_PRIVATE, *fd, 0 );
+    if( *map == MAP_FAILED )
+    {
+        *map = NULL;
+        fprintf( stderr, "[file] Could not map %s: %s\n", location, strerror( errno ) );
+        return -1;
+    }
+
+    /* Fault the file in before the clock starts */
+    madvise( *map, *size, MADV_WILLNEED );
+
+    return 0;
+}
+
+static void close_files( void *ptr )
+{
+    file_ctx_t *file_ctx = ptr;
+
+    if( file_ctx->vmap )
+        munmap( file_ctx->vmap, file_ctx->vmap_size );
+    if( file_ctx->vfd > 0 )
+        close( file_ctx->vfd );
+    if( file_ctx->amap )
+        munmap( file_ctx->amap, file_ctx->amap_size );
+    if( file_ctx->afd > 0 )
+        close( file_ctx->afd );
+
+    file_ctx->vmap = file_ctx->amap = NULL;
+    file_ctx->vfd = file_ctx->afd = -1;
+}
+
+static int open_files( file_ctx_t *file_ctx, obe_input_t *user_opts )
+{
+    int i, cpu_flags;
+
+    file_ctx->vfd = file_ctx->afd = -1;
+
+    if( !user_opts->location )
+    {
+        fprintf( stderr, "[file] No file chosen\n" );
+        return -1;
+    }
+
+    for( i = 0; video_format_tab[i].obe_name != -1; i++ )
+    {
+        if( video_format_tab[i].obe_name == user_opts->video_format )
+            break;
+    }
+
+    if( video_format_tab[i].obe_name == -1 )
+    {
+        fprintf( stderr, "[file] Unsupported video format\n" );
+        return -1;
+    }
+
+    file_ctx->file_format = user_opts->file_format;
+    file_ctx->video_format = user_opts->video_format;
+    file_ctx->width = video_format_tab[i].width;
+    file_ctx->height = video_format_tab[i].height;
+    file_ctx->v_timebase.num = video_format_tab[i].timebase_num;
+    file_ctx->v_timebase.den = video_format_tab[i].timebase_den;
+    file_ctx->interlaced = IS_INTERLACED( file_ctx->video_format );
+    file_ctx->tff = video_format_tab[i].tff;
+
+    for( i = 0; first_active_line[i].format != -1; i++ )
+    {
+        if( first_active_line[i].format == file_ctx->video_format )
+            break;
+    }
+    file_ctx->first_line = first_active_line[i].line;
+
+    if( file_ctx->file_format == FILE_FORMAT_V210 )
+    {
+        /* v210 lines are padded to 48 pixels */
+        file_ctx->line_size = ((file_ctx->width + 47) / 48) * 128;
+        file_ctx->frame_size = file_ctx->line_size * file_ctx->height;
+    }
+    else if( file_ctx->file_format == FILE_FORMAT_YUV422P10 )
+    {
+        file_ctx->line_size = file_ctx->width * sizeof(uint16_t);
+        file_ctx->frame_size = file_ctx->line_size * file_ctx->height * 2;
+    }
+    else
+    {
+        fprintf( stderr, "[file] Unsupported file format\n" );
+        return -1;
+    }
+
+    if( map_file( user_opts->location, &file_ctx->vfd, &file_ctx->vmap, &file_ctx->vmap_size ) < 0 )
+        goto fail;
+
+    file_ctx->frames_in_file = file_ctx->vmap_size / file_ctx->frame_size;
+    if( !file_ctx->frames_in_file )
+    {
+        fprintf( stderr, "[file] %s is smaller than one frame\n", user_opts->location );
+        goto fail;
+    }
+
+    if( file_ctx->vmap_size % file_ctx->frame_size )
+        fprintf( stderr, "[file] %s does not hold a whole number of frames, ignoring the last one\n", user_opts->location );
+
+    if( user_opts->audio_location )
+    {
+        if( map_file( user_opts->audio_location, &file_ctx->afd, &file_ctx->amap, &file_ctx->amap_size ) < 0 )
+            goto fail;
+
+        file_ctx->amap_size -= file_ctx->amap_size % FILE_SAMPLE_SIZE;
+        if( !file_ctx->amap_size )
+        {
+            fprintf( stderr, "[file] %s is smaller than one sample\n", user_opts->audio_location );
+            goto fail;
+        }
+    }
+
+    cpu_flags = obe_get_cpu_flags();
+
+    /* The mapping and the v210 lines are aligned */
+    file_ctx->unpack_line = obe_v210_planar_unpack_c;
+    file_ctx->unpack_align = 6;
+
+    if( cpu_flags & AV_CPU_FLAG_SSSE3 )
+        file_ctx->unpack_line = obe_v210_planar_unpack_aligned_ssse3;
+
+    if( cpu_flags & AV_CPU_FLAG_AVX )
+        file_ctx->unpack_line = obe_v210_planar_unpack_aligned_avx;
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        file_ctx->unpack_line = obe_v210_planar_unpack_avx2;
+        file_ctx->unpack_align = 12;
+    }
+
+    return 0;
+
+fail:
+    close_files( file_ctx );
+    return -1;
+}
+
+static void decode_line( file_ctx_t *file_ctx, const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v )
+{
+    int w = (file_ctx->width / file_ctx->unpack_align) * file_ctx->unpack_align;
+
+    if( w )
+        file_ctx->unpack_line( src, y, u, v, w );
+
+    /* The C version writes whole groups of 6 pixels. The line is padded in the file and the next line
+     * or the spare line at the bottom of the picture takes the rest */
+    if( w < file_ctx->width )
+        obe_v210_planar_unpack_c( src + w / 6 * 4, y + w, u + w / 2, v + w / 2, FFALIGN( file_ctx->width - w, 6 ) );
+}
+
+static int send_video_frame( file_ctx_t *file_ctx, int64_t frame_time )
+{
+    obe_t *h = file_ctx->h;
+    obe_raw_frame_t *raw_frame;
+    obe_image_t *output;
+    const uint8_t *src = file_ctx->vmap + (file_ctx->v_counter % file_ctx->frames_in_file) * file_ctx->frame_size;
+
+    raw_frame = new_raw_frame();
+    if( !raw_frame )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+    output = &raw_frame->alloc_img;
+
+    raw_frame->release_frame = obe_release_frame;
+    raw_frame->release_data = obe_release_pooled_video_data;
+    raw_frame->arrival_time = frame_time;
+    raw_frame->stream_id = file_ctx->video_stream_id;
+
+    output->csp = PIX_FMT_YUV422P10;
+    output->width = file_ctx->width;
+    output->height = file_ctx->height;
+
+    /* One spare line for the unpack functions to write into */
+    raw_frame->frame_buf = get_pooled_image( file_ctx->device, output, file_ctx->height + 1 );
+    if( !raw_frame->frame_buf )
+    {
+        /* The pool has counted the drop */
+        raw_frame->release_frame( raw_frame );
+        return 0;
+    }
+
+    if( file_ctx->file_format == FILE_FORMAT_V210 )
+    {
+        for( int i = 0; i < file_ctx->height; i++ )
+        {
+            decode_line( file_ctx, (const uint32_t*)(src + i * file_ctx->line_size ),
+                         (uint16_t*)(output->plane[0] + i * output->stride[0]),
+                         (uint16_t*)(output->plane[1] + i * output->stride[1]),
+                         (uint16_t*)(output->plane[2] + i * output->stride[2]) );
+        }
+    }
+    else
+    {
+        for( int i = 0; i < 3; i++ )
+        {
+            int line_size = i ? file_ctx->line_size / 2 : file_ctx->line_size;
+
+            for( int j = 0; j < file_ctx->height; j++ )
+            {
+                memcpy( output->plane[i] + j * output->stride[i], src, line_size );
+                src += line_size;
+            }
+        }
+    }
+
+    memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(raw_frame->img) );
+
+    /* The format is always set, a zeroed one would read as PAL and get its VBI lines blanked */
+    raw_frame->img.format = file_ctx->video_format;
+    if( IS_SD( file_ctx->video_format ) )
+    {
+        if( file_ctx->video_format == INPUT_VIDEO_FORMAT_NTSC )
+            raw_frame->img.height = 480;
+
+        raw_frame->img.first_line = file_ctx->first_line;
+    }
+
+    raw_frame->timebase_num = file_ctx->v_timebase.num;
+    raw_frame->timebase_den = file_ctx->v_timebase.den;
+    raw_frame->sar_width = raw_frame->sar_height = 1;
+    raw_frame->pts = av_rescale_q( file_ctx->v_counter, file_ctx->v_timebase, (AVRational){1, OBE_CLOCK} ) + file_ctx->device->pts_offset;
+
+    if( add_to_filter_queue( h, raw_frame ) < 0 )
+    {
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Sends the audio that goes with the current video frame */
+static int send_audio_frame( file_ctx_t *file_ctx )
+{
+    obe_raw_frame_t *raw_frame;
+    int64_t end = av_rescale( file_ctx->v_counter + 1, (int64_t)FILE_SAMPLE_RATE * file_ctx->v_timebase.num,
+                              file_ctx->v_timebase.den );
+    uint8_t *dst;
+    int len;
+
+    raw_frame = new_raw_frame();
+    if( !raw_frame )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    raw_frame->num_samples = end - file_ctx->a_counter;
+    raw_frame->channel_layout = AV_CH_LAYOUT_STEREO;
+    raw_frame->sample_fmt = AV_SAMPLE_FMT_S32;
+
+    raw_frame->len = raw_frame->bytes_left = raw_frame->num_samples * FILE_SAMPLE_SIZE;
+    raw_frame->data = av_malloc( raw_frame->len );
+    if( !raw_frame->data )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        free( raw_frame );
+        return -1;
+    }
+    raw_frame->cur_pos = raw_frame->data;
+
+    /* Loop the audio file independently of the video */
+    dst = raw_frame->data;
+    len = raw_frame->len;
+    if( !file_ctx->amap )
+        memset( dst, 0, len );
+
+    while( file_ctx->amap && len )
+    {
+        int size = MIN( len, file_ctx->amap_size - file_ctx->audio_pos );
+        memcpy( dst, file_ctx->amap + file_ctx->audio_pos, size );
+        dst += size;
+        len -= size;
+        file_ctx->audio_pos = (file_ctx->audio_pos + size) % file_ctx->amap_size;
+    }
+
+    raw_frame->pts = av_rescale_q( file_ctx->a_counter, (AVRational){1, FILE_SAMPLE_RATE}, (AVRational){1, OBE_CLOCK} ) + file_ctx->device->pts_offset;
+    file_ctx->a_counter = end;
+
+    raw_frame->release_data = obe_release_other_data;
+    raw_frame->release_frame = obe_release_frame;
+    raw_frame->stream_id = file_ctx->audio_stream_id;
+
+    if( add_to_encode_queue( file_ctx->h, raw_frame ) < 0 )
+    {
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *probe_stream( void *ptr )
+{
+    obe_input_probe_t *probe_ctx = ptr;
+    obe_t *h = probe_ctx->h;
+    obe_input_t *user_opts = &probe_ctx->user_opts;
+    obe_device_t *device;
+    obe_int_input_stream_t *streams[MAX_STREAMS];
+    int num_streams = 2;
+
+    file_ctx_t file_ctx;
+    memset( &file_ctx, 0, sizeof(file_ctx) );
+
+    if( open_files( &file_ctx, user_opts ) < 0 )
+        goto finish;
+
+    close_files( &file_ctx );
+
+    for( int i = 0; i < num_streams; i++ )
+    {
+        streams[i] = calloc( 1, sizeof(*streams[i]) );
+        if( !streams[i] )
+            goto finish;
+
+        pthread_mutex_lock( &h->device_list_mutex );
+        streams[i]->stream_id = h->cur_stream_id++;
+        pthread_mutex_unlock( &h->device_list_mutex );
+
+        if( i == 0 )
+        {
+            streams[i]->stream_type = STREAM_TYPE_VIDEO;
+            streams[i]->stream_format = VIDEO_UNCOMPRESSED;
+            streams[i]->width  = file_ctx.width;
+            streams[i]->height = file_ctx.video_format == INPUT_VIDEO_FORMAT_NTSC ? 480 : file_ctx.height;
+            streams[i]->timebase_num = file_ctx.v_timebase.num;
+            streams[i]->timebase_den = file_ctx.v_timebase.den;
+            streams[i]->csp    = PIX_FMT_YUV422P10;
+            streams[i]->interlaced = file_ctx.interlaced;
+            streams[i]->tff = file_ctx.tff;
+            streams[i]->sar_num = streams[i]->sar_den = 1; /* The user can choose this when encoding */
+        }
+        else
+        {
+            streams[i]->stream_type = STREAM_TYPE_AUDIO;
+            streams[i]->stream_format = AUDIO_PCM;
+            streams[i]->channel_layout = AV_CH_LAYOUT_STEREO;
+            streams[i]->sample_format = AV_SAMPLE_FMT_S32;
+            streams[i]->sample_rate = FILE_SAMPLE_RATE;
+        }
+    }
+
+    device = new_device();
+    if( !device )
+        goto finish;
+
+    device->num_input_streams = num_streams;
+    memcpy( device->streams, streams, num_streams * sizeof(obe_int_input_stream_t**) );
+    device->device_type = INPUT_FILE;
+    memcpy( &device->user_opts, user_opts, sizeof(*user_opts) );
+
+    /* add device */
+    add_device( h, device );
+
+finish:
+    free( probe_ctx );
+
+    return NULL;
+}
+
+static void *open_input( void *ptr )
+{
+    obe_input_params_t *input = ptr;
+    obe_t *h = input->h;
+    obe_device_t *device = input->device;
+    obe_input_t *user_opts = &device->user_opts;
+    int64_t num_frames, start_time, frame_time, pts;
+
+    file_ctx_t file_ctx;
+    memset( &file_ctx, 0, sizeof(file_ctx) );
+    file_ctx.h = h;
+    file_ctx.device = device;
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        if( device->streams[i]->stream_format == VIDEO_UNCOMPRESSED )
+            file_ctx.video_stream_id = device->streams[i]->stream_id;
+        else if( device->streams[i]->stream_format == AUDIO_PCM )
+            file_ctx.audio_stream_id = device->streams[i]->stream_id;
+    }
+
+    free( input );
+
+    if( open_files( &file_ctx, user_opts ) < 0 )
+        return NULL;
+
+    /* The input thread is cancelled when OBE closes */
+    pthread_cleanup_push( close_files, &file_ctx );
+
+    num_frames = user_opts->num_frames ? user_opts->num_frames : file_ctx.frames_in_file;
+
+    /* Without a frame rate to keep to, hold the input back when the pipeline is full instead of dropping */
+    device->frame_pool_wait = user_opts->fast_replay;
+
+    start_time = obe_mdate();
+
+    for( ; file_ctx.v_counter < num_frames; file_ctx.v_counter++ )
+    {
+        if( !user_opts->fast_replay )
+        {
+            int64_t wait = start_time + av_rescale( file_ctx.v_counter, (int64_t)file_ctx.v_timebase.num * 1000000,
+                                                    file_ctx.v_timebase.den ) - obe_mdate();
+            if( wait > 0 )
+                usleep( wait );
+        }
+
+        /* Ticks the clock, and after a restart moves the timestamps on from where they stopped */
+        pts = av_rescale_q( file_ctx.v_counter, file_ctx.v_timebase, (AVRational){1, OBE_CLOCK} );
+        obe_failover_video( h, device, &pts );
+
+        frame_time = obe_mdate();
+        obe_input_frame_arrived( device, frame_time, 0 );
+
+        if( send_video_frame( &file_ctx, frame_time ) < 0 || send_audio_frame( &file_ctx ) < 0 )
+            break;
+    }
+
+    syslog( LOG_INFO, "[file] Replayed %"PRIi64" frames in %"PRIi64" ms\n", file_ctx.v_counter,
+            (obe_mdate() - start_time) / 1000 );
+
+    pthread_cleanup_pop( 1 );
+
+    return NULL;
+}
+
+const obe_input_func_t file_input = { probe_stream, open_input };
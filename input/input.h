@@ -45,10 +45,41 @@ typedef struct
     int audio_samples;
 } obe_input_params_t;
 
-//extern const obe_input_func_t lavf_input;
+/* Probe cache (obe_input_t probe_cache), SDI inputs only
+ * load adds the device from the cache and returns 0, or returns -1 if the input needs probing.
+ * check is called on frames while h->probe_cache_pending is set and returns -1 for a frame
+ * that doesn't match the cached video stream, removing the cache */
+int obe_probe_cache_load( obe_t *h, const obe_input_t *user_opts );
+int obe_probe_cache_save( const obe_device_t *device );
+int obe_probe_cache_check( obe_t *h, const obe_raw_frame_t *raw_frame );
+
+/* Hot standby failover (obe_probe_backup_device). Both SDI inputs capture all the time but only the active
+ * one feeds the filters and encoders. When it loses signal the other takes over at its next picture, and stays
+ * on until it fails in turn. With neither a black slate and silence are sent at the frame rate.
+ * The timestamps of each input are moved onto one timeline so the clock and the PCR run on across a switch.
+ *
+ * add_backup checks the newly probed device against the primary and gives its streams the same stream ids.
+ * open starts the slate thread, stop ends it once the inputs have stopped and close frees the slate
+ * once nothing downstream holds it. None of these do anything without a backup.
+ * restart is called before stopped inputs start again so their timestamps continue the timeline */
+int  obe_failover_add_backup( obe_t *h, obe_device_t *device );
+int  obe_failover_open( obe_t *h );
+void obe_failover_restart( obe_t *h );
+void obe_failover_stop( obe_t *h );
+void obe_failover_close( obe_t *h );
+/* Called by an input when it finds its signal has come or gone */
+void obe_failover_signal( obe_t *h, obe_device_t *device, int has_signal );
+/* Called for each picture before any of it is sent. Returns -1 if the device isn't feeding the pipeline,
+ * otherwise moves *pts onto the output timeline and ticks the clock with it */
+int  obe_failover_video( obe_t *h, obe_device_t *device, int64_t *pts );
+/* The same for the audio and data of a device, which don't tick the clock */
+int  obe_failover_pts( obe_t *h, obe_device_t *device, int64_t *pts );
+
+extern const obe_input_func_t lavf_input;
 #if HAVE_DECKLINK
 extern const obe_input_func_t decklink_input;
 #endif
 extern const obe_input_func_t linsys_sdi_input;
+extern const obe_input_func_t file_input;
 
 #endif
@@ -21,291 +21,542 @@
  *
  *****************************************************************************/
 
+/* Demuxing runs on the input thread and decoding on a thread of its own so that a slow
+ * decode never holds up reading the socket. Packets are handed over through a fixed ring.
+ *
+ * The input clock is recovered from the PCR, which is read as the transport stream comes off
+ * the protocol so that it can be matched to its arrival time. Inputs without a PCR use the video
+ * DTS instead. Files are read at the rate of their clock.
+ *
+ * Only streams that are encoded are decoded. Passthrough streams, video included, go to the mux
+ * as they came in with their timestamps moved onto the input timeline. */
+
 #include "common/common.h"
 #include "common/lavc.h"
 #include "input/input.h"
 #include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
 
 /* TODO: add support for choosing programs */
 #define MAX_PROGRAMS 1
 /* FIXME: arbitrary number */
 #define NUM_FRAMES_TO_SEARCH 20
-#define AUDIO_BUFFER_SIZE 200000
 
-/* FIXME: make 302M work */
+#define TS_PACKET_SIZE 188
+/* One datagram of seven TS packets so that reads return as soon as a datagram arrives */
+#define LAVF_IO_BUFFER_SIZE (7 * TS_PACKET_SIZE)
+
+/* Packets in flight between the demuxer and the decoders */
+#define LAVF_NUM_PACKETS 256
+
+/* Pictures each video decoder can hold on to on top of the pool: an H.264 DPB and the one being decoded */
+#define LAVF_DECODER_FRAMES 17
+#define LAVF_MAX_THREADS 16
+
+/* Timestamps and PCR are 33-bit 90kHz, which is 2^33 * 300 in 27MHz ticks */
+#define TS_WRAP (((int64_t)1 << 33) * 300)
+/* A step in the clock larger than this is taken as a discontinuity */
+#define MAX_CLOCK_JUMP OBE_CLOCK
+
+enum lavf_stop_e
+{
+    LAVF_STOP_NONE,
+    LAVF_STOP_DRAIN, /* end of input, decode what is queued */
+    LAVF_STOP_NOW,
+};
 
 typedef struct
 {
-    int stream_id;
-    int lavf_stream_idx;
-} lavf_stream_lut;
+    obe_t *h;
+    int drives_clock;
+
+    /* The protocol. It is wrapped so the transport stream can be scanned for PCR on its way to the demuxer */
+    AVIOContext *io;
+
+    /* A transport stream packet split across two reads */
+    uint8_t partial[TS_PACKET_SIZE];
+    int partial_len;
+
+    int pcr_pid;
+    int have_ref;
+    int64_t last_ref;    /* last clock reference, unwrapped and rebased */
+    int64_t wrap_offset;
+    int have_base;
+    int64_t base;        /* the input timeline starts a second before the first timestamp seen */
+    int64_t offset;      /* filtered difference between the input clock and the wallclock */
+    int discontinuity;
+
+    /* Files are read at the rate of their clock */
+    int pace;
+    int64_t pace_ref;
+    int64_t pace_time;
+} lavf_clock_t;
+
+/* The packet timestamps are rewritten in 27MHz ticks on the input timeline before they are queued */
+typedef struct
+{
+    AVPacket pkt;
+    int64_t arrival_time;
+    int64_t clock_time; /* input clock when the packet arrived */
+} lavf_packet_t;
 
-struct lavf_status
+typedef struct
 {
-    AVFormatContext **lavf;
-    int status;
-};
+    int input_stream_id;
+    obe_int_input_stream_t *input_stream;
+    AVRational time_base;
+    int64_t next_pts;
+
+    /* Decoded only when at least one output stream is encoded from it */
+    AVCodecContext *codec;
+    obe_output_stream_t *encode_stream;
+
+    /* Everything else is carried to the mux as it is */
+    int num_passthrough;
+    obe_output_stream_t *passthrough[MAX_STREAMS];
+    int64_t last_arrival;
+} lavf_stream_t;
 
-static lavf_stream_lut *find_stream_id( lavf_stream_lut *cur_lut, int lavf_stream_idx )
+typedef struct
 {
-    int i = 0;
+    obe_t *h;
+    obe_device_t *device;
 
-    while( cur_lut[i].stream_id != -1 && cur_lut[i].lavf_stream_idx != lavf_stream_idx )
-        i++;
+    AVFormatContext *lavf;
+    AVIOContext *pb;
+    lavf_clock_t clock;
+
+    int num_streams;
+    lavf_stream_t *streams; /* indexed by lavf stream index */
+    int video_idx;
+
+    lavf_packet_t packets[LAVF_NUM_PACKETS];
+    obe_queue_t packet_queue; /* demuxer -> decoder */
+    obe_queue_t free_queue;   /* decoder -> demuxer */
+    lavf_packet_t *spare;     /* a packet the demuxer took but didn't use, it is only pushed by the decoder */
+
+    pthread_t decode_thread;
+    int decode_thread_running;
+    int stop;
+} lavf_ctx_t;
+
+/** Clock recovery
+ * Only the demuxer thread touches the clock. Timestamps are unwrapped and rebased before the
+ * packets are queued, so everything past the demuxer sees one monotonic 27MHz timeline **/
+static void set_base( lavf_clock_t *clock, int64_t ts )
+{
+    if( !clock->have_base )
+    {
+        clock->base = ts - OBE_CLOCK;
+        clock->have_base = 1;
+    }
+}
 
-    return &cur_lut[i];
+static void clock_reference( lavf_clock_t *clock, int64_t ref, int discontinuity )
+{
+    int64_t now = get_wallclock_in_mpeg_ticks();
+    int64_t offset;
+
+    set_base( clock, ref );
+    ref += clock->wrap_offset - clock->base;
+    if( clock->have_ref && ref < clock->last_ref - TS_WRAP / 2 )
+    {
+        clock->wrap_offset += TS_WRAP;
+        ref += TS_WRAP;
+    }
+
+    offset = ref - now;
+
+    if( !clock->have_ref || discontinuity || llabs( offset - clock->offset ) > MAX_CLOCK_JUMP )
+    {
+        if( clock->have_ref )
+        {
+            syslog( LOG_WARNING, "[lavf] Clock discontinuity of %"PRIi64" ms\n", ( offset - clock->offset ) / 27000 );
+            clock->discontinuity = 1;
+        }
+
+        clock->offset = offset;
+        clock->pace_ref = ref;
+        clock->pace_time = now;
+    }
+    /* Packets are only ever delayed by the network, so the least delayed ones have the largest
+     * offset. Follow those straight away and let the delayed ones pull the clock back slowly */
+    else if( offset > clock->offset )
+        clock->offset = offset;
+    else
+        clock->offset += ( offset - clock->offset ) >> 8;
+
+    clock->last_ref = ref;
+    clock->have_ref = 1;
+
+    if( clock->drives_clock )
+        obe_clock_tick( clock->h, now + clock->offset );
 }
 
-static lavf_stream_lut *find_lavf_stream_idx( lavf_stream_lut *cur_lut, int stream_id )
+/* Bring a 33-bit timestamp in 27MHz ticks next to the clock */
+static int64_t unwrap_ts( lavf_clock_t *clock, int64_t ts )
 {
-    int i = 0;
+    set_base( clock, ts );
+    ts += clock->wrap_offset - clock->base;
 
-    while( cur_lut[i].stream_id != -1 && cur_lut[i].stream_id != stream_id )
-        i++;
+    if( clock->have_ref )
+    {
+        if( ts - clock->last_ref > TS_WRAP / 2 )
+            ts -= TS_WRAP;
+        else if( clock->last_ref - ts > TS_WRAP / 2 )
+            ts += TS_WRAP;
+    }
 
-    return &cur_lut[i];
+    return ts;
 }
 
-static obe_output_stream_t *get_stream( obe_input_params_t *input, int stream_id )
+static void parse_ts_packet( lavf_clock_t *clock, const uint8_t *pkt )
 {
-    for( int i = 0; i < input->num_output_streams; i++ )
+    int pid = ( ( pkt[1] & 0x1f ) << 8 ) | pkt[2];
+    int64_t base, ext;
+
+    /* Adaptation field long enough for a PCR and with PCR_flag set */
+    if( !( pkt[3] & 0x20 ) || pkt[4] < 7 || !( pkt[5] & 0x10 ) )
+        return;
+
+    /* TODO: take the PCR PID from the PMT */
+    if( clock->pcr_pid == -1 )
+        clock->pcr_pid = pid;
+    else if( pid != clock->pcr_pid )
+        return;
+
+    base = ( (int64_t)pkt[6] << 25 ) | ( pkt[7] << 17 ) | ( pkt[8] << 9 ) | ( pkt[9] << 1 ) | ( pkt[10] >> 7 );
+    ext  = ( ( pkt[10] & 1 ) << 8 ) | pkt[11];
+
+    clock_reference( clock, base * 300 + ext, pkt[5] & 0x80 );
+}
+
+static void scan_ts( lavf_clock_t *clock, const uint8_t *buf, int len )
+{
+    if( clock->partial_len )
     {
-        if( input->output_streams[i].stream_id == stream_id )
-            return &input->output_streams[i];
+        int size = MIN( len, TS_PACKET_SIZE - clock->partial_len );
+        memcpy( clock->partial + clock->partial_len, buf, size );
+        clock->partial_len += size;
+        buf += size;
+        len -= size;
+
+        if( clock->partial_len < TS_PACKET_SIZE )
+            return;
+
+        /* Only trust it if the next packet follows on */
+        if( !len || buf[0] == 0x47 )
+            parse_ts_packet( clock, clock->partial );
+        clock->partial_len = 0;
     }
 
-    return NULL;
+    while( len >= TS_PACKET_SIZE )
+    {
+        if( buf[0] != 0x47 )
+        {
+            buf++;
+            len--;
+            continue;
+        }
+
+        parse_ts_packet( clock, buf );
+        buf += TS_PACKET_SIZE;
+        len -= TS_PACKET_SIZE;
+    }
+
+    if( len && buf[0] == 0x47 )
+    {
+        memcpy( clock->partial, buf, len );
+        clock->partial_len = len;
+    }
 }
 
-static void close_input( void *ptr )
+static int io_read( void *opaque, uint8_t *buf, int size )
+{
+    lavf_clock_t *clock = opaque;
+    int len = avio_read( clock->io, buf, size );
+
+    if( len > 0 )
+        scan_ts( clock, buf, len );
+
+    return len;
+}
+
+static int64_t io_seek( void *opaque, int64_t offset, int whence )
+{
+    lavf_clock_t *clock = opaque;
+
+    if( whence == AVSEEK_SIZE )
+        return avio_size( clock->io );
+
+    clock->partial_len = 0;
+    return avio_seek( clock->io, offset, whence );
+}
+
+/** Decoder buffers **/
+/* obe_get_buffer gives the decoder a pool reference through the picture's opaque.
+ * Raw frames take one of their own so the decoder can keep the picture as a reference */
+static int lavf_get_buffer( AVCodecContext *codec, AVFrame *pic )
 {
-    struct lavf_status *status = ptr;
+    return obe_get_buffer( codec, pic );
+}
 
-    if( status->status )
-        av_close_input_file( *status->lavf );
+static void lavf_release_buffer( AVCodecContext *codec, AVFrame *pic )
+{
+    if( pic->opaque )
+        obe_frame_buf_unref( pic->opaque );
+    pic->opaque = NULL;
+    obe_release_buffer( codec, pic );
 }
 
-/* TODO: share some more code between probe_stream and open_stream */
-void *probe_stream( void *ptr )
+static int open_lavf( AVFormatContext **lavf, const char *location, AVIOContext *pb )
+{
+    *lavf = avformat_alloc_context();
+    if( !*lavf )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    (*lavf)->pb = pb;
+
+    if( avformat_open_input( lavf, location, NULL, NULL ) < 0 )
+    {
+        fprintf( stderr, "[lavf] Could not open %s\n", location );
+        return -1;
+    }
+
+    (*lavf)->max_delay = 100000;
+
+    if( avformat_find_stream_info( *lavf, NULL ) < 0 )
+    {
+        fprintf( stderr, "[lavf] Could not find stream information\n" );
+        avformat_close_input( lavf );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_probe( void *ptr )
+{
+    AVFormatContext **lavf = ptr;
+
+    if( *lavf )
+        avformat_close_input( lavf );
+}
+
+static void *probe_stream( void *ptr )
 {
     obe_input_probe_t *probe_ctx = ptr;
     obe_t *h = probe_ctx->h;
     char *location = probe_ctx->user_opts.location;
     obe_int_input_stream_t *streams[MAX_STREAMS];
-    int num_streams = 0, frame_idx = 0, have_video = 0,
-    lavf_idx = 0, ts_id = 0, program_num = 0, pmt_pid = 0, pcr_pid = 0;
-    struct lavf_status status = {0};
+    int num_streams = 0, frame_idx = 0, have_video = 0, program_num = 0;
     obe_device_t *device;
-    lavf_stream_lut *stream_lut, *out_lut;
 
-    AVFormatContext *lavf;
-    status.lavf = &lavf;
+    AVFormatContext *lavf = NULL;
     AVProgram *cur_program;
     AVStream *stream;
     AVCodecContext *codec;
-    AVMetadataTag *lang = NULL;
+    AVDictionaryEntry *lang;
     AVPacket pkt;
     AVCodec *dec;
     AVFrame frame;
     AVSubtitle subtitle;
 
-    avcodec_init();
-    avcodec_get_frame_defaults( &frame );
-
     av_register_all();
+    avformat_network_init();
     av_log_set_level( AV_LOG_QUIET );
 
-    pthread_cleanup_push( close_input, (void*)&status );
-
-    if( av_open_input_file( &lavf, location, NULL, 0, NULL ) < 0 )
-        return (void*)-1;
+    pthread_cleanup_push( close_probe, (void*)&lavf );
 
-    lavf->max_delay = 100000;
-
-    if( av_find_stream_info( lavf ) < 0 )
-        return (void*)-1;
-
-    status.status = 1;
+    if( open_lavf( &lavf, location, NULL ) < 0 )
+    {
+        lavf = NULL;
+        goto finish;
+    }
 
     for( int i = 0; i < lavf->nb_programs && i < MAX_PROGRAMS; i++ )
     {
         cur_program = lavf->programs[i];
-#if 0
-        ts_id = lavf->ts_id;
-        program_num = cur_program->program_num;
-        pmt_pid = cur_program->pmt_pid;
-        pcr_pid = cur_program->pcr_pid;
-#endif
+        program_num = cur_program->id;
         // TODO SDT
 
-        for( int j = 0; j < cur_program->nb_stream_indexes && j < MAX_STREAMS; j++ )
+        for( int j = 0; j < cur_program->nb_stream_indexes && num_streams < MAX_STREAMS; j++ )
         {
             int idx = cur_program->stream_index[j];
+            AVRational frame_rate;
             stream = lavf->streams[idx];
             codec = stream->codec;
 
-            if( codec->codec_type == AVMEDIA_TYPE_VIDEO || codec->codec_type ==AVMEDIA_TYPE_AUDIO ||
-                codec->codec_type == AVMEDIA_TYPE_SUBTITLE )
-            {
-                dec = avcodec_find_decoder( codec->codec_id );
+            if( codec->codec_type != AVMEDIA_TYPE_VIDEO && codec->codec_type != AVMEDIA_TYPE_AUDIO &&
+                codec->codec_type != AVMEDIA_TYPE_SUBTITLE )
+                continue;
 
-                /* ignore video streams which don't support custom allocators */
-                if( codec->codec_type == AVMEDIA_TYPE_VIDEO && !( dec->capabilities & CODEC_CAP_DR1 ) )
-                    continue;
+            dec = avcodec_find_decoder( codec->codec_id );
+            if( !dec && codec->codec_id != CODEC_ID_DVB_TELETEXT )
+                continue;
+
+            frame_rate = stream->avg_frame_rate.num ? stream->avg_frame_rate : stream->r_frame_rate;
 
-                if( codec->codec_id != CODEC_ID_DVB_TELETEXT && avcodec_open( codec, dec ) < 0 )
+            if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
+            {
+                /* Decoded pictures go straight into the frame pools */
+                if( !( dec->capabilities & CODEC_CAP_DR1 ) )
                     continue;
 
                 /* FIXME: ignore vfr streams for now */
-                if( codec->codec_id == CODEC_ID_H264 && !codec->h264_fixed_frame_rate )
+                if( !frame_rate.num || !frame_rate.den )
                     continue;
+            }
 
-                streams[num_streams] = calloc( 1, sizeof(*streams[num_streams]) );
-                if( !streams[num_streams] )
-                {
-                    fprintf( stderr, "Malloc failed\n" );
-                    goto fail;
-                }
+            if( codec->codec_id != CODEC_ID_DVB_TELETEXT )
+            {
+                if( avcodec_open2( codec, dec, NULL ) < 0 )
+                    continue;
+            }
 
-                pthread_mutex_lock( &h->device_list_mutex );
-                streams[num_streams]->stream_id = h->cur_stream_id++;
-                pthread_mutex_unlock( &h->device_list_mutex );
+            streams[num_streams] = calloc( 1, sizeof(*streams[num_streams]) );
+            if( !streams[num_streams] )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                goto fail;
+            }
 
-                streams[num_streams]->lavf_stream_idx = idx;
+            pthread_mutex_lock( &h->device_list_mutex );
+            streams[num_streams]->stream_id = h->cur_stream_id++;
+            pthread_mutex_unlock( &h->device_list_mutex );
 
-                /* container timebase */
-                streams[num_streams]->transport_timebase_num = stream->time_base.num;
-                streams[num_streams]->transport_timebase_den = stream->time_base.den;
+            streams[num_streams]->lavf_stream_idx = idx;
 
-                /* codec timebase */
-                streams[num_streams]->timebase_num = codec->time_base.num;
-                streams[num_streams]->timebase_den = codec->time_base.den / codec->ticks_per_frame;
+            /* container timebase */
+            streams[num_streams]->transport_timebase_num = stream->time_base.num;
+            streams[num_streams]->transport_timebase_den = stream->time_base.den;
 
-                lang = av_metadata_get( lavf->streams[idx]->metadata, "language", NULL, AV_METADATA_IGNORE_SUFFIX );
+            /* frame duration */
+            if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
+            {
+                streams[num_streams]->timebase_num = frame_rate.den;
+                streams[num_streams]->timebase_den = frame_rate.num;
+            }
 
-                if( lang && strlen( lang->value ) >= 3 )
-                {
-                    memcpy( streams[num_streams]->lang_code, lang->value, 3 );
-                    streams[num_streams]->lang_code[3] = 0;
-                }
+            lang = av_dict_get( stream->metadata, "language", NULL, AV_DICT_IGNORE_SUFFIX );
+            if( lang && strlen( lang->value ) >= 3 )
+            {
+                memcpy( streams[num_streams]->lang_code, lang->value, 3 );
+                streams[num_streams]->lang_code[3] = 0;
+            }
 
-                streams[num_streams]->pid = stream->id;
-#if 0
-                streams[num_streams]->has_stream_identifier = stream->has_stream_identifier;
-                streams[num_streams]->stream_identifier = stream->stream_identifier;
-#endif
+            streams[num_streams]->pid = stream->id;
 
-                if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
-                {
-                    streams[num_streams]->stream_type = STREAM_TYPE_VIDEO;
-                    if( codec->codec_id == CODEC_ID_H264 )
-                        streams[num_streams]->stream_format = VIDEO_AVC;
-                    else if( codec->codec_id == CODEC_ID_MPEG2VIDEO )
-                        streams[num_streams]->stream_format = VIDEO_MPEG2;
-                }
-                else if( codec->codec_type == AVMEDIA_TYPE_AUDIO )
-                {
-                    streams[num_streams]->stream_type = STREAM_TYPE_AUDIO;
-
-                    if( codec->codec_id == CODEC_ID_AC3 )
-                        streams[num_streams]->stream_format = AUDIO_AC_3;
-#if 0
-                    else if( codec->codec_id == CODEC_ID_EAC3 )
-                        streams[num_streams]->stream_format = AUDIO_E_AC_3;
-#endif
-                    else if( codec->codec_id == CODEC_ID_MP3 )
-                        streams[num_streams]->stream_format = AUDIO_MP2;
-                    else if( codec->codec_id == CODEC_ID_AAC || codec->codec_id == CODEC_ID_AAC_LATM )
-                    {
-                        streams[num_streams]->stream_format = AUDIO_AAC;
-                        streams[num_streams]->is_latm = codec->codec_id == CODEC_ID_AAC_LATM;
-                        /* From the descriptor, if available */
-                        streams[num_streams]->aac_profile_and_level = codec->aac_profile_and_level;
-                        streams[num_streams]->aac_type = codec->aac_type;
-                    }
-                }
-                else if( codec->codec_id == CODEC_ID_DVB_SUBTITLE && codec->extradata )
+            if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
+            {
+                streams[num_streams]->stream_type = STREAM_TYPE_VIDEO;
+                if( codec->codec_id == CODEC_ID_H264 )
+                    streams[num_streams]->stream_format = VIDEO_AVC;
+                else if( codec->codec_id == CODEC_ID_MPEG2VIDEO )
+                    streams[num_streams]->stream_format = VIDEO_MPEG2;
+            }
+            else if( codec->codec_type == AVMEDIA_TYPE_AUDIO )
+            {
+                streams[num_streams]->stream_type = STREAM_TYPE_AUDIO;
+
+                if( codec->codec_id == CODEC_ID_AC3 )
+                    streams[num_streams]->stream_format = AUDIO_AC_3;
+                else if( codec->codec_id == CODEC_ID_EAC3 )
+                    streams[num_streams]->stream_format = AUDIO_E_AC_3;
+                else if( codec->codec_id == CODEC_ID_MP2 || codec->codec_id == CODEC_ID_MP3 )
+                    streams[num_streams]->stream_format = AUDIO_MP2;
+                else if( codec->codec_id == CODEC_ID_AAC || codec->codec_id == CODEC_ID_AAC_LATM )
                 {
-                    streams[num_streams]->stream_type = STREAM_TYPE_SUBTITLE;
-                    streams[num_streams]->stream_format = SUBTITLES_DVB;
-                    /* The descriptor sometimes doesn't signal DDS so we need to probe it later */
-                    streams[num_streams]->dvb_subtitling_type = codec->dvb_subtitling_type;
-                    streams[num_streams]->composition_page_id = (codec->extradata[0] << 8) | codec->extradata[1];
-                    streams[num_streams]->ancillary_page_id   = (codec->extradata[2] << 8) | codec->extradata[3];
+                    streams[num_streams]->stream_format = AUDIO_AAC;
+                    streams[num_streams]->is_latm = codec->codec_id == CODEC_ID_AAC_LATM;
                 }
-                else if( codec->codec_id == CODEC_ID_DVB_TELETEXT )
+            }
+            else if( codec->codec_id == CODEC_ID_DVB_SUBTITLE && codec->extradata_size >= 4 )
+            {
+                streams[num_streams]->stream_type = STREAM_TYPE_SUBTITLE;
+                streams[num_streams]->stream_format = SUBTITLES_DVB;
+                streams[num_streams]->composition_page_id = (codec->extradata[0] << 8) | codec->extradata[1];
+                streams[num_streams]->ancillary_page_id   = (codec->extradata[2] << 8) | codec->extradata[3];
+            }
+            else if( codec->codec_id == CODEC_ID_DVB_TELETEXT )
+            {
+                streams[num_streams]->stream_type = STREAM_TYPE_MISC;
+                streams[num_streams]->stream_format = MISC_TELETEXT;
+                /* The first page of the teletext descriptor. FIXME: make lavf output all the teletexts */
+                if( codec->extradata_size >= 5 )
                 {
-                    streams[num_streams]->stream_type = STREAM_TYPE_MISC;
-                    streams[num_streams]->stream_format = MISC_TELETEXT;
-                    /* FIXME: make lavf output all the teletexts */
-#if 0
-                    streams[num_streams]->dvb_teletext_type = codec->dvb_teletext_type;
-                    streams[num_streams]->dvb_teletext_magazine_number = codec->dvb_teletext_magazine_number;
-                    streams[num_streams]->dvb_teletext_page_number = codec->dvb_teletext_page_number;
-#endif
+                    streams[num_streams]->dvb_teletext_type = codec->extradata[3] >> 3;
+                    streams[num_streams]->dvb_teletext_magazine_number = codec->extradata[3] & 7;
+                    streams[num_streams]->dvb_teletext_page_number = codec->extradata[4];
                 }
-                num_streams++;
             }
-        }
-    }
+            else
+            {
+                free( streams[num_streams] );
+                continue;
+            }
 
-    if( !num_streams )
-        return NULL;
+            if( streams[num_streams]->stream_type == STREAM_TYPE_VIDEO )
+                have_video = 1;
 
-    for( int i = 0; i < num_streams; i++ )
-    {
-        if( streams[i]->stream_type == STREAM_TYPE_VIDEO )
-            have_video = 1;
+            num_streams++;
+        }
     }
 
     if( !have_video )
-        goto fail;
-
-    stream_lut = malloc( (num_streams+1) * sizeof(lavf_stream_lut) );
-    if( !stream_lut )
-        goto fail;
-
-    for( int i = 0; i < num_streams; i++ )
     {
-        stream_lut[i].stream_id = streams[i]->stream_id;
-        stream_lut[i].lavf_stream_idx = streams[i]->lavf_stream_idx;
+        fprintf( stderr, "[lavf] No usable video stream\n" );
+        goto fail;
     }
 
-    stream_lut[num_streams].stream_id = stream_lut[num_streams].lavf_stream_idx = -1;
-
     av_init_packet( &pkt );
 
     /* decode some packets to get correct information */
     while( frame_idx < num_streams * NUM_FRAMES_TO_SEARCH )
     {
         int finished = 0;
-        int ret = 0;
+        int is_ours = 0;
+
+        if( av_read_frame( lavf, &pkt ) < 0 )
+            break;
+
+        for( int i = 0; i < num_streams; i++ )
+            is_ours |= streams[i]->lavf_stream_idx == pkt.stream_index;
 
-        ret = av_read_frame( lavf, &pkt );
         codec = lavf->streams[pkt.stream_index]->codec;
 
-        /* TODO: handle 302M */
-        out_lut = find_stream_id( stream_lut, pkt.stream_index );
-        if( out_lut->stream_id != -1 )
+        if( is_ours )
         {
             if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
             {
-                if( ret < 0 )
-                    pkt.size = 0;
-
-                codec->reordered_opaque = pkt.pts;
+                avcodec_get_frame_defaults( &frame );
                 avcodec_decode_video2( codec, &frame, &finished, &pkt );
                 if( finished )
-                    frame_idx++;
+                {
+                    for( int i = 0; i < num_streams; i++ )
+                    {
+                        if( streams[i]->lavf_stream_idx == pkt.stream_index )
+                        {
+                            streams[i]->interlaced = frame.interlaced_frame;
+                            streams[i]->tff = frame.top_field_first;
+                        }
+                    }
+                }
             }
             else if( codec->codec_id == CODEC_ID_DVB_SUBTITLE )
             {
                 avcodec_decode_subtitle2( codec, &subtitle, &finished, &pkt );
                 if( finished )
-                    frame_idx++;
+                    avsubtitle_free( &subtitle );
             }
-            else if( ret >= 0 )
+            else
                 finished = 1;
+
+            frame_idx += finished;
         }
         obe_free_packet( &pkt );
     }
@@ -313,8 +564,7 @@ void *probe_stream( void *ptr )
     /* update streams */
     for( int i = 0; i < num_streams; i++ )
     {
-        lavf_idx = streams[i]->lavf_stream_idx;
-        codec = lavf->streams[lavf_idx]->codec;
+        codec = lavf->streams[streams[i]->lavf_stream_idx]->codec;
 
         streams[i]->bitrate = codec->bit_rate;
 
@@ -322,308 +572,601 @@ void *probe_stream( void *ptr )
         {
             streams[i]->width  = codec->width;
             streams[i]->height = codec->height;
-            streams[i]->csp    = codec->pix_fmt;
-            streams[i]->interlaced = frame.interlaced_frame;
-            streams[i]->tff = frame.top_field_first;
+            /* full_range_flag is almost always wrong so ignore it */
+            streams[i]->csp    = codec->pix_fmt == PIX_FMT_YUVJ420P ? PIX_FMT_YUV420P : codec->pix_fmt;
             streams[i]->sar_num = codec->sample_aspect_ratio.num;
             streams[i]->sar_den = codec->sample_aspect_ratio.den;
+            streams[i]->profile = codec->profile;
+            streams[i]->level   = codec->level;
         }
         else if( codec->codec_type == AVMEDIA_TYPE_AUDIO )
         {
-            streams[i]->channel_layout = codec->channel_layout;
-            streams[i]->sample_format = codec->sample_fmt;
+            streams[i]->channel_layout = codec->channel_layout ? codec->channel_layout :
+                                         av_get_default_channel_layout( codec->channels );
+            /* Decoded audio is interleaved before it is passed on */
+            streams[i]->sample_format = av_get_packed_sample_fmt( codec->sample_fmt );
             streams[i]->sample_rate = codec->sample_rate;
         }
-#if 0
-        else if( codec->codec_id == CODEC_ID_DVB_SUBTITLE )
-            streams[i]->has_dds = codec->dvb_sub_has_dds;
-#endif
-
-        if( codec )
-            avcodec_close( codec );
     }
 
     /* create device */
     device = new_device();
-
     if( !device )
         goto fail;
 
     device->num_input_streams = num_streams;
     memcpy( device->streams, streams, num_streams * sizeof(obe_int_input_stream_t**) );
-    device->location = location;
     device->device_type = INPUT_URL;
-    device->ts_id = ts_id;
+    memcpy( &device->user_opts, &probe_ctx->user_opts, sizeof(device->user_opts) );
+    device->location = location;
     device->program_num = program_num;
-    device->pmt_pid = pmt_pid;
-    device->pcr_pid = pcr_pid;
 
     /* add device */
     add_device( h, device );
-
-    pthread_cleanup_pop( 1 );
-
-    return NULL;
+    num_streams = 0;
 
 fail:
-    fprintf( stderr, "Malloc failed \n" );
-
     for( int k = 0; k < num_streams; k++ )
         free( streams[k] );
 
+    for( int i = 0; i < lavf->nb_streams; i++ )
+    {
+        if( avcodec_is_open( lavf->streams[i]->codec ) )
+            avcodec_close( lavf->streams[i]->codec );
+    }
+
+finish:
+    pthread_cleanup_pop( 1 );
+    free( probe_ctx );
+
     return NULL;
 }
 
-void *open_input( void *ptr )
+/** Decoding **/
+static void interleave_audio( uint8_t *dst, uint8_t **src, int planar, int channels, int num_samples, int bps )
 {
-    obe_input_params_t *input = ptr;
-    obe_t *h = input->h;
-    obe_device_t *device = input->device;
-    lavf_stream_lut *stream_lut, *out_lut;
-    obe_output_stream_t *cur_stream;
-    obe_coded_frame_t *coded_frame;
+    if( !planar )
+    {
+        memcpy( dst, src[0], num_samples * channels * bps );
+        return;
+    }
+
+    for( int i = 0; i < num_samples; i++ )
+    {
+        for( int j = 0; j < channels; j++ )
+        {
+            memcpy( dst, src[j] + i * bps, bps );
+            dst += bps;
+        }
+    }
+}
+
+static int decode_video( lavf_ctx_t *lavf_ctx, lavf_stream_t *stream, lavf_packet_t *packet )
+{
+    AVCodecContext *codec = stream->codec;
     obe_raw_frame_t *raw_frame;
-    obe_encoder_t *encoder;
-    struct lavf_status status = {0};
+    AVFrame frame;
+    int finished = 0;
+    int64_t pts;
 
-    int width;
-    int height;
-    int stride[4];
+    avcodec_get_frame_defaults( &frame );
+    codec->reordered_opaque = packet->arrival_time;
 
-    int16_t *audio_buffer;
-    int audio_size;
+    /* An exhausted frame pool fails the decode as well, the pool counts the drop */
+    if( avcodec_decode_video2( codec, &frame, &finished, &packet->pkt ) < 0 )
+    {
+        syslog( LOG_WARNING, "[lavf] Could not decode video frame\n" );
+        return 0;
+    }
 
-    AVFormatContext *lavf;
-    AVCodecContext *codec;
-    AVCodec *dec;
-    AVPacket pkt;
+    if( !finished )
+        return 0;
+
+    pts = frame.pkt_pts != AV_NOPTS_VALUE ? frame.pkt_pts : frame.pkt_dts;
+    if( pts != AV_NOPTS_VALUE )
+        stream->next_pts = pts;
+
+    raw_frame = new_raw_frame();
+    if( !raw_frame )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    raw_frame->stream_id = stream->input_stream_id;
+    raw_frame->arrival_time = frame.reordered_opaque;
+
+    /* The picture stays in the pool buffer the decoder wrote it to */
+    raw_frame->frame_buf = frame.opaque;
+    obe_frame_buf_ref( raw_frame->frame_buf );
+    raw_frame->release_data = obe_release_pooled_video_data;
+    raw_frame->release_frame = obe_release_frame;
+
+    raw_frame->alloc_img.csp = codec->pix_fmt == PIX_FMT_YUVJ420P ? PIX_FMT_YUV420P : codec->pix_fmt;
+    raw_frame->alloc_img.planes = av_pix_fmt_descriptors[codec->pix_fmt].nb_components;
+    raw_frame->alloc_img.width = codec->width;
+    raw_frame->alloc_img.height = codec->height;
+    memcpy( raw_frame->alloc_img.stride, frame.linesize, sizeof(raw_frame->alloc_img.stride) );
+    memcpy( raw_frame->alloc_img.plane, frame.data, sizeof(raw_frame->alloc_img.plane) );
+    memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(raw_frame->alloc_img) );
+    /* Not SDI, so none of the SD line handling applies */
+    raw_frame->img.format = -1;
+
+    raw_frame->timebase_num = stream->input_stream->timebase_num;
+    raw_frame->timebase_den = stream->input_stream->timebase_den;
+    raw_frame->sar_width  = frame.sample_aspect_ratio.num ? frame.sample_aspect_ratio.num : 1;
+    raw_frame->sar_height = frame.sample_aspect_ratio.den ? frame.sample_aspect_ratio.den : 1;
+
+    raw_frame->pts = stream->next_pts;
+    stream->next_pts += av_rescale( OBE_CLOCK, raw_frame->timebase_num, raw_frame->timebase_den );
+
+    /* TODO: ancillary data */
+    if( add_to_filter_queue( lavf_ctx->h, raw_frame ) < 0 )
+    {
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
+    }
+
+    return 0;
+}
+
+static int decode_audio( lavf_ctx_t *lavf_ctx, lavf_stream_t *stream, lavf_packet_t *packet )
+{
+    AVCodecContext *codec = stream->codec;
+    AVPacket pkt = packet->pkt;
+    obe_raw_frame_t *raw_frame;
     AVFrame frame;
+    int finished, ret, bps;
 
-    av_register_all();
-    av_log_set_level( AV_LOG_QUIET );
+    if( pkt.pts != AV_NOPTS_VALUE )
+        stream->next_pts = pkt.pts;
 
-    status.lavf = &lavf;
+    while( pkt.size > 0 )
+    {
+        avcodec_get_frame_defaults( &frame );
+        finished = 0;
 
-    pthread_cleanup_push( close_input, (void*)&status );
+        ret = avcodec_decode_audio4( codec, &frame, &finished, &pkt );
+        if( ret < 0 )
+        {
+            syslog( LOG_WARNING, "[lavf] Could not decode audio frame\n" );
+            return 0;
+        }
+        pkt.data += ret;
+        pkt.size -= ret;
 
-    if( av_open_input_file( &lavf, device->location, NULL, 0, NULL ) < 0 )
-        return (void*)-1;
+        if( !finished )
+            continue;
 
-    if( av_find_stream_info( lavf ) < 0 )
-        return (void*)-1;
+        raw_frame = new_raw_frame();
+        if( !raw_frame )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return -1;
+        }
 
-    status.status = 1;
+        bps = av_get_bytes_per_sample( codec->sample_fmt );
+        raw_frame->stream_id = stream->encode_stream->stream_id;
+        raw_frame->num_samples = frame.nb_samples;
+        raw_frame->sample_fmt = av_get_packed_sample_fmt( codec->sample_fmt );
+        raw_frame->channel_layout = stream->input_stream->channel_layout;
+        raw_frame->len = raw_frame->bytes_left = frame.nb_samples * codec->channels * bps;
+        raw_frame->data = av_malloc( raw_frame->len );
+        if( !raw_frame->data )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            free( raw_frame );
+            return -1;
+        }
+        raw_frame->cur_pos = raw_frame->data;
+        interleave_audio( raw_frame->data, frame.extended_data, av_sample_fmt_is_planar( codec->sample_fmt ),
+                          codec->channels, frame.nb_samples, bps );
 
-    stream_lut = calloc( (input->num_output_streams+1), sizeof(lavf_stream_lut) );
-    if( !stream_lut )
-        return (void*)-1;
+        raw_frame->release_data = obe_release_other_data;
+        raw_frame->release_frame = obe_release_frame;
+        raw_frame->arrival_time = packet->arrival_time;
+        raw_frame->pts = stream->next_pts;
+        stream->next_pts += av_rescale( frame.nb_samples, OBE_CLOCK, codec->sample_rate );
 
-    pthread_mutex_lock( &device->device_mutex );
-    for( int i = 0; i < input->num_output_streams; i++ )
+        if( add_to_encode_queue( lavf_ctx->h, raw_frame ) < 0 )
+        {
+            raw_frame->release_data( raw_frame );
+            raw_frame->release_frame( raw_frame );
+        }
+    }
+
+    return 0;
+}
+
+static int passthrough_packet( lavf_ctx_t *lavf_ctx, lavf_stream_t *stream, obe_output_stream_t *output_stream,
+                               lavf_packet_t *packet )
+{
+    AVPacket *pkt = &packet->pkt;
+    int is_dvb_sub = stream->input_stream->stream_format == SUBTITLES_DVB;
+    obe_coded_frame_t *coded_frame;
+
+    coded_frame = new_pooled_coded_frame( lavf_ctx->h, output_stream->stream_id, pkt->size + ( is_dvb_sub ? 3 : 0 ) );
+    if( !coded_frame )
     {
-        for( int j = 0; j < device->num_input_streams; j++ )
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    /* FFmpeg removes the DVB subtitle header */
+    if( is_dvb_sub )
+    {
+        coded_frame->data[0] = 0x20;
+        coded_frame->data[1] = 0x00;
+        memcpy( coded_frame->data+2, pkt->data, pkt->size );
+        coded_frame->data[pkt->size+2] = 0xff;
+    }
+    else
+        memcpy( coded_frame->data, pkt->data, pkt->size );
+
+    coded_frame->pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : stream->next_pts;
+    coded_frame->random_access = 1;
+    coded_frame->arrival_time = packet->arrival_time;
+
+    if( stream->input_stream->stream_type == STREAM_TYPE_VIDEO )
+    {
+        /* The mux schedules video by its T-STD times. Without the source's HRD parameters the best
+         * that can be done is to deliver each picture over the time it took to arrive here */
+        coded_frame->is_video = 1;
+        coded_frame->real_pts = coded_frame->pts;
+        coded_frame->real_dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : coded_frame->pts;
+        coded_frame->cpb_final_arrival_time = MIN( packet->clock_time, coded_frame->real_dts );
+        coded_frame->cpb_initial_arrival_time = stream->last_arrival >= 0 ?
+                                                MIN( stream->last_arrival, coded_frame->cpb_final_arrival_time ) :
+                                                coded_frame->cpb_final_arrival_time;
+        stream->last_arrival = coded_frame->cpb_final_arrival_time;
+        coded_frame->random_access = !!( pkt->flags & AV_PKT_FLAG_KEY );
+        coded_frame->priority = coded_frame->random_access;
+    }
+
+    if( add_to_mux_queue( lavf_ctx->h, coded_frame ) < 0 )
+        destroy_coded_frame( coded_frame );
+
+    return 0;
+}
+
+static void *decode_thread( void *ptr )
+{
+    lavf_ctx_t *lavf_ctx = ptr;
+    lavf_packet_t *packet;
+    lavf_stream_t *stream;
+    int stop;
+
+    while( 1 )
+    {
+        packet = obe_queue_pop( &lavf_ctx->packet_queue );
+        if( !packet )
         {
-            if( device->streams[j]->stream_id == input->output_streams[i].stream_id )
+            stop = __atomic_load_n( &lavf_ctx->stop, __ATOMIC_ACQUIRE );
+            if( stop )
             {
-                stream_lut[i].stream_id = device->streams[j]->stream_id;
-                stream_lut[i].lavf_stream_idx = device->streams[j]->lavf_stream_idx;
+                /* Check the queue once more in case the last packets came in with the stop */
+                packet = stop == LAVF_STOP_DRAIN ? obe_queue_pop( &lavf_ctx->packet_queue ) : NULL;
+                if( !packet )
+                    break;
             }
+            else
+            {
+                obe_queue_wait( &lavf_ctx->packet_queue, &lavf_ctx->stop );
+                continue;
+            }
+        }
+
+        if( __atomic_load_n( &lavf_ctx->stop, __ATOMIC_ACQUIRE ) == LAVF_STOP_NOW )
+        {
+            obe_free_packet( &packet->pkt );
+            break;
         }
+
+        stream = &lavf_ctx->streams[packet->pkt.stream_index];
+
+        for( int i = 0; i < stream->num_passthrough; i++ )
+            passthrough_packet( lavf_ctx, stream, stream->passthrough[i], packet );
+
+        if( stream->codec && stream->codec->codec_type == AVMEDIA_TYPE_VIDEO )
+            decode_video( lavf_ctx, stream, packet );
+        else if( stream->codec )
+            decode_audio( lavf_ctx, stream, packet );
+
+        obe_free_packet( &packet->pkt );
+        obe_queue_push( &lavf_ctx->free_queue, packet );
     }
-    pthread_mutex_unlock( &device->device_mutex );
 
-    stream_lut[input->num_output_streams].stream_id = stream_lut[input->num_output_streams].lavf_stream_idx = -1;
+    return NULL;
+}
+
+static void stop_decode_thread( lavf_ctx_t *lavf_ctx, int stop )
+{
+    if( !lavf_ctx->decode_thread_running )
+        return;
 
-    /* We assume the lavf stream_index will be the same along with all the metadata */
+    __atomic_store_n( &lavf_ctx->stop, stop, __ATOMIC_RELEASE );
+    obe_queue_wake( &lavf_ctx->packet_queue );
+    pthread_join( lavf_ctx->decode_thread, NULL );
+    lavf_ctx->decode_thread_running = 0;
+}
 
-    /* Loop through streams and open decoder if necessary */
-    for( int i = 0; i < input->num_output_streams; i++ )
+static void close_input( void *ptr )
+{
+    lavf_ctx_t *lavf_ctx = ptr;
+
+    stop_decode_thread( lavf_ctx, LAVF_STOP_NOW );
+
+    /* Includes any packet the demuxer was reading into when it was cancelled */
+    for( int i = 0; i < LAVF_NUM_PACKETS; i++ )
+        av_free_packet( &lavf_ctx->packets[i].pkt );
+
+    /* The decoders give their pictures back to the pools here */
+    for( int i = 0; i < lavf_ctx->num_streams; i++ )
     {
-        if( input->output_streams[i].stream_action == STREAM_ENCODE )
+        if( lavf_ctx->streams[i].codec )
         {
-            out_lut = find_lavf_stream_idx( stream_lut, input->output_streams[i].stream_id );
-            // TODO check fail
-            codec = lavf->streams[out_lut->lavf_stream_idx]->codec;
-            dec = avcodec_find_decoder( codec->codec_id );
+            avcodec_close( lavf_ctx->streams[i].codec );
+            av_freep( &lavf_ctx->streams[i].codec );
+        }
+    }
 
-            if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
-            {
-#if 0
-                codec->get_buffer = obe_get_buffer;
-                codec->release_buffer = obe_release_buffer;
-                codec->reget_buffer = obe_reget_buffer;
-#endif
-                codec->flags |= CODEC_FLAG_EMU_EDGE;
-            }
+    if( lavf_ctx->lavf )
+        avformat_close_input( &lavf_ctx->lavf );
 
-            if( avcodec_open( codec, dec ) < 0 )
-                return NULL; // TODO cleanup
+    if( lavf_ctx->pb )
+    {
+        av_freep( &lavf_ctx->pb->buffer );
+        av_freep( &lavf_ctx->pb );
+    }
 
-            /* Wait for encoder to be ready */
-            encoder = get_encoder( h, input->output_streams[i].stream_id );
-            pthread_mutex_lock( &encoder->encoder_mutex );
-            if( !encoder->is_ready )
-                pthread_cond_wait( &encoder->encoder_cv, &encoder->encoder_mutex );
-            pthread_mutex_unlock( &encoder->encoder_mutex );
-        }
+    if( lavf_ctx->clock.io )
+        avio_close( lavf_ctx->clock.io );
+
+    obe_queue_destroy( &lavf_ctx->packet_queue );
+    obe_queue_destroy( &lavf_ctx->free_queue );
+
+    if( lavf_ctx->streams )
+        free( lavf_ctx->streams );
+
+    free( lavf_ctx );
+}
+
+static int open_decoder( lavf_ctx_t *lavf_ctx, lavf_stream_t *stream, AVStream *av_stream )
+{
+    AVCodec *dec = avcodec_find_decoder( av_stream->codec->codec_id );
+    AVCodecContext *codec;
+
+    if( !dec )
+        return -1;
+
+    /* The demuxer keeps using the stream's context so the decoder needs its own */
+    codec = stream->codec = avcodec_alloc_context3( dec );
+    if( !codec || avcodec_copy_context( codec, av_stream->codec ) < 0 )
+        return -1;
+
+    if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
+    {
+        long num_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+        codec->opaque = lavf_ctx->device;
+        codec->get_buffer = lavf_get_buffer;
+        codec->release_buffer = lavf_release_buffer;
+        codec->reget_buffer = obe_reget_buffer;
+        codec->flags |= CODEC_FLAG_EMU_EDGE;
+
+        /* Frame threading adds a frame of delay per thread so low latency mode only uses slices */
+        codec->thread_count = MIN( MAX( num_cpus, 1 ), LAVF_MAX_THREADS );
+        codec->thread_type = lavf_ctx->h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? FF_THREAD_SLICE :
+                             FF_THREAD_FRAME | FF_THREAD_SLICE;
+        /* The pools have their own locking */
+        codec->thread_safe_callbacks = 1;
+
+        /* Room for the pictures the decoder holds on to */
+        lavf_ctx->device->frame_pool_size += LAVF_DECODER_FRAMES + codec->thread_count;
     }
 
-    av_init_packet( &pkt );
+    if( avcodec_open2( codec, dec, NULL ) < 0 )
+    {
+        fprintf( stderr, "[lavf] Could not open decoder\n" );
+        return -1;
+    }
 
-    while( 1 )
+    return 0;
+}
+
+static void *open_input( void *ptr )
+{
+    obe_input_params_t *input = ptr;
+    obe_t *h = input->h;
+    obe_device_t *device = input->device;
+    lavf_ctx_t *lavf_ctx;
+    lavf_packet_t *packet;
+    lavf_stream_t *stream;
+    uint8_t *io_buf;
+    int ret;
+
+    av_register_all();
+    avformat_network_init();
+    av_log_set_level( AV_LOG_QUIET );
+
+    lavf_ctx = calloc( 1, sizeof(*lavf_ctx) );
+    if( !lavf_ctx )
     {
-        int finished = 0;
-        int ret = 0;
+        fprintf( stderr, "Malloc failed\n" );
+        free( input );
+        return NULL;
+    }
 
-        ret = av_read_frame( lavf, &pkt );
-        if( ret < 0 )
-            break;
-        codec = lavf->streams[pkt.stream_index]->codec;
-        out_lut = find_stream_id( stream_lut, pkt.stream_index );
+    lavf_ctx->h = h;
+    lavf_ctx->device = device;
+    lavf_ctx->video_idx = -1;
+    lavf_ctx->clock.h = h;
+    lavf_ctx->clock.pcr_pid = -1;
+    lavf_ctx->clock.drives_clock = device == h->devices[0];
 
-        /* TODO: handle wraparound */
+    pthread_cleanup_push( close_input, (void*)lavf_ctx );
 
-        if( out_lut->stream_id != -1 )
+    if( avio_open2( &lavf_ctx->clock.io, device->location, AVIO_FLAG_READ, NULL, NULL ) < 0 )
+    {
+        fprintf( stderr, "[lavf] Could not open %s\n", device->location );
+        goto end;
+    }
+
+    io_buf = av_malloc( LAVF_IO_BUFFER_SIZE );
+    if( !io_buf )
+        goto end;
+
+    lavf_ctx->pb = avio_alloc_context( io_buf, LAVF_IO_BUFFER_SIZE, 0, &lavf_ctx->clock, io_read, NULL, io_seek );
+    if( !lavf_ctx->pb )
+    {
+        av_free( io_buf );
+        goto end;
+    }
+    lavf_ctx->pb->seekable = lavf_ctx->clock.io->seekable;
+    lavf_ctx->clock.pace = lavf_ctx->clock.io->seekable;
+
+    if( open_lavf( &lavf_ctx->lavf, device->location, lavf_ctx->pb ) < 0 )
+        goto end;
+
+    lavf_ctx->num_streams = lavf_ctx->lavf->nb_streams;
+    lavf_ctx->streams = calloc( lavf_ctx->num_streams, sizeof(*lavf_ctx->streams) );
+    if( !lavf_ctx->streams )
+        goto end;
+
+    /* We assume the lavf stream_index will be the same along with all the metadata */
+    for( int i = 0; i < input->num_output_streams; i++ )
+    {
+        obe_output_stream_t *output_stream = &input->output_streams[i];
+        obe_int_input_stream_t *input_stream = NULL;
+        AVStream *av_stream;
+
+        for( int j = 0; j < device->num_input_streams; j++ )
         {
-            cur_stream = get_stream( input, out_lut->stream_id );
-            if( !cur_stream )
-                continue; /* shouldn't happen */
-            if( cur_stream->stream_action == STREAM_PASSTHROUGH )
+            if( device->streams[j]->stream_id == output_stream->input_stream_id )
+                input_stream = device->streams[j];
+        }
+
+        if( !input_stream || input_stream->lavf_stream_idx >= lavf_ctx->num_streams )
+            continue;
+
+        av_stream = lavf_ctx->lavf->streams[input_stream->lavf_stream_idx];
+        stream = &lavf_ctx->streams[input_stream->lavf_stream_idx];
+        if( !stream->input_stream )
+        {
+            stream->input_stream_id = input_stream->stream_id;
+            stream->input_stream = input_stream;
+            stream->time_base = av_stream->time_base;
+            stream->last_arrival = -1;
+        }
+
+        if( output_stream->stream_action == STREAM_PASSTHROUGH )
+        {
+            /* The mux writes an Annex B byte stream, MP4-style AVC would need converting first */
+            if( input_stream->stream_format == VIDEO_AVC && av_stream->codec->extradata_size &&
+                av_stream->codec->extradata[0] == 1 )
             {
-                /* FFmpeg removes the DVB subtitle header */
-                if( codec->codec_id == CODEC_ID_DVB_SUBTITLE )
-                {
-                    coded_frame = new_coded_frame( out_lut->stream_id, pkt.size+3 );
-                    coded_frame->data[0] = 0x20;
-                    coded_frame->data[1] = 0x00;
-                    memcpy( coded_frame->data+2, pkt.data, pkt.size );
-                    coded_frame->data[pkt.size+2] = 0xff;
-                }
-                else
-                {
-                    coded_frame = new_coded_frame( out_lut->stream_id, pkt.size );
-                    if( !coded_frame )
-                    {
-                        syslog( LOG_ERR, "Malloc failed\n" );
-                        obe_free_packet( &pkt );
-                        break;
-                    }
-                    memcpy( coded_frame->data, pkt.data, pkt.size );
-                }
-                coded_frame->stream_id = out_lut->stream_id;
-                coded_frame->pts = pkt.pts;
-                add_to_mux_queue( h, coded_frame );
+                fprintf( stderr, "[lavf] AVC passthrough needs an Annex B input\n" );
+                goto end;
             }
-            else
-            {
-                if( codec->codec_type == AVMEDIA_TYPE_VIDEO )
-                {
-                    avcodec_get_frame_defaults( &frame );
-                    codec->reordered_opaque = pkt.pts;
 
-                    ret = avcodec_decode_video2( codec, &frame, &finished, &pkt );
-                    // TODO: handle failure
-                    if( finished )
-                    {
-                        raw_frame = new_raw_frame();
-                        if( !raw_frame )
-                        {
-                            syslog( LOG_ERR, "Malloc failed\n" );
-                            obe_free_packet( &pkt );
-                            break;
-                        }
-                        raw_frame->stream_id = out_lut->stream_id;
-                        raw_frame->alloc_img.csp = codec->pix_fmt;
+            stream->passthrough[stream->num_passthrough++] = output_stream;
+        }
+        /* Raw video goes to the filter which feeds every encode of it */
+        else if( !stream->codec )
+        {
+            stream->encode_stream = output_stream;
+            if( open_decoder( lavf_ctx, stream, av_stream ) < 0 )
+                goto end;
+        }
 
-                        /* full_range_flag is almost always wrong so ignore it */
-                        if( raw_frame->alloc_img.csp == PIX_FMT_YUVJ420P )
-                            raw_frame->alloc_img.csp = PIX_FMT_YUV420P;
+        if( input_stream->stream_type == STREAM_TYPE_VIDEO && lavf_ctx->video_idx < 0 )
+            lavf_ctx->video_idx = input_stream->lavf_stream_idx;
+    }
 
-                        raw_frame->alloc_img.width = width = codec->width;
-                        raw_frame->alloc_img.height = height = codec->height;
+    free( input );
+    input = NULL;
 
-                        /* FIXME: get rid of this ugly memcpy */
-                        avcodec_align_dimensions2( codec, &width, &height, stride );
-                        if( av_image_alloc( raw_frame->alloc_img.plane, raw_frame->alloc_img.stride, width, height, raw_frame->alloc_img.csp, 16 ) < 0 )
-                        {
-                            syslog( LOG_ERR, "Malloc failed\n" );
-                            obe_free_packet( &pkt );
-                            break;
-                        }
-                        av_image_copy( raw_frame->alloc_img.plane, raw_frame->alloc_img.stride, (const uint8_t**)&frame.data,
-                                       frame.linesize, codec->pix_fmt, width, height );
+    if( obe_queue_init( &lavf_ctx->packet_queue, "lavf", LAVF_NUM_PACKETS, 1 ) < 0 ||
+        obe_queue_init( &lavf_ctx->free_queue, "lavf free", LAVF_NUM_PACKETS, 1 ) < 0 )
+        goto end;
+
+    for( int i = 0; i < LAVF_NUM_PACKETS; i++ )
+    {
+        av_init_packet( &lavf_ctx->packets[i].pkt );
+        obe_queue_push( &lavf_ctx->free_queue, &lavf_ctx->packets[i] );
+    }
 
-                        memcpy( &raw_frame->img, &raw_frame->alloc_img, sizeof(raw_frame->alloc_img) );
+    if( pthread_create( &lavf_ctx->decode_thread, NULL, decode_thread, lavf_ctx ) < 0 )
+    {
+        fprintf( stderr, "[lavf] Couldn't create decode thread\n" );
+        goto end;
+    }
+    lavf_ctx->decode_thread_running = 1;
+
+    while( 1 )
+    {
+        packet = lavf_ctx->spare;
+        lavf_ctx->spare = NULL;
+        while( !packet && !( packet = obe_queue_pop( &lavf_ctx->free_queue ) ) )
+        {
+            obe_queue_wait( &lavf_ctx->free_queue, &lavf_ctx->stop );
+            pthread_testcancel();
+        }
 
-                        raw_frame->release_data = obe_release_video_data;
-                        raw_frame->release_frame = obe_release_frame;
+        ret = av_read_frame( lavf_ctx->lavf, &packet->pkt );
+        if( ret < 0 )
+            break;
 
-                        raw_frame->pts = 0;
-                        if( codec->has_b_frames && frame.reordered_opaque != AV_NOPTS_VALUE )
-                            raw_frame->pts = frame.reordered_opaque;
-                        else if( pkt.dts != AV_NOPTS_VALUE )
-                            raw_frame->pts = pkt.dts;
+        packet->arrival_time = obe_mdate();
 
-                        raw_frame->pts *= 300; // FIXME hack
+        if( packet->pkt.stream_index >= lavf_ctx->num_streams || !lavf_ctx->streams[packet->pkt.stream_index].input_stream )
+        {
+            obe_free_packet( &packet->pkt );
+            lavf_ctx->spare = packet;
+            continue;
+        }
 
-                        add_to_filter_queue( h, raw_frame );
+        stream = &lavf_ctx->streams[packet->pkt.stream_index];
 
-                        /* TODO: ancillary data */
-                        /* TODO: SAR changes */
-                    }
-                }
-                else if( codec->codec_type == AVMEDIA_TYPE_AUDIO )
-                {
-                    /* TODO: find out if there are any odd streams with multiple frames per AVPacket */
-                    audio_size = AUDIO_BUFFER_SIZE;
-                    audio_buffer = av_malloc( audio_size * sizeof(int16_t) );
-                    // TODO fail
-                    if( avcodec_decode_audio3( codec, audio_buffer, &audio_size, &pkt ) < 0 )
-                    {
-                        syslog( LOG_ERR, "[lavf] decoding audio failed\n" );
-                        av_freep( &audio_buffer );
-                        break;
-                    }
+        if( packet->pkt.pts != AV_NOPTS_VALUE )
+            packet->pkt.pts = av_rescale_q( packet->pkt.pts, stream->time_base, (AVRational){1, OBE_CLOCK} );
+        if( packet->pkt.dts != AV_NOPTS_VALUE )
+            packet->pkt.dts = av_rescale_q( packet->pkt.dts, stream->time_base, (AVRational){1, OBE_CLOCK} );
 
-                    raw_frame = new_raw_frame();
-                    if( !raw_frame )
-                    {
-                        syslog( LOG_ERR, "Malloc failed\n" );
-                        av_freep( &audio_buffer );
-                        break;
-                    }
-                    raw_frame->stream_id = out_lut->stream_id;
-
-                    raw_frame->len = audio_size;
-                    raw_frame->data = raw_frame->cur_pos = (uint8_t*)audio_buffer;
-                    raw_frame->num_samples = audio_size / ( codec->channels * sizeof(int16_t) ); // FIXME
-                    raw_frame->sample_fmt = codec->sample_fmt;
-                    raw_frame->channel_layout = codec->channel_layout;
-                    raw_frame->release_data = obe_release_other_data;
-                    raw_frame->release_frame = obe_release_frame;
-                    raw_frame->pts = -1;
-                    if( pkt.pts != AV_NOPTS_VALUE )
-                        raw_frame->pts = pkt.pts;
-
-                    add_to_encode_queue( h, raw_frame );
-                }
+        if( packet->pkt.stream_index == lavf_ctx->video_idx )
+        {
+            /* Without a PCR the video DTS is the clock */
+            if( lavf_ctx->clock.pcr_pid == -1 && packet->pkt.dts != AV_NOPTS_VALUE )
+                clock_reference( &lavf_ctx->clock, packet->pkt.dts, 0 );
 
-                obe_free_packet( &pkt );
-            }
+            obe_input_frame_arrived( device, packet->arrival_time, lavf_ctx->clock.discontinuity );
+            lavf_ctx->clock.discontinuity = 0;
         }
 
-        obe_free_packet( &pkt );
-    }
+        if( packet->pkt.pts != AV_NOPTS_VALUE )
+            packet->pkt.pts = unwrap_ts( &lavf_ctx->clock, packet->pkt.pts );
+        if( packet->pkt.dts != AV_NOPTS_VALUE )
+            packet->pkt.dts = unwrap_ts( &lavf_ctx->clock, packet->pkt.dts );
+        packet->clock_time = get_wallclock_in_mpeg_ticks() + lavf_ctx->clock.offset;
 
-    for( int i = 0; i < input->num_output_streams; i++ )
-    {
-        out_lut = find_lavf_stream_idx( stream_lut, input->output_streams[i].stream_id );
-        codec = lavf->streams[out_lut->lavf_stream_idx]->codec;
+        if( lavf_ctx->clock.pace && lavf_ctx->clock.have_ref )
+            sleep_mpeg_ticks( lavf_ctx->clock.pace_time + lavf_ctx->clock.last_ref - lavf_ctx->clock.pace_ref );
 
-        if( codec )
-            avcodec_close( codec );
+        if( obe_queue_push( &lavf_ctx->packet_queue, packet ) < 0 )
+        {
+            /* Can't happen, there are only as many packets as the queue holds */
+            obe_free_packet( &packet->pkt );
+            lavf_ctx->spare = packet;
+        }
     }
 
+    syslog( LOG_INFO, "[lavf] End of input\n" );
+    stop_decode_thread( lavf_ctx, LAVF_STOP_DRAIN );
+
+end:
+    if( input )
+        free( input );
+
     pthread_cleanup_pop( 1 );
 
     return NULL;
@@ -0,0 +1,361 @@
+/*****************************************************************************
+ * probe_cache.c : saved probe results
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <stddef.h>
+#include <unistd.h>
+#include "common/common.h"
+#include "input/input.h"
+
+/* The file is plain text so it can be looked at and deleted by hand:
+ *
+ * obe-probe <version> <input_type> <card_idx> <video_format> <video_connection> <audio_connection> <ttx_location> <wss_output>
+ * stream
+ * <field> <value>
+ * frame_data <type> <source> <num_lines> <lines...>
+ * end
+ *
+ * The first line is the key. Anything that changes what a probe finds is part of it,
+ * so a cache written for a different card, port or format is never used */
+
+#define PROBE_CACHE_VERSION 1
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} stream_fields[] =
+{
+#define FIELD(x) { #x, offsetof( obe_int_input_stream_t, x ) }
+    FIELD( stream_type ),
+    FIELD( stream_format ),
+    FIELD( transport_timebase_num ),
+    FIELD( transport_timebase_den ),
+    FIELD( timebase_num ),
+    FIELD( timebase_den ),
+    FIELD( audio_type ),
+    FIELD( csp ),
+    FIELD( width ),
+    FIELD( height ),
+    FIELD( sar_num ),
+    FIELD( sar_den ),
+    FIELD( interlaced ),
+    FIELD( tff ),
+    FIELD( profile ),
+    FIELD( level ),
+    FIELD( sample_rate ),
+    FIELD( sample_format ),
+    FIELD( bitrate ),
+    FIELD( is_337m ),
+    FIELD( aac_profile_and_level ),
+    FIELD( aac_type ),
+    FIELD( is_latm ),
+    FIELD( has_dds ),
+    FIELD( dvb_subtitling_type ),
+    FIELD( composition_page_id ),
+    FIELD( ancillary_page_id ),
+    FIELD( dvb_teletext_type ),
+    FIELD( dvb_teletext_magazine_number ),
+    FIELD( dvb_teletext_page_number ),
+    FIELD( vbi_ntsc ),
+    FIELD( source ),
+#undef FIELD
+    { NULL, 0 }
+};
+
+#define STREAM_FIELD(stream, i) ((int*)((uint8_t*)(stream) + stream_fields[i].offset))
+
+static int cache_supported( const obe_input_t *user_opts )
+{
+    return user_opts->input_type == INPUT_DEVICE_DECKLINK || user_opts->input_type == INPUT_DEVICE_LINSYS_SDI;
+}
+
+static void get_key( char *key, int size, const obe_input_t *user_opts )
+{
+    snprintf( key, size, "obe-probe %i %i %i %i %i %i %i %i\n", PROBE_CACHE_VERSION, user_opts->input_type, user_opts->card_idx,
+              user_opts->video_format, user_opts->video_connection, user_opts->audio_connection,
+              user_opts->teletext_location, user_opts->wss_output );
+}
+
+static void free_streams( obe_int_input_stream_t **streams, int num_streams )
+{
+    for( int i = 0; i < num_streams; i++ )
+    {
+        free( streams[i]->frame_data );
+        free( streams[i] );
+    }
+}
+
+static int parse_frame_data( obe_int_input_stream_t *stream, char *line )
+{
+    obe_frame_data_t *frame_data, *tmp;
+    char *end;
+    int pos;
+
+    tmp = realloc( stream->frame_data, ( stream->num_frame_data + 1 ) * sizeof(*stream->frame_data) );
+    if( !tmp )
+        return -1;
+    stream->frame_data = tmp;
+    frame_data = &stream->frame_data[stream->num_frame_data];
+    memset( frame_data, 0, sizeof(*frame_data) );
+
+    if( sscanf( line, "frame_data %i %i %i%n", &frame_data->type, &frame_data->source, &frame_data->num_lines, &pos ) < 3 ||
+        frame_data->num_lines < 0 || frame_data->num_lines > (int)( sizeof(frame_data->lines) / sizeof(frame_data->lines[0]) ) )
+        return -1;
+
+    line += pos;
+    for( int i = 0; i < frame_data->num_lines; i++ )
+    {
+        frame_data->lines[i] = strtol( line, &end, 10 );
+        if( end == line )
+            return -1;
+        line = end;
+    }
+
+    stream->num_frame_data++;
+
+    return 0;
+}
+
+int obe_probe_cache_load( obe_t *h, const obe_input_t *user_opts )
+{
+    obe_int_input_stream_t *streams[MAX_STREAMS];
+    obe_int_input_stream_t *stream = NULL;
+    obe_device_t *device;
+    char line[1024], key[256];
+    int num_streams = 0;
+    int complete = 0;
+    FILE *fp;
+
+    if( !user_opts->probe_cache || !cache_supported( user_opts ) )
+        return -1;
+
+    fp = fopen( user_opts->probe_cache, "r" );
+    if( !fp )
+        return -1;
+
+    /* The key is compared as a string so it doesn't need a parser of its own */
+    get_key( key, sizeof(key), user_opts );
+    if( !fgets( line, sizeof(line), fp ) || strcmp( line, key ) )
+    {
+        fprintf( stderr, "Probe cache \"%s\" is for a different input, probing \n", user_opts->probe_cache );
+        goto fail;
+    }
+
+    while( fgets( line, sizeof(line), fp ) )
+    {
+        char name[64];
+        int value;
+
+        if( !strcmp( line, "stream\n" ) )
+        {
+            if( num_streams == MAX_STREAMS )
+                goto fail;
+            stream = streams[num_streams] = calloc( 1, sizeof(*stream) );
+            if( !stream )
+                goto fail;
+            num_streams++;
+        }
+        else if( !strcmp( line, "end\n" ) )
+        {
+            complete = 1;
+            break;
+        }
+        else if( !stream )
+            goto fail;
+        else if( !strncmp( line, "frame_data ", 11 ) )
+        {
+            if( parse_frame_data( stream, line ) < 0 )
+                goto fail;
+        }
+        else if( sscanf( line, "channel_layout %"SCNi64, &stream->channel_layout ) == 1 )
+            ;
+        else if( sscanf( line, "lang_code %3s", stream->lang_code ) == 1 )
+            ;
+        else if( sscanf( line, "%63s %i", name, &value ) == 2 )
+        {
+            int i;
+            for( i = 0; stream_fields[i].name; i++ )
+            {
+                if( !strcmp( name, stream_fields[i].name ) )
+                {
+                    *STREAM_FIELD( stream, i ) = value;
+                    break;
+                }
+            }
+            if( !stream_fields[i].name )
+                goto fail;
+        }
+        else
+            goto fail;
+    }
+
+    /* A probe always finds at least the video stream */
+    if( !complete || !num_streams )
+    {
+        fprintf( stderr, "Probe cache \"%s\" is damaged, probing \n", user_opts->probe_cache );
+        goto fail;
+    }
+
+    fclose( fp );
+    fp = NULL;
+
+    device = new_device();
+    if( !device )
+        goto fail;
+
+    pthread_mutex_lock( &h->device_list_mutex );
+    for( int i = 0; i < num_streams; i++ )
+    {
+        streams[i]->stream_id = h->cur_stream_id++;
+        /* Checked against the first captured frame */
+        if( streams[i]->stream_type == STREAM_TYPE_VIDEO )
+        {
+            streams[i]->probe_cache_check = 1;
+            h->probe_cache_pending++;
+        }
+    }
+    pthread_mutex_unlock( &h->device_list_mutex );
+
+    device->num_input_streams = num_streams;
+    memcpy( device->streams, streams, num_streams * sizeof(*streams) );
+    device->device_type = user_opts->input_type;
+    memcpy( &device->user_opts, user_opts, sizeof(*user_opts) );
+
+    add_device( h, device );
+
+    return 0;
+
+fail:
+    if( fp )
+        fclose( fp );
+    free_streams( streams, num_streams );
+
+    return -1;
+}
+
+int obe_probe_cache_save( const obe_device_t *device )
+{
+    const obe_input_t *user_opts = &device->user_opts;
+    char key[256];
+    char *tmp_name;
+    FILE *fp;
+
+    if( !user_opts->probe_cache || !cache_supported( user_opts ) )
+        return 0;
+
+    /* Written next to the cache and renamed so a crash mid-write can't leave half a file */
+    tmp_name = malloc( strlen( user_opts->probe_cache ) + 5 );
+    if( !tmp_name )
+    {
+        fprintf( stderr, "Malloc failed \n" );
+        return -1;
+    }
+    sprintf( tmp_name, "%s.tmp", user_opts->probe_cache );
+
+    fp = fopen( tmp_name, "w" );
+    if( !fp )
+    {
+        fprintf( stderr, "Could not open probe cache \"%s\" \n", tmp_name );
+        free( tmp_name );
+        return -1;
+    }
+
+    get_key( key, sizeof(key), user_opts );
+    fputs( key, fp );
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        const obe_int_input_stream_t *stream = device->streams[i];
+
+        fprintf( fp, "stream\n" );
+        for( int j = 0; stream_fields[j].name; j++ )
+            fprintf( fp, "%s %i\n", stream_fields[j].name, *STREAM_FIELD( stream, j ) );
+        fprintf( fp, "channel_layout %"PRIi64"\n", stream->channel_layout );
+        if( stream->lang_code[0] )
+            fprintf( fp, "lang_code %.3s\n", stream->lang_code );
+
+        for( int j = 0; j < stream->num_frame_data; j++ )
+        {
+            const obe_frame_data_t *frame_data = &stream->frame_data[j];
+
+            fprintf( fp, "frame_data %i %i %i", frame_data->type, frame_data->source, frame_data->num_lines );
+            for( int k = 0; k < frame_data->num_lines; k++ )
+                fprintf( fp, " %i", frame_data->lines[k] );
+            fprintf( fp, "\n" );
+        }
+    }
+    fprintf( fp, "end\n" );
+
+    if( fclose( fp ) || rename( tmp_name, user_opts->probe_cache ) < 0 )
+    {
+        fprintf( stderr, "Could not write probe cache \"%s\" \n", user_opts->probe_cache );
+        unlink( tmp_name );
+        free( tmp_name );
+        return -1;
+    }
+
+    free( tmp_name );
+
+    return 0;
+}
+
+int obe_probe_cache_check( obe_t *h, const obe_raw_frame_t *raw_frame )
+{
+    for( int i = 0; i < h->num_devices; i++ )
+    {
+        obe_device_t *device = h->devices[i];
+
+        for( int j = 0; j < device->num_input_streams; j++ )
+        {
+            obe_int_input_stream_t *stream = device->streams[j];
+
+            if( stream->stream_id != raw_frame->stream_id )
+                continue;
+
+            if( !stream->probe_cache_check )
+                return 0;
+
+            if( raw_frame->img.width != stream->width || raw_frame->img.height != stream->height ||
+                raw_frame->timebase_num != stream->timebase_num || raw_frame->timebase_den != stream->timebase_den )
+            {
+                /* Frames are refused so the wrong layout never reaches the encoders. A restart will reprobe */
+                if( stream->probe_cache_check == 1 )
+                {
+                    syslog( LOG_ERR, "Input is %ix%i %i/%i but the probe cache \"%s\" has %ix%i %i/%i. "
+                            "Restart to probe the input again\n",
+                            raw_frame->img.width, raw_frame->img.height, raw_frame->timebase_num, raw_frame->timebase_den,
+                            device->user_opts.probe_cache, stream->width, stream->height,
+                            stream->timebase_num, stream->timebase_den );
+                    unlink( device->user_opts.probe_cache );
+                    stream->probe_cache_check = 2;
+                }
+                return -1;
+            }
+
+            stream->probe_cache_check = 0;
+            __atomic_sub_fetch( &h->probe_cache_pending, 1, __ATOMIC_RELAXED );
+            return 0;
+        }
+    }
+
+    return 0;
+}
@@ -25,6 +25,7 @@
 #include "ancillary.h"
 #include "sdi.h"
 #include "vbi.h"
+#include "x86/sdi.h"
 
 #define READ_8(x) ((x) & 0xff)
 
@@ -45,7 +46,7 @@ static int get_vanc_type( uint8_t did, uint8_t sdid )
 static int parse_afd( obe_sdi_non_display_data_t *non_display_data, obe_raw_frame_t *raw_frame, uint16_t *line, int line_number, int len )
 {
     obe_int_frame_data_t *tmp, *frame_data;
-    obe_user_data_t *tmp2, *user_data;
+    obe_user_data_t *user_data;
 
     /* Skip DC word */
     line++;
@@ -92,19 +93,15 @@ static int parse_afd( obe_sdi_non_display_data_t *non_display_data, obe_raw_fram
     if( check_active_non_display_data( raw_frame, USER_DATA_AFD ) )
         return 0;
 
-    tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+2) * sizeof(*raw_frame->user_data) );
-    if( !tmp2 )
+    user_data = obe_frame_add_user_data( raw_frame, 2 );
+    if( !user_data )
         goto fail;
 
-    raw_frame->user_data = tmp2;
-    user_data = &raw_frame->user_data[raw_frame->num_user_data];
-    raw_frame->num_user_data += 2;
-
     /* Read AFD */
     user_data->len = 1;
     user_data->type = USER_DATA_AFD;
     user_data->source = VANC_GENERIC;
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
         goto fail;
 
@@ -118,7 +115,7 @@ static int parse_afd( obe_sdi_non_display_data_t *non_display_data, obe_raw_fram
     user_data->len = 5;
     user_data->type = USER_DATA_BAR_DATA;
     user_data->source = VANC_GENERIC;
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
         goto fail;
 
@@ -208,7 +205,7 @@ fail:
 static int parse_cdp( obe_sdi_non_display_data_t *non_display_data, obe_raw_frame_t *raw_frame, uint16_t *line, int line_number, int len )
 {
     obe_int_frame_data_t *tmp, *frame_data;
-    obe_user_data_t *tmp2, *user_data;
+    obe_user_data_t *user_data;
 
     /* Skip DC word */
     line++;
@@ -240,16 +237,14 @@ static int parse_cdp( obe_sdi_non_display_data_t *non_display_data, obe_raw_fram
     if( check_active_non_display_data( raw_frame, USER_DATA_CEA_708_CDP ) )
         return 0;
 
-    tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+1) * sizeof(*raw_frame->user_data) );
-    if( !tmp2 )
+    user_data = obe_frame_add_user_data( raw_frame, 1 );
+    if( !user_data )
         goto fail;
 
-    raw_frame->user_data = tmp2;
-    user_data = &raw_frame->user_data[raw_frame->num_user_data++];
     user_data->len = len;
     user_data->type = USER_DATA_CEA_708_CDP;
     user_data->source = VANC_GENERIC;
-    user_data->data = malloc( user_data->len );
+    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
     if( !user_data->data )
         goto fail;
 
@@ -270,6 +265,49 @@ static int parse_cea_608( uint16_t *line )
 }
 #endif
 
+int setup_vanc_parser( obe_sdi_non_display_data_t *non_display_data, int width, int num_lines )
+{
+    int cpu_flags = obe_get_cpu_flags();
+
+    non_display_data->anc_flag_scan = obe_anc_flag_scan_c;
+    non_display_data->anc_flag_step = 1;
+
+    if( cpu_flags & AV_CPU_FLAG_SSE2 )
+    {
+        non_display_data->anc_flag_scan = obe_anc_flag_scan_sse2;
+        non_display_data->anc_flag_step = 8;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        non_display_data->anc_flag_scan = obe_anc_flag_scan_avx2;
+        non_display_data->anc_flag_step = 16;
+    }
+
+    non_display_data->anc_line_stride = FFALIGN( (width * 2 * sizeof(uint16_t)), 16 );
+    non_display_data->anc_buf = av_malloc( num_lines * non_display_data->anc_line_stride );
+    non_display_data->vbi_buf = av_malloc( width * 2 * num_lines );
+    if( !non_display_data->anc_buf || !non_display_data->vbi_buf )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        close_vanc_parser( non_display_data );
+        return -1;
+    }
+
+    return 0;
+}
+
+void close_vanc_parser( obe_sdi_non_display_data_t *non_display_data )
+{
+    av_freep( &non_display_data->anc_buf );
+    av_freep( &non_display_data->vbi_buf );
+}
+
+int vanc_line_has_data( obe_sdi_non_display_data_t *non_display_data, const uint16_t *line, int len )
+{
+    return obe_line_has_anc_flag( non_display_data->anc_flag_scan, non_display_data->anc_flag_step, line, len );
+}
+
 int parse_vanc_line( obe_sdi_non_display_data_t *non_display_data, obe_raw_frame_t *raw_frame, uint16_t *line, int width,
                      int line_number )
 {
@@ -69,6 +69,11 @@ const static obe_anc_identifier_t vanc_identifiers[] =
 };
 
 
+/* Allocates the ancillary buffers for num_lines lines of width pixels and picks the flag scan */
+int setup_vanc_parser( obe_sdi_non_display_data_t *non_display_data, int width, int num_lines );
+void close_vanc_parser( obe_sdi_non_display_data_t *non_display_data );
+/* Nonzero if the len words at line could hold an ancillary packet */
+int vanc_line_has_data( obe_sdi_non_display_data_t *non_display_data, const uint16_t *line, int len );
 int parse_vanc_line( obe_sdi_non_display_data_t *non_display_data, obe_raw_frame_t *raw_frame, uint16_t *line, int width,
                      int line_number );
 #endif
@@ -33,6 +33,8 @@ extern "C"
 #include "input/sdi/ancillary.h"
 #include "input/sdi/vbi.h"
 #include "input/sdi/x86/sdi.h"
+#include "filters/audio/audio.h"
+#include "filters/audio/337m/337m.h"
 }
 
 #include "include/DeckLinkAPI.h"
@@ -109,11 +111,23 @@ typedef struct
     int      probe_buf_len;
     int32_t  *audio_probe_buf;
 
-    AVCodec         *dec;
-    AVCodecContext  *codec;
+    /* SMPTE 337M */
+    int      audio_stream_id;
+    int      probe_data_type_337m;
+    obe_337m_ctx_t smpte337m;
+
+    obe_audio_router_t audio_router;
+
+    /* Active picture, unpacked straight from the card's buffer into the frame pool */
+    obe_v210_unpack_func_t v210_unpack;
+    obe_v210_unpack_func_t v210_unpack_unaligned;
+    int v210_unpack_align;
 
     int64_t last_frame_time;
 
+    /* The SDK's capture thread is moved to the card's node on the first callback */
+    int numa_bound;
+
     /* VBI */
     int has_setup_vbi;
 
@@ -204,40 +218,48 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 {
     decklink_ctx_t *decklink_ctx = &decklink_opts_->decklink_ctx;
     obe_raw_frame_t *raw_frame = NULL;
-    AVPacket pkt;
-    AVFrame frame;
+    obe_v210_unpack_func_t v210_unpack;
     void *frame_bytes, *anc_line;
     obe_t *h = decklink_ctx->h;
-    int finished = 0, ret, bytes, num_anc_lines = 0, anc_line_stride,
+    int num_anc_lines = 0, anc_line_stride,
     lines_read = 0, first_line = 0, last_line = 0, line, num_vbi_lines, vii_line;
     uint32_t *frame_ptr;
     uint16_t *anc_buf, *anc_buf_pos;
     uint8_t *vbi_buf;
     int anc_lines[DECKLINK_VANC_LINES];
+    obe_sdi_non_display_data_t *non_display_parser = &decklink_ctx->non_display_parser;
     IDeckLinkVideoFrameAncillary *ancillary;
     BMDTimeValue stream_time, frame_duration;
+    int64_t frame_pts;
 
     if( decklink_opts_->probe_success )
         return S_OK;
 
-    av_init_packet( &pkt );
+    /* The callback runs on the SDK's own thread */
+    if( !decklink_ctx->numa_bound && decklink_ctx->device )
+    {
+        obe_thread_place( h, OBE_THREAD_INPUT, decklink_ctx->device->numa_node );
+        decklink_ctx->numa_bound = 1;
+    }
 
     if( videoframe )
     {
         if( videoframe->GetFlags() & bmdFrameHasNoInputSource )
         {
             syslog( LOG_ERR, "Decklink card index %i: No input signal detected", decklink_opts_->card_idx );
+            obe_failover_signal( h, decklink_ctx->device, 0 );
             return S_OK;
         }
         else if( decklink_opts_->probe )
             decklink_opts_->probe_success = 1;
 
-        /* use SDI ticks as clock source */
         videoframe->GetStreamTime( &stream_time, &frame_duration, OBE_CLOCK );
-        obe_clock_tick( h, (int64_t)stream_time );
 
         if( decklink_ctx->last_frame_time == -1 )
+        {
             decklink_ctx->last_frame_time = obe_mdate();
+            obe_input_frame_arrived( decklink_ctx->device, decklink_ctx->last_frame_time, 0 );
+        }
         else
         {
             int64_t cur_frame_time = obe_mdate();
@@ -245,14 +267,28 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             {
                 syslog( LOG_WARNING, "Decklink card index %i: No frame received for %"PRIi64" ms", decklink_opts_->card_idx,
                        (cur_frame_time - decklink_ctx->last_frame_time) / 1000 );
-                pthread_mutex_lock( &h->drop_mutex );
-                h->encoder_drop = h->output_drop = 1;
-                pthread_mutex_unlock( &h->drop_mutex );
+                /* With a backup the gap is covered by the other input or the slate */
+                if( h->failover.backup )
+                    obe_failover_signal( h, decklink_ctx->device, 0 );
+                else
+                {
+                    pthread_mutex_lock( &h->drop_mutex );
+                    h->encoder_drop = 1;
+                    h->output_drop++;
+                    pthread_mutex_unlock( &h->drop_mutex );
+                }
             }
 
+            obe_input_frame_arrived( decklink_ctx->device, cur_frame_time, cur_frame_time - decklink_ctx->last_frame_time >= SDI_MAX_DELAY );
             decklink_ctx->last_frame_time = cur_frame_time;
         }
 
+        /* use SDI ticks as clock source. The pictures of a standby input are not used */
+        frame_pts = stream_time;
+        obe_failover_signal( h, decklink_ctx->device, 1 );
+        if( obe_failover_video( h, decklink_ctx->device, &frame_pts ) < 0 )
+            goto end;
+
         const int width = videoframe->GetWidth();
         const int height = videoframe->GetHeight();
         const int stride = videoframe->GetRowBytes();
@@ -271,16 +307,9 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
         /* NTSC starts on line 4 */
         line = decklink_opts_->video_format == INPUT_VIDEO_FORMAT_NTSC ? 4 : 1;
-        anc_line_stride = FFALIGN( (width * 2 * sizeof(uint16_t)), 16 );
-
-        /* Overallocate slightly for VANC buffer
-         * Some VBI services stray into the active picture so allocate some extra space */
-        anc_buf = anc_buf_pos = (uint16_t*)av_malloc( DECKLINK_VANC_LINES * anc_line_stride );
-        if( !anc_buf )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto end;
-        }
+        anc_line_stride = non_display_parser->anc_line_stride;
+        anc_buf = anc_buf_pos = non_display_parser->anc_buf;
+        vbi_buf = non_display_parser->vbi_buf;
 
         while( 1 )
         {
@@ -318,10 +347,12 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             }
         }
 
+        /* Most lines are plain blanking so only the ones with a data flag are parsed */
         anc_buf_pos = anc_buf;
         for( int i = 0; i < num_anc_lines; i++ )
         {
-            parse_vanc_line( &decklink_ctx->non_display_parser, raw_frame, anc_buf_pos, width, anc_lines[i] );
+            if( vanc_line_has_data( non_display_parser, anc_buf_pos, width * 2 ) )
+                parse_vanc_line( non_display_parser, raw_frame, anc_buf_pos, width, anc_lines[i] );
             anc_buf_pos += anc_line_stride / 2;
         }
 
@@ -341,13 +372,6 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
             }
             num_anc_lines += num_vbi_lines;
 
-            vbi_buf = (uint8_t*)av_malloc( width * 2 * num_anc_lines );
-            if( !vbi_buf )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                goto end;
-            }
-
             /* Scale the lines from 10-bit to 8-bit */
             decklink_ctx->downscale_line( anc_buf, vbi_buf, num_anc_lines );
             anc_buf_pos = anc_buf;
@@ -382,37 +406,36 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
             if( decode_vbi( &decklink_ctx->non_display_parser, vbi_buf, raw_frame ) < 0 )
                 goto fail;
-
-            av_free( vbi_buf );
         }
 
-        av_free( anc_buf );
-
         if( !decklink_opts_->probe )
         {
-            decklink_ctx->codec->width = width;
-            decklink_ctx->codec->height = height;
-
-            pkt.data = (uint8_t*)frame_bytes;
-            pkt.size = stride * height;
+            raw_frame->alloc_img.csp = PIX_FMT_YUV422P10;
+            raw_frame->alloc_img.width = width;
+            raw_frame->alloc_img.height = height;
+            raw_frame->release_data = obe_release_pooled_video_data;
+            raw_frame->release_frame = obe_release_frame;
 
-            avcodec_get_frame_defaults( &frame );
-            ret = avcodec_decode_video2( decklink_ctx->codec, &frame, &finished, &pkt );
-            if( ret < 0 || !finished )
+            /* The unpack functions write a few samples past the end of each line */
+            raw_frame->frame_buf = get_pooled_image( decklink_ctx->device, &raw_frame->alloc_img, height + 1 );
+            if( !raw_frame->frame_buf )
             {
-                syslog( LOG_ERR, "[decklink]: Could not decode video frame\n" );
+                /* The pool has counted the drop */
+                obe_release_frame( raw_frame );
                 goto end;
             }
 
-            raw_frame->release_data = obe_release_video_data;
-            raw_frame->release_frame = obe_release_frame;
+            /* The card's buffer is only read once so the frame can go back to it as soon as we return */
+            v210_unpack = ( (intptr_t)frame_bytes | stride ) & 15 ? decklink_ctx->v210_unpack_unaligned : decklink_ctx->v210_unpack;
+            for( int i = 0; i < height; i++ )
+            {
+                obe_image_t *img = &raw_frame->alloc_img;
+                obe_v210_planar_unpack_line( v210_unpack, decklink_ctx->v210_unpack_align, (uint32_t*)((uint8_t*)frame_bytes + i * stride),
+                                             (uint16_t*)( img->plane[0] + i * img->stride[0] ),
+                                             (uint16_t*)( img->plane[1] + i * img->stride[1] ),
+                                             (uint16_t*)( img->plane[2] + i * img->stride[2] ), width );
+            }
 
-            memcpy( raw_frame->alloc_img.stride, frame.linesize, sizeof(raw_frame->alloc_img.stride) );
-            memcpy( raw_frame->alloc_img.plane, frame.data, sizeof(raw_frame->alloc_img.plane) );
-            raw_frame->alloc_img.csp = (int)decklink_ctx->codec->pix_fmt;
-            raw_frame->alloc_img.planes = av_pix_fmt_descriptors[raw_frame->alloc_img.csp].nb_components;
-            raw_frame->alloc_img.width = width;
-            raw_frame->alloc_img.height = height;
             raw_frame->timebase_num = decklink_opts_->timebase_num;
             raw_frame->timebase_den = decklink_opts_->timebase_den;
 
@@ -428,7 +451,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
 
             /* If AFD is present and the stream is SD this will be changed in the video filter */
             raw_frame->sar_width = raw_frame->sar_height = 1;
-            raw_frame->pts = stream_time;
+            raw_frame->pts = frame_pts;
+            raw_frame->arrival_time = obe_mdate();
 
             for( int i = 0; i < decklink_ctx->device->num_input_streams; i++ )
             {
@@ -447,48 +471,39 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived( IDeckLinkVideoInputFram
         }
     }
 
-    /* TODO: probe SMPTE 337M audio */
-
-    if( audioframe && !decklink_opts_->probe )
+    if( audioframe && decklink_opts_->probe )
     {
-        raw_frame = new_raw_frame();
-        if( !raw_frame )
+        if( decklink_ctx->probe_data_type_337m < 0 )
         {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto end;
+            audioframe->GetBytes( &frame_bytes );
+            decklink_ctx->probe_data_type_337m = obe_337m_probe( (int32_t*)frame_bytes, audioframe->GetSampleFrameCount() );
         }
-
-        raw_frame->num_samples = audioframe->GetSampleFrameCount();
-        raw_frame->channel_layout = AV_CH_LAYOUT_STEREO;
-        raw_frame->sample_fmt = AV_SAMPLE_FMT_S32;
-
-        bytes = raw_frame->num_samples * decklink_opts_->num_channels * sizeof(int32_t);
-
+    }
+    else if( audioframe && decklink_ctx->smpte337m.num_output_streams )
+    {
+        BMDTimeValue packet_time;
+        const int32_t *pair;
         audioframe->GetBytes( &frame_bytes );
-        raw_frame->len = raw_frame->bytes_left = bytes;
-        raw_frame->data = (uint8_t*)av_malloc( raw_frame->len );
-        if( !raw_frame->data )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto fail;
-        }
-
-        raw_frame->cur_pos = raw_frame->data;
-        memcpy( raw_frame->data, frame_bytes, bytes );
+        audioframe->GetPacketTime( &packet_time, OBE_CLOCK );
+        if( obe_failover_pts( h, decklink_ctx->device, &packet_time ) < 0 )
+            goto end;
+        pair = obe_audio_router_pair( &decklink_ctx->audio_router, (int32_t*)frame_bytes, audioframe->GetSampleFrameCount() );
+        if( pair )
+            obe_337m_extract( &decklink_ctx->smpte337m, pair, audioframe->GetSampleFrameCount(), packet_time );
+    }
 
+    /* Every encoder gets its channels from one deinterleave of the capture */
+    if( audioframe && !decklink_opts_->probe && decklink_ctx->audio_router.num_routes )
+    {
         BMDTimeValue packet_time;
+        audioframe->GetBytes( &frame_bytes );
         audioframe->GetPacketTime( &packet_time, OBE_CLOCK );
-        raw_frame->pts = packet_time;
-        raw_frame->release_data = obe_release_other_data;
-        raw_frame->release_frame = obe_release_frame;
-        for( int i = 0; i < decklink_ctx->device->num_input_streams; i++ )
-        {
-            if( decklink_ctx->device->streams[i]->stream_format == AUDIO_PCM )
-                raw_frame->stream_id = decklink_ctx->device->streams[i]->stream_id;
-        }
+        if( obe_failover_pts( h, decklink_ctx->device, &packet_time ) < 0 )
+            goto end;
 
-        if( add_to_encode_queue( decklink_ctx->h, raw_frame ) < 0 )
-            goto fail;
+        /* Failures are logged and the capture dropped, the video goes on */
+        obe_audio_router_send( &decklink_ctx->audio_router, (int32_t*)frame_bytes,
+                               audioframe->GetSampleFrameCount(), packet_time );
     }
 
 end:
@@ -526,14 +541,10 @@ static void close_card( decklink_opts_t *decklink_opts )
     if( decklink_ctx->p_delegate )
         decklink_ctx->p_delegate->Release();
 
-    if( decklink_ctx->codec )
-    {
-        avcodec_close( decklink_ctx->codec );
-        av_free( decklink_ctx->codec );
-    }
-
     if( IS_SD( decklink_opts->video_format ) )
         vbi_raw_decoder_destroy( &decklink_ctx->non_display_parser.vbi_decoder );
+
+    close_vanc_parser( &decklink_ctx->non_display_parser );
 }
 
 static int open_card( decklink_opts_t *decklink_opts )
@@ -551,33 +562,6 @@ static int open_card( decklink_opts_t *decklink_opts )
     IDeckLinkIterator *decklink_iterator = NULL;
     HRESULT result;
 
-    avcodec_register_all();
-    decklink_ctx->dec = avcodec_find_decoder( CODEC_ID_V210 );
-    if( !decklink_ctx->dec )
-    {
-        fprintf( stderr, "[decklink] Could not find v210 decoder\n" );
-        goto finish;
-    }
-
-    decklink_ctx->codec = avcodec_alloc_context3( decklink_ctx->dec );
-    if( !decklink_ctx->codec )
-    {
-        fprintf( stderr, "[decklink] Could not allocate AVCodecContext\n" );
-        goto finish;
-    }
-
-    decklink_ctx->codec->get_buffer = obe_get_buffer;
-    decklink_ctx->codec->release_buffer = obe_release_buffer;
-    decklink_ctx->codec->reget_buffer = obe_reget_buffer;
-    decklink_ctx->codec->flags |= CODEC_FLAG_EMU_EDGE;
-
-    /* TODO: setup custom strides */
-    if( avcodec_open2( decklink_ctx->codec, decklink_ctx->dec, NULL ) < 0 )
-    {
-        fprintf( stderr, "[decklink] Could not open libavcodec\n" );
-        goto finish;
-    }
-
     decklink_iterator = CreateDeckLinkIteratorInstance();
     if( !decklink_iterator )
     {
@@ -773,7 +757,29 @@ static int open_card( decklink_opts_t *decklink_opts )
         goto finish;
     }
 
-    cpu_flags = av_get_cpu_flags();
+    cpu_flags = obe_get_cpu_flags();
+
+    /* Setup the active picture unpack functions */
+    decklink_ctx->v210_unpack = decklink_ctx->v210_unpack_unaligned = obe_v210_planar_unpack_c;
+    decklink_ctx->v210_unpack_align = 6;
+
+    if( cpu_flags & AV_CPU_FLAG_SSSE3 )
+    {
+        decklink_ctx->v210_unpack = obe_v210_planar_unpack_aligned_ssse3;
+        decklink_ctx->v210_unpack_unaligned = obe_v210_planar_unpack_unaligned_ssse3;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX )
+    {
+        decklink_ctx->v210_unpack = obe_v210_planar_unpack_aligned_avx;
+        decklink_ctx->v210_unpack_unaligned = obe_v210_planar_unpack_unaligned_avx;
+    }
+
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        decklink_ctx->v210_unpack = decklink_ctx->v210_unpack_unaligned = obe_v210_planar_unpack_avx2;
+        decklink_ctx->v210_unpack_align = 12;
+    }
 
     /* Setup VBI and VANC unpack functions */
     if( IS_SD( decklink_opts->video_format ) )
@@ -787,6 +793,9 @@ static int open_card( decklink_opts_t *decklink_opts )
 
         if( cpu_flags & AV_CPU_FLAG_SSE2 )
             decklink_ctx->downscale_line = obe_downscale_line_sse2;
+
+        if( cpu_flags & AV_CPU_FLAG_AVX2 )
+            decklink_ctx->downscale_line = obe_downscale_line_avx2;
     }
     else
     {
@@ -794,6 +803,14 @@ static int open_card( decklink_opts_t *decklink_opts )
         decklink_ctx->blank_line = obe_blank_line_nv20_c;
     }
 
+    /* Overallocate slightly for the VANC lines
+     * Some VBI services stray into the active picture so allocate some extra space */
+    if( setup_vanc_parser( &decklink_ctx->non_display_parser, decklink_opts->width, DECKLINK_VANC_LINES ) < 0 )
+    {
+        ret = -1;
+        goto finish;
+    }
+
     result = decklink_ctx->p_input->EnableVideoInput( wanted_mode_id, bmdFormat10BitYUV, 0 );
     if( result != S_OK )
     {
@@ -871,6 +888,7 @@ static void *probe_stream( void *ptr )
     decklink_ctx = &decklink_opts->decklink_ctx;
     decklink_ctx->h = h;
     decklink_ctx->last_frame_time = -1;
+    decklink_ctx->probe_data_type_337m = -1;
 
     decklink_ctx = &decklink_opts->decklink_ctx;
 
@@ -887,7 +905,6 @@ static void *probe_stream( void *ptr )
         goto finish;
     }
 
-    /* TODO: probe for SMPTE 337M */
     /* TODO: factor some of the code below out */
 
     for( int i = 0; i < 2; i++ )
@@ -925,6 +942,19 @@ static void *probe_stream( void *ptr )
             streams[i]->sample_format = AV_SAMPLE_FMT_S32;
             /* TODO: support other sample rates */
             streams[i]->sample_rate = 48000;
+
+            if( decklink_ctx->probe_data_type_337m >= 0 )
+            {
+                int stream_format = obe_337m_stream_format( decklink_ctx->probe_data_type_337m );
+                if( stream_format >= 0 )
+                {
+                    streams[i]->stream_format = stream_format;
+                    streams[i]->is_337m = 1;
+                }
+                else
+                    syslog( LOG_WARNING, "[decklink] SMPTE 337M data type %i can't be passed through, treating as PCM",
+                            decklink_ctx->probe_data_type_337m );
+            }
         }
     }
 
@@ -996,6 +1026,7 @@ static void *open_input( void *ptr )
     obe_input_t *user_opts = &device->user_opts;
     decklink_ctx_t *decklink_ctx;
     obe_sdi_non_display_data_t *non_display_parser;
+    int num_channels;
 
     decklink_opts_t *decklink_opts = (decklink_opts_t*)calloc( 1, sizeof(*decklink_opts) );
     if( !decklink_opts )
@@ -1023,6 +1054,28 @@ static void *open_input( void *ptr )
 
     /* TODO: wait for encoder */
 
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        if( device->streams[i]->stream_type == STREAM_TYPE_AUDIO )
+        {
+            decklink_ctx->audio_stream_id = device->streams[i]->stream_id;
+
+            /* The cards capture 2, 8 or 16 channels */
+            num_channels = obe_audio_router_channels( device->streams[i], input->output_streams, input->num_output_streams );
+            decklink_opts->num_channels = num_channels <= 2 ? 2 : num_channels <= 8 ? 8 : 16;
+            if( num_channels > OBE_MAX_SDI_CHANNELS ||
+                obe_audio_router_open( &decklink_ctx->audio_router, h, device->streams[i], input->output_streams,
+                                       input->num_output_streams, decklink_opts->num_channels ) < 0 )
+            {
+                fprintf( stderr, "[decklink] Invalid audio channel selection\n" );
+                goto finish;
+            }
+
+            if( obe_337m_open( &decklink_ctx->smpte337m, h, device->streams[i], input->output_streams, input->num_output_streams ) < 0 )
+                goto finish;
+        }
+    }
+
     if( open_card( decklink_opts ) < 0 )
         goto finish;
 
@@ -1032,7 +1085,11 @@ static void *open_input( void *ptr )
 
 finish:
     if( decklink_opts )
+    {
+        obe_337m_close( &decklink_opts->decklink_ctx.smpte337m );
+        obe_audio_router_close( &decklink_opts->decklink_ctx.audio_router );
         free( decklink_opts );
+    }
     return NULL;
 }
 
@@ -43,6 +43,9 @@
 #include "input/sdi/ancillary.h"
 #include "input/sdi/vbi.h"
 #include "input/sdi/x86/sdi.h"
+#include "filters/video/dither.h"
+#include "filters/audio/audio.h"
+#include "filters/audio/337m/337m.h"
 
 #include <libavutil/mathematics.h>
 #include <libavutil/bswap.h>
@@ -52,6 +55,7 @@
 #define SDIVIDEO_BUFSIZE_FILE   "/sys/class/sdivideo/sdivideorx%u/bufsize"
 #define SDIVIDEO_MODE_FILE      "/sys/class/sdivideo/sdivideorx%u/mode"
 #define SDIVIDEO_VANC_FILE      "/sys/class/sdivideo/sdivideorx%u/vanc"
+#define SDIVIDEO_PCI_DIR        "/sys/class/sdivideo/sdivideorx%u/device"
 #define SDIAUDIO_DEVICE         "/dev/sdiaudiorx%u"
 #define SDIAUDIO_BUFFERS_FILE   "/sys/class/sdiaudio/sdiaudiorx%u/buffers"
 #define SDIAUDIO_BUFSIZE_FILE   "/sys/class/sdiaudio/sdiaudiorx%u/bufsize"
@@ -60,6 +64,7 @@
 #define READ_TIMEOUT            10000
 #define NB_VBUFFERS             2
 #define NB_ABUFFERS             2
+#define MAX_CAPTURE_BUFFERS     32
 #define LINSYS_VANC_LINES       100
 #define LINSYS_NTSC_TOP_LINES   6
 
@@ -127,6 +132,7 @@ typedef struct
     unsigned int standard;
     uint8_t      **vbuffers;
     unsigned int num_vbuffers, current_vbuffer;
+    int          vbuffer_held; /* current_vbuffer is dequeued */
     unsigned int vbuffer_size;
     int          has_vanc;
     int          stride;
@@ -137,6 +143,21 @@ typedef struct
 
     obe_raw_frame_t *raw_frame;
     void (*unpack_line) ( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+    int          unpack_align;
+
+    /* Line n of the frame starts at field_offset[n&1] + (n>>1)*field_stride */
+    int          field_offset[2];
+    int          field_stride;
+
+    /* Fused unpack of HD pictures straight to the encoder's format */
+    int          fused;
+    int          fused_csp;
+    int          num_vanc_lines;
+    obe_image_t  vanc_img;
+    uint16_t     *line_buf[4][3];
+    void (*unpack_line_8bit) ( const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width, const uint16_t *dither );
+    void (*line_avg_10) ( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+    void (*line_avg_10_to_8) ( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
 
     /* audio device reader */
     int          afd;
@@ -147,6 +168,13 @@ typedef struct
     unsigned int abuffer_size;
     int64_t      a_counter;
     AVRational   a_timebase;
+    int          audio_stream_id;
+
+    /* SMPTE 337M */
+    int          probe_data_type_337m;
+    obe_337m_ctx_t smpte337m;
+
+    obe_audio_router_t audio_router;
 
     int64_t      last_frame_time;
 
@@ -174,6 +202,7 @@ typedef struct
     /* Input */
     int card_idx;
     int num_channels;
+    int num_buffers; /* driver buffers for each of video and audio, 0 for the default */
     int probe;
     int audio_samples;
 
@@ -193,44 +222,78 @@ typedef struct
 
 #define MAXLEN 256
 
-#define READ_PIXELS(a, b, c)         \
-    do {                             \
-        val  = av_le2ne32(*src++);   \
-        *a++ =  val & 0x3FF;         \
-        *b++ = (val >> 10) & 0x3FF;  \
-        *c++ = (val >> 20) & 0x3FF;  \
-    } while (0)
+static inline uint8_t *get_line( linsys_ctx_t *linsys_ctx, uint8_t *data, int line )
+{
+    return data + linsys_ctx->field_offset[line & 1] + (line >> 1) * linsys_ctx->field_stride;
+}
 
-static inline void obe_decode_line( linsys_ctx_t *linsys_ctx, const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v )
+/* Unpack the active picture and convert it to the encoder's format in the same pass so the
+ * video filter doesn't have to walk the frame again to dither or downconvert it.
+ * The scratch lines stay in cache. Lines are written in order because the unpack functions
+ * overwrite a few samples past the end of each line. */
+static void decode_picture_fused( linsys_opts_t *linsys_opts, uint8_t *data, obe_image_t *out )
 {
-    uint32_t val;
-    int w;
-
-    w = (linsys_ctx->width / 6) * 6;
-    linsys_ctx->unpack_line( src, y, u, v, w );
-
-    y += w;
-    u += w >> 1;
-    v += w >> 1;
-    src += (w << 1) / 3;
-
-   if( w < linsys_ctx->width - 1 )
-   {
-       READ_PIXELS(u, y, v);
-
-       val  = av_le2ne32(*src++);
-       *y++ =  val & 0x3FF;
-   }
-
-   if( w < linsys_ctx->width - 3 )
-   {
-       *u++ = (val >> 10) & 0x3FF;
-       *y++ = (val >> 20) & 0x3FF;
-
-       val  = av_le2ne32(*src++);
-       *v++ =  val & 0x3FF;
-       *y++ = (val >> 10) & 0x3FF;
-   }
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    const int width = linsys_ctx->width;
+    const int unpack_width = FFALIGN( width, 12 );
+    int num_lines;
+
+    /* In an interlaced frame each chroma line of 4:2:0 comes from two lines of the same field */
+    if( linsys_ctx->fused_csp == PIX_FMT_YUV422P )
+        num_lines = 1;
+    else
+        num_lines = linsys_opts->interlaced ? 4 : 2;
+
+    for( int i = 0; i < linsys_opts->height; i += num_lines )
+    {
+        for( int j = 0; j < num_lines; j++ )
+        {
+            const uint32_t *src = (const uint32_t*)get_line( linsys_ctx, data, linsys_ctx->num_vanc_lines + i + j );
+            const uint16_t *dither = obe_dithers[(i+j)&7];
+            uint16_t **line = linsys_ctx->line_buf[j];
+            uint8_t *y = out->plane[0] + (i+j) * out->stride[0];
+
+            if( linsys_ctx->fused_csp == PIX_FMT_YUV422P )
+            {
+                uint8_t *u = out->plane[1] + (i+j) * out->stride[1];
+                uint8_t *v = out->plane[2] + (i+j) * out->stride[2];
+
+                if( linsys_ctx->unpack_line_8bit )
+                    linsys_ctx->unpack_line_8bit( src, y, u, v, unpack_width, dither );
+                else
+                {
+                    linsys_ctx->unpack_line( src, line[0], line[1], line[2], unpack_width );
+                    linsys_ctx->line_avg_10_to_8( line[0], line[0], y, width, dither );
+                    linsys_ctx->line_avg_10_to_8( line[1], line[1], u, width >> 1, dither );
+                    linsys_ctx->line_avg_10_to_8( line[2], line[2], v, width >> 1, dither );
+                }
+            }
+            else if( linsys_ctx->fused_csp == PIX_FMT_YUV420P10 )
+                linsys_ctx->unpack_line( src, (uint16_t*)y, line[1], line[2], unpack_width );
+            else
+            {
+                linsys_ctx->unpack_line( src, line[0], line[1], line[2], unpack_width );
+                linsys_ctx->line_avg_10_to_8( line[0], line[0], y, width, dither );
+            }
+        }
+
+        for( int j = 0; j < num_lines / 2; j++ )
+        {
+            uint16_t **top = linsys_ctx->line_buf[j];
+            uint16_t **bottom = linsys_ctx->line_buf[j + num_lines / 2];
+            int chroma_line = i / 2 + j;
+
+            for( int k = 1; k < 3; k++ )
+            {
+                uint8_t *dst = out->plane[k] + chroma_line * out->stride[k];
+
+                if( linsys_ctx->fused_csp == PIX_FMT_YUV420P10 )
+                    linsys_ctx->line_avg_10( top[k], bottom[k], (uint16_t*)dst, width >> 1 );
+                else
+                    linsys_ctx->line_avg_10_to_8( top[k], bottom[k], dst, width >> 1, obe_dithers[chroma_line&7] );
+            }
+        }
+    }
 }
 
 static ssize_t write_ul_sysfs( const char *fmt, unsigned int card_idx, unsigned int buf )
@@ -273,30 +336,61 @@ static void close_card( linsys_opts_t *linsys_opts )
         free( linsys_ctx->abuffers );
     }
     close( linsys_ctx->afd );
+
+    av_freep( &linsys_ctx->vanc_img.plane[0] );
+    close_vanc_parser( &linsys_ctx->non_display_parser );
+    for( int i = 0; i < 4; i++ )
+    {
+        for( int j = 0; j < 3; j++ )
+            av_freep( &linsys_ctx->line_buf[i][j] );
+    }
+}
+
+/* Hands the dequeued buffer back to the driver. Video buffers go back as soon as the picture has
+ * been unpacked out of them so the ancillary data and queueing don't hold up the card */
+static int queue_vbuffer( linsys_ctx_t *linsys_ctx )
+{
+    if( !linsys_ctx->vbuffer_held )
+        return 0;
+    linsys_ctx->vbuffer_held = 0;
+
+    if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_QBUF, linsys_ctx->current_vbuffer ) < 0 )
+    {
+        syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_QBUF %s", strerror( errno ) );
+        return -1;
+    }
+
+    linsys_ctx->current_vbuffer++;
+    linsys_ctx->current_vbuffer %= linsys_ctx->num_vbuffers;
+
+    return 0;
 }
 
 static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 {
     linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    obe_sdi_non_display_data_t *non_display_parser = &linsys_ctx->non_display_parser;
     obe_t *h = linsys_ctx->h;
     obe_raw_frame_t *raw_frame = NULL;
-    int num_anc_lines = 0, anc_line_stride, first_line = 0, last_line = 0, cur_line, num_vbi_lines, vii_line, tmp_line;
-    uint16_t *anc_buf = NULL, *anc_buf_pos = NULL;
+    int num_anc_lines = 0, anc_line_stride, first_line = 0, last_line = 0, cur_line, num_vbi_lines, vii_line, tmp_line, has_data;
+    uint16_t *anc_buf, *anc_buf_pos;
     uint16_t *y_src, *u_src, *v_src;
     uint8_t *vbi_buf;
     int64_t pts, sdi_clock;
 
-    obe_image_t *output;
+    obe_image_t *output, *anc_img;
+    int alloc_height;
 
     if( linsys_ctx->non_display_parser.has_probed )
         return 0;
 
-    /* use SDI ticks as clock source */
     sdi_clock = av_rescale_q( linsys_ctx->v_counter, linsys_ctx->v_timebase, (AVRational){1, OBE_CLOCK} );
-    obe_clock_tick( h, sdi_clock );
 
     if( linsys_ctx->last_frame_time == -1 )
+    {
         linsys_ctx->last_frame_time = obe_mdate();
+        obe_input_frame_arrived( linsys_ctx->device, linsys_ctx->last_frame_time, 0 );
+    }
     else
     {
         int64_t cur_frame_time = obe_mdate();
@@ -304,14 +398,30 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
         {
             syslog( LOG_WARNING, "Linsys card index %i: No frame received for %"PRIi64" ms", linsys_opts->card_idx,
                    (cur_frame_time - linsys_ctx->last_frame_time) / 1000 );
-            pthread_mutex_lock( &h->drop_mutex );
-            h->encoder_drop = h->output_drop = 1;
-            pthread_mutex_unlock( &h->drop_mutex );
+            /* With a backup the gap is covered by the other input or the slate */
+            if( h->failover.backup )
+                obe_failover_signal( h, linsys_ctx->device, 0 );
+            else
+            {
+                pthread_mutex_lock( &h->drop_mutex );
+                h->encoder_drop = 1;
+                h->output_drop++;
+                pthread_mutex_unlock( &h->drop_mutex );
+            }
         }
 
+        obe_input_frame_arrived( linsys_ctx->device, cur_frame_time, cur_frame_time - linsys_ctx->last_frame_time >= SDI_MAX_DELAY );
         linsys_ctx->last_frame_time = cur_frame_time;
     }
 
+    /* use SDI ticks as clock source. The pictures of a standby input are not used */
+    obe_failover_signal( h, linsys_ctx->device, 1 );
+    if( obe_failover_video( h, linsys_ctx->device, &sdi_clock ) < 0 )
+    {
+        linsys_ctx->v_counter++;
+        return 0;
+    }
+
     int j;
     for( j = 0; first_active_line[j].format != -1; j++ )
     {
@@ -328,84 +438,70 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     }
     output = &raw_frame->alloc_img;
 
-    raw_frame->release_data = obe_release_video_data;
     raw_frame->release_frame = obe_release_frame;
     raw_frame->arrival_time = linsys_ctx->last_frame_time;
 
-    output->csp = PIX_FMT_YUV422P10;
+    for( int i = 0; linsys_ctx->device && i < linsys_ctx->device->num_input_streams; i++ )
+    {
+        if( linsys_ctx->device->streams[i]->stream_format == VIDEO_UNCOMPRESSED )
+            raw_frame->stream_id = linsys_ctx->device->streams[i]->stream_id;
+    }
+
+    output->csp = linsys_ctx->fused ? linsys_ctx->fused_csp : PIX_FMT_YUV422P10;
     output->planes = av_pix_fmt_descriptors[output->csp].nb_components;
     output->width = linsys_ctx->width;
     output->height = linsys_opts->height;
+    alloc_height = linsys_ctx->fused ? linsys_opts->height : linsys_ctx->coded_height;
 
-    if( av_image_fill_linesizes( output->stride, output->csp, output->width ) < 0 )
-        goto fail;
-
-    if( av_image_alloc( output->plane, output->stride, linsys_ctx->width, linsys_ctx->coded_height + 1, PIX_FMT_YUV422P10, 16 ) < 0 )
-        goto fail;
-
-    uint16_t *y_dst = (uint16_t*)output->plane[0];
-    uint16_t *u_dst = (uint16_t*)output->plane[1];
-    uint16_t *v_dst = (uint16_t*)output->plane[2];
-
-    /* Interleave fields */
-    if( linsys_opts->interlaced )
+    if( linsys_opts->probe )
     {
-        uint8_t *v210_src_f1, *v210_src_f2;
-
-        int k;
-        for( k = 0; field_start_lines[k].format != -1; k++ )
+        /* There is no device to hold a pool while probing */
+        raw_frame->release_data = obe_release_video_data;
+        if( av_image_alloc( output->plane, output->stride, linsys_ctx->width, alloc_height + 1, output->csp, 16 ) < 0 )
+            goto fail;
+    }
+    else
+    {
+        raw_frame->release_data = obe_release_pooled_video_data;
+        raw_frame->frame_buf = get_pooled_image( linsys_ctx->device, output, alloc_height + 1 );
+        if( !raw_frame->frame_buf )
         {
-            if( linsys_opts->video_format == field_start_lines[k].format )
-                break;
+            /* The pool has counted the drop */
+            raw_frame->release_frame( raw_frame );
+            return 0;
         }
+    }
 
-        v210_src_f1 = v210_src_f2 = data;
+    /* In fused mode only the active picture goes into the frame and any VANC lines are unpacked on their own */
+    anc_img = linsys_ctx->fused ? &linsys_ctx->vanc_img : output;
 
-        /* If we can only access the active frame in NTSC mode then swap the field order */
-        if( !linsys_ctx->has_vanc && linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
-            v210_src_f1 += (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
-        else if( linsys_ctx->has_vanc )
-            v210_src_f2 += (field_start_lines[k].field_two - field_start_lines[k].line) * linsys_ctx->stride;
-        else
-            /* All non-VANC resolutions have an even height */
-            v210_src_f2 += (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
-
-        for( int i = 0; i < linsys_ctx->coded_height; i++ )
-        {
-            if( !(i & 1) )
-            {
-                obe_decode_line( linsys_ctx, (const uint32_t*)v210_src_f1, y_dst, u_dst, v_dst );
-                v210_src_f1 += linsys_ctx->stride;
-            }
-            else
-            {
-                obe_decode_line( linsys_ctx, (const uint32_t*)v210_src_f2, y_dst, u_dst, v_dst );
-                v210_src_f2 += linsys_ctx->stride;
-            }
+    uint16_t *y_dst = (uint16_t*)anc_img->plane[0];
+    uint16_t *u_dst = (uint16_t*)anc_img->plane[1];
+    uint16_t *v_dst = (uint16_t*)anc_img->plane[2];
 
-            y_dst += output->stride[0] / 2;
-            u_dst += output->stride[1] / 2;
-            v_dst += output->stride[2] / 2;
-        }
-    }
-    else
+    for( int i = 0; i < (linsys_ctx->fused ? linsys_ctx->num_vanc_lines : linsys_ctx->coded_height); i++ )
     {
-        for( int i = 0; i < linsys_ctx->coded_height; i++ )
-        {
-            obe_decode_line( linsys_ctx, (const uint32_t*)data, y_dst, u_dst, v_dst );
+        obe_v210_planar_unpack_line( linsys_ctx->unpack_line, linsys_ctx->unpack_align,
+                                     (const uint32_t*)get_line( linsys_ctx, data, i ), y_dst, u_dst, v_dst, linsys_ctx->width );
 
-            data += linsys_ctx->stride;
-            y_dst += output->stride[0] / 2;
-            u_dst += output->stride[1] / 2;
-            v_dst += output->stride[2] / 2;
-        }
+        y_dst += anc_img->stride[0] / 2;
+        u_dst += anc_img->stride[1] / 2;
+        v_dst += anc_img->stride[2] / 2;
     }
 
-    anc_line_stride = FFALIGN( (linsys_ctx->width * 2 * sizeof(uint16_t)), 16 );
+    if( linsys_ctx->fused )
+        decode_picture_fused( linsys_opts, data, output );
 
-    y_src = (uint16_t*)output->plane[0];
-    u_src = (uint16_t*)output->plane[1];
-    v_src = (uint16_t*)output->plane[2];
+    if( queue_vbuffer( linsys_ctx ) < 0 )
+        goto fail;
+
+    anc_line_stride = non_display_parser->anc_line_stride;
+    anc_buf = anc_buf_pos = non_display_parser->anc_buf;
+    vbi_buf = non_display_parser->vbi_buf;
+
+    y_src = (uint16_t*)anc_img->plane[0];
+    u_src = (uint16_t*)anc_img->plane[1];
+    v_src = (uint16_t*)anc_img->plane[2];
 
     /* Handle VANC if the card allows it */
     if( linsys_ctx->has_vanc )
@@ -413,35 +509,38 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
         /* NTSC starts on line 4 so skip the top lines for NTSC */
         if( linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
         {
-            y_src += output->stride[0] * LINSYS_NTSC_TOP_LINES / 2;
-            u_src += output->stride[1] * LINSYS_NTSC_TOP_LINES / 2;
-            v_src += output->stride[2] * LINSYS_NTSC_TOP_LINES / 2;
+            y_src += anc_img->stride[0] * LINSYS_NTSC_TOP_LINES / 2;
+            u_src += anc_img->stride[1] * LINSYS_NTSC_TOP_LINES / 2;
+            v_src += anc_img->stride[2] * LINSYS_NTSC_TOP_LINES / 2;
         }
 
         first_line = cur_line = linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC ? 4 : 1;
 
-        /* Overallocate slightly for VANC buffer
-         * Some VBI services stray into the active picture so allocate some extra space */
-        anc_buf = anc_buf_pos = av_malloc( LINSYS_VANC_LINES * anc_line_stride );
-        if( !anc_buf )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto fail;
-        }
-
         while( cur_line != first_active_line[j].line )
         {
-            linsys_ctx->pack_line( y_src, u_src, v_src, anc_buf_pos, linsys_ctx->width );
-            parse_vanc_line( &linsys_ctx->non_display_parser, raw_frame, anc_buf_pos, linsys_ctx->width, cur_line );
+            /* Most lines are plain blanking so look for a data flag in the unpacked planes first.
+             * SD still packs every line because libzvbi is given the whole of the VBI */
+            has_data = vanc_line_has_data( non_display_parser, y_src, linsys_ctx->width ) ||
+                       vanc_line_has_data( non_display_parser, u_src, linsys_ctx->width / 2 ) ||
+                       vanc_line_has_data( non_display_parser, v_src, linsys_ctx->width / 2 );
+
+            if( has_data || IS_SD( linsys_opts->video_format ) )
+                linsys_ctx->pack_line( y_src, u_src, v_src, anc_buf_pos, linsys_ctx->width );
+            if( has_data )
+                parse_vanc_line( non_display_parser, raw_frame, anc_buf_pos, linsys_ctx->width, cur_line );
             anc_buf_pos += anc_line_stride / 2;
 
-            y_src += output->stride[0] / 2;
-            u_src += output->stride[1] / 2;
-            v_src += output->stride[2] / 2;
+            y_src += anc_img->stride[0] / 2;
+            u_src += anc_img->stride[1] / 2;
+            v_src += anc_img->stride[2] / 2;
 
             cur_line = sdi_next_line( linsys_opts->video_format, cur_line );
             num_anc_lines++;
         }
+
+        /* parse_vanc_line would have finished the probe on any line it was given */
+        if( non_display_parser->probe )
+            non_display_parser->has_probed = 1;
     }
     else
         first_line = cur_line = first_active_line[j].line;
@@ -455,21 +554,13 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
             /* skip line 283 for NTSC since libzvbi doesn't like unpaired lines */
             if( linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
             {
-                y_src += output->stride[0] / 2;
-                u_src += output->stride[1] / 2;
-                v_src += output->stride[2] / 2;
+                y_src += anc_img->stride[0] / 2;
+                u_src += anc_img->stride[1] / 2;
+                v_src += anc_img->stride[2] / 2;
                 cur_line = sdi_next_line( linsys_opts->video_format, cur_line );
                 last_line = first_active_line[j].line;
                 first_line = sdi_next_line( linsys_opts->video_format, last_line );
             }
-
-            /* Only the first two lines can be probed for VBI data */
-            anc_buf = anc_buf_pos = av_malloc( NUM_ACTIVE_VBI_LINES * anc_line_stride );
-            if( !anc_buf )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                goto fail;
-            }
         }
         else
             num_vbi_lines += linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC;
@@ -483,19 +574,12 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
         {
             linsys_ctx->pack_line( y_src, u_src, v_src, anc_buf_pos, linsys_ctx->width );
             anc_buf_pos += anc_line_stride / 2;
-            y_src += output->stride[0] / 2;
-            u_src += output->stride[1] / 2;
-            v_src += output->stride[2] / 2;
+            y_src += anc_img->stride[0] / 2;
+            u_src += anc_img->stride[1] / 2;
+            v_src += anc_img->stride[2] / 2;
             last_line = sdi_next_line( linsys_opts->video_format, last_line );
         }
 
-        vbi_buf = av_malloc( linsys_ctx->width * 2 * num_anc_lines );
-        if( !vbi_buf )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            goto fail;
-        }
-
         /* Scale the lines from 10-bit to 8-bit */
         linsys_ctx->downscale_line( anc_buf, vbi_buf, num_anc_lines );
         anc_buf_pos = anc_buf;
@@ -533,12 +617,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 
         if( decode_vbi( &linsys_ctx->non_display_parser, vbi_buf, raw_frame ) < 0 )
             goto fail;
-
-        av_free( vbi_buf );
     }
 
-    av_free( anc_buf );
-
     if( linsys_opts->probe )
     {
         raw_frame->release_data( raw_frame );
@@ -546,7 +626,7 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
     }
     else
     {
-        if( linsys_ctx->has_vanc )
+        if( linsys_ctx->has_vanc && !linsys_ctx->fused )
         {
             /* Just present the coded picture to the encoder */
             y_src = (uint16_t*)output->plane[0];
@@ -602,7 +682,8 @@ static int handle_video_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 
         /* If AFD is present and the stream is SD this will be changed in the video filter */
         raw_frame->sar_width = raw_frame->sar_height = 1;
-        raw_frame->pts = pts = av_rescale_q( linsys_ctx->v_counter++, linsys_ctx->v_timebase, (AVRational){1, OBE_CLOCK} );
+        raw_frame->pts = pts = sdi_clock;
+        linsys_ctx->v_counter++;
 
         if( add_to_filter_queue( h, raw_frame ) < 0 )
             goto fail;
@@ -629,68 +710,40 @@ fail:
 static int handle_audio_frame( linsys_opts_t *linsys_opts, uint8_t *data )
 {
     linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    int num_samples = linsys_ctx->abuffer_size / ( sizeof(int32_t) * linsys_opts->num_channels );
+    int64_t pts = av_rescale_q( linsys_ctx->a_counter, linsys_ctx->a_timebase, (AVRational){1, OBE_CLOCK} );
+    const int32_t *pair;
 
-    obe_raw_frame_t *raw_frame = new_raw_frame();
-    if( !raw_frame )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
-    }
-
-    raw_frame->num_samples = linsys_ctx->abuffer_size / ( sizeof(int32_t) * 2 );
-    raw_frame->channel_layout = AV_CH_LAYOUT_STEREO;
-    raw_frame->sample_fmt = AV_SAMPLE_FMT_S32;
-
-    raw_frame->len = raw_frame->bytes_left = linsys_ctx->abuffer_size;
-    raw_frame->data = av_malloc( raw_frame->len );
-    if( !raw_frame->data )
+    if( linsys_opts->probe )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        free( raw_frame );
-        return -1;
+        if( linsys_ctx->probe_data_type_337m < 0 )
+            linsys_ctx->probe_data_type_337m = obe_337m_probe( (int32_t*)data, num_samples );
+        return 0;
     }
 
-    raw_frame->cur_pos = raw_frame->data;
-    memcpy( raw_frame->data, data, raw_frame->len );
+    linsys_ctx->a_counter += num_samples;
 
-    raw_frame->pts = av_rescale_q( linsys_ctx->a_counter, linsys_ctx->a_timebase, (AVRational){1, OBE_CLOCK} );
-    linsys_ctx->a_counter += raw_frame->num_samples;
+    if( obe_failover_pts( linsys_ctx->h, linsys_ctx->device, &pts ) < 0 )
+        return 0;
 
-    raw_frame->release_data = obe_release_other_data;
-    raw_frame->release_frame = obe_release_frame;
-    for( int i = 0; i < linsys_ctx->device->num_input_streams; i++ )
+    if( linsys_ctx->smpte337m.num_output_streams )
     {
-        if( linsys_ctx->device->streams[i]->stream_format == AUDIO_PCM )
-            raw_frame->stream_id = linsys_ctx->device->streams[i]->stream_id;
+        pair = obe_audio_router_pair( &linsys_ctx->audio_router, (int32_t*)data, num_samples );
+        if( pair )
+            obe_337m_extract( &linsys_ctx->smpte337m, pair, num_samples, pts );
     }
 
-    if( add_to_encode_queue( linsys_ctx->h, raw_frame ) < 0 )
-    {
-        raw_frame->release_data( raw_frame );
-        raw_frame->release_frame( raw_frame );
-        return -1;
-    }
+    /* Only passthrough of the bursts */
+    if( !linsys_ctx->audio_router.num_routes )
+        return 0;
 
-    return 0;
+    return obe_audio_router_send( &linsys_ctx->audio_router, (int32_t*)data, num_samples, pts );
 }
 
-static int capture_data( linsys_opts_t *linsys_opts )
+static void handle_events( linsys_opts_t *linsys_opts, struct pollfd *pfd )
 {
-    struct pollfd pfd[2];
     linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
 
-    pfd[0].fd = linsys_ctx->vfd;
-    pfd[0].events = POLLIN | POLLPRI;
-
-    pfd[1].fd = linsys_ctx->afd;
-    pfd[1].events = POLLIN | POLLPRI;
-
-    if( poll( pfd, 2, READ_TIMEOUT ) < 0 )
-    {
-        syslog( LOG_ERR, "couldn't poll(): %s", strerror( errno ) );
-        return -1;
-    }
-
     /* TODO: card-idx these messages */
 
     if( pfd[0].revents & POLLPRI )
@@ -706,7 +759,14 @@ static int capture_data( linsys_opts_t *linsys_opts )
             if( val & SDIVIDEO_EVENT_RX_FIFO )
                 syslog( LOG_WARNING, "[linsys-sdivideo] onboard receive FIFO overrun \n");
             if( val & SDIVIDEO_EVENT_RX_CARRIER )
+            {
+                int carrier;
+
                 syslog( LOG_WARNING, "[linsys-sdivideo] carrier status change \n");
+                /* A lost carrier fails over straight away rather than waiting for the frames to stop */
+                if( !ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_RXGETCARRIER, &carrier ) && !carrier )
+                    obe_failover_signal( linsys_ctx->h, linsys_ctx->device, 0 );
+            }
             if( val & SDIVIDEO_EVENT_RX_DATA )
                 syslog( LOG_WARNING, "[linsys-sdivideo] data status change \n");
             if( val & SDIVIDEO_EVENT_RX_STD )
@@ -735,47 +795,75 @@ static int capture_data( linsys_opts_t *linsys_opts )
                 syslog( LOG_WARNING, "[linsys-sdiaudio] data status change");
         }
     }
+}
+
+/* Every buffer that is ready is drained before waiting again, so a slow frame doesn't leave the
+ * rest of the queue sitting with the driver */
+static int capture_data( linsys_opts_t *linsys_opts )
+{
+    struct pollfd pfd[2];
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    int max_buffers = linsys_ctx->num_vbuffers + linsys_ctx->num_abuffers;
+    int ret;
+
+    pfd[0].fd = linsys_ctx->vfd;
+    pfd[0].events = POLLIN | POLLPRI;
 
-    if( pfd[0].revents & POLLIN )
+    pfd[1].fd = linsys_ctx->afd;
+    pfd[1].events = POLLIN | POLLPRI;
+
+    for( int i = 0; i < max_buffers; i++ )
     {
-        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_DQBUF, linsys_ctx->current_vbuffer ) < 0 )
+        ret = poll( pfd, 2, i ? 0 : READ_TIMEOUT );
+        if( ret < 0 )
         {
-            syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_DQBUF %s", strerror( errno ) );
+            syslog( LOG_ERR, "couldn't poll(): %s", strerror( errno ) );
             return -1;
         }
+        else if( !ret )
+            break;
 
-        if( handle_video_frame( linsys_opts, linsys_ctx->vbuffers[linsys_ctx->current_vbuffer] ) < 0 )
-            return -1;
+        handle_events( linsys_opts, pfd );
 
-        if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_QBUF, linsys_ctx->current_vbuffer ) < 0 )
+        if( pfd[0].revents & POLLIN )
         {
-            syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_QBUF %s", strerror( errno ) );
-            return -1;
-        }
+            if( ioctl( linsys_ctx->vfd, SDIVIDEO_IOC_DQBUF, linsys_ctx->current_vbuffer ) < 0 )
+            {
+                syslog( LOG_WARNING, "[linsys-sdivideo] couldn't SDIVIDEO_IOC_DQBUF %s", strerror( errno ) );
+                return -1;
+            }
+            linsys_ctx->vbuffer_held = 1;
 
-        linsys_ctx->current_vbuffer++;
-        linsys_ctx->current_vbuffer %= linsys_ctx->num_vbuffers;
-    }
+            ret = handle_video_frame( linsys_opts, linsys_ctx->vbuffers[linsys_ctx->current_vbuffer] );
 
-    if( pfd[1].revents & POLLIN  )
-    {
-        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_DQBUF, linsys_ctx->current_abuffer ) < 0 )
-        {
-            syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_DQBUF %s", strerror( errno ) );
-            return -1;
+            /* Frames which were dropped or failed to unpack still have the buffer */
+            if( queue_vbuffer( linsys_ctx ) < 0 || ret < 0 )
+                return -1;
         }
 
-        if( !linsys_opts->probe && handle_audio_frame( linsys_opts, linsys_ctx->abuffers[linsys_ctx->current_abuffer] ) < 0 )
-            return -1;
-
-        if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_QBUF, linsys_ctx->current_abuffer ) < 0 )
+        if( pfd[1].revents & POLLIN )
         {
-            syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_QBUF %s", strerror( errno ) );
-            return -1;
-        }
+            if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_DQBUF, linsys_ctx->current_abuffer ) < 0 )
+            {
+                syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_DQBUF %s", strerror( errno ) );
+                return -1;
+            }
+
+            /* The audio is deinterleaved out of the buffer straight away so it's handled inline */
+            ret = handle_audio_frame( linsys_opts, linsys_ctx->abuffers[linsys_ctx->current_abuffer] );
+
+            if( ioctl( linsys_ctx->afd, SDIAUDIO_IOC_QBUF, linsys_ctx->current_abuffer ) < 0 )
+            {
+                syslog( LOG_WARNING, "[linsys-sdiaudio] couldn't SDIAUDIO_IOC_QBUF %s", strerror( errno ) );
+                return -1;
+            }
 
-        linsys_ctx->current_abuffer++;
-        linsys_ctx->current_abuffer %= linsys_ctx->num_abuffers;
+            if( ret < 0 )
+                return -1;
+
+            linsys_ctx->current_abuffer++;
+            linsys_ctx->current_abuffer %= linsys_ctx->num_abuffers;
+        }
     }
 
     return 0;
@@ -880,10 +968,19 @@ static int open_card( linsys_opts_t *linsys_opts )
     linsys_ctx->stride = aligned_width * 8 / 3;
     linsys_ctx->vbuffer_size = linsys_ctx->coded_height * linsys_ctx->stride;
 
-    cpu_flags = av_get_cpu_flags();
+    cpu_flags = obe_get_cpu_flags();
 
     /* Setup unpack functions */
     linsys_ctx->unpack_line = obe_v210_planar_unpack_c;
+    linsys_ctx->unpack_align = 6;
+    linsys_ctx->line_avg_10 = obe_line_avg_10_c;
+    linsys_ctx->line_avg_10_to_8 = obe_line_avg_10_to_8_c;
+
+    if( cpu_flags & AV_CPU_FLAG_SSE2 )
+    {
+        linsys_ctx->line_avg_10 = obe_line_avg_10_sse2;
+        linsys_ctx->line_avg_10_to_8 = obe_line_avg_10_to_8_sse2;
+    }
 
     if( cpu_flags & AV_CPU_FLAG_SSSE3 )
         linsys_ctx->unpack_line = obe_v210_planar_unpack_aligned_ssse3;
@@ -891,6 +988,15 @@ static int open_card( linsys_opts_t *linsys_opts )
     if( cpu_flags & AV_CPU_FLAG_AVX )
         linsys_ctx->unpack_line = obe_v210_planar_unpack_aligned_avx;
 
+    if( cpu_flags & AV_CPU_FLAG_AVX2 )
+    {
+        linsys_ctx->unpack_line = obe_v210_planar_unpack_avx2;
+        linsys_ctx->unpack_align = 12;
+        linsys_ctx->unpack_line_8bit = obe_v210_planar_unpack_8bit_avx2;
+        linsys_ctx->line_avg_10 = obe_line_avg_10_avx2;
+        linsys_ctx->line_avg_10_to_8 = obe_line_avg_10_to_8_avx2;
+    }
+
     /* Setup VBI and VANC pack functions */
     if( IS_SD( linsys_opts->video_format ) )
     {
@@ -902,10 +1008,21 @@ static int open_card( linsys_opts_t *linsys_opts )
 
         if( cpu_flags & AV_CPU_FLAG_SSE2 )
             linsys_ctx->downscale_line = obe_downscale_line_sse2;
+
+        if( cpu_flags & AV_CPU_FLAG_AVX2 )
+            linsys_ctx->downscale_line = obe_downscale_line_avx2;
     }
     else
         linsys_ctx->pack_line = obe_yuv422p10_line_to_nv20_c;
 
+    /* Overallocate slightly for the VANC lines
+     * Some VBI services stray into the active picture so allocate some extra space */
+    if( setup_vanc_parser( &linsys_ctx->non_display_parser, linsys_ctx->width, LINSYS_VANC_LINES ) < 0 )
+    {
+        ret = -1;
+        goto finish;
+    }
+
     close( linsys_ctx->vfd );
 
     /* First open the audio for synchronization reasons */
@@ -952,16 +1069,29 @@ static int open_card( linsys_opts_t *linsys_opts )
         goto finish;
     }
 
-    /* TODO: support multichannel */
-    if( write_ul_sysfs( SDIAUDIO_CHANNELS_FILE, linsys_opts->card_idx, SDIAUDIO_CTL_AUDCH_EN_2 ) < 0 )
+    for( i = 0; audio_channels_tab[i].num_channels != -1; i++ )
+    {
+        if( audio_channels_tab[i].num_channels >= linsys_opts->num_channels )
+            break;
+    }
+
+    if( audio_channels_tab[i].num_channels == -1 )
+    {
+        fprintf( stderr, "[linsys-sdiaudio] card can't capture %i channels \n", linsys_opts->num_channels );
+        ret = -1;
+        goto finish;
+    }
+    linsys_opts->num_channels = audio_channels_tab[i].num_channels;
+
+    if( write_ul_sysfs( SDIAUDIO_CHANNELS_FILE, linsys_opts->card_idx, audio_channels_tab[i].linsys_name ) < 0 )
     {
         fprintf( stderr, "[linsys-sdiaudio] could not write to SDIAUDIO_CHANNELS_FILE \n");
         ret = -1;
         goto finish;
     }
 
-    linsys_ctx->abuffer_size = linsys_opts->audio_samples * 2 * sizeof(int32_t);
-    linsys_ctx->num_abuffers = NB_ABUFFERS;
+    linsys_ctx->abuffer_size = linsys_opts->audio_samples * linsys_opts->num_channels * sizeof(int32_t);
+    linsys_ctx->num_abuffers = linsys_opts->num_buffers ? linsys_opts->num_buffers : NB_ABUFFERS;
 
     if( write_ul_sysfs( SDIAUDIO_BUFFERS_FILE, linsys_opts->card_idx, linsys_ctx->num_abuffers ) < 0 )
     {
@@ -1028,7 +1158,35 @@ static int open_card( linsys_opts_t *linsys_opts )
         linsys_ctx->coded_height = video_format_tab[i].total_height;
     }
 
-    linsys_ctx->num_vbuffers = NB_VBUFFERS;
+    /* Interleave the fields. If only the active frame can be accessed in NTSC mode the field order is swapped */
+    if( linsys_opts->interlaced )
+    {
+        int k;
+        for( k = 0; field_start_lines[k].format != -1; k++ )
+        {
+            if( linsys_opts->video_format == field_start_lines[k].format )
+                break;
+        }
+
+        linsys_ctx->field_stride = linsys_ctx->stride;
+        linsys_ctx->field_offset[0] = linsys_ctx->field_offset[1] = 0;
+
+        if( !linsys_ctx->has_vanc && linsys_opts->video_format == INPUT_VIDEO_FORMAT_NTSC )
+            linsys_ctx->field_offset[0] = (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
+        else if( linsys_ctx->has_vanc )
+            linsys_ctx->field_offset[1] = (field_start_lines[k].field_two - field_start_lines[k].line) * linsys_ctx->stride;
+        else
+            /* All non-VANC resolutions have an even height */
+            linsys_ctx->field_offset[1] = (linsys_ctx->coded_height / 2) * linsys_ctx->stride;
+    }
+    else
+    {
+        linsys_ctx->field_stride = 2 * linsys_ctx->stride;
+        linsys_ctx->field_offset[0] = 0;
+        linsys_ctx->field_offset[1] = linsys_ctx->stride;
+    }
+
+    linsys_ctx->num_vbuffers = linsys_opts->num_buffers ? linsys_opts->num_buffers : NB_VBUFFERS;
 
     if( write_ul_sysfs( SDIVIDEO_BUFFERS_FILE, linsys_opts->card_idx, linsys_ctx->num_vbuffers ) < 0 )
     {
@@ -1080,6 +1238,81 @@ finish:
     return ret;
 }
 
+/* If the encoder wants something other than 10-bit 4:2:2, unpack HD pictures straight to it.
+ * SD pictures go through the filter as the visible VBI lines have to be blanked there */
+static int setup_fused_unpack( linsys_opts_t *linsys_opts )
+{
+    linsys_ctx_t *linsys_ctx = &linsys_opts->linsys_ctx;
+    obe_t *h = linsys_ctx->h;
+    obe_output_stream_t *output_stream = NULL;
+    int input_stream_id = -1, csp, j;
+
+    if( IS_SD( linsys_opts->video_format ) )
+        return 0;
+
+    for( int i = 0; i < linsys_ctx->device->num_input_streams; i++ )
+    {
+        if( linsys_ctx->device->streams[i]->stream_format == VIDEO_UNCOMPRESSED )
+            input_stream_id = linsys_ctx->device->streams[i]->stream_id;
+    }
+
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        if( h->output_streams[i].input_stream_id == input_stream_id &&
+            ( h->output_streams[i].stream_format == VIDEO_AVC || h->output_streams[i].stream_format == VIDEO_HEVC ) )
+        {
+            output_stream = &h->output_streams[i];
+            break;
+        }
+    }
+
+    if( !output_stream )
+        return 0;
+
+    csp = output_stream->avc_param.i_csp & X264_CSP_MASK;
+    if( X264_BIT_DEPTH == 8 )
+        linsys_ctx->fused_csp = csp == X264_CSP_I420 ? PIX_FMT_YUV420P : PIX_FMT_YUV422P;
+    else if( csp == X264_CSP_I420 )
+        linsys_ctx->fused_csp = PIX_FMT_YUV420P10;
+    else
+        return 0;
+
+    if( linsys_ctx->has_vanc )
+    {
+        for( j = 0; first_active_line[j].format != -1; j++ )
+        {
+            if( linsys_opts->video_format == first_active_line[j].format )
+                break;
+        }
+
+        for( int line = 1; line != first_active_line[j].line; line = sdi_next_line( linsys_opts->video_format, line ) )
+            linsys_ctx->num_vanc_lines++;
+
+        if( av_image_alloc( linsys_ctx->vanc_img.plane, linsys_ctx->vanc_img.stride, linsys_ctx->width,
+                            linsys_ctx->num_vanc_lines + 1, PIX_FMT_YUV422P10, 16 ) < 0 )
+            goto fail;
+    }
+
+    /* Room for the unpack functions to write past the end of the line */
+    for( int i = 0; i < 4; i++ )
+    {
+        for( int k = 0; k < 3; k++ )
+        {
+            linsys_ctx->line_buf[i][k] = av_malloc( (FFALIGN( linsys_ctx->width, 48 ) + 32) * sizeof(uint16_t) );
+            if( !linsys_ctx->line_buf[i][k] )
+                goto fail;
+        }
+    }
+
+    linsys_ctx->fused = 1;
+
+    return 0;
+
+fail:
+    syslog( LOG_ERR, "Malloc failed\n" );
+    return -1;
+}
+
 static void *probe_stream( void *ptr )
 {
     obe_input_probe_t *probe_ctx = ptr;
@@ -1089,6 +1322,7 @@ static void *probe_stream( void *ptr )
     obe_int_input_stream_t *streams[MAX_STREAMS];
     int num_streams = 0, vbi_stream_services = 0;
     obe_sdi_non_display_data_t *non_display_parser;
+    char sysfs_dir[64];
 
     linsys_opts_t linsys_opts;
     memset( &linsys_opts, 0, sizeof(linsys_opts_t) );
@@ -1099,7 +1333,9 @@ static void *probe_stream( void *ptr )
     non_display_parser->teletext_location = user_opts->teletext_location;
     non_display_parser->wss_output = user_opts->wss_output;
 
+    linsys_opts.num_channels = 2;
     linsys_opts.audio_samples = 2000; /* not important yet when probing */
+    linsys_opts.linsys_ctx.probe_data_type_337m = -1;
 
     if( open_card( &linsys_opts ) < 0 )
         return NULL;
@@ -1158,6 +1394,19 @@ static void *probe_stream( void *ptr )
             streams[i]->sample_format = AV_SAMPLE_FMT_S32;
             /* TODO: support other sample rates */
             streams[i]->sample_rate = 48000;
+
+            if( linsys_opts.linsys_ctx.probe_data_type_337m >= 0 )
+            {
+                int stream_format = obe_337m_stream_format( linsys_opts.linsys_ctx.probe_data_type_337m );
+                if( stream_format >= 0 )
+                {
+                    streams[i]->stream_format = stream_format;
+                    streams[i]->is_337m = 1;
+                }
+                else
+                    syslog( LOG_WARNING, "[linsys-sdiaudio] SMPTE 337M data type %i can't be passed through, treating as PCM",
+                            linsys_opts.linsys_ctx.probe_data_type_337m );
+            }
         }
         else /* VBI stream */
         {
@@ -1179,6 +1428,8 @@ static void *probe_stream( void *ptr )
     device->num_input_streams = num_streams;
     memcpy( device->streams, streams, num_streams * sizeof(obe_int_input_stream_t**) );
     device->device_type = INPUT_DEVICE_LINSYS_SDI;
+    snprintf( sysfs_dir, sizeof(sysfs_dir), SDIVIDEO_PCI_DIR, user_opts->card_idx );
+    device->numa_node = obe_numa_node_of_device( sysfs_dir );
     memcpy( &device->user_opts, user_opts, sizeof(*user_opts) );
 
     /* add device */
@@ -1204,8 +1455,15 @@ static void *open_input( void *ptr )
 
     linsys_opts.num_channels = 2;
     linsys_opts.card_idx = user_opts->card_idx;
+    linsys_opts.num_buffers = user_opts->num_capture_buffers;
     linsys_opts.audio_samples = input->audio_samples;
 
+    if( linsys_opts.num_buffers < 0 || linsys_opts.num_buffers > MAX_CAPTURE_BUFFERS )
+    {
+        fprintf( stderr, "[linsys] Invalid number of capture buffers. Maximum is %i\n", MAX_CAPTURE_BUFFERS );
+        return NULL;
+    }
+
     linsys_ctx = &linsys_opts.linsys_ctx;
 
     linsys_ctx->device = device;
@@ -1219,8 +1477,44 @@ static void *open_input( void *ptr )
 
     /* TODO: wait for encoder */
 
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        if( device->streams[i]->stream_type == STREAM_TYPE_AUDIO )
+        {
+            linsys_ctx->audio_stream_id = device->streams[i]->stream_id;
+
+            /* open_card rounds this up to what the card can capture */
+            linsys_opts.num_channels = obe_audio_router_channels( device->streams[i], input->output_streams, input->num_output_streams );
+            if( linsys_opts.num_channels > OBE_MAX_CHANNELS )
+            {
+                fprintf( stderr, "[linsys-sdiaudio] Invalid audio channel selection\n" );
+                return NULL;
+            }
+
+            if( obe_337m_open( &linsys_ctx->smpte337m, h, device->streams[i], input->output_streams, input->num_output_streams ) < 0 )
+                return NULL;
+        }
+    }
+
     if( open_card( &linsys_opts ) < 0 )
+    {
+        obe_337m_close( &linsys_ctx->smpte337m );
         return NULL;
+    }
+
+    for( int i = 0; i < device->num_input_streams; i++ )
+    {
+        if( device->streams[i]->stream_type == STREAM_TYPE_AUDIO &&
+            obe_audio_router_open( &linsys_ctx->audio_router, h, device->streams[i], input->output_streams,
+                                   input->num_output_streams, linsys_opts.num_channels ) < 0 )
+        {
+            fprintf( stderr, "[linsys-sdiaudio] Invalid audio channel selection\n" );
+            goto end;
+        }
+    }
+
+    if( setup_fused_unpack( &linsys_opts ) < 0 )
+        goto end;
 
     while( 1 )
     {
@@ -1228,7 +1522,10 @@ static void *open_input( void *ptr )
             break;
     }
 
+end:
     close_card( &linsys_opts );
+    obe_337m_close( &linsys_ctx->smpte337m );
+    obe_audio_router_close( &linsys_ctx->audio_router );
 
     return NULL;
 }
@@ -46,6 +46,88 @@ void obe_v210_planar_unpack_c( const uint32_t *src, uint16_t *y, uint16_t *u, ui
     }
 }
 
+/* The kernel does whole multiples of align pixels, the rest of the line is done here */
+void obe_v210_planar_unpack_line( obe_v210_unpack_func_t unpack, int align, const uint32_t *src,
+                                  uint16_t *y, uint16_t *u, uint16_t *v, int width )
+{
+    uint32_t val = 0;
+    int w = ( width / align ) * align;
+
+    unpack( src, y, u, v, w );
+
+    if( w < width - 5 )
+    {
+        obe_v210_planar_unpack_c( src + (w << 1) / 3, y + w, u + (w >> 1), v + (w >> 1), 6 );
+        w += 6;
+    }
+
+    y += w;
+    u += w >> 1;
+    v += w >> 1;
+    src += (w << 1) / 3;
+
+    if( w < width - 1 )
+    {
+        READ_PIXELS( u, y, v );
+
+        val  = av_le2ne32( *src++ );
+        *y++ =  val & 0x3ff;
+    }
+
+    if( w < width - 3 )
+    {
+        *u++ = (val >> 10) & 0x3ff;
+        *y++ = (val >> 20) & 0x3ff;
+
+        val  = av_le2ne32( *src++ );
+        *v++ =  val & 0x3ff;
+        *y++ = (val >> 10) & 0x3ff;
+    }
+}
+
+/* Same scaling as the video filter's 10-bit to 8-bit dither */
+#define DITHER_10_TO_8(x, d) ((((x) + (d)) * 511) >> 11)
+
+void obe_v210_planar_unpack_8bit_c( const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width, const uint16_t *dither )
+{
+    uint32_t val;
+
+    for( int i = 0, c = 0; i < width - 5; i += 6, c += 3 )
+    {
+        val    = av_le2ne32( *src++ );
+        u[c]   = DITHER_10_TO_8(  val        & 0x3ff, dither[c&7] );
+        y[i]   = DITHER_10_TO_8( (val >> 10) & 0x3ff, dither[i&7] );
+        v[c]   = DITHER_10_TO_8( (val >> 20) & 0x3ff, dither[c&7] );
+
+        val    = av_le2ne32( *src++ );
+        y[i+1] = DITHER_10_TO_8(  val        & 0x3ff, dither[(i+1)&7] );
+        u[c+1] = DITHER_10_TO_8( (val >> 10) & 0x3ff, dither[(c+1)&7] );
+        y[i+2] = DITHER_10_TO_8( (val >> 20) & 0x3ff, dither[(i+2)&7] );
+
+        val    = av_le2ne32( *src++ );
+        v[c+1] = DITHER_10_TO_8(  val        & 0x3ff, dither[(c+1)&7] );
+        y[i+3] = DITHER_10_TO_8( (val >> 10) & 0x3ff, dither[(i+3)&7] );
+        u[c+2] = DITHER_10_TO_8( (val >> 20) & 0x3ff, dither[(c+2)&7] );
+
+        val    = av_le2ne32( *src++ );
+        y[i+4] = DITHER_10_TO_8(  val        & 0x3ff, dither[(i+4)&7] );
+        v[c+2] = DITHER_10_TO_8( (val >> 10) & 0x3ff, dither[(c+2)&7] );
+        y[i+5] = DITHER_10_TO_8( (val >> 20) & 0x3ff, dither[(i+5)&7] );
+    }
+}
+
+void obe_line_avg_10_c( uint16_t *a, uint16_t *b, uint16_t *dst, int width )
+{
+    for( int i = 0; i < width; i++ )
+        dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+void obe_line_avg_10_to_8_c( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither )
+{
+    for( int i = 0; i < width; i++ )
+        dst[i] = DITHER_10_TO_8( (a[i] + b[i] + 1) >> 1, dither[i&7] );
+}
+
 /* Convert v210 to the native HD-SDI pixel format. */
 void obe_v210_line_to_nv20_c( uint32_t *src, uint16_t *dst, int width )
 {
@@ -127,6 +209,25 @@ void obe_downscale_line_c( uint16_t *src, uint8_t *dst, int lines )
         dst[i] = src[i] >> 2;
 }
 
+/* The parser accepts 8-bit flags so anything from 0x3fc up counts */
+int obe_anc_flag_scan_c( const uint16_t *src, int len )
+{
+    for( int i = 0; i < len; i++ )
+    {
+        if( src[i] >= 0x3fc )
+            return 1;
+    }
+
+    return 0;
+}
+
+int obe_line_has_anc_flag( obe_anc_flag_scan_func_t scan, int step, const uint16_t *src, int len )
+{
+    int w = ( len / step ) * step;
+
+    return ( w && scan( src, w ) ) || obe_anc_flag_scan_c( src + w, len - w );
+}
+
 void obe_blank_line_nv20_c( uint16_t *dst, int width )
 {
     uint16_t *uv = dst + width;
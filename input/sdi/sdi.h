@@ -32,6 +32,9 @@
 /* In microseconds */
 #define SDI_MAX_DELAY 50000
 
+/* Returns nonzero if any of the len 10-bit words could be part of an ancillary data flag */
+typedef int (*obe_anc_flag_scan_func_t)( const uint16_t *src, int len );
+
 typedef struct
 {
     int line;
@@ -72,6 +75,16 @@ typedef struct
     AVCRC crc[257];
     AVCRC crc_broken[257];
 
+    /* Ancillary lines with no data flag are skipped without being packed or parsed */
+    obe_anc_flag_scan_func_t anc_flag_scan;
+    int anc_flag_step;
+
+    /* Packed 10-bit ancillary lines and their 8-bit copies for libzvbi, reused every frame.
+     * anc_line_stride is in bytes */
+    uint16_t *anc_buf;
+    int anc_line_stride;
+    uint8_t *vbi_buf;
+
     obe_device_t *device;
 } obe_sdi_non_display_data_t;
 
@@ -114,11 +127,19 @@ const static obe_line_number_t field_start_lines[] =
     { -1, -1 },
 };
 
+typedef void (*obe_v210_unpack_func_t)( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+
+/* Unpacks a whole line of v210 to planar 4:2:2 with any of the obe_v210_planar_unpack kernels */
+void obe_v210_planar_unpack_line( obe_v210_unpack_func_t unpack, int align, const uint32_t *src,
+                                  uint16_t *y, uint16_t *u, uint16_t *v, int width );
 void obe_v210_line_to_nv20_c( uint32_t *src, uint16_t *dst, int width );
 void obe_v210_line_to_uyvy_c( uint32_t *src, uint16_t *dst, int width );
 void obe_yuv422p10_line_to_nv20_c( uint16_t *y, uint16_t *u, uint16_t *v, uint16_t *dst, int width );
 void obe_yuv422p10_line_to_uyvy_c( uint16_t *y, uint16_t *u, uint16_t *v, uint16_t *dst, int width );
 void obe_downscale_line_c( uint16_t *src, uint8_t *dst, int lines );
+int obe_anc_flag_scan_c( const uint16_t *src, int len );
+/* Runs an anc_flag_scan kernel over the whole of a line */
+int obe_line_has_anc_flag( obe_anc_flag_scan_func_t scan, int step, const uint16_t *src, int len );
 void obe_blank_line_nv20_c( uint16_t *dst, int width );
 void obe_blank_line_uyvy_c( uint16_t *dst, int width );
 int add_non_display_services( obe_sdi_non_display_data_t *non_display_data, obe_int_input_stream_t *stream, int location );
@@ -30,8 +30,10 @@
 #define VIDEO_INDEX_CRC_POLY 0x1d
 #define VIDEO_INDEX_CRC_POLY_BROKEN 0x1c
 
-#define DVB_VBI_MAXIMUM_SIZE      65536
 #define DVB_VBI_UNIT_SIZE         44
+/* data_identifier, every slice as a data unit of at most 100 bytes and stuffing to the end of the TS packet
+ * This keeps the frames to a small size class of the buffer pool */
+#define DVB_VBI_MAXIMUM_SIZE      (1 + 100 * (2 + 100) + 184)
 #define DVB_VBI_PES_HEADER_SIZE   45
 
 #define DVB_VBI_DATA_IDENTIFIER   0x10
@@ -151,7 +153,7 @@ int decode_vbi( obe_sdi_non_display_data_t *non_display_data, uint8_t *lines, ob
     unsigned int decoded_lines; /* unsigned for libzvbi */
     vbi_sliced *sliced;
     obe_int_frame_data_t *tmp, *frame_data;
-    obe_user_data_t *tmp2, *user_data;
+    obe_user_data_t *user_data;
     int j, vbi_type, found;
 
     sliced = non_display_data->vbi_slices;
@@ -277,15 +279,12 @@ int decode_vbi( obe_sdi_non_display_data_t *non_display_data, uint8_t *lines, ob
                 /* Attach the caption data to the frame's user data */
                 if( !found )
                 {
-                    tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+1) * sizeof(*raw_frame->user_data) );
-                    if( !tmp2 )
+                    user_data = obe_frame_add_user_data( raw_frame, 1 );
+                    if( !user_data )
                         goto fail;
 
-                    raw_frame->user_data = tmp2;
-                    user_data = &raw_frame->user_data[raw_frame->num_user_data++];
-
                     user_data->len  = num_lines * 2;
-                    user_data->data = malloc( user_data->len );
+                    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
                     if( !user_data->data )
                         goto fail;
 
@@ -315,15 +314,12 @@ int decode_vbi( obe_sdi_non_display_data_t *non_display_data, uint8_t *lines, ob
                 if( !found && non_display_data->wss_output != WSS_OUTPUT_DVB_VBI )
                 {
                     /* Attach the WSS data to the frame's user data to be converted later to AFD */
-                    tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+1) * sizeof(*raw_frame->user_data) );
-                    if( !tmp2 )
+                    user_data = obe_frame_add_user_data( raw_frame, 1 );
+                    if( !user_data )
                         goto fail;
 
-                    raw_frame->user_data = tmp2;
-                    user_data = &raw_frame->user_data[raw_frame->num_user_data++];
-
                     user_data->len = 1;
-                    user_data->data = malloc( user_data->len );
+                    user_data->data = obe_frame_alloc( raw_frame, user_data->len );
                     if( !user_data->data )
                         goto fail;
 
@@ -371,7 +367,7 @@ int decode_video_index_information( obe_sdi_non_display_data_t *non_display_data
     /* Video index information is only in the chroma samples */
     uint8_t data[90] = {0};
     obe_int_frame_data_t *tmp, *frame_data;
-    obe_user_data_t *tmp2, *user_data;
+    obe_user_data_t *user_data;
 
     for( int i = 0; i < 90; i++ )
     {
@@ -417,13 +413,11 @@ int decode_video_index_information( obe_sdi_non_display_data_t *non_display_data
             if( check_active_non_display_data( raw_frame, USER_DATA_AFD ) )
                 return 0;
 
-            tmp2 = realloc( raw_frame->user_data, (raw_frame->num_user_data+1) * sizeof(*raw_frame->user_data) );
-            if( !tmp2 )
+            user_data = obe_frame_add_user_data( raw_frame, 1 );
+            if( !user_data )
                 goto fail;
 
-            raw_frame->user_data = tmp2;
-            user_data = &raw_frame->user_data[raw_frame->num_user_data++];
-            user_data->data = malloc( 1 );
+            user_data->data = obe_frame_alloc( raw_frame, 1 );
             if( !user_data->data )
                 goto fail;
 
@@ -506,12 +500,13 @@ static void write_stuffing( bs_t *s )
     }
 }
 
-static int encapsulate_dvb_vbi( obe_sdi_non_display_data_t *non_display_data )
+/* The PES data is written straight into a frame from the shared buffer pool */
+static int encapsulate_dvb_vbi( obe_t *h, obe_sdi_non_display_data_t *non_display_data )
 {
     bs_t s, t;
     int type = 0, j, skip, identifier, data_unit_id = 0, stuffing;
     uint8_t tmp[100];
-    non_display_data->dvb_vbi_frame = new_coded_frame( 0, DVB_VBI_MAXIMUM_SIZE );
+    non_display_data->dvb_vbi_frame = new_pooled_coded_frame( h, 0, DVB_VBI_MAXIMUM_SIZE );
     if( !non_display_data->dvb_vbi_frame )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -599,11 +594,11 @@ static int encapsulate_dvb_vbi( obe_sdi_non_display_data_t *non_display_data )
     return 0;
 }
 
-static int encapsulate_dvb_ttx( obe_sdi_non_display_data_t *non_display_data )
+static int encapsulate_dvb_ttx( obe_t *h, obe_sdi_non_display_data_t *non_display_data )
 {
     bs_t s;
 
-    non_display_data->dvb_ttx_frame = new_coded_frame( 0, DVB_VBI_MAXIMUM_SIZE );
+    non_display_data->dvb_ttx_frame = new_pooled_coded_frame( h, 0, DVB_VBI_MAXIMUM_SIZE );
     if( !non_display_data->dvb_ttx_frame )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
@@ -638,9 +633,11 @@ static int encapsulate_dvb_ttx( obe_sdi_non_display_data_t *non_display_data )
     return 0;
 }
 
+/* Both frames go to the mux together so it is woken once per video frame rather than once for each */
 int send_vbi_and_ttx( obe_t *h, obe_sdi_non_display_data_t *non_display_parser, obe_device_t *device, int64_t pts )
 {
-    int stream_id;
+    obe_coded_frame_t *frames[2];
+    int stream_id, num_frames = 0, num_queued, ret = 0;
 
     /* Send any DVB-VBI frames */
     if( non_display_parser->has_vbi_frame )
@@ -655,17 +652,12 @@ int send_vbi_and_ttx( obe_t *h, obe_sdi_non_display_data_t *non_display_parser,
 
         if( stream_id >= 0 )
         {
-            if( encapsulate_dvb_vbi( non_display_parser ) < 0 )
+            if( encapsulate_dvb_vbi( h, non_display_parser ) < 0 )
                 return -1;
 
             non_display_parser->dvb_vbi_frame->stream_id = stream_id;
             non_display_parser->dvb_vbi_frame->pts = pts;
-
-            if( add_to_mux_queue( h, non_display_parser->dvb_vbi_frame ) < 0 )
-            {
-                destroy_coded_frame( non_display_parser->dvb_ttx_frame );
-                return -1;
-            }
+            frames[num_frames++] = non_display_parser->dvb_vbi_frame;
         }
         non_display_parser->dvb_vbi_frame = NULL;
         non_display_parser->has_vbi_frame = 0;
@@ -684,21 +676,25 @@ int send_vbi_and_ttx( obe_t *h, obe_sdi_non_display_data_t *non_display_parser,
 
         if( stream_id >= 0 )
         {
-            if( encapsulate_dvb_ttx( non_display_parser ) < 0 )
-                return -1;
-
-            non_display_parser->dvb_ttx_frame->stream_id = stream_id;
-            non_display_parser->dvb_ttx_frame->pts = pts;
-
-            if( add_to_mux_queue( h, non_display_parser->dvb_ttx_frame ) < 0 )
+            if( encapsulate_dvb_ttx( h, non_display_parser ) < 0 )
+                ret = -1;
+            else
             {
-                destroy_coded_frame( non_display_parser->dvb_ttx_frame );
-                return -1;
+                non_display_parser->dvb_ttx_frame->stream_id = stream_id;
+                non_display_parser->dvb_ttx_frame->pts = pts;
+                frames[num_frames++] = non_display_parser->dvb_ttx_frame;
             }
         }
         non_display_parser->dvb_ttx_frame = NULL;
         non_display_parser->has_ttx_frame = 0;
     }
 
-    return 0;
+    if( !num_frames )
+        return ret;
+
+    num_queued = add_frames_to_mux_queue( h, frames, num_frames );
+    for( int i = num_queued; i < num_frames; i++ )
+        destroy_coded_frame( frames[i] );
+
+    return num_queued == num_frames ? ret : -1;
 }
@@ -8,6 +8,12 @@ v210_mult: dw 64,4,64,4,64,4,64,4
 v210_luma_shuf: db 8,9,0,1,2,3,12,13,4,5,6,7,-1,-1,-1,-1
 v210_chroma_shuf: db 0,1,8,9,6,7,-1,-1,2,3,4,5,12,13,-1,-1
 
+; (x*16352)>>16 == (x*511)>>11, the scaling used by the video filter's dither
+dither_mult: times 8 dw 16352
+
+; Words above this might be part of an ancillary data flag
+anc_flag_min: times 8 dw 0x3fb
+
 SECTION .text
 
 ; downscale_line( uint16_t *src, uint8_t *dst, int lines );
@@ -36,6 +42,64 @@ DOWNSCALE_line mmx
 INIT_XMM
 DOWNSCALE_line sse2
 
+; x86inc.asm predates YMM support so the AVX2 functions name their registers explicitly
+
+INIT_AVX
+cglobal downscale_line_avx2, 3,3
+    imul   r2d, 1440
+.loop
+    vmovdqu   ymm0, [r0]
+    vmovdqu   ymm1, [r0+32]
+    vpsrlw    ymm0, ymm0, 2
+    vpsrlw    ymm1, ymm1, 2
+    vpackuswb ymm0, ymm0, ymm1
+    vpermq    ymm0, ymm0, 0xd8
+    vmovdqu   [r1], ymm0
+
+    add    r0, 64
+    add    r1, 32
+    sub    r2d, 32
+    jg   .loop
+    vzeroupper
+    RET
+
+; anc_flag_scan( const uint16_t *src, int len )
+; Saturating subtraction leaves only the words from 0x3fc up, which are ORed together over the line
+
+INIT_XMM
+cglobal anc_flag_scan_sse2, 2,2
+    mova      m1, [anc_flag_min]
+    pxor      m2, m2
+.loop
+    movu      m0, [r0]
+    psubusw   m0, m1
+    por       m2, m0
+    add       r0, mmsize
+    sub       r1d, mmsize/2
+    jg        .loop
+    pxor      m0, m0
+    pcmpeqw   m2, m0
+    pmovmskb  eax, m2
+    xor       eax, 0xffff
+    RET
+
+INIT_AVX
+cglobal anc_flag_scan_avx2, 2,2
+    vbroadcasti128 ymm1, [anc_flag_min]
+    vpxor     ymm2, ymm2, ymm2
+.loop
+    vmovdqu   ymm0, [r0]
+    vpsubusw  ymm0, ymm0, ymm1
+    vpor      ymm2, ymm2, ymm0
+    add       r0, 32
+    sub       r1d, 16
+    jg        .loop
+    xor       eax, eax
+    vptest    ymm2, ymm2
+    setnz     al
+    vzeroupper
+    RET
+
 %macro v210_planar_unpack 2
 
 ; v210_planar_unpack(const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width)
@@ -87,3 +151,184 @@ INIT_XMM
 v210_planar_unpack aligned, ssse3
 INIT_AVX
 v210_planar_unpack aligned, avx
+
+; v210_planar_unpack_avx2(const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width)
+; Each lane unpacks 6 pixels exactly like the SSSE3 version, width must be a multiple of 12
+INIT_AVX
+cglobal v210_planar_unpack_avx2, 5, 5
+    movsxdifnidn r4, r4d
+    lea    r1, [r1+2*r4]
+    add    r2, r4
+    add    r3, r4
+    neg    r4
+
+    vbroadcasti128 ymm3, [v210_mult]
+    vbroadcasti128 ymm4, [v210_mask]
+    vbroadcasti128 ymm5, [v210_luma_shuf]
+    vbroadcasti128 ymm6, [v210_chroma_shuf]
+.loop
+    vmovdqu ymm0, [r0]
+
+    vpmullw ymm1, ymm0, ymm3
+    vpsrld  ymm0, ymm0, 10
+    vpsrlw  ymm1, ymm1, 6
+    vpand   ymm0, ymm0, ymm4
+
+    vshufps ymm2, ymm1, ymm0, 0x8d
+    vpshufb ymm2, ymm2, ymm5
+    vmovdqu [r1+2*r4], xmm2
+    vextracti128 [r1+2*r4+12], ymm2, 1
+
+    vshufps ymm1, ymm1, ymm0, 0xd8
+    vpshufb ymm1, ymm1, ymm6
+    vmovq   [r2+r4], xmm1
+    vmovhps [r3+r4], xmm1
+    vextracti128 xmm1, ymm1, 1
+    vmovq   [r2+r4+6], xmm1
+    vmovhps [r3+r4+6], xmm1
+
+    add r0, 32
+    add r4, 12
+    jl  .loop
+
+    vzeroupper
+    RET
+
+; v210_planar_unpack_8bit_avx2(const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width, const uint16_t *dither)
+; Unpacks and dithers to 8-bit in one pass. The dither pattern repeats every two samples so
+; the luma of both lanes lines up with it but the chroma of the upper lane is one sample out
+cglobal v210_planar_unpack_8bit_avx2, 6, 6
+    vbroadcasti128 ymm3, [v210_mult]
+    vbroadcasti128 ymm4, [v210_mask]
+    vbroadcasti128 ymm5, [v210_luma_shuf]
+    vbroadcasti128 ymm6, [v210_chroma_shuf]
+    vbroadcasti128 ymm7, [dither_mult]
+    vbroadcasti128 ymm8, [r5]
+    vpalignr       xmm9, xmm8, xmm8, 2
+    vinserti128    ymm9, ymm8, xmm9, 1
+.loop
+    vmovdqu ymm0, [r0]
+
+    vpmullw ymm1, ymm0, ymm3
+    vpsrld  ymm0, ymm0, 10
+    vpsrlw  ymm1, ymm1, 6
+    vpand   ymm0, ymm0, ymm4
+
+    vshufps ymm2, ymm1, ymm0, 0x8d
+    vpshufb ymm2, ymm2, ymm5
+    vpaddw  ymm2, ymm2, ymm8
+    vpmulhuw ymm2, ymm2, ymm7
+    vpackuswb ymm2, ymm2, ymm2
+    vmovq   [r1], xmm2
+    vextracti128 xmm2, ymm2, 1
+    vmovq   [r1+6], xmm2
+
+    vshufps ymm1, ymm1, ymm0, 0xd8
+    vpshufb ymm1, ymm1, ymm6
+    vpaddw  ymm1, ymm1, ymm9
+    vpmulhuw ymm1, ymm1, ymm7
+    vpackuswb ymm1, ymm1, ymm1
+    vmovd   [r2], xmm1
+    vpextrd [r3], xmm1, 1
+    vextracti128 xmm1, ymm1, 1
+    vmovd   [r2+3], xmm1
+    vpextrd [r3+3], xmm1, 1
+
+    add r0, 32
+    add r1, 12
+    add r2, 6
+    add r3, 6
+    sub r4d, 12
+    jg  .loop
+
+    vzeroupper
+    RET
+
+; line_avg_10( uint16_t *a, uint16_t *b, uint16_t *dst, int width )
+; Averages two 10-bit lines, width must be a multiple of 8
+
+%macro LINE_avg_10 1
+
+cglobal line_avg_10_%1, 4,4
+.loop
+    movu   m0, [r0]
+    movu   m1, [r1]
+    pavgw  m0, m1
+    movu   [r2], m0
+
+    add    r0, mmsize
+    add    r1, mmsize
+    add    r2, mmsize
+    sub    r3d, mmsize/2
+    jg   .loop
+    REP_RET
+%endmacro
+
+INIT_XMM
+LINE_avg_10 sse2
+
+INIT_AVX
+cglobal line_avg_10_avx2, 4,4
+.loop
+    vmovdqu ymm0, [r0]
+    vpavgw  ymm0, ymm0, [r1]
+    vmovdqu [r2], ymm0
+
+    add    r0, 32
+    add    r1, 32
+    add    r2, 32
+    sub    r3d, 16
+    jg   .loop
+    vzeroupper
+    RET
+
+; line_avg_10_to_8( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither )
+; Averages two 10-bit lines and dithers the result to 8-bit, width must be a multiple of 8
+; Passing the same line twice just dithers it
+
+%macro LINE_avg_10_to_8 1
+
+cglobal line_avg_10_to_8_%1, 5,5
+    movu   m2, [r4]
+    mova   m3, [dither_mult]
+    pxor   m4, m4
+.loop
+    movu     m0, [r0]
+    movu     m1, [r1]
+    pavgw    m0, m1
+    paddw    m0, m2
+    pmulhuw  m0, m3
+    packuswb m0, m4
+    movq   [r2], m0
+
+    add    r0, mmsize
+    add    r1, mmsize
+    add    r2, mmsize/2
+    sub    r3d, mmsize/2
+    jg   .loop
+    REP_RET
+%endmacro
+
+INIT_XMM
+LINE_avg_10_to_8 sse2
+
+INIT_AVX
+cglobal line_avg_10_to_8_avx2, 5,5
+    vbroadcasti128 ymm2, [r4]
+    vbroadcasti128 ymm3, [dither_mult]
+.loop
+    vmovdqu   ymm0, [r0]
+    vpavgw    ymm0, ymm0, [r1]
+    vpaddw    ymm0, ymm0, ymm2
+    vpmulhuw  ymm0, ymm0, ymm3
+    vpackuswb ymm0, ymm0, ymm0
+    vpermq    ymm0, ymm0, 0x08
+    vmovdqu   [r2], xmm0
+
+    add    r0, 32
+    add    r1, 32
+    add    r2, 16
+    sub    r3d, 16
+    jg   .loop
+    vzeroupper
+    RET
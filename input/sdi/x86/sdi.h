@@ -26,6 +26,11 @@
 
 void obe_downscale_line_mmx( uint16_t *src, uint8_t *dst, int lines );
 void obe_downscale_line_sse2( uint16_t *src, uint8_t *dst, int lines );
+void obe_downscale_line_avx2( uint16_t *src, uint8_t *dst, int lines );
+
+/* len must be a multiple of 8 (sse2) or 16 (avx2) */
+int obe_anc_flag_scan_sse2( const uint16_t *src, int len );
+int obe_anc_flag_scan_avx2( const uint16_t *src, int len );
 
 void obe_v210_planar_unpack_c( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
 
@@ -35,4 +40,20 @@ void obe_v210_planar_unpack_unaligned_avx( const uint32_t *src, uint16_t *y, uin
 void obe_v210_planar_unpack_aligned_ssse3( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
 void obe_v210_planar_unpack_aligned_avx( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
 
+/* width must be a multiple of 12 */
+void obe_v210_planar_unpack_avx2( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+
+/* Unpack straight to dithered 8-bit 4:2:2 */
+void obe_v210_planar_unpack_8bit_c( const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width, const uint16_t *dither );
+void obe_v210_planar_unpack_8bit_avx2( const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width, const uint16_t *dither );
+
+/* Vertical averaging for 4:2:0 output. width must be a multiple of 8 for the SIMD versions */
+void obe_line_avg_10_c( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_line_avg_10_sse2( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+void obe_line_avg_10_avx2( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+
+void obe_line_avg_10_to_8_c( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_line_avg_10_to_8_sse2( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+void obe_line_avg_10_to_8_avx2( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+
 #endif
@@ -0,0 +1,41 @@
+/*****************************************************************************
+ * monitor.h : OBE monitoring headers
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_MONITOR_H
+#define OBE_MONITOR_H
+
+/* Monitors only read the pipeline through obe_get_stats so they never take a pipeline mutex */
+typedef struct
+{
+    void* (*start_monitor)( void *ptr );
+} obe_monitor_func_t;
+
+typedef struct
+{
+    obe_t *h;
+    obe_snmp_opts_t snmp_opts;
+} obe_monitor_params_t;
+
+extern const obe_monitor_func_t snmp_monitor;
+
+#endif /* OBE_MONITOR_H */
@@ -0,0 +1,361 @@
+/*****************************************************************************
+ * snmp.c : SNMP (AgentX) monitoring
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "monitor/monitor.h"
+#include <sys/select.h>
+#include <net-snmp/net-snmp-config.h>
+#include <net-snmp/net-snmp-includes.h>
+#include <net-snmp/agent/net-snmp-agent-includes.h>
+
+/* Every request is answered from a fresh obe_get_stats. The agent thread
+ * is the only one touching the context so none of this needs locking. */
+
+#define MAX_SNMP_VARS 1024
+#define MAX_SUFFIX_LEN 4
+
+/* SCTE-HMS-MPEG-ENCODER-MIB::encoderInputMonVideoEntry */
+static const oid scte_video_entry_oid[] = { 1, 3, 6, 1, 4, 1, 5591, 1, 11, 5, 5, 1, 1, 2, 1, 1 };
+
+/* OBE-MONITOR-MIB::obeMonitorObjects. This sits in the net-snmp playpen until
+ * a private enterprise number is registered */
+static const oid obe_objects_oid[] = { 1, 3, 6, 1, 4, 1, 8072, 9999, 9999, 1, 1 };
+
+static const char * const stage_names[] = { "filter", "encode", "smoothing", "mux", "output" };
+
+typedef struct
+{
+    oid suffix[MAX_SUFFIX_LEN];
+    int suffix_len;
+
+    u_char type;
+    int64_t value;
+    const char *str;
+} obe_snmp_var_t;
+
+typedef struct obe_snmp_ctx_t obe_snmp_ctx_t;
+
+typedef struct
+{
+    obe_snmp_ctx_t *ctx;
+    const oid *root;
+    int root_len;
+    void (*build)( obe_snmp_ctx_t *ctx );
+} obe_snmp_tree_t;
+
+struct obe_snmp_ctx_t
+{
+    obe_t *h;
+    obe_stats_t stats;
+
+    int num_vars;
+    obe_snmp_var_t vars[MAX_SNMP_VARS];
+
+    /* Bitrate is measured by the agent over its one second tick */
+    int64_t last_sample_time;
+    int64_t last_bytes_sent[OBE_MAX_STATS_OUTPUTS];
+    int64_t bitrate[OBE_MAX_STATS_OUTPUTS];
+
+    /* Signal losses seen at the last read of each input, for intermittent lock */
+    int64_t last_signal_losses[OBE_MAX_STATS_INPUTS];
+
+    obe_snmp_tree_t trees[2];
+};
+
+static void add_var( obe_snmp_ctx_t *ctx, u_char type, int64_t value, const char *str, int suffix_len, ... )
+{
+    obe_snmp_var_t *var;
+    va_list args;
+
+    if( ctx->num_vars == MAX_SNMP_VARS )
+        return;
+
+    var = &ctx->vars[ctx->num_vars++];
+    var->type = type;
+    var->value = value;
+    var->str = str;
+    var->suffix_len = suffix_len;
+
+    va_start( args, suffix_len );
+    for( int i = 0; i < suffix_len; i++ )
+        var->suffix[i] = va_arg( args, int );
+    va_end( args );
+}
+
+/* Columns are added one after the other so the list is in lexicographic order */
+static void build_scte_tree( obe_snmp_ctx_t *ctx )
+{
+    obe_stats_t *stats = &ctx->stats;
+
+    for( int i = 0; i < stats->num_inputs; i++ )
+        add_var( ctx, ASN_UNSIGNED, 1, NULL, 2, 2, i+1 );
+
+    for( int i = 0; i < stats->num_inputs; i++ )
+        add_var( ctx, ASN_INTEGER, IS_SD( stats->inputs[i].video_format ) ? 4 : 5, NULL, 2, 4, i+1 );
+
+    /* locked(1), notLocked(2), intermittent(3) */
+    for( int i = 0; i < stats->num_inputs; i++ )
+    {
+        obe_input_stats_t *input = &stats->inputs[i];
+        int lock = input->signal_lock ? 1 : 2;
+
+        if( input->signal_lock && input->num_signal_losses != ctx->last_signal_losses[i] )
+            lock = 3;
+        ctx->last_signal_losses[i] = input->num_signal_losses;
+
+        add_var( ctx, ASN_INTEGER, lock, NULL, 2, 5, i+1 );
+    }
+}
+
+static void build_obe_tree( obe_snmp_ctx_t *ctx )
+{
+    obe_stats_t *stats = &ctx->stats;
+    int row;
+
+    /* Scalars */
+    add_var( ctx, ASN_INTEGER, stats->is_active ? 2 : 1, NULL, 2, 1, 0 );
+    add_var( ctx, ASN_COUNTER64, stats->num_dropped_frames, NULL, 2, 2, 0 );
+    add_var( ctx, ASN_COUNTER64, stats->num_frame_pool_drops, NULL, 2, 3, 0 );
+
+    /* obeLatencyTable */
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        add_var( ctx, ASN_OCTET_STR, 0, stage_names[i], 4, 4, 1, 2, i+1 );
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        add_var( ctx, ASN_COUNTER64, stats->latency[i].count, NULL, 4, 4, 1, 3, i+1 );
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        add_var( ctx, ASN_GAUGE, stats->latency[i].p50, NULL, 4, 4, 1, 4, i+1 );
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        add_var( ctx, ASN_GAUGE, stats->latency[i].p99, NULL, 4, 4, 1, 5, i+1 );
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+        add_var( ctx, ASN_GAUGE, stats->latency[i].max, NULL, 4, 4, 1, 6, i+1 );
+
+    /* obeVideoEncoderTable */
+    row = 1;
+    for( int i = 0; i < stats->num_encoders; i++ )
+        if( stats->encoders[i].is_video )
+            add_var( ctx, ASN_INTEGER, stats->encoders[i].stream_id, NULL, 4, 5, 1, 2, row++ );
+    row = 1;
+    for( int i = 0; i < stats->num_encoders; i++ )
+        if( stats->encoders[i].is_video )
+            add_var( ctx, ASN_INTEGER, stats->encoders[i].speedcontrol_fill, NULL, 4, 5, 1, 3, row++ );
+
+    /* obeOutputTable */
+    for( int i = 0; i < stats->num_outputs; i++ )
+        add_var( ctx, ASN_INTEGER, stats->outputs[i].type == OUTPUT_RTP ? 2 : 1, NULL, 4, 6, 1, 2, i+1 );
+    for( int i = 0; i < stats->num_outputs; i++ )
+        add_var( ctx, ASN_COUNTER64, stats->outputs[i].bytes_sent, NULL, 4, 6, 1, 3, i+1 );
+    for( int i = 0; i < stats->num_outputs; i++ )
+        add_var( ctx, ASN_GAUGE, ctx->bitrate[i], NULL, 4, 6, 1, 4, i+1 );
+
+    /* obeQueueTable */
+    for( int i = 0; i < stats->num_queues; i++ )
+        add_var( ctx, ASN_OCTET_STR, 0, stats->queues[i].name, 4, 7, 1, 2, i+1 );
+    for( int i = 0; i < stats->num_queues; i++ )
+        add_var( ctx, ASN_INTEGER, stats->queues[i].id, NULL, 4, 7, 1, 3, i+1 );
+    for( int i = 0; i < stats->num_queues; i++ )
+        add_var( ctx, ASN_GAUGE, stats->queues[i].depth, NULL, 4, 7, 1, 4, i+1 );
+    for( int i = 0; i < stats->num_queues; i++ )
+        add_var( ctx, ASN_GAUGE, stats->queues[i].capacity, NULL, 4, 7, 1, 5, i+1 );
+    for( int i = 0; i < stats->num_queues; i++ )
+        add_var( ctx, ASN_GAUGE, stats->queues[i].high_water, NULL, 4, 7, 1, 6, i+1 );
+    for( int i = 0; i < stats->num_queues; i++ )
+        add_var( ctx, ASN_COUNTER64, stats->queues[i].num_overflows, NULL, 4, 7, 1, 7, i+1 );
+}
+
+static void set_var_value( netsnmp_variable_list *vb, obe_snmp_var_t *var )
+{
+    if( var->type == ASN_OCTET_STR )
+        snmp_set_var_typed_value( vb, ASN_OCTET_STR, (const u_char*)var->str, strlen( var->str ) );
+    else if( var->type == ASN_COUNTER64 )
+    {
+        struct counter64 c64;
+        c64.high = (uint64_t)var->value >> 32;
+        c64.low = var->value & 0xffffffff;
+        snmp_set_var_typed_value( vb, ASN_COUNTER64, (const u_char*)&c64, sizeof(c64) );
+    }
+    else
+    {
+        /* Gauges saturate rather than wrap */
+        long value = var->type == ASN_GAUGE || var->type == ASN_UNSIGNED ? MIN( var->value, 0xffffffff ) : var->value;
+        snmp_set_var_typed_value( vb, var->type, (const u_char*)&value, sizeof(value) );
+    }
+}
+
+static int snmp_handler( netsnmp_mib_handler *handler, netsnmp_handler_registration *reginfo,
+                         netsnmp_agent_request_info *reqinfo, netsnmp_request_info *requests )
+{
+    obe_snmp_tree_t *tree = handler->myvoid;
+    obe_snmp_ctx_t *ctx = tree->ctx;
+    oid name[MAX_OID_LEN];
+    int name_len = tree->root_len + MAX_SUFFIX_LEN;
+
+    if( reqinfo->mode != MODE_GET && reqinfo->mode != MODE_GETNEXT )
+        return SNMP_ERR_NOERROR;
+
+    obe_get_stats( ctx->h, &ctx->stats );
+    ctx->num_vars = 0;
+    tree->build( ctx );
+
+    memcpy( name, tree->root, tree->root_len * sizeof(oid) );
+
+    for( netsnmp_request_info *request = requests; request; request = request->next )
+    {
+        netsnmp_variable_list *vb = request->requestvb;
+        obe_snmp_var_t *found = NULL;
+
+        if( request->processed )
+            continue;
+
+        for( int i = 0; i < ctx->num_vars; i++ )
+        {
+            int cmp;
+
+            memcpy( &name[tree->root_len], ctx->vars[i].suffix, ctx->vars[i].suffix_len * sizeof(oid) );
+            name_len = tree->root_len + ctx->vars[i].suffix_len;
+            cmp = snmp_oid_compare( name, name_len, vb->name, vb->name_length );
+
+            if( ( reqinfo->mode == MODE_GET && !cmp ) || ( reqinfo->mode == MODE_GETNEXT && cmp > 0 ) )
+            {
+                found = &ctx->vars[i];
+                break;
+            }
+        }
+
+        if( !found )
+        {
+            /* For GETNEXT the agent moves on to the next registered subtree */
+            if( reqinfo->mode == MODE_GET )
+                netsnmp_set_request_error( reqinfo, request, SNMP_NOSUCHINSTANCE );
+            else
+                vb->type = ASN_PRIV_RETRY;
+            continue;
+        }
+
+        if( reqinfo->mode == MODE_GETNEXT )
+            snmp_set_var_objid( vb, name, name_len );
+        set_var_value( vb, found );
+    }
+
+    return SNMP_ERR_NOERROR;
+}
+
+static int register_tree( obe_snmp_tree_t *tree, const char *name )
+{
+    netsnmp_handler_registration *reg;
+
+    reg = netsnmp_create_handler_registration( name, snmp_handler, tree->root, tree->root_len, HANDLER_CAN_RONLY );
+    if( !reg )
+        return -1;
+    reg->handler->myvoid = tree;
+
+    return netsnmp_register_handler( reg ) == MIB_REGISTERED_OK ? 0 : -1;
+}
+
+static void sample_bitrates( obe_snmp_ctx_t *ctx )
+{
+    obe_stats_t *stats = &ctx->stats;
+    int64_t now = obe_mdate();
+
+    obe_get_stats( ctx->h, stats );
+    if( ctx->last_sample_time )
+    {
+        for( int i = 0; i < stats->num_outputs; i++ )
+            ctx->bitrate[i] = (stats->outputs[i].bytes_sent - ctx->last_bytes_sent[i]) * 8 * 1000000 / (now - ctx->last_sample_time);
+    }
+
+    for( int i = 0; i < stats->num_outputs; i++ )
+        ctx->last_bytes_sent[i] = stats->outputs[i].bytes_sent;
+    ctx->last_sample_time = now;
+}
+
+static void *start_snmp( void *ptr )
+{
+    obe_monitor_params_t *monitor_params = ptr;
+    obe_t *h = monitor_params->h;
+    obe_snmp_ctx_t *ctx;
+
+    ctx = calloc( 1, sizeof(*ctx) );
+    if( !ctx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+    ctx->h = h;
+
+    /* Run as a subagent so access control and ports stay with the system snmpd */
+    netsnmp_ds_set_boolean( NETSNMP_DS_APPLICATION_ID, NETSNMP_DS_AGENT_ROLE, 1 );
+    if( monitor_params->snmp_opts.agentx_socket )
+        netsnmp_ds_set_string( NETSNMP_DS_APPLICATION_ID, NETSNMP_DS_AGENT_X_SOCKET, monitor_params->snmp_opts.agentx_socket );
+    snmp_enable_syslog();
+
+    if( init_agent( "obe" ) )
+    {
+        syslog( LOG_ERR, "[snmp] Could not initialise agent\n" );
+        goto end;
+    }
+
+    ctx->trees[0] = (obe_snmp_tree_t){ ctx, scte_video_entry_oid, OID_LENGTH( scte_video_entry_oid ), build_scte_tree };
+    ctx->trees[1] = (obe_snmp_tree_t){ ctx, obe_objects_oid, OID_LENGTH( obe_objects_oid ), build_obe_tree };
+    if( register_tree( &ctx->trees[0], "encoderInputMonVideoTable" ) < 0 ||
+        register_tree( &ctx->trees[1], "obeMonitorObjects" ) < 0 )
+    {
+        syslog( LOG_ERR, "[snmp] Could not register MIB handlers\n" );
+        snmp_shutdown( "obe" );
+        goto end;
+    }
+
+    init_snmp( "obe" );
+    syslog( LOG_INFO, "[snmp] AgentX subagent started\n" );
+
+    /* Wake up every second to measure the bitrate and check for cancellation */
+    while( !__atomic_load_n( &h->cancel_monitor_thread, __ATOMIC_ACQUIRE ) )
+    {
+        int num_fds = 0, block = 0, ret;
+        struct timeval timeout = { 1, 0 };
+        fd_set fds;
+
+        FD_ZERO( &fds );
+        snmp_select_info( &num_fds, &fds, &timeout, &block );
+        ret = select( num_fds, &fds, NULL, NULL, &timeout );
+        if( ret > 0 )
+            snmp_read( &fds );
+        else if( ret == 0 )
+            snmp_timeout();
+        run_alarms();
+        netsnmp_check_outstanding_agent_requests();
+
+        if( obe_mdate() - ctx->last_sample_time >= 1000000 )
+            sample_bitrates( ctx );
+    }
+
+    snmp_shutdown( "obe" );
+
+end:
+    if( ctx )
+        free( ctx );
+    free( monitor_params );
+
+    return NULL;
+}
+
+const obe_monitor_func_t snmp_monitor = { start_snmp };
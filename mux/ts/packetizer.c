@@ -0,0 +1,833 @@
+/*****************************************************************************
+ * packetizer.c : OBE built-in transport stream packetizer
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "common/crc.h"
+#include "mux/ts/packetizer.h"
+
+#define TS_PACKET_SIZE  188
+#define TS_PAYLOAD_SIZE 184
+#define TS_NULL_PID     0x1fff
+#define TS_CLOCK        27000000LL
+#define TS_PACKET_TICKS (TS_PACKET_SIZE * 8 * TS_CLOCK)
+
+#define PAT_PID         0x0000
+
+#define DEFAULT_PCR_PERIOD 35
+#define DEFAULT_PAT_PERIOD 100
+
+/* Frames waiting to be sent on each stream */
+#define MAX_PENDING_FRAMES 512
+/* Audio and teletext buffers in the T-STD are small so their frames go out shortly before they are decoded */
+#define NON_VIDEO_LEAD     (TS_CLOCK / 20)
+/* Never write more than this in one go, e.g. after a gap in the video */
+#define MAX_BURST          TS_CLOCK
+
+/* The PCR field ends 11 bytes into the packet */
+#define PCR_OFFSET_BYTES   11
+
+/* Sections are at most 1024 bytes so they need no more than six packets */
+#define MAX_SECTION_SIZE   1024
+#define MAX_PSI_PACKETS    6
+
+/* Teletext PES headers are padded out to 45 bytes (EN 300 472) */
+#define TTX_PES_HEADER_DATA_LENGTH 0x24
+
+typedef struct
+{
+    obe_coded_frame_t *coded_frame;
+    uint8_t *data;
+    int size;
+
+    uint8_t pes_header[64];
+    int pes_header_len;
+    /* Bytes of header and data sent so far */
+    int pos;
+
+    int64_t ready;
+    int64_t deadline;
+    int random_access;
+    int priority;
+} packetizer_frame_t;
+
+/* A table serialised and CRC'd once, sent again by copying its packets */
+typedef struct
+{
+    int pid;
+    int version;
+    int cc;
+    int built;
+
+    uint8_t section[MAX_SECTION_SIZE];
+    int section_len;
+
+    uint8_t packets[MAX_PSI_PACKETS][TS_PACKET_SIZE];
+    int num_packets;
+} packetizer_psi_t;
+
+typedef struct
+{
+    int pid;
+    int stream_format;
+    int stream_id;
+    int is_video;
+    int cc;
+
+    int write_lang_code;
+    char lang_code[4];
+    int audio_type;
+    int has_stream_identifier;
+    int stream_identifier;
+
+    int num_teletexts;
+    ts_dvb_ttx_t *teletexts;
+
+    /* Left out of the PMT. Frames already passed in are still sent */
+    int is_disabled;
+
+    packetizer_frame_t *frames;
+    int head;
+    int num_frames;
+} packetizer_stream_t;
+
+struct obe_ts_packetizer_t
+{
+    obe_t *h;
+
+    int muxrate;
+    int ts_id;
+    int program_num;
+    int pmt_pid;
+    int pcr_pid;
+    int64_t pcr_period;
+    int64_t pat_period;
+
+    int num_streams;
+    packetizer_stream_t streams[MAX_STREAMS];
+
+    obe_crc_t crc;
+
+    /* The PMT is sent straight after the PAT. psi_pos counts through the packets of both */
+    packetizer_psi_t pat;
+    packetizer_psi_t pmt;
+    int psi_pos;
+    int pcr_cc;
+
+    int started;
+    int64_t start_time;
+    int64_t num_packets;
+    int64_t next_pcr;
+    int64_t next_psi;
+    /* Packets are written up to the final arrival time of the newest video frame */
+    int64_t target;
+
+    int num_dropped;
+};
+
+static const int packetizer_stream_types[][2] =
+{
+    { LIBMPEGTS_VIDEO_MPEG2,    0x02 },
+    { LIBMPEGTS_VIDEO_AVC,      0x1b },
+    { LIBMPEGTS_AUDIO_MPEG1,    0x03 },
+    { LIBMPEGTS_AUDIO_MPEG2,    0x04 },
+    { LIBMPEGTS_AUDIO_ADTS,     0x0f },
+    { LIBMPEGTS_AUDIO_LATM,     0x11 },
+    { LIBMPEGTS_AUDIO_AC3,      0x06 },
+    { LIBMPEGTS_AUDIO_EAC3,     0x06 },
+    { LIBMPEGTS_DVB_TELETEXT,   0x06 },
+    { -1, -1 },
+};
+
+static int get_stream_type( int stream_format )
+{
+    for( int i = 0; packetizer_stream_types[i][0] != -1; i++ )
+    {
+        if( packetizer_stream_types[i][0] == stream_format )
+            return packetizer_stream_types[i][1];
+    }
+
+    return -1;
+}
+
+static int is_video_format( int stream_format )
+{
+    return stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_format == LIBMPEGTS_VIDEO_AVC;
+}
+
+static packetizer_stream_t *get_stream( obe_ts_packetizer_t *p, int pid )
+{
+    for( int i = 0; i < p->num_streams; i++ )
+    {
+        if( p->streams[i].pid == pid )
+            return &p->streams[i];
+    }
+
+    return NULL;
+}
+
+/* Packet k of the stream leaves at start_time + k * 188 * 8 / muxrate seconds */
+static int64_t get_packet_time( obe_ts_packetizer_t *p, int64_t k )
+{
+    return p->start_time + (k / p->muxrate) * TS_PACKET_TICKS + ((k % p->muxrate) * TS_PACKET_TICKS) / p->muxrate;
+}
+
+static void write_crc( const obe_crc_t *crc_func, uint8_t *section, int len )
+{
+    uint32_t crc = obe_crc32_mpeg( crc_func, section, len );
+
+    section[len]   = crc >> 24;
+    section[len+1] = crc >> 16;
+    section[len+2] = crc >> 8;
+    section[len+3] = crc;
+}
+
+/* Takes a newly built section without its CRC or version. Nothing is redone if the table hasn't changed,
+ * otherwise the version goes up so receivers pick up the new table. Returns 1 if the table changed */
+static int update_psi( const obe_crc_t *crc, packetizer_psi_t *psi, uint8_t *section, int len )
+{
+    uint8_t *pkt;
+    int pos = 0;
+
+    section[5] = 0xc1 | (psi->version << 1);
+    if( psi->built && psi->section_len == len + 4 && !memcmp( psi->section, section, len ) )
+        return 0;
+
+    if( psi->built )
+    {
+        psi->version = (psi->version + 1) & 0x1f;
+        section[5] = 0xc1 | (psi->version << 1);
+    }
+
+    memcpy( psi->section, section, len );
+    write_crc( crc, psi->section, len );
+    psi->section_len = len + 4;
+    psi->built = 1;
+
+    /* The first packet starts with the pointer_field and the last is stuffed with 0xff */
+    for( psi->num_packets = 0; pos < psi->section_len; psi->num_packets++ )
+    {
+        int first = !psi->num_packets;
+        int payload = MIN( psi->section_len - pos, TS_PAYLOAD_SIZE - first );
+
+        pkt = psi->packets[psi->num_packets];
+        memset( pkt, 0xff, TS_PACKET_SIZE );
+        pkt[0] = 0x47;
+        pkt[1] = (first ? 0x40 : 0) | (psi->pid >> 8);
+        pkt[2] = psi->pid & 0xff;
+        pkt[3] = 0x10;
+        if( first )
+            pkt[4] = 0; // pointer_field
+        memcpy( &pkt[4 + first], &psi->section[pos], payload );
+        pos += payload;
+    }
+
+    return 1;
+}
+
+static void build_pat( obe_ts_packetizer_t *p )
+{
+    uint8_t s[16];
+    int section_length = 5 + 4 + 4;
+
+    s[0] = 0x00;                              // table_id
+    s[1] = 0xb0 | (section_length >> 8);
+    s[2] = section_length & 0xff;
+    s[3] = p->ts_id >> 8;
+    s[4] = p->ts_id & 0xff;
+    s[6] = 0;                                 // section_number
+    s[7] = 0;                                 // last_section_number
+    s[8] = p->program_num >> 8;
+    s[9] = p->program_num & 0xff;
+    s[10] = 0xe0 | (p->pmt_pid >> 8);
+    s[11] = p->pmt_pid & 0xff;
+    update_psi( &p->crc, &p->pat, s, 12 );
+}
+
+static int write_es_descriptors( packetizer_stream_t *stream, uint8_t *d )
+{
+    uint8_t *start = d;
+
+    if( stream->write_lang_code )
+    {
+        *d++ = 0x0a; // ISO_639_language_descriptor
+        *d++ = 4;
+        memcpy( d, stream->lang_code, 3 );
+        d += 3;
+        *d++ = stream->audio_type;
+    }
+
+    if( stream->has_stream_identifier )
+    {
+        *d++ = 0x52; // stream_identifier_descriptor
+        *d++ = 1;
+        *d++ = stream->stream_identifier;
+    }
+
+    if( stream->stream_format == LIBMPEGTS_AUDIO_AC3 || stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
+    {
+        /* AC-3 or enhanced AC-3 descriptor with none of the optional fields */
+        *d++ = stream->stream_format == LIBMPEGTS_AUDIO_AC3 ? 0x6a : 0x7a;
+        *d++ = 1;
+        *d++ = 0;
+    }
+    else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT && stream->num_teletexts )
+    {
+        *d++ = 0x56; // teletext_descriptor
+        *d++ = 5 * stream->num_teletexts;
+        for( int i = 0; i < stream->num_teletexts; i++ )
+        {
+            ts_dvb_ttx_t *ttx = &stream->teletexts[i];
+            memcpy( d, ttx->dvb_teletext_lang_code, 3 );
+            d += 3;
+            *d++ = (ttx->dvb_teletext_type << 3) | (ttx->dvb_teletext_magazine_number & 0x7);
+            *d++ = ttx->dvb_teletext_page_number;
+        }
+    }
+
+    return d - start;
+}
+
+static int build_pmt( obe_ts_packetizer_t *p )
+{
+    uint8_t s[MAX_SECTION_SIZE];
+    uint8_t *es = &s[12];
+    int section_length;
+
+    for( int i = 0; i < p->num_streams; i++ )
+    {
+        packetizer_stream_t *stream = &p->streams[i];
+        uint8_t descriptors[MAX_SECTION_SIZE];
+        int es_info_length;
+
+        if( stream->is_disabled )
+            continue;
+
+        es_info_length = write_es_descriptors( stream, descriptors );
+
+        if( es + 5 + es_info_length + 4 > s + MAX_SECTION_SIZE )
+        {
+            syslog( LOG_ERR, "[ts-packetizer] PMT is too large\n" );
+            return -1;
+        }
+
+        es[0] = get_stream_type( stream->stream_format );
+        es[1] = 0xe0 | (stream->pid >> 8);
+        es[2] = stream->pid & 0xff;
+        es[3] = 0xf0 | (es_info_length >> 8);
+        es[4] = es_info_length & 0xff;
+        memcpy( &es[5], descriptors, es_info_length );
+        es += 5 + es_info_length;
+    }
+
+    section_length = (es - &s[3]) + 4;
+    s[0] = 0x02;                              // table_id
+    s[1] = 0xb0 | (section_length >> 8);
+    s[2] = section_length & 0xff;
+    s[3] = p->program_num >> 8;
+    s[4] = p->program_num & 0xff;
+    s[6] = 0;                                 // section_number
+    s[7] = 0;                                 // last_section_number
+    s[8] = 0xe0 | (p->pcr_pid >> 8);
+    s[9] = p->pcr_pid & 0xff;
+    s[10] = 0xf0;                             // program_info_length
+    s[11] = 0;
+    /* Send a changed table straight away rather than at the next repetition */
+    if( update_psi( &p->crc, &p->pmt, s, es - s ) )
+        p->next_psi = 0;
+
+    return 0;
+}
+
+int obe_ts_packetizer_supported( const ts_main_t *params )
+{
+    const ts_program_t *program = &params->programs[0];
+    int has_video = 0;
+
+    if( params->num_programs != 1 || !params->cbr || params->muxrate <= 0 || params->ts_type != TS_TYPE_GENERIC )
+        return -1;
+
+    if( program->is_3dtv || program->num_streams > MAX_STREAMS )
+        return -1;
+
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        if( get_stream_type( program->streams[i].stream_format ) < 0 )
+            return -1;
+        has_video |= is_video_format( program->streams[i].stream_format );
+    }
+
+    return has_video ? 0 : -1;
+}
+
+obe_ts_packetizer_t *obe_ts_packetizer_open( obe_t *h, const ts_main_t *params )
+{
+    const ts_program_t *program = &params->programs[0];
+    obe_ts_packetizer_t *p = calloc( 1, sizeof(*p) );
+    if( !p )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return NULL;
+    }
+
+    p->h = h;
+    p->muxrate = params->muxrate;
+    p->ts_id = params->ts_id;
+    p->program_num = program->program_num;
+    p->pmt_pid = program->pmt_pid;
+    p->pcr_pid = program->pcr_pid;
+    /* The counter before the first payload packet, which has 0 */
+    p->pcr_cc = 0xf;
+    p->pcr_period = (params->pcr_period ? params->pcr_period : DEFAULT_PCR_PERIOD) * (TS_CLOCK / 1000);
+    p->pat_period = (params->pat_period ? params->pat_period : DEFAULT_PAT_PERIOD) * (TS_CLOCK / 1000);
+
+    p->num_streams = program->num_streams;
+    for( int i = 0; i < p->num_streams; i++ )
+    {
+        const ts_stream_t *ts_stream = &program->streams[i];
+        packetizer_stream_t *stream = &p->streams[i];
+
+        stream->pid = ts_stream->pid;
+        stream->stream_format = ts_stream->stream_format;
+        stream->stream_id = ts_stream->stream_id;
+        stream->is_video = is_video_format( ts_stream->stream_format );
+        stream->write_lang_code = ts_stream->write_lang_code;
+        memcpy( stream->lang_code, ts_stream->lang_code, 4 );
+        stream->audio_type = ts_stream->audio_type;
+        stream->has_stream_identifier = ts_stream->has_stream_identifier;
+        stream->stream_identifier = ts_stream->stream_identifier;
+
+        stream->frames = calloc( MAX_PENDING_FRAMES, sizeof(*stream->frames) );
+        if( !stream->frames )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            goto fail;
+        }
+    }
+
+    obe_crc_init( &p->crc );
+    p->pat.pid = PAT_PID;
+    p->pmt.pid = p->pmt_pid;
+    build_pat( p );
+    if( build_pmt( p ) < 0 )
+        goto fail;
+
+    return p;
+
+fail:
+    obe_ts_packetizer_close( p );
+    return NULL;
+}
+
+int obe_ts_packetizer_setup_teletext( obe_ts_packetizer_t *p, int pid, int num_teletexts, const ts_dvb_ttx_t *teletexts )
+{
+    packetizer_stream_t *stream = get_stream( p, pid );
+    /* Each page takes five bytes of a descriptor */
+    if( !stream || stream->stream_format != LIBMPEGTS_DVB_TELETEXT || num_teletexts > 255 / 5 )
+        return -1;
+
+    free( stream->teletexts );
+    stream->teletexts = NULL;
+    stream->num_teletexts = 0;
+
+    if( num_teletexts )
+    {
+        stream->teletexts = malloc( num_teletexts * sizeof(*teletexts) );
+        if( !stream->teletexts )
+        {
+            syslog( LOG_ERR, "Malloc failed\n" );
+            return -1;
+        }
+        memcpy( stream->teletexts, teletexts, num_teletexts * sizeof(*teletexts) );
+        stream->num_teletexts = num_teletexts;
+    }
+
+    return build_pmt( p );
+}
+
+int obe_ts_packetizer_update_stream( obe_ts_packetizer_t *p, const ts_stream_t *ts_stream )
+{
+    packetizer_stream_t *stream = get_stream( p, ts_stream->pid );
+    if( !stream )
+        return -1;
+
+    stream->write_lang_code = ts_stream->write_lang_code;
+    memcpy( stream->lang_code, ts_stream->lang_code, 4 );
+    stream->audio_type = ts_stream->audio_type;
+    stream->has_stream_identifier = ts_stream->has_stream_identifier;
+    stream->stream_identifier = ts_stream->stream_identifier;
+
+    return build_pmt( p );
+}
+
+int obe_ts_packetizer_enable_stream( obe_ts_packetizer_t *p, int pid, int enable )
+{
+    packetizer_stream_t *stream = get_stream( p, pid );
+    /* The PCR is on the video pid */
+    if( !stream || ( stream->is_video && !enable ) )
+        return -1;
+
+    if( stream->is_disabled == !enable )
+        return 0;
+
+    stream->is_disabled = !enable;
+
+    return build_pmt( p );
+}
+
+static uint8_t *write_timestamp( uint8_t *b, int prefix, int64_t ts )
+{
+    ts &= 0x1ffffffffLL;
+    b[0] = (prefix << 4) | ((ts >> 29) & 0xe) | 1;
+    b[1] = ts >> 22;
+    b[2] = ((ts >> 14) & 0xfe) | 1;
+    b[3] = ts >> 7;
+    b[4] = ((ts << 1) & 0xfe) | 1;
+
+    return b + 5;
+}
+
+static int write_pes_header( packetizer_stream_t *stream, uint8_t *b, ts_frame_t *frame )
+{
+    int has_dts = stream->is_video && frame->dts != frame->pts;
+    int header_data_length = has_dts ? 10 : 5;
+    int pes_packet_length;
+    uint8_t *end;
+
+    if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+        header_data_length = TTX_PES_HEADER_DATA_LENGTH;
+
+    /* Video PES packets are unbounded */
+    pes_packet_length = 3 + header_data_length + frame->size;
+    if( stream->is_video || pes_packet_length > 0xffff )
+        pes_packet_length = 0;
+
+    b[0] = 0;
+    b[1] = 0;
+    b[2] = 1;
+    b[3] = stream->stream_id;
+    b[4] = pes_packet_length >> 8;
+    b[5] = pes_packet_length & 0xff;
+    b[6] = 0x84;                              // data_alignment_indicator
+    b[7] = has_dts ? 0xc0 : 0x80;
+    b[8] = header_data_length;
+
+    end = write_timestamp( &b[9], has_dts ? 3 : 2, frame->pts );
+    if( has_dts )
+        end = write_timestamp( end, 1, frame->dts );
+
+    while( end < &b[9 + header_data_length] )
+        *end++ = 0xff;
+
+    return end - b;
+}
+
+static int add_frame( obe_ts_packetizer_t *p, ts_frame_t *frame )
+{
+    packetizer_stream_t *stream = get_stream( p, frame->pid );
+    packetizer_frame_t *f;
+
+    if( !stream || stream->num_frames == MAX_PENDING_FRAMES )
+    {
+        if( !(p->num_dropped++ % 100) )
+            syslog( LOG_WARNING, "[ts-packetizer] Dropped frame on pid %i\n", frame->pid );
+        destroy_coded_frame( frame->opaque );
+        return -1;
+    }
+
+    f = &stream->frames[(stream->head + stream->num_frames) % MAX_PENDING_FRAMES];
+    f->coded_frame = frame->opaque;
+    f->data = frame->data;
+    f->size = frame->size;
+    f->pes_header_len = write_pes_header( stream, f->pes_header, frame );
+    f->pos = 0;
+    f->random_access = frame->random_access;
+    f->priority = frame->priority;
+
+    if( stream->is_video )
+    {
+        f->deadline = frame->cpb_final_arrival_time ? frame->cpb_final_arrival_time : frame->dts * 300;
+        f->ready = frame->cpb_initial_arrival_time;
+        if( f->deadline > p->target )
+            p->target = f->deadline;
+    }
+    else
+    {
+        f->deadline = frame->dts * 300;
+        f->ready = f->deadline - NON_VIDEO_LEAD;
+    }
+
+    stream->num_frames++;
+
+    return 0;
+}
+
+/* The ready stream whose next frame is due first */
+static packetizer_stream_t *get_next_stream( obe_ts_packetizer_t *p, int64_t t )
+{
+    packetizer_stream_t *next = NULL;
+    int64_t deadline = 0;
+
+    for( int i = 0; i < p->num_streams; i++ )
+    {
+        packetizer_stream_t *stream = &p->streams[i];
+        packetizer_frame_t *f = &stream->frames[stream->head];
+
+        if( !stream->num_frames || f->ready > t )
+            continue;
+
+        if( !next || f->deadline < deadline )
+        {
+            next = stream;
+            deadline = f->deadline;
+        }
+    }
+
+    return next;
+}
+
+static uint8_t *write_pcr( uint8_t *b, int64_t pcr )
+{
+    int64_t base = (pcr / 300) & 0x1ffffffffLL;
+    int ext = pcr % 300;
+
+    b[0] = base >> 25;
+    b[1] = base >> 17;
+    b[2] = base >> 9;
+    b[3] = base >> 1;
+    b[4] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+    b[5] = ext & 0xff;
+
+    return b + 6;
+}
+
+static void write_null_packet( uint8_t *pkt )
+{
+    pkt[0] = 0x47;
+    pkt[1] = TS_NULL_PID >> 8;
+    pkt[2] = TS_NULL_PID & 0xff;
+    pkt[3] = 0x10;
+    memset( &pkt[4], 0xff, TS_PAYLOAD_SIZE );
+}
+
+/* Adaptation field only, so it repeats the continuity counter of the last payload packet on the PID */
+static void write_pcr_packet( obe_ts_packetizer_t *p, uint8_t *pkt, int64_t pcr )
+{
+    pkt[0] = 0x47;
+    pkt[1] = p->pcr_pid >> 8;
+    pkt[2] = p->pcr_pid & 0xff;
+    pkt[3] = 0x20 | p->pcr_cc;
+    pkt[4] = TS_PAYLOAD_SIZE - 1;
+    pkt[5] = 0x10;                            // PCR_flag
+    write_pcr( &pkt[6], pcr );
+    memset( &pkt[12], 0xff, TS_PACKET_SIZE - 12 );
+}
+
+static void write_es_packet( obe_ts_packetizer_t *p, packetizer_stream_t *stream, uint8_t *pkt, int64_t pcr )
+{
+    packetizer_frame_t *f = &stream->frames[stream->head];
+    int remaining = f->pes_header_len + f->size - f->pos;
+    int start = !f->pos;
+    int af_flags = 0, af_length = 0, payload;
+    uint8_t *b;
+
+    if( pcr >= 0 )
+    {
+        af_flags |= 0x10;                     // PCR_flag
+        af_length = 8;
+    }
+    if( start && f->random_access )
+    {
+        af_flags |= 0x40;                     // random_access_indicator
+        af_length = MAX( af_length, 2 );
+    }
+
+    payload = MIN( remaining, TS_PAYLOAD_SIZE - af_length );
+    /* The last packet of a frame is stuffed out with the adaptation field */
+    af_length = TS_PAYLOAD_SIZE - payload;
+
+    pkt[0] = 0x47;
+    pkt[1] = (start ? 0x40 : 0) | (f->priority ? 0x20 : 0) | (stream->pid >> 8);
+    pkt[2] = stream->pid & 0xff;
+    pkt[3] = (af_length ? 0x30 : 0x10) | stream->cc;
+    if( stream->pid == p->pcr_pid )
+        p->pcr_cc = stream->cc;
+    stream->cc = (stream->cc + 1) & 0xf;
+
+    b = &pkt[4];
+    if( af_length )
+    {
+        uint8_t *af_end = b + af_length;
+        *b++ = af_length - 1;
+        if( af_length > 1 )
+        {
+            *b++ = af_flags;
+            if( af_flags & 0x10 )
+                b = write_pcr( b, pcr );
+            memset( b, 0xff, af_end - b );
+        }
+        b = af_end;
+    }
+
+    if( f->pos < f->pes_header_len )
+    {
+        int len = MIN( payload, f->pes_header_len - f->pos );
+        memcpy( b, &f->pes_header[f->pos], len );
+        b += len;
+        f->pos += len;
+        payload -= len;
+    }
+
+    memcpy( b, &f->data[f->pos - f->pes_header_len], payload );
+    f->pos += payload;
+
+    if( f->pos == f->pes_header_len + f->size )
+    {
+        destroy_coded_frame( f->coded_frame );
+        f->coded_frame = NULL;
+        stream->head = (stream->head + 1) % MAX_PENDING_FRAMES;
+        stream->num_frames--;
+    }
+}
+
+static void write_packet( obe_ts_packetizer_t *p, uint8_t *pkt, int64_t t )
+{
+    packetizer_stream_t *stream;
+    int64_t pcr = -1;
+
+    if( t >= p->next_psi && p->psi_pos >= p->pat.num_packets + p->pmt.num_packets )
+    {
+        p->psi_pos = 0;
+        p->next_psi = t + p->pat_period;
+    }
+
+    if( p->psi_pos < p->pat.num_packets + p->pmt.num_packets )
+    {
+        packetizer_psi_t *psi = p->psi_pos < p->pat.num_packets ? &p->pat : &p->pmt;
+        int i = p->psi_pos < p->pat.num_packets ? p->psi_pos : p->psi_pos - p->pat.num_packets;
+
+        memcpy( pkt, psi->packets[i], TS_PACKET_SIZE );
+        pkt[3] = 0x10 | psi->cc;
+        psi->cc = (psi->cc + 1) & 0xf;
+        p->psi_pos++;
+        return;
+    }
+
+    stream = get_next_stream( p, t );
+
+    if( t >= p->next_pcr )
+    {
+        packetizer_stream_t *pcr_stream = get_stream( p, p->pcr_pid );
+
+        pcr = t + (PCR_OFFSET_BYTES * 8 * TS_CLOCK) / p->muxrate;
+        p->next_pcr = t + p->pcr_period;
+
+        /* The PCR goes in the PCR stream's next packet if it has one, otherwise in a packet of its own */
+        if( pcr_stream && pcr_stream->num_frames && pcr_stream->frames[pcr_stream->head].ready <= t )
+            stream = pcr_stream;
+        else
+        {
+            write_pcr_packet( p, pkt, pcr );
+            return;
+        }
+    }
+
+    if( stream )
+        write_es_packet( p, stream, pkt, pcr );
+    else
+        write_null_packet( pkt );
+}
+
+int obe_ts_packetizer_write( obe_ts_packetizer_t *p, ts_frame_t *frames, int num_frames, obe_muxed_data_t **muxed_data )
+{
+    obe_muxed_data_t *out;
+    int64_t end, t;
+    int num_packets;
+
+    *muxed_data = NULL;
+
+    for( int i = 0; i < num_frames; i++ )
+        add_frame( p, &frames[i] );
+
+    if( !p->target )
+        return 0;
+
+    if( !p->started )
+    {
+        /* Start with the first frame that can go out, so every frame before the first video is sent in time */
+        p->start_time = p->target;
+        for( int i = 0; i < p->num_streams; i++ )
+        {
+            packetizer_stream_t *stream = &p->streams[i];
+            if( stream->num_frames && stream->frames[stream->head].ready < p->start_time )
+                p->start_time = stream->frames[stream->head].ready;
+        }
+        p->start_time = MAX( p->start_time, p->target - MAX_BURST );
+        p->next_psi = p->next_pcr = p->start_time;
+        p->psi_pos = p->pat.num_packets + p->pmt.num_packets;
+        p->started = 1;
+    }
+
+    /* Enough packets for the newest video frame to have arrived */
+    t = get_packet_time( p, p->num_packets );
+    if( p->target <= t )
+        return 0;
+
+    end = MIN( p->target, t + MAX_BURST );
+    num_packets = ((end - t) * p->muxrate + TS_PACKET_TICKS - 1) / TS_PACKET_TICKS;
+    while( get_packet_time( p, p->num_packets + num_packets ) < end )
+        num_packets++;
+
+    out = new_pooled_muxed_data( p->h, num_packets * TS_PACKET_SIZE );
+    if( !out )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < num_packets; i++ )
+    {
+        t = get_packet_time( p, p->num_packets++ );
+        write_packet( p, &out->data[i * TS_PACKET_SIZE], t );
+        out->pcr_list[i] = t;
+    }
+
+    *muxed_data = out;
+
+    return 0;
+}
+
+void obe_ts_packetizer_close( obe_ts_packetizer_t *p )
+{
+    for( int i = 0; i < p->num_streams; i++ )
+    {
+        packetizer_stream_t *stream = &p->streams[i];
+
+        for( int j = 0; j < stream->num_frames; j++ )
+            destroy_coded_frame( stream->frames[(stream->head + j) % MAX_PENDING_FRAMES].coded_frame );
+
+        free( stream->frames );
+        free( stream->teletexts );
+    }
+
+    free( p );
+}
@@ -0,0 +1,51 @@
+/*****************************************************************************
+ * packetizer.h : OBE built-in transport stream packetizer
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_MUX_TS_PACKETIZER_H
+#define OBE_MUX_TS_PACKETIZER_H
+
+#include <libmpegts.h>
+
+/* A CBR single program packetizer for the common streams (AVC, MPEG audio, AAC, (E-)AC-3 and teletext).
+ * Packets are written straight into pooled muxed data with the PCR of every packet filled in as it goes.
+ * The stream layout is described with the same structures as libmpegts, which handles everything else */
+typedef struct obe_ts_packetizer_t obe_ts_packetizer_t;
+
+/* Returns 0 if the packetizer can carry the transport stream described by params */
+int obe_ts_packetizer_supported( const ts_main_t *params );
+
+obe_ts_packetizer_t *obe_ts_packetizer_open( obe_t *h, const ts_main_t *params );
+/* Same as ts_setup_dvb_teletext */
+int obe_ts_packetizer_setup_teletext( obe_ts_packetizer_t *p, int pid, int num_teletexts, const ts_dvb_ttx_t *teletexts );
+/* Changes the language and stream identifier of the stream on stream->pid.
+ * These can be called between writes, the PMT gets a new version only if it actually changed */
+int obe_ts_packetizer_update_stream( obe_ts_packetizer_t *p, const ts_stream_t *stream );
+/* Takes the stream on pid out of the PMT or puts it back. The video stream can't be disabled */
+int obe_ts_packetizer_enable_stream( obe_ts_packetizer_t *p, int pid, int enable );
+
+/* The packetizer owns the coded frames in opaque from here on and destroys them once they are sent.
+ * frames must be in DTS order. *muxed_data is NULL if there was nothing to send yet */
+int obe_ts_packetizer_write( obe_ts_packetizer_t *p, ts_frame_t *frames, int num_frames, obe_muxed_data_t **muxed_data );
+void obe_ts_packetizer_close( obe_ts_packetizer_t *p );
+
+#endif
@@ -23,6 +23,7 @@
 
 #include "common/common.h"
 #include "mux/mux.h"
+#include "mux/ts/packetizer.h"
 #include <libmpegts.h>
 
 #define MIN_PID 0x30
@@ -32,6 +33,9 @@ static const int mpegts_stream_info[][3] =
 {
     { VIDEO_AVC,   LIBMPEGTS_VIDEO_AVC,      LIBMPEGTS_STREAM_ID_MPEGVIDEO },
     { VIDEO_MPEG2, LIBMPEGTS_VIDEO_MPEG2,    LIBMPEGTS_STREAM_ID_MPEGVIDEO },
+#ifdef LIBMPEGTS_VIDEO_HEVC
+    { VIDEO_HEVC,  LIBMPEGTS_VIDEO_HEVC,     LIBMPEGTS_STREAM_ID_MPEGVIDEO },
+#endif
     /* TODO 302M */
     { AUDIO_MP2,   LIBMPEGTS_AUDIO_MPEG2,    LIBMPEGTS_STREAM_ID_MPEGAUDIO },
     { AUDIO_AC_3,  LIBMPEGTS_AUDIO_AC3,      LIBMPEGTS_STREAM_ID_PRIVATE_1 },
@@ -63,52 +67,135 @@ static const int avc_profiles[][2] =
     { 0, 0 },
 };
 
-static obe_output_stream_t *get_output_mux_stream( obe_mux_params_t *mux_params, int stream_id )
+/* Every input device becomes one program of the transport stream */
+typedef struct
 {
-    for( int i = 0; i < mux_params->num_output_streams; i++ )
+    obe_device_t *device;
+    int video_pid;
+    int width;
+    int height;
+
+    int64_t first_video_pts;
+    int64_t first_video_real_pts;
+    int video_found;
+    int64_t video_dts;
+} obe_mux_program_t;
+
+/* The front frame of each stream's mux queue, keyed by the DTS it is muxed at */
+typedef struct
+{
+    int64_t dts;
+    int queue;
+} obe_mux_heap_entry_t;
+
+static void mux_heap_push( obe_mux_heap_entry_t *heap, int *size, int64_t dts, int queue )
+{
+    int i = (*size)++;
+
+    while( i && heap[(i-1)/2].dts > dts )
     {
-        if( mux_params->output_streams[i].stream_id == stream_id )
-            return &mux_params->output_streams[i];
+        heap[i] = heap[(i-1)/2];
+        i = (i-1)/2;
     }
-    return NULL;
+    heap[i].dts = dts;
+    heap[i].queue = queue;
+}
+
+static obe_mux_heap_entry_t mux_heap_pop( obe_mux_heap_entry_t *heap, int *size )
+{
+    obe_mux_heap_entry_t top = heap[0], last = heap[--(*size)];
+    int i = 0, child;
+
+    while( ( child = 2*i+1 ) < *size )
+    {
+        if( child+1 < *size && heap[child+1].dts < heap[child].dts )
+            child++;
+        if( last.dts <= heap[child].dts )
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return top;
+}
+
+/* Everything but video is timed from the program's first video frame */
+static int64_t get_mux_dts( obe_mux_program_t *mux_program, obe_coded_frame_t *coded_frame )
+{
+    if( coded_frame->is_video )
+        return coded_frame->real_dts;
+
+    return coded_frame->pts - mux_program->first_video_pts + mux_program->first_video_real_pts;
 }
 
 static void encoder_wait( obe_t *h, int stream_id )
 {
-    /* Wait for encoder to be ready */
+    /* Wait for encoder to be ready. The encoders all open at once in their own threads
+     * so this only waits for the slowest one */
     obe_encoder_t *encoder = get_encoder( h, stream_id );
     pthread_mutex_lock( &encoder->encoder_mutex );
-    if( !encoder->is_ready )
+    while( !encoder->is_ready )
         pthread_cond_wait( &encoder->encoder_cv, &encoder->encoder_mutex );
     pthread_mutex_unlock( &encoder->encoder_mutex );
 }
 
+/* Hands the stream metadata changed by obe_update_stream to the packetizer. Called with the mux mutex held */
+static int update_packetizer_streams( obe_t *h, obe_ts_packetizer_t *packetizer, obe_mux_params_t *mux_params )
+{
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
+    {
+        obe_output_stream_t *output_stream = &mux_params->output_streams[i];
+        obe_int_input_stream_t *input_stream = get_input_stream( h, output_stream->input_stream_id );
+        ts_stream_t stream = {0};
+
+        stream.pid = output_stream->ts_opts.pid;
+        if( input_stream->stream_type == STREAM_TYPE_AUDIO )
+        {
+            stream.write_lang_code = !!strlen( output_stream->ts_opts.lang_code );
+            memcpy( stream.lang_code, output_stream->ts_opts.lang_code, 4 );
+            stream.audio_type = output_stream->ts_opts.audio_type;
+        }
+        stream.has_stream_identifier = output_stream->ts_opts.has_stream_identifier;
+        stream.stream_identifier = output_stream->ts_opts.stream_identifier;
+
+        if( obe_ts_packetizer_update_stream( packetizer, &stream ) < 0 ||
+            obe_ts_packetizer_enable_stream( packetizer, stream.pid, !output_stream->ts_opts.is_disabled ) < 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
 void *open_muxer( void *ptr )
 {
     obe_mux_params_t *mux_params = ptr;
     obe_t *h = mux_params->h;
     obe_mux_opts_t *mux_opts = &h->mux_opts;
     int cur_pid = MIN_PID;
-    int stream_format, video_pid = 0, video_found = 0, width = 0,
-    height = 0, has_dds = 0, len = 0, num_frames = 0;
+    int stream_format, video_found = 0, has_dds = 0, len = 0, num_frames = 0, num_programs = 0;
     uint8_t *output;
-    int64_t first_video_pts = -1, video_dts, first_video_real_pts = -1;
     int64_t *pcr_list;
+    int64_t arrival_time;
     ts_writer_t *w;
     ts_main_t params = {0};
-    ts_program_t program = {0};
+    ts_program_t programs[MAX_DEVICES] = {{0}};
+    obe_mux_program_t mux_programs[MAX_DEVICES] = {{0}};
+    obe_mux_program_t *mux_program;
+    ts_program_t *program;
+    int *stream_programs = NULL;
     ts_stream_t *stream;
     ts_dvb_sub_t subtitles;
     ts_dvb_vbi_t *vbi_services;
-    ts_frame_t *frames;
+    ts_frame_t *frames = NULL;
     obe_int_input_stream_t *input_stream;
     obe_output_stream_t *output_stream;
     obe_encoder_t *encoder;
     obe_muxed_data_t *muxed_data;
-
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_RR, &param );
+    obe_coded_frame_t *coded_frame;
+    obe_mux_heap_entry_t *heap = NULL, top;
+    obe_ts_packetizer_t *packetizer = NULL;
+    int heap_size, max_frames = 0, ret, stream_update = -1;
 
     // TODO sanity check the options
 
@@ -127,41 +214,77 @@ void *open_muxer( void *ptr )
         return NULL;
     }
 
-    params.num_programs = 1;
-    params.programs = &program;
-    program.is_3dtv = !!mux_opts->is_3dtv;
-    // TODO more mux opts
-
-    program.streams = calloc( mux_params->num_output_streams, sizeof(*program.streams) );
-    if( !program.streams )
+    /* Group the streams into programs by the device they come from */
+    stream_programs = malloc( mux_params->num_output_streams * sizeof(*stream_programs) );
+    if( !stream_programs )
     {
         fprintf( stderr, "malloc failed\n" );
         goto end;
     }
 
-    program.num_streams = mux_params->num_output_streams;
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
+    {
+        obe_device_t *device = get_input_device( h, mux_params->output_streams[i].input_stream_id );
+        int j = 0;
 
-    if( mux_opts->passthrough )
+        while( j < num_programs && mux_programs[j].device != device )
+            j++;
+
+        if( j == num_programs )
+        {
+            mux_programs[j].device = device;
+            mux_programs[j].first_video_pts = mux_programs[j].first_video_real_pts = -1;
+            num_programs++;
+        }
+
+        stream_programs[i] = j;
+        programs[j].num_streams++;
+    }
+
+    params.num_programs = num_programs;
+    params.programs = programs;
+    // TODO more mux opts
+
+    for( int i = 0; i < num_programs; i++ )
     {
-        /* TODO lock when we can add multiple devices */
-        params.ts_id = h->devices[0]->ts_id;
-        program.program_num = h->devices[0]->program_num;
-        program.pmt_pid = h->devices[0]->pmt_pid;
-        program.pcr_pid = h->devices[0]->pcr_pid;
+        program = &programs[i];
+        program->is_3dtv = !!mux_opts->is_3dtv;
+        program->streams = calloc( program->num_streams, sizeof(*program->streams) );
+        if( !program->streams )
+        {
+            fprintf( stderr, "malloc failed\n" );
+            goto end;
+        }
+        /* Filled in again as the streams are set up */
+        program->num_streams = 0;
+
+        if( mux_opts->passthrough )
+        {
+            program->program_num = mux_programs[i].device->program_num;
+            program->pmt_pid = mux_programs[i].device->pmt_pid;
+            program->pcr_pid = mux_programs[i].device->pcr_pid;
+        }
+        else
+        {
+            /* The user's program number and PMT PID are for the first program, the others follow on */
+            program->program_num = ( mux_opts->program_num ? mux_opts->program_num : 1 ) + i;
+            program->pmt_pid = mux_opts->pmt_pid && !i ? mux_opts->pmt_pid : cur_pid++;
+            /* PCR PID is done later once we know the video pid */
+        }
     }
+
+    if( mux_opts->passthrough )
+        params.ts_id = h->devices[0]->ts_id;
     else
-    {
         params.ts_id = mux_opts->ts_id ? mux_opts->ts_id : 1;
-        program.program_num = mux_opts->program_num ? mux_opts->program_num : 1;
-        program.pmt_pid = mux_opts->pmt_pid ? mux_opts->pmt_pid : cur_pid++;
-        /* PCR PID is done later once we know the video pid */
-    }
 
-    for( int i = 0; i < program.num_streams; i++ )
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
     {
-        stream = &program.streams[i];
+        mux_program = &mux_programs[stream_programs[i]];
+        program = &programs[stream_programs[i]];
+        stream = &program->streams[program->num_streams++];
         output_stream = &mux_params->output_streams[i];
-        input_stream = get_input_stream( h, output_stream->stream_id );
+        input_stream = get_input_stream( h, output_stream->input_stream_id );
 
         if( output_stream->stream_action == STREAM_ENCODE )
             stream_format = output_stream->stream_format;
@@ -172,6 +295,12 @@ void *open_muxer( void *ptr )
         while( mpegts_stream_info[j][0] != -1 && stream_format != mpegts_stream_info[j][0] )
             j++;
 
+        if( stream_format == VIDEO_HEVC && mpegts_stream_info[j][0] == -1 )
+        {
+            fprintf( stderr, "[ts] libmpegts is too old for HEVC\n" );
+            goto end;
+        }
+
         /* OBE does not distinguish between ADTS and LATM but MPEG-TS does */
         if( stream_format == AUDIO_AAC && ( ( output_stream->stream_action == STREAM_PASSTHROUGH && input_stream->is_latm ) ||
             ( output_stream->stream_action == STREAM_ENCODE && output_stream->aac_opts.latm_output ) ) )
@@ -204,13 +333,18 @@ void *open_muxer( void *ptr )
             stream->stream_identifier = output_stream->ts_opts.stream_identifier;
         }
 
-        if( stream_format == VIDEO_AVC )
+        if( input_stream->stream_type == STREAM_TYPE_VIDEO )
         {
-            encoder_wait( h, output_stream->stream_id );
+            if( output_stream->stream_action == STREAM_ENCODE )
+                encoder_wait( h, output_stream->stream_id );
 
-            width = output_stream->avc_param.i_width;
-            height = output_stream->avc_param.i_height;
-            video_pid = stream->pid;
+            /* With several renditions of the same picture the first one carries the PCR */
+            if( !mux_program->video_pid )
+            {
+                mux_program->width = output_stream->stream_action == STREAM_ENCODE ? output_stream->avc_param.i_width : input_stream->width;
+                mux_program->height = output_stream->stream_action == STREAM_ENCODE ? output_stream->avc_param.i_height : input_stream->height;
+                mux_program->video_pid = stream->pid;
+            }
         }
         else if( stream_format == AUDIO_MP2 )
             stream->audio_frame_size = (double)MP2_NUM_SAMPLES * 90000LL * output_stream->ts_opts.frames_per_pes / input_stream->sample_rate;
@@ -220,15 +354,24 @@ void *open_muxer( void *ptr )
             stream->audio_frame_size = (double)AAC_NUM_SAMPLES * 90000LL / input_stream->sample_rate;
         else if( stream_format == AUDIO_E_AC_3 )
         {
-            encoder_wait( h, output_stream->stream_id );
-            encoder = get_encoder( h, output_stream->stream_id );
-            stream->audio_frame_size = (double)encoder->num_samples * 90000LL / input_stream->sample_rate;
+            /* SMPTE 337M bursts of E-AC-3 carry six blocks, the same as AC-3 */
+            if( output_stream->stream_action == STREAM_PASSTHROUGH )
+                stream->audio_frame_size = (double)AC3_NUM_SAMPLES * 90000LL / input_stream->sample_rate;
+            else
+            {
+                encoder_wait( h, output_stream->stream_id );
+                encoder = get_encoder( h, output_stream->stream_id );
+                stream->audio_frame_size = (double)encoder->num_samples * 90000LL / input_stream->sample_rate;
+            }
         }
     }
 
     /* Video stream isn't guaranteed to be first so populate program parameters here */
     if( !mux_opts->passthrough )
-        program.pcr_pid = mux_opts->pcr_pid ? mux_opts->pcr_pid : video_pid;
+    {
+        for( int i = 0; i < num_programs; i++ )
+            programs[i].pcr_pid = mux_opts->pcr_pid && !i ? mux_opts->pcr_pid : mux_programs[i].video_pid;
+    }
 
     if( ts_setup_transport_stream( w, &params ) < 0 )
     {
@@ -236,12 +379,32 @@ void *open_muxer( void *ptr )
         goto end;
     }
 
+    if( mux_opts->internal_packetizer )
+    {
+        if( obe_ts_packetizer_supported( &params ) < 0 )
+            syslog( LOG_WARNING, "[ts] Internal packetizer does not support this stream, using libmpegts\n" );
+        else
+        {
+            packetizer = obe_ts_packetizer_open( h, &params );
+            if( !packetizer )
+            {
+                fprintf( stderr, "[ts] Could not open internal packetizer\n" );
+                goto end;
+            }
+
+            /* Passthrough copies the metadata of the input streams */
+            pthread_mutex_lock( &h->mux_mutex );
+            h->can_update_psi = !mux_opts->passthrough;
+            pthread_mutex_unlock( &h->mux_mutex );
+        }
+    }
+
     /* setup any streams if necessary */
-    for( int i = 0; i < program.num_streams; i++ )
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
     {
-        stream = &program.streams[i];
+        mux_program = &mux_programs[stream_programs[i]];
         output_stream = &mux_params->output_streams[i];
-        input_stream = get_input_stream( h, output_stream->stream_id );
+        input_stream = get_input_stream( h, output_stream->input_stream_id );
         encoder = get_encoder( h, output_stream->stream_id );
 
         if( output_stream->stream_action == STREAM_ENCODE )
@@ -251,12 +414,25 @@ void *open_muxer( void *ptr )
 
         if( stream_format == VIDEO_AVC )
         {
-            x264_param_t *p_param = encoder->encoder_params;
-            int j = 0;
-            while( avc_profiles[j][0] && p_param->i_profile != avc_profiles[j][0] )
+            int profile_idc, level_idc, j = 0;
+
+            if( output_stream->stream_action == STREAM_ENCODE )
+            {
+                x264_param_t *p_param = encoder->encoder_params;
+                profile_idc = p_param->i_profile;
+                level_idc = p_param->i_level_idc;
+            }
+            else
+            {
+                /* lavc keeps the constraint flags above the profile_idc */
+                profile_idc = input_stream->profile & 0xff;
+                level_idc = input_stream->level;
+            }
+
+            while( avc_profiles[j][0] && profile_idc != avc_profiles[j][0] )
                 j++;
 
-            if( ts_setup_mpegvideo_stream( w, stream->pid, p_param->i_level_idc, avc_profiles[j][1], 0, 0, 0 ) < 0 )
+            if( ts_setup_mpegvideo_stream( w, output_stream->ts_opts.pid, level_idc, avc_profiles[j][1], 0, 0, 0 ) < 0 )
             {
                 fprintf( stderr, "[ts] Could not setup video stream\n" );
                 goto end;
@@ -266,7 +442,7 @@ void *open_muxer( void *ptr )
         {
             /* Even though the stream might be stereo, it could switch to 5.1 at some point.
              * It's simpler to let T-STD use 5 channels. As usual the spec doesn't explain how to deal with channel switches */
-            if( ts_setup_mpeg4_aac_stream( w, stream->pid, LIBMPEGTS_MPEG4_AAC_PROFILE_LEVEL_5, 5 ) < 0 )
+            if( ts_setup_mpeg4_aac_stream( w, output_stream->ts_opts.pid, LIBMPEGTS_MPEG4_AAC_PROFILE_LEVEL_5, 5 ) < 0 )
             {
                 fprintf( stderr, "[ts] Could not setup AAC stream\n" );
                 goto end;
@@ -279,8 +455,8 @@ void *open_muxer( void *ptr )
             subtitles.composition_page_id = input_stream->composition_page_id;
             subtitles.ancillary_page_id = input_stream->ancillary_page_id;
             /* A lot of streams don't have DDS flagged correctly so we assume all HD uses DDS */
-            has_dds = width >= 1280 && height >= 720;
-            if( ts_setup_dvb_subtitles( w, stream->pid, has_dds, 1, &subtitles ) < 0 )
+            has_dds = mux_program->width >= 1280 && mux_program->height >= 720;
+            if( ts_setup_dvb_subtitles( w, output_stream->ts_opts.pid, has_dds, 1, &subtitles ) < 0 )
             {
                 fprintf( stderr, "[ts] Could not setup DVB Subtitle stream\n" );
                 goto end;
@@ -288,9 +464,23 @@ void *open_muxer( void *ptr )
         }
         else if( stream_format == MISC_TELETEXT )
         {
-            /* TODO: make TTX passthrough work */
-            if( ts_setup_dvb_teletext( w, stream->pid, output_stream->ts_opts.num_teletexts,
-                (ts_dvb_ttx_t*)output_stream->ts_opts.teletext_opts ) < 0 )
+            ts_dvb_ttx_t ttx = {{0}};
+            ts_dvb_ttx_t *teletexts = (ts_dvb_ttx_t*)output_stream->ts_opts.teletext_opts;
+            int num_teletexts = output_stream->ts_opts.num_teletexts;
+
+            /* Passthrough without any pages set up reuses the first page of the source's descriptor */
+            if( !num_teletexts && input_stream->dvb_teletext_page_number )
+            {
+                memcpy( ttx.dvb_teletext_lang_code, input_stream->lang_code, 4 );
+                ttx.dvb_teletext_type = input_stream->dvb_teletext_type;
+                ttx.dvb_teletext_magazine_number = input_stream->dvb_teletext_magazine_number;
+                ttx.dvb_teletext_page_number = input_stream->dvb_teletext_page_number;
+                teletexts = &ttx;
+                num_teletexts = 1;
+            }
+
+            if( ts_setup_dvb_teletext( w, output_stream->ts_opts.pid, num_teletexts, teletexts ) < 0 ||
+                ( packetizer && obe_ts_packetizer_setup_teletext( packetizer, output_stream->ts_opts.pid, num_teletexts, teletexts ) < 0 ) )
             {
                 fprintf( stderr, "[ts] Could not setup Teletext stream\n" );
                 goto end;
@@ -337,7 +527,7 @@ void *open_muxer( void *ptr )
                 }
             }
 
-            if( ts_setup_dvb_vbi( w, stream->pid, input_stream->num_frame_data, vbi_services ) < 0 )
+            if( ts_setup_dvb_vbi( w, output_stream->ts_opts.pid, input_stream->num_frame_data, vbi_services ) < 0 )
             {
                 fprintf( stderr, "[ts] Could not setup VBI stream\n" );
                 goto end;
@@ -349,7 +539,7 @@ void *open_muxer( void *ptr )
                 /* Setup teletext streams if necessary */
                 if( input_stream->frame_data[j].type == MISC_TELETEXT )
                 {
-                    if( ts_setup_dvb_teletext( w, stream->pid, output_stream->ts_opts.num_teletexts,
+                    if( ts_setup_dvb_teletext( w, output_stream->ts_opts.pid, output_stream->ts_opts.num_teletexts,
                         (ts_dvb_ttx_t*)output_stream->ts_opts.teletext_opts ) < 0 )
                     {
                         fprintf( stderr, "[ts] Could not setup Teletext stream\n" );
@@ -365,13 +555,28 @@ void *open_muxer( void *ptr )
 
     //FILE *fp = fopen( "test.ts", "wb" );
 
+    /* The mux queues are bounded so the frame list can be allocated once */
+    for( int i = 0; i < mux_params->num_output_streams; i++ )
+        max_frames += h->mux_queues[i].capacity;
+
+    frames = calloc( max_frames, sizeof(*frames) );
+    heap = calloc( mux_params->num_output_streams, sizeof(*heap) );
+    if( !frames || !heap )
+    {
+        syslog( LOG_ERR, "Malloc failed\n" );
+        goto end;
+    }
+
     while( 1 )
     {
         video_found = 0;
-        video_dts = 0;
-        int64_t lowest_pts = -1, largest_pts = -1;
+        for( int i = 0; i < num_programs; i++ )
+        {
+            mux_programs[i].video_found = 0;
+            mux_programs[i].video_dts = 0;
+        }
 
-        pthread_mutex_lock( &h->mux_mutex );
+        obe_trace_mutex_lock( &h->mux_mutex, "mux_mutex" );
 
         if( h->cancel_mux_thread )
         {
@@ -379,28 +584,41 @@ void *open_muxer( void *ptr )
             goto end;
         }
 
+        /* The new PMT goes out between two writes so no PES is split across the change */
+        if( h->can_update_psi && stream_update != h->stream_update )
+        {
+            stream_update = h->stream_update;
+            if( update_packetizer_streams( h, packetizer, mux_params ) < 0 )
+                syslog( LOG_WARNING, "[ts] Could not update the PMT\n" );
+        }
+
+        /* Each program is muxed up to the oldest of its own video frames */
         while( !video_found )
         {
-            for( int i = 0; i < h->num_coded_frames; i++ )
+            for( int i = 0; i < mux_params->num_output_streams; i++ )
             {
-                if( h->coded_frames[i]->is_video )
+                coded_frame = obe_queue_front( &h->mux_queues[i] );
+                if( !coded_frame || !coded_frame->is_video )
+                    continue;
+
+                mux_program = &mux_programs[stream_programs[i]];
+                if( mux_program->video_found && mux_program->video_dts <= coded_frame->real_dts )
+                    continue;
+
+                video_found = mux_program->video_found = 1;
+                mux_program->video_dts = coded_frame->real_dts;
+                /* FIXME: handle case where first_video_pts < coded_frame->real_pts */
+                if( mux_program->first_video_pts == -1 )
                 {
-                    video_found = 1;
-                    video_dts = h->coded_frames[i]->real_dts;
-                    /* FIXME: handle case where first_video_pts < h->coded_frames[i]->real_pts */
-                    if( first_video_pts == -1 )
-                    {
-                        /* Get rid of frames which are too early */
-                        first_video_pts = h->coded_frames[i]->pts;
-                        first_video_real_pts = h->coded_frames[i]->real_pts;
-                        remove_early_frames( h, first_video_pts );
-                    }
-                    break;
+                    /* Get rid of frames which are too early */
+                    mux_program->first_video_pts = coded_frame->pts;
+                    mux_program->first_video_real_pts = coded_frame->real_pts;
+                    remove_early_frames( h, mux_program->device, mux_program->first_video_pts );
                 }
             }
 
             if( !video_found )
-                pthread_cond_wait( &h->mux_cv, &h->mux_mutex );
+                obe_trace_cond_wait( &h->mux_cv, &h->mux_mutex, "mux_cv" );
 
             if( h->cancel_mux_thread )
             {
@@ -409,97 +627,127 @@ void *open_muxer( void *ptr )
             }
         }
 
-        frames = calloc( h->num_coded_frames, sizeof(*frames) );
-        if( !frames )
+        /* Merge the streams in DTS order. A stream drops out of the heap once its next frame is past its program's video */
+        heap_size = 0;
+        for( int i = 0; i < mux_params->num_output_streams; i++ )
         {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            pthread_mutex_unlock( &h->mux_mutex );
-            goto end;
+            mux_program = &mux_programs[stream_programs[i]];
+            coded_frame = obe_queue_front( &h->mux_queues[i] );
+            if( mux_program->video_found && coded_frame && get_mux_dts( mux_program, coded_frame ) <= mux_program->video_dts )
+                mux_heap_push( heap, &heap_size, get_mux_dts( mux_program, coded_frame ), i );
         }
 
-        //printf("\n START - queuelen %i \n", h->num_coded_frames);
-
         num_frames = 0;
-        for( int i = 0; i < h->num_coded_frames; i++ )
+        arrival_time = 0;
+        while( heap_size )
         {
-            output_stream = get_output_mux_stream( mux_params, h->coded_frames[i]->stream_id );
-            // FIXME name
-            int64_t rescaled_dts = h->coded_frames[i]->pts - first_video_pts + first_video_real_pts;
-            if( h->coded_frames[i]->is_video )
-                rescaled_dts = h->coded_frames[i]->real_dts;
-
-            //printf("\n stream-id %i ours: %"PRIi64" \n", h->coded_frames[i]->stream_id, h->coded_frames[i]->pts );
-
-            if( rescaled_dts <= video_dts )
+            top = mux_heap_pop( heap, &heap_size );
+            coded_frame = obe_queue_pop( &h->mux_queues[top.queue] );
+            output_stream = &mux_params->output_streams[top.queue];
+            mux_program = &mux_programs[stream_programs[top.queue]];
+
+            memset( &frames[num_frames], 0, sizeof(*frames) );
+            frames[num_frames].opaque = coded_frame;
+            frames[num_frames].size = coded_frame->len;
+            frames[num_frames].data = coded_frame->data;
+            frames[num_frames].pid = output_stream->ts_opts.pid;
+            if( coded_frame->is_video )
             {
-                frames[num_frames].opaque = h->coded_frames[i];
-                frames[num_frames].size = h->coded_frames[i]->len;
-                frames[num_frames].data = h->coded_frames[i]->data;
-                frames[num_frames].pid = output_stream->ts_opts.pid;
-                if( h->coded_frames[i]->is_video )
-                {
-                    frames[num_frames].cpb_initial_arrival_time = h->coded_frames[i]->cpb_initial_arrival_time;
-                    frames[num_frames].cpb_final_arrival_time = h->coded_frames[i]->cpb_final_arrival_time;
-                    frames[num_frames].dts = h->coded_frames[i]->real_dts;
-                    frames[num_frames].pts = h->coded_frames[i]->real_pts;
-                }
-                else
-                {
-                    frames[num_frames].dts = h->coded_frames[i]->pts - first_video_pts + first_video_real_pts;
-                    frames[num_frames].pts = h->coded_frames[i]->pts - first_video_pts + first_video_real_pts;
-                }
+                if( coded_frame->arrival_time > 0 && ( !arrival_time || coded_frame->arrival_time < arrival_time ) )
+                    arrival_time = coded_frame->arrival_time;
+                frames[num_frames].cpb_initial_arrival_time = coded_frame->cpb_initial_arrival_time;
+                frames[num_frames].cpb_final_arrival_time = coded_frame->cpb_final_arrival_time;
+                frames[num_frames].dts = coded_frame->real_dts;
+                frames[num_frames].pts = coded_frame->real_pts;
+            }
+            else
+            {
+                frames[num_frames].dts = top.dts;
+                frames[num_frames].pts = top.dts;
+            }
 
-                frames[num_frames].dts /= 300;
-                frames[num_frames].pts /= 300;
+            frames[num_frames].dts /= 300;
+            frames[num_frames].pts /= 300;
 
-                //printf("\n pid: %i ours: %"PRIi64" \n", frames[num_frames].pid, frames[num_frames].dts );
-                frames[num_frames].random_access = h->coded_frames[i]->random_access;
-                frames[num_frames].priority = h->coded_frames[i]->priority;
-                num_frames++;
-            }
+            frames[num_frames].random_access = coded_frame->random_access;
+            frames[num_frames].priority = coded_frame->priority;
+            num_frames++;
+
+            coded_frame = obe_queue_front( &h->mux_queues[top.queue] );
+            if( coded_frame && get_mux_dts( mux_program, coded_frame ) <= mux_program->video_dts )
+                mux_heap_push( heap, &heap_size, get_mux_dts( mux_program, coded_frame ), top.queue );
         }
 
         pthread_mutex_unlock( &h->mux_mutex );
 
+        if( packetizer )
+        {
+            /* The packetizer writes straight into muxed data and frees the frames as they are sent */
+            obe_trace_begin( "mux", "packetizer" );
+            ret = obe_ts_packetizer_write( packetizer, frames, num_frames, &muxed_data );
+            obe_trace_end( "mux", "packetizer" );
+            if( ret < 0 )
+                goto end;
+
+            if( muxed_data )
+            {
+                muxed_data->arrival_time = arrival_time;
+                obe_latency_record( &h->mux_latency, arrival_time );
+                if( add_to_output_queue( h, muxed_data ) < 0 )
+                    destroy_muxed_data( muxed_data );
+            }
+            continue;
+        }
+
         // TODO figure out last frame
+        obe_trace_begin( "mux", "libmpegts" );
         ts_write_frames( w, frames, num_frames, &output, &len, &pcr_list );
+        obe_trace_end( "mux", "libmpegts" );
 
         if( len )
         {
-            muxed_data = new_muxed_data( len );
+            muxed_data = new_pooled_muxed_data( h, len );
             if( !muxed_data )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
                 goto end;
             }
 
+            /* libmpegts reuses its output buffer on the next call so this copy has to stay */
             memcpy( muxed_data->data, output, len );
-            muxed_data->pcr_list = muxed_data->pcr_list_pos = malloc( (len / 188) * sizeof(int64_t) );
-            if( !muxed_data->pcr_list )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                destroy_muxed_data( muxed_data );
-                goto end;
-            }
             memcpy( muxed_data->pcr_list, pcr_list, (len / 188) * sizeof(int64_t) );
-            add_to_output_queue( h, muxed_data );
+            muxed_data->arrival_time = arrival_time;
+            obe_latency_record( &h->mux_latency, arrival_time );
+            if( add_to_output_queue( h, muxed_data ) < 0 )
+                destroy_muxed_data( muxed_data );
         }
 
+        /* The frames were taken off their queues when they were selected */
         for( int i = 0; i < num_frames; i++ )
-        {
-            remove_from_mux_queue( h, frames[i].opaque );
             destroy_coded_frame( frames[i].opaque );
-        }
-
-        free( frames );
     }
 
 end:
+    if( packetizer )
+    {
+        pthread_mutex_lock( &h->mux_mutex );
+        h->can_update_psi = 0;
+        pthread_mutex_unlock( &h->mux_mutex );
+        obe_ts_packetizer_close( packetizer );
+    }
     ts_close_writer( w );
 
+    if( frames )
+        free( frames );
+    if( heap )
+        free( heap );
+
     /* TODO: clean more */
 
-    free( program.streams );
+    for( int i = 0; i < num_programs; i++ )
+        free( programs[i].streams );
+    if( stream_programs )
+        free( stream_programs );
     free( ptr );
 
     return NULL;
@@ -23,13 +23,20 @@
 
 #include "common/common.h"
 #include "common/lavc.h"
+#include "common/tap.h"
 #include "input/input.h"
 #include "filters/video/video.h"
+#include "filters/audio/audio.h"
 #include "encoders/smoothing.h"
 #include "encoders/video/video.h"
 #include "encoders/audio/audio.h"
 #include "mux/mux.h"
 #include "output/output.h"
+#include "monitor/monitor.h"
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#include <cpuid.h>
+#endif
 
 /** Utilities **/
 int64_t obe_mdate( void )
@@ -39,6 +46,78 @@ int64_t obe_mdate( void )
     return (int64_t)ts_current.tv_sec * 1000000 + (int64_t)ts_current.tv_nsec / 1000;
 }
 
+int obe_get_cpu_flags( void )
+{
+    int cpu_flags = av_get_cpu_flags();
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+    /* This also checks that the OS saves the YMM registers */
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) && ( cpu_flags & AV_CPU_FLAG_AVX ) )
+        cpu_flags |= AV_CPU_FLAG_AVX2;
+
+    unsigned int eax, ebx, ecx, edx;
+    if( __get_cpuid( 1, &eax, &ebx, &ecx, &edx ) && ( ecx & bit_PCLMUL ) )
+        cpu_flags |= OBE_CPU_FLAG_PCLMUL;
+#endif
+
+    return cpu_flags;
+}
+
+/** Statistics **/
+/* An input counts as locked if a frame arrived within this many microseconds, as with SDI_MAX_DELAY */
+#define SIGNAL_LOCK_TIMEOUT 50000
+
+static int latency_bucket( int64_t us )
+{
+    int e, idx;
+
+    if( us < 8 )
+        return us;
+
+    e = 63 - __builtin_clzll( us );
+    idx = (e - 2) * 8 + ((us >> (e - 3)) & 7);
+
+    return MIN( idx, OBE_LATENCY_BUCKETS-1 );
+}
+
+/* Lower bound of a bucket in microseconds */
+static int64_t latency_bucket_value( int idx )
+{
+    if( idx < 8 )
+        return idx;
+
+    return (int64_t)(8 + (idx & 7)) << (idx / 8 - 1);
+}
+
+void obe_latency_record( obe_latency_hist_t *hist, int64_t arrival_time )
+{
+    int64_t us;
+    int idx;
+
+    if( arrival_time <= 0 )
+        return;
+
+    us = MAX( obe_mdate() - arrival_time, 0 );
+    idx = latency_bucket( us );
+
+    /* Single writer, the atomics only stop the reader seeing torn values */
+    __atomic_store_n( &hist->buckets[idx], hist->buckets[idx] + 1, __ATOMIC_RELAXED );
+    if( us > hist->max )
+        __atomic_store_n( &hist->max, us, __ATOMIC_RELAXED );
+}
+
+void obe_input_frame_arrived( obe_device_t *device, int64_t frame_time, int lost )
+{
+    /* The device is not known yet while probing */
+    if( !device )
+        return;
+
+    __atomic_store_n( &device->last_frame_time, frame_time, __ATOMIC_RELAXED );
+    if( lost )
+        __atomic_store_n( &device->num_signal_losses, device->num_signal_losses + 1, __ATOMIC_RELAXED );
+}
+
 /** Create/Destroy **/
 /* Input device */
 obe_device_t *new_device( void )
@@ -51,6 +130,9 @@ obe_device_t *new_device( void )
         return NULL;
     }
 
+    pthread_mutex_init( &device->frame_pool_mutex, NULL );
+    device->numa_node = -1;
+
     return device;
 }
 
@@ -59,6 +141,10 @@ void destroy_device( obe_device_t *device )
     for( int i = 0; i < device->num_input_streams; i++ )
         free( device->streams[i] );
 
+    for( int i = 0; i < device->num_frame_pools; i++ )
+        obe_frame_pool_destroy( device->frame_pools[i] );
+    pthread_mutex_destroy( &device->frame_pool_mutex );
+
     if( device->location )
         free( device->location );
     free( device );
@@ -100,8 +186,32 @@ obe_coded_frame_t *new_coded_frame( int stream_id, int len )
     return coded_frame;
 }
 
+/* The frame header and payload share a single pooled buffer */
+obe_coded_frame_t *new_pooled_coded_frame( obe_t *h, int stream_id, int len )
+{
+    obe_coded_frame_t *coded_frame;
+    obe_buf_t *buf = obe_buf_get( &h->buf_pool, sizeof(*coded_frame) + len );
+    if( !buf )
+        return NULL;
+
+    coded_frame = (obe_coded_frame_t*)buf->data;
+    memset( coded_frame, 0, sizeof(*coded_frame) );
+    coded_frame->stream_id = stream_id;
+    coded_frame->len = len;
+    coded_frame->data = buf->data + sizeof(*coded_frame);
+    coded_frame->buf = buf;
+
+    return coded_frame;
+}
+
 void destroy_coded_frame( obe_coded_frame_t *coded_frame )
 {
+    if( coded_frame->buf )
+    {
+        obe_buf_unref( coded_frame->buf );
+        return;
+    }
+
     free( coded_frame->data );
     free( coded_frame );
 }
@@ -112,47 +222,156 @@ void obe_release_video_data( void *ptr )
      av_freep( &raw_frame->alloc_img.plane[0] );
 }
 
+void obe_release_pooled_video_data( void *ptr )
+{
+     obe_raw_frame_t *raw_frame = ptr;
+     if( raw_frame->frame_buf )
+         obe_frame_buf_unref( raw_frame->frame_buf );
+     raw_frame->frame_buf = NULL;
+}
+
 void obe_release_other_data( void *ptr )
 {
      obe_raw_frame_t *raw_frame = ptr;
      av_freep( &raw_frame->data );
 }
 
+void obe_release_audio_data( void *ptr )
+{
+     obe_raw_frame_t *raw_frame = ptr;
+     if( raw_frame->audio_buf )
+         obe_buf_unref( raw_frame->audio_buf );
+     raw_frame->audio_buf = NULL;
+}
+
 void obe_release_frame( void *ptr )
 {
      obe_raw_frame_t *raw_frame = ptr;
-     if( raw_frame->user_data )
-         free( raw_frame->user_data );
+     obe_arena_unref( raw_frame->arena );
      free( raw_frame );
 }
 
-/* Muxed data */
-obe_muxed_data_t *new_muxed_data( int len )
+/* Frame arena */
+static obe_arena_t *new_arena_block( int size )
 {
-    obe_muxed_data_t *muxed_data = calloc( 1, sizeof(*muxed_data) );
-    if( !muxed_data )
-        return NULL;
-
-    muxed_data->len = len;
-    muxed_data->data = malloc( len );
-    if( !muxed_data->data )
+    obe_arena_t *block = malloc( sizeof(*block) + size );
+    if( !block )
     {
         syslog( LOG_ERR, "Malloc failed\n" );
-        free( muxed_data );
         return NULL;
     }
-    muxed_data->cur_pos = muxed_data->data;
+
+    block->refcount = 1;
+    block->cur = block;
+    block->next = NULL;
+    block->size = size;
+    block->pos = 0;
+
+    return block;
+}
+
+void *obe_frame_alloc( obe_raw_frame_t *raw_frame, int size )
+{
+    obe_arena_t *arena = raw_frame->arena;
+    obe_arena_t *block;
+    void *ptr;
+
+    size = (size + 15) & ~15;
+
+    if( !arena )
+    {
+        arena = raw_frame->arena = new_arena_block( MAX( size, OBE_ARENA_BLOCK_SIZE ) );
+        if( !arena )
+            return NULL;
+    }
+
+    block = arena->cur;
+    if( block->size - block->pos < size )
+    {
+        /* Old blocks stay on the list until the arena is released */
+        block = new_arena_block( MAX( size, OBE_ARENA_BLOCK_SIZE ) );
+        if( !block )
+            return NULL;
+        block->next = arena->next;
+        arena->next = block;
+        arena->cur = block;
+    }
+
+    ptr = block->data + block->pos;
+    block->pos += size;
+
+    return ptr;
+}
+
+obe_user_data_t *obe_frame_add_user_data( obe_raw_frame_t *raw_frame, int num )
+{
+    obe_user_data_t *user_data;
+
+    /* The entries are moved rather than grown in place. A frame only carries a handful */
+    if( raw_frame->num_user_data + num > raw_frame->max_user_data )
+    {
+        int max_user_data = MAX( raw_frame->num_user_data + num, 2 * raw_frame->max_user_data );
+        user_data = obe_frame_alloc( raw_frame, max_user_data * sizeof(*user_data) );
+        if( !user_data )
+            return NULL;
+
+        if( raw_frame->num_user_data )
+            memcpy( user_data, raw_frame->user_data, raw_frame->num_user_data * sizeof(*user_data) );
+        raw_frame->user_data = user_data;
+        raw_frame->max_user_data = max_user_data;
+    }
+
+    user_data = &raw_frame->user_data[raw_frame->num_user_data];
+    memset( user_data, 0, num * sizeof(*user_data) );
+    raw_frame->num_user_data += num;
+
+    return user_data;
+}
+
+void obe_arena_ref( obe_arena_t *arena )
+{
+    __atomic_add_fetch( &arena->refcount, 1, __ATOMIC_RELAXED );
+}
+
+void obe_arena_unref( obe_arena_t *arena )
+{
+    obe_arena_t *next;
+
+    if( !arena || __atomic_sub_fetch( &arena->refcount, 1, __ATOMIC_ACQ_REL ) )
+        return;
+
+    while( arena )
+    {
+        next = arena->next;
+        free( arena );
+        arena = next;
+    }
+}
+
+/* Muxed data
+ * Header, PCR list and TS packets share a single pooled buffer. The outputs only read it
+ * so every output can hold a reference to the same muxed data */
+obe_muxed_data_t *new_pooled_muxed_data( obe_t *h, int len )
+{
+    obe_muxed_data_t *muxed_data;
+    int pcr_size = (len / 188) * sizeof(int64_t);
+    obe_buf_t *buf = obe_buf_get( &h->buf_pool, sizeof(*muxed_data) + pcr_size + len );
+    if( !buf )
+        return NULL;
+
+    muxed_data = (obe_muxed_data_t*)buf->data;
+    memset( muxed_data, 0, sizeof(*muxed_data) );
+    muxed_data->len = len;
+    muxed_data->pcr_list = muxed_data->pcr_list_pos = (int64_t*)(buf->data + sizeof(*muxed_data));
+    muxed_data->data = muxed_data->cur_pos = buf->data + sizeof(*muxed_data) + pcr_size;
+    muxed_data->buf = buf;
 
     return muxed_data;
 }
 
 void destroy_muxed_data( obe_muxed_data_t *muxed_data )
 {
-    if( muxed_data->pcr_list )
-        free( muxed_data->pcr_list );
-
-    free( muxed_data->data );
-    free( muxed_data );
+    obe_buf_unref( muxed_data->buf );
 }
 
 /** Add/Remove misc **/
@@ -163,12 +382,62 @@ void add_device( obe_t *h, obe_device_t *device )
     pthread_mutex_unlock( &h->device_list_mutex );
 }
 
+/* Frame pools
+ * Fills the planes and strides of img (csp, width and height must be set) from the device's
+ * pool for that format, creating the pool the first time a format is seen.
+ * alloc_height is the number of lines to allocate, which may be more than img->height.
+ * Returns NULL if the pool is exhausted. */
+obe_frame_buf_t *get_pooled_image( obe_device_t *device, obe_image_t *img, int alloc_height )
+{
+    obe_frame_pool_t *pool = NULL;
+
+    pthread_mutex_lock( &device->frame_pool_mutex );
+    for( int i = 0; i < device->num_frame_pools; i++ )
+    {
+        if( device->frame_pools[i]->csp == img->csp && device->frame_pools[i]->width == img->width &&
+            device->frame_pools[i]->height == alloc_height )
+        {
+            pool = device->frame_pools[i];
+            break;
+        }
+    }
+
+    if( !pool )
+    {
+        if( device->num_frame_pools == OBE_MAX_FRAME_POOLS )
+        {
+            pthread_mutex_unlock( &device->frame_pool_mutex );
+            syslog( LOG_ERR, "[pool] Too many frame formats\n" );
+            return NULL;
+        }
+
+        pool = obe_frame_pool_create( img->csp, img->width, alloc_height,
+                                      device->frame_pool_size ? device->frame_pool_size : OBE_FRAME_POOL_SIZE_LOW_LATENCY );
+        if( !pool )
+        {
+            pthread_mutex_unlock( &device->frame_pool_mutex );
+            return NULL;
+        }
+        /* obe_get_stats walks the pools without the mutex */
+        device->frame_pools[device->num_frame_pools] = pool;
+        __atomic_store_n( &device->num_frame_pools, device->num_frame_pools + 1, __ATOMIC_RELEASE );
+    }
+    pthread_mutex_unlock( &device->frame_pool_mutex );
+
+    img->planes = av_pix_fmt_descriptors[img->csp].nb_components;
+
+    if( device->frame_pool_wait )
+        return obe_frame_pool_get_wait( pool, img->plane, img->stride );
+
+    return obe_frame_pool_get( pool, img->plane, img->stride );
+}
+
 /** Add/Remove from queues */
 /* Filter queue */
 int add_to_filter_queue( obe_t *h, obe_raw_frame_t *raw_frame )
 {
     obe_filter_t *filter = NULL;
-    obe_raw_frame_t **tmp;
+    int ret;
 
     for( int i = 0; i < h->num_filters; i++ )
     {
@@ -182,36 +451,59 @@ int add_to_filter_queue( obe_t *h, obe_raw_frame_t *raw_frame )
     if( !filter )
         return -1;
 
+    if( __atomic_load_n( &h->probe_cache_pending, __ATOMIC_RELAXED ) && obe_probe_cache_check( h, raw_frame ) < 0 )
+        return -1;
+
+    if( filter->queue.is_spsc )
+        return obe_queue_push( &filter->queue, raw_frame );
+
     pthread_mutex_lock( &filter->filter_mutex );
-    tmp = realloc( filter->frames, sizeof(*filter->frames) * (filter->num_raw_frames+1) );
-    if( !tmp )
+    ret = obe_queue_push( &filter->queue, raw_frame );
+    if( !ret )
+        pthread_cond_signal( &filter->filter_cv );
+    pthread_mutex_unlock( &filter->filter_mutex );
+
+    return ret;
+}
+
+/* Blocks until there is a frame at the front of the queue. Returns NULL if the filter has been cancelled */
+obe_raw_frame_t *get_frame_from_filter_queue( obe_filter_t *filter )
+{
+    obe_raw_frame_t *raw_frame = NULL;
+
+    if( filter->queue.is_spsc )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        while( !__atomic_load_n( &filter->cancel_thread, __ATOMIC_ACQUIRE ) )
+        {
+            raw_frame = obe_queue_front( &filter->queue );
+            if( raw_frame )
+                return raw_frame;
+            obe_queue_wait( &filter->queue, &filter->cancel_thread );
+        }
+        return NULL;
     }
-    filter->frames = tmp;
-    filter->frames[filter->num_raw_frames++] = raw_frame;
-    pthread_cond_signal( &filter->filter_cv );
+
+    pthread_mutex_lock( &filter->filter_mutex );
+    while( !filter->cancel_thread && !filter->queue.size )
+        obe_trace_cond_wait( &filter->filter_cv, &filter->filter_mutex, filter->queue.name );
+
+    if( !filter->cancel_thread )
+        raw_frame = obe_queue_front( &filter->queue );
     pthread_mutex_unlock( &filter->filter_mutex );
 
-    return 0;
+    return raw_frame;
 }
 
 int remove_frame_from_filter_queue( obe_filter_t *filter )
 {
-    obe_raw_frame_t **tmp;
-
-    pthread_mutex_lock( &filter->filter_mutex );
-    if( filter->num_raw_frames > 1 )
-        memmove( &filter->frames[0], &filter->frames[1], sizeof(*filter->frames) * (filter->num_raw_frames-1) );
-    tmp = realloc( filter->frames, sizeof(*filter->frames) * (filter->num_raw_frames-1) );
-    filter->num_raw_frames--;
-    if( !tmp && filter->num_raw_frames )
+    if( filter->queue.is_spsc )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        obe_queue_pop( &filter->queue );
+        return 0;
     }
-    filter->frames = tmp;
+
+    pthread_mutex_lock( &filter->filter_mutex );
+    obe_queue_pop( &filter->queue );
     pthread_mutex_unlock( &filter->filter_mutex );
 
     return 0;
@@ -219,12 +511,15 @@ int remove_frame_from_filter_queue( obe_filter_t *filter )
 
 static void destroy_filter( obe_filter_t *filter )
 {
+    obe_raw_frame_t *raw_frame;
+
     pthread_mutex_lock( &filter->filter_mutex );
-    for( int i = 0; i < filter->num_raw_frames; i++ )
+    while( ( raw_frame = obe_queue_pop( &filter->queue ) ) )
     {
-        filter->frames[i]->release_data( filter->frames[i] );
-        filter->frames[i]->release_frame( filter->frames[i] );
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
     }
+    obe_queue_destroy( &filter->queue );
 
     pthread_mutex_unlock( &filter->filter_mutex );
     pthread_mutex_destroy( &filter->filter_mutex );
@@ -238,7 +533,7 @@ static void destroy_filter( obe_filter_t *filter )
 int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame )
 {
     obe_encoder_t *encoder = NULL;
-    obe_raw_frame_t **tmp;
+    int ret;
 
     for( int i = 0; i < h->num_encoders; i++ )
     {
@@ -249,36 +544,59 @@ int add_to_encode_queue( obe_t *h, obe_raw_frame_t *raw_frame )
     if( !encoder )
         return -1;
 
+    if( encoder->queue.is_spsc )
+        return obe_queue_push( &encoder->queue, raw_frame );
+
     pthread_mutex_lock( &encoder->encoder_mutex );
-    tmp = realloc( encoder->frames, sizeof(*encoder->frames) * (encoder->num_raw_frames+1) );
-    if( !tmp )
+    ret = obe_queue_push( &encoder->queue, raw_frame );
+    if( !ret )
+        pthread_cond_signal( &encoder->encoder_cv );
+    pthread_mutex_unlock( &encoder->encoder_mutex );
+
+    if( !ret && encoder->pool_task )
+        obe_audio_pool_schedule( encoder->pool_task );
+
+    return ret;
+}
+
+/* Blocks until there is a frame at the front of the queue. Returns NULL if the encoder has been cancelled */
+obe_raw_frame_t *get_frame_from_encode_queue( obe_encoder_t *encoder )
+{
+    obe_raw_frame_t *raw_frame = NULL;
+
+    if( encoder->queue.is_spsc )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        while( !__atomic_load_n( &encoder->cancel_thread, __ATOMIC_ACQUIRE ) )
+        {
+            raw_frame = obe_queue_front( &encoder->queue );
+            if( raw_frame )
+                return raw_frame;
+            obe_queue_wait( &encoder->queue, &encoder->cancel_thread );
+        }
+        return NULL;
     }
-    encoder->frames = tmp;
-    encoder->frames[encoder->num_raw_frames++] = raw_frame;
-    pthread_cond_signal( &encoder->encoder_cv );
+
+    pthread_mutex_lock( &encoder->encoder_mutex );
+    while( !encoder->cancel_thread && !encoder->queue.size )
+        obe_trace_cond_wait( &encoder->encoder_cv, &encoder->encoder_mutex, encoder->queue.name );
+
+    if( !encoder->cancel_thread )
+        raw_frame = obe_queue_front( &encoder->queue );
     pthread_mutex_unlock( &encoder->encoder_mutex );
 
-    return 0;
+    return raw_frame;
 }
 
 int remove_frame_from_encode_queue( obe_encoder_t *encoder )
 {
-    obe_raw_frame_t **tmp;
-
-    pthread_mutex_lock( &encoder->encoder_mutex );
-    if( encoder->num_raw_frames > 1 )
-        memmove( &encoder->frames[0], &encoder->frames[1], sizeof(*encoder->frames) * (encoder->num_raw_frames-1) );
-    tmp = realloc( encoder->frames, sizeof(*encoder->frames) * (encoder->num_raw_frames-1) );
-    encoder->num_raw_frames--;
-    if( !tmp && encoder->num_raw_frames )
+    if( encoder->queue.is_spsc )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        obe_queue_pop( &encoder->queue );
+        return 0;
     }
-    encoder->frames = tmp;
+
+    pthread_mutex_lock( &encoder->encoder_mutex );
+    obe_queue_pop( &encoder->queue );
     pthread_mutex_unlock( &encoder->encoder_mutex );
 
     return 0;
@@ -286,12 +604,15 @@ int remove_frame_from_encode_queue( obe_encoder_t *encoder )
 
 static void destroy_encoder( obe_encoder_t *encoder )
 {
+    obe_raw_frame_t *raw_frame;
+
     pthread_mutex_lock( &encoder->encoder_mutex );
-    for( int i = 0; i < encoder->num_raw_frames; i++ )
+    while( ( raw_frame = obe_queue_pop( &encoder->queue ) ) )
     {
-        encoder->frames[i]->release_data( encoder->frames[i] );
-        encoder->frames[i]->release_frame( encoder->frames[i] );
+        raw_frame->release_data( raw_frame );
+        raw_frame->release_frame( raw_frame );
     }
+    obe_queue_destroy( &encoder->queue );
     pthread_mutex_unlock( &encoder->encoder_mutex );
     pthread_mutex_destroy( &encoder->encoder_mutex );
     pthread_cond_destroy( &encoder->encoder_cv );
@@ -302,40 +623,21 @@ static void destroy_encoder( obe_encoder_t *encoder )
 /* Smoothing queue */
 int add_to_smoothing_queue( obe_t *h, obe_coded_frame_t *coded_frame )
 {
-    obe_coded_frame_t **tmp;
+    int ret;
 
-    pthread_mutex_lock( &h->smoothing_mutex );
-    tmp = realloc( h->smoothing_frames, sizeof(*h->smoothing_frames) * (h->num_smoothing_frames+1) );
-    if( !tmp )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
-    }
-    h->smoothing_frames = tmp;
-    h->smoothing_frames[h->num_smoothing_frames++] = coded_frame;
-    pthread_cond_signal( &h->smoothing_in_cv );
+    obe_trace_mutex_lock( &h->smoothing_mutex, "smoothing_mutex" );
+    ret = obe_queue_push( &h->smoothing_queue, coded_frame );
+    if( !ret )
+        pthread_cond_signal( &h->smoothing_in_cv );
     pthread_mutex_unlock( &h->smoothing_mutex );
 
-    return 0;
+    return ret;
 }
 
 int remove_from_smoothing_queue( obe_t *h )
 {
-    obe_coded_frame_t **tmp;
-    pthread_mutex_lock( &h->smoothing_mutex );
-    for( int i = 0; i < h->num_smoothing_frames; i++ )
-    {
-        memmove( &h->smoothing_frames[0], &h->smoothing_frames[1], sizeof(*h->smoothing_frames) * (h->num_smoothing_frames-1) );
-        tmp = realloc( h->smoothing_frames, sizeof(*h->smoothing_frames) * (h->num_smoothing_frames-1) );
-        h->num_smoothing_frames--;
-        if( !tmp && h->num_smoothing_frames )
-        {
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return -1;
-        }
-        h->smoothing_frames = tmp;
-        break;
-    }
+    obe_trace_mutex_lock( &h->smoothing_mutex, "smoothing_mutex" );
+    obe_queue_pop( &h->smoothing_queue );
 
     h->smoothing_last_exit_time = get_input_clock_in_mpeg_ticks( h );
     pthread_cond_broadcast( &h->smoothing_out_cv );
@@ -344,149 +646,192 @@ int remove_from_smoothing_queue( obe_t *h )
     return 0;
 }
 
-/* Mux queue */
-int add_to_mux_queue( obe_t *h, obe_coded_frame_t *coded_frame )
+static void destroy_smoothing( obe_t *h )
 {
-    obe_coded_frame_t **tmp;
+    obe_coded_frame_t *coded_frame;
 
-    pthread_mutex_lock( &h->mux_mutex );
-    tmp = realloc( h->coded_frames, sizeof(*h->coded_frames) * (h->num_coded_frames+1) );
-    if( !tmp )
+    pthread_mutex_lock( &h->smoothing_mutex );
+    while( ( coded_frame = obe_queue_pop( &h->smoothing_queue ) ) )
+        destroy_coded_frame( coded_frame );
+    obe_queue_destroy( &h->smoothing_queue );
+    pthread_mutex_unlock( &h->smoothing_mutex );
+    pthread_mutex_destroy( &h->smoothing_mutex );
+    pthread_cond_destroy( &h->smoothing_in_cv );
+    pthread_cond_destroy( &h->smoothing_out_cv );
+}
+
+/* Mux queue */
+static obe_queue_t *get_mux_queue( obe_t *h, int stream_id )
+{
+    for( int i = 0; i < h->num_output_streams; i++ )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        if( h->output_streams[i].stream_id == stream_id )
+            return &h->mux_queues[i];
     }
-    h->coded_frames = tmp;
-    h->coded_frames[h->num_coded_frames++] = coded_frame;
-    pthread_cond_signal( &h->mux_cv );
-    pthread_mutex_unlock( &h->mux_mutex );
+    return NULL;
+}
 
-    return 0;
+int add_to_mux_queue( obe_t *h, obe_coded_frame_t *coded_frame )
+{
+    return add_frames_to_mux_queue( h, &coded_frame, 1 ) == 1 ? 0 : -1;
 }
 
-int remove_from_mux_queue( obe_t *h, obe_coded_frame_t *coded_frame )
+/* Queues several frames with a single wakeup of the mux. Returns how many were taken,
+ * the caller still owns the rest */
+int add_frames_to_mux_queue( obe_t *h, obe_coded_frame_t **coded_frames, int num_frames )
 {
-    obe_coded_frame_t **tmp;
-    pthread_mutex_lock( &h->mux_mutex );
-    for( int i = 0; i < h->num_coded_frames; i++ )
+    obe_queue_t *queue;
+    int i;
+
+    obe_trace_mutex_lock( &h->mux_mutex, "mux_mutex" );
+    for( i = 0; i < num_frames; i++ )
     {
-        if( h->coded_frames[i] == coded_frame )
-        {
-            memmove( &h->coded_frames[i], &h->coded_frames[i+1], sizeof(*h->coded_frames) * (h->num_coded_frames-1-i) );
-            tmp = realloc( h->coded_frames, sizeof(*h->coded_frames) * (h->num_coded_frames-1) );
-            h->num_coded_frames--;
-            if( !tmp && h->num_coded_frames )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return -1;
-            }
-            h->coded_frames = tmp;
+        queue = get_mux_queue( h, coded_frames[i]->stream_id );
+        if( !queue )
             break;
+
+        /* A disabled stream keeps encoding but its frames go no further */
+        if( h->output_streams[queue - h->mux_queues].ts_opts.is_disabled )
+        {
+            destroy_coded_frame( coded_frames[i] );
+            continue;
         }
+
+        if( obe_queue_push( queue, coded_frames[i] ) < 0 )
+            break;
     }
+    if( i )
+        pthread_cond_signal( &h->mux_cv );
     pthread_mutex_unlock( &h->mux_mutex );
 
-    return 0;
+    return i;
 }
 
 static void destroy_mux( obe_t *h )
 {
+    obe_coded_frame_t *coded_frame;
+
     pthread_mutex_lock( &h->mux_mutex );
-    for( int i = 0; i < h->num_coded_frames; i++ )
-        destroy_coded_frame( h->coded_frames[i] );
+    for( int i = 0; h->mux_queues && i < h->num_output_streams; i++ )
+    {
+        while( ( coded_frame = obe_queue_pop( &h->mux_queues[i] ) ) )
+            destroy_coded_frame( coded_frame );
 
-    free( h->coded_frames );
+        obe_queue_destroy( &h->mux_queues[i] );
+    }
+    free( h->mux_queues );
+    h->mux_queues = NULL;
 
     pthread_mutex_unlock( &h->mux_mutex );
     pthread_mutex_destroy( &h->mux_mutex );
     pthread_cond_destroy( &h->mux_cv );
 }
 
-int remove_early_frames( obe_t *h, int64_t pts )
+/* Only frames from streams of the given device are removed. Each device is its own program with its own start.
+ * Called with the mux mutex held */
+int remove_early_frames( obe_t *h, obe_device_t *device, int64_t pts )
 {
-    obe_coded_frame_t **tmp;
-    for( int i = 0; i < h->num_coded_frames; i++ )
+    obe_coded_frame_t *coded_frame;
+    obe_output_stream_t *output_stream;
+    for( int i = 0; i < h->num_output_streams; i++ )
     {
-        if( !h->coded_frames[i]->is_video && h->coded_frames[i]->pts < pts )
+        output_stream = &h->output_streams[i];
+        if( get_input_device( h, output_stream->input_stream_id ) != device )
+            continue;
+
+        /* Each queue is in order so the early frames are all at the front */
+        while( ( coded_frame = obe_queue_front( &h->mux_queues[i] ) ) && !coded_frame->is_video && coded_frame->pts < pts )
         {
-            destroy_coded_frame( h->coded_frames[i] );
-            memmove( &h->coded_frames[i], &h->coded_frames[i+1], sizeof(*h->coded_frames) * (h->num_coded_frames-1-i) );
-            tmp = realloc( h->coded_frames, sizeof(*h->coded_frames) * (h->num_coded_frames-1) );
-            h->num_coded_frames--;
-            i--;
-            if( !tmp && h->num_coded_frames )
-            {
-                syslog( LOG_ERR, "Malloc failed\n" );
-                return -1;
-            }
-            h->coded_frames = tmp;
+            obe_queue_pop( &h->mux_queues[i] );
+            destroy_coded_frame( coded_frame );
         }
     }
 
     return 0;
 }
 
-/* Output queue */
+/* Output queue
+ * Each output gets its own reference to the muxed data. An output whose queue is full
+ * only drops its own copy, the others are unaffected. Returns -1 if no output took it */
 int add_to_output_queue( obe_t *h, obe_muxed_data_t *muxed_data )
 {
-    obe_muxed_data_t **tmp;
+    int ret = -1;
 
-    pthread_mutex_lock( &h->output_mutex );
-    tmp = realloc( h->muxed_data, sizeof(*h->muxed_data) * (h->num_muxed_data+1) );
-    if( !tmp )
+    muxed_data->queued_time = get_input_clock_in_mpeg_ticks( h );
+
+    for( int i = 0; i < h->num_outputs; i++ )
     {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
+        obe_output_t *output = h->outputs[i];
+
+        obe_buf_ref( muxed_data->buf );
+        obe_trace_mutex_lock( &output->output_mutex, output->queue.name );
+        if( !obe_queue_push( &output->queue, muxed_data ) )
+        {
+            pthread_cond_signal( &output->output_cv );
+            ret = 0;
+        }
+        else
+            obe_buf_unref( muxed_data->buf );
+        pthread_mutex_unlock( &output->output_mutex );
     }
-    h->muxed_data = tmp;
-    h->muxed_data[h->num_muxed_data++] = muxed_data;
-    pthread_cond_signal( &h->output_cv );
-    pthread_mutex_unlock( &h->output_mutex );
 
-    return 0;
+    /* The muxer's own reference */
+    if( !ret )
+        destroy_muxed_data( muxed_data );
+
+    return ret;
 }
 
-int remove_from_output_queue( obe_t *h )
+int remove_from_output_queue( obe_output_t *output )
 {
-    obe_muxed_data_t **tmp;
-
-    pthread_mutex_lock( &h->output_mutex );
-    if( h->num_muxed_data > 1 )
-        memmove( &h->muxed_data[0], &h->muxed_data[1], sizeof(*h->muxed_data) * (h->num_muxed_data-1) );
-    tmp = realloc( h->muxed_data, sizeof(*h->muxed_data) * (h->num_muxed_data-1) );
-    h->num_muxed_data--;
-    if( !tmp && h->num_muxed_data )
-    {
-        syslog( LOG_ERR, "Malloc failed\n" );
-        return -1;
-    }
-    h->muxed_data = tmp;
-    pthread_mutex_unlock( &h->output_mutex );
+    pthread_mutex_lock( &output->output_mutex );
+    obe_queue_pop( &output->queue );
+    pthread_mutex_unlock( &output->output_mutex );
 
     return 0;
 }
 
-static void destroy_output( obe_t *h )
+static void destroy_output( obe_output_t *output )
 {
-    pthread_mutex_lock( &h->output_mutex );
-    for( int i = 0; i < h->num_muxed_data; i++ )
-        destroy_muxed_data( h->muxed_data[i] );
+    obe_muxed_data_t *muxed_data;
 
-    free( h->muxed_data );
+    pthread_mutex_lock( &output->output_mutex );
+    while( ( muxed_data = obe_queue_pop( &output->queue ) ) )
+        destroy_muxed_data( muxed_data );
 
-    pthread_mutex_unlock( &h->output_mutex );
-    pthread_mutex_destroy( &h->output_mutex );
-    pthread_cond_destroy( &h->output_cv );
+    obe_queue_destroy( &output->queue );
+
+    pthread_mutex_unlock( &output->output_mutex );
+    pthread_mutex_destroy( &output->output_mutex );
+    pthread_cond_destroy( &output->output_cv );
+    free( output );
 }
 
 /** Get items **/
 /* Input stream */
 obe_int_input_stream_t *get_input_stream( obe_t *h, int input_stream_id )
 {
-    for( int j = 0; j < h->devices[0]->num_input_streams; j++ )
+    for( int i = 0; i < h->num_devices; i++ )
+    {
+        for( int j = 0; j < h->devices[i]->num_input_streams; j++ )
+        {
+            if( h->devices[i]->streams[j]->stream_id == input_stream_id )
+                return h->devices[i]->streams[j];
+        }
+    }
+    return NULL;
+}
+
+/* Device which an input stream comes from */
+obe_device_t *get_input_device( obe_t *h, int input_stream_id )
+{
+    for( int i = 0; i < h->num_devices; i++ )
     {
-        if( h->devices[0]->streams[j]->stream_id == input_stream_id )
-            return h->devices[0]->streams[j];
+        for( int j = 0; j < h->devices[i]->num_input_streams; j++ )
+        {
+            if( h->devices[i]->streams[j]->stream_id == input_stream_id )
+                return h->devices[i];
+        }
     }
     return NULL;
 }
@@ -573,62 +918,67 @@ void sleep_mpeg_ticks( int64_t i_time )
     clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, &ts );
 }
 
-void obe_clock_tick( obe_t *h, int64_t value )
+int get_non_display_location( int type )
 {
-    /* Use this signal as the SDI clocksource */
-    pthread_mutex_lock( &h->obe_clock_mutex );
-    h->smoothing_last_pts = value;
-    h->smoothing_last_wallclock = get_wallclock_in_mpeg_ticks();
-    pthread_mutex_unlock( &h->obe_clock_mutex );
-    pthread_cond_broadcast( &h->obe_clock_cv );
+    /* Set the appropriate location */
+    for( int i = 0; non_display_data_locations[i].service != -1; i++ )
+    {
+        if( non_display_data_locations[i].service == type )
+            return non_display_data_locations[i].location;
+    }
+
+    return -1;
 }
 
-int64_t get_input_clock_in_mpeg_ticks( obe_t *h )
+static int obe_validate_input_params( obe_input_t *input_device )
 {
-    int64_t value;
-    pthread_mutex_lock( &h->obe_clock_mutex );
-    value = h->smoothing_last_pts + ( get_wallclock_in_mpeg_ticks() - h->smoothing_last_wallclock );
-    pthread_mutex_unlock( &h->obe_clock_mutex );
+    if( input_device->input_type == INPUT_DEVICE_DECKLINK )
+    {
+        /* TODO check */
+    }
 
-    return value;
+    return 0;
 }
 
-void sleep_input_clock( obe_t *h, int64_t i_time )
+/* Wraps the input's probe thread so the caller is woken as soon as it finishes */
+typedef struct
 {
-    int64_t wallclock_time;
-    pthread_mutex_lock( &h->obe_clock_mutex );
-    wallclock_time = ( i_time - h->smoothing_last_pts ) + h->smoothing_last_wallclock;
-    pthread_mutex_unlock( &h->obe_clock_mutex );
+    void *(*probe_input)( void *ptr );
+    void *args;
 
-    sleep_mpeg_ticks( wallclock_time );
-}
+    pthread_mutex_t mutex;
+    pthread_cond_t  cv;
+    int done;
+} obe_probe_thread_t;
 
-int get_non_display_location( int type )
+static void probe_thread_done( void *ptr )
 {
-    /* Set the appropriate location */
-    for( int i = 0; non_display_data_locations[i].service != -1; i++ )
-    {
-        if( non_display_data_locations[i].service == type )
-            return non_display_data_locations[i].location;
-    }
+    obe_probe_thread_t *probe = ptr;
 
-    return -1;
+    pthread_mutex_lock( &probe->mutex );
+    probe->done = 1;
+    pthread_cond_signal( &probe->cv );
+    pthread_mutex_unlock( &probe->mutex );
 }
 
-static int obe_validate_input_params( obe_input_t *input_device )
+static void *probe_thread( void *ptr )
 {
-    if( input_device->input_type == INPUT_DEVICE_DECKLINK )
-    {
-        /* TODO check */
-    }
+    obe_probe_thread_t *probe = ptr;
+    void *ret;
 
-    return 0;
+    pthread_cleanup_push( probe_thread_done, probe );
+    ret = probe->probe_input( probe->args );
+    pthread_cleanup_pop( 1 );
+
+    return ret;
 }
 
 int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *program )
 {
     pthread_t thread;
     void *ret_ptr;
+    obe_probe_thread_t probe = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+    struct timespec deadline;
     obe_int_input_stream_t *stream_in;
     obe_input_stream_t *stream_out;
     obe_input_probe_t *args = NULL;
@@ -652,25 +1002,29 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
         return -1;
     }
 
-    if( input_device->input_type == INPUT_URL )
+    if( h->failover.backup )
     {
-        //input = lavf_input;
-        fprintf( stderr, "URL input is not supported currently \n" );
-        goto fail;
+        fprintf( stderr, "No more devices allowed after a backup input \n" );
+        return -1;
     }
+
+    if( input_device->input_type == INPUT_URL )
+        input = lavf_input;
 #if HAVE_DECKLINK
     else if( input_device->input_type == INPUT_DEVICE_DECKLINK )
         input = decklink_input;
 #endif
     else if( input_device->input_type == INPUT_DEVICE_LINSYS_SDI )
         input = linsys_sdi_input;
+    else if( input_device->input_type == INPUT_FILE )
+        input = file_input;
     else
     {
         fprintf( stderr, "Invalid input device \n" );
         return -1;
     }
 
-    if( input_device->input_type == INPUT_URL && !input_device->location )
+    if( ( input_device->input_type == INPUT_URL || input_device->input_type == INPUT_FILE ) && !input_device->location )
     {
         fprintf( stderr, "Invalid input location\n" );
         return -1;
@@ -697,45 +1051,89 @@ int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *
         strcpy( args->user_opts.location, input_device->location );
     }
 
+    if( input_device->audio_location )
+    {
+        args->user_opts.audio_location = strdup( input_device->audio_location );
+        if( !args->user_opts.audio_location )
+        {
+            fprintf( stderr, "Malloc failed \n" );
+            goto fail;
+        }
+    }
+
+    if( input_device->probe_cache )
+    {
+        args->user_opts.probe_cache = strdup( input_device->probe_cache );
+        if( !args->user_opts.probe_cache )
+        {
+            fprintf( stderr, "Malloc failed \n" );
+            goto fail;
+        }
+    }
+
     if( obe_validate_input_params( input_device ) < 0 )
         goto fail;
 
-    if( pthread_create( &thread, NULL, input.probe_input, (void*)args ) < 0 )
+    /* The device takes the strings in user_opts either way */
+    if( !obe_probe_cache_load( h, &args->user_opts ) )
     {
-        fprintf( stderr, "Couldn't create probe thread \n" );
-        goto fail;
+        printf( "Loaded probe from \"%s\" \n", input_device->probe_cache );
+        free( args );
     }
-
-    if( input_device->location )
-        printf( "Probing device: \"%s\". ", input_device->location );
-    else if( input_device->input_type == INPUT_DEVICE_LINSYS_SDI )
-        printf( "Probing device: Linsys card %i. ", input_device->card_idx );
     else
-        printf( "Probing device: Decklink card %i. ", input_device->card_idx );
+    {
+        probe.probe_input = input.probe_input;
+        probe.args = args;
 
-    printf( "Timeout %i seconds \n", probe_time );
+        if( pthread_create( &thread, NULL, probe_thread, &probe ) < 0 )
+        {
+            fprintf( stderr, "Couldn't create probe thread \n" );
+            goto fail;
+        }
 
-    while( i++ < probe_time )
-    {
-        sleep( 1 );
-        fprintf( stderr, "." );
+        if( input_device->location )
+            printf( "Probing device: \"%s\". ", input_device->location );
+        else if( input_device->input_type == INPUT_DEVICE_LINSYS_SDI )
+            printf( "Probing device: Linsys card %i. ", input_device->card_idx );
+        else
+            printf( "Probing device: Decklink card %i. ", input_device->card_idx );
 
-        if( pthread_kill( thread, 0 ) == ESRCH )
-            break;
-    }
+        printf( "Timeout %i seconds \n", probe_time );
+
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_sec++;
+
+        pthread_mutex_lock( &probe.mutex );
+        while( !probe.done && i < probe_time )
+        {
+            if( pthread_cond_timedwait( &probe.cv, &probe.mutex, &deadline ) == ETIMEDOUT )
+            {
+                fprintf( stderr, "." );
+                deadline.tv_sec++;
+                i++;
+            }
+        }
+        pthread_mutex_unlock( &probe.mutex );
 
-    pthread_cancel( thread );
-    pthread_join( thread, &ret_ptr );
+        if( !probe.done )
+            pthread_cancel( thread );
+        pthread_join( thread, &ret_ptr );
 
-    cur_devices = h->num_devices;
+        cur_devices = h->num_devices;
 
-    if( prev_devices == cur_devices )
-    {
-        fprintf( stderr, "Could not probe device \n" );
-        program = NULL;
-        return -1;
+        if( prev_devices == cur_devices )
+        {
+            fprintf( stderr, "Could not probe device \n" );
+            program = NULL;
+            return -1;
+        }
+
+        obe_probe_cache_save( h->devices[h->num_devices-1] );
     }
 
+    if( input_device->numa_node >= 0 )
+        h->devices[h->num_devices-1]->numa_node = input_device->numa_node;
+
     // FIXME this needs to be made to support probing whilst running
     // TODO metadata etc
     program->num_streams = h->devices[h->num_devices-1]->num_input_streams;
@@ -785,12 +1183,62 @@ fail:
     {
         if( args->user_opts.location )
             free( args->user_opts.location );
+        if( args->user_opts.audio_location )
+            free( args->user_opts.audio_location );
+        if( args->user_opts.probe_cache )
+            free( args->user_opts.probe_cache );
         free( args );
     }
 
     return -1;
 }
 
+int obe_probe_backup_device( obe_t *h, obe_input_t *input_device )
+{
+    obe_input_program_t program = {0};
+    obe_device_t *device;
+
+    if( !input_device )
+    {
+        fprintf( stderr, "Invalid input pointers \n" );
+        return -1;
+    }
+
+    if( h->num_devices != 1 )
+    {
+        fprintf( stderr, "The main input must be probed before the backup \n" );
+        return -1;
+    }
+
+    if( input_device->input_type != h->devices[0]->device_type ||
+        ( input_device->input_type != INPUT_DEVICE_LINSYS_SDI && input_device->input_type != INPUT_DEVICE_DECKLINK ) )
+    {
+        fprintf( stderr, "The main and backup inputs must be SDI cards of the same type \n" );
+        return -1;
+    }
+
+    if( obe_probe_device( h, input_device, &program ) < 0 )
+        return -1;
+
+    device = h->devices[h->num_devices-1];
+    if( obe_failover_add_backup( h, device ) < 0 )
+    {
+        /* The failed backup's stream ids are handed out again */
+        h->cur_stream_id -= device->num_input_streams;
+        destroy_device( device );
+        h->devices[--h->num_devices] = NULL;
+        free( program.streams );
+        return -1;
+    }
+
+    /* The streams are the same as the main input's, the probed program isn't handed back */
+    h->cur_stream_id -= device->num_input_streams;
+    device->probed_streams = NULL;
+    free( program.streams );
+
+    return 0;
+}
+
 int obe_populate_avc_encoder_params( obe_t *h, int input_stream_id, x264_param_t *param )
 {
     obe_int_input_stream_t *stream = get_input_stream( h, input_stream_id );
@@ -901,6 +1349,26 @@ int obe_setup_streams( obe_t *h, obe_output_stream_t *output_streams, int num_st
     }
     // TODO sanity check the inputs
 
+    for( int i = 0; i < num_streams; i++ )
+    {
+        for( int j = 0; j < i; j++ )
+        {
+            if( output_streams[i].stream_id == output_streams[j].stream_id )
+            {
+                fprintf( stderr, "Stream id %i is used more than once \n", output_streams[i].stream_id );
+                return -1;
+            }
+        }
+
+#if !HAVE_LIBX265
+        if( output_streams[i].stream_action == STREAM_ENCODE && output_streams[i].stream_format == VIDEO_HEVC )
+        {
+            fprintf( stderr, "HEVC encoding needs libx265 \n" );
+            return -1;
+        }
+#endif
+    }
+
     h->num_output_streams = num_streams;
     h->output_streams = malloc( num_streams * sizeof(*h->output_streams) );
     if( !h->output_streams )
@@ -921,92 +1389,332 @@ int obe_setup_muxer( obe_t *h, obe_mux_opts_t *mux_opts )
     return 0;
 }
 
+int obe_setup_tap( obe_t *h, obe_tap_opts_t *tap_opts )
+{
+    if( h->tap_opts.name )
+        free( h->tap_opts.name );
+
+    memcpy( &h->tap_opts, tap_opts, sizeof(obe_tap_opts_t) );
+    if( tap_opts->name )
+    {
+        h->tap_opts.name = strdup( tap_opts->name );
+        if( !h->tap_opts.name )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int obe_setup_snmp( obe_t *h, obe_snmp_opts_t *snmp_opts )
+{
+#if HAVE_LIBNETSNMP
+    if( h->snmp_opts.agentx_socket )
+        free( h->snmp_opts.agentx_socket );
+
+    memcpy( &h->snmp_opts, snmp_opts, sizeof(obe_snmp_opts_t) );
+    if( snmp_opts->agentx_socket )
+    {
+        h->snmp_opts.agentx_socket = strdup( snmp_opts->agentx_socket );
+        if( !h->snmp_opts.agentx_socket )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+    }
+
+    return 0;
+#else
+    if( snmp_opts->enabled )
+    {
+        fprintf( stderr, "OBE was built without net-snmp\n" );
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
 int obe_setup_output( obe_t *h, obe_output_opts_t *output_opts )
 {
     // TODO sanity check
 
-    memcpy( &h->output_opts, output_opts, sizeof(obe_output_opts_t) );
+    if( output_opts->num_outputs < 1 || output_opts->num_outputs > MAX_OUTPUTS )
+    {
+        fprintf( stderr, "Invalid number of outputs. Maximum is %i\n", MAX_OUTPUTS );
+        return -1;
+    }
+
+    if( h->output_opts.outputs )
+        free( h->output_opts.outputs );
+
+    h->output_opts.num_outputs = output_opts->num_outputs;
+    h->output_opts.outputs = malloc( output_opts->num_outputs * sizeof(*output_opts->outputs) );
+    if( !h->output_opts.outputs )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        h->output_opts.num_outputs = 0;
+        return -1;
+    }
+    memcpy( h->output_opts.outputs, output_opts->outputs, output_opts->num_outputs * sizeof(*output_opts->outputs) );
+
+    return 0;
+}
+
+/* The first device is the clock source so all of the inputs must be locked to a common reference */
+static int start_inputs( obe_t *h )
+{
+    obe_input_func_t input;
+
+    for( int i = 0; i < h->num_devices; i++ )
+    {
+        if( h->devices[i]->device_type == INPUT_FILE )
+            input = file_input;
+        else if( h->devices[i]->device_type == INPUT_URL )
+            input = lavf_input;
+#if HAVE_DECKLINK
+        else if( h->devices[i]->device_type == INPUT_DEVICE_DECKLINK )
+            input = decklink_input;
+#endif
+        else
+            input = linsys_sdi_input;
+
+        obe_input_params_t *input_params = calloc( 1, sizeof(*input_params) );
+        if( !input_params )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        input_params->h = h;
+        input_params->device = h->devices[i];
+
+        /* TODO: in the future give it only the streams which are necessary */
+        input_params->num_output_streams = h->num_output_streams;
+        input_params->output_streams = h->output_streams;
+        input_params->audio_samples = h->audio_samples;
+
+        if( obe_thread_create( h, &h->devices[i]->device_thread, OBE_THREAD_INPUT, h->devices[i]->numa_node, input.open_input, (void*)input_params ) < 0 )
+        {
+            fprintf( stderr, "Couldn't create input thread \n" );
+            return -1;
+        }
+    }
+
     return 0;
 }
 
 int obe_start( obe_t *h )
 {
     obe_int_input_stream_t  *input_stream;
+    obe_device_t            *device;
     obe_vid_filter_params_t *vid_filter_params;
     obe_vid_enc_params_t *vid_enc_params;
     obe_aud_enc_params_t *aud_enc_params;
     obe_output_params_t  *out_params;
 
-    obe_input_func_t  input;
-    obe_aud_enc_func_t audio_encoder;
+    const obe_aud_enc_func_t *audio_encoder;
+    obe_vid_enc_func_t video_encoder;
     obe_output_func_t output;
 
-    int num_samples;
+    int num_samples = 0, queue_depth, is_video, num_audio_encoders = 0;
+
+    /* Everything after the inputs is still open. Restarting them is handled like a loss of signal
+     * so the encoders reset speedcontrol and the outputs resync */
+    if( __atomic_load_n( &h->is_standby, __ATOMIC_ACQUIRE ) )
+    {
+        pthread_mutex_lock( &h->drop_mutex );
+        h->encoder_drop = 1;
+        h->output_drop++;
+        pthread_mutex_unlock( &h->drop_mutex );
+
+        /* The inputs start their timestamps again, move them on from where the pipeline stopped */
+        obe_failover_restart( h );
+
+        if( start_inputs( h ) < 0 )
+            goto fail;
+
+        __atomic_store_n( &h->is_standby, 0, __ATOMIC_RELEASE );
+        return 0;
+    }
 
     /* TODO: a lot of sanity checks */
-    /* TODO: decide upon thread priorities */
+
+    if( !h->num_devices )
+    {
+        fprintf( stderr, "No input devices \n" );
+        return -1;
+    }
+
+    /* Only URL inputs carry compressed video that can be passed through */
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        obe_int_input_stream_t *stream = get_input_stream( h, h->output_streams[i].input_stream_id );
+        obe_device_t *device = get_input_device( h, h->output_streams[i].input_stream_id );
+
+        if( stream && device && stream->stream_type == STREAM_TYPE_VIDEO &&
+            h->output_streams[i].stream_action == STREAM_PASSTHROUGH && device->device_type != INPUT_URL )
+        {
+            fprintf( stderr, "Video stream %i must be encoded \n", h->output_streams[i].stream_id );
+            return -1;
+        }
+
+        /* The PCM samples of SMPTE 337M audio are the compressed bursts */
+        if( stream && stream->is_337m && h->output_streams[i].stream_action == STREAM_ENCODE )
+        {
+            fprintf( stderr, "SMPTE 337M audio stream %i must be passed through \n", h->output_streams[i].stream_id );
+            return -1;
+        }
+
+        /* Channel maps pick channels out of SDI embedded audio */
+        if( stream && device && stream->stream_type == STREAM_TYPE_AUDIO && h->output_streams[i].stream_action == STREAM_ENCODE &&
+            ( device->device_type == INPUT_DEVICE_DECKLINK || device->device_type == INPUT_DEVICE_LINSYS_SDI ) )
+        {
+            int out_channels, map_channels = obe_channel_map_channels( h->output_streams[i].channel_map, &out_channels );
+
+            if( map_channels < 0 || h->output_streams[i].channel_offset < 0 ||
+                h->output_streams[i].channel_offset + map_channels > OBE_MAX_SDI_CHANNELS )
+            {
+                fprintf( stderr, "Invalid channel map for audio stream %i \n", h->output_streams[i].stream_id );
+                return -1;
+            }
+
+            if( h->output_streams[i].stream_format == AUDIO_MP2 && out_channels > 2 )
+            {
+                fprintf( stderr, "MP2 audio stream %i can only be mono or stereo \n", h->output_streams[i].stream_id );
+                return -1;
+            }
+        }
+    }
 
     /* Setup mutexes and cond vars */
-    pthread_mutex_init( &h->devices[0]->device_mutex, NULL );
+    for( int i = 0; i < h->num_devices; i++ )
+        pthread_mutex_init( &h->devices[i]->device_mutex, NULL );
     pthread_mutex_init( &h->drop_mutex, NULL );
+    pthread_mutex_init( &h->statmux.mutex, NULL );
     pthread_mutex_init( &h->smoothing_mutex, NULL );
     pthread_cond_init( &h->smoothing_in_cv, NULL );
     pthread_cond_init( &h->smoothing_out_cv, NULL );
-    pthread_mutex_init( &h->obe_clock_mutex, NULL );
-    pthread_cond_init( &h->obe_clock_cv, NULL );
+    obe_clock_init( &h->clock );
     pthread_mutex_init( &h->mux_mutex, NULL );
     pthread_cond_init( &h->mux_cv, NULL );
-    pthread_mutex_init( &h->output_mutex, NULL );
-    pthread_cond_init( &h->output_cv, NULL );
 
-    if( h->devices[0]->device_type == INPUT_URL )
+    /* Frames in flight are bounded by the pools rather than the queues */
+    for( int i = 0; i < h->num_devices; i++ )
     {
-        //input = lavf_input;
-        fprintf( stderr, "URL input is not supported currently \n" );
-        goto fail;
+        h->devices[i]->frame_pool_size = h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ?
+                                         OBE_FRAME_POOL_SIZE_LOW_LATENCY : OBE_FRAME_POOL_SIZE_GENERIC;
     }
-#if HAVE_DECKLINK
-    else if( h->devices[0]->device_type == INPUT_DEVICE_DECKLINK )
-        input = decklink_input;
-#endif
-    else if( h->devices[0]->device_type == INPUT_DEVICE_LINSYS_SDI )
-        input = linsys_sdi_input;
-    else
+    if( obe_buf_pool_init( &h->buf_pool, h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ?
+                           OBE_BUF_POOL_SIZE_LOW_LATENCY : OBE_BUF_POOL_SIZE_GENERIC ) < 0 )
+        goto fail;
+
+    /* Size the queues up front so that no frame hand-off touches the allocator */
+    queue_depth = OBE_QUEUE_MAX_FRAME_RATE * ( h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ?
+                  OBE_QUEUE_SECONDS_LOW_LATENCY : OBE_QUEUE_SECONDS_GENERIC );
+
+    if( obe_queue_init( &h->smoothing_queue, "smoothing", queue_depth * MAX( h->num_output_streams, 1 ), 0 ) < 0 )
+        goto fail;
+
+    h->mux_queues = calloc( h->num_output_streams, sizeof(*h->mux_queues) );
+    if( !h->mux_queues )
     {
-        fprintf( stderr, "Invalid input device \n" );
+        fprintf( stderr, "Malloc failed\n" );
         goto fail;
     }
 
-    if( h->output_opts.output == OUTPUT_UDP )
-        output = udp_output;
-    else
-        output = rtp_output;
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        if( obe_queue_init( &h->mux_queues[i], "mux", queue_depth, 0 ) < 0 )
+            goto fail;
+    }
 
-    /* Open Output Thread */
-    out_params = calloc( 1, sizeof(*out_params) );
-    if( !out_params )
+    for( int i = 0; i < h->num_devices; i++ )
     {
-        fprintf( stderr, "Malloc failed \n" );
-        goto fail;
+#if HAVE_DECKLINK
+        if( h->devices[i]->device_type == INPUT_DEVICE_DECKLINK )
+            continue;
+#endif
+        if( h->devices[i]->device_type != INPUT_DEVICE_LINSYS_SDI && h->devices[i]->device_type != INPUT_FILE &&
+            h->devices[i]->device_type != INPUT_URL )
+        {
+            fprintf( stderr, "Invalid input device \n" );
+            goto fail;
+        }
     }
 
-    memcpy( &out_params->output_opts, &h->output_opts, sizeof(h->output_opts) );
-    if( h->output_opts.target )
+    /* Open Output Threads */
+    for( int i = 0; i < h->output_opts.num_outputs; i++ )
     {
-        out_params->output_opts.target = malloc( strlen( h->output_opts.target ) + 1 );
-        if( !out_params->output_opts.target )
+        obe_output_dst_t *output_dst = &h->output_opts.outputs[i];
+
+        if( output_dst->type == OUTPUT_UDP )
+            output = udp_output;
+        else if( output_dst->type == OUTPUT_LINSYS_ASI )
+            output = linsys_asi_output;
+        else if( output_dst->type == OUTPUT_HLS )
+            output = hls_output;
+        else if( output_dst->type == OUTPUT_FILE )
+        {
+#if HAVE_LIBURING
+            output = file_output;
+#else
+            fprintf( stderr, "File output needs liburing \n" );
+            goto fail;
+#endif
+        }
+        else
+            output = rtp_output;
+
+        h->outputs[h->num_outputs] = calloc( 1, sizeof(obe_output_t) );
+        if( !h->outputs[h->num_outputs] )
         {
             fprintf( stderr, "Malloc failed \n" );
             goto fail;
         }
-        strcpy( out_params->output_opts.target, h->output_opts.target );
+        pthread_mutex_init( &h->outputs[h->num_outputs]->output_mutex, NULL );
+        pthread_cond_init( &h->outputs[h->num_outputs]->output_cv, NULL );
+        h->num_outputs++;
+
+        if( obe_queue_init( &h->outputs[i]->queue, "output", queue_depth, 0 ) < 0 )
+            goto fail;
+
+        out_params = calloc( 1, sizeof(*out_params) );
+        if( !out_params )
+        {
+            fprintf( stderr, "Malloc failed \n" );
+            goto fail;
+        }
+
+        memcpy( &out_params->output_dst, output_dst, sizeof(*output_dst) );
+        if( output_dst->target )
+        {
+            out_params->output_dst.target = malloc( strlen( output_dst->target ) + 1 );
+            if( !out_params->output_dst.target )
+            {
+                fprintf( stderr, "Malloc failed \n" );
+                free( out_params );
+                goto fail;
+            }
+            strcpy( out_params->output_dst.target, output_dst->target );
+        }
+        out_params->h = h;
+        out_params->output = h->outputs[i];
+
+        if( obe_thread_create( h, &h->outputs[i]->output_thread, OBE_THREAD_OUTPUT, -1, output.open_output, (void*)out_params ) < 0 )
+        {
+            fprintf( stderr, "Couldn't create output thread \n" );
+            goto fail;
+        }
     }
-    out_params->h = h;
 
-    if( pthread_create( &h->output_thread, NULL, output.open_output, (void*)out_params ) < 0 )
+    for( int i = 0; i < h->num_output_streams; i++ )
     {
-        fprintf( stderr, "Couldn't create output thread \n" );
-        goto fail;
+        if( h->output_streams[i].stream_action == STREAM_ENCODE &&
+            ( h->output_streams[i].stream_format == AUDIO_AC_3 || h->output_streams[i].stream_format == AUDIO_E_AC_3 ||
+              h->output_streams[i].stream_format == AUDIO_AAC  || h->output_streams[i].stream_format == AUDIO_MP2 ) )
+            num_audio_encoders++;
     }
 
     /* Open Encoder Threads */
@@ -1024,9 +1732,19 @@ int obe_start( obe_t *h )
             pthread_mutex_init( &h->encoders[h->num_encoders]->encoder_mutex, NULL );
             pthread_cond_init( &h->encoders[h->num_encoders]->encoder_cv, NULL );
 
-            if( h->output_streams[i].stream_format == VIDEO_AVC )
+            /* The video encoder is only ever fed by its filter thread so it can use a lock-free queue.
+             * Audio goes straight from the input thread and keeps the mutex for now */
+            is_video = h->output_streams[i].stream_format == VIDEO_AVC || h->output_streams[i].stream_format == VIDEO_HEVC;
+            if( obe_queue_init( &h->encoders[h->num_encoders]->queue, "encoder", queue_depth, is_video ) < 0 )
+                goto fail;
+
+            if( is_video )
             {
                 x264_param_t *x264_param = &h->output_streams[i].avc_param;
+                /* The filter sends it whole progressive frames */
+                if( h->output_streams[i].deinterlace )
+                    x264_param->b_interlaced = 0;
+
                 if( h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY )
                 {
                     /* This doesn't need to be particularly accurate since x264 calculates the correct value internally */
@@ -1044,7 +1762,16 @@ int obe_start( obe_t *h )
                 h->encoders[h->num_encoders]->is_video = 1;
 
                 memcpy( &vid_enc_params->avc_param, &h->output_streams[i].avc_param, sizeof(x264_param_t) );
-                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, x264_encoder.start_encoder, (void*)vid_enc_params ) < 0 )
+                vid_enc_params->video_encoder = h->output_streams[i].video_encoder;
+                video_encoder = vid_enc_params->video_encoder == VIDEO_ENCODER_X264 ? x264_encoder : lavc_avc_encoder;
+#if HAVE_LIBX265
+                if( h->output_streams[i].stream_format == VIDEO_HEVC )
+                    video_encoder = x265_hevc_encoder;
+#endif
+                /* x264's threads are started from this one so they stay on the same node */
+                device = get_input_device( h, h->output_streams[i].input_stream_id );
+                if( obe_thread_create( h, &h->encoders[h->num_encoders]->encoder_thread, OBE_THREAD_VIDEO_ENCODER,
+                                       device ? device->numa_node : -1, video_encoder.start_encoder, (void*)vid_enc_params ) < 0 )
                 {
                     fprintf( stderr, "Couldn't create encode thread \n" );
                     goto fail;
@@ -1053,7 +1780,7 @@ int obe_start( obe_t *h )
             else if( h->output_streams[i].stream_format == AUDIO_AC_3 || h->output_streams[i].stream_format == AUDIO_E_AC_3 ||
                      h->output_streams[i].stream_format == AUDIO_AAC  || h->output_streams[i].stream_format == AUDIO_MP2 )
             {
-                audio_encoder = h->output_streams[i].stream_format == AUDIO_MP2 ? twolame_encoder : lavc_encoder;
+                audio_encoder = h->output_streams[i].stream_format == AUDIO_MP2 ? &twolame_encoder : &lavc_encoder;
                 num_samples = h->output_streams[i].stream_format == AUDIO_MP2 ? MP2_NUM_SAMPLES :
                               h->output_streams[i].stream_format == AUDIO_AAC ? AAC_NUM_SAMPLES : AC3_NUM_SAMPLES;
 
@@ -1067,13 +1794,23 @@ int obe_start( obe_t *h )
                 aud_enc_params->h = h;
                 aud_enc_params->encoder = h->encoders[h->num_encoders];
 
-                input_stream = get_input_stream( h, h->output_streams[i].stream_id );
+                input_stream = get_input_stream( h, h->output_streams[i].input_stream_id );
+                device = get_input_device( h, h->output_streams[i].input_stream_id );
                 aud_enc_params->sample_format = input_stream->sample_format;
                 aud_enc_params->output_format = h->output_streams[i].stream_format;
                 /* TODO: check the bitrate is allowed by the format */
                 aud_enc_params->bitrate = h->output_streams[i].bitrate;
                 aud_enc_params->sample_rate = input_stream->sample_rate;
                 aud_enc_params->num_channels = av_get_channel_layout_nb_channels( input_stream->channel_layout );
+                aud_enc_params->channel_layout = input_stream->channel_layout;
+
+                /* SDI inputs send planar audio holding the stream's channel map */
+                if( device && ( device->device_type == INPUT_DEVICE_DECKLINK || device->device_type == INPUT_DEVICE_LINSYS_SDI ) )
+                {
+                    obe_channel_map_channels( h->output_streams[i].channel_map, &aud_enc_params->num_channels );
+                    aud_enc_params->channel_layout = obe_channel_map_layout( h->output_streams[i].channel_map );
+                    aud_enc_params->sample_format = AV_SAMPLE_FMT_S32P;
+                }
 
                 /* Choose the optimal number of audio frames per PES
                  * TODO: E-AC3 (Needs T-STD information!), low-latency modifications */
@@ -1093,11 +1830,19 @@ int obe_start( obe_t *h )
                 if( h->output_streams[i].stream_format == AUDIO_AAC )
                     memcpy( &aud_enc_params->aac_opts, &h->output_streams[i].aac_opts, sizeof(h->output_streams[i].aac_opts) );
 
-                if( pthread_create( &h->encoders[h->num_encoders]->encoder_thread, NULL, audio_encoder.start_encoder, (void*)aud_enc_params ) < 0 )
+                /* The pool is sized by the number of audio streams, up to a bound, rather than a thread each */
+                if( !h->audio_pool )
                 {
-                    fprintf( stderr, "Couldn't create encode thread \n" );
-                    goto fail;
+                    h->audio_pool = obe_audio_pool_open( h, num_audio_encoders );
+                    if( !h->audio_pool )
+                    {
+                        free( aud_enc_params );
+                        goto fail;
+                    }
                 }
+
+                if( obe_audio_pool_add( h->audio_pool, audio_encoder, aud_enc_params ) < 0 )
+                    goto fail;
             }
 
             h->num_encoders++;
@@ -1105,7 +1850,7 @@ int obe_start( obe_t *h )
     }
 
     /* Open Smoothing Thread */
-    if( pthread_create( &h->smoothing_thread, NULL, x264_smoothing.start_smoothing, (void*)h ) < 0 )
+    if( obe_thread_create( h, &h->smoothing_thread, OBE_THREAD_SMOOTHING, -1, x264_smoothing.start_smoothing, (void*)h ) < 0 )
     {
         fprintf( stderr, "Couldn't create mux thread \n" );
         goto fail;
@@ -1123,77 +1868,151 @@ int obe_start( obe_t *h )
     mux_params->num_output_streams = h->num_output_streams;
     mux_params->output_streams = h->output_streams;
 
-    if( pthread_create( &h->mux_thread, NULL, ts_muxer.open_muxer, (void*)mux_params ) < 0 )
+    if( obe_thread_create( h, &h->mux_thread, OBE_THREAD_MUX, -1, ts_muxer.open_muxer, (void*)mux_params ) < 0 )
     {
         fprintf( stderr, "Couldn't create mux thread \n" );
         goto fail;
     }
 
-    /* Open Filter Thread */
+    /* The filters and audio routers find their entries when they open */
+    if( obe_tap_open( h ) < 0 )
+        goto fail;
+
+    /* Open Filter Threads
+     * Each input video stream gets one filter thread which makes every rendition of it */
     for( int i = 0; i < h->num_output_streams; i++ )
     {
-        input_stream = get_input_stream( h, h->output_streams[i].stream_id );
-        if( input_stream && input_stream->stream_type == STREAM_TYPE_VIDEO )
+        int is_first = 1;
+
+        input_stream = get_input_stream( h, h->output_streams[i].input_stream_id );
+        if( !input_stream || input_stream->stream_type != STREAM_TYPE_VIDEO || h->output_streams[i].stream_action != STREAM_ENCODE )
+            continue;
+
+        for( int j = 0; j < i; j++ )
         {
-            h->filters[h->num_filters] = calloc( 1, sizeof(obe_filter_t) );
-            if( !h->filters[h->num_filters] )
-                goto fail;
+            if( h->output_streams[j].input_stream_id == h->output_streams[i].input_stream_id &&
+                h->output_streams[j].stream_action == STREAM_ENCODE )
+                is_first = 0;
+        }
 
-            pthread_mutex_init( &h->filters[h->num_filters]->filter_mutex, NULL );
-            pthread_cond_init( &h->filters[h->num_filters]->filter_cv, NULL );
+        if( !is_first )
+            continue;
+
+        h->filters[h->num_filters] = calloc( 1, sizeof(obe_filter_t) );
+        if( !h->filters[h->num_filters] )
+            goto fail;
 
-            h->filters[h->num_filters]->num_stream_ids = 1;
-            h->filters[h->num_filters]->stream_id_list = malloc( sizeof(*h->filters[h->num_filters]->stream_id_list) );
-            if( !h->filters[h->num_filters]->stream_id_list )
+        pthread_mutex_init( &h->filters[h->num_filters]->filter_mutex, NULL );
+        pthread_cond_init( &h->filters[h->num_filters]->filter_cv, NULL );
+        /* One input thread feeds one filter thread */
+        /* With a backup input the slate thread is a second producer */
+        if( obe_queue_init( &h->filters[h->num_filters]->queue, "filter", queue_depth, !h->failover.backup ) < 0 )
+            goto fail;
+
+        h->filters[h->num_filters]->num_stream_ids = 1;
+        h->filters[h->num_filters]->stream_id_list = malloc( sizeof(*h->filters[h->num_filters]->stream_id_list) );
+        if( !h->filters[h->num_filters]->stream_id_list )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            goto fail;
+        }
+        h->filters[h->num_filters]->stream_id_list[0] = input_stream->stream_id;
+
+        vid_filter_params = calloc( 1, sizeof(*vid_filter_params) );
+        if( !vid_filter_params )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            goto fail;
+        }
+
+        vid_filter_params->h = h;
+        vid_filter_params->device = get_input_device( h, input_stream->stream_id );
+        vid_filter_params->filter = h->filters[h->num_filters];
+        vid_filter_params->input_stream = input_stream;
+        vid_filter_params->target_csp = h->output_streams[i].avc_param.i_csp & X264_CSP_MASK;
+
+        for( int j = i; j < h->num_output_streams; j++ )
+        {
+            obe_output_stream_t *output_stream = &h->output_streams[j];
+            obe_vid_filter_rendition_t *rendition = &vid_filter_params->renditions[vid_filter_params->num_renditions];
+
+            if( output_stream->input_stream_id != h->output_streams[i].input_stream_id ||
+                output_stream->stream_action != STREAM_ENCODE )
+                continue;
+
+            if( vid_filter_params->num_renditions == MAX_RENDITIONS )
             {
-                fprintf( stderr, "Malloc failed\n" );
+                fprintf( stderr, "Too many renditions of input stream %i. Maximum is %i\n", input_stream->stream_id, MAX_RENDITIONS );
+                free( vid_filter_params );
                 goto fail;
             }
-            h->filters[h->num_filters]->stream_id_list[0] = h->output_streams[i].stream_id;
 
-            vid_filter_params = calloc( 1, sizeof(*vid_filter_params) );
-            if( !vid_filter_params )
+            /* The chroma conversion and dithering are done once for all renditions */
+            if( ( output_stream->avc_param.i_csp & X264_CSP_MASK ) != vid_filter_params->target_csp )
             {
-                fprintf( stderr, "Malloc failed\n" );
+                fprintf( stderr, "All renditions of input stream %i must use the same chroma format\n", input_stream->stream_id );
+                free( vid_filter_params );
                 goto fail;
             }
 
-            vid_filter_params->h = h;
-            vid_filter_params->filter = h->filters[h->num_filters];
-            vid_filter_params->input_stream = input_stream;
-            vid_filter_params->target_csp = h->output_streams[i].avc_param.i_csp & X264_CSP_MASK;
-
-            if( pthread_create( &h->filters[h->num_filters]->filter_thread, NULL, video_filter.start_filter, (void*)vid_filter_params ) < 0 )
+            if( output_stream->avc_param.i_width > input_stream->width || output_stream->avc_param.i_height > input_stream->height ||
+                output_stream->avc_param.i_width <= 0 || output_stream->avc_param.i_height <= 0 ||
+                ( output_stream->avc_param.i_width & 1 ) || ( output_stream->avc_param.i_height & 1 ) )
             {
-                fprintf( stderr, "Couldn't create filter thread \n" );
+                fprintf( stderr, "Invalid resolution %ix%i for stream %i\n", output_stream->avc_param.i_width,
+                         output_stream->avc_param.i_height, output_stream->stream_id );
+                free( vid_filter_params );
                 goto fail;
             }
-            h->num_filters++;
+
+            rendition->stream_id = output_stream->stream_id;
+            rendition->width = output_stream->avc_param.i_width;
+            rendition->height = output_stream->avc_param.i_height;
+            rendition->deinterlace = output_stream->deinterlace && input_stream->interlaced;
+            vid_filter_params->num_renditions++;
+        }
+
+        if( obe_thread_create( h, &h->filters[h->num_filters]->filter_thread, OBE_THREAD_FILTER,
+                               vid_filter_params->device ? vid_filter_params->device->numa_node : -1,
+                               video_filter.start_filter, (void*)vid_filter_params ) < 0 )
+        {
+            fprintf( stderr, "Couldn't create filter thread \n" );
+            goto fail;
         }
+        h->num_filters++;
     }
 
-    /* Open Input Thread */
-    obe_input_params_t *input_params = calloc( 1, sizeof(*input_params) );
-    if( !input_params )
-    {
-        fprintf( stderr, "Malloc failed\n" );
+    /* Open Input Threads */
+    h->audio_samples = num_samples;
+    if( obe_failover_open( h ) < 0 )
+        goto fail;
+
+    if( start_inputs( h ) < 0 )
         goto fail;
-    }
-    input_params->h = h;
-    input_params->device = h->devices[0];
 
-    /* TODO: in the future give it only the streams which are necessary */
-    input_params->num_output_streams = h->num_output_streams;
-    input_params->output_streams = h->output_streams;
-    input_params->audio_samples = num_samples;
+    /* obe_get_stats can be called from other threads once this is set */
+    __atomic_store_n( &h->is_active, 1, __ATOMIC_RELEASE );
 
-    if( pthread_create( &h->devices[0]->device_thread, NULL, input.open_input, (void*)input_params ) < 0 )
+#if HAVE_LIBNETSNMP
+    /* A monitoring failure is not worth stopping the encode for */
+    if( h->snmp_opts.enabled )
     {
-        fprintf( stderr, "Couldn't create input thread \n" );
-        goto fail;
+        obe_monitor_params_t *monitor_params = calloc( 1, sizeof(*monitor_params) );
+        if( !monitor_params )
+            syslog( LOG_ERR, "Malloc failed\n" );
+        else
+        {
+            monitor_params->h = h;
+            memcpy( &monitor_params->snmp_opts, &h->snmp_opts, sizeof(obe_snmp_opts_t) );
+            if( pthread_create( &h->monitor_thread, NULL, snmp_monitor.start_monitor, (void*)monitor_params ) )
+            {
+                syslog( LOG_ERR, "Couldn't create SNMP thread\n" );
+                h->monitor_thread = 0;
+                free( monitor_params );
+            }
+        }
     }
-
-    h->is_active = 1;
+#endif
 
     return 0;
 
@@ -1204,12 +2023,323 @@ fail:
     return -1;
 };
 
+int obe_stop( obe_t *h )
+{
+    void *ret_ptr;
+
+    if( !__atomic_load_n( &h->is_active, __ATOMIC_ACQUIRE ) || __atomic_load_n( &h->is_standby, __ATOMIC_ACQUIRE ) )
+    {
+        fprintf( stderr, "Encoder not running \n" );
+        return -1;
+    }
+
+    /* Set first so the slate isn't sent in place of the inputs being stopped */
+    __atomic_store_n( &h->is_standby, 1, __ATOMIC_RELEASE );
+
+    /* Frames already captured drain through the rest of the pipeline */
+    for( int i = 0; i < h->num_devices; i++ )
+    {
+        if( h->devices[i]->device_thread )
+        {
+            pthread_cancel( h->devices[i]->device_thread );
+            pthread_join( h->devices[i]->device_thread, &ret_ptr );
+            h->devices[i]->device_thread = 0;
+        }
+    }
+
+    return 0;
+}
+
+int obe_update_stream( obe_t *h, obe_output_stream_t *output_stream )
+{
+    obe_output_stream_t *cur_stream = get_output_stream( h, output_stream->stream_id );
+    obe_int_input_stream_t *input_stream;
+    obe_ts_stream_opts_t *ts_opts = &output_stream->ts_opts;
+    obe_encoder_t *encoder;
+    int ts_changed;
+
+    if( !__atomic_load_n( &h->is_active, __ATOMIC_ACQUIRE ) )
+    {
+        fprintf( stderr, "Encoder not running \n" );
+        return -1;
+    }
+
+    if( !cur_stream )
+    {
+        fprintf( stderr, "Could not find stream %i \n", output_stream->stream_id );
+        return -1;
+    }
+
+    input_stream = get_input_stream( h, cur_stream->input_stream_id );
+
+    if( ts_opts->pid && ts_opts->pid != cur_stream->ts_opts.pid )
+    {
+        fprintf( stderr, "The pid of stream %i can't be changed while encoding \n", output_stream->stream_id );
+        return -1;
+    }
+
+    if( input_stream->stream_type == STREAM_TYPE_VIDEO && ts_opts->is_disabled )
+    {
+        fprintf( stderr, "Video streams can't be disabled \n" );
+        return -1;
+    }
+
+    if( input_stream->stream_type == STREAM_TYPE_VIDEO && cur_stream->stream_action == STREAM_ENCODE )
+    {
+        const x264_param_t *param = &output_stream->avc_param;
+        /* Kept up to date with anything not yet taken up by the encoder */
+        x264_param_t *cur_param = &cur_stream->avc_param;
+        x264_param_t *enc_param;
+
+        encoder = get_encoder( h, cur_stream->stream_id );
+
+        pthread_mutex_lock( &encoder->encoder_mutex );
+        enc_param = encoder->encoder_params;
+        if( param->rc.i_vbv_buffer_size && enc_param && param->rc.i_vbv_buffer_size != enc_param->rc.i_vbv_buffer_size )
+        {
+            pthread_mutex_unlock( &encoder->encoder_mutex );
+            fprintf( stderr, "The VBV buffer size of stream %i can't be changed while encoding \n", output_stream->stream_id );
+            return -1;
+        }
+
+        if( ( param->rc.i_bitrate && param->rc.i_bitrate != cur_param->rc.i_bitrate ) ||
+            ( param->rc.i_vbv_max_bitrate && param->rc.i_vbv_max_bitrate != cur_param->rc.i_vbv_max_bitrate ) ||
+            param->sc.max_preset != cur_param->sc.max_preset || param->sc.f_speed != cur_param->sc.f_speed )
+        {
+            if( cur_stream->stream_format != VIDEO_AVC || cur_stream->video_encoder != VIDEO_ENCODER_X264 )
+            {
+                pthread_mutex_unlock( &encoder->encoder_mutex );
+                fprintf( stderr, "Only x264 can change rate while encoding \n" );
+                return -1;
+            }
+
+            encoder->update_bitrate = param->rc.i_bitrate ? param->rc.i_bitrate : cur_param->rc.i_bitrate;
+            encoder->update_vbv_maxrate = param->rc.i_vbv_max_bitrate ? param->rc.i_vbv_max_bitrate : cur_param->rc.i_vbv_max_bitrate;
+            encoder->update_max_preset = param->sc.max_preset;
+            encoder->update_speed = param->sc.f_speed;
+            encoder->update_pending = 1;
+
+            cur_param->rc.i_bitrate = encoder->update_bitrate;
+            cur_param->rc.i_vbv_max_bitrate = encoder->update_vbv_maxrate;
+            cur_param->sc.max_preset = encoder->update_max_preset;
+            cur_param->sc.f_speed = encoder->update_speed;
+        }
+        pthread_mutex_unlock( &encoder->encoder_mutex );
+    }
+
+    pthread_mutex_lock( &h->mux_mutex );
+    ts_changed = memcmp( ts_opts->lang_code, cur_stream->ts_opts.lang_code, 4 ) ||
+                 ts_opts->audio_type != cur_stream->ts_opts.audio_type ||
+                 ts_opts->has_stream_identifier != cur_stream->ts_opts.has_stream_identifier ||
+                 ts_opts->stream_identifier != cur_stream->ts_opts.stream_identifier ||
+                 ts_opts->is_disabled != cur_stream->ts_opts.is_disabled;
+
+    if( ts_changed )
+    {
+        if( !h->can_update_psi )
+        {
+            pthread_mutex_unlock( &h->mux_mutex );
+            fprintf( stderr, "Stream metadata can only be changed while encoding with the internal packetizer \n" );
+            return -1;
+        }
+
+        memcpy( cur_stream->ts_opts.lang_code, ts_opts->lang_code, 4 );
+        cur_stream->ts_opts.write_lang_code = !!strlen( ts_opts->lang_code );
+        cur_stream->ts_opts.audio_type = ts_opts->audio_type;
+        cur_stream->ts_opts.has_stream_identifier = ts_opts->has_stream_identifier;
+        cur_stream->ts_opts.stream_identifier = ts_opts->stream_identifier;
+        cur_stream->ts_opts.is_disabled = ts_opts->is_disabled;
+        h->stream_update++;
+        pthread_cond_signal( &h->mux_cv );
+    }
+    pthread_mutex_unlock( &h->mux_mutex );
+
+    return 0;
+}
+
+static void add_latency( int64_t *buckets, int64_t *max, obe_latency_hist_t *hist )
+{
+    for( int i = 0; i < OBE_LATENCY_BUCKETS; i++ )
+        buckets[i] += __atomic_load_n( &hist->buckets[i], __ATOMIC_RELAXED );
+    *max = MAX( *max, __atomic_load_n( &hist->max, __ATOMIC_RELAXED ) );
+}
+
+static void get_latency_stats( obe_latency_stats_t *stats, int64_t *buckets, int64_t max )
+{
+    int64_t count = 0, sum = 0;
+
+    memset( stats, 0, sizeof(*stats) );
+
+    for( int i = 0; i < OBE_LATENCY_BUCKETS; i++ )
+        count += buckets[i];
+
+    if( !count )
+        return;
+
+    stats->count = count;
+    stats->max = max;
+
+    /* Percentiles are reported as the lower bound of their bucket */
+    for( int i = 0; i < OBE_LATENCY_BUCKETS; i++ )
+    {
+        int64_t prev = sum;
+        sum += buckets[i];
+
+        if( prev * 2 < count && sum * 2 >= count )
+            stats->p50 = latency_bucket_value( i );
+        if( prev * 100 < count * 99 && sum * 100 >= count * 99 )
+        {
+            stats->p99 = latency_bucket_value( i );
+            break;
+        }
+    }
+}
+
+static void add_queue_stats( obe_stats_t *stats, obe_queue_t *queue, int id )
+{
+    obe_queue_stats_t *queue_stats;
+
+    if( stats->num_queues == OBE_MAX_STATS_QUEUES || !queue->capacity )
+        return;
+
+    queue_stats = &stats->queues[stats->num_queues++];
+    queue_stats->name = queue->name;
+    queue_stats->id = id;
+    queue_stats->capacity = queue->capacity;
+
+    /* These are reads of single counters so the owning mutex isn't needed */
+    queue_stats->depth = obe_queue_size( queue );
+    queue_stats->high_water = __atomic_load_n( &queue->high_water, __ATOMIC_RELAXED );
+    queue_stats->num_overflows = __atomic_load_n( &queue->num_overflows, __ATOMIC_RELAXED );
+}
+
+int obe_get_stats( obe_t *h, obe_stats_t *stats )
+{
+    int64_t buckets[OBE_LATENCY_BUCKETS];
+    int64_t max;
+
+    int64_t now = obe_mdate();
+
+    memset( stats, 0, sizeof(*stats) );
+
+    stats->is_active = __atomic_load_n( &h->is_active, __ATOMIC_ACQUIRE );
+    if( !stats->is_active )
+        return 0;
+
+    stats->num_dropped_frames = __atomic_load_n( &h->output_drop, __ATOMIC_RELAXED );
+
+    /* Input clock */
+    stats->clock.drift_ppb = __atomic_load_n( &h->clock.drift_ppb, __ATOMIC_RELAXED );
+    stats->clock.jitter = __atomic_load_n( &h->clock.jitter_ticks, __ATOMIC_RELAXED ) * 1000000 / OBE_CLOCK;
+    stats->clock.num_resyncs = __atomic_load_n( &h->clock.num_resyncs, __ATOMIC_RELAXED );
+
+    /* Latency */
+    for( int stage = 0; stage < OBE_NUM_STAGES; stage++ )
+    {
+        memset( buckets, 0, sizeof(buckets) );
+        max = 0;
+
+        if( stage == OBE_STAGE_FILTER )
+        {
+            for( int i = 0; i < h->num_filters; i++ )
+                add_latency( buckets, &max, &h->filters[i]->latency );
+        }
+        else if( stage == OBE_STAGE_ENCODE )
+        {
+            for( int i = 0; i < h->num_encoders; i++ )
+                add_latency( buckets, &max, &h->encoders[i]->latency );
+        }
+        else if( stage == OBE_STAGE_SMOOTHING )
+            add_latency( buckets, &max, &h->smoothing_latency );
+        else if( stage == OBE_STAGE_MUX )
+            add_latency( buckets, &max, &h->mux_latency );
+        else
+        {
+            for( int i = 0; i < h->num_outputs; i++ )
+                add_latency( buckets, &max, &h->outputs[i]->latency );
+        }
+
+        get_latency_stats( &stats->latency[stage], buckets, max );
+    }
+
+    /* Inputs and their frame pools */
+    for( int i = 0; i < h->num_devices; i++ )
+    {
+        obe_device_t *device = h->devices[i];
+        int num_frame_pools = __atomic_load_n( &device->num_frame_pools, __ATOMIC_ACQUIRE );
+
+        if( stats->num_inputs < OBE_MAX_STATS_INPUTS )
+        {
+            obe_input_stats_t *input = &stats->inputs[stats->num_inputs++];
+            int64_t last_frame_time = __atomic_load_n( &device->last_frame_time, __ATOMIC_RELAXED );
+
+            input->input_type = device->device_type;
+            input->video_format = device->user_opts.video_format;
+            input->signal_lock = last_frame_time && now - last_frame_time < SIGNAL_LOCK_TIMEOUT;
+            input->num_signal_losses = __atomic_load_n( &device->num_signal_losses, __ATOMIC_RELAXED );
+            input->is_active = !h->failover.backup || __atomic_load_n( &h->failover.active, __ATOMIC_RELAXED ) == device;
+        }
+
+        for( int j = 0; j < num_frame_pools; j++ )
+            stats->num_frame_pool_drops += __atomic_load_n( &device->frame_pools[j]->num_drops, __ATOMIC_RELAXED );
+    }
+    stats->num_failovers = __atomic_load_n( &h->failover.num_switches, __ATOMIC_RELAXED );
+
+    /* Encoders */
+    for( int i = 0; i < h->num_encoders && i < OBE_MAX_STATS_ENCODERS; i++ )
+    {
+        obe_encoder_stats_t *encoder = &stats->encoders[stats->num_encoders++];
+
+        encoder->stream_id = h->encoders[i]->stream_id;
+        encoder->is_video = h->encoders[i]->is_video;
+        encoder->speedcontrol_fill = __atomic_load_n( &h->encoders[i]->speedcontrol_fill, __ATOMIC_RELAXED );
+        encoder->shed_level = __atomic_load_n( &h->encoders[i]->shed_level, __ATOMIC_RELAXED );
+        encoder->num_shed_frames = __atomic_load_n( &h->encoders[i]->num_shed_frames, __ATOMIC_RELAXED );
+    }
+
+    /* Outputs */
+    for( int i = 0; i < h->num_outputs && i < OBE_MAX_STATS_OUTPUTS; i++ )
+    {
+        obe_output_stats_t *output = &stats->outputs[stats->num_outputs++];
+
+        output->type = h->output_opts.outputs[i].type;
+        output->bytes_sent = __atomic_load_n( &h->outputs[i]->bytes_sent, __ATOMIC_RELAXED );
+    }
+
+    /* Queues */
+    for( int i = 0; i < h->num_filters; i++ )
+        add_queue_stats( stats, &h->filters[i]->queue, h->filters[i]->num_stream_ids ? h->filters[i]->stream_id_list[0] : -1 );
+    for( int i = 0; i < h->num_encoders; i++ )
+        add_queue_stats( stats, &h->encoders[i]->queue, h->encoders[i]->stream_id );
+    add_queue_stats( stats, &h->smoothing_queue, 0 );
+    for( int i = 0; h->mux_queues && i < h->num_output_streams; i++ )
+        add_queue_stats( stats, &h->mux_queues[i], h->output_streams[i].stream_id );
+    for( int i = 0; i < h->num_outputs; i++ )
+        add_queue_stats( stats, &h->outputs[i]->queue, i );
+
+    return 0;
+}
+
+static void report_queue( obe_queue_t *queue )
+{
+    if( queue->capacity )
+        syslog( LOG_INFO, "[queue] %s: high-water mark %i of %i, %"PRIi64" overflows\n", queue->name,
+                queue->high_water, queue->capacity, queue->num_overflows );
+}
+
 void obe_close( obe_t *h )
 {
     void *ret_ptr;
 
     fprintf( stderr, "closing obe \n" );
 
+    /* Stop monitoring first since it reads every stage */
+    if( h->monitor_thread )
+    {
+        __atomic_store_n( &h->cancel_monitor_thread, 1, __ATOMIC_RELEASE );
+        pthread_join( h->monitor_thread, &ret_ptr );
+    }
+
     /* Cancel input thread */
     for( int i = 0; i < h->num_devices; i++ )
     {
@@ -1220,15 +2350,20 @@ void obe_close( obe_t *h )
         }
     }
 
+    /* The slate thread feeds the filters and audio encoders too */
+    obe_failover_stop( h );
+
     fprintf( stderr, "input cancelled \n" );
 
     /* Cancel filter threads */
     for( int i = 0; i < h->num_filters; i++ )
     {
         pthread_mutex_lock( &h->filters[i]->filter_mutex );
-        h->filters[i]->cancel_thread = 1;
+        __atomic_store_n( &h->filters[i]->cancel_thread, 1, __ATOMIC_RELEASE );
         pthread_cond_signal( &h->filters[i]->filter_cv );
         pthread_mutex_unlock( &h->filters[i]->filter_mutex );
+        if( h->filters[i]->queue.is_spsc )
+            obe_queue_wake( &h->filters[i]->queue );
         pthread_join( h->filters[i]->filter_thread, &ret_ptr );
     }
 
@@ -1237,13 +2372,20 @@ void obe_close( obe_t *h )
     /* Cancel encoder threads */
     for( int i = 0; i < h->num_encoders; i++ )
     {
+        if( h->encoders[i]->pool_task )
+            continue;
         pthread_mutex_lock( &h->encoders[i]->encoder_mutex );
-        h->encoders[i]->cancel_thread = 1;
+        __atomic_store_n( &h->encoders[i]->cancel_thread, 1, __ATOMIC_RELEASE );
         pthread_cond_signal( &h->encoders[i]->encoder_cv );
         pthread_mutex_unlock( &h->encoders[i]->encoder_mutex );
+        if( h->encoders[i]->queue.is_spsc )
+            obe_queue_wake( &h->encoders[i]->queue );
         pthread_join( h->encoders[i]->encoder_thread, &ret_ptr );
     }
 
+    obe_audio_pool_close( h->audio_pool );
+    h->audio_pool = NULL;
+
     fprintf( stderr, "encoders cancelled \n" );
 
     /* Cancel smoothing thread */
@@ -1270,11 +2412,30 @@ void obe_close( obe_t *h )
 
     fprintf( stderr, "mux cancelled \n" );
 
-    /* Cancel output_thread TODO */
+    /* Cancel output threads. The mux has stopped so each one sends what is left in its queue first */
+    for( int i = 0; i < h->num_outputs; i++ )
+    {
+        if( !h->outputs[i]->output_thread )
+            continue;
+        pthread_mutex_lock( &h->outputs[i]->output_mutex );
+        h->outputs[i]->cancel_thread = 1;
+        pthread_cond_signal( &h->outputs[i]->output_cv );
+        pthread_mutex_unlock( &h->outputs[i]->output_mutex );
+        pthread_join( h->outputs[i]->output_thread, &ret_ptr );
+    }
 
-    /* Destroy devices */
-    for( int i = 0; i < h->num_devices; i++ )
-        destroy_device( h->devices[i] );
+    fprintf( stderr, "outputs cancelled \n" );
+
+    /* Report how deep each queue got so that the sizing in obe_start can be checked */
+    for( int i = 0; i < h->num_filters; i++ )
+        report_queue( &h->filters[i]->queue );
+    for( int i = 0; i < h->num_encoders; i++ )
+        report_queue( &h->encoders[i]->queue );
+    report_queue( &h->smoothing_queue );
+    for( int i = 0; h->mux_queues && i < h->num_output_streams; i++ )
+        report_queue( &h->mux_queues[i] );
+    for( int i = 0; i < h->num_outputs; i++ )
+        report_queue( &h->outputs[i]->queue );
 
     /* Destroy filters */
     for( int i = 0; i < h->num_filters; i++ )
@@ -1284,11 +2445,38 @@ void obe_close( obe_t *h )
     for( int i = 0; i < h->num_encoders; i++ )
         destroy_encoder( h->encoders[i] );
 
+    /* Destroy smoothing */
+    destroy_smoothing( h );
+
     /* Destroy mux */
     destroy_mux( h );
 
-    /* Destroy output */
-    destroy_output( h );
+    obe_failover_close( h );
+
+    /* Nothing writes to the tap now */
+    obe_tap_close( h );
+
+    /* Destroy outputs */
+    for( int i = 0; i < h->num_outputs; i++ )
+        destroy_output( h->outputs[i] );
+
+    if( h->output_opts.outputs )
+        free( h->output_opts.outputs );
+
+    if( h->snmp_opts.agentx_socket )
+        free( h->snmp_opts.agentx_socket );
+    if( h->tap_opts.name )
+        free( h->tap_opts.name );
+
+    for( int i = 0; i < OBE_NUM_THREAD_STAGES; i++ )
+        free( h->thread_opts[i].cpus );
+
+    /* Destroy devices last since queued frames may still hold pooled buffers */
+    for( int i = 0; i < h->num_devices; i++ )
+        destroy_device( h->devices[i] );
+
+    obe_clock_destroy( &h->clock );
+    obe_buf_pool_destroy( &h->buf_pool );
 
     free( h );
     h = NULL;
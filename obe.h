@@ -94,6 +94,7 @@ enum input_type_e
     INPUT_URL,
     INPUT_DEVICE_DECKLINK,
     INPUT_DEVICE_LINSYS_SDI,
+    INPUT_FILE,
 //    INPUT_DEVICE_V4L2,
 //    INPUT_DEVICE_ASI,
 };
@@ -112,6 +113,27 @@ enum wss_output_e
     WSS_OUTPUT_AFD_AND_DVB_VBI,
 };
 
+enum file_format_e
+{
+    FILE_FORMAT_V210,
+    FILE_FORMAT_YUV422P10, /* planar little-endian, as the filter takes it */
+};
+
+/* File input options:
+ *
+ * location       - raw video file, one frame after another with no header. video_format gives its size and rate
+ * audio_location - raw interleaved stereo 32-bit little-endian 48kHz PCM, as captured from the card.
+ *                  A silent audio stream is made if this isn't set
+ * file_format    - file_format_e
+ * fast_replay    - feed frames as fast as the pipeline takes them rather than at the frame rate
+ * num_frames     - number of frames to play, looping the files. 0 plays the video file once
+ *
+ * numa_node      - NUMA node the card is attached to. -1 finds it from sysfs where the driver allows (linsys)
+ *                  and otherwise leaves the threads unbound
+ * num_capture_buffers - buffers the driver captures into for each of video and audio. 0 uses the default (linsys)
+ * probe_cache    - file the probe is saved to and loaded from instead of probing again when the card, port and
+ *                  format are the same. The first video frame is checked against it (decklink and linsys)
+ */
 typedef struct
 {
     int input_type;
@@ -125,6 +147,16 @@ typedef struct
 
     int teletext_location;
     int wss_output;
+
+    /* File */
+    char *audio_location;
+    int file_format;
+    int fast_replay;
+    int64_t num_frames;
+
+    int numa_node;
+    int num_capture_buffers;
+    char *probe_cache;
 } obe_input_t;
 
 /**** Stream Formats ****/
@@ -183,6 +215,9 @@ enum stream_formats_e
     VANC_DTV_DATA_BROADCAST,
     VANC_SMPTE_VBI,
     VANC_SCTE_104,
+
+    /* Added after the rest so the values above stay the same for applications built against them */
+    VIDEO_HEVC,
 };
 
 typedef struct
@@ -249,6 +284,12 @@ typedef struct
 /* Only one program is returned */
 int obe_probe_device( obe_t *h, obe_input_t *input_device, obe_input_program_t *program );
 
+/* Probes a hot standby for the input already probed. Both must be SDI and carry the same streams
+ * in the same formats. The backup feeds the same encoders and takes over when the main input
+ * loses its signal; a black slate with silence is sent while neither has signal.
+ * No more inputs can be probed after a backup. */
+int obe_probe_backup_device( obe_t *h, obe_input_t *input_device );
+
 enum stream_action_e
 {
     STREAM_PASSTHROUGH,
@@ -302,6 +343,9 @@ typedef struct
     int num_teletexts;
     obe_teletext_opts_t *teletext_opts;
 
+    /* Left out of the PMT and not muxed. The stream is still encoded so that it can come back without a gap */
+    int is_disabled;
+
     // TODO Teletext/VBI indentifier
 } obe_ts_stream_opts_t;
 
@@ -361,29 +405,63 @@ typedef struct
     int latm_output;
 } obe_aac_opts_t;
 
+/**** Video Encoders ****/
+/* The hardware encoders go through libavcodec and take their settings from avc_param.
+ * Only the size, frame rate, bitrate, VBV, keyint, bframes, level and interlacing are used,
+ * and user data such as captions is not carried */
+enum video_encoder_e
+{
+    VIDEO_ENCODER_X264,
+    VIDEO_ENCODER_NVENC,
+    VIDEO_ENCODER_QSV,
+};
+
 /* Stream Options:
  *
  * stream_id - stream id. Streams cannot be duplicated
- * stream_action - stream action. Video streams must be encoded
+ * input_stream_id - input stream this stream is made from. Several encoded video streams can be made from
+ *                   one input video stream (e.g. an ABR ladder). The resolution of each one comes from
+ *                   avc_param.i_width and avc_param.i_height and must not be larger than the input
+ * stream_action - stream action. Video streams must be encoded unless they come from a URL input
  *
  * Encode Options: (ignored in passthrough mode)
  * stream_format - stream_format
+ * video_encoder - video_encoder_e for VIDEO_AVC streams. The hardware encoders need a bitrate and VBV buffer size
+ * VIDEO_HEVC streams are encoded with x265, which also takes its settings from avc_param
+ * deinterlace - encode an interlaced input as progressive. Each frame is rebuilt from its first field
+ *               and the stream is encoded at the frame rate. Ignored for progressive inputs
+ * channel_map - channel_map_e. Which channels of an SDI input's embedded audio an audio stream is encoded from.
+ *               Several audio streams can be made from one SDI audio input stream
+ * channel_offset - first SDI channel of the map, counting from zero
  *
  */
 
+enum channel_map_e
+{
+    CHANNEL_MAP_STEREO,
+    CHANNEL_MAP_MONO,
+    CHANNEL_MAP_5POINT1,
+    CHANNEL_MAP_5POINT1_TO_STEREO, /* ITU-R BS.775 downmix with the LFE dropped */
+};
+
 typedef struct
 {
     int stream_id;
+    int input_stream_id;
     int stream_action;
 
     /** Encode options **/
     int stream_format;
 
-    /* AVC */
+    /* AVC and HEVC */
+    int video_encoder;
     x264_param_t avc_param;
+    int deinterlace;
 
     /* Audio */
     int bitrate;
+    int channel_map;
+    int channel_offset;
 
     /* Metadata */
     obe_audio_metadata_t audio_metadata;
@@ -436,6 +514,13 @@ typedef struct
 
     int is_3dtv;
 
+    /* CBR single program streams of the common formats can be written by OBE itself instead of libmpegts */
+    int internal_packetizer;
+
+    /* Share the video bitrate between programs by how hard each picture is to code. Every x264 encoder's
+     * vbv-maxrate is its fair share and it gets between half and twice that. Encoders with filler are left alone */
+    int statmux;
+
     /* DVB */
 
     /* ATSC */
@@ -450,27 +535,302 @@ enum output_e
 {
     OUTPUT_UDP, /* MPEG-TS in UDP */
     OUTPUT_RTP, /* MPEG-TS in RTP in UDP */
-//    OUTPUT_LINSYS_ASI,
+    OUTPUT_LINSYS_ASI,
+    OUTPUT_FILE, /* MPEG-TS recorded to disk, needs liburing */
+    OUTPUT_HLS,  /* MPEG-TS segments and an HLS playlist, written to a directory and/or served over HTTP */
 //    OUTPUT_LINSYS_SMPTE_310M,
 };
 
 /* Output structure
  *
+ * Every output carries the same transport stream. Each one has its own thread,
+ * queue and pacing so a slow destination only loses its own data.
+ *
+ * type   - output_e
  * target - TODO document url parameters
+ *          For linsys-asi, the index of the transmitter (asitxN), 0 if not set.
+ *          Cards that can timestamp packets send each one at its PCR time, other cards are stuffed to the mux rate
+ *          For file, a strftime pattern for the file names with an optional ?segment=seconds to start a new
+ *          file every so often. Without a '%' in the pattern, segments are numbered instead
+ *          For hls, the directory to write the playlist and segments to (ideally tmpfs), which can be left out
+ *          when serving over HTTP, followed by ?segment=seconds&window=segments&port=port.
+ *          Segments are cut at video random access points, the playlist is index.m3u8
  *
  */
 
 typedef struct
 {
-    int output;
+    int type;
     char *target;
+} obe_output_dst_t;
+
+typedef struct
+{
+    int num_outputs;
+    obe_output_dst_t *outputs;
 } obe_output_opts_t;
 
 int obe_setup_output( obe_t *h, obe_output_opts_t *output_opts );
 
+/**** Statistics *****/
+/* Latency is measured in microseconds from capture until a frame leaves each stage */
+enum obe_latency_stage_e
+{
+    OBE_STAGE_FILTER,
+    OBE_STAGE_ENCODE,
+    OBE_STAGE_SMOOTHING,
+    OBE_STAGE_MUX,
+    OBE_STAGE_OUTPUT,
+    OBE_NUM_STAGES,
+};
+
+typedef struct
+{
+    int64_t count;
+    int64_t p50;
+    int64_t p99;
+    int64_t max;
+} obe_latency_stats_t;
+
+typedef struct
+{
+    const char *name;
+    int id;            /* stream id for filter and encoder queues, output number for output queues */
+    int depth;
+    int capacity;
+    int high_water;
+    int64_t num_overflows;
+} obe_queue_stats_t;
+
+typedef struct
+{
+    int input_type;
+    int video_format;
+    int signal_lock;          /* a frame has arrived within the last 50ms */
+    int64_t num_signal_losses;
+    int is_active;            /* the output comes from this input, 0 for a standby input or while the slate is sent */
+} obe_input_stats_t;
+
+typedef struct
+{
+    int stream_id;
+    int is_video;
+    int speedcontrol_fill;    /* speedcontrol buffer fill in tenths of a percent, video only */
+    int shed_level;           /* obe_shed_level_e, 0 when keeping up */
+    int64_t num_shed_frames;  /* frames dropped because the encoder was too far behind */
+} obe_encoder_stats_t;
+
+typedef struct
+{
+    int type;                 /* output_e */
+    int64_t bytes_sent;
+} obe_output_stats_t;
+
+/* Recovery of the clock source input's clock against CLOCK_MONOTONIC */
+typedef struct
+{
+    int64_t drift_ppb;        /* input clock rate relative to the system clock, in parts per billion */
+    int64_t jitter;           /* mean phase error of the input clock ticks in microseconds */
+    int64_t num_resyncs;      /* discontinuities in the input clock */
+} obe_clock_stats_t;
+
+#define OBE_MAX_STATS_INPUTS   8
+#define OBE_MAX_STATS_ENCODERS 40
+#define OBE_MAX_STATS_OUTPUTS  8
+#define OBE_MAX_STATS_QUEUES   128
+
+typedef struct
+{
+    int is_active;
+    int64_t num_dropped_frames; /* gaps in the input, each one resets the outputs */
+
+    obe_clock_stats_t clock;
+
+    obe_latency_stats_t latency[OBE_NUM_STAGES];
+
+    int num_inputs;
+    obe_input_stats_t inputs[OBE_MAX_STATS_INPUTS];
+
+    int num_encoders;
+    obe_encoder_stats_t encoders[OBE_MAX_STATS_ENCODERS];
+
+    int num_outputs;
+    obe_output_stats_t outputs[OBE_MAX_STATS_OUTPUTS];
+
+    int num_queues;
+    obe_queue_stats_t queues[OBE_MAX_STATS_QUEUES];
+
+    int64_t num_frame_pool_drops;
+    int64_t num_failovers;    /* switches between the main input, the backup input and the slate */
+} obe_stats_t;
+
+/* Can be called from any thread. No pipeline mutex is taken so the values are not
+ * a consistent snapshot, but polling never stalls the encoding threads.
+ * Only is_active is filled in when OBE is not running. */
+int obe_get_stats( obe_t *h, obe_stats_t *stats );
+
+/**** SNMP *****/
+/* The agent runs as an AgentX subagent of the system snmpd.
+ * It serves encoderInputMonVideoTable from the SCTE HMS 154-3 MIB and the
+ * pipeline counters in monitor/snmp/mib/OBE-MONITOR-MIB.txt
+ *
+ * agentx_socket - master agent socket, NULL for the net-snmp default
+ */
+typedef struct
+{
+    int enabled;
+    char *agentx_socket;
+} obe_snmp_opts_t;
+
+int obe_setup_snmp( obe_t *h, obe_snmp_opts_t *snmp_opts );
+
+/**** Shared memory tap *****/
+/* Picture snapshots and audio meters for confidence monitoring, published in the POSIX shared
+ * memory object "name" for readers that shm_open and mmap it. The encoder only writes, so a
+ * reader can't hold up the pipeline.
+ *
+ * The object is an obe_tap_header_t and then num_entries entries. Each entry is an obe_tap_entry_t
+ * with num_slots slots after it, each slot_size bytes, and the next entry starts entry_size bytes
+ * after it. Pictures have an entry for each encoded input video stream; meters one for each
+ * encoded audio output stream. A slot is an obe_tap_slot_t and then its payload.
+ *
+ * The newest slot is slot (write_count-1) % num_slots. It holds a complete payload if seq is
+ * even before the payload is read and the same after it.
+ *
+ * name             - object name, "/obe-tap" if NULL
+ * picture_interval - milliseconds between snapshots of a picture
+ * meter_interval   - milliseconds of audio in each meter reading
+ * width            - snapshots are decimated by a whole factor to no wider than this
+ */
+typedef struct
+{
+    int enabled;
+    char *name;
+    int picture_interval;
+    int meter_interval;
+    int width;
+} obe_tap_opts_t;
+
+int obe_setup_tap( obe_t *h, obe_tap_opts_t *tap_opts );
+
+#define OBE_TAP_MAGIC   0x5041544f /* "OTAP" */
+#define OBE_TAP_VERSION 1
+#define OBE_TAP_MAX_CHANNELS 16
+
+enum obe_tap_type_e
+{
+    OBE_TAP_PICTURE,
+    OBE_TAP_METERS,
+};
+
+typedef struct
+{
+    uint32_t magic;       /* written last, once the object is laid out */
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t header_size; /* first entry */
+} obe_tap_header_t;
+
+typedef struct
+{
+    uint32_t type;        /* obe_tap_type_e */
+    uint32_t stream_id;   /* input stream for pictures, output stream for meters */
+    uint32_t entry_size;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t pad;
+    uint64_t write_count;
+} obe_tap_entry_t;
+
+typedef struct
+{
+    uint32_t seq;         /* odd while the slot is written */
+    uint32_t pad;
+    int64_t  pts;         /* 27MHz */
+    int64_t  wallclock;   /* microseconds, CLOCK_MONOTONIC */
+} obe_tap_slot_t;
+
+/* Followed by 8-bit 4:2:0 planes, width x height luma then width/2 x height/2 of each chroma */
+typedef struct
+{
+    uint32_t width;
+    uint32_t height;
+} obe_tap_picture_t;
+
+/* ITU-R BS.1770 loudness of the reading is -0.691 + 10*log10( sum of weight * mean_square )
+ * over the channels, with a weight of 1.41 for surround channels and 0 for LFE */
+typedef struct
+{
+    uint32_t num_channels;
+    uint32_t num_samples;
+    float peak[OBE_TAP_MAX_CHANNELS];        /* largest sample, 1.0 is full scale */
+    float mean_square[OBE_TAP_MAX_CHANNELS]; /* K-weighted */
+} obe_tap_meters_t;
+
+/**** Thread placement *****/
+/* Threads started by a stage, such as x264's or the filter's slice threads, are placed with it */
+enum obe_thread_stage_e
+{
+    OBE_THREAD_INPUT,
+    OBE_THREAD_FILTER,
+    OBE_THREAD_VIDEO_ENCODER,
+    OBE_THREAD_AUDIO_ENCODER,
+    OBE_THREAD_SMOOTHING,
+    OBE_THREAD_MUX,
+    OBE_THREAD_OUTPUT,
+    OBE_NUM_THREAD_STAGES,
+};
+
+enum obe_sched_policy_e
+{
+    OBE_SCHED_DEFAULT, /* realtime for smoothing, mux and outputs, normal for the rest */
+    OBE_SCHED_OTHER,
+    OBE_SCHED_FIFO,
+    OBE_SCHED_RR,
+};
+
+/* cpus     - CPU list such as "2-3,8". NULL runs on the CPUs of the input card's NUMA node if it is known
+ * policy   - obe_sched_policy_e. Realtime policies need CAP_SYS_NICE, without it the thread runs at normal priority
+ * priority - 1 to 99 for the realtime policies
+ */
+typedef struct
+{
+    char *cpus;
+    int policy;
+    int priority;
+} obe_thread_opts_t;
+
+int obe_setup_thread( obe_t *h, int stage, obe_thread_opts_t *thread_opts );
+
+/**** Tracing *****/
+/* Queue pushes and pops, waits on the pipeline's condition variables and contended mutexes,
+ * encode calls and datagram sends are recorded per thread. Each thread keeps its last
+ * 32768 events so a dump covers the last few seconds. Tracing can be turned on and off
+ * and dumped at any time, it is off by default.
+ *
+ * obe_trace_dump writes Chrome trace JSON which chrome://tracing and Perfetto open */
+void obe_trace_enable( int enable );
+int obe_trace_dump( const char *filename );
+
 int obe_start( obe_t *h );
+
+/* obe_stop puts the encoder on warm standby. Only the inputs are stopped, the encoders, mux and
+ * outputs stay open with their buffers already faulted in. The next obe_start just restarts the
+ * inputs so output resumes within a few frames. The gap is handled like a loss of signal.
+ * The streams, mux and outputs can't be changed in standby, obe_close ends it */
 int obe_stop( obe_t *h );
 
+/* obe_update_stream changes a stream while encoding. output_stream is matched to the stream
+ * with the same stream_id and the fields that can change are taken from it:
+ *
+ * x264 video - rc.i_bitrate, rc.i_vbv_max_bitrate, sc.max_preset and sc.f_speed. These are
+ *              taken up at the start of the next GOP. With statmux the vbv-maxrate is the new fair share
+ * any stream - ts_opts lang_code, audio_type, stream_identifier and is_disabled (not for video).
+ *              These need the internal packetizer and go out in a new version of the PMT between two PES
+ *
+ * A zero bitrate, VBV or pid is left as it is. The pid, VBV buffer size and formats can't change */
+int obe_update_stream( obe_t *h, obe_output_stream_t *output_stream );
+
 void obe_close( obe_t *h );
 
 #endif
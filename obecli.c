@@ -46,10 +46,16 @@ typedef struct
     obe_t *h;
     obe_input_t input;
     obe_input_program_t program;
+    int num_output_streams;
+    int num_audio_streams; /* extra audio streams after the renditions */
     obe_output_stream_t *output_streams;
     obe_mux_opts_t mux_opts;
     obe_output_opts_t output;
+    obe_snmp_opts_t snmp_opts;
+    obe_tap_opts_t tap_opts;
+    obe_thread_opts_t thread_opts[OBE_NUM_THREAD_STAGES];
     int avc_profile;
+    int warm_standby; /* stop leaves the encoders open */
 } obecli_ctx_t;
 
 obecli_ctx_t cli;
@@ -59,10 +65,11 @@ static volatile int b_ctrl_c = 0;
 static char *line_read = NULL;
 
 static int running = 0;
+static int standby = 0;
 static int system_type_value = OBE_SYSTEM_TYPE_GENERIC;
 
 static const char * const system_types[]             = { "generic", "lowlatency", 0 };
-static const char * const input_types[]              = { "url", "decklink", "linsys-sdi", 0 };
+static const char * const input_types[]              = { "url", "decklink", "linsys-sdi", "file", 0 };
 static const char * const input_video_formats[]      = { "pal", "ntsc", "720p50", "720p59.94", "720p60", "1080i50", "1080i59.94", "1080i60",
                                                          "1080p23.98", "1080p24", "1080p25", "1080p29.97", "1080p30", "1080p50", "1080p59.94",
                                                          "1080p60", 0 };
@@ -71,16 +78,33 @@ static const char * const input_audio_connections[]  = { "embedded", "aes-ebu",
 static const char * const ttx_locations[]            = { "dvb-ttx", "dvb-vbi", "both", 0 };
 static const char * const wss_outputs[]              = { "afd", "dvb-vbi", "both", 0 };
 static const char * const stream_actions[]           = { "passthrough", "encode", 0 };
-static const char * const encode_formats[]           = { "", "avc", "", "", "mp2", "ac3", "e-ac3", "aac-experimental", 0 };
+static const char * const encode_formats[]           = { "", "avc", "", "hevc", "", "mp2", "ac3", "e-ac3", "aac-experimental", 0 };
 static const char * const frame_packing_modes[]      = { "none", "checkerboard", "column", "row", "side-by-side", "top-bottom", "temporal", 0 };
 static const char * const teletext_types[]           = { "", "initial", "subtitle", "additional-info", "program-schedule", "hearing-imp", 0 };
 static const char * const audio_types[]              = { "undefined", "clean-effects", "hearing-impaired", "visual-impaired", 0 };
 static const char * const aac_encapsulations[]       = { "adts", "latm", 0 };
-static const char * const output_modules[]           = { "udp", "rtp", "linsys-asi", 0 };
-
-static const char * system_opts[] = { "system-type", NULL };
+static const char * const output_modules[]           = { "udp", "rtp", "linsys-asi", "file", "hls", 0 };
+static const char * const file_formats[]             = { "v210", "yuv422p10", 0 };
+static const char * const video_encoders[]           = { "x264", "nvenc", "qsv", 0 };
+static const char * const channel_maps[]             = { "stereo", "mono", "5.1", "5.1-downmix", 0 };
+
+static const char * system_opts[] = { "system-type", "snmp", "agentx-socket",
+                                      /* Thread placement, a CPU list and a scheduling policy for each stage in obe_thread_stage_e order */
+                                      "input-cpus", "input-sched", "filter-cpus", "filter-sched",
+                                      "video-encoder-cpus", "video-encoder-sched", "audio-encoder-cpus", "audio-encoder-sched",
+                                      "smoothing-cpus", "smoothing-sched", "mux-cpus", "mux-sched",
+                                      "output-cpus", "output-sched",
+                                      "warm-standby",
+                                      "tap", "tap-name", "tap-picture-interval", "tap-meter-interval", "tap-width", NULL };
+#define SYSTEM_OPTS_THREADS 3
+#define SYSTEM_OPTS_STANDBY (SYSTEM_OPTS_THREADS+2*OBE_NUM_THREAD_STAGES)
+#define SYSTEM_OPTS_TAP     (SYSTEM_OPTS_STANDBY+1)
+static const char * sched_policies[] = { "default", "other", "fifo", "rr", NULL };
 static const char * input_opts[]  = { "location", "card-idx", "video-format", "video-connection", "audio-connection", "ttx-location",
-                                      "wss-output", NULL };
+                                      "wss-output",
+                                      /* File options */
+                                      "audio-location", "file-format", "fast-replay", "num-frames",
+                                      "numa-node", "capture-buffers", "probe-cache", NULL };
 /* TODO: split the stream options into general options, video options, ts options */
 static const char * stream_opts[] = { "action", "format",
                                       /* Encoding options */
@@ -91,9 +115,21 @@ static const char * stream_opts[] = { "action", "format",
                                       "aac-encap",
                                       /* TS options */
                                       "pid", "lang", "audio-type", "num-ttx", "ttx-lang", "ttx-type", "ttx-mag", "ttx-page",
+                                      /* Rendition options */
+                                      "width", "height",
+                                      /* Video encoder */
+                                      "encoder",
+                                      /* SDI audio channels */
+                                      "channel-map", "channel-offset",
+                                      /* Video filter */
+                                      "deinterlace",
+                                      /* Speedcontrol */
+                                      "max-preset",
+                                      /* Left out of the mux */
+                                      "disabled",
                                       NULL };
 static const char * muxer_opts[]  = { "ts-type", "cbr", "ts-muxrate", "passthrough", "ts-id", "program-num", "pmt-pid", "pcr-pid",
-                                      "pcr-period", "pat-period", NULL };
+                                      "pcr-period", "pat-period", "internal-packetizer", "statmux", NULL };
 static const char * ts_types[]    = { "generic", "dvb", "cablelabs", "atsc", "isdb", NULL };
 static const char * output_opts[] = { "target", NULL };
 
@@ -106,6 +142,17 @@ void obe_cli_printf( const char *name, const char *fmt, ... )
     va_end( arg );
 }
 
+/* Stream ids carry on from one probed input to the next */
+static obe_input_stream_t *get_probed_stream( int stream_id )
+{
+    for( int i = 0; i < cli.program.num_streams; i++ )
+    {
+        if( cli.program.streams[i].stream_id == stream_id )
+            return &cli.program.streams[i];
+    }
+    return NULL;
+}
+
 static char **obe_split_string( char *string, char *sep, uint32_t limit )
 {
     if( !string )
@@ -309,6 +356,33 @@ static int parse_enum_value( const char *arg, const char * const *names, int *ds
 }
 
 /* set functions - TODO add lots more opts */
+/* policy[:priority], the realtime policies default to the highest priority */
+static int parse_sched( const char *value, obe_thread_opts_t *thread_opts )
+{
+    char policy[16], *end;
+    const char *colon = strchr( value, ':' );
+    int len = colon ? colon - value : strlen( value );
+
+    if( len >= (int)sizeof(policy) )
+        return -1;
+    memcpy( policy, value, len );
+    policy[len] = 0;
+
+    if( check_enum_value( policy, sched_policies ) < 0 )
+        return -1;
+    parse_enum_value( policy, sched_policies, &thread_opts->policy );
+
+    thread_opts->priority = 99;
+    if( colon )
+    {
+        thread_opts->priority = strtol( colon + 1, &end, 10 );
+        if( end == colon + 1 || *end )
+            return -1;
+    }
+
+    return 0;
+}
+
 static int set_obe( char *command, obecli_command_t *child )
 {
     if( !strlen( command ) )
@@ -326,6 +400,8 @@ static int set_obe( char *command, obecli_command_t *child )
             return -1;
 
         char *system_type     = obe_get_option( system_opts[0], opts );
+        char *snmp            = obe_get_option( system_opts[1], opts );
+        char *agentx_socket   = obe_get_option( system_opts[2], opts );
 
         FAIL_IF_ERROR( system_type && ( check_enum_value( system_type, system_types ) < 0 ),
                        "Invalid system type\n" );
@@ -338,6 +414,48 @@ static int set_obe( char *command, obecli_command_t *child )
             obe_set_config( cli.h, system_type_value );
         }
 
+        for( int i = 0; i < OBE_NUM_THREAD_STAGES; i++ )
+        {
+            char *cpus  = obe_get_option( system_opts[SYSTEM_OPTS_THREADS+2*i], opts );
+            char *sched = obe_get_option( system_opts[SYSTEM_OPTS_THREADS+2*i+1], opts );
+            obe_thread_opts_t *thread_opts = &cli.thread_opts[i];
+
+            if( !cpus && !sched )
+                continue;
+
+            /* The stage keeps whichever of the two isn't given */
+            if( cpus )
+            {
+                free( thread_opts->cpus );
+                thread_opts->cpus = strdup( cpus );
+                FAIL_IF_ERROR( !thread_opts->cpus, "malloc failed\n" );
+            }
+            FAIL_IF_ERROR( sched && parse_sched( sched, thread_opts ) < 0,
+                           "Invalid scheduling \"%s\", use other, fifo[:priority] or rr[:priority]\n", sched );
+            FAIL_IF_ERROR( obe_setup_thread( cli.h, i, thread_opts ) < 0, "Invalid thread placement\n" );
+        }
+
+        cli.snmp_opts.enabled = obe_otoi( snmp, cli.snmp_opts.enabled );
+        cli.warm_standby = obe_otoi( obe_get_option( system_opts[SYSTEM_OPTS_STANDBY], opts ), cli.warm_standby );
+
+        cli.tap_opts.enabled          = obe_otoi( obe_get_option( system_opts[SYSTEM_OPTS_TAP], opts ), cli.tap_opts.enabled );
+        cli.tap_opts.picture_interval = obe_otoi( obe_get_option( system_opts[SYSTEM_OPTS_TAP+2], opts ), cli.tap_opts.picture_interval );
+        cli.tap_opts.meter_interval   = obe_otoi( obe_get_option( system_opts[SYSTEM_OPTS_TAP+3], opts ), cli.tap_opts.meter_interval );
+        cli.tap_opts.width            = obe_otoi( obe_get_option( system_opts[SYSTEM_OPTS_TAP+4], opts ), cli.tap_opts.width );
+        if( obe_get_option( system_opts[SYSTEM_OPTS_TAP+1], opts ) )
+        {
+            free( cli.tap_opts.name );
+            cli.tap_opts.name = strdup( obe_get_option( system_opts[SYSTEM_OPTS_TAP+1], opts ) );
+            FAIL_IF_ERROR( !cli.tap_opts.name, "malloc failed\n" );
+        }
+        if( agentx_socket )
+        {
+            if( cli.snmp_opts.agentx_socket )
+                free( cli.snmp_opts.agentx_socket );
+            cli.snmp_opts.agentx_socket = strdup( agentx_socket );
+            FAIL_IF_ERROR( !cli.snmp_opts.agentx_socket, "malloc failed\n" );
+        }
+
         obe_free_string_array( opts );
     }
 
@@ -367,6 +485,13 @@ static int set_input( char *command, obecli_command_t *child )
         char *audio_connection = obe_get_option( input_opts[4], opts );
         char *ttx_location = obe_get_option( input_opts[5], opts );
         char *wss_output   = obe_get_option( input_opts[6], opts );
+        char *audio_location = obe_get_option( input_opts[7], opts );
+        char *file_format  = obe_get_option( input_opts[8], opts );
+        char *fast_replay  = obe_get_option( input_opts[9], opts );
+        char *num_frames   = obe_get_option( input_opts[10], opts );
+        char *numa_node    = obe_get_option( input_opts[11], opts );
+        char *capture_buffers = obe_get_option( input_opts[12], opts );
+        char *probe_cache  = obe_get_option( input_opts[13], opts );
 
         FAIL_IF_ERROR( video_format && ( check_enum_value( video_format, input_video_formats ) < 0 ),
                        "Invalid video format\n" );
@@ -383,6 +508,9 @@ static int set_input( char *command, obecli_command_t *child )
         FAIL_IF_ERROR( wss_output && ( check_enum_value( wss_output, wss_outputs ) < 0 ),
                        "Invalid WSS output location\n" );
 
+        FAIL_IF_ERROR( file_format && ( check_enum_value( file_format, file_formats ) < 0 ),
+                       "Invalid file format\n" );
+
         if( location )
         {
              if( cli.input.location )
@@ -393,6 +521,25 @@ static int set_input( char *command, obecli_command_t *child )
              strcpy( cli.input.location, location );
         }
 
+        if( audio_location )
+        {
+             if( cli.input.audio_location )
+                 free( cli.input.audio_location );
+
+             cli.input.audio_location = malloc( strlen( audio_location ) + 1 );
+             FAIL_IF_ERROR( !cli.input.audio_location, "malloc failed\n" );
+             strcpy( cli.input.audio_location, audio_location );
+        }
+
+        if( probe_cache )
+        {
+             if( cli.input.probe_cache )
+                 free( cli.input.probe_cache );
+
+             cli.input.probe_cache = strdup( probe_cache );
+             FAIL_IF_ERROR( !cli.input.probe_cache, "malloc failed\n" );
+        }
+
         cli.input.card_idx = obe_otoi( card_idx, cli.input.card_idx );
         if( video_format )
             parse_enum_value( video_format, input_video_formats, &cli.input.video_format );
@@ -404,6 +551,12 @@ static int set_input( char *command, obecli_command_t *child )
             parse_enum_value( ttx_location, ttx_locations, &cli.input.teletext_location );
         if( wss_output )
             parse_enum_value( wss_output, wss_outputs, &cli.input.wss_output );
+        if( file_format )
+            parse_enum_value( file_format, file_formats, &cli.input.file_format );
+        cli.input.fast_replay = obe_otob( fast_replay, cli.input.fast_replay );
+        cli.input.num_frames = obe_otoi( num_frames, cli.input.num_frames );
+        cli.input.numa_node = obe_otoi( numa_node, cli.input.numa_node );
+        cli.input.num_capture_buffers = obe_otoi( capture_buffers, cli.input.num_capture_buffers );
 
         obe_free_string_array( opts );
     }
@@ -435,9 +588,11 @@ static int set_stream( char *command, obecli_command_t *child )
         int stream_id = obe_otoi( command, -1 );
 
 
-        FAIL_IF_ERROR( stream_id < 0 || stream_id > cli.program.num_streams-1,
+        FAIL_IF_ERROR( stream_id < 0 || stream_id > cli.num_output_streams-1,
                        "Invalid stream id\n" );
 
+        obe_input_stream_t *input_stream = get_probed_stream( cli.output_streams[stream_id].input_stream_id );
+
         if( str_len > str_len2 )
         {
             char *params = command + tok_len2 + 1;
@@ -466,6 +621,14 @@ static int set_stream( char *command, obecli_command_t *child )
             char *csp         = obe_get_option( stream_opts[18], opts );
             char *filler      = obe_get_option( stream_opts[19], opts );
             char *intra_refresh = obe_get_option( stream_opts[20], opts );
+            char *width       = obe_get_option( stream_opts[30], opts );
+            char *height      = obe_get_option( stream_opts[31], opts );
+            char *encoder     = obe_get_option( stream_opts[32], opts );
+            char *channel_map = obe_get_option( stream_opts[33], opts );
+            char *channel_offset = obe_get_option( stream_opts[34], opts );
+            char *deinterlace = obe_get_option( stream_opts[35], opts );
+            char *max_preset  = obe_get_option( stream_opts[36], opts );
+            char *disabled    = obe_get_option( stream_opts[37], opts );
 
             char *aac_encap   = obe_get_option( stream_opts[21], opts );
 
@@ -474,7 +637,7 @@ static int set_stream( char *command, obecli_command_t *child )
             char *lang        = obe_get_option( stream_opts[23], opts );
             char *audio_type  = obe_get_option( stream_opts[24], opts );
 
-            if( cli.program.streams[stream_id].stream_type == STREAM_TYPE_VIDEO )
+            if( input_stream->stream_type == STREAM_TYPE_VIDEO )
             {
                 x264_param_t *avc_param = &cli.output_streams[stream_id].avc_param;
 
@@ -487,9 +650,23 @@ static int set_stream( char *command, obecli_command_t *child )
                 FAIL_IF_ERROR( frame_packing && ( check_enum_value( frame_packing, frame_packing_modes ) < 0 ),
                                "Invalid frame packing mode\n" )
 
+                FAIL_IF_ERROR( action && ( check_enum_value( action, stream_actions ) < 0 ),
+                              "Invalid stream action\n" );
+
+                FAIL_IF_ERROR( encoder && ( check_enum_value( encoder, video_encoders ) < 0 ),
+                              "Invalid video encoder\n" );
+
+                FAIL_IF_ERROR( format && strcasecmp( format, "avc" ) && strcasecmp( format, "hevc" ),
+                              "Invalid video format\n" );
+
                 /* Set it to encode by default */
                 cli.output_streams[stream_id].stream_action = STREAM_ENCODE;
-                cli.output_streams[stream_id].stream_format = VIDEO_AVC;
+                if( cli.output_streams[stream_id].stream_format != VIDEO_HEVC )
+                    cli.output_streams[stream_id].stream_format = VIDEO_AVC;
+                if( action )
+                    parse_enum_value( action, stream_actions, &cli.output_streams[stream_id].stream_action );
+                if( format )
+                    parse_enum_value( format, encode_formats, &cli.output_streams[stream_id].stream_format );
                 avc_param->rc.i_vbv_max_bitrate = obe_otoi( vbv_maxrate, 0 );
                 avc_param->rc.i_vbv_buffer_size = obe_otoi( vbv_bufsize, 0 );
                 avc_param->rc.i_bitrate         = obe_otoi( bitrate, 0 );
@@ -504,6 +681,20 @@ static int set_stream( char *command, obecli_command_t *child )
                 avc_param->b_interlaced        = obe_otob( interlaced, avc_param->b_interlaced );
                 avc_param->b_tff               = obe_otob( tff, avc_param->b_tff );
                 avc_param->b_intra_refresh     = obe_otob( intra_refresh, avc_param->b_intra_refresh );
+                avc_param->i_width             = obe_otoi( width, avc_param->i_width );
+                avc_param->i_height            = obe_otoi( height, avc_param->i_height );
+                avc_param->sc.max_preset       = obe_otoi( max_preset, avc_param->sc.max_preset );
+
+                cli.output_streams[stream_id].deinterlace = obe_otob( deinterlace, cli.output_streams[stream_id].deinterlace );
+                if( cli.output_streams[stream_id].deinterlace )
+                    avc_param->b_interlaced = 0;
+
+                if( encoder )
+                    parse_enum_value( encoder, video_encoders, &cli.output_streams[stream_id].video_encoder );
+
+                FAIL_IF_ERROR( cli.output_streams[stream_id].stream_format == VIDEO_HEVC &&
+                               cli.output_streams[stream_id].video_encoder != VIDEO_ENCODER_X264,
+                               "HEVC is only encoded with x265\n" );
 
                 if( profile )
                     parse_enum_value( profile, x264_profile_names, &cli.avc_profile );
@@ -539,7 +730,7 @@ static int set_stream( char *command, obecli_command_t *child )
                     cli.mux_opts.is_3dtv = 1;
 
             }
-            else if( cli.program.streams[stream_id].stream_type == STREAM_TYPE_AUDIO )
+            else if( input_stream->stream_type == STREAM_TYPE_AUDIO )
             {
                 int default_bitrate = 0;
 
@@ -558,6 +749,9 @@ static int set_stream( char *command, obecli_command_t *child )
                 FAIL_IF_ERROR( audio_type && check_enum_value( audio_type, audio_types ) < 0,
                               "Invalid audio type\n" );
 
+                FAIL_IF_ERROR( channel_map && check_enum_value( channel_map, channel_maps ) < 0,
+                              "Invalid channel map\n" );
+
                 FAIL_IF_ERROR( audio_type && check_enum_value( audio_type, audio_types ) >= 0 &&
                                !cli.output_streams[stream_id].ts_opts.write_lang_code && !( lang && strlen( lang ) >= 3 ),
                                "Audio type requires setting a language\n" );
@@ -568,6 +762,10 @@ static int set_stream( char *command, obecli_command_t *child )
                     parse_enum_value( format, encode_formats, &cli.output_streams[stream_id].stream_format );
                 if( audio_type )
                     parse_enum_value( audio_type, audio_types, &cli.output_streams[stream_id].ts_opts.audio_type );
+                if( channel_map )
+                    parse_enum_value( channel_map, channel_maps, &cli.output_streams[stream_id].channel_map );
+                cli.output_streams[stream_id].channel_offset = obe_otoi( channel_offset, cli.output_streams[stream_id].channel_offset );
+                cli.output_streams[stream_id].ts_opts.is_disabled = obe_otob( disabled, cli.output_streams[stream_id].ts_opts.is_disabled );
 
                 if( cli.output_streams[stream_id].stream_format == AUDIO_MP2 )
                     default_bitrate = 256;
@@ -592,8 +790,8 @@ static int set_stream( char *command, obecli_command_t *child )
                     cli.output_streams[stream_id].ts_opts.lang_code[3] = 0;
                 }
             }
-            else if( cli.program.streams[stream_id].stream_format == MISC_TELETEXT ||
-                     cli.program.streams[stream_id].stream_format == VBI_RAW )
+            else if( input_stream->stream_format == MISC_TELETEXT ||
+                     input_stream->stream_format == VBI_RAW )
             {
                 /* NB: remap these if more encoding options are added - TODO: split them up */
                 char *ttx_lang = obe_get_option( stream_opts[26], opts );
@@ -662,6 +860,8 @@ static int set_muxer( char *command, obecli_command_t *child )
         char *pcr_pid     = obe_get_option( muxer_opts[7], opts );
         char *pcr_period  = obe_get_option( muxer_opts[8], opts );
         char *pat_period  = obe_get_option( muxer_opts[9], opts );
+        char *internal_packetizer = obe_get_option( muxer_opts[10], opts );
+        char *statmux     = obe_get_option( muxer_opts[11], opts );
 
         FAIL_IF_ERROR( ts_type && ( check_enum_value( ts_type, ts_types ) < 0 ),
                       "Invalid AVC profile\n" );
@@ -679,12 +879,133 @@ static int set_muxer( char *command, obecli_command_t *child )
         cli.mux_opts.pcr_pid    = obe_otoi( pcr_pid, cli.mux_opts.pcr_pid  );
         cli.mux_opts.pcr_period = obe_otoi( pcr_period, cli.mux_opts.pcr_period );
         cli.mux_opts.pat_period = obe_otoi( pat_period, cli.mux_opts.pat_period );
+        cli.mux_opts.internal_packetizer = obe_otob( internal_packetizer, cli.mux_opts.internal_packetizer );
+        cli.mux_opts.statmux = obe_otob( statmux, cli.mux_opts.statmux );
         obe_free_string_array( opts );
     }
 
     return 0;
 }
 
+static int set_outputs( char *command, obecli_command_t *child )
+{
+    if( !strlen( command ) )
+        return -1;
+
+    int num_outputs = obe_otoi( command, -1 );
+    FAIL_IF_ERROR( num_outputs < 1, "Invalid number of outputs\n" );
+
+    for( int i = num_outputs; i < cli.output.num_outputs; i++ )
+    {
+        if( cli.output.outputs[i].target )
+            free( cli.output.outputs[i].target );
+    }
+
+    obe_output_dst_t *outputs = realloc( cli.output.outputs, num_outputs * sizeof(*outputs) );
+    FAIL_IF_ERROR( !outputs, "malloc failed\n" );
+    for( int i = cli.output.num_outputs; i < num_outputs; i++ )
+        memset( &outputs[i], 0, sizeof(*outputs) );
+
+    cli.output.outputs = outputs;
+    cli.output.num_outputs = num_outputs;
+
+    return 0;
+}
+
+/* Extra renditions of the video stream are numbered after the input streams */
+static int set_renditions( char *command, obecli_command_t *child )
+{
+    int video_id = -1;
+
+    if( !strlen( command ) )
+        return -1;
+
+    FAIL_IF_ERROR( !cli.program.num_streams, "No active devices\n" );
+
+    int num_renditions = obe_otoi( command, -1 );
+    FAIL_IF_ERROR( num_renditions < 1, "Invalid number of renditions\n" );
+    FAIL_IF_ERROR( cli.num_audio_streams, "Renditions must be set before audio streams\n" );
+
+    for( int i = 0; i < cli.program.num_streams; i++ )
+    {
+        if( cli.program.streams[i].stream_type == STREAM_TYPE_VIDEO )
+            video_id = i;
+    }
+    FAIL_IF_ERROR( video_id < 0, "No video stream\n" );
+
+    int num_output_streams = cli.program.num_streams + num_renditions - 1;
+    obe_output_stream_t *output_streams = realloc( cli.output_streams, num_output_streams * sizeof(*output_streams) );
+    FAIL_IF_ERROR( !output_streams, "malloc failed\n" );
+
+    for( int i = cli.num_output_streams; i < num_output_streams; i++ )
+    {
+        memset( &output_streams[i], 0, sizeof(*output_streams) );
+        output_streams[i].stream_id = i;
+        output_streams[i].input_stream_id = cli.program.streams[video_id].stream_id;
+        output_streams[i].stream_action = STREAM_ENCODE;
+        obe_populate_avc_encoder_params( cli.h, output_streams[i].input_stream_id, &output_streams[i].avc_param );
+    }
+
+    cli.output_streams = output_streams;
+    cli.num_output_streams = num_output_streams;
+
+    return 0;
+}
+
+/* Extra audio streams are made from the first audio input stream, each with its own channel map */
+static int set_audio_streams( char *command, obecli_command_t *child )
+{
+    int audio_id = -1;
+
+    if( !strlen( command ) )
+        return -1;
+
+    FAIL_IF_ERROR( !cli.program.num_streams, "No active devices\n" );
+
+    int num_audio_streams = obe_otoi( command, -1 );
+    FAIL_IF_ERROR( num_audio_streams < 1, "Invalid number of audio streams\n" );
+
+    for( int i = 0; i < cli.program.num_streams && audio_id < 0; i++ )
+    {
+        if( cli.program.streams[i].stream_type == STREAM_TYPE_AUDIO )
+            audio_id = i;
+    }
+    FAIL_IF_ERROR( audio_id < 0, "No audio stream\n" );
+
+    /* The input's own audio stream is the first one */
+    int num_output_streams = cli.num_output_streams - cli.num_audio_streams + num_audio_streams - 1;
+
+    obe_output_stream_t *output_streams = realloc( cli.output_streams, num_output_streams * sizeof(*output_streams) );
+    FAIL_IF_ERROR( !output_streams, "malloc failed\n" );
+
+    /* New streams start with the settings of the input's own audio stream */
+    for( int i = cli.num_output_streams; i < num_output_streams; i++ )
+    {
+        memcpy( &output_streams[i], &output_streams[audio_id], sizeof(*output_streams) );
+        output_streams[i].stream_id = i;
+        output_streams[i].ts_opts.pid = 0;
+    }
+
+    cli.output_streams = output_streams;
+    cli.num_output_streams = num_output_streams;
+    cli.num_audio_streams = num_audio_streams - 1;
+
+    return 0;
+}
+
+/* Strips an optional "outputid:" prefix. Output 0 is used if there isn't one */
+static int get_output_id( char **command )
+{
+    char *end;
+    int output_id = strtol( *command, &end, 10 );
+
+    if( end == *command || *end != ':' )
+        return 0;
+
+    *command = end + 1;
+    return output_id;
+}
+
 static int set_output( char *command, obecli_command_t *child )
 {
     if( !strlen( command ) )
@@ -697,6 +1018,11 @@ static int set_output( char *command, obecli_command_t *child )
     if( !strcasecmp( command, "opts" ) && str_len > tok_len )
     {
         char *params = command + tok_len + 1;
+        int output_id = get_output_id( &params );
+        FAIL_IF_ERROR( output_id < 0 || output_id > cli.output.num_outputs-1,
+                       "Invalid output id\n" );
+
+        obe_output_dst_t *output_dst = &cli.output.outputs[output_id];
         char **opts = obe_split_options( params, output_opts );
         if( !opts && params )
             return -1;
@@ -704,18 +1030,22 @@ static int set_output( char *command, obecli_command_t *child )
         char *target = obe_get_option( output_opts[0], opts );
         if( target )
         {
-             if( cli.output.target )
-                 free( cli.output.target );
+             if( output_dst->target )
+                 free( output_dst->target );
 
-             cli.output.target = malloc( strlen( target ) + 1 );
-             FAIL_IF_ERROR( !cli.output.target, "malloc failed\n" );
-             strcpy( cli.output.target, target );
+             output_dst->target = malloc( strlen( target ) + 1 );
+             FAIL_IF_ERROR( !output_dst->target, "malloc failed\n" );
+             strcpy( output_dst->target, target );
         }
         obe_free_string_array( opts );
     }
     else
     {
-        FAIL_IF_ERROR( parse_enum_value( command, output_modules, &cli.output.output ) < 0,
+        int output_id = get_output_id( &command );
+        FAIL_IF_ERROR( output_id < 0 || output_id > cli.output.num_outputs-1,
+                       "Invalid output id\n" );
+
+        FAIL_IF_ERROR( parse_enum_value( command, output_modules, &cli.output.outputs[output_id].type ) < 0,
                        "Invalid output %s\n", command )
     }
 
@@ -808,6 +1138,12 @@ static int show_help( char *command, obecli_command_t *child )
 
     H0( "\n" );
 
+    H0( "trace - Record a timeline trace\n" );
+    for( int i = 0; trace_commands[i].name != 0; i++ )
+        H0( "       %-*s %-*s  - %s \n", 8, trace_commands[i].name, 21, trace_commands[i].child_opts, trace_commands[i].description );
+
+    H0( "\n" );
+
     return 0;
 }
 
@@ -856,14 +1192,76 @@ static int show_outputs( char *command, obecli_command_t *child )
     return 0;
 }
 
+static int show_stats( char *command, obecli_command_t *child )
+{
+    static const char * const stage_names[] = { "filter", "encode", "smoothing", "mux", "output" };
+    obe_stats_t stats;
+
+    FAIL_IF_ERROR( !running, "Encoder not running\n" );
+
+    if( obe_get_stats( cli.h, &stats ) < 0 )
+        return -1;
+
+    printf( "\nLatency since capture (us): \n" );
+    printf( "       %-10s %10s %10s %10s %10s \n", "stage", "frames", "p50", "p99", "max" );
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+    {
+        obe_latency_stats_t *latency = &stats.latency[i];
+        printf( "       %-10s %10"PRIi64" %10"PRIi64" %10"PRIi64" %10"PRIi64" \n", stage_names[i],
+                latency->count, latency->p50, latency->p99, latency->max );
+    }
+
+    printf( "\nQueues: \n" );
+    printf( "       %-10s %4s %6s %10s %10s %10s \n", "queue", "id", "depth", "capacity", "high-water", "overflows" );
+    for( int i = 0; i < stats.num_queues; i++ )
+    {
+        obe_queue_stats_t *queue = &stats.queues[i];
+        printf( "       %-10s %4i %6i %10i %10i %10"PRIi64" \n", queue->name, queue->id, queue->depth,
+                queue->capacity, queue->high_water, queue->num_overflows );
+    }
+
+    printf( "\nInputs: \n" );
+    for( int i = 0; i < stats.num_inputs; i++ )
+        printf( "       %i: signal %s, %"PRIi64" losses%s \n", i, stats.inputs[i].signal_lock ? "locked" : "not locked",
+                stats.inputs[i].num_signal_losses, stats.inputs[i].is_active ? "" : ", standby" );
+
+    printf( "\nInput clock: drift %.3f ppm, jitter %"PRIi64" us, %"PRIi64" resyncs \n",
+            stats.clock.drift_ppb / 1000.0, stats.clock.jitter, stats.clock.num_resyncs );
+
+    printf( "\nOutputs: \n" );
+    for( int i = 0; i < stats.num_outputs; i++ )
+        printf( "       %i: %"PRIi64" bytes sent \n", i, stats.outputs[i].bytes_sent );
+
+    printf( "\nDropped frames: %"PRIi64" \n", stats.num_dropped_frames );
+    printf( "Frame pool drops: %"PRIi64" \n", stats.num_frame_pool_drops );
+    printf( "Failovers: %"PRIi64" \n", stats.num_failovers );
+
+    return 0;
+}
+
 static int start_encode( char *command, obecli_command_t *child )
 {
     FAIL_IF_ERROR( running, "Encoder already running\n" );
+
+    /* The settings were checked the first time and can't have changed */
+    if( standby )
+    {
+        if( obe_start( cli.h ) < 0 )
+            return -1;
+
+        standby = 0;
+        running = 1;
+        printf( "Encoding resumed\n" );
+        return 0;
+    }
+
     FAIL_IF_ERROR( !cli.program.num_streams, "No active devices\n" );
 
-    for( int i = 0; i < cli.program.num_streams; i++ )
+    for( int i = 0; i < cli.num_output_streams; i++ )
     {
-        if( cli.program.streams[i].stream_type == STREAM_TYPE_VIDEO )
+        obe_input_stream_t *input_stream = get_probed_stream( cli.output_streams[i].input_stream_id );
+
+        if( input_stream->stream_type == STREAM_TYPE_VIDEO && cli.output_streams[i].stream_action == STREAM_ENCODE )
         {
             /* x264 calculates the single-frame VBV size later on */
             FAIL_IF_ERROR( system_type_value == OBE_SYSTEM_TYPE_GENERIC && !cli.output_streams[i].avc_param.rc.i_vbv_buffer_size,
@@ -875,14 +1273,14 @@ static int start_encode( char *command, obecli_command_t *child )
             if( cli.output_streams[i].avc_param.rc.i_vbv_max_bitrate && !cli.output_streams[i].avc_param.rc.i_bitrate )
                 cli.output_streams[i].avc_param.rc.i_bitrate = cli.output_streams[i].avc_param.rc.i_vbv_max_bitrate;
 
-            cli.output_streams[i].stream_action = STREAM_ENCODE;
-            cli.output_streams[i].stream_format = VIDEO_AVC;
-            if( cli.avc_profile >= 0 )
+            if( cli.output_streams[i].stream_format != VIDEO_HEVC )
+                cli.output_streams[i].stream_format = VIDEO_AVC;
+            if( cli.avc_profile >= 0 && cli.output_streams[i].stream_format == VIDEO_AVC )
                 x264_param_apply_profile( &cli.output_streams[i].avc_param, x264_profile_names[cli.avc_profile] );
         }
-        else if( cli.program.streams[i].stream_type == STREAM_TYPE_AUDIO )
+        else if( input_stream->stream_type == STREAM_TYPE_AUDIO )
         {
-            if( cli.output_streams[i].stream_action == STREAM_PASSTHROUGH && cli.program.streams[i].stream_format == AUDIO_PCM &&
+            if( cli.output_streams[i].stream_action == STREAM_PASSTHROUGH && input_stream->stream_format == AUDIO_PCM &&
                 cli.output_streams[i].stream_format != AUDIO_MP2 && cli.output_streams[i].stream_format != AUDIO_AC_3 &&
                 cli.output_streams[i].stream_format != AUDIO_AAC )
             {
@@ -895,16 +1293,16 @@ static int start_encode( char *command, obecli_command_t *child )
                 return -1;
             }
         }
-        else if( cli.program.streams[i].stream_format == MISC_TELETEXT || cli.program.streams[i].stream_format == VBI_RAW )
+        else if( input_stream->stream_format == MISC_TELETEXT || input_stream->stream_format == VBI_RAW )
         {
-            int found = cli.program.streams[i].stream_format == MISC_TELETEXT;
+            int found = input_stream->stream_format == MISC_TELETEXT;
 
             /* Search the VBI streams for teletext and complain if teletext isn't set up properly */
-            if( cli.program.streams[i].stream_format == VBI_RAW )
+            if( input_stream->stream_format == VBI_RAW )
             {
-                for( int j = 0; j < cli.program.streams[i].num_frame_data; j++ )
+                for( int j = 0; j < input_stream->num_frame_data; j++ )
                 {
-                    if( cli.program.streams[i].frame_data[j].type == MISC_TELETEXT )
+                    if( input_stream->frame_data[j].type == MISC_TELETEXT )
                     {
                         found = 1;
                         break;
@@ -919,15 +1317,25 @@ static int start_encode( char *command, obecli_command_t *child )
 
     FAIL_IF_ERROR( !cli.mux_opts.ts_muxrate, "No mux rate selected\n" );
 
-    if( ( cli.output.output == OUTPUT_UDP || cli.output.output == OUTPUT_RTP ) && !cli.output.target )
+    for( int i = 0; i < cli.output.num_outputs; i++ )
     {
-        fprintf( stderr, "No output target chosen\n" );
-        return -1;
+        if( ( cli.output.outputs[i].type == OUTPUT_UDP || cli.output.outputs[i].type == OUTPUT_RTP ||
+             cli.output.outputs[i].type == OUTPUT_FILE ) && !cli.output.outputs[i].target )
+        {
+            fprintf( stderr, "No output target chosen for output %i\n", i );
+            return -1;
+        }
     }
 
-    obe_setup_streams( cli.h, cli.output_streams, cli.program.num_streams );
+    if( obe_setup_streams( cli.h, cli.output_streams, cli.num_output_streams ) < 0 )
+        return -1;
     obe_setup_muxer( cli.h, &cli.mux_opts );
-    obe_setup_output( cli.h, &cli.output );
+    if( obe_setup_output( cli.h, &cli.output ) < 0 )
+        return -1;
+    if( obe_setup_snmp( cli.h, &cli.snmp_opts ) < 0 )
+        return -1;
+    if( obe_setup_tap( cli.h, &cli.tap_opts ) < 0 )
+        return -1;
     if( obe_start( cli.h ) < 0 )
         return -1;
 
@@ -939,11 +1347,68 @@ static int start_encode( char *command, obecli_command_t *child )
 
 static int stop_encode( char *command, obecli_command_t *child )
 {
+    if( cli.warm_standby && running )
+    {
+        if( obe_stop( cli.h ) < 0 )
+            return -1;
+
+        running = 0;
+        standby = 1;
+        printf( "Encoding stopped, encoders on standby\n" );
+        return 0;
+    }
+
     obe_close( cli.h );
 
     return 0;
 }
 
+/* update functions */
+static int update_stream( char *command, obecli_command_t *child )
+{
+    FAIL_IF_ERROR( !running && !standby, "Encoder not running\n" );
+
+    int stream_id = obe_otoi( command, -1 );
+
+    FAIL_IF_ERROR( stream_id < 0 || stream_id > cli.num_output_streams-1,
+                   "Invalid stream id\n" );
+
+    if( obe_update_stream( cli.h, &cli.output_streams[stream_id] ) < 0 )
+        return -1;
+
+    printf( "Stream %i updated\n", stream_id );
+
+    return 0;
+}
+
+/* trace functions */
+static int trace_start( char *command, obecli_command_t *child )
+{
+    obe_trace_enable( 1 );
+
+    return 0;
+}
+
+static int trace_stop( char *command, obecli_command_t *child )
+{
+    obe_trace_enable( 0 );
+
+    return 0;
+}
+
+/* Events keep being recorded while the file is written so a dump can be taken as soon as something goes wrong */
+static int trace_dump( char *command, obecli_command_t *child )
+{
+    FAIL_IF_ERROR( !strlen( command ), "No trace file given\n" );
+
+    if( obe_trace_dump( command ) < 0 )
+        return -1;
+
+    printf( "Trace written to %s \n", command );
+
+    return 0;
+}
+
 static char *get_format_name( int stream_format, const obecli_format_name_t *names, int long_name )
 {
     int i = 0;
@@ -963,16 +1428,40 @@ static int probe_device( char *command, obecli_command_t *child )
     if( !strlen( command ) )
         return -1;
 
+    /* The backup carries the same streams so the stream list and output streams are kept */
+    if( !strcasecmp( command, "backup" ) )
+    {
+        FAIL_IF_ERROR( !cli.program.num_streams, "The main input must be probed before the backup\n" )
+        if( obe_probe_backup_device( cli.h, &cli.input ) < 0 )
+            return -1;
+
+        printf( "\nBackup input probed \n\n" );
+        return 0;
+    }
+
     FAIL_IF_ERROR( strcasecmp( command, "input" ), "%s is not a valid item to probe\n", command )
 
     /* TODO check for validity */
 
-    if( obe_probe_device( cli.h, &cli.input, &cli.program ) < 0 )
+    /* Each probed input becomes another program of the transport stream */
+    obe_input_program_t program = {0};
+    if( obe_probe_device( cli.h, &cli.input, &program ) < 0 )
         return -1;
 
+    int first_stream = cli.program.num_streams;
+    obe_input_stream_t *streams = realloc( cli.program.streams, ( first_stream + program.num_streams ) * sizeof(*streams) );
+    if( streams )
+    {
+        memcpy( &streams[first_stream], program.streams, program.num_streams * sizeof(*streams) );
+        cli.program.streams = streams;
+        cli.program.num_streams += program.num_streams;
+    }
+    free( program.streams );
+    FAIL_IF_ERROR( !streams, "malloc failed\n" );
+
     printf("\n");
 
-    for( int i = 0; i < cli.program.num_streams; i++ )
+    for( int i = first_stream; i < cli.program.num_streams; i++ )
     {
         stream = &cli.program.streams[i];
         format_name = get_format_name( stream->stream_format, format_names, 0 );
@@ -1034,11 +1523,17 @@ static int probe_device( char *command, obecli_command_t *child )
             fprintf( stderr, "Malloc failed \n" );
             return -1;
         }
+        cli.num_output_streams = cli.program.num_streams;
+        cli.num_audio_streams = 0;
         for( int i = 0; i < cli.program.num_streams; i++ )
         {
-            cli.output_streams[i].stream_id = cli.program.streams[i].stream_id;
+            cli.output_streams[i].stream_id = cli.output_streams[i].input_stream_id = cli.program.streams[i].stream_id;
             if( cli.program.streams[i].stream_type == STREAM_TYPE_VIDEO )
+            {
+                /* Video is encoded unless the stream is set to passthrough */
+                cli.output_streams[i].stream_action = STREAM_ENCODE;
                 obe_populate_avc_encoder_params( cli.h, cli.program.streams[i].stream_id, &(cli.output_streams[i].avc_param) );
+            }
         }
     }
 
@@ -1091,6 +1586,15 @@ int main( int argc, char **argv )
     }
 
     cli.avc_profile = -1;
+    cli.input.numa_node = -1;
+
+    cli.output.outputs = calloc( 1, sizeof(*cli.output.outputs) );
+    if( !cli.output.outputs )
+    {
+        fprintf( stderr, "malloc failed\n" );
+        return -1;
+    }
+    cli.output.num_outputs = 1;
 
     printf( "\nOpen Broadcast Encoder command line interface.\n" );
     printf( "Version 0.1-beta \n" );
@@ -1129,6 +1633,22 @@ int main( int argc, char **argv )
     if( cli.output_streams )
         free( cli.output_streams );
 
+    if( cli.program.streams )
+        free( cli.program.streams );
+
+    for( int i = 0; i < cli.output.num_outputs; i++ )
+    {
+        if( cli.output.outputs[i].target )
+            free( cli.output.outputs[i].target );
+    }
+    free( cli.output.outputs );
+
+    if( cli.snmp_opts.agentx_socket )
+        free( cli.snmp_opts.agentx_socket );
+    free( cli.tap_opts.name );
+    for( int i = 0; i < OBE_NUM_THREAD_STAGES; i++ )
+        free( cli.thread_opts[i].cpus );
+
     if( cli.h )
         obe_close( cli.h );
 
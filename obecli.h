@@ -44,6 +44,9 @@ static int set_obe( char *command, obecli_command_t *child );
 static int set_input( char *command, obecli_command_t *child );
 static int set_stream( char *command, obecli_command_t *child );
 static int set_muxer( char *command, obecli_command_t *child );
+static int set_outputs( char *command, obecli_command_t *child );
+static int set_renditions( char *command, obecli_command_t *child );
+static int set_audio_streams( char *command, obecli_command_t *child );
 static int set_output( char *command, obecli_command_t *child );
 
 static int show_bitdepth( char *command, obecli_command_t *child );
@@ -53,10 +56,17 @@ static int show_help( char *command, obecli_command_t *child );
 static int show_inputs( char *command, obecli_command_t *child );
 static int show_muxers( char *command, obecli_command_t *child );
 static int show_outputs( char *command, obecli_command_t *child );
+static int show_stats( char *command, obecli_command_t *child );
 
 static int start_encode( char *command, obecli_command_t *child );
 static int stop_encode( char *command, obecli_command_t *child );
 
+static int update_stream( char *command, obecli_command_t *child );
+
+static int trace_start( char *command, obecli_command_t *child );
+static int trace_stop( char *command, obecli_command_t *child );
+static int trace_dump( char *command, obecli_command_t *child );
+
 struct obecli_command_t
 {
     char *name;
@@ -117,6 +127,7 @@ static obecli_command_t show_commands[] =
     { "inputs",   "",  "Show supported inputs",      show_inputs,   NULL },
     { "muxers",   "",  "Show supported muxers",      show_muxers,   NULL },
     { "outputs",  "",  "Show supported outputs",     show_outputs,  NULL },
+    { "stats",    "",  "Show encoder statistics",    show_stats,    NULL },
     { 0 }
 };
 
@@ -127,7 +138,24 @@ static obecli_command_t set_commands[] =
     { "stream", "opts streamid:[opts]",   "Set stream options",             set_stream, NULL },
     { "muxer",  "[name] OR opts [opts]",  "Set muxer name or muxer opts",   set_muxer,  NULL },
     { "mux",    "[name] OR opts [opts]",  "Set muxer name or muxer opts",   set_muxer,  NULL },
-    { "output", "[name] OR opts [opts]",  "Set output name or output opts", set_output, NULL },
+    { "outputs", "[num]",                 "Set number of outputs",          set_outputs, NULL },
+    { "renditions", "[num]",              "Set number of video renditions", set_renditions, NULL },
+    { "audio-streams", "[num]",           "Set number of audio streams",    set_audio_streams, NULL },
+    { "output", "[outputid:][name] OR opts [outputid:][opts]", "Set output name or output opts", set_output, NULL },
+    { 0 }
+};
+
+static obecli_command_t trace_commands[] =
+{
+    { "start", "",       "Start recording trace events",        trace_start, NULL },
+    { "stop",  "",       "Stop recording trace events",         trace_stop,  NULL },
+    { "dump",  "[file]", "Write the trace as Chrome trace JSON", trace_dump,  NULL },
+    { 0 }
+};
+
+static obecli_command_t update_commands[] =
+{
+    { "stream", "[streamid]", "Apply the stream options while encoding", update_stream, NULL },
     { 0 }
 };
 
@@ -135,11 +163,13 @@ static obecli_command_t main_commands[] =
 {
     //{ "add",   "[item] ...", "Add stream",             parse_command, add_commands },
     { "help",  "[item] ...", "Display help",             show_help,     NULL },
-    { "probe", "[input]",    "Probe input",              probe_device,  NULL },
+    { "probe", "[input|backup]", "Probe input or a backup for it", probe_device,  NULL },
     { "set",   "[item] ...", "Set item",                 parse_command, set_commands },
     { "show",  "[item] ...", "Show item",                parse_command, show_commands },
     { "start", "",           "Start encoding",           start_encode,  NULL },
     { "stop",  "",           "Stop encoding",            stop_encode,   NULL },
+    { "trace", "[item] ...", "Record a timeline trace",  parse_command, trace_commands },
+    { "update", "[item] ...", "Update item while encoding", parse_command, update_commands },
     { 0 }
 };
 
@@ -150,6 +180,7 @@ static const obecli_input_name_t input_names[] =
     { INPUT_URL,             "URL",      "URL (includes UDP and RTP)",             "libavformat" },
     { INPUT_DEVICE_DECKLINK, "Decklink", "Blackmagic Design Decklink input",       "internal" },
     { INPUT_DEVICE_DECKLINK, "Linsys SDI", "Linear Systems (DVEO) SDI card input", "internal" },
+    { INPUT_FILE,            "File",     "Raw video and audio file replay",        "internal" },
     { 0, 0, 0 },
 };
 
@@ -159,6 +190,7 @@ static const obecli_format_name_t format_names[] =
     { VIDEO_UNCOMPRESSED, "RAW", "Uncompressed Video",    "N/A",                       "N/A" },
     { VIDEO_AVC,    "AVC",       "Advanced Video Coding", "FFmpeg AVC decoder",        "x264 encoder" },
     { VIDEO_MPEG2,  "MPEG-2",    "MPEG-2 Video",          "FFmpeg MPEG-2 decoder",     "N/A" },
+    { VIDEO_HEVC,   "HEVC",      "High Efficiency Video Coding", "N/A",                "x265 encoder" },
     { AUDIO_PCM,    "PCM",       "PCM (raw audio)",       "N/A",                       "N/A" },
     { AUDIO_MP2,    "MP2",       "MPEG-1 Layer II Audio", "FFmpeg MP2 audio decoder",  "twolame encoder" },
     { AUDIO_AC_3,   "AC3",       "ATSC A/52B / AC-3",     "FFmpeg AC-3 audio decoder", "FFmpeg AC-3 encoder" },
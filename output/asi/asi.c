@@ -0,0 +1,517 @@
+/*****************************************************************************
+ * asi.c : Linsys ASI output functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "common/common.h"
+#include "common/linsys/asi.h"
+#include "common/linsys/util.h"
+#include "output/output.h"
+
+#define ASI_DEVICE            "/dev/asitx%u"
+#define ASI_BUFFERS_FILE      "/sys/class/asi/asitx%u/buffers"
+#define ASI_BUFSIZE_FILE      "/sys/class/asi/asitx%u/bufsize"
+#define ASI_MODE_FILE         "/sys/class/asi/asitx%u/mode"
+#define ASI_CLOCK_SOURCE_FILE "/sys/class/asi/asitx%u/clock_source"
+#define ASI_TIMESTAMPS_FILE   "/sys/class/asi/asitx%u/timestamps"
+#define ASI_NULL_PACKETS_FILE "/sys/class/asi/asitx%u/null_packets"
+
+/* The muxed data is written straight into the driver's DMA buffers. They are kept small
+ * because a buffer is only handed over once it is full */
+#define ASI_NUM_BUFFERS     8
+#define ASI_PKTS_PER_BUFFER 32 /* even, so a buffer is a multiple of 8 bytes in either mode */
+#define ASI_STAMP_SIZE      8
+#define ASI_POLL_TIMEOUT    1000
+
+/* ASI runs at 270Mbit/s, 27M 10-bit characters a second. Each packet is followed by two K28.5 */
+#define ASI_CHAR_RATE 27000000
+
+#define TS_PACKET_SIZE 188
+#define NULL_PID       0x1fff
+
+typedef struct
+{
+    obe_output_params_t *output_params;
+    unsigned int card_idx;
+    int fd;
+    unsigned int cap;
+
+    int num_buffers;
+    int buffer_size;
+    int pkt_size;
+    uint8_t **buffers;
+    size_t buffer_mem_size;
+    int cur_buffer;
+    uint8_t *buf_pos; /* NULL when the application doesn't hold a buffer */
+    uint8_t *buf_end;
+
+    /* Stuffing mode. The card's clock sets the rate, so the rate of the stream is matched to it
+     * by adding or removing one null packet per buffer when the driver's queue drifts */
+    int rate_adjust;
+
+    /* Timestamp mode. Every packet carries the card's 27MHz count it leaves at */
+    int timestamps;
+    int64_t start_pcr;
+    int64_t start_mpeg;
+    int64_t min_preroll;
+    obe_output_jitter_t jitter;
+    unsigned int last_count;
+    int64_t count_base;
+    int64_t clock_offset; /* card count minus input clock */
+    int clock_offset_init;
+
+    obe_muxed_data_t **muxed_data;
+} obe_asi_ctx;
+
+static const uint8_t null_packet[TS_PACKET_SIZE] = { 0x47, NULL_PID >> 8, NULL_PID & 0xff, 0x10 };
+
+static ssize_t write_ul_sysfs( const char *fmt, unsigned int card_idx, unsigned int val )
+{
+    char filename[256], data[32];
+
+    snprintf( filename, sizeof(filename), fmt, card_idx );
+    snprintf( data, sizeof(data), "%u\n", val );
+
+    return util_write( filename, data, strlen( data ) + 1 );
+}
+
+/* Stuffing that brings the line down to muxrate. The fractional part of the interpacket stuffing
+ * is made up by sending some packets with one more K28.5 (finetuning) */
+static int set_stuffing( obe_asi_ctx *asi, int muxrate )
+{
+    struct asi_txstuffing stuffing = {0};
+    const int64_t chars = (int64_t)ASI_CHAR_RATE * TS_PACKET_SIZE * 8;
+    int64_t rem, best_err = -1;
+    int best_d = 1, best_b = 0;
+
+    if( chars / muxrate < TS_PACKET_SIZE + 2 )
+    {
+        fprintf( stderr, "[linsys-asi] Mux rate %i is too high for ASI\n", muxrate );
+        return -1;
+    }
+
+    stuffing.ip = chars / muxrate - TS_PACKET_SIZE - 2;
+    rem = chars % muxrate;
+
+    if( rem && ( asi->cap & ASI_CAP_TX_FINETUNING ) )
+    {
+        /* Closest b/d to rem/muxrate */
+        for( int d = 1; d <= 256; d++ )
+        {
+            int b = ( rem * d + muxrate / 2 ) / muxrate;
+            int64_t err = llabs( rem * d - (int64_t)b * muxrate );
+            if( best_err < 0 || err * best_d < best_err * d )
+            {
+                best_err = err;
+                best_d = d;
+                best_b = b;
+            }
+        }
+
+        if( best_b == best_d )
+        {
+            stuffing.ip++;
+            best_b = 0;
+        }
+    }
+
+    stuffing.normal_ip = best_d - best_b;
+    stuffing.big_ip = best_b;
+
+    if( ioctl( asi->fd, ASI_IOC_TXSETSTUFFING, &stuffing ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] Could not set stuffing: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The counter is 32 bits and wraps every 159 seconds, which is far longer than a buffer lasts */
+static int read_card_clock( obe_asi_ctx *asi, int64_t *count )
+{
+    unsigned int val;
+
+    if( ioctl( asi->fd, ASI_IOC_TXGET27COUNT, &val ) < 0 )
+    {
+        syslog( LOG_ERR, "[linsys-asi] Could not read the 27MHz counter: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    if( val < asi->last_count )
+        asi->count_base += 1LL << 32;
+    asi->last_count = val;
+    *count = asi->count_base + val;
+
+    return 0;
+}
+
+static void handle_events( obe_asi_ctx *asi )
+{
+    unsigned int val;
+
+    if( ioctl( asi->fd, ASI_IOC_TXGETEVENTS, &val ) < 0 )
+    {
+        syslog( LOG_WARNING, "[linsys-asi] could not ASI_IOC_TXGETEVENTS %s", strerror( errno ) );
+        return;
+    }
+
+    if( val & ASI_EVENT_TX_BUFFER )
+        syslog( LOG_WARNING, "[linsys-asi] driver transmit buffer queue underrun \n" );
+    if( val & ASI_EVENT_TX_FIFO )
+        syslog( LOG_WARNING, "[linsys-asi] onboard transmit FIFO underrun \n" );
+    if( val & ASI_EVENT_TX_DATA )
+        syslog( LOG_WARNING, "[linsys-asi] transmit data status change \n" );
+}
+
+/* Blocks until the card has finished with the next buffer. This is the only pacing there is */
+static int get_buffer( obe_t *h, obe_asi_ctx *asi )
+{
+    struct pollfd pfd;
+
+    pfd.fd = asi->fd;
+    pfd.events = POLLOUT | POLLPRI;
+
+    while( 1 )
+    {
+        int ret = poll( &pfd, 1, ASI_POLL_TIMEOUT );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            syslog( LOG_ERR, "[linsys-asi] couldn't poll(): %s", strerror( errno ) );
+            return -1;
+        }
+        else if( !ret )
+        {
+            syslog( LOG_WARNING, "[linsys-asi] card has stopped taking data\n" );
+            continue;
+        }
+
+        if( pfd.revents & POLLPRI )
+            handle_events( asi );
+
+        if( pfd.revents & POLLOUT )
+            break;
+    }
+
+    if( ioctl( asi->fd, ASI_IOC_DQBUF, asi->cur_buffer ) < 0 )
+    {
+        syslog( LOG_ERR, "[linsys-asi] couldn't ASI_IOC_DQBUF %s", strerror( errno ) );
+        return -1;
+    }
+
+    asi->buf_pos = asi->buffers[asi->cur_buffer];
+    asi->buf_end = asi->buf_pos + asi->buffer_size;
+
+    if( asi->timestamps )
+    {
+        int64_t count, offset;
+
+        if( read_card_clock( asi, &count ) < 0 )
+            return -1;
+
+        offset = count - get_input_clock_in_mpeg_ticks( h );
+        if( !asi->clock_offset_init )
+        {
+            asi->clock_offset = offset;
+            asi->clock_offset_init = 1;
+        }
+        else
+            asi->clock_offset += ( offset - asi->clock_offset ) >> 4;
+    }
+    else
+    {
+        unsigned int level;
+
+        if( ioctl( asi->fd, ASI_IOC_TXGETBUFLEVEL, &level ) < 0 )
+            level = asi->num_buffers / 2;
+
+        if( level < asi->num_buffers / 4 )
+            asi->rate_adjust = 1;
+        else if( level > asi->num_buffers * 3 / 4 )
+            asi->rate_adjust = -1;
+        else
+            asi->rate_adjust = 0;
+    }
+
+    return 0;
+}
+
+static int queue_buffer( obe_asi_ctx *asi )
+{
+    if( ioctl( asi->fd, ASI_IOC_QBUF, asi->cur_buffer ) < 0 )
+    {
+        syslog( LOG_ERR, "[linsys-asi] couldn't ASI_IOC_QBUF %s", strerror( errno ) );
+        return -1;
+    }
+
+    asi->cur_buffer = ( asi->cur_buffer + 1 ) % asi->num_buffers;
+    asi->buf_pos = NULL;
+
+    return 0;
+}
+
+static int write_packet( obe_t *h, obe_asi_ctx *asi, const uint8_t *pkt, int64_t pcr )
+{
+    if( !asi->buf_pos && get_buffer( h, asi ) < 0 )
+        return -1;
+
+    if( asi->timestamps )
+    {
+        int64_t preroll = MAX( asi->jitter.preroll, asi->min_preroll );
+        uint64_t stamp = pcr - asi->start_pcr + asi->start_mpeg + preroll + asi->clock_offset;
+
+        /* Little-endian 27MHz count */
+        for( int i = 0; i < ASI_STAMP_SIZE; i++ )
+            asi->buf_pos[i] = stamp >> (8*i);
+        asi->buf_pos += ASI_STAMP_SIZE;
+    }
+    else if( asi->rate_adjust > 0 )
+    {
+        asi->rate_adjust = 0;
+        memcpy( asi->buf_pos, null_packet, TS_PACKET_SIZE );
+        asi->buf_pos += TS_PACKET_SIZE;
+        if( asi->buf_pos == asi->buf_end && queue_buffer( asi ) < 0 )
+            return -1;
+        return write_packet( h, asi, pkt, pcr );
+    }
+    else if( asi->rate_adjust < 0 && ( ( pkt[1] << 8 ) | pkt[2] ) == NULL_PID )
+    {
+        asi->rate_adjust = 0;
+        return 0;
+    }
+
+    memcpy( asi->buf_pos, pkt, TS_PACKET_SIZE );
+    asi->buf_pos += TS_PACKET_SIZE;
+
+    if( asi->buf_pos == asi->buf_end )
+        return queue_buffer( asi );
+
+    return 0;
+}
+
+static void close_output( void *handle )
+{
+    obe_asi_ctx *asi = handle;
+
+    if( asi->buffers )
+    {
+        for( int i = 0; i < asi->num_buffers; i++ )
+        {
+            if( asi->buffers[i] && asi->buffers[i] != MAP_FAILED )
+                munmap( asi->buffers[i], asi->buffer_mem_size );
+        }
+        free( asi->buffers );
+    }
+    if( asi->fd >= 0 )
+        close( asi->fd );
+    if( asi->muxed_data )
+        free( asi->muxed_data );
+    if( asi->output_params->output_dst.target )
+        free( asi->output_params->output_dst.target );
+    free( asi->output_params );
+}
+
+static int open_card( obe_t *h, obe_asi_ctx *asi )
+{
+    char dev[256];
+    long page_size = sysconf( _SC_PAGESIZE );
+
+    asi->num_buffers = ASI_NUM_BUFFERS;
+
+    if( write_ul_sysfs( ASI_MODE_FILE, asi->card_idx, ASI_CTL_TX_MODE_188 ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] could not write ASI_CTL_TX_MODE_188\n" );
+        return -1;
+    }
+
+    if( write_ul_sysfs( ASI_CLOCK_SOURCE_FILE, asi->card_idx, ASI_CTL_TX_CLKSRC_ONBOARD ) < 0 )
+        syslog( LOG_WARNING, "[linsys-asi] could not select the onboard clock\n" );
+
+    /* Capabilities are only known once the device is open, so it is opened once to find them */
+    snprintf( dev, sizeof(dev), ASI_DEVICE, asi->card_idx );
+    if( ( asi->fd = open( dev, O_WRONLY ) ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] couldn't open device %s\n", dev );
+        return -1;
+    }
+
+    if( ioctl( asi->fd, ASI_IOC_TXGETCAP, &asi->cap ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] couldn't get the card's capabilities\n" );
+        return -1;
+    }
+    close( asi->fd );
+    asi->fd = -1;
+
+    asi->timestamps = ( asi->cap & ASI_CAP_TX_PTIMESTAMPS ) && ( asi->cap & ASI_CAP_TX_27COUNTER ) &&
+                      write_ul_sysfs( ASI_TIMESTAMPS_FILE, asi->card_idx, ASI_CTL_TSTAMP_PREPEND ) >= 0;
+    if( !asi->timestamps )
+        write_ul_sysfs( ASI_TIMESTAMPS_FILE, asi->card_idx, ASI_CTL_TSTAMP_NONE );
+
+    /* In timestamp mode the card fills the gaps between packets itself */
+    if( asi->cap & ASI_CAP_TX_NULLPACKETS )
+        write_ul_sysfs( ASI_NULL_PACKETS_FILE, asi->card_idx, asi->timestamps );
+
+    asi->pkt_size = TS_PACKET_SIZE + ( asi->timestamps ? ASI_STAMP_SIZE : 0 );
+    asi->buffer_size = ASI_PKTS_PER_BUFFER * asi->pkt_size;
+
+    if( write_ul_sysfs( ASI_BUFFERS_FILE, asi->card_idx, asi->num_buffers ) < 0 ||
+        write_ul_sysfs( ASI_BUFSIZE_FILE, asi->card_idx, asi->buffer_size ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] could not set up the transmit buffers\n" );
+        return -1;
+    }
+
+    if( ( asi->fd = open( dev, O_WRONLY ) ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] couldn't open device %s\n", dev );
+        return -1;
+    }
+
+    if( !asi->timestamps && set_stuffing( asi, h->mux_opts.ts_muxrate ) < 0 )
+        return -1;
+
+    asi->buffers = calloc( asi->num_buffers, sizeof(*asi->buffers) );
+    if( !asi->buffers )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    asi->buffer_mem_size = ( ( asi->buffer_size + page_size - 1 ) / page_size ) * page_size;
+    for( int i = 0; i < asi->num_buffers; i++ )
+    {
+        if( ( asi->buffers[i] = mmap( NULL, asi->buffer_size, PROT_WRITE, MAP_SHARED,
+                                      asi->fd, i * asi->buffer_mem_size ) ) == MAP_FAILED )
+        {
+            fprintf( stderr, "[linsys-asi] could not mmap transmit buffer %i\n", i );
+            return -1;
+        }
+    }
+
+    /* A packet waits for the rest of its buffer and the buffer waits for the one before it */
+    asi->min_preroll = 2 * (int64_t)ASI_PKTS_PER_BUFFER * TS_PACKET_SIZE * 8 * OBE_CLOCK / h->mux_opts.ts_muxrate;
+
+    return 0;
+}
+
+static void *open_output( void *ptr )
+{
+    obe_output_params_t *output_params = ptr;
+    obe_t *h = output_params->h;
+    obe_output_t *output = output_params->output;
+    obe_asi_ctx asi = {0};
+    int num_muxed_data = 0, num_drops = 0;
+    obe_muxed_data_t **muxed_data;
+    int64_t now;
+
+    asi.output_params = output_params;
+    asi.fd = -1;
+    asi.start_pcr = -1;
+    asi.card_idx = output_params->output_dst.target ? strtoul( output_params->output_dst.target, NULL, 10 ) : 0;
+    pthread_cleanup_push( close_output, (void*)&asi );
+
+    muxed_data = asi.muxed_data = malloc( output->queue.capacity * sizeof(*muxed_data) );
+    if( !muxed_data )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
+
+    /* A card left open stays busy, so every failure goes through close_output */
+    if( open_card( h, &asi ) < 0 )
+    {
+        fprintf( stderr, "[linsys-asi] Could not open card %u\n", asi.card_idx );
+        goto finish;
+    }
+
+    obe_output_jitter_init( &asi.jitter, h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? OUTPUT_PREROLL_LOW_LATENCY : OUTPUT_PREROLL_GENERIC );
+
+    syslog( LOG_INFO, "[linsys-asi] Card %u transmitting in %s mode\n", asi.card_idx, asi.timestamps ? "timestamp" : "stuffing" );
+
+    while( 1 )
+    {
+        num_muxed_data = obe_output_pop_all( output, muxed_data );
+        if( num_muxed_data < 0 )
+            break;
+
+        /* The card keeps its own clock, so only the timestamps need to start again after a drop */
+        pthread_mutex_lock( &h->drop_mutex );
+        if( h->output_drop != num_drops )
+        {
+            syslog( LOG_INFO, "ASI output resync\n" );
+            num_drops = h->output_drop;
+            asi.start_pcr = -1;
+            obe_output_jitter_resync( &asi.jitter );
+        }
+        pthread_mutex_unlock( &h->drop_mutex );
+
+        now = get_input_clock_in_mpeg_ticks( h );
+        for( int i = 0; i < num_muxed_data; i++ )
+        {
+            int num_pkts = muxed_data[i]->len / TS_PACKET_SIZE;
+
+            if( asi.timestamps && num_pkts )
+            {
+                if( asi.start_pcr == -1 )
+                {
+                    asi.start_pcr = muxed_data[i]->pcr_list[0];
+                    asi.start_mpeg = now;
+                }
+                else
+                    obe_output_jitter_update( &asi.jitter, muxed_data[i]->queued_time -
+                                              ( muxed_data[i]->pcr_list[0] - asi.start_pcr + asi.start_mpeg ), now );
+            }
+
+            for( int j = 0; j < num_pkts; j++ )
+            {
+                if( write_packet( h, &asi, &muxed_data[i]->data[j*TS_PACKET_SIZE], muxed_data[i]->pcr_list[j] ) < 0 )
+                {
+                    syslog( LOG_ERR, "[linsys-asi] Failed to write to card %u\n", asi.card_idx );
+                    for( ; i < num_muxed_data; i++ )
+                        destroy_muxed_data( muxed_data[i] );
+                    goto finish;
+                }
+            }
+
+            __atomic_store_n( &output->bytes_sent, output->bytes_sent + num_pkts * TS_PACKET_SIZE, __ATOMIC_RELAXED );
+            obe_latency_record( &output->latency, muxed_data[i]->arrival_time );
+            destroy_muxed_data( muxed_data[i] );
+        }
+    }
+
+finish:
+    pthread_cleanup_pop( 1 );
+
+    return NULL;
+}
+
+const obe_output_func_t linsys_asi_output = { open_output };
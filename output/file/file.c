@@ -0,0 +1,390 @@
+/*****************************************************************************
+ * file.c : file recording output functions
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE /* O_DIRECT */
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <liburing.h>
+#include <libavutil/parseutils.h>
+
+#include "common/common.h"
+#include "output/output.h"
+
+/* The muxed data is copied into a few large buffers from the data pool, which are written
+ * with O_DIRECT through io_uring so the page cache never fills up with recordings and
+ * a slow disk only ever holds up this thread. Pool buffers are page aligned */
+#define RECORD_BUF_SIZE  (1<<20)
+#define RECORD_NUM_BUFS  8
+#define RECORD_ALIGN     4096
+
+typedef struct
+{
+    obe_buf_t *buf;
+    int len;  /* bytes filled */
+    int busy; /* being written */
+} obe_record_buf_t;
+
+typedef struct
+{
+    obe_output_params_t *output_params;
+    char *pattern;
+    int64_t segment_duration; /* 27MHz ticks, 0 records into one file */
+    int direct;
+
+    struct io_uring ring;
+    int ring_init;
+    obe_record_buf_t bufs[RECORD_NUM_BUFS];
+    int cur_buf;
+    int num_busy;
+
+    int fd;
+    int fd_direct;
+    int64_t file_pos; /* bytes submitted to the current file */
+    int64_t segment_start;
+    int segment_num;
+    int open_failed;
+
+    obe_muxed_data_t **muxed_data;
+} obe_record_ctx;
+
+/* Reaps finished writes, waiting for at least one if wait is set */
+static int reap_writes( obe_record_ctx *rec, int wait )
+{
+    struct io_uring_cqe *cqe;
+    int ret = 0;
+
+    while( rec->num_busy )
+    {
+        int err = wait ? io_uring_wait_cqe( &rec->ring, &cqe ) : io_uring_peek_cqe( &rec->ring, &cqe );
+        if( err == -EINTR )
+            continue;
+        else if( err < 0 )
+            break;
+
+        obe_record_buf_t *rb = io_uring_cqe_get_data( cqe );
+        if( cqe->res < 0 )
+        {
+            syslog( LOG_ERR, "[file] Write failed: %s\n", strerror( -cqe->res ) );
+            ret = -1;
+        }
+        else if( cqe->res < rb->len )
+        {
+            syslog( LOG_ERR, "[file] Short write, %i of %i bytes\n", cqe->res, rb->len );
+            ret = -1;
+        }
+
+        rb->busy = 0;
+        rb->len = 0;
+        rec->num_busy--;
+        io_uring_cqe_seen( &rec->ring, cqe );
+        wait = 0;
+    }
+
+    return ret;
+}
+
+/* Writes len bytes of the current buffer at the end of the file and moves on to the next buffer */
+static int submit_buf( obe_record_ctx *rec, int len )
+{
+    obe_record_buf_t *rb = &rec->bufs[rec->cur_buf];
+    struct io_uring_sqe *sqe = io_uring_get_sqe( &rec->ring );
+    int ret = 0;
+
+    /* There are as many entries as buffers so this can't fail */
+    if( !sqe )
+        return -1;
+
+    io_uring_prep_write_fixed( sqe, rec->fd, rb->buf->data, len, rec->file_pos, rec->cur_buf );
+    io_uring_sqe_set_data( sqe, rb );
+    rb->len = len;
+    rb->busy = 1;
+    rec->num_busy++;
+    rec->file_pos += len;
+
+    if( io_uring_submit( &rec->ring ) < 0 )
+    {
+        syslog( LOG_ERR, "[file] Could not submit write\n" );
+        return -1;
+    }
+
+    rec->cur_buf = ( rec->cur_buf + 1 ) % RECORD_NUM_BUFS;
+    if( reap_writes( rec, 0 ) < 0 )
+        ret = -1;
+
+    /* Only here does the disk hold anything up */
+    while( rec->bufs[rec->cur_buf].busy )
+    {
+        if( reap_writes( rec, 1 ) < 0 )
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int open_segment( obe_record_ctx *rec, int64_t pcr )
+{
+    char name[PATH_MAX];
+    struct tm tm;
+    time_t now = time( NULL );
+    int len;
+
+    localtime_r( &now, &tm );
+    len = strftime( name, sizeof(name), rec->pattern, &tm );
+    if( !len )
+    {
+        syslog( LOG_ERR, "[file] Invalid file name\n" );
+        return -1;
+    }
+
+    /* Without a date in the name each segment would overwrite the last */
+    if( rec->segment_duration && !strchr( rec->pattern, '%' ) )
+        snprintf( name + len, sizeof(name) - len, ".%i", rec->segment_num );
+
+    rec->fd_direct = rec->direct;
+    rec->fd = open( name, O_WRONLY | O_CREAT | O_TRUNC | ( rec->fd_direct ? O_DIRECT : 0 ), 0644 );
+    if( rec->fd < 0 && rec->fd_direct && errno == EINVAL )
+    {
+        /* Filesystems such as tmpfs don't do O_DIRECT */
+        rec->fd_direct = 0;
+        rec->fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    }
+
+    if( rec->fd < 0 )
+    {
+        if( !rec->open_failed )
+            syslog( LOG_ERR, "[file] Could not open \"%s\": %s\n", name, strerror( errno ) );
+        rec->open_failed = 1;
+        return -1;
+    }
+
+    syslog( LOG_INFO, "[file] Recording to \"%s\"\n", name );
+    rec->open_failed = 0;
+    rec->file_pos = 0;
+    rec->segment_start = pcr;
+    rec->segment_num++;
+
+    return 0;
+}
+
+/* The tail is padded out to a whole block for O_DIRECT and the file cut back afterwards */
+static int close_segment( obe_record_ctx *rec )
+{
+    obe_record_buf_t *rb = &rec->bufs[rec->cur_buf];
+    int64_t size = rec->file_pos + rb->len;
+    int ret = 0;
+
+    if( rb->len )
+    {
+        int len = rec->fd_direct ? FFALIGN( rb->len, RECORD_ALIGN ) : rb->len;
+
+        memset( rb->buf->data + rb->len, 0, len - rb->len );
+        if( submit_buf( rec, len ) < 0 )
+            ret = -1;
+    }
+
+    while( rec->num_busy )
+    {
+        if( reap_writes( rec, 1 ) < 0 )
+            ret = -1;
+    }
+
+    if( rec->fd_direct && ftruncate( rec->fd, size ) < 0 )
+        ret = -1;
+
+    close( rec->fd );
+    rec->fd = -1;
+
+    return ret;
+}
+
+static int write_data( obe_record_ctx *rec, const uint8_t *data, int len )
+{
+    int ret = 0;
+
+    while( len )
+    {
+        obe_record_buf_t *rb = &rec->bufs[rec->cur_buf];
+        int n = MIN( len, RECORD_BUF_SIZE - rb->len );
+
+        memcpy( rb->buf->data + rb->len, data, n );
+        rb->len += n;
+        data += n;
+        len -= n;
+
+        if( rb->len == RECORD_BUF_SIZE && submit_buf( rec, RECORD_BUF_SIZE ) < 0 )
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static void close_output( void *handle )
+{
+    obe_record_ctx *rec = handle;
+
+    /* Only left open when the thread was cancelled, a normal stop has already finished the segment */
+    if( rec->fd >= 0 )
+        close_segment( rec );
+    if( rec->ring_init )
+    {
+        io_uring_unregister_buffers( &rec->ring );
+        io_uring_queue_exit( &rec->ring );
+    }
+    for( int i = 0; i < RECORD_NUM_BUFS; i++ )
+    {
+        if( rec->bufs[i].buf )
+            obe_buf_unref( rec->bufs[i].buf );
+    }
+    if( rec->pattern )
+        free( rec->pattern );
+    if( rec->muxed_data )
+        free( rec->muxed_data );
+    if( rec->output_params->output_dst.target )
+        free( rec->output_params->output_dst.target );
+    free( rec->output_params );
+}
+
+/* target is a strftime pattern for the file names with options after a '?'
+ * segment - length of each file in seconds. 0 (default) records one file */
+static int open_recorder( obe_t *h, obe_record_ctx *rec, const char *target )
+{
+    struct iovec iovs[RECORD_NUM_BUFS];
+    const char *p = strchr( target, '?' );
+    char buf[256];
+
+    rec->pattern = p ? strndup( target, p - target ) : strdup( target );
+    if( !rec->pattern )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    if( p && av_find_info_tag( buf, sizeof(buf), "segment", p ) )
+        rec->segment_duration = strtol( buf, NULL, 10 ) * OBE_CLOCK;
+
+    rec->direct = 1;
+    for( int i = 0; i < RECORD_NUM_BUFS; i++ )
+    {
+        rec->bufs[i].buf = obe_buf_get( &h->buf_pool, RECORD_BUF_SIZE );
+        if( !rec->bufs[i].buf )
+            return -1;
+        /* A buffer from the heap when the pool is exhausted won't be aligned */
+        if( (intptr_t)rec->bufs[i].buf->data & (RECORD_ALIGN-1) )
+            rec->direct = 0;
+        iovs[i].iov_base = rec->bufs[i].buf->data;
+        iovs[i].iov_len = RECORD_BUF_SIZE;
+    }
+
+    if( io_uring_queue_init( RECORD_NUM_BUFS, &rec->ring, 0 ) < 0 )
+    {
+        fprintf( stderr, "[file] Could not set up io_uring\n" );
+        return -1;
+    }
+    rec->ring_init = 1;
+
+    if( io_uring_register_buffers( &rec->ring, iovs, RECORD_NUM_BUFS ) < 0 )
+    {
+        fprintf( stderr, "[file] Could not register buffers\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *open_output( void *ptr )
+{
+    obe_output_params_t *output_params = ptr;
+    obe_t *h = output_params->h;
+    obe_output_t *output = output_params->output;
+    obe_record_ctx rec = {0};
+    int num_muxed_data = 0;
+    obe_muxed_data_t **muxed_data;
+
+    /* Unlike the network outputs this runs at normal priority unless told otherwise. Nothing waits on it */
+    if( h->thread_opts[OBE_THREAD_OUTPUT].policy == OBE_SCHED_DEFAULT )
+    {
+        struct sched_param param = {0};
+        pthread_setschedparam( pthread_self(), SCHED_OTHER, &param );
+    }
+
+    rec.output_params = output_params;
+    rec.fd = -1;
+    rec.segment_start = -1;
+    pthread_cleanup_push( close_output, (void*)&rec );
+
+    muxed_data = rec.muxed_data = malloc( output->queue.capacity * sizeof(*muxed_data) );
+    if( !muxed_data )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
+
+    if( open_recorder( h, &rec, output_params->output_dst.target ) < 0 )
+    {
+        fprintf( stderr, "[file] Could not create output\n" );
+        goto finish;
+    }
+
+    while( 1 )
+    {
+        num_muxed_data = obe_output_pop_all( output, muxed_data );
+        if( num_muxed_data < 0 )
+            break;
+
+        for( int i = 0; i < num_muxed_data; i++ )
+        {
+            int64_t pcr = muxed_data[i]->len ? muxed_data[i]->pcr_list[0] : rec.segment_start;
+
+            if( rec.fd >= 0 && rec.segment_duration && pcr - rec.segment_start >= rec.segment_duration &&
+                close_segment( &rec ) < 0 )
+                syslog( LOG_ERR, "[file] Segment %i is incomplete\n", rec.segment_num );
+
+            /* After a failure the next data starts a new file */
+            if( rec.fd < 0 )
+                open_segment( &rec, pcr );
+
+            if( rec.fd >= 0 && write_data( &rec, muxed_data[i]->data, muxed_data[i]->len ) < 0 )
+            {
+                syslog( LOG_ERR, "[file] Segment %i is incomplete\n", rec.segment_num );
+                close_segment( &rec );
+            }
+
+            __atomic_store_n( &output->bytes_sent, output->bytes_sent + muxed_data[i]->len, __ATOMIC_RELAXED );
+            obe_latency_record( &output->latency, muxed_data[i]->arrival_time );
+            destroy_muxed_data( muxed_data[i] );
+        }
+    }
+
+    /* The last buffer is written out and the O_DIRECT padding cut off before the file is closed */
+    if( rec.fd >= 0 && close_segment( &rec ) < 0 )
+        syslog( LOG_ERR, "[file] Segment %i is incomplete\n", rec.segment_num );
+
+finish:
+    pthread_cleanup_pop( 1 );
+
+    return NULL;
+}
+
+const obe_output_func_t file_output = { open_output };
@@ -0,0 +1,745 @@
+/*****************************************************************************
+ * hls.c : HLS segmenter output
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <libavutil/parseutils.h>
+
+#include "common/common.h"
+#include "output/output.h"
+
+/* The transport stream is cut in front of the packet that starts each video random access point once
+ * a segment is long enough. Segments are copied once into a ring and are served, or written out,
+ * straight from there. Readers never lock the data, they check afterwards that the writer hasn't
+ * lapped what they sent */
+#define HLS_MAX_SEGMENTS 32
+#define HLS_MAX_CLIENTS  16
+#define HLS_SEND_SIZE    (64*1024)
+#define HLS_PLAYLIST     "index.m3u8"
+
+#define TS_PACKET_SIZE 188
+/* The most one ring_write adds, which can be part way through its copy when a reader looks at written */
+#define HLS_MAX_WRITE  TS_PACKET_SIZE
+
+typedef struct
+{
+    int64_t num;      /* media sequence number */
+    int64_t start;    /* position in the ring, counted from the first byte ever written */
+    int64_t len;
+    int64_t duration; /* 27MHz ticks */
+} obe_hls_segment_t;
+
+typedef struct
+{
+    int fd;
+    char req[1024];
+    int req_len;
+
+    /* Headers, and the playlist body which is small enough to copy */
+    char buf[4096];
+    int buf_len;
+    int buf_pos;
+
+    /* Segment data still to be sent from the ring */
+    int64_t pos;
+    int64_t end;
+} obe_hls_client_t;
+
+typedef struct
+{
+    obe_output_params_t *output_params;
+    char *dir;
+    int64_t target_duration;
+    int window;
+    int port;
+
+    uint8_t *ring;
+    int64_t ring_size;
+    int64_t written;
+
+    /* Finished segments, oldest first. The playlist lists the newest window of them,
+     * the older ones stay around for clients that are still fetching */
+    pthread_mutex_t mutex;
+    int mutex_init;
+    obe_hls_segment_t segments[HLS_MAX_SEGMENTS];
+    int num_segments;
+    char playlist[4096 - 256];
+    int playlist_len;
+
+    /* Segment being written */
+    int64_t cur_num;
+    int64_t cur_start;
+    int64_t cur_pcr;
+    int64_t last_pcr;
+    int started;
+
+    /* Every segment starts with the latest PAT and PMT so it decodes on its own */
+    uint8_t pat[TS_PACKET_SIZE];
+    uint8_t pmt[TS_PACKET_SIZE];
+    int have_pat;
+    int have_pmt;
+    int pmt_pid;
+    int video_pid;
+
+    obe_muxed_data_t **muxed_data;
+
+    int listen_fd;
+    pthread_t http_thread;
+    int http_running;
+    obe_hls_client_t clients[HLS_MAX_CLIENTS];
+} obe_hls_ctx;
+
+/**** Transport stream ****/
+
+static int ts_pid( const uint8_t *pkt )
+{
+    return ( ( pkt[1] & 0x1f ) << 8 ) | pkt[2];
+}
+
+/* Returns the start of the section in a packet starting one, or NULL */
+static const uint8_t *ts_section( const uint8_t *pkt, int *section_length )
+{
+    const uint8_t *p = pkt + 4;
+
+    if( pkt[0] != 0x47 || !( pkt[1] & 0x40 ) || !( pkt[3] & 0x10 ) )
+        return NULL;
+
+    if( pkt[3] & 0x20 )
+        p += 1 + p[0];
+    if( p >= pkt + TS_PACKET_SIZE - 1 )
+        return NULL;
+    p += 1 + p[0]; /* pointer_field */
+
+    /* Tables used here are small enough to fit in one packet */
+    if( p + 3 > pkt + TS_PACKET_SIZE )
+        return NULL;
+    *section_length = ( ( p[1] & 0x0f ) << 8 ) | p[2];
+    if( *section_length < 9 || p + 3 + *section_length > pkt + TS_PACKET_SIZE )
+        return NULL;
+
+    return p;
+}
+
+static void parse_pat( obe_hls_ctx *hls, const uint8_t *pkt )
+{
+    int section_length;
+    const uint8_t *p = ts_section( pkt, &section_length );
+
+    if( !p || p[0] != 0x00 )
+        return;
+
+    for( const uint8_t *q = p + 8; q + 4 <= p + 3 + section_length - 4; q += 4 )
+    {
+        /* Program 0 is the NIT */
+        if( ( q[0] << 8 | q[1] ) != 0 )
+        {
+            hls->pmt_pid = ( ( q[2] & 0x1f ) << 8 ) | q[3];
+            memcpy( hls->pat, pkt, TS_PACKET_SIZE );
+            hls->have_pat = 1;
+            return;
+        }
+    }
+}
+
+static void parse_pmt( obe_hls_ctx *hls, const uint8_t *pkt )
+{
+    int section_length, program_info_length;
+    const uint8_t *p = ts_section( pkt, &section_length );
+    const uint8_t *end;
+
+    if( !p || p[0] != 0x02 )
+        return;
+
+    end = p + 3 + section_length - 4;
+    program_info_length = ( ( p[10] & 0x0f ) << 8 ) | p[11];
+    for( const uint8_t *q = p + 12 + program_info_length; q + 5 <= end; q += 5 + ( ( ( q[3] & 0x0f ) << 8 ) | q[4] ) )
+    {
+        /* MPEG-2, AVC and HEVC video */
+        if( q[0] == 0x01 || q[0] == 0x02 || q[0] == 0x1b || q[0] == 0x24 )
+        {
+            hls->video_pid = ( ( q[1] & 0x1f ) << 8 ) | q[2];
+            memcpy( hls->pmt, pkt, TS_PACKET_SIZE );
+            hls->have_pmt = 1;
+            return;
+        }
+    }
+}
+
+/* The muxer sets the random_access_indicator on the first packet of every random access point */
+static int is_random_access( const obe_hls_ctx *hls, const uint8_t *pkt )
+{
+    return ts_pid( pkt ) == hls->video_pid && ( pkt[1] & 0x40 ) && ( pkt[3] & 0x20 ) && pkt[4] && ( pkt[5] & 0x40 );
+}
+
+/**** Ring ****/
+
+static void ring_write( obe_hls_ctx *hls, const uint8_t *data, int len )
+{
+    int64_t pos = hls->written % hls->ring_size;
+    int n = MIN( len, hls->ring_size - pos );
+
+    memcpy( hls->ring + pos, data, n );
+    memcpy( hls->ring, data + n, len - n );
+    __atomic_store_n( &hls->written, hls->written + len, __ATOMIC_RELEASE );
+}
+
+/* Data at pos is still what was written there, and stays so through a write in progress */
+static int ring_valid( obe_hls_ctx *hls, int64_t pos )
+{
+    return __atomic_load_n( &hls->written, __ATOMIC_ACQUIRE ) + HLS_MAX_WRITE - hls->ring_size <= pos;
+}
+
+/**** Playlist and files ****/
+
+static int segment_name( char *name, int size, const char *dir, int64_t num )
+{
+    return snprintf( name, size, "%s%ssegment_%"PRIi64".ts", dir ? dir : "", dir ? "/" : "", num );
+}
+
+/* Called with the mutex held */
+static void update_playlist( obe_hls_ctx *hls )
+{
+    int first = MAX( hls->num_segments - hls->window, 0 );
+    int64_t max_duration = OBE_CLOCK;
+    int len;
+
+    for( int i = first; i < hls->num_segments; i++ )
+        max_duration = MAX( max_duration, hls->segments[i].duration );
+
+    len = snprintf( hls->playlist, sizeof(hls->playlist),
+                    "#EXTM3U\n"
+                    "#EXT-X-VERSION:3\n"
+                    "#EXT-X-TARGETDURATION:%"PRIi64"\n"
+                    "#EXT-X-MEDIA-SEQUENCE:%"PRIi64"\n",
+                    (int64_t)( ( max_duration + OBE_CLOCK / 2 ) / OBE_CLOCK ),
+                    hls->num_segments ? hls->segments[first].num : 0 );
+
+    for( int i = first; i < hls->num_segments && len < (int)sizeof(hls->playlist); i++ )
+    {
+        len += snprintf( hls->playlist + len, sizeof(hls->playlist) - len, "#EXTINF:%.3f,\nsegment_%"PRIi64".ts\n",
+                         (double)hls->segments[i].duration / OBE_CLOCK, hls->segments[i].num );
+    }
+
+    hls->playlist_len = MIN( len, (int)sizeof(hls->playlist) - 1 );
+}
+
+static int write_file( obe_hls_ctx *hls, const char *name, const uint8_t *data, int64_t len, int64_t ring_pos )
+{
+    char tmp_name[PATH_MAX];
+    int fd, ret = 0;
+
+    /* Renamed into place so nothing ever fetches a half written file */
+    snprintf( tmp_name, sizeof(tmp_name), "%s.tmp", name );
+    fd = open( tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+    {
+        syslog( LOG_ERR, "[hls] Could not open \"%s\": %s\n", tmp_name, strerror( errno ) );
+        return -1;
+    }
+
+    while( len && !ret )
+    {
+        int64_t n = len;
+        const uint8_t *p = data;
+
+        if( !data )
+        {
+            int64_t pos = ring_pos % hls->ring_size;
+            n = MIN( len, hls->ring_size - pos );
+            p = hls->ring + pos;
+        }
+
+        if( write( fd, p, n ) != n )
+            ret = -1;
+        len -= n;
+        ring_pos += n;
+    }
+
+    if( close( fd ) < 0 || ret < 0 || rename( tmp_name, name ) < 0 )
+    {
+        syslog( LOG_ERR, "[hls] Could not write \"%s\"\n", name );
+        unlink( tmp_name );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void finish_segment( obe_hls_ctx *hls, int64_t pcr )
+{
+    obe_hls_segment_t *seg;
+    char name[PATH_MAX];
+    int64_t dropped[HLS_MAX_SEGMENTS+1];
+    int num_dropped = 0;
+
+    if( hls->dir )
+    {
+        segment_name( name, sizeof(name), hls->dir, hls->cur_num );
+        write_file( hls, name, NULL, hls->written - hls->cur_start, hls->cur_start );
+    }
+
+    pthread_mutex_lock( &hls->mutex );
+    /* A window of segments stays after the playlist one for clients still fetching.
+     * open_segmenter keeps 2 * window within HLS_MAX_SEGMENTS */
+    while( hls->num_segments >= 2 * hls->window )
+    {
+        dropped[num_dropped++] = hls->segments[0].num;
+        memmove( &hls->segments[0], &hls->segments[1], --hls->num_segments * sizeof(*hls->segments) );
+    }
+
+    seg = &hls->segments[hls->num_segments++];
+    seg->num = hls->cur_num;
+    seg->start = hls->cur_start;
+    seg->len = hls->written - hls->cur_start;
+    seg->duration = pcr - hls->cur_pcr;
+
+    /* Segments the ring has lapped can't be served any more */
+    while( hls->num_segments && !ring_valid( hls, hls->segments[0].start ) )
+    {
+        dropped[num_dropped++] = hls->segments[0].num;
+        memmove( &hls->segments[0], &hls->segments[1], --hls->num_segments * sizeof(*hls->segments) );
+    }
+
+    update_playlist( hls );
+    pthread_mutex_unlock( &hls->mutex );
+
+    if( hls->dir )
+    {
+        snprintf( name, sizeof(name), "%s/"HLS_PLAYLIST, hls->dir );
+        write_file( hls, name, (uint8_t*)hls->playlist, hls->playlist_len, 0 );
+
+        /* Files go a while after they leave the playlist, the same as segments in memory */
+        for( int i = 0; i < num_dropped; i++ )
+        {
+            segment_name( name, sizeof(name), hls->dir, dropped[i] );
+            unlink( name );
+        }
+    }
+}
+
+static void write_packet( obe_hls_ctx *hls, const uint8_t *pkt, int64_t pcr )
+{
+    int pid = ts_pid( pkt );
+
+    if( pid == 0 )
+        parse_pat( hls, pkt );
+    else if( hls->have_pat && pid == hls->pmt_pid )
+        parse_pmt( hls, pkt );
+
+    if( hls->have_pmt && is_random_access( hls, pkt ) && ( !hls->started || pcr - hls->cur_pcr >= hls->target_duration ) )
+    {
+        if( hls->started )
+            finish_segment( hls, pcr );
+
+        hls->started = 1;
+        hls->cur_num++;
+        hls->cur_start = hls->written;
+        hls->cur_pcr = pcr;
+        ring_write( hls, hls->pat, TS_PACKET_SIZE );
+        ring_write( hls, hls->pmt, TS_PACKET_SIZE );
+    }
+
+    /* Nothing before the first random access point is any use */
+    if( hls->started )
+        ring_write( hls, pkt, TS_PACKET_SIZE );
+    hls->last_pcr = pcr;
+}
+
+/**** HTTP ****/
+
+static void close_client( obe_hls_client_t *client )
+{
+    close( client->fd );
+    client->fd = -1;
+}
+
+static void start_response( obe_hls_ctx *hls, obe_hls_client_t *client )
+{
+    char path[256];
+    int64_t num;
+    char c;
+
+    client->buf_pos = 0;
+    client->pos = client->end = 0;
+
+    if( sscanf( client->req, "GET %255s", path ) != 1 )
+    {
+        client->buf_len = snprintf( client->buf, sizeof(client->buf), "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" );
+        return;
+    }
+
+    pthread_mutex_lock( &hls->mutex );
+    if( !strcmp( path, "/"HLS_PLAYLIST ) && hls->num_segments )
+    {
+        client->buf_len = snprintf( client->buf, sizeof(client->buf),
+                                    "HTTP/1.1 200 OK\r\n"
+                                    "Content-Type: application/vnd.apple.mpegurl\r\n"
+                                    "Content-Length: %i\r\n"
+                                    "Cache-Control: no-cache\r\n"
+                                    "Connection: close\r\n\r\n", hls->playlist_len );
+        memcpy( client->buf + client->buf_len, hls->playlist, hls->playlist_len );
+        client->buf_len += hls->playlist_len;
+        pthread_mutex_unlock( &hls->mutex );
+        return;
+    }
+
+    if( sscanf( path, "/segment_%"SCNi64".t%c", &num, &c ) == 2 && c == 's' )
+    {
+        for( int i = 0; i < hls->num_segments; i++ )
+        {
+            if( hls->segments[i].num == num && ring_valid( hls, hls->segments[i].start ) )
+            {
+                client->pos = hls->segments[i].start;
+                client->end = client->pos + hls->segments[i].len;
+                client->buf_len = snprintf( client->buf, sizeof(client->buf),
+                                            "HTTP/1.1 200 OK\r\n"
+                                            "Content-Type: video/mp2t\r\n"
+                                            "Content-Length: %"PRIi64"\r\n"
+                                            "Connection: close\r\n\r\n", hls->segments[i].len );
+                pthread_mutex_unlock( &hls->mutex );
+                return;
+            }
+        }
+    }
+    pthread_mutex_unlock( &hls->mutex );
+
+    client->buf_len = snprintf( client->buf, sizeof(client->buf), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" );
+}
+
+/* Returns -1 once the client is finished with, successfully or not */
+static int client_read( obe_hls_ctx *hls, obe_hls_client_t *client )
+{
+    int ret = recv( client->fd, client->req + client->req_len, sizeof(client->req) - 1 - client->req_len, MSG_DONTWAIT );
+
+    if( ret < 0 && ( errno == EAGAIN || errno == EINTR ) )
+        return 0;
+    else if( ret <= 0 )
+        return -1;
+
+    client->req_len += ret;
+    client->req[client->req_len] = 0;
+
+    if( strstr( client->req, "\r\n\r\n" ) )
+        start_response( hls, client );
+    else if( client->req_len == sizeof(client->req) - 1 )
+        return -1;
+
+    return 0;
+}
+
+static int client_write( obe_hls_ctx *hls, obe_hls_client_t *client )
+{
+    int ret;
+
+    if( client->buf_pos < client->buf_len )
+    {
+        ret = send( client->fd, client->buf + client->buf_pos, client->buf_len - client->buf_pos, MSG_DONTWAIT | MSG_NOSIGNAL );
+        if( ret < 0 )
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        client->buf_pos += ret;
+        return 0;
+    }
+
+    if( client->pos < client->end )
+    {
+        int64_t pos = client->pos % hls->ring_size;
+        int64_t n = MIN( MIN( client->end - client->pos, hls->ring_size - pos ), HLS_SEND_SIZE );
+
+        if( !ring_valid( hls, client->pos ) )
+            return -1;
+        ret = send( client->fd, hls->ring + pos, n, MSG_DONTWAIT | MSG_NOSIGNAL );
+        if( ret < 0 )
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+        /* The writer got there during the send so the client has been given garbage */
+        if( !ring_valid( hls, client->pos ) )
+        {
+            syslog( LOG_WARNING, "[hls] Client too slow, segment overwritten\n" );
+            return -1;
+        }
+        client->pos += ret;
+        return 0;
+    }
+
+    return -1;
+}
+
+static void http_cleanup( void *ptr )
+{
+    obe_hls_ctx *hls = ptr;
+
+    for( int i = 0; i < HLS_MAX_CLIENTS; i++ )
+    {
+        if( hls->clients[i].fd >= 0 )
+            close_client( &hls->clients[i] );
+    }
+}
+
+static void *http_thread( void *ptr )
+{
+    obe_hls_ctx *hls = ptr;
+    struct pollfd fds[HLS_MAX_CLIENTS+1];
+    int idx[HLS_MAX_CLIENTS+1];
+
+    pthread_cleanup_push( http_cleanup, hls );
+
+    while( 1 )
+    {
+        int num_fds = 1;
+
+        fds[0].fd = hls->listen_fd;
+        fds[0].events = POLLIN;
+        for( int i = 0; i < HLS_MAX_CLIENTS; i++ )
+        {
+            obe_hls_client_t *client = &hls->clients[i];
+            if( client->fd < 0 )
+                continue;
+            fds[num_fds].fd = client->fd;
+            fds[num_fds].events = client->buf_len ? POLLOUT : POLLIN;
+            idx[num_fds++] = i;
+        }
+
+        if( poll( fds, num_fds, -1 ) < 0 )
+            continue;
+
+        for( int i = 1; i < num_fds; i++ )
+        {
+            obe_hls_client_t *client = &hls->clients[idx[i]];
+
+            if( fds[i].revents & ( POLLERR | POLLHUP | POLLNVAL ) )
+                close_client( client );
+            else if( ( fds[i].revents & POLLIN ) && client_read( hls, client ) < 0 )
+                close_client( client );
+            else if( ( fds[i].revents & POLLOUT ) && client_write( hls, client ) < 0 )
+                close_client( client );
+        }
+
+        if( fds[0].revents & POLLIN )
+        {
+            int fd = accept( hls->listen_fd, NULL, NULL );
+            int i;
+
+            if( fd < 0 )
+                continue;
+
+            for( i = 0; i < HLS_MAX_CLIENTS && hls->clients[i].fd >= 0; i++ )
+                ;
+            if( i == HLS_MAX_CLIENTS )
+            {
+                close( fd );
+                continue;
+            }
+
+            memset( &hls->clients[i], 0, sizeof(hls->clients[i]) );
+            hls->clients[i].fd = fd;
+        }
+    }
+
+    pthread_cleanup_pop( 1 );
+
+    return NULL;
+}
+
+static int open_http( obe_hls_ctx *hls )
+{
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons( hls->port ), .sin6_addr = IN6ADDR_ANY_INIT };
+    int on = 1;
+
+    hls->listen_fd = socket( AF_INET6, SOCK_STREAM, 0 );
+    if( hls->listen_fd < 0 )
+    {
+        fprintf( stderr, "[hls] Could not create socket\n" );
+        return -1;
+    }
+
+    setsockopt( hls->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+    if( bind( hls->listen_fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 || listen( hls->listen_fd, HLS_MAX_CLIENTS ) < 0 )
+    {
+        fprintf( stderr, "[hls] Could not listen on port %i\n", hls->port );
+        return -1;
+    }
+
+    for( int i = 0; i < HLS_MAX_CLIENTS; i++ )
+        hls->clients[i].fd = -1;
+
+    if( pthread_create( &hls->http_thread, NULL, http_thread, hls ) )
+    {
+        fprintf( stderr, "[hls] Could not create HTTP thread\n" );
+        return -1;
+    }
+    hls->http_running = 1;
+
+    return 0;
+}
+
+/**** Output ****/
+
+static void close_output( void *handle )
+{
+    obe_hls_ctx *hls = handle;
+
+    if( hls->http_running )
+    {
+        pthread_cancel( hls->http_thread );
+        pthread_join( hls->http_thread, NULL );
+    }
+    if( hls->listen_fd >= 0 )
+        close( hls->listen_fd );
+    if( hls->mutex_init )
+        pthread_mutex_destroy( &hls->mutex );
+    free( hls->muxed_data );
+    free( hls->ring );
+    free( hls->dir );
+    if( hls->output_params->output_dst.target )
+        free( hls->output_params->output_dst.target );
+    free( hls->output_params );
+}
+
+/* target is the directory to write to, which can be left out when serving over HTTP, with options after a '?'
+ * segment - target segment length in seconds (default 2)
+ * window  - number of segments in the playlist (default 6)
+ * port    - serve the playlist and segments over HTTP on this port */
+static int open_segmenter( obe_t *h, obe_hls_ctx *hls, const char *target )
+{
+    const char *p = strchr( target, '?' );
+    int64_t ring_size;
+    char buf[256];
+
+    hls->target_duration = 2 * OBE_CLOCK;
+    hls->window = 6;
+
+    if( p != target )
+    {
+        hls->dir = p ? strndup( target, p - target ) : strdup( target );
+        if( !hls->dir )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+    }
+
+    if( p && av_find_info_tag( buf, sizeof(buf), "segment", p ) )
+        hls->target_duration = strtol( buf, NULL, 10 ) * OBE_CLOCK;
+    if( p && av_find_info_tag( buf, sizeof(buf), "window", p ) )
+        hls->window = strtol( buf, NULL, 10 );
+    if( p && av_find_info_tag( buf, sizeof(buf), "port", p ) )
+        hls->port = strtol( buf, NULL, 10 );
+
+    if( hls->target_duration <= 0 || hls->window <= 0 || hls->window > HLS_MAX_SEGMENTS / 2 )
+    {
+        fprintf( stderr, "[hls] Invalid segment length or window, at most %i segments\n", HLS_MAX_SEGMENTS / 2 );
+        return -1;
+    }
+
+    if( !hls->dir && !hls->port )
+    {
+        fprintf( stderr, "[hls] Needs a directory, a port or both\n" );
+        return -1;
+    }
+
+    /* Enough for every segment kept, with headroom for GOPs longer than the target */
+    ring_size = (int64_t)h->mux_opts.ts_muxrate / 8 * ( hls->target_duration / OBE_CLOCK ) * ( 2 * hls->window + 2 ) * 2;
+    hls->ring_size = FFALIGN( MAX( ring_size, 16 << 20 ), TS_PACKET_SIZE );
+    hls->ring = malloc( hls->ring_size );
+    if( !hls->ring )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    pthread_mutex_init( &hls->mutex, NULL );
+    hls->mutex_init = 1;
+
+    if( hls->port && open_http( hls ) < 0 )
+        return -1;
+
+    return 0;
+}
+
+static void *open_output( void *ptr )
+{
+    obe_output_params_t *output_params = ptr;
+    obe_t *h = output_params->h;
+    obe_output_t *output = output_params->output;
+    obe_hls_ctx hls = {0};
+    int num_muxed_data = 0;
+    obe_muxed_data_t **muxed_data;
+
+    /* Like the file output this runs at normal priority unless told otherwise */
+    if( h->thread_opts[OBE_THREAD_OUTPUT].policy == OBE_SCHED_DEFAULT )
+    {
+        struct sched_param param = {0};
+        pthread_setschedparam( pthread_self(), SCHED_OTHER, &param );
+    }
+
+    hls.output_params = output_params;
+    hls.listen_fd = -1;
+    hls.pmt_pid = -1;
+    hls.video_pid = -1;
+    pthread_cleanup_push( close_output, (void*)&hls );
+
+    muxed_data = hls.muxed_data = malloc( output->queue.capacity * sizeof(*muxed_data) );
+    if( !muxed_data )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
+
+    if( open_segmenter( h, &hls, output_params->output_dst.target ? output_params->output_dst.target : "" ) < 0 )
+    {
+        fprintf( stderr, "[hls] Could not create output\n" );
+        goto finish;
+    }
+
+    while( 1 )
+    {
+        num_muxed_data = obe_output_pop_all( output, muxed_data );
+        if( num_muxed_data < 0 )
+            break;
+
+        for( int i = 0; i < num_muxed_data; i++ )
+        {
+            for( int j = 0; j < muxed_data[i]->len / TS_PACKET_SIZE; j++ )
+                write_packet( &hls, &muxed_data[i]->data[j*TS_PACKET_SIZE], muxed_data[i]->pcr_list[j] );
+
+            __atomic_store_n( &output->bytes_sent, output->bytes_sent + muxed_data[i]->len, __ATOMIC_RELAXED );
+            obe_latency_record( &output->latency, muxed_data[i]->arrival_time );
+            destroy_muxed_data( muxed_data[i] );
+        }
+    }
+
+    /* Stopped normally, so publish what is left of the segment being written */
+    if( hls.started )
+        finish_segment( &hls, hls.last_pcr );
+
+finish:
+    pthread_cleanup_pop( 1 );
+
+    return NULL;
+}
+
+const obe_output_func_t hls_output = { open_output };
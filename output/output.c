@@ -0,0 +1,92 @@
+/*****************************************************************************
+ * output.c : OBE output functions shared between outputs
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "common/common.h"
+#include "output/output.h"
+
+/* The pre-roll covers the mean lateness plus this many mean deviations. For roughly Gaussian
+ * jitter that is about 4 sigma, a few underruns in every 100000 chunks */
+#define JITTER_DEVIATIONS 5
+/* Weight of each new measurement, 1/16 */
+#define JITTER_SHIFT      4
+/* The pre-roll shrinks at 10ppm so receivers see it as ordinary clock drift */
+#define JITTER_SLEW       100000
+
+void obe_output_jitter_init( obe_output_jitter_t *jitter, int64_t preroll )
+{
+    memset( jitter, 0, sizeof(*jitter) );
+    jitter->preroll = preroll;
+    jitter->last_update = -1;
+}
+
+void obe_output_jitter_update( obe_output_jitter_t *jitter, int64_t lateness, int64_t now )
+{
+    int64_t err = lateness - jitter->mean;
+    int64_t target, step;
+
+    jitter->mean += err >> JITTER_SHIFT;
+    jitter->dev += ( llabs( err ) - jitter->dev ) >> JITTER_SHIFT;
+
+    target = jitter->mean + JITTER_DEVIATIONS * jitter->dev;
+    target = MIN( MAX( target, 0 ), OUTPUT_PREROLL_MAX );
+
+    /* Data arriving this late would underrun anyway, so growing at once costs nothing extra */
+    if( target > jitter->preroll )
+        jitter->preroll = target;
+    else if( jitter->last_update >= 0 )
+    {
+        step = ( now - jitter->last_update ) / JITTER_SLEW;
+        jitter->preroll -= MIN( jitter->preroll - target, step );
+    }
+
+    jitter->last_update = now;
+}
+
+void obe_output_jitter_resync( obe_output_jitter_t *jitter )
+{
+    jitter->mean = 0;
+    jitter->last_update = -1;
+}
+
+/* The output queue is bounded so its contents can always be taken in one go */
+int obe_output_pop_all( obe_output_t *output, obe_muxed_data_t **muxed_data )
+{
+    int num_muxed_data;
+
+    pthread_mutex_lock( &output->output_mutex );
+    while( !output->queue.size && !output->cancel_thread )
+        obe_trace_cond_wait( &output->output_cv, &output->output_mutex, output->queue.name );
+
+    if( !output->queue.size )
+    {
+        pthread_mutex_unlock( &output->output_mutex );
+        return -1;
+    }
+
+    num_muxed_data = output->queue.size;
+    for( int i = 0; i < num_muxed_data; i++ )
+        muxed_data[i] = obe_queue_pop( &output->queue );
+    pthread_mutex_unlock( &output->output_mutex );
+
+    return num_muxed_data;
+}
@@ -24,6 +24,42 @@
 #ifndef OBE_OUTPUT_H
 #define OBE_OUTPUT_H
 
+/* Packets due within this many 27MHz ticks of the first one go out in a single batch.
+ * Without SO_TXTIME they leave back to back, so this also bounds the added jitter */
+#define OUTPUT_PACING_WINDOW 27000
+
+/* When the kernel paces the packets (SO_TXTIME) they are handed over in larger batches,
+ * OUTPUT_TXTIME_LEAD ticks before the first one is due, so the thread sleeps in bulk */
+#define OUTPUT_TXTIME_WINDOW (27000*8)
+#define OUTPUT_TXTIME_LEAD   (27000*2)
+
+/* Pre-roll the outputs start with before anything has been measured */
+#define OUTPUT_PREROLL_GENERIC     (27000*40)
+#define OUTPUT_PREROLL_LOW_LATENCY 0
+#define OUTPUT_PREROLL_MAX         (27000*500)
+
+/* How far behind the mux an output sends its packets. It follows the lateness of the muxed data
+ * against the packet schedule so that almost nothing arrives after it was due */
+typedef struct
+{
+    int64_t preroll;
+    /* Running mean and mean absolute deviation of the lateness, 27MHz */
+    int64_t mean;
+    int64_t dev;
+    int64_t last_update;
+} obe_output_jitter_t;
+
+void obe_output_jitter_init( obe_output_jitter_t *jitter, int64_t preroll );
+/* lateness is how long after its send time without pre-roll the data was queued for the output */
+void obe_output_jitter_update( obe_output_jitter_t *jitter, int64_t lateness, int64_t now );
+/* The schedule restarts from the next packet, the spread of the lateness still holds */
+void obe_output_jitter_resync( obe_output_jitter_t *jitter );
+
+/* Waits for muxed data and takes everything queued for the output in one go. muxed_data holds
+ * queue.capacity entries. Returns the number taken, or -1 once the output is cancelled and the
+ * queue is empty, when the output finishes off and returns */
+int obe_output_pop_all( obe_output_t *output, obe_muxed_data_t **muxed_data );
+
 typedef struct
 {
     void* (*open_output)( void *ptr );
@@ -32,10 +68,16 @@ typedef struct
 typedef struct
 {
     obe_t *h;
-    obe_output_opts_t output_opts;
+    obe_output_t *output;
+    obe_output_dst_t output_dst;
 } obe_output_params_t;
 
 extern const obe_output_func_t udp_output;
 extern const obe_output_func_t rtp_output;
+extern const obe_output_func_t linsys_asi_output;
+extern const obe_output_func_t hls_output;
+#if HAVE_LIBURING
+extern const obe_output_func_t file_output;
+#endif
 
 #endif /* OBE_OUTPUT_H */
@@ -31,26 +31,132 @@
 #include "output/output.h"
 #include "common/bitstream.h"
 #include <libavutil/fifo.h>
+#include <libavutil/cpu.h>
+#include "x86/fec.h"
 
 #define RTP_VERSION 2
 #define MPEG_TS_PAYLOAD_TYPE 33
 #define RTP_HEADER_SIZE 12
 
+/* SMPTE 2022-1 */
+#define FEC_PAYLOAD_TYPE 96
+#define FEC_HEADER_SIZE 16
+#define FEC_PACKET_SIZE (RTP_HEADER_SIZE+FEC_HEADER_SIZE+TS_PACKETS_SIZE)
+#define FEC_COLUMN_PORT_OFFSET 2
+#define FEC_ROW_PORT_OFFSET 4
+#define FEC_MAX_COLUMNS 20
+#define FEC_MIN_ROWS 4
+#define FEC_MAX_ROWS 20
+#define FEC_MAX_MATRIX 100
+
+/* The XOR runs over whole vectors, so it reads a little past the end of each payload */
+#define FEC_XOR_SIZE ((TS_PACKETS_SIZE+31)&~31)
+#define RTP_PACKET_PADDING (FEC_XOR_SIZE-TS_PACKETS_SIZE)
+
 #define RTCP_SR_PACKET_TYPE 200
 #define RTCP_PACKET_SIZE 28
+#define RTCP_PORT_OFFSET 1
+#define RTCP_SR_INTERVAL OBE_CLOCK
+#define RTCP_MAX_PACKET_SIZE 1500
+
+/* RFC 4585 generic NACK */
+#define RTCP_RTPFB_PACKET_TYPE 205
+#define RTCP_GENERIC_NACK 1
+
+/* RFC 4588 retransmission, SSRC multiplexed with the media */
+#define RTX_PAYLOAD_TYPE 97
+#define RTX_OSN_SIZE 2
+#define RTX_PACKET_SIZE (RTP_HEADER_SIZE+RTX_OSN_SIZE+TS_PACKETS_SIZE)
+#define RTX_DEFAULT_CACHE 2048
+#define RTX_MAX_CACHE 32768
+/* A packet asked for again within this long has probably already been resent */
+#define RTX_MIN_INTERVAL (OBE_CLOCK/100)
 
 #define NTP_OFFSET 2208988800ULL
 #define NTP_OFFSET_US (NTP_OFFSET * 1000000ULL)
 
+/* XOR of the media packets protected by one FEC packet */
+typedef struct
+{
+    uint16_t sn_base;
+    uint16_t length_recovery;
+    uint8_t  pt_recovery;
+    uint32_t ts_recovery;
+    uint8_t *payload;
+} obe_fec_accum_t;
+
 typedef struct
 {
     hnd_t udp_handle;
+    uint16_t seq;
+
+    /* FEC packets produced during the current batch */
+    int num_pkts;
+    uint8_t (*pkt_buf)[FEC_PACKET_SIZE];
+    obe_udp_pkt_t pkts[UDP_MAX_BATCH];
+} obe_fec_stream_t;
+
+typedef struct
+{
+    int columns; /* L */
+    int rows;    /* D */
+    int matrix_pos;
 
+    obe_fec_stream_t column;
+    obe_fec_stream_t row;
+
+    uint8_t *accum_buf;
+    obe_fec_accum_t column_accum[FEC_MAX_COLUMNS];
+    obe_fec_accum_t row_accum;
+
+    void (*xor_payload)( uint8_t *dst, const uint8_t *src, int len );
+} obe_rtp_fec_ctx;
+
+typedef struct
+{
+    int is_valid;
+    uint16_t seq;
+    uint32_t timestamp;
+    int64_t rtx_time; /* wallclock of the last retransmission */
+    uint8_t *data;    /* RTX_PACKET_SIZE bytes, the payload is already where a retransmission needs it */
+} obe_rtx_slot_t;
+
+/* Every media packet sent is kept in a ring indexed by the low bits of its sequence number.
+ * The ring is written by the sender and read by the NACK handler in the same thread,
+ * so a retransmission is sent straight from its slot without a copy or an allocation */
+typedef struct
+{
+    hnd_t rtcp_handle;
     uint16_t seq;
     uint32_t ssrc;
+    int64_t last_sr_time;
+    uint32_t last_timestamp;
+
+    int cache_size; /* a power of two */
+    uint8_t *cache_buf;
+    obe_rtx_slot_t *slots;
+
+    int num_pkts;
+    obe_udp_pkt_t pkts[UDP_MAX_BATCH];
+
+    int64_t num_nacked;
+    int64_t num_resent;
+} obe_rtp_rtx_ctx;
+
+typedef struct
+{
+    hnd_t udp_handle;
+
+    uint16_t seq;
+    uint32_t ssrc;
+    /* Only the sequence number and timestamp change between packets */
+    uint8_t header[RTP_HEADER_SIZE];
 
     uint32_t pkt_cnt;
     uint32_t octet_cnt;
+
+    obe_rtp_fec_ctx *fec;
+    obe_rtp_rtx_ctx *rtx;
 } obe_rtp_ctx;
 
 struct rtp_status
@@ -59,8 +165,16 @@ struct rtp_status
     hnd_t *rtp_handle;
     AVFifoBuffer *fifo_data;
     AVFifoBuffer *fifo_pcr;
+    obe_muxed_data_t **muxed_data;
+    int64_t *arrival_times;
 };
 
+/* The pcr fifo only ever holds whole entries so the next one can be read in place */
+static int64_t peek_pcr( AVFifoBuffer *fifo_pcr )
+{
+    return *(int64_t*)fifo_pcr->rptr;
+}
+
 static int64_t obe_gettime(void)
 {
     struct timeval tv;
@@ -73,31 +187,210 @@ static uint64_t obe_ntp_time(void)
   return (obe_gettime() / 1000) * 1000 + NTP_OFFSET_US;
 }
 
-static int rtp_open( hnd_t *p_handle, char *target )
+/* len must be a multiple of 32 and dst must be aligned */
+void obe_fec_xor_c( uint8_t *dst, const uint8_t *src, int len )
 {
-    obe_rtp_ctx *p_rtp = calloc( 1, sizeof(*p_rtp) );
-    if( !p_rtp )
+    for( int i = 0; i < len; i++ )
+        dst[i] ^= src[i];
+}
+
+/* FEC streams go to the same host as the media, on the port FEC_*_PORT_OFFSET above it */
+static int open_fec_stream( obe_fec_stream_t *stream, char *target, int port_offset )
+{
+    char hostname[256], fec_target[1024];
+    const char *query = strchr( target, '?' );
+    int port;
+
+    av_url_split( NULL, 0, NULL, 0, hostname, sizeof(hostname), &port, NULL, 0, target );
+    snprintf( fec_target, sizeof(fec_target), strchr( hostname, ':' ) ? "udp://[%s]:%i%s" : "udp://%s:%i%s",
+              hostname, port + port_offset, query ? query : "" );
+
+    stream->pkt_buf = calloc( UDP_MAX_BATCH, sizeof(*stream->pkt_buf) );
+    if( !stream->pkt_buf )
     {
-        fprintf( stderr, "[rtp] malloc failed" );
+        fprintf( stderr, "[rtp] malloc failed\n" );
         return -1;
     }
 
-    if( udp_open( &p_rtp->udp_handle, target ) < 0 )
+    if( udp_open( &stream->udp_handle, fec_target ) < 0 )
     {
-        fprintf( stderr, "[rtp] Could not create udp output" );
+        fprintf( stderr, "[rtp] Could not create FEC output %s\n", fec_target );
         return -1;
     }
 
-    p_rtp->ssrc = av_get_random_seed();
+    return 0;
+}
 
-    *p_handle = p_rtp;
+static void close_fec( obe_rtp_fec_ctx *fec )
+{
+    if( fec->column.udp_handle )
+        udp_close( fec->column.udp_handle );
+    if( fec->row.udp_handle )
+        udp_close( fec->row.udp_handle );
+    if( fec->column.pkt_buf )
+        free( fec->column.pkt_buf );
+    if( fec->row.pkt_buf )
+        free( fec->row.pkt_buf );
+    if( fec->accum_buf )
+        free( fec->accum_buf );
+    free( fec );
+}
+
+/* url options: 'fec-columns=L' and 'fec-rows=D' enable SMPTE 2022-1 column and row FEC */
+static int open_fec( obe_rtp_ctx *p_rtp, char *target )
+{
+    obe_rtp_fec_ctx *fec;
+    const char *p = strchr( target, '?' );
+    char buf[20];
+    int columns = 0, rows = 0, cpu;
+
+    if( !p )
+        return 0;
+
+    if( av_find_info_tag( buf, sizeof(buf), "fec-columns", p ) )
+        columns = strtol( buf, NULL, 10 );
+    if( av_find_info_tag( buf, sizeof(buf), "fec-rows", p ) )
+        rows = strtol( buf, NULL, 10 );
+
+    if( !columns && !rows )
+        return 0;
+
+    if( columns < 1 || columns > FEC_MAX_COLUMNS || rows < FEC_MIN_ROWS || rows > FEC_MAX_ROWS ||
+        columns * rows > FEC_MAX_MATRIX )
+    {
+        fprintf( stderr, "[rtp] Invalid FEC matrix %ix%i. Columns must be 1-%i, rows %i-%i and at most %i packets in total\n",
+                 columns, rows, FEC_MAX_COLUMNS, FEC_MIN_ROWS, FEC_MAX_ROWS, FEC_MAX_MATRIX );
+        return -1;
+    }
+
+    fec = calloc( 1, sizeof(*fec) );
+    if( !fec )
+    {
+        fprintf( stderr, "[rtp] malloc failed\n" );
+        return -1;
+    }
+
+    fec->columns = columns;
+    fec->rows = rows;
+
+    if( posix_memalign( (void**)&fec->accum_buf, 32, (columns + 1) * FEC_XOR_SIZE ) )
+    {
+        fec->accum_buf = NULL;
+        fprintf( stderr, "[rtp] malloc failed\n" );
+        goto fail;
+    }
+    memset( fec->accum_buf, 0, (columns + 1) * FEC_XOR_SIZE );
+
+    for( int i = 0; i < columns; i++ )
+        fec->column_accum[i].payload = fec->accum_buf + i * FEC_XOR_SIZE;
+    fec->row_accum.payload = fec->accum_buf + columns * FEC_XOR_SIZE;
+
+    if( open_fec_stream( &fec->column, target, FEC_COLUMN_PORT_OFFSET ) < 0 ||
+        open_fec_stream( &fec->row, target, FEC_ROW_PORT_OFFSET ) < 0 )
+        goto fail;
+
+    cpu = av_get_cpu_flags();
+
+    fec->xor_payload = obe_fec_xor_c;
+
+    if( cpu & AV_CPU_FLAG_SSE2 )
+        fec->xor_payload = obe_fec_xor_sse2;
+
+    if( cpu & AV_CPU_FLAG_AVX )
+        fec->xor_payload = obe_fec_xor_avx;
+
+    p_rtp->fec = fec;
 
     return 0;
+
+fail:
+    close_fec( fec );
+    return -1;
 }
-#if 0
-static int write_rtcp_pkt( hnd_t handle )
+
+static void fec_accumulate( obe_rtp_fec_ctx *fec, obe_fec_accum_t *accum, int first, uint8_t *payload,
+                            uint16_t seq, uint32_t timestamp )
+{
+    if( first )
+    {
+        accum->sn_base = seq;
+        accum->length_recovery = TS_PACKETS_SIZE;
+        accum->pt_recovery = MPEG_TS_PAYLOAD_TYPE;
+        accum->ts_recovery = timestamp;
+        memcpy( accum->payload, payload, TS_PACKETS_SIZE );
+    }
+    else
+    {
+        accum->length_recovery ^= TS_PACKETS_SIZE;
+        accum->pt_recovery ^= MPEG_TS_PAYLOAD_TYPE;
+        accum->ts_recovery ^= timestamp;
+        fec->xor_payload( accum->payload, payload, FEC_XOR_SIZE );
+    }
+}
+
+/* Queues an FEC packet to go out at the same time as the media packet that completed it */
+static void write_fec_pkt( obe_rtp_fec_ctx *fec, obe_fec_stream_t *stream, obe_fec_accum_t *accum, int is_row, int64_t tx_time )
+{
+    uint8_t *pkt = stream->pkt_buf[stream->num_pkts];
+    bs_t s;
+    bs_init( &s, pkt, RTP_HEADER_SIZE+FEC_HEADER_SIZE );
+
+    bs_write( &s, 2, RTP_VERSION ); // version
+    bs_write1( &s, 0 );             // padding
+    bs_write1( &s, 0 );             // extension
+    bs_write( &s, 4, 0 );           // CSRC count
+    bs_write1( &s, 0 );             // marker
+    bs_write( &s, 7, FEC_PAYLOAD_TYPE ); // payload type
+    bs_write( &s, 16, stream->seq++ ); // sequence number
+    bs_write32( &s, 0 );            // timestamp
+    bs_write32( &s, 0 );            // ssrc
+
+    bs_write( &s, 16, accum->sn_base );         // SNBase low bits
+    bs_write( &s, 16, accum->length_recovery ); // length recovery
+    bs_write1( &s, 1 );                         // E
+    bs_write( &s, 7, accum->pt_recovery );      // PT recovery
+    bs_write( &s, 24, 0 );                      // mask
+    bs_write32( &s, accum->ts_recovery );       // TS recovery
+    bs_write1( &s, 0 );                         // N
+    bs_write1( &s, is_row );                    // D
+    bs_write( &s, 3, 0 );                       // type (XOR)
+    bs_write( &s, 3, 0 );                       // index
+    bs_write( &s, 8, is_row ? 1 : fec->columns ); // offset
+    bs_write( &s, 8, is_row ? fec->columns : fec->rows ); // NA
+    bs_write( &s, 8, 0 );                       // SNBase ext bits
+    bs_flush( &s );
+
+    memcpy( &pkt[RTP_HEADER_SIZE+FEC_HEADER_SIZE], accum->payload, TS_PACKETS_SIZE );
+
+    stream->pkts[stream->num_pkts].data = pkt;
+    stream->pkts[stream->num_pkts].size = FEC_PACKET_SIZE;
+    stream->pkts[stream->num_pkts].tx_time = tx_time;
+    stream->num_pkts++;
+}
+
+/* Media packets fill an L x D matrix row by row. Row FEC covers each row of L packets
+ * and column FEC covers each column of D packets */
+static void fec_add_pkt( obe_rtp_fec_ctx *fec, obe_udp_pkt_t *pkt, uint16_t seq, uint32_t timestamp )
+{
+    int column = fec->matrix_pos % fec->columns;
+    int row = fec->matrix_pos / fec->columns;
+    uint8_t *payload = pkt->data + RTP_HEADER_SIZE;
+
+    fec_accumulate( fec, &fec->column_accum[column], row == 0, payload, seq, timestamp );
+    fec_accumulate( fec, &fec->row_accum, column == 0, payload, seq, timestamp );
+
+    if( column == fec->columns - 1 )
+        write_fec_pkt( fec, &fec->row, &fec->row_accum, 1, pkt->tx_time );
+
+    if( row == fec->rows - 1 )
+        write_fec_pkt( fec, &fec->column, &fec->column_accum[column], 0, pkt->tx_time );
+
+    if( ++fec->matrix_pos == fec->columns * fec->rows )
+        fec->matrix_pos = 0;
+}
+
+static int write_rtcp_pkt( obe_rtp_ctx *p_rtp )
 {
-    obe_rtp_ctx *p_rtp = handle;
     uint64_t ntp_time = obe_ntp_time();
     uint8_t pkt[100];
     bs_t s;
@@ -111,42 +404,323 @@ static int write_rtcp_pkt( hnd_t handle )
     bs_write32( &s, p_rtp->ssrc );  // ssrc
     bs_write32( &s, ntp_time / 1000000 ); // NTP timestamp, most significant word
     bs_write32( &s, ((ntp_time % 1000000) << 32) / 1000000 ); // NTP timestamp, least significant word
-    bs_write32( &s, 0 );            // RTP timestamp FIXME
+    bs_write32( &s, p_rtp->rtx->last_timestamp ); // RTP timestamp of the last packet sent
     bs_write32( &s, p_rtp->pkt_cnt ); // sender's packet count
     bs_write32( &s, p_rtp->octet_cnt ); // sender's octet count
     bs_flush( &s );
 
-    if( udp_write( p_rtp->udp_handle, pkt, RTCP_PACKET_SIZE ) < 0 )
+    if( udp_write( p_rtp->rtx->rtcp_handle, pkt, RTCP_PACKET_SIZE ) < 0 )
         return -1;
 
     return 0;
 }
-#endif
-static int write_rtp_pkt( hnd_t handle, uint8_t *data, int len, int64_t timestamp )
+
+static void close_rtx( obe_rtp_rtx_ctx *rtx )
+{
+    if( rtx->num_nacked )
+        syslog( LOG_INFO, "[rtp] %"PRIi64" packets NACKed, %"PRIi64" retransmitted\n", rtx->num_nacked, rtx->num_resent );
+
+    if( rtx->rtcp_handle )
+        udp_close( rtx->rtcp_handle );
+    if( rtx->cache_buf )
+        free( rtx->cache_buf );
+    if( rtx->slots )
+        free( rtx->slots );
+    free( rtx );
+}
+
+/* url options: 'rtx=1' answers RTCP NACKs with RFC 4588 retransmissions and 'rtx-cache=n' is
+ * how many sent packets can be asked for again. RTCP goes to the port above the media and
+ * NACKs are accepted on either port so rtcp-mux receivers work too */
+static int open_rtx( obe_rtp_ctx *p_rtp, char *target )
+{
+    obe_rtp_rtx_ctx *rtx;
+    const char *p = strchr( target, '?' );
+    char buf[20], hostname[256], rtcp_target[1024];
+    int cache_size = RTX_DEFAULT_CACHE, port;
+
+    if( !p || !av_find_info_tag( buf, sizeof(buf), "rtx", p ) || !strtol( buf, NULL, 10 ) )
+        return 0;
+
+    if( av_find_info_tag( buf, sizeof(buf), "rtx-cache", p ) )
+        cache_size = strtol( buf, NULL, 10 );
+
+    /* Half the sequence number space at most so a slot's packet is never mistaken for one a whole cycle later */
+    if( cache_size < UDP_MAX_BATCH || cache_size > RTX_MAX_CACHE || ( cache_size & (cache_size - 1) ) )
+    {
+        fprintf( stderr, "[rtp] Invalid retransmission cache of %i packets. It must be a power of two from %i to %i\n",
+                 cache_size, UDP_MAX_BATCH, RTX_MAX_CACHE );
+        return -1;
+    }
+
+    rtx = calloc( 1, sizeof(*rtx) );
+    if( !rtx )
+    {
+        fprintf( stderr, "[rtp] malloc failed\n" );
+        return -1;
+    }
+
+    rtx->cache_size = cache_size;
+    rtx->cache_buf = malloc( (size_t)cache_size * RTX_PACKET_SIZE );
+    rtx->slots = calloc( cache_size, sizeof(*rtx->slots) );
+    if( !rtx->cache_buf || !rtx->slots )
+    {
+        fprintf( stderr, "[rtp] malloc failed\n" );
+        goto fail;
+    }
+
+    /* Fault the ring in now rather than while sending */
+    memset( rtx->cache_buf, 0, (size_t)cache_size * RTX_PACKET_SIZE );
+    for( int i = 0; i < cache_size; i++ )
+        rtx->slots[i].data = rtx->cache_buf + (size_t)i * RTX_PACKET_SIZE;
+
+    av_url_split( NULL, 0, NULL, 0, hostname, sizeof(hostname), &port, NULL, 0, target );
+    snprintf( rtcp_target, sizeof(rtcp_target), strchr( hostname, ':' ) ? "udp://[%s]:%i" : "udp://%s:%i",
+              hostname, port + RTCP_PORT_OFFSET );
+
+    if( udp_open( &rtx->rtcp_handle, rtcp_target ) < 0 )
+    {
+        fprintf( stderr, "[rtp] Could not create RTCP output %s\n", rtcp_target );
+        goto fail;
+    }
+
+    rtx->ssrc = av_get_random_seed();
+    rtx->seq = av_get_random_seed();
+    p_rtp->rtx = rtx;
+
+    return 0;
+
+fail:
+    close_rtx( rtx );
+    return -1;
+}
+
+/* pkt has its RTP header, the payload is copied in after the space for the RTX header and OSN */
+static void rtx_add_pkt( obe_rtp_rtx_ctx *rtx, obe_udp_pkt_t *pkt, uint16_t seq, uint32_t timestamp )
+{
+    obe_rtx_slot_t *slot = &rtx->slots[seq & (rtx->cache_size - 1)];
+
+    slot->is_valid = 1;
+    slot->seq = seq;
+    slot->timestamp = timestamp;
+    slot->rtx_time = 0;
+    memcpy( slot->data + RTP_HEADER_SIZE + RTX_OSN_SIZE, pkt->data + RTP_HEADER_SIZE, TS_PACKETS_SIZE );
+
+    rtx->last_timestamp = timestamp;
+}
+
+static void rtx_queue_pkt( obe_rtp_rtx_ctx *rtx, uint16_t seq, int64_t now )
+{
+    obe_rtx_slot_t *slot = &rtx->slots[seq & (rtx->cache_size - 1)];
+    uint8_t *pkt = slot->data;
+
+    rtx->num_nacked++;
+
+    /* Too old, or not sent yet */
+    if( !slot->is_valid || slot->seq != seq )
+        return;
+
+    if( slot->rtx_time && now - slot->rtx_time < RTX_MIN_INTERVAL )
+        return;
+    slot->rtx_time = now;
+
+    pkt[0] = RTP_VERSION << 6;
+    pkt[1] = RTX_PAYLOAD_TYPE;
+    bs_put_be16( &pkt[2], rtx->seq++ );
+    bs_put_be32( &pkt[4], slot->timestamp );
+    bs_put_be32( &pkt[8], rtx->ssrc );
+    bs_put_be16( &pkt[RTP_HEADER_SIZE], seq ); // original sequence number
+
+    rtx->pkts[rtx->num_pkts].data = pkt;
+    rtx->pkts[rtx->num_pkts].size = RTX_PACKET_SIZE;
+    rtx->pkts[rtx->num_pkts].tx_time = 0;
+    rtx->num_pkts++;
+    rtx->num_resent++;
+}
+
+static int rtx_flush( obe_rtp_ctx *p_rtp )
+{
+    obe_rtp_rtx_ctx *rtx = p_rtp->rtx;
+    int ret = 0;
+
+    if( rtx->num_pkts && udp_write_batch( p_rtp->udp_handle, rtx->pkts, rtx->num_pkts ) < 0 )
+        ret = -1;
+    rtx->num_pkts = 0;
+
+    return ret;
+}
+
+/* Walks a compound RTCP packet for generic NACKs of the media stream */
+static int rtx_parse_rtcp( obe_rtp_ctx *p_rtp, uint8_t *buf, int len, int64_t now )
+{
+    obe_rtp_rtx_ctx *rtx = p_rtp->rtx;
+
+    while( len >= 4 )
+    {
+        int fmt = buf[0] & 0x1f;
+        int pt = buf[1];
+        int size = ( ( buf[2] << 8 | buf[3] ) + 1 ) * 4;
+
+        if( ( buf[0] >> 6 ) != RTP_VERSION || size > len )
+            break;
+
+        if( pt == RTCP_RTPFB_PACKET_TYPE && fmt == RTCP_GENERIC_NACK && size >= 12 &&
+            (uint32_t)( buf[8] << 24 | buf[9] << 16 | buf[10] << 8 | buf[11] ) == p_rtp->ssrc )
+        {
+            /* Each FCI is a lost packet and a bitmask of the 16 after it */
+            for( int i = 12; i + 4 <= size; i += 4 )
+            {
+                uint16_t pid = buf[i] << 8 | buf[i+1];
+                uint16_t blp = buf[i+2] << 8 | buf[i+3];
+
+                for( int j = 0; j < 17; j++ )
+                {
+                    if( j && !( blp & ( 1 << (j-1) ) ) )
+                        continue;
+
+                    if( rtx->num_pkts == UDP_MAX_BATCH && rtx_flush( p_rtp ) < 0 )
+                        return -1;
+                    rtx_queue_pkt( rtx, pid + j, now );
+                }
+            }
+        }
+
+        buf += size;
+        len -= size;
+    }
+
+    return 0;
+}
+
+static int rtx_poll_handle( obe_rtp_ctx *p_rtp, hnd_t handle, int64_t now )
+{
+    uint8_t buf[RTCP_MAX_PACKET_SIZE];
+    int len;
+
+    while( ( len = udp_read( handle, buf, sizeof(buf) ) ) > 0 )
+    {
+        /* RTCP packet types are 192-223 whichever port it came in on */
+        if( len >= 8 && buf[1] >= 192 && buf[1] <= 223 && rtx_parse_rtcp( p_rtp, buf, len, now ) < 0 )
+            return -1;
+    }
+
+    return len < 0 ? -1 : 0;
+}
+
+/* Called after each batch so a NACK waits at most one pacing window */
+static int rtx_poll( obe_rtp_ctx *p_rtp )
+{
+    obe_rtp_rtx_ctx *rtx = p_rtp->rtx;
+    int64_t now = get_wallclock_in_mpeg_ticks();
+
+    /* Sender reports let the receiver find the RTCP port to send NACKs back to */
+    if( now - rtx->last_sr_time >= RTCP_SR_INTERVAL )
+    {
+        if( write_rtcp_pkt( p_rtp ) < 0 )
+            syslog( LOG_WARNING, "[rtp] Failed to write RTCP packet\n" );
+        rtx->last_sr_time = now;
+    }
+
+    if( rtx_poll_handle( p_rtp, rtx->rtcp_handle, now ) < 0 ||
+        rtx_poll_handle( p_rtp, p_rtp->udp_handle, now ) < 0 )
+    {
+        rtx->num_pkts = 0;
+        return -1;
+    }
+
+    return rtx_flush( p_rtp );
+}
+
+static void write_rtp_header( obe_rtp_ctx *p_rtp )
+{
+    uint8_t *header = p_rtp->header;
+
+    /* Byte stores, a bitstream flush would write past the 12 bytes of the template */
+    header[0] = RTP_VERSION << 6;  // version, no padding, extension or CSRCs
+    header[1] = MPEG_TS_PAYLOAD_TYPE; // no marker, payload type
+    bs_put_be16( &header[2], 0 );  // sequence number, filled in per packet
+    bs_put_be32( &header[4], 0 );  // timestamp, filled in per packet
+    bs_put_be32( &header[8], p_rtp->ssrc ); // ssrc
+}
+
+static int rtp_open( hnd_t *p_handle, char *target )
+{
+    obe_rtp_ctx *p_rtp = calloc( 1, sizeof(*p_rtp) );
+    if( !p_rtp )
+    {
+        fprintf( stderr, "[rtp] malloc failed" );
+        return -1;
+    }
+
+    if( udp_open( &p_rtp->udp_handle, target ) < 0 )
+    {
+        fprintf( stderr, "[rtp] Could not create udp output" );
+        goto fail;
+    }
+
+    if( open_fec( p_rtp, target ) < 0 )
+        goto fail;
+
+    if( open_rtx( p_rtp, target ) < 0 )
+        goto fail;
+
+    p_rtp->ssrc = av_get_random_seed();
+    write_rtp_header( p_rtp );
+
+    *p_handle = p_rtp;
+
+    return 0;
+
+fail:
+    if( p_rtp->udp_handle )
+        udp_close( p_rtp->udp_handle );
+    if( p_rtp->fec )
+        close_fec( p_rtp->fec );
+    free( p_rtp );
+    return -1;
+}
+
+/* Each packet already has its TS payload after RTP_HEADER_SIZE bytes of space for the header */
+static int write_rtp_pkts( hnd_t handle, obe_udp_pkt_t *pkts, int num_pkts, int64_t *timestamps )
 {
     obe_rtp_ctx *p_rtp = handle;
-    uint8_t pkt[RTP_HEADER_SIZE+TS_PACKETS_SIZE];
-    bs_t s;
-    bs_init( &s, pkt, RTP_HEADER_SIZE+TS_PACKETS_SIZE );
+    obe_rtp_fec_ctx *fec = p_rtp->fec;
 
-    bs_write( &s, 2, RTP_VERSION ); // version
-    bs_write1( &s, 0 );             // padding
-    bs_write1( &s, 0 );             // extension
-    bs_write( &s, 4, 0 );           // CSRC count
-    bs_write1( &s, 0 );             // marker
-    bs_write( &s, 7, MPEG_TS_PAYLOAD_TYPE ); // payload type
-    bs_write( &s, 16, p_rtp->seq++ ); // sequence number
-    bs_write32( &s, timestamp );      // timestamp
-    bs_write32( &s, p_rtp->ssrc );    // ssrc
-    bs_flush( &s );
+    if( fec )
+        fec->column.num_pkts = fec->row.num_pkts = 0;
 
-    memcpy( &pkt[RTP_HEADER_SIZE], data, len );
+    for( int i = 0; i < num_pkts; i++ )
+    {
+        /* Only byte stores within the first RTP_HEADER_SIZE bytes, a bitstream flush here would run into the payload */
+        memcpy( pkts[i].data, p_rtp->header, RTP_HEADER_SIZE );
+        bs_put_be16( &pkts[i].data[2], p_rtp->seq ); // sequence number
+        bs_put_be32( &pkts[i].data[4], timestamps[i] ); // timestamp
+
+        if( fec )
+            fec_add_pkt( fec, &pkts[i], p_rtp->seq, timestamps[i] );
+        if( p_rtp->rtx )
+            rtx_add_pkt( p_rtp->rtx, &pkts[i], p_rtp->seq, timestamps[i] );
+        p_rtp->seq++;
+    }
 
-    if( udp_write( p_rtp->udp_handle, pkt, RTP_HEADER_SIZE+TS_PACKETS_SIZE ) < 0 )
+    if( udp_write_batch( p_rtp->udp_handle, pkts, num_pkts ) < 0 )
         return -1;
 
-    p_rtp->pkt_cnt++;
-    p_rtp->octet_cnt += len;
+    if( fec )
+    {
+        if( fec->column.num_pkts && udp_write_batch( fec->column.udp_handle, fec->column.pkts, fec->column.num_pkts ) < 0 )
+            return -1;
+        if( fec->row.num_pkts && udp_write_batch( fec->row.udp_handle, fec->row.pkts, fec->row.num_pkts ) < 0 )
+            return -1;
+    }
+
+    p_rtp->pkt_cnt += num_pkts;
+    for( int i = 0; i < num_pkts; i++ )
+        p_rtp->octet_cnt += pkts[i].size - RTP_HEADER_SIZE;
+
+    /* A lost retransmission is no worse than a lost packet so this doesn't stop the output */
+    if( p_rtp->rtx && rtx_poll( p_rtp ) < 0 )
+        syslog( LOG_WARNING, "[rtp] Failed to send retransmissions\n" );
 
     return 0;
 }
@@ -156,6 +730,10 @@ static void rtp_close( hnd_t handle )
     obe_rtp_ctx *p_rtp = handle;
 
     udp_close( p_rtp->udp_handle);
+    if( p_rtp->fec )
+        close_fec( p_rtp->fec );
+    if( p_rtp->rtx )
+        close_rtx( p_rtp->rtx );
     free( p_rtp );
 }
 
@@ -167,8 +745,14 @@ static void close_output( void *handle )
         av_fifo_free( status->fifo_data );
     if( status->fifo_pcr )
         av_fifo_free( status->fifo_pcr );
+    if( status->muxed_data )
+        free( status->muxed_data );
+    if( status->arrival_times )
+        free( status->arrival_times );
     if( *status->rtp_handle )
         rtp_close( *status->rtp_handle );
+    if( status->output_params->output_dst.target )
+        free( status->output_params->output_dst.target );
     free( status->output_params );
 }
 
@@ -177,96 +761,92 @@ static void *open_output( void *ptr )
 {
     obe_output_params_t *output_params = ptr;
     obe_t *h = output_params->h;
+    obe_output_t *output = output_params->output;
     struct rtp_status status;
     hnd_t rtp_handle = NULL;
-    int num_muxed_data = 0, buffer_frames = 0, ready = 0;
-    obe_muxed_data_t **muxed_data;
-    int64_t last_pcr = -1, last_clock = -1, delta;
+    int num_muxed_data = 0, num_pkts, num_drops = 0;
+    int64_t pacing_window = OUTPUT_PACING_WINDOW, pacing_lead = 0;
+    obe_muxed_data_t **muxed_data = NULL;
+    int64_t *arrival_times = NULL;
+    int64_t last_pcr = -1, last_clock = -1, delta, now;
+    obe_output_jitter_t jitter;
     AVFifoBuffer *fifo_data = NULL, *fifo_pcr = NULL;
-    uint8_t rtp_buf[TS_PACKETS_SIZE];
-    int64_t pcrs[7];
+    uint8_t rtp_buf[UDP_MAX_BATCH][RTP_HEADER_SIZE+TS_PACKETS_SIZE+RTP_PACKET_PADDING];
+    int64_t pcrs[UDP_MAX_BATCH][7];
+    int64_t timestamps[UDP_MAX_BATCH];
+    obe_udp_pkt_t pkts[UDP_MAX_BATCH];
 
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+    /* Everything is freed by close_output, so it goes on before the first allocation */
+    memset( &status, 0, sizeof(status) );
+    status.output_params = output_params;
+    status.rtp_handle = &rtp_handle;
+    pthread_cleanup_push( close_output, (void*)&status );
 
-    fifo_data = av_fifo_alloc( TS_PACKETS_SIZE );
+    fifo_data = status.fifo_data = av_fifo_alloc( TS_PACKETS_SIZE );
     if( !fifo_data )
     {
         fprintf( stderr, "[rtp] Could not allocate data fifo" );
-        return NULL;
+        goto finish;
     }
 
-    fifo_pcr = av_fifo_alloc( 7 * sizeof(int64_t) );
+    fifo_pcr = status.fifo_pcr = av_fifo_alloc( 7 * sizeof(int64_t) );
     if( !fifo_pcr )
     {
         fprintf( stderr, "[rtp] Could not allocate pcr fifo" );
-        return NULL;
+        goto finish;
     }
 
-    status.output_params = output_params;
-    status.rtp_handle = &rtp_handle;
-    status.fifo_data = fifo_data;
-    status.fifo_pcr = fifo_pcr;
-    pthread_cleanup_push( close_output, (void*)&status );
+    muxed_data = status.muxed_data = malloc( output->queue.capacity * sizeof(*muxed_data) );
+    arrival_times = status.arrival_times = malloc( output->queue.capacity * sizeof(*arrival_times) );
+    if( !muxed_data || !arrival_times )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
+
+    if( rtp_open( &rtp_handle, output_params->output_dst.target ) < 0 )
+        goto finish;
 
-    if( rtp_open( &rtp_handle, output_params->output_opts.target ) < 0 )
-        return NULL;
+    obe_output_jitter_init( &jitter, h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? OUTPUT_PREROLL_LOW_LATENCY : OUTPUT_PREROLL_GENERIC );
 
-    buffer_frames = h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? 0 : 2;
+    if( udp_is_kernel_paced( ((obe_rtp_ctx*)rtp_handle)->udp_handle ) )
+    {
+        pacing_window = OUTPUT_TXTIME_WINDOW;
+        pacing_lead = OUTPUT_TXTIME_LEAD;
+    }
 
     int64_t start_mpeg_time = 0, start_pcr_time = 0;
 
     while( 1 )
     {
-        pthread_mutex_lock( &h->output_mutex );
-        if( h->num_muxed_data == num_muxed_data )
-        {
-            /* Often this cond_wait is not because of an underflow */
-            pthread_cond_wait( &h->output_cv, &h->output_mutex );
-        }
+        num_muxed_data = obe_output_pop_all( output, muxed_data );
+        if( num_muxed_data < 0 )
+            break;
 
-        num_muxed_data = h->num_muxed_data;
-
-        /* Refill the buffer after a drop */
+        /* After a drop the schedule restarts from the next packet rather than refilling the buffer */
         pthread_mutex_lock( &h->drop_mutex );
-        if( h->output_drop )
+        if( h->output_drop != num_drops )
         {
-            syslog( LOG_INFO, "RTP output buffer reset\n" );
-            ready = h->output_drop = 0;
+            syslog( LOG_INFO, "RTP output resync\n" );
+            num_drops = h->output_drop;
             last_clock = -1;
+            obe_output_jitter_resync( &jitter );
         }
         pthread_mutex_unlock( &h->drop_mutex );
 
-        if( !ready )
-        {
-            if( num_muxed_data >= buffer_frames )
-                ready = 1;
-            else
-            {
-                pthread_mutex_unlock( &h->output_mutex );
-                continue;
-            }
-        }
-
-        muxed_data = malloc( num_muxed_data * sizeof(*muxed_data) );
-        if( !muxed_data )
-        {
-            pthread_mutex_unlock( &h->output_mutex );
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return NULL;
-        }
-        memcpy( muxed_data, h->muxed_data, num_muxed_data * sizeof(*muxed_data) );
-        pthread_mutex_unlock( &h->output_mutex );
-
 //        printf("\n START %i \n", num_muxed_data );
 
+        now = get_input_clock_in_mpeg_ticks( h );
         for( int i = 0; i < num_muxed_data; i++ )
         {
+            /* Lateness of the first packet against the schedule without any pre-roll */
+            if( last_clock != -1 && muxed_data[i]->len )
+                obe_output_jitter_update( &jitter, muxed_data[i]->queued_time - ( muxed_data[i]->pcr_list[0] - start_pcr_time + start_mpeg_time ), now );
+
             if( av_fifo_realloc2( fifo_data, av_fifo_size( fifo_data ) + muxed_data[i]->len ) < 0 )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                goto finish;
             }
 
             av_fifo_generic_write( fifo_data, muxed_data[i]->data, muxed_data[i]->len, NULL );
@@ -274,24 +854,35 @@ static void *open_output( void *ptr )
             if( av_fifo_realloc2( fifo_pcr, av_fifo_size( fifo_pcr ) + ((muxed_data[i]->len * sizeof(int64_t)) / 188) ) < 0 )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                goto finish;
             }
 
             av_fifo_generic_write( fifo_pcr, muxed_data[i]->pcr_list, (muxed_data[i]->len * sizeof(int64_t)) / 188, NULL );
 
-            remove_from_output_queue( h );
+            arrival_times[i] = muxed_data[i]->arrival_time;
             destroy_muxed_data( muxed_data[i] );
         }
 
-        free( muxed_data );
-
         while( av_fifo_size( fifo_data ) >= TS_PACKETS_SIZE )
         {
-            av_fifo_generic_read( fifo_data, rtp_buf, TS_PACKETS_SIZE, NULL );
-            av_fifo_generic_read( fifo_pcr, pcrs, 7 * sizeof(int64_t), NULL );
-            if( last_clock != -1 )
+            /* Take every packet that is due within the pacing window of the first one */
+            num_pkts = 0;
+            do
+            {
+                av_fifo_generic_read( fifo_data, &rtp_buf[num_pkts][RTP_HEADER_SIZE], TS_PACKETS_SIZE, NULL );
+                av_fifo_generic_read( fifo_pcr, pcrs[num_pkts], 7 * sizeof(int64_t), NULL );
+                num_pkts++;
+            } while( num_pkts < UDP_MAX_BATCH && av_fifo_size( fifo_data ) >= TS_PACKETS_SIZE &&
+                     peek_pcr( fifo_pcr ) - pcrs[0][0] < pacing_window );
+
+            if( last_clock == -1 )
+            {
+                start_mpeg_time = get_input_clock_in_mpeg_ticks( h );
+                start_pcr_time = pcrs[0][0];
+            }
+            else
             {
-                delta = pcrs[0] - last_pcr;
+                delta = pcrs[0][0] - last_pcr;
 #if 0
                 int64_t mpegtime = get_wallclock_in_mpeg_ticks();
 
@@ -302,25 +893,40 @@ static void *open_output( void *ptr )
                     printf("\n behind %f \n", (double)(last_clock + delta - mpegtime)/27000000 );
                 }
 #endif
-                sleep_input_clock( h, pcrs[0] - start_pcr_time + start_mpeg_time );
             }
 
-            if( last_clock == -1 )
+            /* The batch that (re)starts the clock waits out the pre-roll as well */
+            sleep_input_clock( h, pcrs[0][0] - start_pcr_time + start_mpeg_time + jitter.preroll - pacing_lead );
+
+            for( int i = 0; i < num_pkts; i++ )
             {
-                start_mpeg_time = get_input_clock_in_mpeg_ticks( h );
-                start_pcr_time = pcrs[0];
+                pkts[i].data = rtp_buf[i];
+                pkts[i].size = RTP_HEADER_SIZE+TS_PACKETS_SIZE;
+                /* The batch that (re)starts the clock has no tx time so ETF doesn't drop it as late */
+                if( last_clock == -1 )
+                    pkts[i].tx_time = 0;
+                else
+                    pkts[i].tx_time = input_clock_to_wallclock( h, pcrs[i][0] - start_pcr_time + start_mpeg_time + jitter.preroll ) * 1000 / 27;
+                timestamps[i] = pcrs[i][0];
             }
 
             last_clock = get_wallclock_in_mpeg_ticks();
-            last_pcr = pcrs[0];
-            if( write_rtp_pkt( rtp_handle, rtp_buf, TS_PACKETS_SIZE, pcrs[0] ) < 0 )
+            last_pcr = pcrs[num_pkts-1][0];
+            if( write_rtp_pkts( rtp_handle, pkts, num_pkts, timestamps ) < 0 )
 	    {
                 syslog( LOG_ERR, "[rtp] Failed to write RTP packet\n" );
-                return NULL;
+                goto finish;
             }
+            __atomic_store_n( &output->bytes_sent, output->bytes_sent + num_pkts * TS_PACKETS_SIZE, __ATOMIC_RELAXED );
         }
+
+        /* Whatever is left in the fifo is less than one packet batch */
+        for( int i = 0; i < num_muxed_data; i++ )
+            obe_latency_record( &output->latency, arrival_times[i] );
+        num_muxed_data = 0;
     }
 
+finish:
     pthread_cleanup_pop( 1 );
 
     return NULL;
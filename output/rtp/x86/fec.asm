@@ -0,0 +1,31 @@
+%include "x86inc.asm"
+%include "x86util.asm"
+
+SECTION .text
+
+;
+; obe_fec_xor( uint8_t *dst, const uint8_t *src, int len )
+; dst must be aligned, len must be a multiple of mmsize
+;
+
+%macro FEC_xor 1
+
+cglobal fec_xor_%1, 3,3
+    movsxdifnidn r2, r2d
+    add       r0, r2
+    add       r1, r2
+    neg       r2
+
+.loop
+    movu      m0, [r1+r2]
+    pxor      m0, [r0+r2]
+    mova      [r0+r2], m0
+    add       r2, mmsize
+    jl        .loop
+    REP_RET
+%endmacro
+
+INIT_XMM
+FEC_xor sse2
+INIT_AVX
+FEC_xor avx
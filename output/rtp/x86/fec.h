@@ -0,0 +1,31 @@
+/*****************************************************************************
+ * fec.h: rtp fec asm prototypes
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef OBE_X86_FEC
+#define OBE_X86_FEC
+
+void obe_fec_xor_c( uint8_t *dst, const uint8_t *src, int len );
+void obe_fec_xor_sse2( uint8_t *dst, const uint8_t *src, int len );
+void obe_fec_xor_avx( uint8_t *dst, const uint8_t *src, int len );
+
+#endif
@@ -34,8 +34,16 @@ struct udp_status
     hnd_t *udp_handle;
     AVFifoBuffer *fifo_data;
     AVFifoBuffer *fifo_pcr;
+    obe_muxed_data_t **muxed_data;
+    int64_t *arrival_times;
 };
 
+/* The pcr fifo only ever holds whole entries so the next one can be read in place */
+static int64_t peek_pcr( AVFifoBuffer *fifo_pcr )
+{
+    return *(int64_t*)fifo_pcr->rptr;
+}
+
 static void close_output( void *handle )
 {
     struct udp_status *status = handle;
@@ -44,8 +52,14 @@ static void close_output( void *handle )
         av_fifo_free( status->fifo_data );
     if( status->fifo_pcr )
         av_fifo_free( status->fifo_pcr );
+    if( status->muxed_data )
+        free( status->muxed_data );
+    if( status->arrival_times )
+        free( status->arrival_times );
     if( *status->udp_handle )
         udp_close( *status->udp_handle );
+    if( status->output_params->output_dst.target )
+        free( status->output_params->output_dst.target );
     free( status->output_params );
 }
 
@@ -53,99 +67,94 @@ static void *open_output( void *ptr )
 {
     obe_output_params_t *output_params = ptr;
     obe_t *h = output_params->h;
+    obe_output_t *output = output_params->output;
     struct udp_status status;
     hnd_t udp_handle = NULL;
-    int num_muxed_data = 0, buffer_frames = 0, ready = 0;
-    obe_muxed_data_t **muxed_data;
-    int64_t last_pcr = -1, last_clock = -1, delta;
+    int num_muxed_data = 0, num_pkts, num_drops = 0;
+    int64_t pacing_window = OUTPUT_PACING_WINDOW, pacing_lead = 0;
+    obe_muxed_data_t **muxed_data = NULL;
+    int64_t *arrival_times = NULL;
+    int64_t last_pcr = -1, last_clock = -1, delta, now;
+    obe_output_jitter_t jitter;
     AVFifoBuffer *fifo_data = NULL, *fifo_pcr = NULL;
-    uint8_t udp_buf[TS_PACKETS_SIZE];
-    int64_t pcrs[7];
+    uint8_t udp_buf[UDP_MAX_BATCH][TS_PACKETS_SIZE];
+    int64_t pcrs[UDP_MAX_BATCH][7];
+    obe_udp_pkt_t pkts[UDP_MAX_BATCH];
 
-    struct sched_param param = {0};
-    param.sched_priority = 99;
-    pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+    /* Everything is freed by close_output, so it goes on before the first allocation */
+    memset( &status, 0, sizeof(status) );
+    status.output_params = output_params;
+    status.udp_handle = &udp_handle;
+    pthread_cleanup_push( close_output, (void*)&status );
 
-    fifo_data = av_fifo_alloc( TS_PACKETS_SIZE );
+    fifo_data = status.fifo_data = av_fifo_alloc( TS_PACKETS_SIZE );
     if( !fifo_data )
     {
         fprintf( stderr, "[udp] Could not allocate data fifo\n" );
-        return NULL;
+        goto finish;
     }
 
-    fifo_pcr = av_fifo_alloc( 7 * sizeof(int64_t) );
+    fifo_pcr = status.fifo_pcr = av_fifo_alloc( 7 * sizeof(int64_t) );
     if( !fifo_pcr )
     {
         fprintf( stderr, "[udp] Could not allocate pcr fifo\n" );
-        return NULL;
+        goto finish;
     }
 
-    status.output_params = output_params;
-    status.udp_handle = &udp_handle;
-    status.fifo_data = fifo_data;
-    status.fifo_pcr = fifo_pcr;
-    pthread_cleanup_push( close_output, (void*)&status );
+    muxed_data = status.muxed_data = malloc( output->queue.capacity * sizeof(*muxed_data) );
+    arrival_times = status.arrival_times = malloc( output->queue.capacity * sizeof(*arrival_times) );
+    if( !muxed_data || !arrival_times )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto finish;
+    }
 
-    if( udp_open( &udp_handle, output_params->output_opts.target ) < 0 )
+    if( udp_open( &udp_handle, output_params->output_dst.target ) < 0 )
     {
         fprintf( stderr, "[udp] Could not create output\n" );
-        return NULL;
+        goto finish;
     }
 
-    buffer_frames = h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? 0 : 2;
+    obe_output_jitter_init( &jitter, h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ? OUTPUT_PREROLL_LOW_LATENCY : OUTPUT_PREROLL_GENERIC );
+
+    if( udp_is_kernel_paced( udp_handle ) )
+    {
+        pacing_window = OUTPUT_TXTIME_WINDOW;
+        pacing_lead = OUTPUT_TXTIME_LEAD;
+    }
 
     int64_t start_mpeg_time = 0, start_pcr_time = 0;
 
     while( 1 )
     {
-        pthread_mutex_lock( &h->output_mutex );
-        if( h->num_muxed_data == num_muxed_data )
-        {
-            /* Often this cond_wait is not because of an underflow */
-            pthread_cond_wait( &h->output_cv, &h->output_mutex );
-        }
-
-        num_muxed_data = h->num_muxed_data;
+        num_muxed_data = obe_output_pop_all( output, muxed_data );
+        if( num_muxed_data < 0 )
+            break;
 
-        /* Refill the buffer after a drop */
+        /* After a drop the schedule restarts from the next packet rather than refilling the buffer */
         pthread_mutex_lock( &h->drop_mutex );
-        if( h->output_drop )
+        if( h->output_drop != num_drops )
         {
-            syslog( LOG_INFO, "UDP output buffer reset\n" );
-            ready = h->output_drop = 0;
+            syslog( LOG_INFO, "UDP output resync\n" );
+            num_drops = h->output_drop;
             last_clock = -1;
+            obe_output_jitter_resync( &jitter );
         }
         pthread_mutex_unlock( &h->drop_mutex );
 
-        if( !ready )
-        {
-            if( num_muxed_data >= buffer_frames )
-                ready = 1;
-            else
-            {
-                pthread_mutex_unlock( &h->output_mutex );
-                continue;
-            }
-        }
-
-        muxed_data = malloc( num_muxed_data * sizeof(*muxed_data) );
-        if( !muxed_data )
-        {
-            pthread_mutex_unlock( &h->output_mutex );
-            syslog( LOG_ERR, "Malloc failed\n" );
-            return NULL;
-        }
-        memcpy( muxed_data, h->muxed_data, num_muxed_data * sizeof(*muxed_data) );
-        pthread_mutex_unlock( &h->output_mutex );
-
 //        printf("\n START %i \n", num_muxed_data );
 
+        now = get_input_clock_in_mpeg_ticks( h );
         for( int i = 0; i < num_muxed_data; i++ )
         {
+            /* Lateness of the first packet against the schedule without any pre-roll */
+            if( last_clock != -1 && muxed_data[i]->len )
+                obe_output_jitter_update( &jitter, muxed_data[i]->queued_time - ( muxed_data[i]->pcr_list[0] - start_pcr_time + start_mpeg_time ), now );
+
             if( av_fifo_realloc2( fifo_data, av_fifo_size( fifo_data ) + muxed_data[i]->len ) < 0 )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                goto finish;
             }
 
             av_fifo_generic_write( fifo_data, muxed_data[i]->data, muxed_data[i]->len, NULL );
@@ -153,24 +162,35 @@ static void *open_output( void *ptr )
             if( av_fifo_realloc2( fifo_pcr, av_fifo_size( fifo_pcr ) + ((muxed_data[i]->len * sizeof(int64_t)) / 188) ) < 0 )
             {
                 syslog( LOG_ERR, "Malloc failed\n" );
-                return NULL;
+                goto finish;
             }
 
             av_fifo_generic_write( fifo_pcr, muxed_data[i]->pcr_list, (muxed_data[i]->len * sizeof(int64_t)) / 188, NULL );
 
-            remove_from_output_queue( h );
+            arrival_times[i] = muxed_data[i]->arrival_time;
             destroy_muxed_data( muxed_data[i] );
         }
 
-        free( muxed_data );
-
         while( av_fifo_size( fifo_data ) >= TS_PACKETS_SIZE )
         {
-            av_fifo_generic_read( fifo_data, udp_buf, TS_PACKETS_SIZE, NULL );
-            av_fifo_generic_read( fifo_pcr, pcrs, 7 * sizeof(int64_t), NULL );
-            if( last_clock != -1 )
+            /* Take every packet that is due within the pacing window of the first one */
+            num_pkts = 0;
+            do
             {
-                delta = pcrs[0] - last_pcr;
+                av_fifo_generic_read( fifo_data, udp_buf[num_pkts], TS_PACKETS_SIZE, NULL );
+                av_fifo_generic_read( fifo_pcr, pcrs[num_pkts], 7 * sizeof(int64_t), NULL );
+                num_pkts++;
+            } while( num_pkts < UDP_MAX_BATCH && av_fifo_size( fifo_data ) >= TS_PACKETS_SIZE &&
+                     peek_pcr( fifo_pcr ) - pcrs[0][0] < pacing_window );
+
+            if( last_clock == -1 )
+            {
+                start_mpeg_time = get_input_clock_in_mpeg_ticks( h );
+                start_pcr_time = pcrs[0][0];
+            }
+            else
+            {
+                delta = pcrs[0][0] - last_pcr;
 #if 0
                 int64_t mpegtime = get_wallclock_in_mpeg_ticks();
 
@@ -179,27 +199,40 @@ static void *open_output( void *ptr )
                     printf("\n behind %f \n", (double)(last_clock + delta - mpegtime)/27000000 );
                 }
 #endif
-                sleep_input_clock( h, pcrs[0] - start_pcr_time + start_mpeg_time );
             }
 
-            if( last_clock == -1 )
+            /* The batch that (re)starts the clock waits out the pre-roll as well */
+            sleep_input_clock( h, pcrs[0][0] - start_pcr_time + start_mpeg_time + jitter.preroll - pacing_lead );
+
+            for( int i = 0; i < num_pkts; i++ )
             {
-                start_mpeg_time = get_input_clock_in_mpeg_ticks( h );
-                start_pcr_time = pcrs[0];
+                pkts[i].data = udp_buf[i];
+                pkts[i].size = TS_PACKETS_SIZE;
+                /* The batch that (re)starts the clock has no tx time so ETF doesn't drop it as late */
+                if( last_clock == -1 )
+                    pkts[i].tx_time = 0;
+                else
+                    pkts[i].tx_time = input_clock_to_wallclock( h, pcrs[i][0] - start_pcr_time + start_mpeg_time + jitter.preroll ) * 1000 / 27;
             }
 
             last_clock = get_wallclock_in_mpeg_ticks();
-            last_pcr = pcrs[0];
+            last_pcr = pcrs[num_pkts-1][0];
 
-            if( udp_write( udp_handle, udp_buf, TS_PACKETS_SIZE ) < 0 )
+            if( udp_write_batch( udp_handle, pkts, num_pkts ) < 0 )
 	    {
                 syslog( LOG_ERR, "[udp] Failed to write UDP packet\n" );
-                return NULL;
+                goto finish;
             }
+            __atomic_store_n( &output->bytes_sent, output->bytes_sent + num_pkts * TS_PACKETS_SIZE, __ATOMIC_RELAXED );
         }
+
+        /* Whatever is left in the fifo is less than one packet batch */
+        for( int i = 0; i < num_muxed_data; i++ )
+            obe_latency_record( &output->latency, arrival_times[i] );
         num_muxed_data = 0;
     }
 
+finish:
     pthread_cleanup_pop( 1 );
 
     return NULL;
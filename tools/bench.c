@@ -0,0 +1,387 @@
+/*****************************************************************************
+ * bench.c : end-to-end pipeline benchmark from recorded files
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+/* Runs a recording through the file input and the same filter, encoder, mux and output threads as obecli
+ * and reports the frame rate, the latency of each stage and the heap allocations made per frame.
+ *
+ * The allocation counters are linked in with -Wl,--wrap so they only see calls made from OBE itself,
+ * not those made inside x264 or libav. */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <libavutil/mem.h>
+
+#include "common/common.h"
+
+#define WARMUP_FRAMES 50
+#define POLL_TIME     100000
+#define IDLE_TIME     1000000
+
+/** Allocation counting **/
+static volatile int64_t num_allocs;
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t nmemb, size_t size );
+void *__real_realloc( void *ptr, size_t size );
+int   __real_posix_memalign( void **ptr, size_t align, size_t size );
+void *__real_av_malloc( size_t size );
+void *__real_av_mallocz( size_t size );
+
+static inline void count_alloc( void )
+{
+    __atomic_fetch_add( &num_allocs, 1, __ATOMIC_RELAXED );
+}
+
+void *__wrap_malloc( size_t size )
+{
+    count_alloc();
+    return __real_malloc( size );
+}
+
+void *__wrap_calloc( size_t nmemb, size_t size )
+{
+    count_alloc();
+    return __real_calloc( nmemb, size );
+}
+
+void *__wrap_realloc( void *ptr, size_t size )
+{
+    count_alloc();
+    return __real_realloc( ptr, size );
+}
+
+int __wrap_posix_memalign( void **ptr, size_t align, size_t size )
+{
+    count_alloc();
+    return __real_posix_memalign( ptr, align, size );
+}
+
+void *__wrap_av_malloc( size_t size )
+{
+    count_alloc();
+    return __real_av_malloc( size );
+}
+
+void *__wrap_av_mallocz( size_t size )
+{
+    count_alloc();
+    return __real_av_mallocz( size );
+}
+
+/** Options **/
+static const char * const video_formats[] = { "pal", "ntsc", "720p50", "720p59.94", "720p60", "1080i50", "1080i59.94", "1080i60",
+                                              "1080p23.98", "1080p24", "1080p25", "1080p29.97", "1080p30", "1080p50", "1080p59.94",
+                                              "1080p60", 0 };
+static const char * const file_formats[]  = { "v210", "yuv422p10", 0 };
+static const char * const system_types[]  = { "generic", "lowlatency", 0 };
+static const char * const audio_formats[] = { "mp2", "aac", 0 };
+
+static const char * const stage_names[] = { "filter", "encode", "smoothing", "mux", "output" };
+
+static int parse_enum( const char *name, const char * const *names )
+{
+    for( int i = 0; names[i]; i++ )
+    {
+        if( !strcasecmp( name, names[i] ) )
+            return i;
+    }
+
+    return -1;
+}
+
+static void help( void )
+{
+    printf( "Usage: obebench [options] video_file\n"
+            "\n"
+            "  --format <string>        File format: v210, yuv422p10 [v210]\n"
+            "  --video-format <string>  Video format of the recording, as in obecli [1080i50]\n"
+            "  --audio <file>           Stereo s32le 48kHz audio, silence if not given\n"
+            "  --audio-format <string>  Audio encoding: mp2, aac [mp2]\n"
+            "  --frames <int>           Frames to play, looping the file. 0 plays it once [0]\n"
+            "  --realtime               Play at the frame rate instead of as fast as possible\n"
+            "  --system <string>        System type: generic, lowlatency [generic]\n"
+            "  --bitrate <int>          Video bitrate in kbit/s [10000]\n"
+            "  --preset <string>        x264 preset to apply over the OBE defaults. Disables speedcontrol\n"
+            "  --target <string>        Output target [udp://127.0.0.1:5000]\n" );
+}
+
+/* Apply the analysis settings of an x264 preset without touching the rate control and
+ * broadcast settings OBE chose. Speedcontrol would change them again, so it is turned off */
+static int apply_preset( x264_param_t *param, const char *preset )
+{
+    x264_param_t tmp;
+
+    if( x264_param_default_preset( &tmp, preset, NULL ) < 0 )
+    {
+        fprintf( stderr, "Invalid preset %s\n", preset );
+        return -1;
+    }
+
+    param->analyse.inter = tmp.analyse.inter;
+    param->analyse.i_me_method = tmp.analyse.i_me_method;
+    param->analyse.i_me_range = tmp.analyse.i_me_range;
+    param->analyse.i_subpel_refine = tmp.analyse.i_subpel_refine;
+    param->analyse.i_trellis = tmp.analyse.i_trellis;
+    param->analyse.b_mixed_references = tmp.analyse.b_mixed_references;
+    param->analyse.i_direct_mv_pred = tmp.analyse.i_direct_mv_pred;
+    param->analyse.i_weighted_pred = tmp.analyse.i_weighted_pred;
+    param->i_frame_reference = tmp.i_frame_reference;
+    param->i_bframe_adaptive = tmp.i_bframe_adaptive;
+    param->rc.b_mb_tree = tmp.rc.b_mb_tree;
+    param->rc.i_aq_mode = tmp.rc.i_aq_mode;
+
+    param->sc.f_speed = 0;
+
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    obe_t *h = NULL;
+    obe_input_t input = {0};
+    obe_input_program_t program = {0};
+    obe_output_stream_t *output_streams = NULL;
+    obe_mux_opts_t mux_opts = {0};
+    obe_output_dst_t output_dst = {0};
+    obe_output_opts_t output_opts = {0};
+    obe_stats_t stats;
+
+    int system_type = OBE_SYSTEM_TYPE_GENERIC;
+    int audio_format = AUDIO_MP2;
+    int bitrate = 10000;
+    char *preset = NULL;
+    int ret = 1;
+
+    int64_t warm_time = 0, last_time, now;
+    int64_t warm_allocs = 0, warm_frames = 0, last_frames = 0, total_frames;
+
+    static const struct option long_options[] =
+    {
+        { "format",       required_argument, NULL, 'f' },
+        { "video-format", required_argument, NULL, 'v' },
+        { "audio",        required_argument, NULL, 'a' },
+        { "audio-format", required_argument, NULL, 'A' },
+        { "frames",       required_argument, NULL, 'n' },
+        { "realtime",     no_argument,       NULL, 'r' },
+        { "system",       required_argument, NULL, 's' },
+        { "bitrate",      required_argument, NULL, 'b' },
+        { "preset",       required_argument, NULL, 'p' },
+        { "target",       required_argument, NULL, 't' },
+        { "help",         no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    input.input_type = INPUT_FILE;
+    input.video_format = INPUT_VIDEO_FORMAT_1080I_50;
+    input.file_format = FILE_FORMAT_V210;
+    input.fast_replay = 1;
+    output_dst.type = OUTPUT_UDP;
+    output_dst.target = "udp://127.0.0.1:5000";
+
+    for( int c; ( c = getopt_long( argc, argv, "h", long_options, NULL ) ) != -1; )
+    {
+        switch( c )
+        {
+            case 'f':
+                if( ( input.file_format = parse_enum( optarg, file_formats ) ) < 0 )
+                {
+                    fprintf( stderr, "Invalid file format %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'v':
+                if( ( input.video_format = parse_enum( optarg, video_formats ) ) < 0 )
+                {
+                    fprintf( stderr, "Invalid video format %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'a':
+                input.audio_location = optarg;
+                break;
+            case 'A':
+                if( parse_enum( optarg, audio_formats ) < 0 )
+                {
+                    fprintf( stderr, "Invalid audio format %s\n", optarg );
+                    return 1;
+                }
+                audio_format = parse_enum( optarg, audio_formats ) ? AUDIO_AAC : AUDIO_MP2;
+                break;
+            case 'n':
+                input.num_frames = strtoll( optarg, NULL, 10 );
+                break;
+            case 'r':
+                input.fast_replay = 0;
+                break;
+            case 's':
+                if( ( system_type = parse_enum( optarg, system_types ) ) < 0 )
+                {
+                    fprintf( stderr, "Invalid system type %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'b':
+                bitrate = atoi( optarg );
+                break;
+            case 'p':
+                preset = optarg;
+                break;
+            case 't':
+                output_dst.target = optarg;
+                break;
+            default:
+                help();
+                return c != 'h';
+        }
+    }
+
+    if( optind >= argc )
+    {
+        help();
+        return 1;
+    }
+    input.location = argv[optind];
+
+    h = obe_setup();
+    if( !h )
+    {
+        fprintf( stderr, "obe_setup failed\n" );
+        return 1;
+    }
+
+    if( obe_set_config( h, system_type ) < 0 )
+        goto end;
+
+    if( obe_probe_device( h, &input, &program ) < 0 )
+        goto end;
+
+    output_streams = calloc( program.num_streams, sizeof(*output_streams) );
+    if( !output_streams )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+
+    for( int i = 0; i < program.num_streams; i++ )
+    {
+        obe_output_stream_t *stream = &output_streams[i];
+
+        stream->stream_id = stream->input_stream_id = program.streams[i].stream_id;
+        stream->stream_action = STREAM_ENCODE;
+
+        if( program.streams[i].stream_type == STREAM_TYPE_VIDEO )
+        {
+            stream->stream_format = VIDEO_AVC;
+            obe_populate_avc_encoder_params( h, stream->input_stream_id, &stream->avc_param );
+            stream->avc_param.rc.i_bitrate = stream->avc_param.rc.i_vbv_max_bitrate = bitrate;
+            /* One second of VBV, x264 picks the single-frame size itself in low latency mode */
+            if( system_type == OBE_SYSTEM_TYPE_GENERIC )
+                stream->avc_param.rc.i_vbv_buffer_size = bitrate;
+
+            if( preset && apply_preset( &stream->avc_param, preset ) < 0 )
+                goto end;
+        }
+        else
+        {
+            stream->stream_format = audio_format;
+            stream->bitrate = audio_format == AUDIO_MP2 ? 256 : 128;
+        }
+    }
+
+    if( obe_setup_streams( h, output_streams, program.num_streams ) < 0 )
+        goto end;
+
+    /* Leave room for the audio and the overhead of the transport stream */
+    mux_opts.ts_muxrate = ( bitrate + 1000 ) * 1100;
+    if( obe_setup_muxer( h, &mux_opts ) < 0 )
+        goto end;
+
+    output_opts.num_outputs = 1;
+    output_opts.outputs = &output_dst;
+    if( obe_setup_output( h, &output_opts ) < 0 )
+        goto end;
+
+    if( obe_start( h ) < 0 )
+        goto end;
+
+    total_frames = input.num_frames;
+    last_time = obe_mdate();
+
+    while( 1 )
+    {
+        usleep( POLL_TIME );
+        now = obe_mdate();
+
+        if( obe_get_stats( h, &stats ) < 0 )
+            goto end;
+
+        int64_t frames = stats.latency[OBE_STAGE_ENCODE].count;
+
+        if( !warm_time && frames >= WARMUP_FRAMES )
+        {
+            warm_time = now;
+            warm_frames = frames;
+            warm_allocs = __atomic_load_n( &num_allocs, __ATOMIC_RELAXED );
+        }
+
+        if( frames != last_frames )
+        {
+            last_frames = frames;
+            last_time = now;
+        }
+        /* The encoder keeps its lookahead until it is closed, so the run ends when the input has
+         * been through the filter and the encoder has stopped producing frames */
+        else if( last_frames && ( !total_frames || stats.latency[OBE_STAGE_FILTER].count >= total_frames ) &&
+                 now - last_time > IDLE_TIME )
+            break;
+    }
+
+    if( !warm_time || last_frames <= warm_frames )
+    {
+        fprintf( stderr, "Too few frames were encoded, use a longer file or --frames\n" );
+        goto end;
+    }
+
+    printf( "\n" );
+    printf( "frames:            %"PRIi64" (%i warmup)\n", last_frames, WARMUP_FRAMES );
+    printf( "fps:               %.2f\n", (double)( last_frames - warm_frames ) * 1000000 / ( last_time - warm_time ) );
+    printf( "allocs per frame:  %.2f\n", (double)( __atomic_load_n( &num_allocs, __ATOMIC_RELAXED ) - warm_allocs ) /
+                                         ( last_frames - warm_frames ) );
+    printf( "frame pool drops:  %"PRIi64"\n", stats.num_frame_pool_drops );
+    printf( "\n%-10s %10s %10s %10s %10s\n", "stage", "frames", "p50 (us)", "p99 (us)", "max (us)" );
+    for( int i = 0; i < OBE_NUM_STAGES; i++ )
+    {
+        obe_latency_stats_t *latency = &stats.latency[i];
+        printf( "%-10s %10"PRIi64" %10"PRIi64" %10"PRIi64" %10"PRIi64"\n", stage_names[i], latency->count,
+                latency->p50, latency->p99, latency->max );
+    }
+
+    ret = 0;
+
+end:
+    obe_close( h );
+    if( output_streams )
+        free( output_streams );
+
+    return ret;
+}
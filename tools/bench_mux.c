@@ -0,0 +1,1157 @@
+/*****************************************************************************
+ * bench_mux.c : mux and output benchmark with a PCR analyser
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+/* Feeds synthetic coded frames into the TS mux at the rate smoothing would and captures what the UDP
+ * or RTP output sends on loopback. Reports the CPU the mux and output threads use per Mbit, the send
+ * and sleep calls they make, the PCR accuracy, frequency offset and jitter (PCR_AC, PCR_FO and PCR_OJ
+ * of ETSI TR 101 290) and a histogram of the datagram inter-arrival times.
+ *
+ * Each pacing mode is run in its own process with the same streams so that the modes can be compared.
+ * The send and sleep calls are counted with -Wl,--wrap, the benchmark's own threads are left out. */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common/common.h"
+#include "mux/mux.h"
+#include "output/output.h"
+
+#define WARMUP_TIME     2
+#define DURATION        20
+#define DRAIN_TIME      500000
+
+#define MP2_SAMPLE_RATE 48000
+#define IFRAME_RATIO    4
+#define AVC_PROFILE     100
+#define AVC_LEVEL       40
+
+#define CAPTURE_BATCH   64
+#define CAPTURE_MTU     2048
+#define CAPTURE_RCVBUF  ( 16 << 20 )
+#define CAPTURE_TIMEOUT 100000
+
+#define TS_PACKET_SIZE  188
+#define RTP_HEADER_SIZE 12
+#define RTP_PAYLOAD_TS  33
+#define PCR_WRAP        ( ( 1LL << 33 ) * 300 )
+
+/* The limits of TR 101 290 */
+#define PCR_AC_LIMIT       500     /* ns */
+#define PCR_INTERVAL_LIMIT 40      /* ms */
+
+/* Inter-arrival times in powers of two of microseconds, the first bucket is below 1us */
+#define NUM_ARRIVAL_BUCKETS 18
+
+/** Send and sleep counting **/
+static int64_t num_sends;
+static int64_t num_sleeps;
+static __thread int is_bench_thread;
+
+ssize_t __real_sendto( int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len );
+ssize_t __real_sendmsg( int fd, const struct msghdr *msg, int flags );
+int     __real_sendmmsg( int fd, struct mmsghdr *msgs, unsigned int vlen, int flags );
+int     __real_clock_nanosleep( clockid_t clock_id, int flags, const struct timespec *req, struct timespec *rem );
+
+static inline void count_call( int64_t *counter )
+{
+    if( !is_bench_thread )
+        __atomic_fetch_add( counter, 1, __ATOMIC_RELAXED );
+}
+
+ssize_t __wrap_sendto( int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len )
+{
+    count_call( &num_sends );
+    return __real_sendto( fd, buf, len, flags, addr, addr_len );
+}
+
+ssize_t __wrap_sendmsg( int fd, const struct msghdr *msg, int flags )
+{
+    count_call( &num_sends );
+    return __real_sendmsg( fd, msg, flags );
+}
+
+int __wrap_sendmmsg( int fd, struct mmsghdr *msgs, unsigned int vlen, int flags )
+{
+    count_call( &num_sends );
+    return __real_sendmmsg( fd, msgs, vlen, flags );
+}
+
+int __wrap_clock_nanosleep( clockid_t clock_id, int flags, const struct timespec *req, struct timespec *rem )
+{
+    count_call( &num_sleeps );
+    return __real_clock_nanosleep( clock_id, flags, req, rem );
+}
+
+/** Options **/
+static const char * const system_types[] = { "generic", "lowlatency", 0 };
+static const char * const output_types[] = { "udp", "rtp", 0 };
+
+/* How the output spaces its datagrams. Everything but the first is an option of the udp target */
+static const struct
+{
+    const char *name;
+    const char *url_opts;
+} pacing_modes[] =
+{
+    { "sleep",  "" },           /* clock_nanosleep before each batch, then sendmmsg */
+    { "gso",    "?gso=1" },     /* the same schedule, each batch coalesced with UDP_SEGMENT */
+    { "txtime", "?txtime=1" },  /* the kernel launches each datagram with SO_TXTIME */
+    { 0, 0 }
+};
+
+typedef struct
+{
+    int system_type;
+    int output_type;
+    int port;
+    int bitrate;        /* kbit/s */
+    int audio_pids;
+    int audio_bitrate;  /* kbit/s */
+    int muxrate;        /* bit/s */
+    int fps_num;
+    int fps_den;
+    int keyint;
+    int pcr_period;
+    int internal_packetizer;
+    int warmup;
+    int duration;
+} bench_opts_t;
+
+/* What a run sends back to the parent for the comparison */
+typedef struct
+{
+    int ok;
+    double mux_cpu;     /* us per Mbit */
+    double output_cpu;  /* us per Mbit */
+    double sends;       /* per second */
+    double sleeps;      /* per second */
+    double pcr_ac_max;  /* ns */
+    double pcr_oj_pp;   /* us */
+    double pcr_fo;      /* ppm */
+    double pcr_interval_max; /* ms */
+    int64_t cc_errors;
+} bench_result_t;
+
+static int parse_enum( const char *name, const char * const *names )
+{
+    for( int i = 0; names[i]; i++ )
+    {
+        if( !strcasecmp( name, names[i] ) )
+            return i;
+    }
+
+    return -1;
+}
+
+static int parse_pacing_mode( const char *name, int len )
+{
+    for( int i = 0; pacing_modes[i].name; i++ )
+    {
+        if( strlen( pacing_modes[i].name ) == len && !strncasecmp( name, pacing_modes[i].name, len ) )
+            return i;
+    }
+
+    return -1;
+}
+
+static void help( void )
+{
+    printf( "Usage: obebench-mux [options]\n"
+            "\n"
+            "  --bitrate <int>          Video bitrate in kbit/s [10000]\n"
+            "  --audio-pids <int>       Number of MP2 audio PIDs [1]\n"
+            "  --audio-bitrate <int>    Bitrate of each audio PID in kbit/s [192]\n"
+            "  --muxrate <int>          Transport stream rate in kbit/s. 0 leaves 10%% for overhead [0]\n"
+            "  --frame-rate <num[/den]> Video frame rate [25]\n"
+            "  --keyint <int>           Frames between the larger I-frames [50]\n"
+            "  --pcr-period <int>       PCR period in ms. 0 is the libmpegts default [0]\n"
+            "  --internal-packetizer    Use the internal packetizer instead of libmpegts\n"
+            "  --system <string>        System type: generic, lowlatency [generic]\n"
+            "  --output <string>        Output: udp, rtp [udp]\n"
+            "  --port <int>             Loopback port to capture on [5000]\n"
+            "  --pacing <list>          Comma separated pacing modes to compare: sleep, gso, txtime [sleep]\n"
+            "  --warmup <int>           Seconds before measuring [%i]\n"
+            "  --duration <int>         Seconds to measure [%i]\n", WARMUP_TIME, DURATION );
+}
+
+/** Capture **/
+enum capture_state_e
+{
+    CAPTURE_WARMUP,
+    CAPTURE_MEASURE,
+    CAPTURE_STOP,
+};
+
+typedef struct
+{
+    int64_t index;   /* TS packet number since the capture started */
+    int64_t pcr;     /* 27MHz, unwrapped */
+    int64_t arrival; /* ns */
+} pcr_sample_t;
+
+typedef struct
+{
+    int fd;
+    int is_rtp;
+    int state;
+
+    int64_t num_packets;
+    int64_t num_bytes;
+    int64_t num_datagrams;
+    int64_t num_bad_datagrams;
+    int64_t sync_errors;
+    int64_t cc_errors;
+    int64_t last_arrival;
+    int64_t arrival_hist[NUM_ARRIVAL_BUCKETS];
+    uint8_t cc[8192];
+
+    int pcr_pid;
+    int64_t last_pcr;
+    pcr_sample_t *pcrs;
+    int num_pcrs;
+    int max_pcrs;
+
+    uint8_t bufs[CAPTURE_BATCH][CAPTURE_MTU];
+    char control[CAPTURE_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+} capture_t;
+
+static int open_capture( capture_t *cap, int port )
+{
+    struct sockaddr_in addr = {0};
+    struct timeval timeout = { 0, CAPTURE_TIMEOUT };
+    int on = 1, rcvbuf = CAPTURE_RCVBUF;
+
+    cap->fd = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( cap->fd < 0 )
+    {
+        fprintf( stderr, "Could not create capture socket\n" );
+        return -1;
+    }
+
+    /* The kernel receive timestamps keep the scheduling of this thread out of the arrival times */
+    setsockopt( cap->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+    setsockopt( cap->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf) );
+    setsockopt( cap->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    if( setsockopt( cap->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on) ) < 0 )
+    {
+        fprintf( stderr, "Kernel receive timestamps are not supported\n" );
+        return -1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( bind( cap->fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0 )
+    {
+        fprintf( stderr, "Could not bind capture socket to port %i\n", port );
+        return -1;
+    }
+
+    memset( cap->cc, 0xff, sizeof(cap->cc) );
+    cap->pcr_pid = -1;
+    cap->last_pcr = -1;
+
+    return 0;
+}
+
+static int add_pcr_sample( capture_t *cap, int64_t pcr, int64_t arrival )
+{
+    if( cap->num_pcrs == cap->max_pcrs )
+    {
+        int max_pcrs = cap->max_pcrs ? cap->max_pcrs * 2 : 4096;
+        pcr_sample_t *tmp = realloc( cap->pcrs, max_pcrs * sizeof(*cap->pcrs) );
+        if( !tmp )
+            return -1;
+        cap->pcrs = tmp;
+        cap->max_pcrs = max_pcrs;
+    }
+
+    cap->pcrs[cap->num_pcrs].index = cap->num_packets;
+    cap->pcrs[cap->num_pcrs].pcr = pcr;
+    cap->pcrs[cap->num_pcrs].arrival = arrival;
+    cap->num_pcrs++;
+
+    return 0;
+}
+
+static void parse_ts_packet( capture_t *cap, uint8_t *pkt, int64_t arrival, int measure )
+{
+    int pid, afc, cc, last_cc;
+    int64_t pcr;
+
+    if( pkt[0] != 0x47 )
+    {
+        cap->sync_errors++;
+        return;
+    }
+
+    pid = ( ( pkt[1] & 0x1f ) << 8 ) | pkt[2];
+    afc = ( pkt[3] >> 4 ) & 3;
+    cc = pkt[3] & 0xf;
+
+    /* Only packets with a payload advance the counter, a repeat is allowed once */
+    if( pid != 0x1fff && ( afc & 1 ) )
+    {
+        last_cc = cap->cc[pid];
+        if( last_cc != 0xff && cc != ( ( last_cc + 1 ) & 0xf ) && cc != last_cc && measure )
+            cap->cc_errors++;
+        cap->cc[pid] = cc;
+    }
+
+    if( ( afc & 2 ) && pkt[4] >= 7 && ( pkt[5] & 0x10 ) )
+    {
+        /* The first PID seen with a PCR is the one that is analysed */
+        if( cap->pcr_pid == -1 )
+            cap->pcr_pid = pid;
+
+        if( pid == cap->pcr_pid )
+        {
+            pcr = ( (int64_t)pkt[6] << 25 | pkt[7] << 17 | pkt[8] << 9 | pkt[9] << 1 | pkt[10] >> 7 ) * 300 +
+                  ( ( pkt[10] & 1 ) << 8 | pkt[11] );
+            if( cap->last_pcr != -1 )
+            {
+                while( pcr < cap->last_pcr - PCR_WRAP / 2 )
+                    pcr += PCR_WRAP;
+            }
+            cap->last_pcr = pcr;
+
+            if( measure && add_pcr_sample( cap, pcr, arrival ) < 0 )
+                fprintf( stderr, "Malloc failed\n" );
+        }
+    }
+}
+
+static void parse_datagram( capture_t *cap, uint8_t *data, int len, int64_t arrival )
+{
+    int measure = __atomic_load_n( &cap->state, __ATOMIC_ACQUIRE ) == CAPTURE_MEASURE;
+    int64_t delta;
+    int bucket, header_size;
+
+    if( cap->is_rtp )
+    {
+        /* RTCP comes to the same port */
+        if( len < RTP_HEADER_SIZE || ( data[0] >> 6 ) != 2 || ( data[1] & 0x7f ) != RTP_PAYLOAD_TS )
+            return;
+        header_size = RTP_HEADER_SIZE + ( data[0] & 0xf ) * 4;
+        data += header_size;
+        len -= header_size;
+    }
+
+    if( len <= 0 || len % TS_PACKET_SIZE )
+    {
+        cap->num_bad_datagrams++;
+        return;
+    }
+
+    if( measure )
+    {
+        if( cap->last_arrival )
+        {
+            delta = ( arrival - cap->last_arrival ) / 1000;
+            for( bucket = 0; bucket < NUM_ARRIVAL_BUCKETS - 1 && delta >= ( 1LL << bucket ); bucket++ )
+                ;
+            cap->arrival_hist[bucket]++;
+        }
+        cap->num_datagrams++;
+        cap->num_bytes += len;
+    }
+    cap->last_arrival = arrival;
+
+    for( int i = 0; i < len; i += TS_PACKET_SIZE )
+    {
+        parse_ts_packet( cap, &data[i], arrival, measure );
+        cap->num_packets++;
+    }
+}
+
+static int64_t get_arrival_time( struct msghdr *msg )
+{
+    struct timespec ts;
+
+    for( struct cmsghdr *cmsg = CMSG_FIRSTHDR( msg ); cmsg; cmsg = CMSG_NXTHDR( msg, cmsg ) )
+    {
+        if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS )
+        {
+            memcpy( &ts, CMSG_DATA( cmsg ), sizeof(ts) );
+            return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+    }
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *capture_thread( void *ptr )
+{
+    capture_t *cap = ptr;
+    struct mmsghdr msgs[CAPTURE_BATCH];
+    struct iovec iovs[CAPTURE_BATCH];
+    int num_msgs;
+
+    is_bench_thread = 1;
+
+    while( __atomic_load_n( &cap->state, __ATOMIC_ACQUIRE ) != CAPTURE_STOP )
+    {
+        memset( msgs, 0, sizeof(msgs) );
+        for( int i = 0; i < CAPTURE_BATCH; i++ )
+        {
+            iovs[i].iov_base = cap->bufs[i];
+            iovs[i].iov_len = CAPTURE_MTU;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = cap->control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(cap->control[i]);
+        }
+
+        num_msgs = recvmmsg( cap->fd, msgs, CAPTURE_BATCH, MSG_WAITFORONE, NULL );
+        if( num_msgs < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+                continue;
+            fprintf( stderr, "Capture failed: %s\n", strerror( errno ) );
+            break;
+        }
+
+        for( int i = 0; i < num_msgs; i++ )
+            parse_datagram( cap, cap->bufs[i], msgs[i].msg_len, get_arrival_time( &msgs[i].msg_hdr ) );
+    }
+
+    return NULL;
+}
+
+/** PCR analysis **/
+/* Least squares fit of y = a + b*x */
+static void fit_line( const double *x, const double *y, int n, double *a, double *b )
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for( int i = 0; i < n; i++ )
+    {
+        sx += x[i];
+        sy += y[i];
+        sxx += x[i] * x[i];
+        sxy += x[i] * y[i];
+    }
+
+    *b = n > 1 && n * sxx != sx * sx ? ( n * sxy - sx * sy ) / ( n * sxx - sx * sx ) : 0;
+    *a = n ? ( sy - *b * sx ) / n : 0;
+}
+
+/* PCR_AC is the error of each PCR against its position in a constant rate stream and PCR_OJ the error
+ * of its arrival against the PCR. The rates are fitted rather than taken from the options so the
+ * frequency offset of the loopback clock shows up as PCR_FO instead of as jitter. */
+static int analyse_pcrs( capture_t *cap, bench_result_t *result, double *measured_rate, double *pcr_ac_rms, double *pcr_oj_max )
+{
+    pcr_sample_t *pcrs = cap->pcrs;
+    int n = cap->num_pcrs;
+    double *x, *y, a, b, err, min_oj = 0, max_oj = 0, sum_ac = 0;
+
+    if( n < 2 )
+    {
+        fprintf( stderr, "Too few PCRs were captured\n" );
+        return -1;
+    }
+
+    x = malloc( n * sizeof(*x) );
+    y = malloc( n * sizeof(*y) );
+    if( !x || !y )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( x );
+        free( y );
+        return -1;
+    }
+
+    for( int i = 0; i < n; i++ )
+    {
+        x[i] = pcrs[i].index - pcrs[0].index;
+        y[i] = pcrs[i].pcr - pcrs[0].pcr;
+    }
+    fit_line( x, y, n, &a, &b );
+    *measured_rate = b > 0 ? TS_PACKET_SIZE * 8 * (double)OBE_CLOCK / b : 0;
+
+    result->pcr_ac_max = 0;
+    for( int i = 0; i < n; i++ )
+    {
+        err = ( y[i] - a - b * x[i] ) * 1000 / 27;
+        result->pcr_ac_max = MAX( result->pcr_ac_max, fabs( err ) );
+        sum_ac += err * err;
+    }
+    *pcr_ac_rms = sqrt( sum_ac / n );
+
+    result->pcr_interval_max = 0;
+    for( int i = 1; i < n; i++ )
+        result->pcr_interval_max = MAX( result->pcr_interval_max, ( pcrs[i].pcr - pcrs[i-1].pcr ) / 27000.0 );
+
+    for( int i = 0; i < n; i++ )
+    {
+        x[i] = pcrs[i].pcr - pcrs[0].pcr;
+        y[i] = ( pcrs[i].arrival - pcrs[0].arrival ) * 27 / 1000.0;
+    }
+    fit_line( x, y, n, &a, &b );
+    result->pcr_fo = ( b - 1 ) * 1e6;
+
+    for( int i = 0; i < n; i++ )
+    {
+        err = ( y[i] - a - b * x[i] ) / 27;
+        min_oj = MIN( min_oj, err );
+        max_oj = MAX( max_oj, err );
+    }
+    result->pcr_oj_pp = max_oj - min_oj;
+    *pcr_oj_max = MAX( max_oj, -min_oj );
+
+    free( x );
+    free( y );
+
+    return 0;
+}
+
+/** Setup **/
+/* One program with a video PID and the audio PIDs, passed through so no encoder is needed */
+static int setup_streams( obe_t *h, bench_opts_t *opts )
+{
+    obe_output_stream_t output_streams[MAX_STREAMS] = {{0}};
+    obe_int_input_stream_t *input_stream;
+    obe_device_t *device;
+    int num_streams = 1 + opts->audio_pids;
+
+    device = new_device();
+    if( !device )
+        return -1;
+
+    for( int i = 0; i < num_streams; i++ )
+    {
+        input_stream = device->streams[i] = calloc( 1, sizeof(*input_stream) );
+        if( !input_stream )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            destroy_device( device );
+            return -1;
+        }
+        device->num_input_streams++;
+
+        input_stream->stream_id = i;
+        if( !i )
+        {
+            input_stream->stream_type = STREAM_TYPE_VIDEO;
+            input_stream->stream_format = VIDEO_AVC;
+            input_stream->profile = AVC_PROFILE;
+            input_stream->level = AVC_LEVEL;
+            input_stream->width = 1920;
+            input_stream->height = 1080;
+            input_stream->timebase_num = opts->fps_den;
+            input_stream->timebase_den = opts->fps_num;
+        }
+        else
+        {
+            input_stream->stream_type = STREAM_TYPE_AUDIO;
+            input_stream->stream_format = AUDIO_MP2;
+            input_stream->sample_rate = MP2_SAMPLE_RATE;
+        }
+
+        output_streams[i].stream_id = output_streams[i].input_stream_id = i;
+        output_streams[i].stream_action = STREAM_PASSTHROUGH;
+        output_streams[i].ts_opts.frames_per_pes = 1;
+    }
+    device->device_type = INPUT_URL;
+    h->cur_stream_id = num_streams;
+    add_device( h, device );
+
+    return obe_setup_streams( h, output_streams, num_streams );
+}
+
+/* The part of obe_start that opens the queues, the output and the mux */
+static int start_mux( obe_t *h )
+{
+    obe_output_params_t *out_params;
+    obe_mux_params_t *mux_params;
+    int queue_depth;
+
+    pthread_mutex_init( &h->drop_mutex, NULL );
+    pthread_mutex_init( &h->smoothing_mutex, NULL );
+    pthread_cond_init( &h->smoothing_in_cv, NULL );
+    pthread_cond_init( &h->smoothing_out_cv, NULL );
+    obe_clock_init( &h->clock );
+    pthread_mutex_init( &h->mux_mutex, NULL );
+    pthread_cond_init( &h->mux_cv, NULL );
+    if( obe_buf_pool_init( &h->buf_pool, h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ?
+                           OBE_BUF_POOL_SIZE_LOW_LATENCY : OBE_BUF_POOL_SIZE_GENERIC ) < 0 )
+        return -1;
+
+    queue_depth = OBE_QUEUE_MAX_FRAME_RATE * ( h->obe_system == OBE_SYSTEM_TYPE_LOW_LATENCY ?
+                  OBE_QUEUE_SECONDS_LOW_LATENCY : OBE_QUEUE_SECONDS_GENERIC );
+
+    if( obe_queue_init( &h->smoothing_queue, "smoothing", queue_depth, 0 ) < 0 )
+        return -1;
+
+    h->mux_queues = calloc( h->num_output_streams, sizeof(*h->mux_queues) );
+    if( !h->mux_queues )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < h->num_output_streams; i++ )
+    {
+        if( obe_queue_init( &h->mux_queues[i], "mux", queue_depth, 0 ) < 0 )
+            return -1;
+    }
+
+    h->outputs[0] = calloc( 1, sizeof(obe_output_t) );
+    out_params = calloc( 1, sizeof(*out_params) );
+    if( !h->outputs[0] || !out_params )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( out_params );
+        return -1;
+    }
+    pthread_mutex_init( &h->outputs[0]->output_mutex, NULL );
+    pthread_cond_init( &h->outputs[0]->output_cv, NULL );
+    h->num_outputs = 1;
+
+    if( obe_queue_init( &h->outputs[0]->queue, "output", queue_depth, 0 ) < 0 )
+    {
+        free( out_params );
+        return -1;
+    }
+
+    memcpy( &out_params->output_dst, &h->output_opts.outputs[0], sizeof(out_params->output_dst) );
+    out_params->output_dst.target = strdup( h->output_opts.outputs[0].target );
+    out_params->h = h;
+    out_params->output = h->outputs[0];
+    if( !out_params->output_dst.target )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( out_params );
+        return -1;
+    }
+
+    if( obe_thread_create( h, &h->outputs[0]->output_thread, OBE_THREAD_OUTPUT, -1,
+                           h->output_opts.outputs[0].type == OUTPUT_RTP ? rtp_output.open_output : udp_output.open_output,
+                           (void*)out_params ) < 0 )
+    {
+        fprintf( stderr, "Couldn't create output thread\n" );
+        return -1;
+    }
+
+    mux_params = calloc( 1, sizeof(*mux_params) );
+    if( !mux_params )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+    mux_params->h = h;
+    mux_params->device = h->devices[0];
+    mux_params->num_output_streams = h->num_output_streams;
+    mux_params->output_streams = h->output_streams;
+
+    if( obe_thread_create( h, &h->mux_thread, OBE_THREAD_MUX, -1, ts_muxer.open_muxer, (void*)mux_params ) < 0 )
+    {
+        fprintf( stderr, "Couldn't create mux thread\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Feeding **/
+static int64_t get_thread_cpu( pthread_t thread )
+{
+    struct timespec ts;
+    clockid_t clock_id;
+
+    if( pthread_getcpuclockid( thread, &clock_id ) || clock_gettime( clock_id, &ts ) < 0 )
+        return 0;
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct
+{
+    int64_t time;
+    int64_t mux_cpu;
+    int64_t output_cpu;
+    int64_t sends;
+    int64_t sleeps;
+} bench_snapshot_t;
+
+static void take_snapshot( obe_t *h, bench_snapshot_t *snapshot )
+{
+    snapshot->time = obe_mdate();
+    snapshot->mux_cpu = get_thread_cpu( h->mux_thread );
+    snapshot->output_cpu = get_thread_cpu( h->outputs[0]->output_thread );
+    snapshot->sends = __atomic_load_n( &num_sends, __ATOMIC_RELAXED );
+    snapshot->sleeps = __atomic_load_n( &num_sleeps, __ATOMIC_RELAXED );
+}
+
+/* Video frames are queued at their dts as smoothing would. Their HRD arrival times follow the bits
+ * at the video bitrate, with an I-frame of IFRAME_RATIO times the average size every keyint frames.
+ * The audio is queued as soon as it is due, ahead of the video it goes with */
+static int feed_frames( obe_t *h, bench_opts_t *opts, capture_t *cap, bench_snapshot_t *start, bench_snapshot_t *end )
+{
+    obe_coded_frame_t *coded_frames[MAX_STREAMS];
+    int64_t video_duration = OBE_CLOCK * opts->fps_den / opts->fps_num;
+    int64_t audio_duration = MP2_NUM_SAMPLES * OBE_CLOCK / MP2_SAMPLE_RATE;
+    int64_t warmup_time = (int64_t)opts->warmup * OBE_CLOCK;
+    int64_t end_time = warmup_time + (int64_t)opts->duration * OBE_CLOCK;
+    int64_t base = OBE_CLOCK, video_time = 0, audio_time = 0, next_time, start_time;
+    int64_t avg_size = (int64_t)opts->bitrate * 125 * video_duration / OBE_CLOCK;
+    int64_t i_size = opts->keyint > 1 ? avg_size * IFRAME_RATIO : avg_size;
+    int64_t p_size = opts->keyint > 1 ? ( avg_size * opts->keyint - i_size ) / ( opts->keyint - 1 ) : avg_size;
+    int64_t audio_size = (int64_t)MP2_NUM_SAMPLES * opts->audio_bitrate * 125 / MP2_SAMPLE_RATE;
+    int64_t cpb_delay = MAX( OBE_CLOCK / 2, ( IFRAME_RATIO + 1 ) * video_duration );
+    int64_t video_bits = 0;
+    int64_t num_video_frames = 0;
+    int measuring = 0;
+    static const uint8_t aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+
+    if( p_size < (int64_t)sizeof(aud) )
+    {
+        fprintf( stderr, "Video bitrate is too low for a keyint of %i\n", opts->keyint );
+        return -1;
+    }
+
+    is_bench_thread = 1;
+    start_time = get_input_clock_in_mpeg_ticks( h );
+
+    while( video_time < end_time )
+    {
+        next_time = MIN( video_time, audio_time );
+        sleep_input_clock( h, start_time + next_time );
+
+        if( !measuring && next_time >= warmup_time )
+        {
+            take_snapshot( h, start );
+            __atomic_store_n( &cap->state, CAPTURE_MEASURE, __ATOMIC_RELEASE );
+            measuring = 1;
+        }
+
+        if( audio_time <= video_time )
+        {
+            for( int i = 0; i < opts->audio_pids; i++ )
+            {
+                coded_frames[i] = new_pooled_coded_frame( h, 1 + i, audio_size );
+                if( !coded_frames[i] )
+                {
+                    fprintf( stderr, "Malloc failed\n" );
+                    return -1;
+                }
+                memset( coded_frames[i]->data, 0xff, audio_size );
+                coded_frames[i]->pts = base + audio_time;
+                coded_frames[i]->random_access = 1;
+            }
+
+            int num_queued = add_frames_to_mux_queue( h, coded_frames, opts->audio_pids );
+            for( int i = num_queued; i < opts->audio_pids; i++ )
+                destroy_coded_frame( coded_frames[i] );
+
+            audio_time += audio_duration;
+        }
+        else
+        {
+            int64_t size = num_video_frames % opts->keyint ? p_size : i_size;
+            obe_coded_frame_t *coded_frame = new_pooled_coded_frame( h, 0, size );
+            if( !coded_frame )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
+            }
+            memcpy( coded_frame->data, aud, sizeof(aud) );
+            memset( coded_frame->data + sizeof(aud), 0xff, size - sizeof(aud) );
+
+            coded_frame->is_video = 1;
+            coded_frame->pts = base + video_time;
+            coded_frame->cpb_initial_arrival_time = base + video_bits * OBE_CLOCK / ( opts->bitrate * 1000LL );
+            video_bits += size * 8;
+            coded_frame->cpb_final_arrival_time = base + video_bits * OBE_CLOCK / ( opts->bitrate * 1000LL );
+            coded_frame->real_dts = coded_frame->real_pts = base + cpb_delay + video_time;
+            coded_frame->random_access = coded_frame->priority = !( num_video_frames % opts->keyint );
+            coded_frame->arrival_time = obe_mdate();
+
+            if( add_to_mux_queue( h, coded_frame ) < 0 )
+                destroy_coded_frame( coded_frame );
+
+            num_video_frames++;
+            video_time += video_duration;
+        }
+    }
+
+    take_snapshot( h, end );
+    __atomic_store_n( &cap->state, CAPTURE_STOP, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+/** Report **/
+static void print_histogram( capture_t *cap )
+{
+    int64_t total = 0;
+
+    for( int i = 0; i < NUM_ARRIVAL_BUCKETS; i++ )
+        total += cap->arrival_hist[i];
+
+    printf( "\n%-22s %12s %8s\n", "inter-arrival", "datagrams", "%" );
+    for( int i = 0; i < NUM_ARRIVAL_BUCKETS; i++ )
+    {
+        char range[32];
+
+        if( !cap->arrival_hist[i] )
+            continue;
+
+        if( !i )
+            snprintf( range, sizeof(range), "< 1 us" );
+        else if( i == NUM_ARRIVAL_BUCKETS - 1 )
+            snprintf( range, sizeof(range), ">= %lli us", 1LL << ( i - 1 ) );
+        else
+            snprintf( range, sizeof(range), "%lli - %lli us", 1LL << ( i - 1 ), 1LL << i );
+
+        printf( "%-22s %12"PRIi64" %8.2f\n", range, cap->arrival_hist[i], 100.0 * cap->arrival_hist[i] / total );
+    }
+}
+
+static int run_mode( bench_opts_t *opts, int mode, bench_result_t *result )
+{
+    obe_t *h = NULL;
+    obe_mux_opts_t mux_opts = {0};
+    obe_output_dst_t output_dst = {0};
+    obe_output_opts_t output_opts = {0};
+    bench_snapshot_t start, end;
+    capture_t *cap;
+    pthread_t cap_thread;
+    char target[256];
+    double mbits, seconds, measured_rate, pcr_ac_rms, pcr_oj_max;
+    int ret = -1, cap_started = 0;
+
+    cap = calloc( 1, sizeof(*cap) );
+    if( !cap )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+    cap->is_rtp = opts->output_type == OUTPUT_RTP;
+    if( open_capture( cap, opts->port ) < 0 )
+        goto end;
+
+    snprintf( target, sizeof(target), "%s://127.0.0.1:%i%s", output_types[opts->output_type - OUTPUT_UDP],
+              opts->port, pacing_modes[mode].url_opts );
+
+    h = obe_setup();
+    if( !h )
+    {
+        fprintf( stderr, "obe_setup failed\n" );
+        goto end;
+    }
+
+    if( obe_set_config( h, opts->system_type ) < 0 || setup_streams( h, opts ) < 0 )
+        goto end;
+
+    mux_opts.cbr = 1;
+    mux_opts.ts_muxrate = opts->muxrate;
+    mux_opts.pcr_period = opts->pcr_period;
+    mux_opts.internal_packetizer = opts->internal_packetizer;
+    if( obe_setup_muxer( h, &mux_opts ) < 0 )
+        goto end;
+
+    output_dst.type = opts->output_type;
+    output_dst.target = target;
+    output_opts.num_outputs = 1;
+    output_opts.outputs = &output_dst;
+    if( obe_setup_output( h, &output_opts ) < 0 )
+        goto end;
+
+    if( pthread_create( &cap_thread, NULL, capture_thread, cap ) )
+    {
+        fprintf( stderr, "Couldn't create capture thread\n" );
+        goto end;
+    }
+    cap_started = 1;
+
+    if( start_mux( h ) < 0 )
+        goto end;
+
+    if( feed_frames( h, opts, cap, &start, &end ) < 0 )
+        goto end;
+
+    /* Let the output send what the mux still holds so the last PCRs aren't cut off */
+    usleep( DRAIN_TIME );
+    pthread_join( cap_thread, NULL );
+    cap_started = 0;
+
+    mbits = cap->num_bytes * 8 / 1e6;
+    seconds = ( end.time - start.time ) / 1e6;
+    if( mbits <= 0 || seconds <= 0 || analyse_pcrs( cap, result, &measured_rate, &pcr_ac_rms, &pcr_oj_max ) < 0 )
+    {
+        fprintf( stderr, "Nothing was received from %s\n", target );
+        goto end;
+    }
+
+    result->mux_cpu = ( end.mux_cpu - start.mux_cpu ) / 1000.0 / mbits;
+    result->output_cpu = ( end.output_cpu - start.output_cpu ) / 1000.0 / mbits;
+    result->sends = ( end.sends - start.sends ) / seconds;
+    result->sleeps = ( end.sleeps - start.sleeps ) / seconds;
+    result->cc_errors = cap->cc_errors;
+    result->ok = 1;
+
+    printf( "\n" );
+    printf( "pacing:            %s (%s)\n", pacing_modes[mode].name, target );
+    printf( "muxrate:           %.3f Mbit/s, %.3f measured from the PCRs\n", opts->muxrate / 1e6, measured_rate / 1e6 );
+    printf( "received:          %.2f Mbit in %.2f s, %"PRIi64" datagrams\n", mbits, seconds, cap->num_datagrams );
+    printf( "errors:            %"PRIi64" continuity, %"PRIi64" sync, %"PRIi64" bad datagrams\n",
+            cap->cc_errors, cap->sync_errors, cap->num_bad_datagrams );
+    printf( "mux cpu:           %.1f us per Mbit\n", result->mux_cpu );
+    printf( "output cpu:        %.1f us per Mbit\n", result->output_cpu );
+    printf( "send calls:        %.1f per second, %.2f datagrams each\n", result->sends,
+            result->sends ? cap->num_datagrams / seconds / result->sends : 0 );
+    printf( "sleep calls:       %.1f per second\n", result->sleeps );
+    printf( "PCRs:              %i on PID %i, longest interval %.2f ms (limit %i)\n", cap->num_pcrs, cap->pcr_pid,
+            result->pcr_interval_max, PCR_INTERVAL_LIMIT );
+    printf( "PCR_AC:            %.0f ns max, %.0f ns rms (limit %i) %s\n", result->pcr_ac_max, pcr_ac_rms, PCR_AC_LIMIT,
+            result->pcr_ac_max <= PCR_AC_LIMIT ? "ok" : "FAIL" );
+    printf( "PCR_FO:            %.3f ppm\n", result->pcr_fo );
+    printf( "PCR_OJ:            %.1f us peak to peak, %.1f us max\n", result->pcr_oj_pp, pcr_oj_max );
+    print_histogram( cap );
+
+    ret = 0;
+
+end:
+    if( cap_started )
+    {
+        __atomic_store_n( &cap->state, CAPTURE_STOP, __ATOMIC_RELEASE );
+        pthread_join( cap_thread, NULL );
+    }
+    if( h )
+        obe_close( h );
+    if( cap->fd > 0 )
+        close( cap->fd );
+    free( cap->pcrs );
+    free( cap );
+
+    return ret;
+}
+
+/* Each mode gets a fresh process. The outputs are never stopped, only the process exiting ends them,
+ * so a run can't leave threads behind for the next one */
+static int run_mode_process( bench_opts_t *opts, int mode, bench_result_t *result )
+{
+    int fds[2], status;
+    pid_t pid;
+
+    memset( result, 0, sizeof(*result) );
+
+    if( pipe( fds ) < 0 )
+    {
+        fprintf( stderr, "Could not create pipe\n" );
+        return -1;
+    }
+
+    fflush( stdout );
+    pid = fork();
+    if( pid < 0 )
+    {
+        fprintf( stderr, "Could not fork\n" );
+        close( fds[0] );
+        close( fds[1] );
+        return -1;
+    }
+
+    if( !pid )
+    {
+        close( fds[0] );
+        run_mode( opts, mode, result );
+        fflush( stdout );
+        if( write( fds[1], result, sizeof(*result) ) != sizeof(*result) )
+            _exit( 1 );
+        _exit( 0 );
+    }
+
+    close( fds[1] );
+    if( read( fds[0], result, sizeof(*result) ) != sizeof(*result) )
+        memset( result, 0, sizeof(*result) );
+    close( fds[0] );
+    waitpid( pid, &status, 0 );
+
+    return result->ok ? 0 : -1;
+}
+
+int main( int argc, char **argv )
+{
+    bench_opts_t opts = {0};
+    bench_result_t results[sizeof(pacing_modes) / sizeof(pacing_modes[0])];
+    int modes[sizeof(pacing_modes) / sizeof(pacing_modes[0])];
+    int num_modes = 0, muxrate = 0, ret = 0;
+    const char *pacing = "sleep";
+    char *end;
+
+    static const struct option long_options[] =
+    {
+        { "bitrate",             required_argument, NULL, 'b' },
+        { "audio-pids",          required_argument, NULL, 'a' },
+        { "audio-bitrate",       required_argument, NULL, 'A' },
+        { "muxrate",             required_argument, NULL, 'm' },
+        { "frame-rate",          required_argument, NULL, 'f' },
+        { "keyint",              required_argument, NULL, 'k' },
+        { "pcr-period",          required_argument, NULL, 'P' },
+        { "internal-packetizer", no_argument,       NULL, 'i' },
+        { "system",              required_argument, NULL, 's' },
+        { "output",              required_argument, NULL, 'o' },
+        { "port",                required_argument, NULL, 'p' },
+        { "pacing",              required_argument, NULL, 'c' },
+        { "warmup",              required_argument, NULL, 'w' },
+        { "duration",            required_argument, NULL, 'd' },
+        { "help",                no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    opts.system_type = OBE_SYSTEM_TYPE_GENERIC;
+    opts.output_type = OUTPUT_UDP;
+    opts.port = 5000;
+    opts.bitrate = 10000;
+    opts.audio_pids = 1;
+    opts.audio_bitrate = 192;
+    opts.fps_num = 25;
+    opts.fps_den = 1;
+    opts.keyint = 50;
+    opts.warmup = WARMUP_TIME;
+    opts.duration = DURATION;
+
+    for( int c; ( c = getopt_long( argc, argv, "h", long_options, NULL ) ) != -1; )
+    {
+        switch( c )
+        {
+            case 'b':
+                opts.bitrate = atoi( optarg );
+                break;
+            case 'a':
+                opts.audio_pids = atoi( optarg );
+                break;
+            case 'A':
+                opts.audio_bitrate = atoi( optarg );
+                break;
+            case 'm':
+                muxrate = atoi( optarg );
+                break;
+            case 'f':
+                opts.fps_num = strtol( optarg, &end, 10 );
+                opts.fps_den = *end == '/' ? strtol( end + 1, NULL, 10 ) : 1;
+                break;
+            case 'k':
+                opts.keyint = atoi( optarg );
+                break;
+            case 'P':
+                opts.pcr_period = atoi( optarg );
+                break;
+            case 'i':
+                opts.internal_packetizer = 1;
+                break;
+            case 's':
+                if( ( opts.system_type = parse_enum( optarg, system_types ) ) < 0 )
+                {
+                    fprintf( stderr, "Invalid system type %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'o':
+                if( parse_enum( optarg, output_types ) < 0 )
+                {
+                    fprintf( stderr, "Invalid output %s\n", optarg );
+                    return 1;
+                }
+                opts.output_type = OUTPUT_UDP + parse_enum( optarg, output_types );
+                break;
+            case 'p':
+                opts.port = atoi( optarg );
+                break;
+            case 'c':
+                pacing = optarg;
+                break;
+            case 'w':
+                opts.warmup = atoi( optarg );
+                break;
+            case 'd':
+                opts.duration = atoi( optarg );
+                break;
+            default:
+                help();
+                return c != 'h';
+        }
+    }
+
+    if( opts.bitrate <= 0 || opts.audio_pids < 0 || opts.audio_pids >= MAX_STREAMS || opts.audio_bitrate <= 0 ||
+        opts.fps_num <= 0 || opts.fps_den <= 0 || opts.keyint <= 0 || opts.warmup < 0 || opts.duration <= 0 ||
+        opts.port <= 0 || opts.port > 65535 )
+    {
+        fprintf( stderr, "Invalid options\n" );
+        help();
+        return 1;
+    }
+
+    for( const char *p = pacing; *p; )
+    {
+        int len = strcspn( p, "," );
+        int mode = parse_pacing_mode( p, len );
+
+        if( mode < 0 || num_modes == sizeof(modes) / sizeof(modes[0]) )
+        {
+            fprintf( stderr, "Invalid pacing mode %.*s\n", len, p );
+            return 1;
+        }
+        modes[num_modes++] = mode;
+        p += len + !!p[len];
+    }
+
+    /* Leave room for the PES and TS headers and the tables */
+    opts.muxrate = muxrate ? muxrate * 1000 : ( opts.bitrate + opts.audio_pids * opts.audio_bitrate ) * 1100;
+
+    for( int i = 0; i < num_modes; i++ )
+    {
+        if( run_mode_process( &opts, modes[i], &results[i] ) < 0 )
+        {
+            fprintf( stderr, "Pacing mode %s failed\n", pacing_modes[modes[i]].name );
+            ret = 1;
+        }
+    }
+
+    if( num_modes > 1 )
+    {
+        printf( "\n%-8s %10s %10s %10s %10s %10s %10s %10s %8s\n", "pacing", "mux us/Mb", "out us/Mb", "sends/s",
+                "sleeps/s", "AC ns", "OJ us p-p", "FO ppm", "cc err" );
+        for( int i = 0; i < num_modes; i++ )
+        {
+            bench_result_t *r = &results[i];
+
+            if( !r->ok )
+                printf( "%-8s %10s\n", pacing_modes[modes[i]].name, "failed" );
+            else
+                printf( "%-8s %10.1f %10.1f %10.1f %10.1f %10.0f %10.1f %10.3f %8"PRIi64"\n", pacing_modes[modes[i]].name,
+                        r->mux_cpu, r->output_cpu, r->sends, r->sleeps, r->pcr_ac_max, r->pcr_oj_pp, r->pcr_fo, r->cc_errors );
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,880 @@
+/*****************************************************************************
+ * checkasm.c : check the assembly kernels against C and benchmark them
+ *****************************************************************************
+ * Copyright (C) 2010 Open Broadcast Systems Ltd.
+ *
+ * Authors: Kieran Kunhya <kieran@kunhya.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include <inttypes.h>
+#include "common/common.h"
+#include "input/sdi/sdi.h"
+#include "input/sdi/x86/sdi.h"
+#include "filters/video/dither.h"
+#include "filters/video/x86/vfilter.h"
+#include "output/rtp/x86/fec.h"
+#include "filters/audio/x86/337m.h"
+#include "encoders/audio/x86/convert.h"
+#include "filters/audio/x86/audio.h"
+#include "common/crc.h"
+#include "common/x86/crc.h"
+
+/* Widest line any kernel is run on. Buffers are padded because the SIMD
+ * versions round the width up to their step and read and write past it */
+#define MAX_WIDTH  4096
+#define BUF_PAD    128
+#define BUF_SIZE   (MAX_WIDTH * 8 + BUF_PAD)
+
+#define NUM_RUNS   32
+#define BENCH_RUNS 2000
+#define BENCH_WIDTH 1920
+
+typedef struct
+{
+    const char *name;
+    int cpu;        /* AV_CPU_FLAG_* needed, 0 for C */
+    int step;       /* width must be a multiple of this */
+    void *func;
+} checkasm_func_t;
+
+typedef struct
+{
+    const char *name;
+    int (*check)( const checkasm_func_t *ref, const checkasm_func_t *func );
+    void (*bench)( const checkasm_func_t *func, int width );
+    const char *unit;   /* what one "pixel" of the cycle count is */
+    checkasm_func_t funcs[6];
+} checkasm_kernel_t;
+
+static int cpu_flags;
+static int do_bench;
+
+static uint8_t *buf_src[2];
+static uint8_t *buf_ref;
+static uint8_t *buf_out;
+
+/** Timing **/
+static inline uint64_t read_time( void )
+{
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+    uint32_t lo, hi;
+    asm volatile( "lfence\nrdtsc" : "=a"(lo), "=d"(hi) :: "memory" );
+    return (uint64_t)hi << 32 | lo;
+#else
+    return obe_mdate();
+#endif
+}
+
+/* Each sample times four calls so the timer overhead is mostly amortised. The fastest sample is
+ * reported as the others are mostly interrupts and cache misses */
+#define BENCH( call )\
+do\
+{\
+    uint64_t best = UINT64_MAX;\
+    for( int r = 0; r < BENCH_RUNS; r++ )\
+    {\
+        uint64_t t = read_time();\
+        call; call; call; call;\
+        t = read_time() - t;\
+        if( t < best )\
+            best = t;\
+    }\
+    report_bench( func, best / 4, width );\
+} while( 0 )
+
+static void report_bench( const checkasm_func_t *func, uint64_t cycles, int width )
+{
+    printf( "    %-18s %8"PRIu64" cycles %7.3f cycles/px\n", func->name, cycles, (double)cycles / width );
+}
+
+/** Inputs **/
+static void fill_10bit( uint16_t *dst, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] = rand() & 0x3ff;
+}
+
+static void fill_v210( uint32_t *dst, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] = (uint32_t)(rand() & 0x3ff) | (uint32_t)(rand() & 0x3ff) << 10 | (uint32_t)(rand() & 0x3ff) << 20;
+}
+
+static void fill_8bit( uint8_t *dst, int len )
+{
+    for( int i = 0; i < len; i++ )
+        dst[i] = rand();
+}
+
+/* Random width up to MAX_WIDTH, usually not a multiple of the vector size */
+static int random_width( int max )
+{
+    return 1 + rand() % max;
+}
+
+static int round_width( int width, int step )
+{
+    return MAX( width / step * step, step );
+}
+
+static int report_fail( const checkasm_func_t *func, int width, int pos )
+{
+    fprintf( stderr, "    %s FAILED at width %i, first mismatch at %i\n", func->name, width, pos );
+    return -1;
+}
+
+/* Fills the outputs with different garbage so untouched samples can't match by accident */
+static void clear_outputs( int len )
+{
+    memset( buf_ref, 0xaa, len );
+    memset( buf_out, 0x55, len );
+}
+
+static int compare_16( const checkasm_func_t *func, uint16_t *ref, uint16_t *out, int len, int width )
+{
+    for( int i = 0; i < len; i++ )
+        if( ref[i] != out[i] )
+            return report_fail( func, width, i );
+    return 0;
+}
+
+static int compare_8( const checkasm_func_t *func, uint8_t *ref, uint8_t *out, int len, int width )
+{
+    for( int i = 0; i < len; i++ )
+        if( ref[i] != out[i] )
+            return report_fail( func, width, i );
+    return 0;
+}
+
+/** downscale_line **/
+typedef void (*downscale_line_func_t)( uint16_t *src, uint8_t *dst, int lines );
+
+static int check_downscale_line( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int lines = 1 + rand() % 2;
+        int len = lines * 720 * 2;
+
+        fill_10bit( (uint16_t*)buf_src[0], len );
+        clear_outputs( len );
+        ((downscale_line_func_t)ref->func)( (uint16_t*)buf_src[0], buf_ref, lines );
+        ((downscale_line_func_t)func->func)( (uint16_t*)buf_src[0], buf_out, lines );
+        if( compare_8( func, buf_ref, buf_out, len, lines ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_downscale_line( const checkasm_func_t *func, int width )
+{
+    width = 720 * 2;
+    BENCH( ((downscale_line_func_t)func->func)( (uint16_t*)buf_src[0], buf_out, 1 ) );
+}
+
+/** anc_flag_scan **/
+typedef int (*anc_flag_scan_func_t)( const uint16_t *src, int len );
+
+static int check_anc_flag_scan( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    uint16_t *src = (uint16_t*)buf_src[0];
+
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int len = round_width( random_width( MAX_WIDTH ), func->step );
+
+        /* Blanking with a flag word planted in half of the runs */
+        for( int j = 0; j < len; j++ )
+            src[j] = rand() % 0x3fc;
+        if( i & 1 )
+            src[rand() % len] = 0x3fc + ( rand() & 3 );
+
+        if( !((anc_flag_scan_func_t)ref->func)( src, len ) != !((anc_flag_scan_func_t)func->func)( src, len ) )
+            return report_fail( func, len, 0 );
+    }
+    return 0;
+}
+
+static void bench_anc_flag_scan( const checkasm_func_t *func, int width )
+{
+    fill_10bit( (uint16_t*)buf_src[0], width );
+    for( int i = 0; i < width; i++ )
+        ((uint16_t*)buf_src[0])[i] &= 0x1ff;
+    BENCH( ((anc_flag_scan_func_t)func->func)( (uint16_t*)buf_src[0], width ) );
+}
+
+/** v210_planar_unpack **/
+typedef void (*v210_unpack_func_t)( const uint32_t *src, uint16_t *y, uint16_t *u, uint16_t *v, int width );
+
+static int check_v210_unpack_src( const checkasm_func_t *ref, const checkasm_func_t *func, const uint32_t *src )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+        uint16_t *ref_y = (uint16_t*)buf_ref, *ref_u = ref_y + MAX_WIDTH + BUF_PAD, *ref_v = ref_u + MAX_WIDTH/2 + BUF_PAD;
+        uint16_t *out_y = (uint16_t*)buf_out, *out_u = out_y + MAX_WIDTH + BUF_PAD, *out_v = out_u + MAX_WIDTH/2 + BUF_PAD;
+
+        fill_v210( (uint32_t*)buf_src[0], MAX_WIDTH * 2 / 3 + BUF_PAD / 4 );
+        clear_outputs( BUF_SIZE );
+        ((v210_unpack_func_t)ref->func)( src, ref_y, ref_u, ref_v, width );
+        ((v210_unpack_func_t)func->func)( src, out_y, out_u, out_v, width );
+        if( compare_16( func, ref_y, out_y, width, width ) < 0 ||
+            compare_16( func, ref_u, out_u, width / 2, width ) < 0 ||
+            compare_16( func, ref_v, out_v, width / 2, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static int check_v210_unpack_aligned( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    return check_v210_unpack_src( ref, func, (uint32_t*)buf_src[0] );
+}
+
+/* Decklink lines are not aligned so read from an odd dword */
+static int check_v210_unpack_unaligned( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    return check_v210_unpack_src( ref, func, (uint32_t*)buf_src[0] + 1 );
+}
+
+static void bench_v210_unpack( const checkasm_func_t *func, int width )
+{
+    uint16_t *y = (uint16_t*)buf_out, *u = y + MAX_WIDTH + BUF_PAD, *v = u + MAX_WIDTH/2 + BUF_PAD;
+    BENCH( ((v210_unpack_func_t)func->func)( (uint32_t*)buf_src[0], y, u, v, width ) );
+}
+
+/** v210_planar_unpack_8bit **/
+typedef void (*v210_unpack_8bit_func_t)( const uint32_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width, const uint16_t *dither );
+
+static int check_v210_unpack_8bit( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+        const uint16_t *dither = obe_dithers[i&7];
+        uint8_t *ref_y = buf_ref, *ref_u = ref_y + MAX_WIDTH + BUF_PAD, *ref_v = ref_u + MAX_WIDTH/2 + BUF_PAD;
+        uint8_t *out_y = buf_out, *out_u = out_y + MAX_WIDTH + BUF_PAD, *out_v = out_u + MAX_WIDTH/2 + BUF_PAD;
+
+        fill_v210( (uint32_t*)buf_src[0], MAX_WIDTH * 2 / 3 + BUF_PAD / 4 );
+        clear_outputs( BUF_SIZE );
+        ((v210_unpack_8bit_func_t)ref->func)( (uint32_t*)buf_src[0], ref_y, ref_u, ref_v, width, dither );
+        ((v210_unpack_8bit_func_t)func->func)( (uint32_t*)buf_src[0], out_y, out_u, out_v, width, dither );
+        if( compare_8( func, ref_y, out_y, width, width ) < 0 ||
+            compare_8( func, ref_u, out_u, width / 2, width ) < 0 ||
+            compare_8( func, ref_v, out_v, width / 2, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_v210_unpack_8bit( const checkasm_func_t *func, int width )
+{
+    uint8_t *y = buf_out, *u = y + MAX_WIDTH + BUF_PAD, *v = u + MAX_WIDTH/2 + BUF_PAD;
+    BENCH( ((v210_unpack_8bit_func_t)func->func)( (uint32_t*)buf_src[0], y, u, v, width, obe_dithers[0] ) );
+}
+
+/** Vertical filters: line_avg_10 and chroma_420_*_10 **/
+typedef void (*vfilter_10_func_t)( uint16_t *a, uint16_t *b, uint16_t *dst, int width );
+
+static int check_vfilter_10( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+
+        fill_10bit( (uint16_t*)buf_src[0], MAX_WIDTH + BUF_PAD / 2 );
+        fill_10bit( (uint16_t*)buf_src[1], MAX_WIDTH + BUF_PAD / 2 );
+        clear_outputs( BUF_SIZE );
+        ((vfilter_10_func_t)ref->func)( (uint16_t*)buf_src[0], (uint16_t*)buf_src[1], (uint16_t*)buf_ref, width );
+        ((vfilter_10_func_t)func->func)( (uint16_t*)buf_src[0], (uint16_t*)buf_src[1], (uint16_t*)buf_out, width );
+        if( compare_16( func, (uint16_t*)buf_ref, (uint16_t*)buf_out, width, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_vfilter_10( const checkasm_func_t *func, int width )
+{
+    BENCH( ((vfilter_10_func_t)func->func)( (uint16_t*)buf_src[0], (uint16_t*)buf_src[1], (uint16_t*)buf_out, width ) );
+}
+
+/** Vertical filters with dither: line_avg_10_to_8 and chroma_420_*_8 **/
+typedef void (*vfilter_8_func_t)( uint16_t *a, uint16_t *b, uint8_t *dst, int width, const uint16_t *dither );
+
+static int check_vfilter_8( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+        const uint16_t *dither = obe_dithers[i&7];
+
+        fill_10bit( (uint16_t*)buf_src[0], MAX_WIDTH + BUF_PAD / 2 );
+        fill_10bit( (uint16_t*)buf_src[1], MAX_WIDTH + BUF_PAD / 2 );
+        clear_outputs( BUF_SIZE );
+        ((vfilter_8_func_t)ref->func)( (uint16_t*)buf_src[0], (uint16_t*)buf_src[1], buf_ref, width, dither );
+        ((vfilter_8_func_t)func->func)( (uint16_t*)buf_src[0], (uint16_t*)buf_src[1], buf_out, width, dither );
+        if( compare_8( func, buf_ref, buf_out, width, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_vfilter_8( const checkasm_func_t *func, int width )
+{
+    BENCH( ((vfilter_8_func_t)func->func)( (uint16_t*)buf_src[0], (uint16_t*)buf_src[1], buf_out, width, obe_dithers[0] ) );
+}
+
+/** dither_row_10_to_8 **/
+typedef void (*dither_row_func_t)( uint16_t *src, uint8_t *dst, const uint16_t *dither, int width, int stride );
+
+/* The video filter passes the full picture width so any width has to work */
+static int check_dither_row( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+        const uint16_t *dither = obe_dithers[i&7];
+
+        fill_10bit( (uint16_t*)buf_src[0], MAX_WIDTH + BUF_PAD / 2 );
+        clear_outputs( BUF_SIZE );
+        ((dither_row_func_t)ref->func)( (uint16_t*)buf_src[0], buf_ref, dither, width, width * 2 );
+        ((dither_row_func_t)func->func)( (uint16_t*)buf_src[0], buf_out, dither, width, width * 2 );
+        if( compare_8( func, buf_ref, buf_out, width, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_dither_row( const checkasm_func_t *func, int width )
+{
+    BENCH( ((dither_row_func_t)func->func)( (uint16_t*)buf_src[0], buf_out, obe_dithers[0], width, width * 2 ) );
+}
+
+typedef void (*dither_plane_func_t)( uint16_t *src, intptr_t src_stride, uint8_t *dst, intptr_t dst_stride, int width, int height, int y );
+
+/* Rows are padded to 16 pixels past the width, as frame pools do, and the first row isn't always line 0 */
+static int check_dither_plane( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH / 4 ), func->step );
+        int stride = FFALIGN( width, 16 ) + 16;
+        int height = 1 + rand() % 8;
+        int y = rand();
+
+        fill_10bit( (uint16_t*)buf_src[0], stride * height );
+        clear_outputs( stride * height );
+        ((dither_plane_func_t)ref->func)( (uint16_t*)buf_src[0], stride * 2, buf_ref, stride, width, height, y );
+        ((dither_plane_func_t)func->func)( (uint16_t*)buf_src[0], stride * 2, buf_out, stride, width, height, y );
+        for( int j = 0; j < height; j++ )
+            if( compare_8( func, buf_ref + j * stride, buf_out + j * stride, width, width ) < 0 )
+                return -1;
+    }
+    return 0;
+}
+
+/* Four rows of a quarter of the width so the cycles per pixel compare with dither_row */
+static void bench_dither_plane( const checkasm_func_t *func, int width )
+{
+    int row = width / 4;
+    int stride = FFALIGN( row, 16 );
+    BENCH( ((dither_plane_func_t)func->func)( (uint16_t*)buf_src[0], stride * 2, buf_out, stride, row, 4, 0 ) );
+}
+
+/** deinterlace_line **/
+typedef void (*deinterlace_8_func_t)( uint8_t *dst, const uint8_t *cur, const uint8_t *prev, intptr_t stride, int width );
+typedef void (*deinterlace_10_func_t)( uint16_t *dst, const uint16_t *cur, const uint16_t *prev, intptr_t stride, int width );
+
+/* The previous frame matches in about half the samples so both the woven and the interpolated
+ * paths are taken. Rows are padded past the width as frame pools do */
+static void fill_deinterlace( int len, int pixel_size )
+{
+    if( pixel_size == 2 )
+    {
+        uint16_t *cur = (uint16_t*)buf_src[0], *prev = (uint16_t*)buf_src[1];
+        fill_10bit( cur, len );
+        fill_10bit( prev, len );
+        for( int i = 0; i < len; i++ )
+            if( rand() & 1 )
+                prev[i] = cur[i];
+    }
+    else
+    {
+        fill_8bit( buf_src[0], len );
+        fill_8bit( buf_src[1], len );
+        for( int i = 0; i < len; i++ )
+            if( rand() & 1 )
+                buf_src[1][i] = buf_src[0][i];
+    }
+}
+
+static int check_deinterlace_8( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+        int stride = FFALIGN( width, 32 ) + 32;
+
+        fill_deinterlace( stride * 3, 1 );
+        clear_outputs( stride );
+        ((deinterlace_8_func_t)ref->func)( buf_ref, buf_src[0] + stride, buf_src[1] + stride, stride, width );
+        ((deinterlace_8_func_t)func->func)( buf_out, buf_src[0] + stride, buf_src[1] + stride, stride, width );
+        if( compare_8( func, buf_ref, buf_out, width, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_deinterlace_8( const checkasm_func_t *func, int width )
+{
+    int stride = FFALIGN( width, 32 );
+    BENCH( ((deinterlace_8_func_t)func->func)( buf_out, buf_src[0] + stride, buf_src[1] + stride, stride, width ) );
+}
+
+static int check_deinterlace_10( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int width = round_width( random_width( MAX_WIDTH ), func->step );
+        int stride = FFALIGN( width, 16 ) + 16;
+        uint16_t *cur = (uint16_t*)buf_src[0] + stride, *prev = (uint16_t*)buf_src[1] + stride;
+
+        fill_deinterlace( stride * 3, 2 );
+        clear_outputs( stride * 2 );
+        ((deinterlace_10_func_t)ref->func)( (uint16_t*)buf_ref, cur, prev, stride * 2, width );
+        ((deinterlace_10_func_t)func->func)( (uint16_t*)buf_out, cur, prev, stride * 2, width );
+        if( compare_16( func, (uint16_t*)buf_ref, (uint16_t*)buf_out, width, width ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_deinterlace_10( const checkasm_func_t *func, int width )
+{
+    int stride = FFALIGN( width, 16 );
+    BENCH( ((deinterlace_10_func_t)func->func)( (uint16_t*)buf_out, (uint16_t*)buf_src[0] + stride,
+                                                (uint16_t*)buf_src[1] + stride, stride * 2, width ) );
+}
+
+/** fec_xor **/
+typedef void (*fec_xor_func_t)( uint8_t *dst, const uint8_t *src, int len );
+
+/* The payload comes straight from the packet so it is read unaligned */
+static int check_fec_xor( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int len = round_width( random_width( MAX_WIDTH ), func->step );
+
+        fill_8bit( buf_src[0], len + 1 );
+        fill_8bit( buf_ref, len );
+        memcpy( buf_out, buf_ref, len );
+        ((fec_xor_func_t)ref->func)( buf_ref, buf_src[0] + 1, len );
+        ((fec_xor_func_t)func->func)( buf_out, buf_src[0] + 1, len );
+        if( compare_8( func, buf_ref, buf_out, len, len ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_fec_xor( const checkasm_func_t *func, int width )
+{
+    BENCH( ((fec_xor_func_t)func->func)( buf_out, buf_src[0] + 1, width ) );
+}
+
+/** find_337m_sync **/
+typedef int (*find_337m_sync_func_t)( const int32_t *samples, int num_frames );
+
+static const uint32_t sync_337m[][2] =
+{
+    { 0xf8720000, 0x4e1f0000 },
+    { 0x6f872000, 0x54e1f000 },
+    { 0x96f87200, 0xa54e1f00 },
+};
+
+/* Plants a lone Pa, then a sync with random low bits which sometimes mixes word lengths */
+static int check_find_337m_sync( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    int32_t *samples = (int32_t*)buf_src[0];
+
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int num_frames = round_width( random_width( MAX_WIDTH ), func->step );
+        int pa = rand() % 3, pb = rand() & 1 ? pa : rand() % 3;
+        int frame = rand() % num_frames, lone = rand() % num_frames;
+
+        fill_8bit( buf_src[0], num_frames * 8 );
+        samples[2*lone] = sync_337m[rand() % 3][0];
+        if( rand() & 3 )
+        {
+            samples[2*frame]   = sync_337m[pa][0] | ( rand() & ~sync_337m[2][0] & 0xff );
+            samples[2*frame+1] = sync_337m[pb][1] | ( rand() & ~sync_337m[2][1] & 0xff );
+        }
+
+        int ref_pos = ((find_337m_sync_func_t)ref->func)( samples, num_frames );
+        int pos = ((find_337m_sync_func_t)func->func)( samples, num_frames );
+        if( ref_pos != pos )
+            return report_fail( func, num_frames, ref_pos );
+    }
+    return 0;
+}
+
+/* Nothing to find so the whole buffer is searched */
+static void bench_find_337m_sync( const checkasm_func_t *func, int width )
+{
+    memset( buf_src[0], 0, width * 8 );
+    BENCH( ((find_337m_sync_func_t)func->func)( (int32_t*)buf_src[0], width ) );
+}
+
+/** audio sample conversion **/
+typedef void (*s32_to_flt_func_t)( float *dst, const int32_t *src, int len );
+typedef void (*s32_to_s16_func_t)( int16_t *dst, const int32_t *src, int len );
+typedef void (*s32_to_fltp_2ch_func_t)( float *dst0, float *dst1, const int32_t *src, int num_frames );
+typedef void (*s32_to_s16p_2ch_func_t)( int16_t *dst0, int16_t *dst1, const int32_t *src, int num_frames );
+
+/* The float versions have to be bit exact because the scale is a power of two */
+static int check_s32_to_flt( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int len = round_width( random_width( MAX_WIDTH ), func->step );
+
+        fill_8bit( buf_src[0], len * 4 );
+        clear_outputs( len * 4 );
+        ((s32_to_flt_func_t)ref->func)( (float*)buf_ref, (int32_t*)buf_src[0], len );
+        ((s32_to_flt_func_t)func->func)( (float*)buf_out, (int32_t*)buf_src[0], len );
+        if( compare_8( func, buf_ref, buf_out, len * 4, len ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_s32_to_flt( const checkasm_func_t *func, int width )
+{
+    BENCH( ((s32_to_flt_func_t)func->func)( (float*)buf_out, (int32_t*)buf_src[0], width ) );
+}
+
+static int check_s32_to_s16( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int len = round_width( random_width( MAX_WIDTH ), func->step );
+
+        fill_8bit( buf_src[0], len * 4 );
+        clear_outputs( len * 2 );
+        ((s32_to_s16_func_t)ref->func)( (int16_t*)buf_ref, (int32_t*)buf_src[0], len );
+        ((s32_to_s16_func_t)func->func)( (int16_t*)buf_out, (int32_t*)buf_src[0], len );
+        if( compare_16( func, (uint16_t*)buf_ref, (uint16_t*)buf_out, len, len ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_s32_to_s16( const checkasm_func_t *func, int width )
+{
+    BENCH( ((s32_to_s16_func_t)func->func)( (int16_t*)buf_out, (int32_t*)buf_src[0], width ) );
+}
+
+static int check_s32_to_fltp_2ch( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int num_frames = round_width( random_width( MAX_WIDTH ), func->step );
+
+        fill_8bit( buf_src[0], num_frames * 8 );
+        clear_outputs( num_frames * 8 );
+        ((s32_to_fltp_2ch_func_t)ref->func)( (float*)buf_ref, (float*)buf_ref + num_frames, (int32_t*)buf_src[0], num_frames );
+        ((s32_to_fltp_2ch_func_t)func->func)( (float*)buf_out, (float*)buf_out + num_frames, (int32_t*)buf_src[0], num_frames );
+        if( compare_8( func, buf_ref, buf_out, num_frames * 8, num_frames ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_s32_to_fltp_2ch( const checkasm_func_t *func, int width )
+{
+    BENCH( ((s32_to_fltp_2ch_func_t)func->func)( (float*)buf_out, (float*)buf_out + width, (int32_t*)buf_src[0], width ) );
+}
+
+static int check_s32_to_s16p_2ch( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int num_frames = round_width( random_width( MAX_WIDTH ), func->step );
+
+        fill_8bit( buf_src[0], num_frames * 8 );
+        clear_outputs( num_frames * 4 );
+        ((s32_to_s16p_2ch_func_t)ref->func)( (int16_t*)buf_ref, (int16_t*)buf_ref + num_frames, (int32_t*)buf_src[0], num_frames );
+        ((s32_to_s16p_2ch_func_t)func->func)( (int16_t*)buf_out, (int16_t*)buf_out + num_frames, (int32_t*)buf_src[0], num_frames );
+        if( compare_16( func, (uint16_t*)buf_ref, (uint16_t*)buf_out, num_frames * 2, num_frames ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_s32_to_s16p_2ch( const checkasm_func_t *func, int width )
+{
+    BENCH( ((s32_to_s16p_2ch_func_t)func->func)( (int16_t*)buf_out, (int16_t*)buf_out + width, (int32_t*)buf_src[0], width ) );
+}
+
+/** audio channel routing **/
+typedef void (*deinterleave_4ch_func_t)( int32_t *dst, int plane_stride, const int32_t *src, int src_channels, int num_frames );
+
+/* Captures are 4, 8 or 16 channels wide */
+static int check_deinterleave_4ch( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int src_channels = 4 << ( rand() % 3 );
+        int num_frames = round_width( random_width( MAX_WIDTH / 8 ), func->step );
+
+        fill_8bit( buf_src[0], num_frames * src_channels * 4 );
+        clear_outputs( num_frames * 16 );
+        ((deinterleave_4ch_func_t)ref->func)( (int32_t*)buf_ref, num_frames, (int32_t*)buf_src[0], src_channels, num_frames );
+        ((deinterleave_4ch_func_t)func->func)( (int32_t*)buf_out, num_frames, (int32_t*)buf_src[0], src_channels, num_frames );
+        if( compare_8( func, buf_ref, buf_out, num_frames * 16, num_frames ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+static void bench_deinterleave_4ch( const checkasm_func_t *func, int width )
+{
+    BENCH( ((deinterleave_4ch_func_t)func->func)( (int32_t*)buf_out, width, (int32_t*)buf_src[0], 4, width ) );
+}
+
+/** crc32_mpeg **/
+/* The C version's table is set up by obe_crc_init. Sections are read from wherever they were written so unaligned */
+static int check_crc32_mpeg( const checkasm_func_t *ref, const checkasm_func_t *func )
+{
+    obe_crc_t crc;
+    obe_crc_init( &crc );
+
+    for( int i = 0; i < NUM_RUNS; i++ )
+    {
+        int len = round_width( random_width( MAX_WIDTH ), func->step );
+        uint32_t init = (uint32_t)rand() << 16 ^ rand();
+
+        fill_8bit( buf_src[0], len + 1 );
+        if( ((obe_crc32_func_t)ref->func)( init, buf_src[0] + 1, len ) != ((obe_crc32_func_t)func->func)( init, buf_src[0] + 1, len ) )
+            return report_fail( func, len, 0 );
+    }
+    return 0;
+}
+
+static void bench_crc32_mpeg( const checkasm_func_t *func, int width )
+{
+    obe_crc_t crc;
+    obe_crc_init( &crc );
+    BENCH( ((obe_crc32_func_t)func->func)( 0xffffffff, buf_src[0] + 1, width ) );
+}
+
+/* The C version of each kernel comes first and is the reference for the rest */
+static const checkasm_kernel_t kernels[] =
+{
+    { "downscale_line", check_downscale_line, bench_downscale_line, "sample",
+      { { "c",    0, 1, obe_downscale_line_c },
+        { "mmx",  AV_CPU_FLAG_MMX,  1, obe_downscale_line_mmx },
+        { "sse2", AV_CPU_FLAG_SSE2, 1, obe_downscale_line_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 1, obe_downscale_line_avx2 } } },
+    { "anc_flag_scan", check_anc_flag_scan, bench_anc_flag_scan, "sample",
+      { { "c",    0, 1, obe_anc_flag_scan_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8,  obe_anc_flag_scan_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 16, obe_anc_flag_scan_avx2 } } },
+    { "v210_planar_unpack_aligned", check_v210_unpack_aligned, bench_v210_unpack, "pixel",
+      { { "c",     0, 6, obe_v210_planar_unpack_c },
+        { "ssse3", AV_CPU_FLAG_SSSE3, 6,  obe_v210_planar_unpack_aligned_ssse3 },
+        { "avx",   AV_CPU_FLAG_AVX,   6,  obe_v210_planar_unpack_aligned_avx },
+        { "avx2",  AV_CPU_FLAG_AVX2,  12, obe_v210_planar_unpack_avx2 } } },
+    { "v210_planar_unpack_unaligned", check_v210_unpack_unaligned, bench_v210_unpack, "pixel",
+      { { "c",     0, 6, obe_v210_planar_unpack_c },
+        { "ssse3", AV_CPU_FLAG_SSSE3, 6,  obe_v210_planar_unpack_unaligned_ssse3 },
+        { "avx",   AV_CPU_FLAG_AVX,   6,  obe_v210_planar_unpack_unaligned_avx },
+        { "avx2",  AV_CPU_FLAG_AVX2,  12, obe_v210_planar_unpack_avx2 } } },
+    { "v210_planar_unpack_8bit", check_v210_unpack_8bit, bench_v210_unpack_8bit, "pixel",
+      { { "c",    0, 6, obe_v210_planar_unpack_8bit_c },
+        { "avx2", AV_CPU_FLAG_AVX2, 12, obe_v210_planar_unpack_8bit_avx2 } } },
+    { "line_avg_10", check_vfilter_10, bench_vfilter_10, "pixel",
+      { { "c",    0, 1, obe_line_avg_10_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_line_avg_10_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 8, obe_line_avg_10_avx2 } } },
+    { "line_avg_10_to_8", check_vfilter_8, bench_vfilter_8, "pixel",
+      { { "c",    0, 1, obe_line_avg_10_to_8_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_line_avg_10_to_8_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 8, obe_line_avg_10_to_8_avx2 } } },
+    { "dither_row_10_to_8", check_dither_row, bench_dither_row, "pixel",
+      { { "c",    0, 1, obe_dither_row_10_to_8_c },
+        { "sse4", AV_CPU_FLAG_SSE4, 1, obe_dither_row_10_to_8_sse4 },
+        { "avx",  AV_CPU_FLAG_AVX,  1, obe_dither_row_10_to_8_avx } } },
+    { "dither_plane_10_to_8", check_dither_plane, bench_dither_plane, "pixel",
+      { { "c",    0, 1, obe_dither_plane_10_to_8_c },
+#if ARCH_X86_64
+        { "avx2", AV_CPU_FLAG_AVX2, 1, obe_dither_plane_10_to_8_avx2 },
+#endif
+      } },
+    { "chroma_420_progressive_10", check_vfilter_10, bench_vfilter_10, "pixel",
+      { { "c",    0, 1, obe_chroma_420_progressive_10_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_chroma_420_progressive_10_sse2 },
+        { "avx",  AV_CPU_FLAG_AVX,  8, obe_chroma_420_progressive_10_avx } } },
+    { "chroma_420_interlaced_10", check_vfilter_10, bench_vfilter_10, "pixel",
+      { { "c",    0, 1, obe_chroma_420_interlaced_10_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_chroma_420_interlaced_10_sse2 },
+        { "avx",  AV_CPU_FLAG_AVX,  8, obe_chroma_420_interlaced_10_avx } } },
+    { "chroma_420_progressive_8", check_vfilter_8, bench_vfilter_8, "pixel",
+      { { "c",    0, 1, obe_chroma_420_progressive_8_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_chroma_420_progressive_8_sse2 },
+        { "avx",  AV_CPU_FLAG_AVX,  8, obe_chroma_420_progressive_8_avx } } },
+    { "chroma_420_interlaced_8", check_vfilter_8, bench_vfilter_8, "pixel",
+      { { "c",    0, 1, obe_chroma_420_interlaced_8_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_chroma_420_interlaced_8_sse2 },
+        { "avx",  AV_CPU_FLAG_AVX,  8, obe_chroma_420_interlaced_8_avx } } },
+    { "deinterlace_line_8", check_deinterlace_8, bench_deinterlace_8, "pixel",
+      { { "c",    0, 1, obe_deinterlace_line_8_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 1, obe_deinterlace_line_8_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 1, obe_deinterlace_line_8_avx2 } } },
+    { "deinterlace_line_10", check_deinterlace_10, bench_deinterlace_10, "pixel",
+      { { "c",    0, 1, obe_deinterlace_line_10_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 1, obe_deinterlace_line_10_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 1, obe_deinterlace_line_10_avx2 } } },
+    { "fec_xor", check_fec_xor, bench_fec_xor, "byte",
+      { { "c",    0, 32, obe_fec_xor_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 32, obe_fec_xor_sse2 },
+        { "avx",  AV_CPU_FLAG_AVX,  32, obe_fec_xor_avx } } },
+    { "find_337m_sync", check_find_337m_sync, bench_find_337m_sync, "frame",
+      { { "c",    0, 1, obe_find_337m_sync_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 2, obe_find_337m_sync_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 4, obe_find_337m_sync_avx2 } } },
+    { "s32_to_flt", check_s32_to_flt, bench_s32_to_flt, "sample",
+      { { "c",    0, 1, obe_s32_to_flt_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 4, obe_s32_to_flt_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 8, obe_s32_to_flt_avx2 } } },
+    { "s32_to_s16", check_s32_to_s16, bench_s32_to_s16, "sample",
+      { { "c",    0, 1, obe_s32_to_s16_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_s32_to_s16_sse2 } } },
+    { "s32_to_fltp_2ch", check_s32_to_fltp_2ch, bench_s32_to_fltp_2ch, "frame",
+      { { "c",    0, 1, obe_s32_to_fltp_2ch_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 4, obe_s32_to_fltp_2ch_sse2 },
+        { "avx2", AV_CPU_FLAG_AVX2, 8, obe_s32_to_fltp_2ch_avx2 } } },
+    { "s32_to_s16p_2ch", check_s32_to_s16p_2ch, bench_s32_to_s16p_2ch, "frame",
+      { { "c",    0, 1, obe_s32_to_s16p_2ch_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 8, obe_s32_to_s16p_2ch_sse2 } } },
+    { "deinterleave_4ch_s32", check_deinterleave_4ch, bench_deinterleave_4ch, "frame",
+      { { "c",    0, 1, obe_deinterleave_4ch_s32_c },
+        { "sse2", AV_CPU_FLAG_SSE2, 4, obe_deinterleave_4ch_s32_sse2 } } },
+    { "crc32_mpeg", check_crc32_mpeg, bench_crc32_mpeg, "byte",
+      { { "c",      0, 1, obe_crc32_mpeg_c },
+        { "pclmul", AV_CPU_FLAG_SSSE3|OBE_CPU_FLAG_PCLMUL, 16, obe_crc32_mpeg_pclmul } } },
+    { 0 },
+};
+
+static int run_kernel( const checkasm_kernel_t *kernel )
+{
+    const checkasm_func_t *ref = &kernel->funcs[0];
+    int ret = 0;
+
+    printf( "%s:\n", kernel->name );
+
+    for( int i = 1; i < 6 && kernel->funcs[i].name; i++ )
+    {
+        const checkasm_func_t *func = &kernel->funcs[i];
+
+        if( (cpu_flags & func->cpu) != func->cpu )
+        {
+            printf( "    %-18s skipped\n", func->name );
+            continue;
+        }
+
+        if( kernel->check( ref, func ) < 0 )
+            ret = -1;
+        else
+            printf( "    %-18s ok\n", func->name );
+    }
+
+    if( do_bench )
+    {
+        printf( "  %s, cycles per %s:\n", kernel->name, kernel->unit );
+        for( int i = 0; i < 6 && kernel->funcs[i].name; i++ )
+        {
+            const checkasm_func_t *func = &kernel->funcs[i];
+            if( (cpu_flags & func->cpu) == func->cpu )
+                kernel->bench( func, round_width( BENCH_WIDTH, func->step ) );
+        }
+    }
+
+    return ret;
+}
+
+static void show_usage( void )
+{
+    printf( "Usage: checkasm [--bench] [seed]\n"
+            "  Checks every assembly kernel the CPU supports against the C version,\n"
+            "  --bench also prints cycles per pixel for each version\n" );
+}
+
+int main( int argc, char **argv )
+{
+    int ret = 0;
+    unsigned int seed = obe_mdate();
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( !strcmp( argv[i], "--bench" ) )
+            do_bench = 1;
+        else if( !strcmp( argv[i], "--help" ) || !strcmp( argv[i], "-h" ) )
+        {
+            show_usage();
+            return 0;
+        }
+        else
+            seed = strtoul( argv[i], NULL, 0 );
+    }
+
+    cpu_flags = obe_get_cpu_flags();
+
+    printf( "checkasm: using random seed %u\n", seed );
+    if( do_bench )
+        printf( "checkasm: cycles are timestamp counter ticks so fix the clock speed for comparable results\n" );
+    srand( seed );
+
+    for( int i = 0; i < 2; i++ )
+    {
+        if( posix_memalign( (void**)&buf_src[i], 64, BUF_SIZE ) )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return 1;
+        }
+    }
+    if( posix_memalign( (void**)&buf_ref, 64, BUF_SIZE ) || posix_memalign( (void**)&buf_out, 64, BUF_SIZE ) )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return 1;
+    }
+
+    for( int i = 0; kernels[i].name; i++ )
+        if( run_kernel( &kernels[i] ) < 0 )
+            ret = -1;
+
+    printf( ret ? "checkasm: FAILED\n" : "checkasm: all tests passed\n" );
+
+    for( int i = 0; i < 2; i++ )
+        free( buf_src[i] );
+    free( buf_ref );
+    free( buf_out );
+
+    return !!ret;
+}